@@ -26,9 +26,16 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef HAVE_GETTIMEOFDAY
+#include <sys/timeb.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
+#include "probes.h"
 
 /*********************************************************************/
 /*   low level APDU handling functions                               */
@@ -362,6 +369,133 @@ sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/*********************************************************************/
+/*   APDU statistics                                                 */
+/*********************************************************************/
+
+static unsigned long long sc_apdu_stats_time(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) != 0)
+		return 0;
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	struct _timeb time_buf;
+
+	_ftime(&time_buf);
+	return (unsigned long long) time_buf.time * 1000000 + time_buf.millitm * 1000;
+#endif
+}
+
+/* Returns the statistics entry of the APDU, or NULL if they are not collected */
+static struct sc_apdu_stats *
+sc_apdu_stats_entry(struct sc_card *card, const struct sc_apdu *apdu)
+{
+	struct sc_reader *reader = card->reader;
+
+	if (!(card->ctx->flags & SC_CTX_FLAG_APDU_STATS) || reader == NULL)
+		return NULL;
+	if (reader->apdu_stats == NULL) {
+		reader->apdu_stats = calloc(256, sizeof *reader->apdu_stats);
+		if (reader->apdu_stats == NULL)
+			return NULL;
+	}
+	return &reader->apdu_stats[apdu->ins & 0xFF];
+}
+
+static void
+sc_apdu_stats_record(struct sc_card *card, const struct sc_apdu *apdu,
+		int rv, unsigned long long start)
+{
+	struct sc_apdu_stats *stats = sc_apdu_stats_entry(card, apdu);
+	unsigned long long elapsed, end;
+	unsigned int bucket;
+
+	if (stats == NULL)
+		return;
+
+	end = sc_apdu_stats_time();
+	elapsed = end > start ? end - start : 0;
+
+	stats->count++;
+	stats->time_us += elapsed;
+	for (bucket = 0; bucket < SC_APDU_STATS_BUCKETS - 1
+			&& elapsed >= 1000ULL << bucket; bucket++)
+		;
+	stats->latency[bucket]++;
+	if (rv != SC_SUCCESS) {
+		stats->errors++;
+		return;
+	}
+	stats->bytes_out += sc_apdu_get_length(apdu, card->reader->active_protocol);
+	stats->bytes_in += apdu->resplen + 2;
+}
+
+const struct sc_apdu_stats *sc_get_apdu_stats(struct sc_reader *reader, unsigned int ins)
+{
+	if (reader == NULL || reader->apdu_stats == NULL || ins > 0xFF)
+		return NULL;
+	return &reader->apdu_stats[ins];
+}
+
+void sc_reset_apdu_stats(struct sc_reader *reader)
+{
+	if (reader != NULL && reader->apdu_stats != NULL)
+		memset(reader->apdu_stats, 0, 256 * sizeof *reader->apdu_stats);
+}
+
+void sc_apdu_stats_write(struct sc_reader *reader)
+{
+	struct sc_context *ctx = reader->ctx;
+	const struct sc_apdu_stats *stats;
+	unsigned int ins;
+	FILE *f;
+
+	if (reader->apdu_stats == NULL || ctx == NULL || ctx->apdu_stats_file == NULL)
+		return;
+	/* appended, so that the runs of several programs add up */
+	f = fopen(ctx->apdu_stats_file, "a");
+	if (f == NULL) {
+		sc_log(ctx, "Cannot write APDU statistics to %s", ctx->apdu_stats_file);
+		return;
+	}
+	for (ins = 0; ins < 256; ins++) {
+		stats = &reader->apdu_stats[ins];
+		if (stats->count == 0)
+			continue;
+		fprintf(f, "%s\t%s\t%02X\t%lu\t%lu\t%llu\t%llu\t%llu\n",
+				ctx->app_name ? ctx->app_name : "default",
+				reader->name ? reader->name : "", ins,
+				stats->count, stats->errors, stats->bytes_out,
+				stats->bytes_in, stats->time_us);
+	}
+	fclose(f);
+}
+
+
+/* The card may select a different file or security environment with
+ * these commands */
+static void
+sc_card_cache_forget(struct sc_card *card, const struct sc_apdu *apdu)
+{
+	switch (apdu->ins) {
+	case 0xA4:	/* SELECT */
+	case 0xE0:	/* CREATE FILE */
+	case 0xE4:	/* DELETE FILE */
+	case 0x70:	/* MANAGE CHANNEL */
+		card->cache.selected_path.len = 0;
+		card->cache.selected_dir.len = 0;
+		card->cache.se_valid = 0;
+		break;
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+		card->cache.se_valid = 0;
+		break;
+	}
+}
+
+
 static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
@@ -376,6 +510,7 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	       "CLA:%X, INS:%X, P1:%X, P2:%X, data(%"SC_FORMAT_LEN_SIZE_T"u) %p",
 	       apdu->cla, apdu->ins, apdu->p1, apdu->p2, apdu->datalen,
 	       apdu->data);
+	sc_card_cache_forget(card, apdu);
 #ifdef ENABLE_SM
 	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
 		   	&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0) {
@@ -384,13 +519,74 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 #endif
 
 	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, apdu);
+	SC_PROBE4(transmit__start, card, apdu->ins, apdu->lc, apdu->le);
+	if (ctx->flags & SC_CTX_FLAG_APDU_STATS) {
+		unsigned long long start = sc_apdu_stats_time();
+
+		rv = card->reader->ops->transmit(card->reader, apdu);
+		sc_apdu_stats_record(card, apdu, rv, start);
+	} else {
+		rv = card->reader->ops->transmit(card->reader, apdu);
+	}
+	SC_PROBE4(transmit__end, card, (apdu->sw1 << 8) | apdu->sw2, apdu->resplen, rv);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
 
+/* Hands count plain APDUs to the reader driver at once, see transmit_batch */
+static int
+sc_batch_transmit(struct sc_card *card, struct sc_apdu *apdus, size_t count)
+{
+	struct sc_context *ctx = card->ctx;
+	unsigned long long start = 0, share;
+	size_t i;
+	int rv;
+
+	for (i = 0; i < count; i++)
+		sc_card_cache_forget(card, &apdus[i]);
+	if (ctx->flags & SC_CTX_FLAG_APDU_STATS)
+		start = sc_apdu_stats_time();
+	rv = card->reader->ops->transmit_batch(card->reader, apdus, count);
+	if (rv <= 0 || (size_t) rv > count) {
+		sc_log(ctx, "unable to transmit APDU batch: %d", rv);
+		return rv < 0 ? rv : SC_ERROR_INTERNAL;
+	}
+
+	if (ctx->flags & SC_CTX_FLAG_APDU_STATS) {
+		/* the reader cannot tell the time of the individual APDUs */
+		share = (sc_apdu_stats_time() - start) / rv;
+		for (i = 0; i < (size_t) rv; i++)
+			sc_apdu_stats_record(card, &apdus[i], SC_SUCCESS,
+					sc_apdu_stats_time() - share);
+	}
+
+	return rv;
+}
+
+
+/* Whether the APDUs can be handed to the reader driver as a batch */
+static int
+sc_can_batch(struct sc_card *card, const struct sc_apdu *apdus, size_t count)
+{
+	size_t i;
+
+	if (count < 2 || card->reader->ops->transmit_batch == NULL)
+		return 0;
+	for (i = 0; i < count; i++) {
+		if (apdus[i].flags & SC_APDU_FLAGS_CHAINING)
+			return 0;
+#ifdef ENABLE_SM
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
+				&& (apdus[i].flags & SC_APDU_FLAGS_NO_SM) == 0)
+			return 0;
+#endif
+	}
+	return 1;
+}
+
+
 static int
 sc_set_le_and_transmit(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 {
@@ -459,17 +655,22 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 
 	do {
 		unsigned char resp[256];
+		unsigned char *rbuf;
 		size_t resp_len = le;
 
+		/* the data goes directly to the buffer of the caller if all the
+		 * data asked for fits; only a piece which has to be cut to the
+		 * end of the buffer goes through resp[] */
+		rbuf = buflen >= le ? buf : resp;
+
 		/* call GET RESPONSE to get more date from the card;
 		 * note: GET RESPONSE returns the left amount of data (== SW2) */
-		memset(resp, 0, sizeof(resp));
-		rv = card->ops->get_response(card, &resp_len, resp);
+		rv = card->ops->get_response(card, &resp_len, rbuf);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
 			if (resp_len)   {
-				sc_log_hex(ctx, "SM response data", resp, resp_len);
-				sc_sm_update_apdu_response(card, resp, resp_len, rv, apdu);
+				sc_log_hex(ctx, "SM response data", rbuf, resp_len);
+				sc_sm_update_apdu_response(card, rbuf, resp_len, rv, apdu);
 			}
 #endif
 			LOG_TEST_RET(ctx, rv, "GET RESPONSE error");
@@ -480,7 +681,8 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		if (buflen < le)
 			le = buflen;
 
-		memcpy(buf, resp, le);
+		if (rbuf == resp)
+			memcpy(buf, resp, le);
 		buf    += le;
 		buflen -= le;
 
@@ -506,6 +708,9 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 }
 
 
+static int sc_transmit_finish(sc_card_t *card, sc_apdu_t *apdu, size_t olen);
+static int sc_transmit_locked(sc_card_t *card, sc_apdu_t *apdu);
+
 /** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
  *  @param  card  sc_card_t object for the smartcard
  *  @param  apdu  APDU to be sent
@@ -523,12 +728,34 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	r = sc_single_transmit(card, apdu);
 	LOG_TEST_RET(ctx, r, "transmit APDU failed");
 
+	r = sc_transmit_finish(card, apdu, olen);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+/* Handle the status words that ask for re-transmission or GET RESPONSE after
+ * the APDU was transmitted. olen is the size of the response buffer. */
+static int
+sc_transmit_finish(sc_card_t *card, sc_apdu_t *apdu, size_t olen)
+{
+	struct sc_context *ctx  = card->ctx;
+	int          r = SC_SUCCESS;
+
+	/* "security status not satisfied": a login state read earlier is wrong */
+	if (apdu->sw1 == 0x69 && apdu->sw2 == 0x82)
+		card->auth_serial++;
+
 	/* ok, the APDU was successfully transmitted. Now we have two special cases:
 	 * 1. the card returned 0x6Cxx: in this case APDU will be re-transmitted with Le set to SW2
 	 * (possible only if response buffer size is larger than new Le = SW2)
 	 */
-	if (apdu->sw1 == 0x6C && (apdu->flags & SC_APDU_FLAGS_NO_RETRY_WL) == 0)
+	if (apdu->sw1 == 0x6C && (apdu->flags & SC_APDU_FLAGS_NO_RETRY_WL) == 0) {
+		struct sc_apdu_stats *stats = sc_apdu_stats_entry(card, apdu);
+
+		if (stats != NULL)
+			stats->retransmit++;
 		r = sc_set_le_and_transmit(card, apdu, olen);
+	}
 	LOG_TEST_RET(ctx, r, "cannot re-transmit APDU ");
 
 	/* 2. the card returned 0x61xx: more data can be read from the card
@@ -536,11 +763,16 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	 *    Unless the SC_APDU_FLAGS_NO_GET_RESP is set we try to read as
 	 *    much data as possible using GET RESPONSE.
 	 */
-	if (apdu->sw1 == 0x61 && (apdu->flags & SC_APDU_FLAGS_NO_GET_RESP) == 0)
+	if (apdu->sw1 == 0x61 && (apdu->flags & SC_APDU_FLAGS_NO_GET_RESP) == 0) {
+		struct sc_apdu_stats *stats = sc_apdu_stats_entry(card, apdu);
+
+		if (stats != NULL)
+			stats->get_response++;
 		r = sc_get_response(card, apdu, olen);
+	}
 	LOG_TEST_RET(ctx, r, "cannot get all data with 'GET RESPONSE'");
 
-	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	return SC_SUCCESS;
 }
 
 
@@ -567,6 +799,284 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		return r;
 	}
 
+	r = sc_transmit_locked(card, apdu);
+	/* all done => release lock */
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+
+	return r;
+}
+
+
+int sc_transmit_apdus(sc_card_t *card, sc_apdu_t *apdus, size_t count)
+{
+	size_t *olens = NULL;
+	size_t i, j, n;
+	int r = SC_SUCCESS, batch;
+
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* check all APDUs before anything is sent to the card */
+	for (i = 0; i < count; i++) {
+		sc_detect_apdu_cse(card, &apdus[i]);
+		if (sc_check_apdu(card, &apdus[i]) != SC_SUCCESS)
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	}
+
+	/* the reader driver can only get the plain APDUs */
+	batch = sc_can_batch(card, apdus, count);
+	if (batch) {
+		olens = malloc(count * sizeof *olens);
+		if (olens == NULL)
+			batch = 0;
+		for (i = 0; batch && i < count; i++)
+			olens[i] = apdus[i].resplen;
+	}
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		free(olens);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
+	for (i = 0; i < count; i += n) {
+		if (!batch) {
+			n = 1;
+			r = sc_transmit_locked(card, &apdus[i]);
+			if (r == SC_SUCCESS)
+				r = sc_check_sw(card, apdus[i].sw1, apdus[i].sw2);
+			if (r != SC_SUCCESS)
+				break;
+			continue;
+		}
+
+		/* The reader stops after the first APDU that did not return
+		 * 90 00 and returns the number of transmitted APDUs */
+		r = sc_batch_transmit(card, &apdus[i], count - i);
+		if (r < 0)
+			break;
+		n = r;
+		for (j = i; j < i + n; j++) {
+			r = sc_transmit_finish(card, &apdus[j], olens[j]);
+			if (r == SC_SUCCESS)
+				r = sc_check_sw(card, apdus[j].sw1, apdus[j].sw2);
+			if (r != SC_SUCCESS)
+				break;
+		}
+		if (r != SC_SUCCESS)
+			break;
+	}
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+	free(olens);
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+
+int sc_transmit_apdu_submit(sc_card_t *card, sc_apdu_t *apdu,
+		sc_apdu_callback_t callback, void *arg)
+{
+	struct sc_reader *reader;
+	int r;
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	reader = card->reader;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (card->async.apdu != NULL)
+		LOG_TEST_RET(card->ctx, SC_ERROR_NOT_ALLOWED, "another APDU is in progress");
+	if (apdu->flags & SC_APDU_FLAGS_CHAINING)
+		LOG_TEST_RET(card->ctx, SC_ERROR_NOT_SUPPORTED, "command chaining is not supported");
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
+			&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0)
+		LOG_TEST_RET(card->ctx, SC_ERROR_NOT_SUPPORTED, "secure messaging is not supported");
+#endif
+	if (reader->ops->transmit == NULL)
+		LOG_TEST_RET(card->ctx, SC_ERROR_NOT_SUPPORTED, "cannot transmit APDU");
+
+	sc_detect_apdu_cse(card, apdu);
+	if (sc_check_apdu(card, apdu) != SC_SUCCESS)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
+	sc_card_cache_forget(card, apdu);
+	card->async.apdu = apdu;
+	card->async.olen = apdu->resplen;
+	card->async.done = 0;
+	if (card->ctx->flags & SC_CTX_FLAG_APDU_STATS)
+		card->async.start = sc_apdu_stats_time();
+
+	sc_log(card->ctx,
+	       "CLA:%X, INS:%X, P1:%X, P2:%X, data(%"SC_FORMAT_LEN_SIZE_T"u) %p",
+	       apdu->cla, apdu->ins, apdu->p1, apdu->p2, apdu->datalen,
+	       apdu->data);
+
+	if (reader->ops->transmit_submit != NULL && reader->ops->transmit_wait != NULL) {
+		r = reader->ops->transmit_submit(reader, apdu, callback, arg);
+		if (r != SC_SUCCESS) {
+			card->async.apdu = NULL;
+			if (sc_unlock(card) != SC_SUCCESS)
+				sc_log(card->ctx, "sc_unlock failed");
+		}
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
+	/* the reader driver can only transmit synchronously */
+	card->async.result = reader->ops->transmit(reader, apdu);
+	card->async.done = 1;
+	if (callback != NULL)
+		callback(apdu, arg);
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
+
+int sc_transmit_apdu_complete(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r;
+
+	if (card == NULL || apdu == NULL || card->async.apdu != apdu)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (card->async.done)
+		r = card->async.result;
+	else
+		r = card->reader->ops->transmit_wait(card->reader, apdu);
+	if (card->ctx->flags & SC_CTX_FLAG_APDU_STATS)
+		sc_apdu_stats_record(card, apdu, r, card->async.start);
+
+	if (r == SC_SUCCESS)
+		r = sc_transmit_finish(card, apdu, card->async.olen);
+	else
+		sc_log(card->ctx, "unable to transmit APDU");
+
+	card->async.apdu = NULL;
+	card->async.done = 0;
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+
+/* Fills in tapdu with the chaining segment of apdu starting at buf, with
+ * len bytes left to send. Returns 1 for the last segment. */
+static int
+sc_chain_segment(const sc_apdu_t *apdu, const u8 *buf, size_t len,
+		size_t max_send_size, sc_apdu_t *tapdu)
+{
+	size_t plen;
+	int last = 0;
+
+	*tapdu = *apdu;
+	/* clear chaining flag */
+	tapdu->flags &= ~SC_APDU_FLAGS_CHAINING;
+	if (len > max_send_size) {
+		/* adjust APDU case: in case of CASE 4 APDU
+		 * the intermediate APDU are of CASE 3 */
+		if ((tapdu->cse & SC_APDU_SHORT_MASK) == SC_APDU_CASE_4_SHORT)
+			tapdu->cse--;
+		/* XXX: the chunk size must be adjusted when
+		 *      secure messaging is used */
+		plen          = max_send_size;
+		tapdu->cla    |= 0x10;
+		tapdu->le      = 0;
+		/* the intermediate APDU don't expect data */
+		tapdu->lc      = 0;
+		tapdu->resplen = 0;
+		tapdu->resp    = NULL;
+	} else {
+		plen = len;
+		last = 1;
+	}
+	tapdu->data    = buf;
+	tapdu->datalen = tapdu->lc = plen;
+
+	return last;
+}
+
+
+/* Transmit all segments of a chained APDU as one batch. Returns 1 if the
+ * APDU cannot be batched. */
+static int
+sc_transmit_chain_batch(sc_card_t *card, sc_apdu_t *apdu)
+{
+	size_t max_send_size = sc_get_max_send_size(card);
+	size_t count, i, n;
+	sc_apdu_t *segs;
+	int r = SC_SUCCESS;
+
+	if (card->reader->ops->transmit_batch == NULL || max_send_size == 0)
+		return 1;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
+			&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0)
+		return 1;
+#endif
+	count = (apdu->datalen + max_send_size - 1) / max_send_size;
+	if (count < 2)
+		return 1;
+	segs = calloc(count, sizeof *segs);
+	if (segs == NULL)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		sc_chain_segment(apdu, apdu->data + i * max_send_size,
+				apdu->datalen - i * max_send_size, max_send_size, &segs[i]);
+		r = sc_check_apdu(card, &segs[i]);
+		if (r != SC_SUCCESS) {
+			sc_log(card->ctx, "inconsistent APDU while chaining");
+			goto out;
+		}
+	}
+
+	/* the reader stops at the first segment that did not return 90 00 */
+	r = sc_batch_transmit(card, segs, count);
+	if (r < 0)
+		goto out;
+	n = r;
+	if (n < count) {
+		r = sc_check_sw(card, segs[n - 1].sw1, segs[n - 1].sw2);
+		if (r == SC_SUCCESS)
+			r = SC_ERROR_INTERNAL;
+		goto out;
+	}
+
+	r = sc_transmit_finish(card, &segs[count - 1], apdu->resplen);
+	/* set the SW1 and SW2 bytes of the last segment in the original APDU */
+	apdu->sw1 = segs[count - 1].sw1;
+	apdu->sw2 = segs[count - 1].sw2;
+	apdu->resplen = segs[count - 1].resplen;
+
+out:
+	free(segs);
+	return r;
+}
+
+
+/* Transmit a checked APDU, splitting it with command chaining if requested.
+ * The card has to be locked. */
+static int
+sc_transmit_locked(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
+
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
 		 * bytes using command chaining */
@@ -574,34 +1084,16 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		const u8  *buf = apdu->data;
 		size_t    max_send_size = sc_get_max_send_size(card);
 
+		r = sc_transmit_chain_batch(card, apdu);
+		if (r != 1)
+			return r;
+		r = SC_SUCCESS;
+
 		while (len != 0) {
-			size_t    plen;
 			sc_apdu_t tapdu;
-			int       last = 0;
-
-			tapdu = *apdu;
-			/* clear chaining flag */
-			tapdu.flags &= ~SC_APDU_FLAGS_CHAINING;
-			if (len > max_send_size) {
-				/* adjust APDU case: in case of CASE 4 APDU
-				 * the intermediate APDU are of CASE 3 */
-				if ((tapdu.cse & SC_APDU_SHORT_MASK) == SC_APDU_CASE_4_SHORT)
-					tapdu.cse--;
-				/* XXX: the chunk size must be adjusted when
-				 *      secure messaging is used */
-				plen          = max_send_size;
-				tapdu.cla    |= 0x10;
-				tapdu.le      = 0;
-				/* the intermediate APDU don't expect data */
-				tapdu.lc      = 0;
-				tapdu.resplen = 0;
-				tapdu.resp    = NULL;
-			} else {
-				plen = len;
-				last = 1;
-			}
-			tapdu.data    = buf;
-			tapdu.datalen = tapdu.lc = plen;
+			int       last;
+
+			last = sc_chain_segment(apdu, buf, len, max_send_size, &tapdu);
 
 			r = sc_check_apdu(card, &tapdu);
 			if (r != SC_SUCCESS) {
@@ -624,15 +1116,12 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 				if (r != SC_SUCCESS)
 					break;
 			}
-			len -= plen;
-			buf += plen;
+			len -= tapdu.datalen;
+			buf += tapdu.datalen;
 		}
 	} else
 		/* transmit single APDU */
 		r = sc_transmit(card, apdu);
-	/* all done => release lock */
-	if (sc_unlock(card) != SC_SUCCESS)
-		sc_log(card->ctx, "sc_unlock failed");
 
 	return r;
 }
@@ -24,6 +24,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,7 +33,8 @@
 #include "internal.h"
 #include "asn1.h"
 
-static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
+static int asn1_decode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		       struct sc_asn1_binding *bind,
 		       const u8 *in, size_t len, const u8 **newp, size_t *len_left,
 		       int choice, int depth);
 static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
@@ -353,123 +355,291 @@ static void sc_asn1_print_generalizedtime(const u8 * buf, size_t buflen)
 	sc_asn1_print_utctime(buf + 2, buflen - 2);
 }
 
-static void print_tags_recursive(const u8 * buf0, const u8 * buf,
-				 size_t buflen, size_t depth)
+/* largest header sc_asn1_read_tag() can parse: tag, length byte, 4 bytes length */
+#define WALK_MAX_HEADER	(SC_ASN1_TAGNUM_SIZE + 1 + 4)
+
+struct sc_asn1_walker {
+	sc_asn1_walk_read_t read;
+	void *read_arg;
+	u8 buf[4096];
+	size_t pos, end;
+	int eof;
+	/* bytes left in each open element, left[0] is the input itself */
+	size_t left[SC_ASN1_WALK_MAX_DEPTH + 1];
+};
+
+/* buffer up to want bytes, returns the number of bytes available */
+static size_t walk_fill(struct sc_asn1_walker *w, size_t want)
 {
 	int r;
-	size_t i;
-	size_t bytesleft = buflen;
-	const char *classes[4] = {
-		"Universal",
-		"Application",
-		"Context",
-		"Private"
-	};
-	const u8 *p = buf;
-
-	while (bytesleft >= 2) {
-		unsigned int cla = 0, tag = 0, hlen;
-		const u8 *tagp = p;
-		size_t len;
 
-		r = sc_asn1_read_tag(&tagp, bytesleft, &cla, &tag, &len);
-		if (r != SC_SUCCESS || tagp == NULL) {
-			printf("Error in decoding.\n");
-			return;
-		}
-		hlen = tagp - p;
-		if (cla == 0 && tag == 0) {
-			printf("Zero tag, finishing\n");
+	if (w->end - w->pos >= want || w->eof)
+		return w->end - w->pos;
+	memmove(w->buf, w->buf + w->pos, w->end - w->pos);
+	w->end -= w->pos;
+	w->pos = 0;
+	while (w->end < want) {
+		r = w->read(w->read_arg, w->buf + w->end, sizeof w->buf - w->end);
+		if (r <= 0) {
+			w->eof = 1;
 			break;
 		}
-		print_indent(depth);
-		/* let i be the length of the tag in bytes */
-		for (i = 1; i < sizeof tag - 1; i++) {
-			if (!(tag >> 8*i))
-				break;
-		}
-		printf("%02X", cla<<(i-1)*8 | tag);
+		w->end += r;
+	}
+	return w->end - w->pos;
+}
 
-		if ((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_UNIVERSAL) {
-			printf(" %s", tag2str(tag));
-		} else {
-			printf(" %s %-2u",
-					classes[cla >> 6],
-					i == 1 ? tag & SC_ASN1_TAG_PRIMITIVE : tag & (((unsigned int) ~0) >> (i + 1) * 8));
-		}
-		if (!((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_UNIVERSAL
-					&& tag == SC_ASN1_TAG_NULL && len == 0)) {
-			printf(" (%"SC_FORMAT_LEN_SIZE_T"u byte%s)",
-					len,
-					len != 1 ? "s" : "");
+/* take n bytes from the input, copying them to out unless it is NULL */
+static int walk_take(struct sc_asn1_walker *w, u8 *out, size_t n)
+{
+	while (n > 0) {
+		size_t chunk = walk_fill(w, n < sizeof w->buf ? n : sizeof w->buf);
+
+		if (chunk == 0)
+			return SC_ERROR_ASN1_END_OF_CONTENTS;
+		if (chunk > n)
+			chunk = n;
+		if (out) {
+			memcpy(out, w->buf + w->pos, chunk);
+			out += chunk;
 		}
+		w->pos += chunk;
+		n -= chunk;
+	}
+	return SC_SUCCESS;
+}
 
-		if (len + hlen > bytesleft) {
-			printf(" Illegal length!\n");
-			return;
-		}
-		p += hlen + len;
-		bytesleft -= hlen + len;
+int sc_asn1_walk(sc_asn1_walk_read_t read, void *read_arg, size_t len,
+		sc_asn1_walk_cb_t cb, void *cb_arg)
+{
+	struct sc_asn1_walker *w;
+	struct sc_asn1_walk_elem elem;
+	size_t level = 0;
+	int r = SC_SUCCESS;
 
-		if (cla & SC_ASN1_TAG_CONSTRUCTED) {
-			putchar('\n');
-			print_tags_recursive(buf0, tagp, len, depth + 2*i + 1);
+	if (read == NULL || cb == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	w->read = read;
+	w->read_arg = read_arg;
+	w->left[0] = len;
+
+	while (r == SC_SUCCESS) {
+		const u8 *tagp;
+		size_t avail, want, skip;
+		u8 *value = NULL;
+
+		memset(&elem, 0, sizeof elem);
+		elem.depth = level;
+
+		/* a single byte left can not hold an element and is ignored */
+		want = w->left[level] < WALK_MAX_HEADER ? w->left[level] : WALK_MAX_HEADER;
+		avail = want < 2 ? 0 : walk_fill(w, want);
+		if (avail < 2) {
+			if (level == 0)
+				break;
+			r = walk_take(w, NULL, w->left[level]);
+			if (r == SC_SUCCESS) {
+				elem.depth = --level;
+				r = cb(cb_arg, SC_ASN1_WALK_END, &elem);
+			}
 			continue;
 		}
-
-		switch (tag) {
-			case SC_ASN1_TAG_BIT_STRING:
-				printf(": ");
-				sc_asn1_print_bit_string(tagp, len, depth + 2*i + 1);
-				break;
-			case SC_ASN1_TAG_OCTET_STRING:
-				sc_asn1_print_octet_string(tagp, len, depth + 2*i + 1);
-				break;
-			case SC_ASN1_TAG_OBJECT:
-				printf(": ");
-				sc_asn1_print_object_id(tagp, len);
-				break;
-			case SC_ASN1_TAG_INTEGER:
-			case SC_ASN1_TAG_ENUMERATED:
-				printf(": ");
-				sc_asn1_print_integer(tagp, len);
-				break;
-			case SC_ASN1_TAG_IA5STRING:
-			case SC_ASN1_TAG_PRINTABLESTRING:
-			case SC_ASN1_TAG_T61STRING:
-			case SC_ASN1_TAG_UTF8STRING:
-				printf(": ");
-				sc_asn1_print_utf8string(tagp, len);
-				break;
-			case SC_ASN1_TAG_BOOLEAN:
-				printf(": ");
-				sc_asn1_print_boolean(tagp, len);
-				break;
-			case SC_ASN1_GENERALIZEDTIME:
-				printf(": ");
-				sc_asn1_print_generalizedtime(tagp, len);
+		if (avail > want)
+			avail = want;
+
+		tagp = w->buf + w->pos;
+		r = sc_asn1_read_tag(&tagp, avail, &elem.cla, &elem.tag, &elem.len);
+		if ((r == SC_SUCCESS || r == SC_ERROR_ASN1_END_OF_CONTENTS) && tagp != NULL) {
+			elem.hlen = tagp - (w->buf + w->pos);
+			r = elem.len > w->left[level] - elem.hlen
+				? SC_ERROR_INVALID_ASN1_OBJECT : SC_SUCCESS;
+		} else {
+			r = SC_ERROR_INVALID_ASN1_OBJECT;
+		}
+		skip = w->left[level];
+		if (r == SC_SUCCESS) {
+			w->pos += elem.hlen;
+			w->left[level] -= elem.hlen + elem.len;
+			skip = w->left[level];
+			if (elem.cla & SC_ASN1_TAG_CONSTRUCTED) {
+				skip += elem.len;
+				if (level == SC_ASN1_WALK_MAX_DEPTH)
+					r = SC_ERROR_INVALID_ASN1_OBJECT;
+			} else {
+				value = malloc(elem.len ? elem.len : 1);
+				if (value == NULL)
+					r = SC_ERROR_OUT_OF_MEMORY;
+				else
+					r = walk_take(w, value, elem.len);
+			}
+		}
+		if (r != SC_SUCCESS) {
+			free(value);
+			if (r == SC_ERROR_OUT_OF_MEMORY)
 				break;
-			case SC_ASN1_UTCTIME:
-				printf(": ");
-				sc_asn1_print_utctime(tagp, len);
+			/* report the error and skip the rest of the enclosing element */
+			r = cb(cb_arg, SC_ASN1_WALK_ERROR, &elem);
+			if (r != SC_SUCCESS || level == 0)
 				break;
+			r = walk_take(w, NULL, skip);
+			w->left[level] = 0;
+			continue;
 		}
 
-		if ((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_APPLICATION) {
-			print_hex(tagp, len, depth + 2*i + 1);
+		if (elem.cla & SC_ASN1_TAG_CONSTRUCTED) {
+			r = cb(cb_arg, SC_ASN1_WALK_BEGIN, &elem);
+			w->left[++level] = elem.len;
+		} else {
+			elem.value = value;
+			r = cb(cb_arg, SC_ASN1_WALK_PRIMITIVE, &elem);
+			free(value);
 		}
+	}
 
-		if ((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_CONTEXT) {
-			print_hex(tagp, len, depth + 2*i + 1);
-		}
+	free(w);
+	return r;
+}
+
+struct print_state {
+	size_t indent[SC_ASN1_WALK_MAX_DEPTH + 1];
+};
+
+static int print_tag_cb(void *arg, int event, const struct sc_asn1_walk_elem *elem)
+{
+	struct print_state *st = arg;
+	unsigned int cla = elem->cla, tag = elem->tag;
+	size_t i, len = elem->len, depth = st->indent[elem->depth];
+	const u8 *tagp = elem->value;
+	const char *classes[4] = {
+		"Universal",
+		"Application",
+		"Context",
+		"Private"
+	};
+
+	if (event == SC_ASN1_WALK_ERROR) {
+		printf("Error in decoding.\n");
+		return SC_SUCCESS;
+	}
+	if (event == SC_ASN1_WALK_END)
+		return SC_SUCCESS;
+
+	print_indent(depth);
+	/* let i be the length of the tag in bytes */
+	for (i = 1; i < sizeof tag - 1; i++) {
+		if (!(tag >> 8*i))
+			break;
+	}
+	printf("%02X", cla<<(i-1)*8 | tag);
 
+	if ((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_UNIVERSAL) {
+		printf(" %s", tag2str(tag));
+	} else {
+		printf(" %s %-2u",
+				classes[cla >> 6],
+				i == 1 ? tag & SC_ASN1_TAG_PRIMITIVE : tag & (((unsigned int) ~0) >> (i + 1) * 8));
+	}
+	if (!((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_UNIVERSAL
+				&& tag == SC_ASN1_TAG_NULL && len == 0)) {
+		printf(" (%"SC_FORMAT_LEN_SIZE_T"u byte%s)",
+				len,
+				len != 1 ? "s" : "");
+	}
+
+	depth += 2*i + 1;
+	if (event == SC_ASN1_WALK_BEGIN) {
 		putchar('\n');
+		st->indent[elem->depth + 1] = depth;
+		return SC_SUCCESS;
 	}
+
+	switch (tag) {
+		case SC_ASN1_TAG_BIT_STRING:
+			printf(": ");
+			sc_asn1_print_bit_string(tagp, len, depth);
+			break;
+		case SC_ASN1_TAG_OCTET_STRING:
+			sc_asn1_print_octet_string(tagp, len, depth);
+			break;
+		case SC_ASN1_TAG_OBJECT:
+			printf(": ");
+			sc_asn1_print_object_id(tagp, len);
+			break;
+		case SC_ASN1_TAG_INTEGER:
+		case SC_ASN1_TAG_ENUMERATED:
+			printf(": ");
+			sc_asn1_print_integer(tagp, len);
+			break;
+		case SC_ASN1_TAG_IA5STRING:
+		case SC_ASN1_TAG_PRINTABLESTRING:
+		case SC_ASN1_TAG_T61STRING:
+		case SC_ASN1_TAG_UTF8STRING:
+			printf(": ");
+			sc_asn1_print_utf8string(tagp, len);
+			break;
+		case SC_ASN1_TAG_BOOLEAN:
+			printf(": ");
+			sc_asn1_print_boolean(tagp, len);
+			break;
+		case SC_ASN1_GENERALIZEDTIME:
+			printf(": ");
+			sc_asn1_print_generalizedtime(tagp, len);
+			break;
+		case SC_ASN1_UTCTIME:
+			printf(": ");
+			sc_asn1_print_utctime(tagp, len);
+			break;
+	}
+
+	if ((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_APPLICATION) {
+		print_hex(tagp, len, depth);
+	}
+
+	if ((cla & SC_ASN1_TAG_CLASS) == SC_ASN1_TAG_CONTEXT) {
+		print_hex(tagp, len, depth);
+	}
+
+	putchar('\n');
+	return SC_SUCCESS;
+}
+
+int sc_asn1_print_tags_stream(sc_asn1_walk_read_t read, void *read_arg, size_t len)
+{
+	struct print_state st;
+
+	memset(&st, 0, sizeof st);
+	return sc_asn1_walk(read, read_arg, len, print_tag_cb, &st);
+}
+
+struct mem_reader {
+	const u8 *buf;
+	size_t left;
+};
+
+static int mem_read(void *arg, u8 *buf, size_t len)
+{
+	struct mem_reader *m = arg;
+
+	if (len > m->left)
+		len = m->left;
+	if (len > INT_MAX)
+		len = INT_MAX;
+	memcpy(buf, m->buf, len);
+	m->buf += len;
+	m->left -= len;
+	return (int) len;
 }
 
 void sc_asn1_print_tags(const u8 * buf, size_t buflen)
 {
-	print_tags_recursive(buf, buf, buflen, 0);
+	struct mem_reader m;
+
+	m.buf = buf;
+	m.left = buflen;
+	sc_asn1_print_tags_stream(mem_read, &m, buflen);
 }
 
 const u8 *sc_asn1_find_tag(sc_context_t *ctx, const u8 * buf,
@@ -510,6 +680,63 @@ const u8 *sc_asn1_find_tag(sc_context_t *ctx, const u8 * buf,
 	return NULL;
 }
 
+void sc_asn1_index_tags(sc_context_t *ctx, const u8 *buf, size_t buflen,
+	struct sc_asn1_tag_index *index)
+{
+	size_t left = buflen, taglen;
+	const u8 *p = buf;
+
+	index->count = 0;
+	index->rest = NULL;
+	index->restlen = 0;
+	while (left >= 2) {
+		unsigned int cla = 0, tag, mask = 0xff00;
+
+		if (index->count == SC_ASN1_TAG_INDEX_SIZE) {
+			index->rest = p;
+			index->restlen = left;
+			return;
+		}
+
+		buf = p;
+		/* stop where sc_asn1_find_tag() would stop */
+		if (sc_asn1_read_tag(&p, left, &cla, &tag, &taglen) != SC_SUCCESS
+				|| p == NULL)
+			return;
+
+		left -= (p - buf);
+		while ((tag & mask) != 0) {
+			cla  <<= 8;
+			mask <<= 8;
+		}
+		index->tags[index->count].tag = tag | cla;
+		index->tags[index->count].value = p;
+		index->tags[index->count].len = taglen;
+		index->count++;
+
+		left -= taglen;
+		p += taglen;
+	}
+}
+
+const u8 *sc_asn1_index_find(sc_context_t *ctx, const struct sc_asn1_tag_index *index,
+	unsigned int tag, size_t *taglen)
+{
+	size_t i;
+
+	for (i = 0; i < index->count; i++) {
+		if (index->tags[i].tag == tag) {
+			*taglen = index->tags[i].len;
+			return index->tags[i].value;
+		}
+	}
+	if (index->rest != NULL)
+		return sc_asn1_find_tag(ctx, index->rest, index->restlen, tag, taglen);
+
+	*taglen = 0;
+	return NULL;
+}
+
 const u8 *sc_asn1_skip_tag(sc_context_t *ctx, const u8 ** buf, size_t *buflen,
 			   unsigned int tag_in, size_t *taglen_out)
 {
@@ -955,11 +1182,14 @@ int sc_asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	return asn1_write_element(ctx, tag, data, datalen, out, outlen);
 }
 
-static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
-	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+/* Writes the tag and length of an element with datalen bytes of contents
+ * to out, which may be NULL to only get the number of bytes needed.
+ * Returns that number or an error code. */
+static int asn1_write_header(sc_context_t *ctx, unsigned int tag,
+	size_t datalen, u8 *out)
 {
 	unsigned char t;
-	unsigned char *buf, *p;
+	unsigned char *p = out;
 	int c = 0;
 	unsigned short_tag;
 	unsigned char tag_char[3] = {0, 0, 0};
@@ -983,6 +1213,14 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 			SC_TEST_RET(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_INVALID_DATA, "MS bit of the last byte expected to be 'zero'");
 	}
 
+	if (datalen > 127) {
+		c = 1;
+		while (datalen >> (c << 3))
+			c++;
+	}
+	if (out == NULL)
+		return (int) (tag_len + 1 + c);
+
 	t = tag_char[tag_len - 1] & 0x1F;
 
 	switch (tag & SC_ASN1_CLASS_MASK) {
@@ -1000,18 +1238,7 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	}
 	if (tag & SC_ASN1_CONS)
 		t |= SC_ASN1_TAG_CONSTRUCTED;
-	if (datalen > 127) {
-		c = 1;
-		while (datalen >> (c << 3))
-			c++;
-	}
-
-	*outlen = tag_len + 1 + c + datalen;
-	buf = malloc(*outlen);
-	if (buf == NULL)
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
 
-	*out = p = buf;
 	*p++ = t;
 	for (ii=1;ii<tag_len;ii++)
 		*p++ = tag_char[tag_len - ii - 1];
@@ -1024,7 +1251,29 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	else   {
 		*p++ = datalen & 0x7F;
 	}
-	memcpy(p, data, datalen);
+
+	return (int) (p - out);
+}
+
+static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
+	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+{
+	unsigned char *buf;
+	int r;
+
+	r = asn1_write_header(ctx, tag, datalen, NULL);
+	if (r < 0)
+		return r;
+
+	*outlen = r + datalen;
+	buf = malloc(*outlen);
+	if (buf == NULL)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
+
+	*out = buf;
+	asn1_write_header(ctx, tag, datalen, buf);
+	if (datalen)
+		memcpy(buf + r, data, datalen);
 
 	return SC_SUCCESS;
 }
@@ -1051,24 +1300,22 @@ static int asn1_decode_path(sc_context_t *ctx, const u8 *in, size_t len,
 			    sc_path_t *path, int depth)
 {
 	int idx, count, r;
-	struct sc_asn1_entry asn1_path_ext[3], asn1_path[5];
 	unsigned char path_value[SC_MAX_PATH_SIZE], aid_value[SC_MAX_AID_SIZE];
 	size_t path_len = sizeof(path_value), aid_len = sizeof(aid_value);
+	struct sc_asn1_binding asn1_path_ext[2] = {
+		{ aid_value, &aid_len, NULL, NULL, 0 },
+		{ path_value, &path_len, NULL, NULL, 0 },
+	};
+	struct sc_asn1_binding asn1_path[4] = {
+		{ path_value, &path_len, NULL, NULL, 0 },
+		{ &idx, NULL, NULL, NULL, 0 },
+		{ &count, NULL, NULL, NULL, 0 },
+		{ NULL, NULL, c_asn1_path_ext, asn1_path_ext, 0 },
+	};
 
 	memset(path, 0, sizeof(struct sc_path));
 
-	sc_copy_asn1_entry(c_asn1_path_ext, asn1_path_ext);
-	sc_copy_asn1_entry(c_asn1_path, asn1_path);
-
-	sc_format_asn1_entry(asn1_path_ext + 0, aid_value, &aid_len, 0);
-	sc_format_asn1_entry(asn1_path_ext + 1, path_value, &path_len, 0);
-
-	sc_format_asn1_entry(asn1_path + 0, path_value, &path_len, 0);
-	sc_format_asn1_entry(asn1_path + 1, &idx, NULL, 0);
-	sc_format_asn1_entry(asn1_path + 2, &count, NULL, 0);
-	sc_format_asn1_entry(asn1_path + 3, asn1_path_ext, NULL, 0);
-
-	r = asn1_decode(ctx, asn1_path, in, len, NULL, NULL, 0, depth + 1);
+	r = asn1_decode(ctx, c_asn1_path, asn1_path, in, len, NULL, NULL, 0, depth + 1);
 	if (r)
 		return r;
 
@@ -1167,7 +1414,7 @@ static int asn1_decode_se_info(sc_context_t *ctx, const u8 *obj, size_t objlen,
 		sc_format_asn1_entry(asn1_se_info + 2, &si.aid.value, &si.aid.len, 0);
 		sc_format_asn1_entry(asn1_se + 0, asn1_se_info, NULL, 0);
 
-		ret = asn1_decode(ctx, asn1_se, ptr, ptrlen, &ptr, &ptrlen, 0, depth+1);
+		ret = asn1_decode(ctx, asn1_se, NULL, ptr, ptrlen, &ptr, &ptrlen, 0, depth+1);
 		if (ret != SC_SUCCESS)
 			goto err;
 		if (!(asn1_se_info[1].flags & SC_ASN1_PRESENT))
@@ -1292,38 +1539,53 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 				  int depth)
 {
 	struct sc_pkcs15_object *p15_obj = obj->p15_obj;
-	struct sc_asn1_entry asn1_c_attr[6], asn1_p15_obj[5];
-	struct sc_asn1_entry asn1_ac_rules[SC_PKCS15_MAX_ACCESS_RULES + 1], asn1_ac_rule[SC_PKCS15_MAX_ACCESS_RULES][3];
+	struct sc_asn1_binding asn1_c_attr[5], asn1_p15_obj[4];
+	struct sc_asn1_binding asn1_ac_rules[SC_PKCS15_MAX_ACCESS_RULES], asn1_ac_rule[SC_PKCS15_MAX_ACCESS_RULES][2];
 	size_t flags_len = sizeof(p15_obj->flags);
 	size_t label_len = sizeof(p15_obj->label);
 	size_t access_mode_len = sizeof(p15_obj->access_rules[0].access_mode);
 	int r, ii;
 
-	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)
-		sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule[ii]);
-	sc_copy_asn1_entry(c_asn1_access_control_rules, asn1_ac_rules);
+	memset(asn1_c_attr, 0, sizeof(asn1_c_attr));
+	memset(asn1_p15_obj, 0, sizeof(asn1_p15_obj));
+	memset(asn1_ac_rules, 0, sizeof(asn1_ac_rules));
+	memset(asn1_ac_rule, 0, sizeof(asn1_ac_rule));
 
-
-	sc_copy_asn1_entry(c_asn1_com_obj_attr, asn1_c_attr);
-	sc_copy_asn1_entry(c_asn1_p15_obj, asn1_p15_obj);
-	sc_format_asn1_entry(asn1_c_attr + 0, p15_obj->label, &label_len, 0);
-	sc_format_asn1_entry(asn1_c_attr + 1, &p15_obj->flags, &flags_len, 0);
-	sc_format_asn1_entry(asn1_c_attr + 2, &p15_obj->auth_id, NULL, 0);
-	sc_format_asn1_entry(asn1_c_attr + 3, &p15_obj->user_consent, NULL, 0);
+	asn1_c_attr[0].parm = p15_obj->label;
+	asn1_c_attr[0].arg = &label_len;
+	asn1_c_attr[1].parm = &p15_obj->flags;
+	asn1_c_attr[1].arg = &flags_len;
+	asn1_c_attr[2].parm = &p15_obj->auth_id;
+	asn1_c_attr[3].parm = &p15_obj->user_consent;
 
 	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)   {
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 0, &p15_obj->access_rules[ii].access_mode, &access_mode_len, 0);
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 1, &p15_obj->access_rules[ii].auth_id, NULL, 0);
-		sc_format_asn1_entry(asn1_ac_rules + ii, asn1_ac_rule[ii], NULL, 0);
-	}
-	sc_format_asn1_entry(asn1_c_attr + 4, asn1_ac_rules, NULL, 0);
-
-	sc_format_asn1_entry(asn1_p15_obj + 0, asn1_c_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_p15_obj + 1, obj->asn1_class_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_p15_obj + 2, obj->asn1_subclass_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_p15_obj + 3, obj->asn1_type_attr, NULL, 0);
+		asn1_ac_rule[ii][0].parm = &p15_obj->access_rules[ii].access_mode;
+		asn1_ac_rule[ii][0].arg = &access_mode_len;
+		asn1_ac_rule[ii][1].parm = &p15_obj->access_rules[ii].auth_id;
+		asn1_ac_rules[ii].asn1 = c_asn1_access_control_rule;
+		asn1_ac_rules[ii].bind = asn1_ac_rule[ii];
+	}
+	asn1_c_attr[4].asn1 = c_asn1_access_control_rules;
+	asn1_c_attr[4].bind = asn1_ac_rules;
+
+	asn1_p15_obj[0].asn1 = c_asn1_com_obj_attr;
+	asn1_p15_obj[0].bind = asn1_c_attr;
+	/* the attributes of the class are given as templates with bindings
+	 * or as entries of the caller */
+	if (obj->bind_class_attr != NULL)
+		asn1_p15_obj[1] = *obj->bind_class_attr;
+	else
+		asn1_p15_obj[1].parm = obj->asn1_class_attr;
+	if (obj->bind_subclass_attr != NULL)
+		asn1_p15_obj[2] = *obj->bind_subclass_attr;
+	else
+		asn1_p15_obj[2].parm = obj->asn1_subclass_attr;
+	if (obj->bind_type_attr != NULL)
+		asn1_p15_obj[3] = *obj->bind_type_attr;
+	else
+		asn1_p15_obj[3].parm = obj->asn1_type_attr;
 
-	r = asn1_decode(ctx, asn1_p15_obj, in, len, NULL, NULL, 0, depth + 1);
+	r = asn1_decode(ctx, c_asn1_p15_obj, asn1_p15_obj, in, len, NULL, NULL, 0, depth + 1);
 	return r;
 }
 
@@ -1383,13 +1645,18 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 	return r;
 }
 
-static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
+/* Without bindings, the output is taken from and the SC_ASN1_PRESENT flag
+ * is set in the entry itself, which then belongs to the caller */
+static int asn1_decode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entry,
+			     struct sc_asn1_binding *bind,
 			     const u8 *obj, size_t objlen, int depth)
 {
-	void *parm = entry->parm;
+	void *parm = bind ? bind->parm : entry->parm;
+	void *arg = bind ? bind->arg : entry->arg;
+	unsigned int flags = bind ? entry->flags | bind->flags : entry->flags;
 	int (*callback_func)(sc_context_t *nctx, void *arg, const u8 *nobj,
 			     size_t nobjlen, int ndepth);
-	size_t *len = (size_t *) entry->arg;
+	size_t *len = (size_t *) arg;
 	int r = 0;
 
 	callback_func = parm;
@@ -1401,8 +1668,11 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		if (parm != NULL)
-			r = asn1_decode(ctx, (struct sc_asn1_entry *) parm, obj,
+		if (bind != NULL && bind->asn1 != NULL)
+			r = asn1_decode(ctx, bind->asn1, bind->bind, obj,
+				       objlen, NULL, NULL, 0, depth + 1);
+		else if (parm != NULL)
+			r = asn1_decode(ctx, (struct sc_asn1_entry *) parm, NULL, obj,
 				       objlen, NULL, NULL, 0, depth + 1);
 		break;
 	case SC_ASN1_NULL:
@@ -1421,9 +1691,9 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 	case SC_ASN1_INTEGER:
 	case SC_ASN1_ENUMERATED:
 		if (parm != NULL) {
-			r = sc_asn1_decode_integer(obj, objlen, (int *) entry->parm);
+			r = sc_asn1_decode_integer(obj, objlen, (int *) parm);
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sdecoding '%s' returned %d\n", depth, depth, "",
-					entry->name, *((int *) entry->parm));
+					entry->name, *((int *) parm));
 		}
 		break;
 	case SC_ASN1_BIT_STRING_NI:
@@ -1435,7 +1705,7 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 				r = SC_ERROR_INVALID_ASN1_OBJECT;
 				break;
 			}
-			if (entry->flags & SC_ASN1_ALLOC) {
+			if (flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
 				*buf = malloc(objlen-1);
 				if (*buf == NULL) {
@@ -1462,14 +1732,19 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 			assert(len != NULL);
 
 			/* Strip off padding zero */
-			if ((entry->flags & SC_ASN1_UNSIGNED)
+			if ((flags & SC_ASN1_UNSIGNED)
 			 && obj[0] == 0x00 && objlen > 1) {
 				objlen--;
 				obj++;
 			}
 
-			/* Allocate buffer if needed */
-			if (entry->flags & SC_ASN1_ALLOC) {
+			/* Borrow or allocate buffer if needed */
+			if ((flags & SC_ASN1_ALLOC) && (flags & SC_ASN1_BORROW)) {
+				*((const u8 **) parm) = obj;
+				*len = objlen;
+				break;
+			}
+			if (flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
 				*buf = malloc(objlen);
 				if (*buf == NULL) {
@@ -1489,7 +1764,7 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 		if (parm != NULL) {
 			size_t c;
 			assert(len != NULL);
-			if (entry->flags & SC_ASN1_ALLOC) {
+			if (flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
 				*buf = malloc(objlen);
 				if (*buf == NULL) {
@@ -1513,7 +1788,7 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 	case SC_ASN1_UTF8STRING:
 		if (parm != NULL) {
 			assert(len != NULL);
-			if (entry->flags & SC_ASN1_ALLOC) {
+			if (flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
 				*buf = malloc(objlen+1);
 				if (*buf == NULL) {
@@ -1524,17 +1799,17 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 				parm = *buf;
 			}
 			r = sc_asn1_decode_utf8string(obj, objlen, (u8 *) parm, len);
-			if (entry->flags & SC_ASN1_ALLOC) {
+			if (flags & SC_ASN1_ALLOC) {
 				*len -= 1;
 			}
 		}
 		break;
 	case SC_ASN1_PATH:
-		if (entry->parm != NULL)
+		if (parm != NULL)
 			r = asn1_decode_path(ctx, obj, objlen, (sc_path_t *) parm, depth);
 		break;
 	case SC_ASN1_PKCS15_ID:
-		if (entry->parm != NULL) {
+		if (parm != NULL) {
 			struct sc_pkcs15_id *id = (struct sc_pkcs15_id *) parm;
 			size_t c = objlen > sizeof(id->value) ? sizeof(id->value) : objlen;
 
@@ -1543,20 +1818,20 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 		}
 		break;
 	case SC_ASN1_PKCS15_OBJECT:
-		if (entry->parm != NULL)
+		if (parm != NULL)
 			r = asn1_decode_p15_object(ctx, obj, objlen, (struct sc_asn1_pkcs15_object *) parm, depth);
 		break;
 	case SC_ASN1_ALGORITHM_ID:
-		if (entry->parm != NULL)
+		if (parm != NULL)
 			r = sc_asn1_decode_algorithm_id(ctx, obj, objlen, (struct sc_algorithm_id *) parm, depth);
 		break;
 	case SC_ASN1_SE_INFO:
-		if (entry->parm != NULL)
-			r = asn1_decode_se_info(ctx, obj, objlen, (sc_pkcs15_sec_env_info_t ***)entry->parm, len, depth);
+		if (parm != NULL)
+			r = asn1_decode_se_info(ctx, obj, objlen, (sc_pkcs15_sec_env_info_t ***) parm, len, depth);
 		break;
 	case SC_ASN1_CALLBACK:
-		if (entry->parm != NULL)
-			r = callback_func(ctx, entry->arg, obj, objlen, depth);
+		if (parm != NULL)
+			r = callback_func(ctx, arg, obj, objlen, depth);
 		break;
 	default:
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "invalid ASN.1 type: %d\n", entry->type);
@@ -1567,17 +1842,21 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 		      sc_strerror(r));
 		return r;
 	}
-	entry->flags |= SC_ASN1_PRESENT;
+	if (bind != NULL)
+		bind->flags |= SC_ASN1_PRESENT;
+	else
+		((struct sc_asn1_entry *) entry)->flags |= SC_ASN1_PRESENT;
 	return 0;
 }
 
-static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
+static int asn1_decode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		       struct sc_asn1_binding *bind,
 		       const u8 *in, size_t len, const u8 **newp, size_t *len_left,
 		       int choice, int depth)
 {
 	int r, idx = 0;
 	const u8 *p = in, *obj;
-	struct sc_asn1_entry *entry = asn1;
+	const struct sc_asn1_entry *entry = asn1;
 	size_t left = len, objlen;
 
 	sc_debug(ctx, SC_LOG_DEBUG_ASN1,
@@ -1610,9 +1889,13 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 
 		/* Special case CHOICE has no tag */
 		if (entry->type == SC_ASN1_CHOICE) {
-			r = asn1_decode(ctx,
-				(struct sc_asn1_entry *) entry->parm,
-				p, left, &p, &left, 1, depth + 1);
+			if (bind != NULL && bind[idx].asn1 != NULL)
+				r = asn1_decode(ctx, bind[idx].asn1, bind[idx].bind,
+					p, left, &p, &left, 1, depth + 1);
+			else
+				r = asn1_decode(ctx,
+					(struct sc_asn1_entry *) (bind ? bind[idx].parm : entry->parm),
+					NULL, p, left, &p, &left, 1, depth + 1);
 			if (r >= 0)
 				r = 0;
 			goto decode_ok;
@@ -1639,7 +1922,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			}
 			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_ASN1_OBJECT_NOT_FOUND);
 		}
-		r = asn1_decode_entry(ctx, entry, obj, objlen, depth);
+		r = asn1_decode_entry(ctx, entry, bind ? &bind[idx] : NULL, obj, objlen, depth);
 
 decode_ok:
 		if (r)
@@ -1661,17 +1944,78 @@ decode_ok:
 int sc_asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		   const u8 *in, size_t len, const u8 **newp, size_t *len_left)
 {
-	return asn1_decode(ctx, asn1, in, len, newp, len_left, 0, 0);
+	return asn1_decode(ctx, asn1, NULL, in, len, newp, len_left, 0, 0);
 }
 
 int sc_asn1_decode_choice(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			  const u8 *in, size_t len, const u8 **newp, size_t *len_left)
 {
-	return asn1_decode(ctx, asn1, in, len, newp, len_left, 1, 0);
+	return asn1_decode(ctx, asn1, NULL, in, len, newp, len_left, 1, 0);
+}
+
+int sc_asn1_decode_template(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+			    struct sc_asn1_binding *bind,
+			    const u8 *in, size_t len, const u8 **newp, size_t *len_left)
+{
+	return asn1_decode(ctx, asn1, bind, in, len, newp, len_left, 0, 0);
 }
 
+int sc_asn1_decode_template_choice(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+				   struct sc_asn1_binding *bind,
+				   const u8 *in, size_t len, const u8 **newp, size_t *len_left)
+{
+	return asn1_decode(ctx, asn1, bind, in, len, newp, len_left, 1, 0);
+}
+
+/* An encoding in progress. The first pass collects the tag and length of
+ * every element, with the contents of the primitive ones, so that the
+ * second pass can write it into one buffer of the final size. */
+struct asn1_piece {
+	unsigned int tag;
+	size_t len;	/* length of the contents or of data */
+	u8 *data;	/* contents of a primitive element, NULL for a header */
+};
+
+struct asn1_pieces {
+	struct asn1_piece *list;
+	size_t count;
+	size_t size;
+};
+
+static int asn1_pieces_add(struct asn1_pieces *pieces, unsigned int tag,
+			   u8 *data, size_t len)
+{
+	struct asn1_piece *piece;
+
+	if (pieces->count == pieces->size) {
+		size_t size = pieces->size ? 2 * pieces->size : 16;
+
+		piece = realloc(pieces->list, size * sizeof *piece);
+		if (piece == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		pieces->list = piece;
+		pieces->size = size;
+	}
+	piece = &pieces->list[pieces->count++];
+	piece->tag = tag;
+	piece->len = len;
+	piece->data = data;
+	return SC_SUCCESS;
+}
+
+/* Drops the pieces from index start on */
+static void asn1_pieces_truncate(struct asn1_pieces *pieces, size_t start)
+{
+	while (pieces->count > start)
+		free(pieces->list[--pieces->count].data);
+}
+
+static int asn1_encode_pieces(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+			      struct asn1_pieces *pieces, size_t *size, int depth);
+
+/* Adds the pieces of the entry and returns its encoded length in objlen */
 static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entry,
-			     u8 **obj, size_t *objlen, int depth)
+			     struct asn1_pieces *pieces, size_t *objlen, int depth)
 {
 	void *parm = entry->parm;
 	int (*callback_func)(sc_context_t *nctx, void *arg, u8 **nobj,
@@ -1680,6 +2024,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	int r = 0;
 	u8 * buf = NULL;
 	size_t buflen = 0;
+	size_t start = pieces->count;
 
 	callback_func = parm;
 
@@ -1715,7 +2060,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		}
 		if (choice == NULL)
 			goto no_object;
-		return asn1_encode_entry(ctx, choice, obj, objlen, depth + 1);
+		return asn1_encode_entry(ctx, choice, pieces, objlen, depth + 1);
 	}
 
 	if (entry->type != SC_ASN1_NULL && parm == NULL) {
@@ -1723,10 +2068,16 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		return SC_ERROR_INVALID_ASN1_OBJECT;
 	}
 
+	/* the header, its length is set below */
+	r = asn1_pieces_add(pieces, entry->tag, NULL, 0);
+	if (r)
+		return r;
+
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		r = asn1_encode(ctx, (const struct sc_asn1_entry *) parm, &buf,
-				&buflen, depth + 1);
+		/* the members are written directly after the header */
+		r = asn1_encode_pieces(ctx, (const struct sc_asn1_entry *) parm,
+				pieces, &buflen, depth + 1);
 		break;
 	case SC_ASN1_NULL:
 		buf = NULL;
@@ -1835,11 +2186,17 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "invalid ASN.1 type: %d\n", entry->type);
 		return SC_ERROR_INVALID_ASN1_OBJECT;
 	}
+	if (r == 0 && buflen && entry->type != SC_ASN1_STRUCT) {
+		r = asn1_pieces_add(pieces, 0, buf, buflen);
+		if (r == 0)
+			buf = NULL;
+	}
+	free(buf);
+	buf = NULL;
 	if (r) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encoding of ASN.1 object '%s' failed: %s\n", entry->name,
 		      sc_strerror(r));
-		if (buf)
-			free(buf);
+		asn1_pieces_truncate(pieces, start);
 		return r;
 	}
 
@@ -1854,32 +2211,36 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	 *  -	any other empty objects are considered bogus
 	 */
 no_object:
+	*objlen = 0;
 	if (!buflen && entry->flags & SC_ASN1_OPTIONAL && !(entry->flags & SC_ASN1_PRESENT)) {
 		/* This happens when we try to encode e.g. the
 		 * subClassAttributes, which may be empty */
-		*obj = NULL;
-		*objlen = 0;
+		asn1_pieces_truncate(pieces, start);
 		r = 0;
-	} else if (!buflen && (entry->flags & SC_ASN1_EMPTY_ALLOWED)) {
-		*obj = NULL;
-		*objlen = 0;
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
-		if (r)
-			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n", sc_strerror(r));
-	} else if (buflen || entry->type == SC_ASN1_NULL || entry->tag & SC_ASN1_CONS) {
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
-		if (r)
+	} else if (buflen || (entry->flags & SC_ASN1_EMPTY_ALLOWED)
+			|| entry->type == SC_ASN1_NULL || entry->tag & SC_ASN1_CONS) {
+		if (pieces->count == start)
+			r = asn1_pieces_add(pieces, entry->tag, NULL, 0);
+		if (r == 0)
+			r = asn1_write_header(ctx, entry->tag, buflen, NULL);
+		if (r < 0) {
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n",
 					sc_strerror(r));
+			asn1_pieces_truncate(pieces, start);
+		} else {
+			pieces->list[start].len = buflen;
+			*objlen = r + buflen;
+			r = 0;
+		}
 	} else if (!(entry->flags & SC_ASN1_PRESENT)) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode non-optional ASN.1 object: not given by caller\n");
+		asn1_pieces_truncate(pieces, start);
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
 	} else {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode empty non-optional ASN.1 object\n");
+		asn1_pieces_truncate(pieces, start);
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
 	}
-	if (buf)
-		free(buf);
 	if (r >= 0)
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1,
 			 "%*.*slength of encoded item=%"SC_FORMAT_LEN_SIZE_T"u\n",
@@ -1887,40 +2248,54 @@ no_object:
 	return r;
 }
 
-static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
-		      u8 **ptr, size_t *size, int depth)
+static int asn1_encode_pieces(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+			      struct asn1_pieces *pieces, size_t *size, int depth)
 {
-	int r, idx = 0;
-	u8 *obj = NULL, *buf = NULL, *tmp;
+	int r, idx;
 	size_t total = 0, objsize;
 
 	for (idx = 0; asn1[idx].name != NULL; idx++) {
-		r = asn1_encode_entry(ctx, &asn1[idx], &obj, &objsize, depth);
-		if (r) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
+		r = asn1_encode_entry(ctx, &asn1[idx], pieces, &objsize, depth);
+		if (r)
 			return r;
-		}
-		/* in case of an empty (optional) element continue with
-		 * the next asn1 element */
-		if (!objsize)
-			continue;
-		tmp = (u8 *) realloc(buf, total + objsize);
-		if (!tmp) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
-		}
-		buf = tmp;
-		memcpy(buf + total, obj, objsize);
-		free(obj);
-		obj = NULL;
 		total += objsize;
 	}
+	*size = total;
+	return 0;
+}
+
+static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		      u8 **ptr, size_t *size, int depth)
+{
+	struct asn1_pieces pieces = { NULL, 0, 0 };
+	u8 *buf = NULL, *p;
+	size_t total = 0, idx;
+	int r;
+
+	/* first pass: lengths and contents of the primitive elements */
+	r = asn1_encode_pieces(ctx, asn1, &pieces, &total, depth);
+	if (r == 0 && total) {
+		buf = malloc(total);
+		if (buf == NULL)
+			r = SC_ERROR_OUT_OF_MEMORY;
+	}
+	/* second pass: write everything */
+	for (idx = 0, p = buf; r == 0 && idx < pieces.count; idx++) {
+		struct asn1_piece *piece = &pieces.list[idx];
+
+		if (piece->data == NULL) {
+			p += asn1_write_header(ctx, piece->tag, piece->len, p);
+		} else {
+			memcpy(p, piece->data, piece->len);
+			p += piece->len;
+		}
+	}
+	asn1_pieces_truncate(&pieces, 0);
+	free(pieces.list);
+	if (r) {
+		free(buf);
+		return r;
+	}
 	*ptr = buf;
 	*size = total;
 	return 0;
@@ -1943,7 +2318,7 @@ _sc_asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		       const u8 *in, size_t len, const u8 **newp, size_t *left,
 		       int choice, int depth)
 {
-	return asn1_decode(ctx, asn1, in, len, newp, left, choice, depth);
+	return asn1_decode(ctx, asn1, NULL, in, len, newp, left, choice, depth);
 }
 
 int
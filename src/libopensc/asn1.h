@@ -37,11 +37,28 @@ struct sc_asn1_entry {
 	void *arg;
 };
 
+/* Output of an entry of a const template, see sc_asn1_decode_template() */
+struct sc_asn1_binding {
+	void *parm;
+	void *arg;
+	/* SC_ASN1_STRUCT and SC_ASN1_CHOICE: template and bindings of the
+	 * members; without them, parm points to entries as with sc_asn1_decode() */
+	const struct sc_asn1_entry *asn1;
+	struct sc_asn1_binding *bind;
+	/* added to the flags of the template, SC_ASN1_PRESENT is set when
+	 * the entry was decoded */
+	unsigned int flags;
+};
+
 struct sc_asn1_pkcs15_object {
 	struct sc_pkcs15_object *p15_obj;
 	struct sc_asn1_entry *asn1_class_attr;
 	struct sc_asn1_entry *asn1_subclass_attr;
 	struct sc_asn1_entry *asn1_type_attr;
+	/* when decoding, used instead of the entries above if set */
+	struct sc_asn1_binding *bind_class_attr;
+	struct sc_asn1_binding *bind_subclass_attr;
+	struct sc_asn1_binding *bind_type_attr;
 };
 
 struct sc_asn1_pkcs15_algorithm_info {
@@ -64,6 +81,16 @@ int sc_asn1_decode(struct sc_context *ctx, struct sc_asn1_entry *asn1,
 		   const u8 *in, size_t len, const u8 **newp, size_t *left);
 int sc_asn1_decode_choice(struct sc_context *ctx, struct sc_asn1_entry *asn1,
 		   const u8 *in, size_t len, const u8 **newp, size_t *left);
+/* Like sc_asn1_decode(), with the output of asn1[i] given by bind[i]
+ * instead of asn1[i] itself, so that a static template can be used without
+ * copying it. The bindings have to be initialized to zero apart from the
+ * output. */
+int sc_asn1_decode_template(struct sc_context *ctx, const struct sc_asn1_entry *asn1,
+		   struct sc_asn1_binding *bind,
+		   const u8 *in, size_t len, const u8 **newp, size_t *left);
+int sc_asn1_decode_template_choice(struct sc_context *ctx, const struct sc_asn1_entry *asn1,
+		   struct sc_asn1_binding *bind,
+		   const u8 *in, size_t len, const u8 **newp, size_t *left);
 int sc_asn1_encode(struct sc_context *ctx, const struct sc_asn1_entry *asn1,
 		   u8 **buf, size_t *bufsize);
 int _sc_asn1_decode(struct sc_context *, struct sc_asn1_entry *,
@@ -81,6 +108,27 @@ const u8 *sc_asn1_verify_tag(struct sc_context *ctx, const u8 * buf,
 const u8 *sc_asn1_skip_tag(struct sc_context *ctx, const u8 ** buf,
 			   size_t *buflen, unsigned int tag, size_t *taglen);
 
+/* Index of the tags at one level of a buffer, built in one pass.
+ * sc_asn1_index_find() returns the same as sc_asn1_find_tag() on the
+ * indexed buffer; tags past the first SC_ASN1_TAG_INDEX_SIZE ones are
+ * searched for in the rest of the buffer. */
+#define SC_ASN1_TAG_INDEX_SIZE	16
+struct sc_asn1_tag_index {
+	struct {
+		unsigned int tag;
+		const u8 *value;
+		size_t len;
+	} tags[SC_ASN1_TAG_INDEX_SIZE];
+	size_t count;
+	const u8 *rest;
+	size_t restlen;
+};
+
+void sc_asn1_index_tags(struct sc_context *ctx, const u8 *buf, size_t buflen,
+			struct sc_asn1_tag_index *index);
+const u8 *sc_asn1_index_find(struct sc_context *ctx, const struct sc_asn1_tag_index *index,
+			     unsigned int tag, size_t *taglen);
+
 /* DER encoding */
 
 /* Argument 'ptr' is set to the location of the next possible ASN.1 object.
@@ -89,8 +137,43 @@ const u8 *sc_asn1_skip_tag(struct sc_context *ctx, const u8 ** buf,
  * If data is NULL, the data field will not be written. This is helpful for constructed structures. */
 int sc_asn1_put_tag(unsigned int tag, const u8 * data, size_t datalen, u8 * out, size_t outlen, u8 ** ptr);
 
+/* Iterative DER walker
+ *
+ * The input is pulled through 'read', which returns the number of bytes
+ * stored in 'buf', 0 at the end of input or a negative value on error.
+ * 'len' is the length of the input, or SIZE_MAX if it is not known;
+ * then an element that is cut short is only noticed when it is read.
+ * 'cb' is called for every element in order: SC_ASN1_WALK_BEGIN and
+ * SC_ASN1_WALK_END bracket the contents of a constructed element,
+ * SC_ASN1_WALK_PRIMITIVE passes a primitive element with its value.
+ * On SC_ASN1_WALK_ERROR the rest of the enclosing element is skipped.
+ * Only the value of the current primitive element is held in memory.
+ * A non-zero return value of 'cb' stops the walk and is returned. */
+#define SC_ASN1_WALK_PRIMITIVE	0
+#define SC_ASN1_WALK_BEGIN	1
+#define SC_ASN1_WALK_END	2
+#define SC_ASN1_WALK_ERROR	3
+
+#define SC_ASN1_WALK_MAX_DEPTH	64
+
+struct sc_asn1_walk_elem {
+	size_t depth;		/* nesting level, 0 for top level elements */
+	unsigned int cla, tag;
+	size_t hlen;		/* length of tag and length octets */
+	size_t len;		/* length of the contents */
+	const u8 *value;	/* contents of a primitive element */
+};
+
+typedef int (*sc_asn1_walk_read_t)(void *arg, u8 *buf, size_t len);
+typedef int (*sc_asn1_walk_cb_t)(void *arg, int event,
+		const struct sc_asn1_walk_elem *elem);
+
+int sc_asn1_walk(sc_asn1_walk_read_t read, void *read_arg, size_t len,
+		sc_asn1_walk_cb_t cb, void *cb_arg);
+
 /* ASN.1 printing functions */
 void sc_asn1_print_tags(const u8 * buf, size_t buflen);
+int sc_asn1_print_tags_stream(sc_asn1_walk_read_t read, void *read_arg, size_t len);
 
 /* ASN.1 object decoding functions */
 int sc_asn1_utf8string_to_ascii(const u8 * buf, size_t buflen,
@@ -142,6 +225,9 @@ int sc_asn1_sig_value_sequence_to_rs(struct sc_context *ctx,
 #define SC_ASN1_ALLOC			0x00000004
 #define SC_ASN1_UNSIGNED		0x00000008
 #define SC_ASN1_EMPTY_ALLOWED           0x00000010
+/* with SC_ASN1_ALLOC: point into the input instead of copying (octet strings only),
+ * the caller keeps the input alive for as long as the decoded value is used */
+#define SC_ASN1_BORROW			0x00000020
 
 #define SC_ASN1_BOOLEAN                 1
 #define SC_ASN1_INTEGER                 2
@@ -0,0 +1,318 @@
+/*
+ * cache.c: Memory budget of the caches of the card drivers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "probes.h"
+
+/*
+ * All cache entries of a context are on one list, the most recently used
+ * first. When more than budget bytes are held, entries are taken from the
+ * tail and put on the evicted list of their cache. They no longer count
+ * against the budget, but their memory is only given back by
+ * sc_cache_collect() when the card that owns them is locked next.
+ */
+struct sc_cache_manager {
+	void *mutex;
+	size_t budget;			/* 0 for no limit */
+	size_t used;
+	struct sc_cache_entry lru;	/* list head */
+	struct sc_cache *caches;
+};
+
+#define CACHE_MGR(ctx) ((struct sc_cache_manager *) (ctx)->cache_mgr)
+
+static void cache_unlink(struct sc_cache_entry *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void cache_link_first(struct sc_cache_manager *mgr, struct sc_cache_entry *entry)
+{
+	entry->prev = &mgr->lru;
+	entry->next = mgr->lru.next;
+	mgr->lru.next->prev = entry;
+	mgr->lru.next = entry;
+}
+
+static void cache_drop(struct sc_cache_manager *mgr, struct sc_cache_entry *entry)
+{
+	cache_unlink(entry);
+	mgr->used -= entry->size;
+	entry->cache->size -= entry->size;
+	entry->cache->entries--;
+}
+
+/* removes an entry from the evicted list of its cache */
+static void cache_unlink_evicted(struct sc_cache_entry *entry)
+{
+	struct sc_cache_entry **p;
+
+	for (p = &entry->cache->evicted; *p; p = &(*p)->next) {
+		if (*p == entry) {
+			*p = entry->next;
+			break;
+		}
+	}
+	entry->next = NULL;
+}
+
+static void cache_evict(struct sc_cache_manager *mgr, struct sc_cache_entry *keep)
+{
+	while (mgr->budget && mgr->used > mgr->budget) {
+		struct sc_cache_entry *entry = mgr->lru.prev;
+
+		if (entry == keep)
+			entry = entry->prev;
+		if (entry == &mgr->lru)
+			break;
+		cache_drop(mgr, entry);
+		entry->state = SC_CACHE_ENTRY_EVICTED;
+		entry->next = entry->cache->evicted;
+		entry->cache->evicted = entry;
+		entry->cache->evictions++;
+	}
+}
+
+int sc_cache_manager_create(struct sc_context *ctx, size_t budget)
+{
+	struct sc_cache_manager *mgr = CACHE_MGR(ctx);
+
+	if (mgr == NULL) {
+		mgr = calloc(1, sizeof *mgr);
+		if (mgr == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (sc_mutex_create(ctx, &mgr->mutex) != SC_SUCCESS) {
+			free(mgr);
+			return SC_ERROR_INTERNAL;
+		}
+		mgr->lru.prev = mgr->lru.next = &mgr->lru;
+		ctx->cache_mgr = mgr;
+	}
+	sc_mutex_lock(ctx, mgr->mutex);
+	mgr->budget = budget;
+	sc_mutex_unlock(ctx, mgr->mutex);
+	return SC_SUCCESS;
+}
+
+void sc_cache_manager_free(struct sc_context *ctx)
+{
+	struct sc_cache_manager *mgr = CACHE_MGR(ctx);
+
+	if (mgr == NULL)
+		return;
+	/* the caches are unregistered when their cards are released */
+	sc_mutex_destroy(ctx, mgr->mutex);
+	free(mgr);
+	ctx->cache_mgr = NULL;
+}
+
+void sc_cache_register(struct sc_card *card, struct sc_cache *cache, const char *name,
+		int (*evict)(struct sc_cache *, struct sc_cache_entry *), void *data)
+{
+	struct sc_cache_manager *mgr = CACHE_MGR(card->ctx);
+
+	if (cache->card != NULL)
+		return;
+	memset(cache, 0, sizeof *cache);
+	cache->name = name;
+	cache->card = card;
+	cache->evict = evict;
+	cache->data = data;
+	if (mgr == NULL)
+		return;
+	sc_mutex_lock(card->ctx, mgr->mutex);
+	cache->next = mgr->caches;
+	mgr->caches = cache;
+	sc_mutex_unlock(card->ctx, mgr->mutex);
+}
+
+void sc_cache_unregister(struct sc_cache *cache)
+{
+	struct sc_cache_manager *mgr;
+	struct sc_cache **p;
+	struct sc_cache_entry *entry, *next;
+
+	if (cache->card == NULL)
+		return;
+	mgr = CACHE_MGR(cache->card->ctx);
+	if (mgr != NULL) {
+		sc_mutex_lock(cache->card->ctx, mgr->mutex);
+		for (entry = mgr->lru.next; entry != &mgr->lru; entry = next) {
+			next = entry->next;
+			if (entry->cache == cache)
+				cache_drop(mgr, entry);
+		}
+		for (p = &mgr->caches; *p; p = &(*p)->next) {
+			if (*p == cache) {
+				*p = cache->next;
+				break;
+			}
+		}
+		sc_mutex_unlock(cache->card->ctx, mgr->mutex);
+	}
+	memset(cache, 0, sizeof *cache);
+}
+
+void sc_cache_add(struct sc_cache *cache, struct sc_cache_entry *entry, size_t size)
+{
+	struct sc_cache_manager *mgr;
+
+	if (cache->card == NULL || (mgr = CACHE_MGR(cache->card->ctx)) == NULL)
+		return;
+	sc_mutex_lock(cache->card->ctx, mgr->mutex);
+	if (entry->state == SC_CACHE_ENTRY_ACTIVE)
+		cache_drop(mgr, entry);
+	else if (entry->state == SC_CACHE_ENTRY_EVICTED)
+		cache_unlink_evicted(entry);
+	entry->cache = cache;
+	entry->size = size;
+	entry->state = SC_CACHE_ENTRY_ACTIVE;
+	cache_link_first(mgr, entry);
+	mgr->used += size;
+	cache->size += size;
+	cache->entries++;
+	cache_evict(mgr, entry);
+	sc_mutex_unlock(cache->card->ctx, mgr->mutex);
+}
+
+void sc_cache_resize(struct sc_cache *cache, struct sc_cache_entry *entry, size_t size)
+{
+	if (entry->state == SC_CACHE_ENTRY_ACTIVE && entry->size != size)
+		sc_cache_add(cache, entry, size);
+}
+
+void sc_cache_remove(struct sc_cache *cache, struct sc_cache_entry *entry)
+{
+	struct sc_cache_manager *mgr;
+
+	if (entry->state == SC_CACHE_ENTRY_UNUSED || cache->card == NULL
+			|| (mgr = CACHE_MGR(cache->card->ctx)) == NULL)
+		return;
+	sc_mutex_lock(cache->card->ctx, mgr->mutex);
+	if (entry->state == SC_CACHE_ENTRY_ACTIVE)
+		cache_drop(mgr, entry);
+	else
+		cache_unlink_evicted(entry);
+	entry->state = SC_CACHE_ENTRY_UNUSED;
+	sc_mutex_unlock(cache->card->ctx, mgr->mutex);
+}
+
+void sc_cache_hit(struct sc_cache *cache, struct sc_cache_entry *entry)
+{
+	struct sc_cache_manager *mgr;
+
+	SC_PROBE_STR2(cache__hit, "memory", cache->card);
+	if (cache->card == NULL || (mgr = CACHE_MGR(cache->card->ctx)) == NULL)
+		return;
+	if (entry->state != SC_CACHE_ENTRY_ACTIVE) {
+		/* evicted, but not yet collected: it is still good */
+		if (entry->state == SC_CACHE_ENTRY_EVICTED)
+			sc_cache_add(cache, entry, entry->size);
+		sc_mutex_lock(cache->card->ctx, mgr->mutex);
+		cache->hits++;
+		sc_mutex_unlock(cache->card->ctx, mgr->mutex);
+		return;
+	}
+	sc_mutex_lock(cache->card->ctx, mgr->mutex);
+	cache_unlink(entry);
+	cache_link_first(mgr, entry);
+	cache->hits++;
+	sc_mutex_unlock(cache->card->ctx, mgr->mutex);
+}
+
+void sc_cache_miss(struct sc_cache *cache)
+{
+	struct sc_cache_manager *mgr;
+
+	SC_PROBE_STR2(cache__miss, "memory", cache->card);
+	if (cache->card == NULL || (mgr = CACHE_MGR(cache->card->ctx)) == NULL)
+		return;
+	sc_mutex_lock(cache->card->ctx, mgr->mutex);
+	cache->misses++;
+	sc_mutex_unlock(cache->card->ctx, mgr->mutex);
+}
+
+void sc_cache_collect(struct sc_card *card)
+{
+	struct sc_cache_manager *mgr = CACHE_MGR(card->ctx);
+	struct sc_cache *cache;
+	struct sc_cache_entry *evicted = NULL, *entry;
+
+	if (mgr == NULL)
+		return;
+	/* a card has few caches, take the evicted entries of all of them */
+	sc_mutex_lock(card->ctx, mgr->mutex);
+	for (cache = mgr->caches; cache; cache = cache->next) {
+		if (cache->card != card)
+			continue;
+		while ((entry = cache->evicted) != NULL) {
+			cache->evicted = entry->next;
+			entry->next = evicted;
+			evicted = entry;
+		}
+	}
+	sc_mutex_unlock(card->ctx, mgr->mutex);
+
+	while ((entry = evicted) != NULL) {
+		evicted = entry->next;
+		entry->next = NULL;
+		cache = entry->cache;
+		/* the entry is no longer on any list, the driver may reuse it */
+		entry->state = SC_CACHE_ENTRY_UNUSED;
+		if (cache->evict(cache, entry)) {
+			sc_log(card->ctx, "%s cache keeps an entry in use", cache->name);
+			sc_cache_add(cache, entry, entry->size);
+		}
+	}
+}
+
+int sc_get_cache_stats(struct sc_context *ctx, size_t idx, struct sc_cache_stats *stats)
+{
+	struct sc_cache_manager *mgr;
+	struct sc_cache *cache;
+	int r = SC_ERROR_OBJECT_NOT_FOUND;
+
+	if (ctx == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	mgr = CACHE_MGR(ctx);
+	if (mgr == NULL)
+		return r;
+	sc_mutex_lock(ctx, mgr->mutex);
+	for (cache = mgr->caches; cache && idx; cache = cache->next)
+		idx--;
+	if (cache) {
+		stats->name = cache->name;
+		stats->size = cache->size;
+		stats->entries = cache->entries;
+		stats->hits = cache->hits;
+		stats->misses = cache->misses;
+		stats->evictions = cache->evictions;
+		r = SC_SUCCESS;
+	}
+	sc_mutex_unlock(ctx, mgr->mutex);
+	return r;
+}
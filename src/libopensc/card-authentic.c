@@ -103,6 +103,8 @@ static void authentic_debug_select_file(struct sc_card *card, const struct sc_pa
 static int authentic_sm_open(struct sc_card *card);
 static int authentic_sm_get_wrapped_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu **sm_apdu);
 static int authentic_sm_free_wrapped_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu **sm_apdu);
+static int authentic_sm_read_binary(struct sc_card *card, unsigned int idx, unsigned char *buf, size_t count);
+static int authentic_sm_update_binary(struct sc_card *card, unsigned int idx, const unsigned char *buf, size_t count);
 #endif
 
 static int
@@ -447,6 +449,8 @@ authentic_init_oberthur_authentic_3_2(struct sc_card *card)
 	card->sm_ctx.ops.open = authentic_sm_open;
 	card->sm_ctx.ops.get_sm_apdu = authentic_sm_get_wrapped_apdu;
 	card->sm_ctx.ops.free_sm_apdu = authentic_sm_free_wrapped_apdu;
+	card->sm_ctx.ops.read_binary = authentic_sm_read_binary;
+	card->sm_ctx.ops.update_binary = authentic_sm_update_binary;
 #endif
 
 	rv = authentic_select_aid(card, aid_AuthentIC_3_2, sizeof(aid_AuthentIC_3_2), NULL, NULL);
@@ -2276,6 +2280,143 @@ authentic_sm_get_wrapped_apdu(struct sc_card *card, struct sc_apdu *plain, struc
 	*sm_apdu = apdu;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
+
+
+/*
+ * READ/UPDATE BINARY of 'count' bytes as a series of APDUs that are secured
+ * by one call to the SM module, instead of one call per APDU.
+ * Returns zero if the SM module cannot do that, the caller then falls back
+ * to the APDU by APDU wrapping.
+ */
+static int
+authentic_sm_transmit_binary(struct sc_card *card, unsigned char ins, unsigned int idx,
+		unsigned char *rbuf, const unsigned char *sbuf, size_t count)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_remote_data rdata;
+	struct sc_remote_apdu *rapdu;
+	struct sc_apdu *apdus = NULL;
+	unsigned char icv[8];
+	size_t chunk, offs, ii, nn, done = 0;
+	int rv;
+
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT || !card->sm_ctx.module.ops.get_apdus)
+		return 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (rbuf)   {
+		chunk = sc_get_max_recv_size(card);
+		if (chunk > 256)
+			chunk = 256;
+	}
+	else   {
+		/* room for the padding and the MAC in a short APDU */
+		chunk = sc_get_max_send_size(card);
+		if (chunk > 239)
+			chunk = 239;
+	}
+
+	nn = (count + chunk - 1) / chunk;
+	if (nn < 2)
+		LOG_FUNC_RETURN(ctx, 0);
+
+	apdus = calloc(nn, sizeof(struct sc_apdu));
+	if (!apdus)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	sc_remote_data_init(&rdata);
+	rv = rdata.reserve(&rdata, nn);
+	if (rv < 0)
+		goto err;
+
+	for (ii = 0, offs = 0; ii < nn; ii++, offs += chunk)   {
+		size_t sz = count - offs > chunk ? chunk : count - offs;
+		unsigned int p = idx + offs;
+
+		rv = rdata.alloc(&rdata, &rapdu);
+		if (rv < 0)
+			goto err;
+
+		if (rbuf)   {
+			sc_format_apdu(card, &rapdu->apdu, SC_APDU_CASE_2_SHORT, ins, (p >> 8) & 0x7F, p & 0xFF);
+			rapdu->apdu.le = sz;
+		}
+		else   {
+			sc_format_apdu(card, &rapdu->apdu, SC_APDU_CASE_3_SHORT, ins, (p >> 8) & 0x7F, p & 0xFF);
+			memcpy(rapdu->sbuf, sbuf + offs, sz);
+			rapdu->apdu.lc = sz;
+			rapdu->apdu.datalen = sz;
+		}
+		rapdu->apdu.data = rapdu->sbuf;
+		rapdu->apdu.resp = rapdu->rbuf;
+		rapdu->apdu.resplen = rbuf ? sz : 0;
+	}
+
+	rv = sc_lock(card);
+	if (rv < 0)
+		goto err;
+
+	memcpy(icv, card->sm_ctx.info.session.gp.mac_icv, sizeof(icv));
+	card->sm_ctx.info.cmd = SM_CMD_APDU_TRANSMIT_BATCH;
+	rv = card->sm_ctx.module.ops.get_apdus(ctx, &card->sm_ctx.info, NULL, 0, &rdata);
+	card->sm_ctx.info.cmd = SM_CMD_APDU_TRANSMIT;
+	if (rv == SC_ERROR_NOT_SUPPORTED)   {
+		sc_log(ctx, "SM module cannot secure a batch of APDUs");
+		sc_unlock(card);
+		rv = 0;
+		goto err;
+	}
+	else if (rv < 0)   {
+		sc_unlock(card);
+		sc_sm_stop(card);
+		goto err;
+	}
+
+	for (ii = 0, rapdu = rdata.data; ii < nn && rapdu; ii++, rapdu = rapdu->next)   {
+		apdus[ii] = rapdu->apdu;
+		apdus[ii].flags |= SC_APDU_FLAGS_NO_SM | SC_APDU_FLAGS_NO_RETRY_WL;
+	}
+
+	rv = sc_transmit_apdus(card, apdus, nn);
+
+	/* The APDUs after a failed one were not sent. The next MAC has to
+	 * chain on the MAC of the last APDU that the card has seen. */
+	for (ii = 0; ii < nn && apdus[ii].sw1; ii++)   {
+		if (rbuf)   {
+			memcpy(rbuf + done, apdus[ii].resp, apdus[ii].resplen);
+			done += apdus[ii].resplen;
+		}
+	}
+	if (ii == 0)
+		memcpy(card->sm_ctx.info.session.gp.mac_icv, icv, sizeof(icv));
+	else if (ii < nn)
+		memcpy(card->sm_ctx.info.session.gp.mac_icv, apdus[ii - 1].data + apdus[ii - 1].datalen - 8, 8);
+	sc_unlock(card);
+	if (rv < 0)
+		goto err;
+
+	rv = rbuf ? (int)done : (int)count;
+err:
+	rdata.free(&rdata);
+	free(apdus);
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+
+static int
+authentic_sm_read_binary(struct sc_card *card, unsigned int idx,
+		unsigned char *buf, size_t count)
+{
+	return authentic_sm_transmit_binary(card, 0xB0, idx, buf, NULL, count);
+}
+
+
+static int
+authentic_sm_update_binary(struct sc_card *card, unsigned int idx,
+		const unsigned char *buf, size_t count)
+{
+	return authentic_sm_transmit_binary(card, 0xD6, idx, NULL, buf, count);
+}
 #endif
 
 static struct sc_card_driver *
@@ -33,6 +33,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -190,15 +191,34 @@ typedef struct {
 #define CAC_OBJECT_TYPE_TLV_FILE	4
 #define CAC_OBJECT_TYPE_GENERIC		5
 
+/*
+ * Decoded objects are kept in a small per card cache, so going back and
+ * forth between objects does not read and decompress them again. The
+ * least recently used entry is replaced when the cache is full, all
+ * entries are dropped when the card was reset. The buffers count against
+ * memory_cache_size and may be evicted, see cache.c.
+ */
+#define CAC_CACHE_SIZE			8
+
+typedef struct cac_cache_entry {
+	sc_path_t path;			/* path the object was selected with */
+	int object_type;		/* object type it was decoded as */
+	u8 *buf;			/* TLV file or certificate as returned by read_binary */
+	size_t buf_len;
+	unsigned int last_used;		/* 0 for an unused entry */
+	struct sc_cache_entry mem;
+} cac_cache_entry_t;
+
 /*
  * CAC private data per card state
  */
 typedef struct cac_private_data {
 	int object_type;		/* select set this so we know how to read the file */
 	int cert_next;			/* index number for the next certificate found in the list */
-	u8 *cache_buf;			/* cached version of the currently selected file */
-	size_t cache_buf_len;		/* length of the cached selected file */
-	int cached;			/* is the cached selected file valid */
+	sc_path_t selected_path;	/* path of the currently selected file */
+	cac_cache_entry_t cache[CAC_CACHE_SIZE]; /* decoded objects */
+	unsigned int cache_clock;	/* last_used of the most recent cache hit */
+	struct sc_cache mem_cache;	/* accounting of the buffers */
 	cac_cuid_t cuid;                /* card unique ID from the CCC */
 	u8 *cac_id;                     /* card serial number */
 	size_t cac_id_len;              /* card serial number len */
@@ -241,10 +261,77 @@ static cac_private_data_t *cac_new_private_data(void)
 	return priv;
 }
 
+static void cac_cache_flush(cac_private_data_t *priv)
+{
+	int i;
+
+	for (i = 0; i < CAC_CACHE_SIZE; i++) {
+		sc_cache_remove(&priv->mem_cache, &priv->cache[i].mem);
+		free(priv->cache[i].buf);
+		memset(&priv->cache[i], 0, sizeof(priv->cache[i]));
+	}
+	priv->cache_clock = 0;
+}
+
+static int cac_cache_evict(struct sc_cache *cache, struct sc_cache_entry *mem)
+{
+	cac_cache_entry_t *entry = (cac_cache_entry_t *)
+		((u8 *) mem - offsetof(cac_cache_entry_t, mem));
+
+	free(entry->buf);
+	memset(entry, 0, sizeof(*entry));
+	return 0;
+}
+
+static cac_cache_entry_t *cac_cache_find(cac_private_data_t *priv)
+{
+	int i;
+
+	for (i = 0; i < CAC_CACHE_SIZE; i++) {
+		cac_cache_entry_t *entry = &priv->cache[i];
+
+		if (entry->last_used && entry->object_type == priv->object_type
+				&& sc_compare_path(&entry->path, &priv->selected_path)
+				&& entry->path.aid.len == priv->selected_path.aid.len
+				&& !memcmp(entry->path.aid.value, priv->selected_path.aid.value,
+					entry->path.aid.len)) {
+			entry->last_used = ++priv->cache_clock;
+			sc_cache_hit(&priv->mem_cache, &entry->mem);
+			return entry;
+		}
+	}
+	sc_cache_miss(&priv->mem_cache);
+	return NULL;
+}
+
+/* takes ownership of buf */
+static cac_cache_entry_t *cac_cache_add(sc_card_t *card, u8 *buf, size_t buf_len)
+{
+	cac_private_data_t *priv = CAC_DATA(card);
+	cac_cache_entry_t *entry = &priv->cache[0];
+	int i;
+
+	for (i = 1; i < CAC_CACHE_SIZE; i++)
+		if (priv->cache[i].last_used < entry->last_used)
+			entry = &priv->cache[i];
+
+	sc_cache_register(card, &priv->mem_cache, "cac", cac_cache_evict, priv);
+	sc_cache_remove(&priv->mem_cache, &entry->mem);
+	free(entry->buf);
+	entry->path = priv->selected_path;
+	entry->object_type = priv->object_type;
+	entry->buf = buf;
+	entry->buf_len = buf_len;
+	entry->last_used = ++priv->cache_clock;
+	sc_cache_add(&priv->mem_cache, &entry->mem, buf_len);
+	return entry;
+}
+
 static void cac_free_private_data(cac_private_data_t *priv)
 {
+	sc_cache_unregister(&priv->mem_cache);
 	free(priv->cac_id);
-	free(priv->cache_buf);
+	cac_cache_flush(priv);
 	free(priv->aca_path);
 	list_destroy(&priv->pki_list);
 	list_destroy(&priv->general_list);
@@ -584,32 +671,21 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	size_t tl_len, val_len, tlv_len;
 	size_t len, tl_head_len, cert_len;
 	u8 cert_type, tag;
+	u8 *cache_buf = NULL;
+	size_t cache_buf_len = 0;
+	cac_cache_entry_t *entry;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
-	/* if we didn't return it all last time, return the remainder */
-	if (priv->cached) {
+	/* if we have read and decoded this object before, return it from the cache */
+	entry = cac_cache_find(priv);
+	if (entry) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 			 "returning cached value idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
 			 idx, count);
-		if (idx > priv->cache_buf_len) {
-			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_FILE_END_REACHED);
-		}
-		len = MIN(count, priv->cache_buf_len-idx);
-		memcpy(buf, &priv->cache_buf[idx], len);
-		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, len);
+		goto copy;
 	}
 
-	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
-		 "clearing cache idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
-		 idx, count);
-	if (priv->cache_buf) {
-		free(priv->cache_buf);
-		priv->cache_buf = NULL;
-		priv->cache_buf_len = 0;
-	}
-
-
 	if (priv->object_type <= 0)
 		 SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
 
@@ -625,14 +701,14 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	switch (priv->object_type) {
 	case CAC_OBJECT_TYPE_TLV_FILE:
 		tlv_len = tl_len + val_len;
-		priv->cache_buf = malloc(tlv_len);
-		if (priv->cache_buf == NULL) {
+		cache_buf = malloc(tlv_len);
+		if (cache_buf == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto done;
 		}
-		priv->cache_buf_len = tlv_len;
+		cache_buf_len = tlv_len;
 
-		for (tl_ptr = tl, val_ptr=val, tlv_ptr = priv->cache_buf;
+		for (tl_ptr = tl, val_ptr=val, tlv_ptr = cache_buf;
 				tl_len >= 2 && tlv_len > 0;
 				val_len -= len, tlv_len -= len, val_ptr += len, tlv_ptr += len) {
 			/* get the tag and the length */
@@ -698,7 +774,7 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 		/* if the info byte is 1, then the cert is compressed, decompress it */
 		if ((cert_type & 0x3) == 1) {
 #ifdef ENABLE_ZLIB
-			r = sc_decompress_alloc(&priv->cache_buf, &priv->cache_buf_len,
+			r = sc_decompress_alloc(&cache_buf, &cache_buf_len,
 				cert_ptr, cert_len, COMPRESSION_AUTO);
 #else
 			sc_log(card->ctx, "CAC compression not supported, no zlib");
@@ -707,13 +783,13 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 			if (r)
 				goto done;
 		} else if (cert_len > 0) {
-			priv->cache_buf = malloc(cert_len);
-			if (priv->cache_buf == NULL) {
+			cache_buf = malloc(cert_len);
+			if (cache_buf == NULL) {
 				r = SC_ERROR_OUT_OF_MEMORY;
 				goto done;
 			}
-			priv->cache_buf_len = cert_len;
-			memcpy(priv->cache_buf, cert_ptr, cert_len);
+			cache_buf_len = cert_len;
+			memcpy(cache_buf, cert_ptr, cert_len);
 		} else {
 			sc_log(card->ctx, "Can't read zero-length certificate");
 			goto done;
@@ -731,16 +807,24 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 		goto done;
 	}
 
-	/* OK we've read the data, now copy the required portion out to the callers buffer */
-	priv->cached = 1;
-	len = MIN(count, priv->cache_buf_len-idx);
-	memcpy(buf, &priv->cache_buf[idx], len);
+	/* OK we've read the data, keep it and copy the required portion out to the callers buffer */
+	entry = cac_cache_add(card, cache_buf, cache_buf_len);
+	cache_buf = NULL;
+copy:
+	if (idx > entry->buf_len) {
+		r = SC_ERROR_FILE_END_REACHED;
+		goto done;
+	}
+	len = MIN(count, entry->buf_len-idx);
+	memcpy(buf, &entry->buf[idx], len);
 	r = len;
 done:
 	if (tl)
 		free(tl);
 	if (val)
 		free(val);
+	if (cache_buf)
+		free(cache_buf);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
@@ -1229,13 +1313,8 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 			priv->object_type = CAC_OBJECT_TYPE_CERT;
 		}
 
-		/* forget any old cached values */
-		if (priv->cache_buf) {
-			free(priv->cache_buf);
-			priv->cache_buf = NULL;
-		}
-		priv->cache_buf_len = 0;
-		priv->cached = 0;
+		/* read_binary looks up the decoded object by this path */
+		priv->selected_path = *in_path;
 	}
 
 	if (in_path->aid.len) {
@@ -2003,6 +2082,19 @@ static int cac_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data, int *tries
 	return  iso_drv->ops->pin_cmd(card, data, tries_left);
 }
 
+static int cac_card_reader_lock_obtained(sc_card_t *card, int was_reset)
+{
+	cac_private_data_t * priv = CAC_DATA(card);
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	/* the objects may have been changed by whoever reset the card */
+	if (priv && was_reset > 0)
+		cac_cache_flush(priv);
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
 static struct sc_card_operations cac_ops;
 
 static struct sc_card_driver cac_drv = {
@@ -2031,6 +2123,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	cac_ops.decipher =  cac_decipher;
 	cac_ops.card_ctl = cac_card_ctl;
 	cac_ops.pin_cmd = cac_pin_cmd;
+	cac_ops.card_reader_lock_obtained = cac_card_reader_lock_obtained;
 
 	return &cac_drv;
 }
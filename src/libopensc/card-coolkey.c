@@ -69,6 +69,7 @@
  *  COOLKEY hardware and APDU constants
  */
 #define COOLKEY_MAX_CHUNK_SIZE 240 /* must be less than 255-8 */
+#define COOLKEY_MAX_READ_CHUNK_SIZE 255 /* the length of a read is a single byte */
 
 /* ISO 7816 CLA values used by COOLKEY */
 #define ISO7816_CLASS           0x00
@@ -748,6 +749,15 @@ coolkey_v1_get_object_length(u8 *obj, size_t buf_len)
 /*
  * COOLKEY private data per card state
  */
+/* Objects of objects_list by ID. Objects are only ever appended to the list,
+ * which keeps them at a stable address until the list is destroyed */
+#define COOLKEY_OBJECT_INDEX_BUCKETS 64
+
+struct coolkey_object_index_entry {
+	sc_cardctl_coolkey_object_t *obj;
+	struct coolkey_object_index_entry *next;
+};
+
 typedef struct coolkey_private_data {
 	u8 protocol_version_major;
 	u8 protocol_version_minor;
@@ -763,6 +773,7 @@ typedef struct coolkey_private_data {
 	coolkey_cuid_t cuid;			/* card unique ID from the CCC */
 	sc_cardctl_coolkey_object_t *obj;	/* pointer to the current selected object */
 	list_t objects_list;			/* list of objects on the token */
+	struct coolkey_object_index_entry *objects_index[COOLKEY_OBJECT_INDEX_BUCKETS];
 	unsigned short key_id;			/* key id set by select */
 	int	algorithm;			/* saved from set_security_env */
 	int operation;				/* saved from set_security_env */
@@ -804,6 +815,8 @@ static void coolkey_free_private_data(coolkey_private_data_t *priv)
 {
 	list_t *l = &priv->objects_list;
 	sc_cardctl_coolkey_object_t *o;
+	struct coolkey_object_index_entry *entry, *next;
+	size_t i;
 
 	/* Clean up the allocated memory in the items */
 	list_iterator_start(l);
@@ -814,6 +827,12 @@ static void coolkey_free_private_data(coolkey_private_data_t *priv)
 	}
 	list_iterator_stop(l);
 
+	for (i = 0; i < COOLKEY_OBJECT_INDEX_BUCKETS; i++) {
+		for (entry = priv->objects_index[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+	}
 	list_destroy(&priv->objects_list);
 	if (priv->token_name) {
 		free(priv->token_name);
@@ -825,28 +844,42 @@ static void coolkey_free_private_data(coolkey_private_data_t *priv)
 /*
  * Object list operations
  */
-static int coolkey_add_object_to_list(list_t *list, const sc_cardctl_coolkey_object_t *object)
+static size_t coolkey_object_index_hash(unsigned long object_id)
+{
+	return (size_t) (((object_id & 0xffffffffUL) * 2654435761UL) >> 8) % COOLKEY_OBJECT_INDEX_BUCKETS;
+}
+
+static int coolkey_add_object_to_list(coolkey_private_data_t *priv, const sc_cardctl_coolkey_object_t *object)
 {
-	if (list_append(list, object) < 0)
+	list_t *list = &priv->objects_list;
+	struct coolkey_object_index_entry *entry, **pp;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (list_append(list, object) < 0) {
+		free(entry);
 		return SC_ERROR_UNKNOWN;
+	}
+	entry->obj = list_get_at(list, list_size(list) - 1);
+
+	/* like a search of the list, a lookup returns the first object of an ID */
+	for (pp = &priv->objects_index[coolkey_object_index_hash(object->id)]; *pp != NULL; pp = &(*pp)->next)
+		;
+	*pp = entry;
 	return SC_SUCCESS;
 }
 
 #define COOLKEY_AID "\xA0\x00\x00\x01\x16"
 static sc_cardctl_coolkey_object_t *
-coolkey_find_object_by_id(list_t *list, unsigned long object_id)
+coolkey_find_object_by_id(coolkey_private_data_t *priv, unsigned long object_id)
 {
-	int pos;
-	static sc_cardctl_coolkey_object_t cmp = {{
-		"", 0, 0, 0, SC_PATH_TYPE_DF_NAME,
-		{ COOLKEY_AID, sizeof(COOLKEY_AID)-1 }
-	}, 0, 0, NULL};
-
-	cmp.id = object_id;
-	if ((pos = list_locate(list, &cmp)) < 0)
-		return NULL;
+	struct coolkey_object_index_entry *entry;
 
-	return list_get_at(list, pos);
+	for (entry = priv->objects_index[coolkey_object_index_hash(object_id)]; entry != NULL; entry = entry->next)
+		if (entry->obj->id == object_id)
+			return entry->obj;
+	return NULL;
 }
 
 
@@ -1077,22 +1110,25 @@ coolkey_get_life_cycle(sc_card_t *card, coolkey_life_cycle_t *life_cycle)
 }
 
 
-/* should be general global platform call */
 static int
 coolkey_get_cplc_data(sc_card_t *card, global_platform_cplc_data_t *cplc_data)
 {
-	size_t len = sizeof(global_platform_cplc_data_t);
-	u8 *receive_buf = (u8 *)cplc_data;
-	return coolkey_apdu_io(card, GLOBAL_PLATFORM_CLASS, ISO7816_INS_GET_DATA, 0x9f, 0x7f,
-			NULL, 0, &receive_buf, &len,  NULL, 0);
+	return gp_get_cplc_data(card, (u8 *)cplc_data, sizeof(global_platform_cplc_data_t));
 }
 
+static const struct sc_aid coolkey_aid = {
+	{ 0x62, 0x76, 0x01, 0xff, 0x00, 0x00, 0x00 }, 7
+};
+
 /* select the coolkey applet */
 static int coolkey_select_applet(sc_card_t *card)
 {
-	u8 aid[] = { 0x62, 0x76, 0x01, 0xff, 0x00, 0x00, 0x00 };
-	return coolkey_apdu_io(card, ISO7816_CLASS, ISO7816_INS_SELECT_FILE, 4, 0,
-			&aid[0], sizeof(aid), NULL, NULL,  NULL, 0);
+	int r;
+
+	r = coolkey_apdu_io(card, ISO7816_CLASS, ISO7816_INS_SELECT_FILE, 4, 0,
+			coolkey_aid.value, coolkey_aid.len, NULL, NULL,  NULL, 0);
+	gp_aid_cache_update(card, &coolkey_aid, r);
+	return r;
 }
 
 static void
@@ -1128,7 +1164,7 @@ static int coolkey_read_object(sc_card_t *card, unsigned long object_id, size_t
 	left = out_len;
 	do {
 		ulong2bebytes(&params.offset[0], offset);
-		params.length = MIN(left, COOLKEY_MAX_CHUNK_SIZE);
+		params.length = MIN(left, COOLKEY_MAX_READ_CHUNK_SIZE);
 		len = left;
 		r = coolkey_apdu_io(card, COOLKEY_CLASS, COOLKEY_INS_READ_OBJECT, 0, 0,
 			(u8 *)&params, sizeof(params), &out_ptr, &len, nonce, nonce_size);
@@ -1397,7 +1433,7 @@ coolkey_fill_object(sc_card_t *card, sc_cardctl_coolkey_object_t *obj)
 		free(new_obj_data);
 		return SC_ERROR_CORRUPTED_DATA;
 	}
-	obj_entry = coolkey_find_object_by_id(&priv->objects_list, obj->id);
+	obj_entry = coolkey_find_object_by_id(priv, obj->id);
 	if (obj_entry == NULL) {
 		free(new_obj_data);
 		return SC_ERROR_INTERNAL; /* shouldn't happen */
@@ -1557,7 +1593,7 @@ coolkey_find_object(sc_card_t *card, sc_cardctl_coolkey_find_object_t *fobj)
 
 	switch (fobj->type) {
 	case SC_CARDCTL_COOLKEY_FIND_BY_ID:
-		obj = coolkey_find_object_by_id(&priv->objects_list, fobj->find_id);
+		obj = coolkey_find_object_by_id(priv, fobj->find_id);
 		break;
 	case SC_CARDCTL_COOLKEY_FIND_BY_TEMPLATE:
 		obj = coolkey_find_object_by_template(card, fobj->coolkey_template, fobj->template_count);
@@ -1907,7 +1943,7 @@ static int coolkey_select_file(sc_card_t *card, const sc_path_t *in_path, sc_fil
 		return r;
 	}
 	object_id = bebytes2ulong(in_path->value);
-	priv->obj = coolkey_find_object_by_id(&priv->objects_list, object_id);
+	priv->obj = coolkey_find_object_by_id(priv, object_id);
 	if (priv->obj == NULL) {
 		return SC_ERROR_OBJECT_NOT_FOUND;
 	}
@@ -1968,7 +2004,7 @@ coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const
 		memcpy(&new_object.data[add_v1_record], object_data, object_length);
 	}
 
-	r = coolkey_add_object_to_list(&priv->objects_list, &new_object);
+	r = coolkey_add_object_to_list(priv, &new_object);
 	if (r != SC_SUCCESS) {
 		/* if we didn't successfully put the object on the list,
 		 * the data space didn't get adopted. free it before we return */
@@ -2190,14 +2226,10 @@ static int coolkey_initialize(sc_card_t *card)
 	/* if we didn't pull the cuid from the combined object, then grab it now */
 	if (!combined_processed) {
 		global_platform_cplc_data_t cplc_data;
-		/* select the card manager, because a card with applet only will have
-		   already selected the coolkey applet */
-
-		r = gp_select_card_manager(card);
-		if (r < 0) {
-			goto cleanup;
-		}
 
+		/* this selects the card manager, because a card with applet only
+		   will have already selected the coolkey applet */
+		memset(&cplc_data, 0, sizeof(cplc_data));
 		r = coolkey_get_cplc_data(card, &cplc_data);
 		if (r < 0) {
 			goto cleanup;
@@ -2230,6 +2262,10 @@ static int coolkey_match_card(sc_card_t *card)
 	 * however it may be in dirty memory */
 	card->ops->logout = NULL;
 
+	/* a card seen before without the applet is not asked again */
+	if (gp_aid_cached(card, &coolkey_aid) == 0)
+		return 0;
+
 	r = coolkey_select_applet(card);
 	return (r >= SC_SUCCESS);
 }
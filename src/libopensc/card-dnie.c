@@ -2150,6 +2150,8 @@ static int dnie_pin_verify(struct sc_card *card,
 	u8 pinbuffer[SC_MAX_APDU_BUFFER_SIZE];
 	int pinlen = 0;
 	int padding = 0;
+	int sm_flag = CWA_SM_WARM;
+	int reused = 0;
 
 	LOG_FUNC_CALLED(card->ctx);
 	/* ensure that secure channel is established from reset */
@@ -2157,8 +2159,15 @@ static int dnie_pin_verify(struct sc_card *card,
 		/* the provider should be prepared for using PIN information */
 		sc_log(card->ctx, "DNIe 3.0 detected doing PIN initialization");
 		dnie_change_cwa_provider_to_pin(card);
+		/* the PIN channel has to be created for every verification */
+		sm_flag = CWA_SM_ON;
+	} else {
+		/* keep the channel established since the last card reset */
+		reused = card->sm_ctx.sm_mode == SM_MODE_TRANSMIT;
 	}
-	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, sm_flag);
+	if (res != SC_SUCCESS)
+		dnie_forget_icc_certificates(card);
 	LOG_TEST_RET(card->ctx, res, "Establish SM failed");
 
 	data->apdu = &apdu;	/* prepare apdu struct */
@@ -2177,6 +2186,15 @@ static int dnie_pin_verify(struct sc_card *card,
 
 	/* and send to card through virtual channel */
 	res = sc_transmit_apdu(card, &apdu);
+	if (res != SC_SUCCESS && reused && card->sm_ctx.sm_mode == SM_MODE_NONE) {
+		/* the card has dropped the channel: the PIN was not verified */
+		sc_log(card->ctx, "SM channel lost, re-establishing it");
+		res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+		LOG_TEST_RET(card->ctx, res, "Establish SM failed");
+		dnie_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x20, 0x00, 0x00, 0, pinlen,
+					NULL, 0, pinbuffer, pinlen);
+		res = sc_transmit_apdu(card, &apdu);
+	}
 	if (res != SC_SUCCESS) {
 		LOG_TEST_RET(card->ctx, res, "VERIFY APDU Transmit fail");
 	}
@@ -2267,6 +2285,29 @@ static int dnie_pin_cmd(struct sc_card *card,
 	LOG_FUNC_RETURN(card->ctx, res);
 }
 
+/**
+ * OpenDNIe implementation of card_reader_lock_obtained() card driver operation.
+ *
+ * The secure channel is kept for the lifetime of the card handle, but a
+ * card reset destroys it on the card side.
+ *
+ * @param card pointer to card driver structure
+ * @param was_reset whether the card was reset since the last lock
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int dnie_card_reader_lock_obtained(struct sc_card *card, int was_reset)
+{
+	int res = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(card->ctx);
+	if (was_reset > 0 && card->sm_ctx.sm_mode != SM_MODE_NONE) {
+		sc_log(card->ctx, "Card was reset: secure channel is lost");
+		res = cwa_create_secure_channel(card,
+			GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_OFF);
+	}
+	LOG_FUNC_RETURN(card->ctx, res);
+}
+
 /**********************************************************************/
 
 /**
@@ -2326,6 +2367,7 @@ static sc_card_driver_t *get_dnie_driver(void)
 	dnie_ops.process_fci	= dnie_process_fci;
 	/* dnie_ops.construct_fci */
 	dnie_ops.pin_cmd	= dnie_pin_cmd;
+	dnie_ops.card_reader_lock_obtained = dnie_card_reader_lock_obtained;
 	dnie_ops.get_data	= NULL;
 	dnie_ops.put_data	= NULL;
 	dnie_ops.delete_record	= NULL;
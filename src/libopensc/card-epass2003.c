@@ -100,6 +100,11 @@ typedef struct epass2003_exdata_st {
 	unsigned char icv_mac[16];	/* instruction counter vector(for sm) */
 	unsigned char currAlg;		/* current Alg */
 	unsigned int  ecAlgFlags; 	/* Ec Alg mechanism type*/
+	/* cipher contexts keyed with the session keys, only the IV is set per APDU */
+	EVP_CIPHER_CTX *enc_ctx;	/* encryption with sk_enc */
+	EVP_CIPHER_CTX *dec_ctx;	/* decryption with sk_enc */
+	EVP_CIPHER_CTX *mac_ctx;	/* MAC with sk_mac (first DES key in DES mode) */
+	EVP_CIPHER_CTX *mac2_ctx;	/* decryption with the second DES key of sk_mac */
 } epass2003_exdata;
 
 #define REVERSE_ORDER4(x)	(			  \
@@ -366,6 +371,83 @@ des_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_
 }
 
 
+static void
+sm_cipher_free(epass2003_exdata *exdata)
+{
+	EVP_CIPHER_CTX_free(exdata->enc_ctx);
+	EVP_CIPHER_CTX_free(exdata->dec_ctx);
+	EVP_CIPHER_CTX_free(exdata->mac_ctx);
+	EVP_CIPHER_CTX_free(exdata->mac2_ctx);
+	exdata->enc_ctx = exdata->dec_ctx = NULL;
+	exdata->mac_ctx = exdata->mac2_ctx = NULL;
+}
+
+
+/* schedule the session keys once, the contexts are reused for every APDU */
+static int
+sm_cipher_init(epass2003_exdata *exdata)
+{
+	unsigned char bKey[24] = { 0 };
+	int ok;
+
+	sm_cipher_free(exdata);
+	exdata->enc_ctx = EVP_CIPHER_CTX_new();
+	exdata->dec_ctx = EVP_CIPHER_CTX_new();
+	exdata->mac_ctx = EVP_CIPHER_CTX_new();
+	exdata->mac2_ctx = EVP_CIPHER_CTX_new();
+	if (!exdata->enc_ctx || !exdata->dec_ctx || !exdata->mac_ctx || !exdata->mac2_ctx) {
+		sm_cipher_free(exdata);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	if (KEY_TYPE_AES == exdata->smtype) {
+		ok = EVP_EncryptInit_ex(exdata->enc_ctx, EVP_aes_128_cbc(), NULL, exdata->sk_enc, NULL)
+			&& EVP_DecryptInit_ex(exdata->dec_ctx, EVP_aes_128_cbc(), NULL, exdata->sk_enc, NULL)
+			&& EVP_EncryptInit_ex(exdata->mac_ctx, EVP_aes_128_cbc(), NULL, exdata->sk_mac, NULL);
+	}
+	else {
+		memcpy(&bKey[0], exdata->sk_enc, 16);
+		memcpy(&bKey[16], exdata->sk_enc, 8);
+		ok = EVP_EncryptInit_ex(exdata->enc_ctx, EVP_des_ede3_cbc(), NULL, bKey, NULL)
+			&& EVP_DecryptInit_ex(exdata->dec_ctx, EVP_des_ede3_cbc(), NULL, bKey, NULL)
+			&& EVP_EncryptInit_ex(exdata->mac_ctx, EVP_des_cbc(), NULL, exdata->sk_mac, NULL)
+			&& EVP_DecryptInit_ex(exdata->mac2_ctx, EVP_des_cbc(), NULL, &exdata->sk_mac[8], NULL);
+		memset(bKey, 0, sizeof bKey);
+	}
+	if (!ok) {
+		sm_cipher_free(exdata);
+		return SC_ERROR_INTERNAL;
+	}
+
+	return SC_SUCCESS;
+}
+
+
+static int
+sm_cipher(EVP_CIPHER_CTX *ctx, const unsigned char *iv,
+		const unsigned char *input, size_t length, unsigned char *output)
+{
+	int outl = 0;
+	int outl_tmp = 0;
+
+	if (ctx == NULL)
+		return SC_ERROR_SM_NOT_INITIALIZED;
+
+	/* keep the key schedule, only reset the IV */
+	if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+		return SC_ERROR_INTERNAL;
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	if (!EVP_CipherUpdate(ctx, output, &outl, input, length))
+		return SC_ERROR_INTERNAL;
+
+	if (!EVP_CipherFinal_ex(ctx, output + outl, &outl_tmp))
+		return SC_ERROR_INTERNAL;
+
+	return SC_SUCCESS;
+}
+
+
 static int
 openssl_dig(const EVP_MD * digest, const unsigned char *input, size_t length,
 		unsigned char *output)
@@ -481,6 +563,9 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 	if (0 != memcmp(&cryptogram[16], &result[20], 8))
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_CARD_CMD_FAILED);
 
+	r = sm_cipher_init(exdata);
+	LOG_TEST_RET(card->ctx, r, "cannot set up SM cipher contexts");
+
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
 
@@ -650,10 +735,8 @@ construct_data_tlv(struct sc_card *card, struct sc_apdu *apdu, unsigned char *ap
 	memcpy(data_tlv, &apdu_buf[block_size], tlv_more);
 
 	/* encrypt Data */
-	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
-	else
-		des3_encrypt_cbc(exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
+	if (sm_cipher(exdata->enc_ctx, iv, pad, pad_len, apdu_buf + block_size + tlv_more))
+		return -1;
 
 	memcpy(data_tlv + tlv_more, apdu_buf + block_size + tlv_more, pad_len);
 	*data_tlv_len = tlv_more + pad_len;
@@ -736,16 +819,17 @@ construct_mac_tlv(struct sc_card *card, unsigned char *apdu_buf, size_t data_tlv
 	memset(icv, 0, sizeof(icv));
 	memcpy(icv, exdata->icv_mac, 16);
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(exdata->sk_mac, 16, icv, apdu_buf, mac_len, mac);
+		if (sm_cipher(exdata->mac_ctx, icv, apdu_buf, mac_len, mac))
+			return -1;
 		memcpy(mac_tlv + 2, &mac[mac_len - 16], 8);
 	}
 	else {
 		unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
 		unsigned char tmp[8] = { 0 };
-		des_encrypt_cbc(exdata->sk_mac, 8, icv, apdu_buf, mac_len, mac);
-		des_decrypt_cbc(&exdata->sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
-		memset(iv, 0x00, sizeof iv);
-		des_encrypt_cbc(exdata->sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
+		if (sm_cipher(exdata->mac_ctx, icv, apdu_buf, mac_len, mac)
+				|| sm_cipher(exdata->mac2_ctx, iv, &mac[mac_len - 8], 8, tmp)
+				|| sm_cipher(exdata->mac_ctx, iv, tmp, 8, mac_tlv + 2))
+			return -1;
 	}
 
 	*mac_tlv_len = 2 + 8;
@@ -942,10 +1026,8 @@ decrypt_response(struct sc_card *card, unsigned char *in, size_t inlen, unsigned
 		return -1;
 
 	/* decrypt */
-	if (KEY_TYPE_AES == exdata->smtype)
-		aes128_decrypt_cbc(exdata->sk_enc, 16, iv, &in[i], cipher_len - 1, plaintext);
-	else
-		des3_decrypt_cbc(exdata->sk_enc, 16, iv, &in[i], cipher_len - 1, plaintext);
+	if (sm_cipher(exdata->dec_ctx, iv, &in[i], cipher_len - 1, plaintext))
+		return -1;
 
 	/* unpadding */
 	while (0x80 != plaintext[cipher_len - 2] && (cipher_len - 2 > 0))
@@ -1221,8 +1303,10 @@ epass2003_finish(sc_card_t *card)
 {
 	epass2003_exdata *exdata = (epass2003_exdata *)card->drv_data;
 
-	if (exdata)
+	if (exdata) {
+		sm_cipher_free(exdata);
 		free(exdata);
+	}
 	return SC_SUCCESS;
 }
 
@@ -149,6 +149,9 @@ struct gids_private_data {
 	size_t masterfilesize;
 	u8 cmapfile[MAX_GIDS_FILE_SIZE];
 	size_t cmapfilesize;
+	u8 cardcf[6];				// cardcf file when masterfile and cmapfile were read
+	int cardcfvalid;
+	int cachechecked;			// caches checked against cardcf while the card is locked
 	unsigned short currentEFID;
 	unsigned short currentDO;
 	int state;
@@ -374,6 +377,8 @@ static int gids_update_cardcf(sc_card_t* card, int file, int container) {
 		cardcf[2] = containerfreshness & 0xFF;
 		cardcf[3] = (containerfreshness>>8) & 0xFF;
 	}
+	// the caches no longer match the stored cardcf and are reloaded by gids_refresh_cache
+	data->cachechecked = 0;
 	r = gids_write_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, 6);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to update the cardcf file");
 	return r;
@@ -436,6 +441,46 @@ static int gids_read_cmapfile(sc_card_t* card) {
 	return r;
 }
 
+// refresh the masterfile and cmapfile caches in case something has been modified.
+// Every change on the card updates the cardcf file, so they are only read again
+// if it differs from the cardcf read together with them. While the card stays
+// locked, nobody else can change it and the caches are checked only once.
+static int gids_refresh_cache(sc_card_t* card) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	u8 cardcf[6];
+	size_t cardcfsize = sizeof(cardcf);
+	int r;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (data->cachechecked && card->lock_count > 0) {
+		return SC_SUCCESS;
+	}
+	if (data->cardcfvalid && data->masterfilesize != sizeof(data->masterfile)
+			&& data->cmapfilesize != sizeof(data->cmapfile)) {
+		r = gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, &cardcfsize);
+		if (r == SC_SUCCESS && cardcfsize == sizeof(cardcf) && memcmp(cardcf, data->cardcf, sizeof(cardcf)) == 0) {
+			data->cachechecked = 1;
+			return SC_SUCCESS;
+		}
+	}
+
+	data->cardcfvalid = 0;
+	data->cachechecked = 0;
+	r = gids_read_masterfile(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read masterfile failed");
+	r = gids_read_cmapfile(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read cmapfile failed");
+
+	cardcfsize = sizeof(cardcf);
+	r = gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, &cardcfsize);
+	if (r == SC_SUCCESS && cardcfsize == sizeof(cardcf)) {
+		memcpy(data->cardcf, cardcf, sizeof(cardcf));
+		data->cardcfvalid = 1;
+	}
+	data->cachechecked = 1;
+	return SC_SUCCESS;
+}
+
 // create a file record in the masterfile
 static int gids_create_file(sc_card_t *card, char* directory, char* filename) {
 	int r;
@@ -604,6 +649,9 @@ static int gids_get_serialnr(sc_card_t * card, sc_serial_number_t * serial)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	if (card->serialnr.len)
+		goto end;
+
 	buffersize = sizeof(buffer);
 	r = gids_read_gidsfile(card, "", "cardid", buffer, &buffersize);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to read cardid");
@@ -617,6 +665,7 @@ static int gids_get_serialnr(sc_card_t * card, sc_serial_number_t * serial)
 	card->serialnr.len = buffersize;
 	memcpy(card->serialnr.value, buffer, card->serialnr.len);
 
+end:
 	/* return cached serial number */
 	if (serial)
 		memcpy(serial, &card->serialnr, sizeof(*serial));
@@ -1032,10 +1081,8 @@ static int
 gids_get_all_containers(sc_card_t* card, size_t *recordsnum) {
 	int r;
 	struct gids_private_data *privatedata = (struct gids_private_data *) card->drv_data;
-	r = gids_read_masterfile(card);
-	LOG_TEST_RET(card->ctx, r, "unable to read the masterfile");
-	r = gids_read_cmapfile(card);
-	LOG_TEST_RET(card->ctx, r, "unable to read the cmapfile");
+	r = gids_refresh_cache(card);
+	LOG_TEST_RET(card->ctx, r, "unable to refresh the masterfile and cmapfile");
 	*recordsnum = (privatedata ->cmapfilesize / sizeof(CONTAINER_MAP_RECORD));
 	return SC_SUCCESS;
 }
@@ -1097,10 +1144,8 @@ gids_select_key_reference(sc_card_t *card, sc_pkcs15_prkey_info_t* key_info) {
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
 	// refresh the cached data in case some thing has been modified
-	r = gids_read_masterfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read masterfile failed");
-	r = gids_read_cmapfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read cmapfile failed");
+	r = gids_refresh_cache(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids refresh cache failed");
 
 	recordsnum = (data->cmapfilesize / sizeof(CONTAINER_MAP_RECORD));
 
@@ -1527,10 +1572,8 @@ static int gids_save_certificate(sc_card_t *card, sc_pkcs15_object_t *certobject
 	assert((privkeyobject->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_PRKEY);
 
 	// refresh the cached data in case some thing has been modified
-	r = gids_read_masterfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read masterfile failed");
-	r= gids_read_cmapfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read cmapfile failed");
+	r = gids_refresh_cache(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids refresh cache failed");
 
 	// compress the certificate according to the minidriver specification
 	r = gids_encode_certificate(card, cert_info->value.value, cert_info->value.len, certbuffer, &certbuffersize);
@@ -1633,10 +1676,8 @@ static int gids_delete_cert(sc_card_t *card, sc_pkcs15_object_t* object) {
 
 	assert((object->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_CERT);
 	// refresh the cached data in case some thing has been modified
-	r = gids_read_masterfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read masterfile failed");
-	r= gids_read_cmapfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read cmapfile failed");
+	r = gids_refresh_cache(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids refresh cache failed");
 
 	// remove the file reference from the masterfile
 	if (cert_info->path.len != 4) {
@@ -1687,10 +1728,8 @@ static int gids_delete_key(sc_card_t *card, sc_pkcs15_object_t* object) {
 
 	assert((object->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_PRKEY);
 	// refresh the cached data in case some thing has been modified
-	r = gids_read_masterfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read masterfile failed");
-	r = gids_read_cmapfile(card);
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids read cmapfile failed");
+	r = gids_refresh_cache(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids refresh cache failed");
 	containernum = key_info->key_reference - GIDS_FIRST_KEY_IDENTIFIER;
 
 	r = gids_delete_container_num(card, containernum);
@@ -2014,12 +2053,31 @@ static int gids_authenticate_admin(sc_card_t *card, u8* key) {
 #endif
 }
 
+// every change of the card content updates cardcf, the pkcs15 emulation cache is
+// checked against it
+static int gids_get_freshness_token(sc_card_t *card, sc_cardctl_freshness_token_t *token)
+{
+	struct gids_private_data *data = (struct gids_private_data *) card->drv_data;
+	size_t len = sizeof(token->value);
+	int r;
+
+	if (token == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", token->value, &len);
+	LOG_TEST_RET(card->ctx, r, "unable to get the cardcf");
+	token->len = len;
+	return SC_SUCCESS;
+}
+
 static int gids_card_ctl(sc_card_t * card, unsigned long cmd, void *ptr)
 {
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	switch (cmd) {
 		case SC_CARDCTL_GET_SERIALNR:
 			return gids_get_serialnr(card, (sc_serial_number_t *) ptr);
+		case SC_CARDCTL_GET_FRESHNESS_TOKEN:
+		case SC_CARDCTL_GET_CHANGE_COUNTER:
+			return gids_get_freshness_token(card, (sc_cardctl_freshness_token_t *) ptr);
 		case SC_CARDCTL_GIDS_GET_ALL_CONTAINERS:
 			return gids_get_all_containers(card, (size_t*) ptr);
 		case SC_CARDCTL_GIDS_GET_CONTAINER_DETAIL:
@@ -2056,6 +2114,11 @@ static int gids_card_reader_lock_obtained(sc_card_t *card, int was_reset)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	// somebody else may have changed the card while it was not locked
+	if (card->drv_data) {
+		((struct gids_private_data*) card->drv_data)->cachechecked = 0;
+	}
+
 	if (was_reset > 0) {
 		u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
 		size_t resplen = sizeof(rbuf);
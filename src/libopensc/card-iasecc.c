@@ -117,6 +117,7 @@ static int iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *
 static int iasecc_pin_is_verified(struct sc_card *card, struct sc_pin_cmd_data *pin_cmd, int *tries_left);
 static int iasecc_get_free_reference(struct sc_card *card, struct iasecc_ctl_get_free_reference *ctl_data);
 static int iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update);
+static void iasecc_sdo_uncache(struct sc_card *card, unsigned sdo_class, unsigned sdo_ref);
 
 #ifdef ENABLE_SM
 static int _iasecc_sm_read_binary(struct sc_card *card, unsigned int offs, unsigned char *buf, size_t count);
@@ -1369,6 +1370,9 @@ iasecc_logout(struct sc_card *card)
 	memcpy(path.value, card->ef_atr->aid.value, card->ef_atr->aid.len);
 	path.len = card->ef_atr->aid.len;
 
+	/* the security status is lost, so is the SM session */
+	iasecc_sm_close_session(card);
+
 	rv = iasecc_select_file(card, &path, NULL);
 	sc_log(ctx, "Select ECC ROOT with the AID from EF.ATR: rv %i", rv);
 
@@ -1376,6 +1380,18 @@ iasecc_logout(struct sc_card *card)
 }
 
 
+static int
+iasecc_card_reader_lock_obtained(struct sc_card *card, int was_reset)
+{
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	/* an SM session is only kept within one card lock */
+	iasecc_sm_close_session(card);
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
+
 static int
 iasecc_finish(struct sc_card *card)
 {
@@ -1392,6 +1408,8 @@ iasecc_finish(struct sc_card *card)
 		se_info = next;
 	}
 
+	iasecc_sdo_uncache(card, 0, 0);
+
 	free(card->drv_data);
 	card->drv_data = NULL;
 
@@ -1438,6 +1456,10 @@ iasecc_delete_file(struct sc_card *card, const struct sc_path *path)
 		card->cache.current_ef = NULL;
 	}
 
+	/* SDOs of a deleted DF are gone as well */
+	if (file->type == SC_FILE_TYPE_DF)
+		iasecc_sdo_uncache(card, 0, 0);
+
 	sc_file_free(file);
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -1481,20 +1503,83 @@ iasecc_get_algorithm(struct sc_context *ctx, const struct sc_security_env *env,
 }
 
 
+static struct iasecc_se_info *
+iasecc_se_get_info_from_cache(struct sc_card *card, int reference)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_se_info *si = NULL;
+
+	for(si = prv->se_info; si; si = si->next)   {
+		if (si->reference != reference)
+			continue;
+		if (!(card->cache.valid && card->cache.current_df) && si->df)
+			continue;
+		if (card->cache.valid && card->cache.current_df && !si->df)
+			continue;
+		if (card->cache.valid && card->cache.current_df && si->df)
+			if (memcmp(&card->cache.current_df->path, &si->df->path, sizeof(struct sc_path)))
+				continue;
+		break;
+	}
+
+	return si;
+}
+
+
+/*
+ * SE info of the current DF, parsed once and then kept in the cache of
+ * the driver. The returned info belongs to the cache.
+ */
 static int
-iasecc_se_cache_info(struct sc_card *card, struct iasecc_se_info *se)
+iasecc_se_fetch(struct sc_card *card, int reference, struct iasecc_se_info **out)
 {
 	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
 	struct sc_context *ctx = card->ctx;
 	struct iasecc_se_info *se_info = NULL, *si = NULL;
+	struct sc_apdu apdu;
+	unsigned char rbuf[0x100];
+	unsigned char sbuf_iasecc[10] = {
+		0x4D, 0x08, IASECC_SDO_TEMPLATE_TAG, 0x06,
+		IASECC_SDO_TAG_HEADER, IASECC_SDO_CLASS_SE | IASECC_OBJECT_REF_LOCAL,
+		reference & 0x3F,
+		0x02, IASECC_SDO_CLASS_SE, 0x80
+	};
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 
+	if (reference > IASECC_SE_REF_MAX)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	*out = iasecc_se_get_info_from_cache(card, reference);
+	if (*out)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	sc_log(ctx, "No SE#%X info in cache, try to use 'GET DATA'", reference);
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xCB, 0x3F, 0xFF);
+	apdu.data = sbuf_iasecc;
+	apdu.datalen = sizeof(sbuf_iasecc);
+	apdu.lc = apdu.datalen;
+	apdu.resp = rbuf;
+	apdu.resplen = sizeof(rbuf);
+	apdu.le = sizeof(rbuf);
+
+	rv = sc_transmit_apdu(card, &apdu);
+	LOG_TEST_RET(ctx, rv, "APDU transmit failed");
+	rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	LOG_TEST_RET(ctx, rv, "get SE data  error");
+
 	se_info = calloc(1, sizeof(struct iasecc_se_info));
 	if (!se_info)
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SE info allocation error");
-	memcpy(se_info, se, sizeof(struct iasecc_se_info));
+	se_info->reference = reference;
+
+	rv = iasecc_se_parse(card, apdu.resp, apdu.resplen, se_info);
+	if (rv < 0)   {
+		free(se_info);
+		LOG_TEST_RET(ctx, rv, "cannot parse SE data");
+	}
 
 	if (card->cache.valid && card->cache.current_df)   {
 		sc_file_dup(&se_info->df, card->cache.current_df);
@@ -1504,13 +1589,6 @@ iasecc_se_cache_info(struct sc_card *card, struct iasecc_se_info *se)
 		}
 	}
 
-	rv = iasecc_docp_copy(ctx, &se->docp, &se_info->docp);
-	if (rv < 0)   {
-		free(se_info->df);
-		free(se_info);
-		LOG_TEST_RET(ctx, rv, "Cannot make copy of DOCP");
-	}
-
 	if (!prv->se_info)   {
 		prv->se_info = se_info;
 	}
@@ -1520,37 +1598,26 @@ iasecc_se_cache_info(struct sc_card *card, struct iasecc_se_info *se)
 		si->next = se_info;
 	}
 
-	LOG_FUNC_RETURN(ctx, rv);
+	*out = se_info;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
-static int
-iasecc_se_get_info_from_cache(struct sc_card *card, struct iasecc_se_info *se)
+int
+iasecc_se_get_info(struct sc_card *card, struct iasecc_se_info *se)
 {
-	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
 	struct sc_context *ctx = card->ctx;
 	struct iasecc_se_info *si = NULL;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 
-	for(si = prv->se_info; si; si = si->next)   {
-		if (si->reference != se->reference)
-			continue;
-		if (!(card->cache.valid && card->cache.current_df) && si->df)
-			continue;
-		if (card->cache.valid && card->cache.current_df && !si->df)
-			continue;
-		if (card->cache.valid && card->cache.current_df && si->df)
-			if (memcmp(&card->cache.current_df->path, &si->df->path, sizeof(struct sc_path)))
-				continue;
-		break;
-	}
-
-	if (!si)
-		return SC_ERROR_OBJECT_NOT_FOUND;
+	rv = iasecc_se_fetch(card, se->reference, &si);
+	LOG_TEST_RET(ctx, rv, "Cannot get SE info");
 
 	memcpy(se, si, sizeof(struct iasecc_se_info));
+	se->next = NULL;
+	se->df = NULL;
 
 	if (si->df)   {
 		sc_file_dup(&se->df, si->df);
@@ -1565,50 +1632,21 @@ iasecc_se_get_info_from_cache(struct sc_card *card, struct iasecc_se_info *se)
 }
 
 
+/*
+ * The CRT of the SE that matches the template in 'crt', as
+ * iasecc_se_get_crt(), taken from the cached SE without copying it.
+ */
 int
-iasecc_se_get_info(struct sc_card *card, struct iasecc_se_info *se)
+iasecc_se_get_crt_by_reference(struct sc_card *card, int reference, struct sc_crt *crt)
 {
-	struct sc_context *ctx = card->ctx;
-	struct sc_apdu apdu;
-	unsigned char rbuf[0x100];
-	unsigned char sbuf_iasecc[10] = {
-		0x4D, 0x08, IASECC_SDO_TEMPLATE_TAG, 0x06,
-		IASECC_SDO_TAG_HEADER, IASECC_SDO_CLASS_SE | IASECC_OBJECT_REF_LOCAL,
-		se->reference & 0x3F,
-		0x02, IASECC_SDO_CLASS_SE, 0x80
-	};
+	struct iasecc_se_info *si = NULL;
 	int rv;
 
-	LOG_FUNC_CALLED(ctx);
-
-	if (se->reference > IASECC_SE_REF_MAX)
-                LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
-
-	rv = iasecc_se_get_info_from_cache(card, se);
-	if (rv == SC_ERROR_OBJECT_NOT_FOUND)   {
-		sc_log(ctx, "No SE#%X info in cache, try to use 'GET DATA'", se->reference);
-
-		sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xCB, 0x3F, 0xFF);
-		apdu.data = sbuf_iasecc;
-		apdu.datalen = sizeof(sbuf_iasecc);
-		apdu.lc = apdu.datalen;
-		apdu.resp = rbuf;
-		apdu.resplen = sizeof(rbuf);
-		apdu.le = sizeof(rbuf);
-
-		rv = sc_transmit_apdu(card, &apdu);
-		LOG_TEST_RET(ctx, rv, "APDU transmit failed");
-		rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
-		LOG_TEST_RET(ctx, rv, "get SE data  error");
-
-		rv = iasecc_se_parse(card, apdu.resp, apdu.resplen, se);
-		LOG_TEST_RET(ctx, rv, "cannot parse SE data");
+	rv = iasecc_se_fetch(card, reference, &si);
+	if (rv < 0)
+		return rv;
 
-		rv = iasecc_se_cache_info(card, se);
-		LOG_TEST_RET(ctx, rv, "failed to put SE data into cache");
-	}
-
-	LOG_FUNC_RETURN(ctx, rv);
+	return iasecc_se_get_crt(card, si, crt);
 }
 
 
@@ -1889,7 +1927,6 @@ iasecc_se_at_to_chv_reference(struct sc_card *card, unsigned reference,
 		unsigned *chv_reference)
 {
 	struct sc_context *ctx = card->ctx;
-	struct iasecc_se_info se;
 	struct sc_crt crt;
 	int rv;
 
@@ -1899,24 +1936,16 @@ iasecc_se_at_to_chv_reference(struct sc_card *card, unsigned reference,
 	if (reference > IASECC_SE_REF_MAX)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
-	memset(&se, 0, sizeof(se));
-	se.reference = reference;
-
-	rv = iasecc_se_get_info(card, &se);
-	LOG_TEST_RET(ctx, rv, "SDO get data error");
-
 	memset(&crt, 0, sizeof(crt));
 	crt.tag = IASECC_CRT_TAG_AT;
 	crt.usage = IASECC_UQB_AT_USER_PASSWORD;
 
-	rv = iasecc_se_get_crt(card, &se, &crt);
+	rv = iasecc_se_get_crt_by_reference(card, reference, &crt);
 	LOG_TEST_RET(ctx, rv, "no authentication template for USER PASSWORD");
 
 	if (chv_reference)
 		*chv_reference = crt.refs[0];
 
-	sc_file_free(se.df);
-
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
@@ -2185,12 +2214,10 @@ iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *data)
 	       "iasecc_pin_get_policy() sdo.docp.size.size %"SC_FORMAT_LEN_SIZE_T"u",
 	       sdo.docp.size.size);
 	for (ii=0; ii<sizeof(sdo.docp.scbs); ii++)   {
-		struct iasecc_se_info se;
 		unsigned char scb = sdo.docp.scbs[ii];
 		struct sc_acl_entry *acl = &data->pin1.acls[ii];
 		int crt_num = 0;
 
-		memset(&se, 0, sizeof(se));
 		memset(&acl->crts, 0, sizeof(acl->crts));
 
 		sc_log(ctx, "iasecc_pin_get_policy() set info acls: SCB 0x%X", scb);
@@ -2201,18 +2228,10 @@ iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *data)
 		if (scb==0 || scb==0xFF)
 			continue;
 
-		if (se.reference != (int)acl->key_ref)   {
-			memset(&se, 0, sizeof(se));
-
-			se.reference = acl->key_ref;
-
-			rv = iasecc_se_get_info(card, &se);
-			LOG_TEST_GOTO_ERR(ctx, rv, "SDO get data error");
-		}
-
 		if (scb & IASECC_SCB_METHOD_USER_AUTH)   {
-			rv = iasecc_se_get_crt_by_usage(card, &se,
-					IASECC_CRT_TAG_AT, IASECC_UQB_AT_USER_PASSWORD, &acl->crts[crt_num]);
+			acl->crts[crt_num].tag = IASECC_CRT_TAG_AT;
+			acl->crts[crt_num].usage = IASECC_UQB_AT_USER_PASSWORD;
+			rv = iasecc_se_get_crt_by_reference(card, acl->key_ref, &acl->crts[crt_num]);
 			LOG_TEST_GOTO_ERR(ctx, rv, "no authentication template for 'USER PASSWORD'");
 			sc_log(ctx, "iasecc_pin_get_policy() scb:0x%X; sdo_ref:[%i,%i,...]",
 					scb, acl->crts[crt_num].refs[0], acl->crts[crt_num].refs[1]);
@@ -2227,8 +2246,6 @@ iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *data)
 				acl->method = SC_AC_NEVER;
 			continue;
 		}
-
-		sc_file_free(se.df);
 	}
 
 	if (sdo.data.chv.size_max.value)
@@ -2620,6 +2637,7 @@ iasecc_sdo_create(struct sc_card *card, struct iasecc_sdo *sdo)
 
 	sc_log(ctx, "iasecc_sdo_create(card:%p) %02X%02X%02X", card,
 			IASECC_SDO_TAG_HEADER, sdo->sdo_class | 0x80, sdo->sdo_ref);
+	iasecc_sdo_uncache(card, sdo->sdo_class, sdo->sdo_ref);
 
 	data_len = iasecc_sdo_encode_create(ctx, sdo, &data);
 	LOG_TEST_RET(ctx, data_len, "iasecc_sdo_create() cannot encode SDO create data");
@@ -2688,6 +2706,7 @@ iasecc_sdo_delete(struct sc_card *card, struct iasecc_sdo *sdo)
 	data[3] = sdo->sdo_class | 0x80;
 	data[4] = sdo->sdo_ref;
 	sc_log(ctx, "delete SDO %02X%02X%02X", data[2], data[3], data[4]);
+	iasecc_sdo_uncache(card, sdo->sdo_class, sdo->sdo_ref);
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xDB, 0x3F, 0xFF);
 	apdu.data = data;
@@ -2715,6 +2734,8 @@ iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update)
 	if (update->magic != SC_CARDCTL_IASECC_SDO_MAGIC_PUT_DATA)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO update data");
 
+	iasecc_sdo_uncache(card, update->sdo_class, update->sdo_ref);
+
 	for(ii=0; update->fields[ii].tag && ii < IASECC_SDO_TAGS_UPDATE_MAX; ii++)   {
 		unsigned char *encoded = NULL;
 		int encoded_len;
@@ -2751,6 +2772,11 @@ iasecc_sdo_key_rsa_put_data(struct sc_card *card, struct iasecc_sdo_rsa_update *
 
 	LOG_FUNC_CALLED(ctx);
 
+	if (update->sdo_prv_key)
+		iasecc_sdo_uncache(card, update->sdo_prv_key->sdo_class, update->sdo_prv_key->sdo_ref);
+	if (update->sdo_pub_key)
+		iasecc_sdo_uncache(card, update->sdo_pub_key->sdo_class, update->sdo_pub_key->sdo_ref);
+
 	if (update->sdo_prv_key)   {
 		sc_log(ctx, "encode private rsa in %p", &update->update_prv);
 		rv = iasecc_sdo_encode_rsa_update(card->ctx, update->sdo_prv_key, update->p15_rsa, &update->update_prv);
@@ -2832,18 +2858,110 @@ iasecc_sdo_tag_from_class(unsigned sdo_class)
 }
 
 
+/*
+ * The 'GET DATA' answers for the SDOs are kept per card and per current DF,
+ * as the SE info. The CHV SDOs are not kept, they carry the PIN tries
+ * counter. An entry is dropped when its SDO is created, updated, generated
+ * or deleted through this driver; sdo_class 0 drops them all.
+ */
+static void
+iasecc_sdo_uncache(struct sc_card *card, unsigned sdo_class, unsigned sdo_ref)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache **next, *sc;
+
+	if (!prv)
+		return;
+
+	sdo_class |= IASECC_OBJECT_REF_LOCAL;
+	sdo_ref &= 0x9F;
+	for (next = &prv->sdo_cache; (sc = *next) != NULL; )   {
+		if (sdo_class != IASECC_OBJECT_REF_LOCAL && (sc->sdo_class != sdo_class || sc->sdo_ref != sdo_ref))   {
+			next = &sc->next;
+			continue;
+		}
+		*next = sc->next;
+		free(sc->data);
+		free(sc);
+	}
+}
+
+
+static struct iasecc_sdo_cache *
+iasecc_sdo_cache_find(struct sc_card *card, unsigned sdo_class, unsigned sdo_ref, int sdo_tag)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *sc;
+	struct sc_path df_path;
+
+	memset(&df_path, 0, sizeof(df_path));
+	if (card->cache.valid && card->cache.current_df)
+		df_path = card->cache.current_df->path;
+
+	for (sc = prv->sdo_cache; sc; sc = sc->next)
+		if (sc->sdo_class == sdo_class && sc->sdo_ref == sdo_ref && sc->sdo_tag == sdo_tag
+				&& !memcmp(&sc->df_path, &df_path, sizeof(df_path)))
+			break;
+	return sc;
+}
+
+
+static void
+iasecc_sdo_cache_add(struct sc_card *card, unsigned sdo_class, unsigned sdo_ref, int sdo_tag,
+		int rv, const unsigned char *data, size_t len)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *sc;
+
+	sc = calloc(1, sizeof(struct iasecc_sdo_cache));
+	if (!sc)
+		return;
+	if (len)   {
+		sc->data = malloc(len);
+		if (!sc->data)   {
+			free(sc);
+			return;
+		}
+		memcpy(sc->data, data, len);
+	}
+	sc->sdo_class = sdo_class;
+	sc->sdo_ref = sdo_ref;
+	sc->sdo_tag = sdo_tag;
+	if (card->cache.valid && card->cache.current_df)
+		sc->df_path = card->cache.current_df->path;
+	sc->rv = rv;
+	sc->len = len;
+
+	sc->next = prv->sdo_cache;
+	prv->sdo_cache = sc;
+}
+
+
 static int
 iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo)
 {
 	struct sc_context *ctx = card->ctx;
+	struct iasecc_sdo_cache *sc = NULL;
 	struct sc_apdu apdu;
 	unsigned char sbuf[0x100];
 	size_t offs = sizeof(sbuf) - 1;
 	unsigned char rbuf[0x400];
+	unsigned sdo_class = sdo->sdo_class | IASECC_OBJECT_REF_LOCAL, sdo_ref = sdo->sdo_ref & 0x9F;
+	int cacheable = (sdo->sdo_class & ~IASECC_OBJECT_REF_LOCAL) != IASECC_SDO_CLASS_CHV;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 
+	if (cacheable)
+		sc = iasecc_sdo_cache_find(card, sdo_class, sdo_ref, sdo_tag);
+	if (sc)   {
+		sc_log(ctx, "SDO %02X%02X tag %X from cache", sdo_class, sdo_ref, sdo_tag);
+		LOG_TEST_RET(ctx, sc->rv, "SDO get data error");
+		rv = iasecc_sdo_parse(card, sc->data, sc->len, sdo);
+		LOG_TEST_RET(ctx, rv, "cannot parse SDO data");
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
 	sbuf[offs--] = 0x80;
 	sbuf[offs--] = sdo_tag & 0xFF;
 	if ((sdo_tag >> 8) & 0xFF)
@@ -2874,11 +2992,17 @@ iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo
 	rv = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, rv, "APDU transmit failed");
 	rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	/* No public data, see iasecc_sdo_get_data() */
+	if (cacheable && rv == SC_ERROR_INCORRECT_PARAMETERS)
+		iasecc_sdo_cache_add(card, sdo_class, sdo_ref, sdo_tag, rv, NULL, 0);
 	LOG_TEST_RET(ctx, rv, "SDO get data error");
 
 	rv = iasecc_sdo_parse(card, apdu.resp, apdu.resplen, sdo);
 	LOG_TEST_RET(ctx, rv, "cannot parse SDO data");
 
+	if (cacheable)
+		iasecc_sdo_cache_add(card, sdo_class, sdo_ref, sdo_tag, SC_SUCCESS, apdu.resp, apdu.resplen);
+
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
@@ -2919,6 +3043,9 @@ iasecc_sdo_generate(struct sc_card *card, struct iasecc_sdo *sdo)
 	if (sdo->sdo_class != IASECC_SDO_CLASS_RSA_PRIVATE)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "For a moment, only RSA_PRIVATE class can be accepted for the SDO generation");
 
+	iasecc_sdo_uncache(card, IASECC_SDO_CLASS_RSA_PRIVATE, sdo->sdo_ref);
+	iasecc_sdo_uncache(card, IASECC_SDO_CLASS_RSA_PUBLIC, sdo->sdo_ref);
+
 	if (sdo->docp.acls_contact.size == 0)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Bewildered ... there are no ACLs");
 
@@ -2981,7 +3108,6 @@ static int
 iasecc_get_chv_reference_from_se(struct sc_card *card, int *se_reference)
 {
 	struct sc_context *ctx = card->ctx;
-	struct iasecc_se_info se;
 	struct sc_crt crt;
 	int rv;
 
@@ -2990,20 +3116,13 @@ iasecc_get_chv_reference_from_se(struct sc_card *card, int *se_reference)
 	if (!se_reference)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "Invalid arguments");
 
-	memset(&se, 0, sizeof(se));
-	se.reference = *se_reference;
-
-	rv = iasecc_se_get_info(card, &se);
-	LOG_TEST_RET(ctx, rv, "get SE info error");
-
 	memset(&crt, 0, sizeof(crt));
 	crt.tag = IASECC_CRT_TAG_AT;
 	crt.usage = IASECC_UQB_AT_USER_PASSWORD;
 
-	rv = iasecc_se_get_crt(card, &se, &crt);
+	rv = iasecc_se_get_crt_by_reference(card, *se_reference, &crt);
 	LOG_TEST_RET(ctx, rv, "Cannot get 'USER PASSWORD' authentication template");
 
-	sc_file_free(se.df);
 	LOG_FUNC_RETURN(ctx, crt.refs[0]);
 }
 
@@ -3031,6 +3150,8 @@ iasecc_card_ctl(struct sc_card *card, unsigned long cmd, void *ptr)
 		return iasecc_sdo_key_rsa_put_data(card, (struct iasecc_sdo_rsa_update *) ptr);
 	case SC_CARDCTL_IASECC_SDO_GET_DATA:
 		sc_log(ctx, "CMD SC_CARDCTL_IASECC_SDO_GET_DATA: sdo_class %X", sdo->sdo_class);
+		/* callers of the card_ctl get the current usage counters */
+		iasecc_sdo_uncache(card, sdo->sdo_class, sdo->sdo_ref);
 		return iasecc_sdo_get_data(card, (struct iasecc_sdo *) ptr);
 	case SC_CARDCTL_IASECC_SDO_GENERATE:
 		sc_log(ctx, "CMD SC_CARDCTL_IASECC_SDO_GET_DATA: sdo_class %X", sdo->sdo_class);
@@ -3595,6 +3716,7 @@ sc_get_driver(void)
 	/*	delete_record: Not implemented	*/
 
 	iasecc_ops.read_public_key = iasecc_read_public_key;
+	iasecc_ops.card_reader_lock_obtained = iasecc_card_reader_lock_obtained;
 
 	return &iasecc_drv;
 }
@@ -3616,4 +3738,10 @@ iasecc_se_get_info()
 	return SC_ERROR_NOT_SUPPORTED;
 }
 
+int
+iasecc_se_get_crt_by_reference()
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
 #endif /* ENABLE_OPENSSL */
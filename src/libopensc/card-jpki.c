@@ -54,6 +54,8 @@ int jpki_select_ap(struct sc_card *card)
 	path.type = SC_PATH_TYPE_DF_NAME;
 	rc = sc_select_file(card, &path, NULL);
 	LOG_TEST_RET(card->ctx, rc, "select JPKI AP failed");
+	if (JPKI_DRVDATA(card))
+		JPKI_DRVDATA(card)->selected = SELECT_JPKI_AP;
 
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
@@ -151,7 +153,7 @@ jpki_select_file(struct sc_card *card,
 	       "jpki_select_file: path=%s, len=%"SC_FORMAT_LEN_SIZE_T"u",
 	       sc_print_path(path), path->len);
 	if (path->len == 2 && memcmp(path->value, "\x3F\x00", 2) == 0) {
-		drvdata->selected = SELECT_MF;
+		/* the MF is virtual, the card keeps its current selection */
 		if (file_out) {
 			sc_file_dup(file_out, drvdata->mf);
 			if (*file_out == NULL) {
@@ -177,10 +179,27 @@ jpki_select_file(struct sc_card *card,
 	apdu.datalen = path->len;
 	apdu.lc = path->len;
 
-	rc = sc_transmit_apdu(card, &apdu);
-	LOG_TEST_RET(card->ctx, rc, "APDU transmit failed");
-	rc = sc_check_sw(card, apdu.sw1, apdu.sw2);
-	LOG_TEST_RET(card->ctx, rc, "SW Check failed");
+	/* The EF selected in this lock session is still current; the select
+	 * returns no FCI, so there is nothing to gain from sending it again */
+	if (drvdata && path->type == SC_PATH_TYPE_FILE_ID && path->len == 2
+			&& card->lock_count > 0
+			&& drvdata->selected == SELECT_JPKI_AP
+			&& drvdata->selected_ef == (unsigned int) (path->value[0] << 8 | path->value[1])) {
+		sc_log(card->ctx, "EF already selected");
+	} else {
+		if (drvdata) {
+			/* jpki_select_ap() marks the AP as selected again */
+			if (path->type == SC_PATH_TYPE_DF_NAME)
+				drvdata->selected = SELECT_MF;
+			drvdata->selected_ef = 0;
+		}
+		rc = sc_transmit_apdu(card, &apdu);
+		LOG_TEST_RET(card->ctx, rc, "APDU transmit failed");
+		rc = sc_check_sw(card, apdu.sw1, apdu.sw2);
+		LOG_TEST_RET(card->ctx, rc, "SW Check failed");
+		if (drvdata && path->type == SC_PATH_TYPE_FILE_ID && path->len == 2)
+			drvdata->selected_ef = path->value[0] << 8 | path->value[1];
+	}
 	if (!file_out) {
 		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 	}
@@ -364,11 +383,18 @@ jpki_compute_signature(sc_card_t * card,
 
 static int jpki_card_reader_lock_obtained(sc_card_t *card, int was_reset)
 {
+	struct jpki_private_data *drvdata = JPKI_DRVDATA(card);
 	int r = SC_SUCCESS;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	/* others may have selected a different EF */
+	if (drvdata)
+		drvdata->selected_ef = 0;
+
 	if (was_reset > 0) {
+		if (drvdata)
+			drvdata->selected = SELECT_MF;
 		r = jpki_select_ap(card);
 	}
 
@@ -230,6 +230,15 @@ static int myeid_init(struct sc_card *card)
 	card->max_recv_size = 255;
 	card->max_send_size = 255;
 
+	/* Cards from firmware 4.5 accept extended APDUs over T=1; use them only
+	 * for the commands that need them, as long as the reader allows it */
+	if (card->version.fw_major >= 45 && card->reader->active_protocol == SC_PROTO_T1
+			&& (card->reader->max_send_size == 0
+				|| card->reader->max_send_size > SC_READER_SHORT_APDU_MAX_SEND_SIZE)
+			&& (card->reader->max_recv_size == 0
+				|| card->reader->max_recv_size > SC_READER_SHORT_APDU_MAX_RECV_SIZE))
+		card->caps |= SC_CARD_CAP_APDU_EXT;
+
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
 
@@ -1086,6 +1095,78 @@ int myeid_ecdh_derive(struct sc_card *card, const u8* pubkey, size_t pubkey_len,
 }
 
 
+/* Decipher a 2048 bit cryptogram: it does not fit in a short APDU together
+ * with the padding indicator byte. Send it in a single extended APDU when the
+ * card and the reader support them, otherwise in two halves that are
+ * transmitted as one batch. */
+static int myeid_decipher_2048(struct sc_card *card, const u8 *crgram,
+		u8 *out, size_t outlen)
+{
+	struct sc_apdu apdus[2];
+	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	u8 sbuf[2][SC_MAX_APDU_BUFFER_SIZE];
+	size_t len;
+	int r;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (card->caps & SC_CARD_CAP_APDU_EXT) {
+		u8 ebuf[257];
+
+		sc_format_apdu(card, &apdus[0], SC_APDU_CASE_4_EXT, 0x2A, 0x80, 0x86);
+		/* padding indicator byte, 0x00 = No further indication */
+		ebuf[0] = 0x00;
+		memcpy(ebuf + 1, crgram, 256);
+		apdus[0].lc = apdus[0].datalen = sizeof(ebuf);
+		apdus[0].data = ebuf;
+		apdus[0].le = 256;
+		apdus[0].resp = rbuf;
+		apdus[0].resplen = sizeof(rbuf);
+
+		r = sc_transmit_apdu(card, &apdus[0]);
+		LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
+		if (apdus[0].sw1 == 0x90 && apdus[0].sw2 == 0x00) {
+			len = apdus[0].resplen > outlen ? outlen : apdus[0].resplen;
+			memcpy(out, rbuf, len);
+			LOG_FUNC_RETURN(card->ctx, (int)len);
+		}
+		if (apdus[0].sw1 != 0x67 && apdus[0].sw1 != 0x6D && apdus[0].sw1 != 0x6E)
+			LOG_FUNC_RETURN(card->ctx, sc_check_sw(card, apdus[0].sw1, apdus[0].sw2));
+
+		/* the length was not accepted: fall back to two short APDUs */
+		sc_log(card->ctx, "Extended APDU refused, disabling them");
+		card->caps &= ~SC_CARD_CAP_APDU_EXT;
+	}
+
+	/* INS: 0x2A  PERFORM SECURITY OPERATION
+	    * P1:  0x80  Resp: Plain value
+	    * P2:  0x86  Cmd: Padding indicator byte followed by cryptogram */
+	sc_format_apdu(card, &apdus[0], SC_APDU_CASE_3_SHORT, 0x2A, 0x80, 0x86);
+	/* padding indicator byte, 0x81 = first half of 2048 bit cryptogram */
+	sbuf[0][0] = 0x81;
+	memcpy(sbuf[0] + 1, crgram, 128);
+	apdus[0].lc = apdus[0].datalen = 129;
+	apdus[0].data = sbuf[0];
+
+	sc_format_apdu(card, &apdus[1], SC_APDU_CASE_4_SHORT, 0x2A, 0x80, 0x86);
+	/* padding indicator byte, 0x82 = Second half of 2048 bit cryptogram */
+	sbuf[1][0] = 0x82;
+	memcpy(sbuf[1] + 1, crgram + 128, 128);
+	apdus[1].lc = apdus[1].datalen = 129;
+	apdus[1].data = sbuf[1];
+	apdus[1].le = 256;
+	apdus[1].resp = rbuf;
+	apdus[1].resplen = sizeof(rbuf);
+
+	r = sc_transmit_apdus(card, apdus, 2);
+	LOG_TEST_RET(card->ctx, r, "Decipher failed");
+
+	len = apdus[1].resplen > outlen ? outlen : apdus[1].resplen;
+	memcpy(out, rbuf, len);
+	LOG_FUNC_RETURN(card->ctx, (int)len);
+}
+
+
 static int myeid_decipher(struct sc_card *card, const u8 * crgram,
 		size_t crgram_len, u8 * out, size_t outlen)
 {
@@ -1114,32 +1195,23 @@ static int myeid_decipher(struct sc_card *card, const u8 * crgram,
 	if (crgram_len > 256)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
 
+	if (crgram_len == 256) {
+		r = myeid_decipher_2048(card, crgram, out, outlen);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
 	/* INS: 0x2A  PERFORM SECURITY OPERATION
 	    * P1:  0x80  Resp: Plain value
 	    * P2:  0x86  Cmd: Padding indicator byte followed by cryptogram */
-	sc_format_apdu(card, &apdu,
-		(crgram_len < 256) ? SC_APDU_CASE_4_SHORT : SC_APDU_CASE_3_SHORT,
-		0x2A, 0x80, 0x86);
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0x2A, 0x80, 0x86);
 
 	apdu.resp = rbuf;
 	apdu.resplen = sizeof(rbuf);
 	apdu.le = crgram_len;
 
-	if (crgram_len == 256)
-	{
-		apdu.le = 0;
-		/* padding indicator byte, 0x81 = first half of 2048 bit cryptogram */
-		sbuf[0] = 0x81;
-		memcpy(sbuf + 1, crgram, crgram_len / 2);
-		apdu.lc = crgram_len / 2 + 1;
-	}
-	else
-	{
-		sbuf[0] = 0; /* padding indicator byte, 0x00 = No further indication */
-		memcpy(sbuf + 1, crgram, crgram_len);
-		apdu.lc = crgram_len + 1;
-	}
-
+	sbuf[0] = 0; /* padding indicator byte, 0x00 = No further indication */
+	memcpy(sbuf + 1, crgram, crgram_len);
+	apdu.lc = crgram_len + 1;
 	apdu.datalen = apdu.lc;
 	apdu.data = sbuf;
 
@@ -1147,39 +1219,10 @@ static int myeid_decipher(struct sc_card *card, const u8 * crgram,
 	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
 	if (apdu.sw1 == 0x90 && apdu.sw2 == 0x00)
 	{
-		if (crgram_len == 256)
-		{
-			sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT,
-				0x2A, 0x80, 0x86);
-			apdu.resp = rbuf;
-			apdu.resplen = sizeof(rbuf);
-			apdu.le = crgram_len;
-			/* padding indicator byte,
-			    * 0x82 = Second half of 2048 bit cryptogram */
-			sbuf[0] = 0x82;
-			memcpy(sbuf + 1, crgram + crgram_len / 2, crgram_len / 2);
-			apdu.lc = crgram_len / 2 + 1;
-			apdu.datalen = apdu.lc;
-			apdu.data = sbuf;
-
-			r = sc_transmit_apdu(card, &apdu);
-
-			LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
-
-			if (apdu.sw1 == 0x90 && apdu.sw2 == 0x00)
-			{
-				int len = apdu.resplen > outlen ? outlen : apdu.resplen;
-				memcpy(out, apdu.resp, len);
-				LOG_FUNC_RETURN(card->ctx, len);
-			}
-		}
-		else
-		{
-			int len = apdu.resplen > outlen ? outlen : apdu.resplen;
+		int len = apdu.resplen > outlen ? outlen : apdu.resplen;
 
-			memcpy(out, apdu.resp, len);
-			LOG_FUNC_RETURN(card->ctx, len);
-		}
+		memcpy(out, apdu.resp, len);
+		LOG_FUNC_RETURN(card->ctx, len);
 	}
 	LOG_FUNC_RETURN(card->ctx, sc_check_sw(card, apdu.sw1, apdu.sw2));
 }
@@ -159,6 +159,7 @@ typedef struct pgp_blob {
 	sc_file_t *	file;
 	unsigned int	id;
 	int		status;
+	int		loaded;	/* contents are known, do not read again */
 
 	unsigned char *	data;
 	unsigned int	len;
@@ -844,6 +845,7 @@ pgp_set_blob(pgp_blob_t *blob, const u8 *data, size_t len)
 	blob->data = NULL;
 	blob->len    = 0;
 	blob->status = 0;
+	blob->loaded = 1;
 
 	if (len > 0) {
 		void *tmp = calloc(len, 1);
@@ -1051,10 +1053,14 @@ pgp_read_blob(sc_card_t *card, pgp_blob_t *blob)
 {
 	struct pgp_priv_data *priv = DRVDATA(card);
 
-	if (blob->data != NULL)
+	if (blob->loaded)
 		return SC_SUCCESS;
 	if (blob->info == NULL)
 		return blob->status;
+	/* the card does not have it: no need to ask again */
+	if (blob->status == SC_ERROR_DATA_OBJECT_NOT_FOUND
+			|| blob->status == SC_ERROR_FILE_NOT_FOUND)
+		return blob->status;
 
 	if (blob->info->get_fn) {	/* readable, top-level DO */
 		u8 	buffer[2048];
@@ -1200,6 +1206,39 @@ pgp_get_blob(sc_card_t *card, pgp_blob_t *blob, unsigned int id,
 }
 
 
+/* DOs only available as part of a constructed DO, and the DO containing them */
+static const struct {
+	unsigned int	id;
+	unsigned int	parent;
+} pgp_do_parents[] = {
+	{ 0x005b, 0x0065 },
+	{ 0x5f2d, 0x0065 },
+	{ 0x5f35, 0x0065 },
+	{ 0x0073, 0x006e },
+	{ 0x7f66, 0x006e },
+	{ 0x0093, 0x007a },
+};
+
+/**
+ * Internal: get the ID of the constructed DO a DO is part of, 0 if unknown.
+ */
+static unsigned int
+pgp_get_parent_id(unsigned int id)
+{
+	size_t i;
+
+	/* "discretionary data objects": algorithm attributes, PW status, fingerprints, ... */
+	if (id >= 0x00c0 && id <= 0x00cf)
+		return 0x0073;
+
+	for (i = 0; i < sizeof(pgp_do_parents) / sizeof(pgp_do_parents[0]); i++)
+		if (pgp_do_parents[i].id == id)
+			return pgp_do_parents[i].parent;
+
+	return 0;
+}
+
+
 /**
  * Internal: search recursively for a blob by ID below a given root.
  */
@@ -1208,12 +1247,23 @@ pgp_seek_blob(sc_card_t *card, pgp_blob_t *root, unsigned int id,
 		pgp_blob_t **ret)
 {
 	pgp_blob_t	*child;
+	unsigned int	parent_id;
 	int			r;
 
 	if ((r = pgp_get_blob(card, root, id, ret)) == 0)
 		/* the sought blob is right under root */
 		return r;
 
+	/* known place: only fetch the DOs on the way to it */
+	parent_id = pgp_get_parent_id(id);
+	if (parent_id == root->id)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (parent_id != 0) {
+		if (pgp_seek_blob(card, root, parent_id, &child) < 0)
+			return SC_ERROR_FILE_NOT_FOUND;
+		return pgp_get_blob(card, child, id, ret);
+	}
+
 	/* not found, seek deeper */
 	for (child = root->files; child; child = child->next) {
 		/* The DO of SIMPLE type or the DO holding certificate
@@ -2982,6 +3032,42 @@ pgp_erase_card(sc_card_t *card)
 }
 
 
+#ifdef ENABLE_OPENSSL
+/**
+ * Internal: change counter of the card, the hash of the key fingerprints
+ * and generation dates. They come with the application related data, so
+ * no APDU is needed after init. The signature counter is left out, it
+ * changes with every signature and not with the content.
+ */
+static int
+pgp_get_change_counter(sc_card_t *card, sc_cardctl_freshness_token_t *counter)
+{
+	pgp_blob_t *fingerprints, *dates;
+	u8 *data;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	fingerprints = pgp_find_blob(card, 0x00c5);
+	dates = pgp_find_blob(card, 0x00cd);
+	if (fingerprints == NULL || dates == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	data = malloc(fingerprints->len + dates->len + 1);
+	if (data == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	if (fingerprints->len)
+		memcpy(data, fingerprints->data, fingerprints->len);
+	if (dates->len)
+		memcpy(data + fingerprints->len, dates->data, dates->len);
+	SHA256(data, fingerprints->len + dates->len, counter->value);
+	counter->len = SHA256_DIGEST_LENGTH;
+	free(data);
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+#endif /* ENABLE_OPENSSL */
+
+
 /**
  * ABI: ISO 7816-9 CARD CTL - perform special card-specific operations.
  */
@@ -2999,6 +3085,11 @@ pgp_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 		break;
 
 #ifdef ENABLE_OPENSSL
+	case SC_CARDCTL_GET_CHANGE_COUNTER:
+		r = pgp_get_change_counter(card, (sc_cardctl_freshness_token_t *) ptr);
+		LOG_FUNC_RETURN(card->ctx, r);
+		break;
+
 	case SC_CARDCTL_OPENPGP_GENERATE_KEY:
 		r = pgp_gen_key(card, (sc_cardctl_openpgp_keygen_info_t *) ptr);
 		LOG_FUNC_RETURN(card->ctx, r);
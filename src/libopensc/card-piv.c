@@ -27,8 +27,10 @@
 #endif
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -45,6 +47,7 @@
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
+#include <openssl/sha.h>
 #endif /* ENABLE_OPENSSL */
 
 #include "internal.h"
@@ -127,17 +130,30 @@ enum {
  * If the file lilsted in the history object offCardCertURL was found,
  * its certs will be read into the cache and PIV_OBJ_CACHE_VALID set
  * and PIV_OBJ_CACHE_NOT_PRESENT unset.
+ * Certificates and public keys read from the card count against
+ * memory_cache_size and are dropped from the cache when evicted, they
+ * are read again when needed (see cache.c).
  */
 
 #define PIV_OBJ_CACHE_VALID			1
 #define PIV_OBJ_CACHE_NOT_PRESENT	8
 
+/*
+ * State of the persistent object cache, see piv_pcache_load():
+ * PIV_PCACHE_OFF   objects are not kept across processes.
+ * PIV_PCACHE_LOADED the cache file was checked against the card,
+ * objects read from the card from now on make it dirty.
+ */
+#define PIV_PCACHE_OFF		0
+#define PIV_PCACHE_LOADED	1
+
 typedef struct piv_obj_cache {
 	u8* obj_data;
 	size_t obj_len;
 	u8* internal_obj_data; /* like a cert in the object */
 	size_t internal_obj_len;
 	int flags;
+	struct sc_cache_entry mem;
 } piv_obj_cache_t;
 
 enum {
@@ -159,6 +175,7 @@ typedef struct piv_private_data {
 	u8* w_buf;   /* write_binary buffer */
 	size_t w_buf_len; /* length of w_buff */
 	piv_obj_cache_t obj_cache[PIV_OBJ_LAST_ENUM];
+	struct sc_cache mem_cache;	/* accounting of the evictable obj_cache entries */
 	int keysWithOnCardCerts;
 	int keysWithOffCardCerts;
 	char * offCardCertURL;
@@ -174,6 +191,8 @@ typedef struct piv_private_data {
 	unsigned int card_issues; /* card_issues flags for this card */
 	int object_test_verify; /* Can test this object to set verification state of card */
 	int yubico_version; /* 3 byte version number of NEO or Yubikey4  as integer */
+	int pcache_state; /* PIV_PCACHE_* */
+	int pcache_dirty; /* cache file must be rewritten at piv_finish */
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
@@ -667,6 +686,7 @@ static int piv_generate_key(sc_card_t *card,
 
 	if (r >= 0) {
 		const u8 *cp;
+		struct sc_asn1_tag_index index;
 		keydata->exponent = 0;
 
 		/* expected tag is 7f49.  */
@@ -684,16 +704,18 @@ static int piv_generate_key(sc_card_t *card,
 			goto err;
 		}
 
+		sc_asn1_index_tags(card->ctx, cp, in_len, &index);
+
 		/* if RSA vs EC */
 		if (keydata->key_bits > 0 ) {
-			tag = sc_asn1_find_tag(card->ctx, cp, in_len, 0x82, &taglen);
+			tag = sc_asn1_index_find(card->ctx, &index, 0x82, &taglen);
 			if (tag != NULL && taglen <= 4) {
 				keydata->exponent = 0;
 				for (i = 0; i < taglen;i++)
 					keydata->exponent = (keydata->exponent<<8) + tag[i];
 			}
 
-			tag = sc_asn1_find_tag(card->ctx, cp, in_len, 0x81, &taglen);
+			tag = sc_asn1_index_find(card->ctx, &index, 0x81, &taglen);
 			if (tag != NULL && taglen > 0) {
 				keydata->pubkey = malloc(taglen);
 				if (keydata->pubkey == NULL)
@@ -703,7 +725,7 @@ static int piv_generate_key(sc_card_t *card,
 			}
 		}
 		else { /* must be EC */
-			tag = sc_asn1_find_tag(card->ctx, cp, in_len, 0x86, &taglen);
+			tag = sc_asn1_index_find(card->ctx, &index, 0x86, &taglen);
 			if (tag != NULL && taglen > 0) {
 				keydata->ecpoint = malloc(taglen);
 				if (keydata->ecpoint == NULL)
@@ -983,6 +1005,49 @@ err:
 }
 
 
+/*
+ * Objects that may be kept in the persistent object cache. These are
+ * readable without the PIN; the printed information, fingerprints and
+ * facial image are never written to disk.
+ */
+static int
+piv_pcache_persistable(int enumtag)
+{
+	switch (enumtag) {
+		case PIV_OBJ_CCC:
+		case PIV_OBJ_CHUI:
+		case PIV_OBJ_DISCOVERY:
+		case PIV_OBJ_HISTORY:
+			return 1;
+	}
+	return (piv_objects[enumtag].flags & PIV_OBJECT_TYPE_CERT) != 0;
+}
+
+
+/* called from sc_lock(), the object is read again from the card when needed */
+static int
+piv_cache_evict(struct sc_cache *cache, struct sc_cache_entry *mem)
+{
+	piv_private_data_t * priv = cache->data;
+	piv_obj_cache_t *obj = (piv_obj_cache_t *)
+		((u8 *) mem - offsetof(piv_obj_cache_t, mem));
+	int enumtag = (int) (obj - priv->obj_cache);
+
+	/* read_binary returns the object in chunks from the cache */
+	if (priv->selected_obj >= 0 && piv_objects[priv->selected_obj].enumtag == enumtag
+			&& priv->rwb_state >= 0)
+		return 1;
+
+	free(obj->obj_data);
+	free(obj->internal_obj_data);
+	obj->obj_data = NULL;
+	obj->obj_len = 0;
+	obj->internal_obj_data = NULL;
+	obj->internal_obj_len = 0;
+	obj->flags = 0;
+	return 0;
+}
+
 static int
 piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 {
@@ -1017,6 +1082,7 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 		*buf = priv->obj_cache[enumtag].obj_data;
 		*buf_len = priv->obj_cache[enumtag].obj_len;
 		r = *buf_len;
+		sc_cache_hit(&priv->mem_cache, &priv->obj_cache[enumtag].mem);
 		goto ok;
 	}
 
@@ -1034,14 +1100,24 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 
 	/* Not cached, try to get it, piv_get_data will allocate a buf */
 	sc_log(card->ctx, "get #%d",  enumtag);
+	if (piv_objects[enumtag].flags & (PIV_OBJECT_TYPE_CERT | PIV_OBJECT_TYPE_PUBKEY))
+		sc_cache_miss(&priv->mem_cache);
 	rbuflen = 1;
 	r = piv_get_data(card, enumtag, &rbuf, &rbuflen);
+	if ((r >= 0 || r == SC_ERROR_FILE_NOT_FOUND)
+			&& priv->pcache_state == PIV_PCACHE_LOADED
+			&& piv_pcache_persistable(enumtag))
+		priv->pcache_dirty = 1;
 	if (r > 0) {
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 		priv->obj_cache[enumtag].obj_len = r;
 		priv->obj_cache[enumtag].obj_data = rbuf;
 		*buf = rbuf;
 		*buf_len = r;
+		if (piv_objects[enumtag].flags & (PIV_OBJECT_TYPE_CERT | PIV_OBJECT_TYPE_PUBKEY)) {
+			sc_cache_register(card, &priv->mem_cache, "piv", piv_cache_evict, priv);
+			sc_cache_add(&priv->mem_cache, &priv->obj_cache[enumtag].mem, r);
+		}
 
 		sc_log(card->ctx,
 		       "added #%d  %p:%"SC_FORMAT_LEN_SIZE_T"u %p:%"SC_FORMAT_LEN_SIZE_T"u",
@@ -1053,7 +1129,7 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 
 	} else if (r == 0 || r == SC_ERROR_FILE_NOT_FOUND) {
 		r = SC_ERROR_FILE_NOT_FOUND;
-		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_NOT_PRESENT;
 		priv->obj_cache[enumtag].obj_len = 0;
 	} else if ( r < 0) {
 		goto err;
@@ -1073,6 +1149,7 @@ piv_cache_internal_data(sc_card_t *card, int enumtag)
 	const u8* body;
 	size_t taglen;
 	size_t bodylen;
+	struct sc_asn1_tag_index index;
 	int compressed = 0;
 
 	/* if already cached */
@@ -1096,13 +1173,14 @@ piv_cache_internal_data(sc_card_t *card, int enumtag)
 	/* get the certificate out */
 	 if (piv_objects[enumtag].flags & PIV_OBJECT_TYPE_CERT) {
 
-		tag = sc_asn1_find_tag(card->ctx, body, bodylen, 0x71, &taglen);
+		sc_asn1_index_tags(card->ctx, body, bodylen, &index);
+		tag = sc_asn1_index_find(card->ctx, &index, 0x71, &taglen);
 		/* 800-72-1 not clear if this is 80 or 01 Sent comment to NIST for 800-72-2 */
 		/* 800-73-3 says it is 01, keep dual test so old cards still work */
 		if (tag && (((*tag) & 0x80) || ((*tag) & 0x01)))
 			compressed = 1;
 
-		tag = sc_asn1_find_tag(card->ctx, body, bodylen, 0x70, &taglen);
+		tag = sc_asn1_index_find(card->ctx, &index, 0x70, &taglen);
 		if (tag == NULL)
 			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OBJECT_NOT_VALID);
 
@@ -1157,6 +1235,8 @@ piv_cache_internal_data(sc_card_t *card, int enumtag)
 	       enumtag,
 	       priv->obj_cache[enumtag].internal_obj_data,
 	       priv->obj_cache[enumtag].internal_obj_len);
+	sc_cache_resize(&priv->mem_cache, &priv->obj_cache[enumtag].mem,
+		priv->obj_cache[enumtag].obj_len + priv->obj_cache[enumtag].internal_obj_len);
 
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
@@ -1368,6 +1448,9 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 		/* if  cached, remove old entry */
 		if (priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID) {
 			priv->obj_cache[enumtag].flags = 0;
+			sc_cache_remove(&priv->mem_cache, &priv->obj_cache[enumtag].mem);
+			if (priv->pcache_state == PIV_PCACHE_LOADED)
+				priv->pcache_dirty = 1;
 			if (priv->obj_cache[enumtag].obj_data) {
 				free(priv->obj_cache[enumtag].obj_data);
 				priv->obj_cache[enumtag].obj_data = NULL;
@@ -2088,6 +2171,7 @@ piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* serial)
 	const u8 *fascn;
 	const u8 *guid;
 	size_t rbuflen = 0, bodylen, fascnlen, guidlen;
+	struct sc_asn1_tag_index index;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	if (card->serialnr.len)   {
@@ -2109,8 +2193,9 @@ piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* serial)
 	if (rbuflen != 0) {
 		body = sc_asn1_find_tag(card->ctx, rbuf, rbuflen, 0x53, &bodylen); /* Pass the outer wrapper asn1 */
 		if (body != NULL && bodylen != 0) {
-			fascn = sc_asn1_find_tag(card->ctx, body, bodylen, 0x30, &fascnlen); /* Find the FASC-N data */
-			guid = sc_asn1_find_tag(card->ctx, body, bodylen, 0x34, &guidlen);
+			sc_asn1_index_tags(card->ctx, body, bodylen, &index);
+			fascn = sc_asn1_index_find(card->ctx, &index, 0x30, &fascnlen); /* Find the FASC-N data */
+			guid = sc_asn1_index_find(card->ctx, &index, 0x34, &guidlen);
 
 			gbits = 0; /* if guid is valid, gbits will not be zero */
 			if (guid && guidlen == 16) {
@@ -2144,6 +2229,46 @@ piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* serial)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/*
+ * Change counter: hash of the CHUID and the History object. They are read
+ * at init, so this costs no APDU. The persistent object cache relies on
+ * the same two objects to notice a changed card.
+ */
+static int
+piv_get_change_counter(sc_card_t *card, sc_cardctl_freshness_token_t *counter)
+{
+	int r;
+#ifdef ENABLE_OPENSSL
+	u8 *chui = NULL, *history = NULL, *data;
+	size_t chui_len = 0, history_len = 0;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	r = piv_get_cached_data(card, PIV_OBJ_CHUI, &chui, &chui_len);
+	LOG_TEST_RET(card->ctx, r, "Failure retrieving CHUI");
+	r = piv_get_cached_data(card, PIV_OBJ_HISTORY, &history, &history_len);
+	if (r == SC_ERROR_FILE_NOT_FOUND)
+		history_len = 0;
+	else
+		LOG_TEST_RET(card->ctx, r, "Failure retrieving History");
+
+	data = malloc(chui_len + history_len);
+	if (data == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(data, chui, chui_len);
+	if (history_len)
+		memcpy(data + chui_len, history, history_len);
+	SHA256(data, chui_len + history_len, counter->value);
+	counter->len = SHA256_DIGEST_LENGTH;
+	free(data);
+	r = SC_SUCCESS;
+#else
+	sc_log(card->ctx, "OpenSSL Required");
+	r = SC_ERROR_NOT_SUPPORTED;
+#endif /* ENABLE_OPENSSL */
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
 /*
  * If the object can not be present on the card, because the History
  * object is not present or the History object says its not present,
@@ -2213,6 +2338,9 @@ static int piv_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 		case SC_CARDCTL_GET_SERIALNR:
 			return piv_get_serial_nr_from_CHUI(card, (sc_serial_number_t *) ptr);
 			break;
+		case SC_CARDCTL_GET_CHANGE_COUNTER:
+			return piv_get_change_counter(card, (sc_cardctl_freshness_token_t *) ptr);
+			break;
 		case SC_CARDCTL_PIV_PIN_PREFERENCE:
 			return piv_get_pin_preference(card, ptr);
 			break;
@@ -2585,6 +2713,7 @@ static int piv_parse_discovery(sc_card_t *card, u8 * rbuf, size_t rbuflen, int a
 	size_t aidlen;
 	const u8 * pinp;
 	size_t pinplen;
+	struct sc_asn1_tag_index index;
 	unsigned int cla_out, tag_out;
 
 
@@ -2601,7 +2730,8 @@ static int piv_parse_discovery(sc_card_t *card, u8 * rbuf, size_t rbuflen, int a
 	       cla_out, tag_out, body, bodylen);
 	if ( cla_out+tag_out == 0x7E && body != NULL && bodylen != 0) {
 		aidlen = 0;
-		aid = sc_asn1_find_tag(card->ctx, body, bodylen, 0x4F, &aidlen);
+		sc_asn1_index_tags(card->ctx, body, bodylen, &index);
+		aid = sc_asn1_index_find(card->ctx, &index, 0x4F, &aidlen);
 		sc_log(card->ctx, "Discovery aid=%p:%"SC_FORMAT_LEN_SIZE_T"u",
 		       aid, aidlen);
 			if (aid == NULL || aidlen < piv_aids[0].len_short ||
@@ -2611,7 +2741,7 @@ static int piv_parse_discovery(sc_card_t *card, u8 * rbuf, size_t rbuflen, int a
 				goto err;
 			}
 			if (aid_only == 0) {
-				pinp = sc_asn1_find_tag(card->ctx, body, bodylen, 0x5F2F, &pinplen);
+				pinp = sc_asn1_index_find(card->ctx, &index, 0x5F2F, &pinplen);
 				sc_log(card->ctx,
 				       "Discovery pinp=%p:%"SC_FORMAT_LEN_SIZE_T"u",
 				       pinp, pinplen);
@@ -2708,6 +2838,7 @@ piv_process_history(sc_card_t *card)
 	size_t numlen;
 	const u8 * url = NULL;
 	size_t urllen;
+	struct sc_asn1_tag_index index;
 	u8 * ocfhfbuf = NULL;
 	unsigned int cla_out, tag_out;
 	size_t ocfhflen;
@@ -2743,8 +2874,9 @@ piv_process_history(sc_card_t *card)
 		}
 
 		if ( cla_out+tag_out == 0x53 && body != NULL && bodylen != 0) {
+			sc_asn1_index_tags(card->ctx, body, bodylen, &index);
 			numlen = 0;
-			num = sc_asn1_find_tag(card->ctx, body, bodylen, 0xC1, &numlen);
+			num = sc_asn1_index_find(card->ctx, &index, 0xC1, &numlen);
 			if (num) {
 				if (numlen != 1 || *num > PIV_OBJ_RETIRED_X509_20-PIV_OBJ_RETIRED_X509_1+1) {
 					r = SC_ERROR_INTERNAL; /* TODO some other error */
@@ -2755,7 +2887,7 @@ piv_process_history(sc_card_t *card)
 			}
 
 			numlen = 0;
-			num = sc_asn1_find_tag(card->ctx, body, bodylen, 0xC2, &numlen);
+			num = sc_asn1_index_find(card->ctx, &index, 0xC2, &numlen);
 			if (num) {
 				if (numlen != 1 || *num > PIV_OBJ_RETIRED_X509_20-PIV_OBJ_RETIRED_X509_1+1) {
 					r = SC_ERROR_INTERNAL; /* TODO some other error */
@@ -2765,7 +2897,7 @@ piv_process_history(sc_card_t *card)
 				priv->keysWithOffCardCerts = *num;
 			}
 
-			url = sc_asn1_find_tag(card->ctx, body, bodylen, 0xF3, &urllen);
+			url = sc_asn1_index_find(card->ctx, &index, 0xF3, &urllen);
 			if (url) {
 				priv->offCardCertURL = calloc(1,urllen+1);
 				if (priv->offCardCertURL == NULL)
@@ -2886,6 +3018,15 @@ piv_process_history(sc_card_t *card)
 			*cp++ = 0x00;
 			put_tag_and_len(0xFE, 0, &cp);
 
+			/* may already be loaded from the persistent object cache */
+			sc_cache_remove(&priv->mem_cache, &priv->obj_cache[enumtag].mem);
+			if (priv->obj_cache[enumtag].obj_data)
+				free(priv->obj_cache[enumtag].obj_data);
+			if (priv->obj_cache[enumtag].internal_obj_data) {
+				free(priv->obj_cache[enumtag].internal_obj_data);
+				priv->obj_cache[enumtag].internal_obj_data = NULL;
+				priv->obj_cache[enumtag].internal_obj_len = 0;
+			}
 			priv->obj_cache[enumtag].obj_data = certobj;
 			priv->obj_cache[enumtag].obj_len = certobjlen;
 			priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
@@ -2913,6 +3054,214 @@ err:
 }
 
 
+/*
+ * Persistent object cache: the objects piv_pcache_persistable() accepts
+ * are kept in a file of the cache directory named after the serial number
+ * from the CHUID. The file starts with PIV_PCACHE_MAGIC and holds records
+ * of a one byte enumtag, a four byte big endian length and the object.
+ * A length of zero records an object the card does not have.
+ *
+ * The file is only used if its CHUID and History objects are identical
+ * to the ones just read from the card, so a returning card costs these
+ * two GET DATA commands instead of reading every certificate again.
+ */
+#define PIV_PCACHE_MAGIC	"PIVC\x01"
+#define PIV_PCACHE_MAGIC_LEN	5
+#define PIV_PCACHE_REC_HDR	5
+
+static int
+piv_pcache_filename(sc_card_t *card, char *buf, size_t bufsize)
+{
+	sc_serial_number_t serial;
+	char dir[PATH_MAX];
+	char serial_hex[2 * SC_MAX_SERIALNR + 1];
+	int r;
+
+	memset(&serial, 0, sizeof(serial));
+	r = piv_get_serial_nr_from_CHUI(card, &serial);
+	if (r != SC_SUCCESS)
+		return r;
+	if (serial.len == 0)
+		return SC_ERROR_INTERNAL;
+	sc_bin_to_hex(serial.value, serial.len, serial_hex, sizeof(serial_hex), 0);
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/piv_%s", dir, serial_hex);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+
+/* Walk the records of a cache file, install them if install is set */
+static int
+piv_pcache_parse(sc_card_t *card, const u8 *data, size_t len, int install)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	const u8 *p = data + PIV_PCACHE_MAGIC_LEN;
+	size_t left = len - PIV_PCACHE_MAGIC_LEN;
+	int checked = 0;
+	int count = 0;
+
+	while (left > 0) {
+		piv_obj_cache_t *obj;
+		int enumtag;
+		size_t rlen;
+
+		if (left < PIV_PCACHE_REC_HDR)
+			return SC_ERROR_INVALID_DATA;
+		enumtag = p[0];
+		rlen = ((size_t) p[1] << 24) | ((size_t) p[2] << 16)
+			| ((size_t) p[3] << 8) | p[4];
+		p += PIV_PCACHE_REC_HDR;
+		left -= PIV_PCACHE_REC_HDR;
+		if (enumtag >= PIV_OBJ_LAST_ENUM || !piv_pcache_persistable(enumtag)
+				|| rlen > left)
+			return SC_ERROR_INVALID_DATA;
+		obj = &priv->obj_cache[enumtag];
+
+		if (enumtag == PIV_OBJ_CHUI || enumtag == PIV_OBJ_HISTORY) {
+			/* freshly read from the card, must be unchanged */
+			if (!(obj->flags & PIV_OBJ_CACHE_VALID) || obj->obj_len != rlen
+					|| (rlen && memcmp(obj->obj_data, p, rlen)))
+				return SC_ERROR_INVALID_DATA;
+			checked++;
+		} else if (install && !(obj->flags & PIV_OBJ_CACHE_VALID)) {
+			if (rlen) {
+				obj->obj_data = malloc(rlen);
+				if (obj->obj_data == NULL)
+					return SC_ERROR_OUT_OF_MEMORY;
+				memcpy(obj->obj_data, p, rlen);
+			}
+			obj->obj_len = rlen;
+			obj->flags |= PIV_OBJ_CACHE_VALID;
+			count++;
+		}
+		p += rlen;
+		left -= rlen;
+	}
+
+	if (checked != 2)
+		return SC_ERROR_INVALID_DATA;
+	return count;
+}
+
+
+/*
+ * Called from piv_init with the card locked. Reads CHUID and History and
+ * fills the object cache from the cache file if it still matches the card.
+ */
+static void
+piv_pcache_load(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char fname[PATH_MAX];
+	u8 *rbuf = NULL;
+	size_t rbuflen = 0;
+	u8 *data = NULL;
+	long flen;
+	FILE *f;
+	int r;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	r = piv_get_cached_data(card, PIV_OBJ_CHUI, &rbuf, &rbuflen);
+	if (r < 0)
+		return;
+	r = piv_get_cached_data(card, PIV_OBJ_HISTORY, &rbuf, &rbuflen);
+	if (r < 0 && r != SC_ERROR_FILE_NOT_FOUND)
+		return;
+	if (piv_pcache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+
+	/* from now on the file is rewritten unless it is found current */
+	priv->pcache_state = PIV_PCACHE_LOADED;
+	priv->pcache_dirty = 1;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return;
+	if (fseek(f, 0, SEEK_END) != 0 || (flen = ftell(f)) < PIV_PCACHE_MAGIC_LEN
+			|| fseek(f, 0, SEEK_SET) != 0)
+		goto err;
+	data = malloc(flen);
+	if (data == NULL || fread(data, 1, flen, f) != (size_t) flen
+			|| memcmp(data, PIV_PCACHE_MAGIC, PIV_PCACHE_MAGIC_LEN))
+		goto err;
+
+	r = piv_pcache_parse(card, data, flen, 0);
+	if (r < 0) {
+		sc_log(card->ctx, "object cache %s does not match the card", fname);
+		goto err;
+	}
+	r = piv_pcache_parse(card, data, flen, 1);
+	if (r >= 0) {
+		sc_log(card->ctx, "loaded %d objects from %s", r, fname);
+		priv->pcache_dirty = 0;
+	}
+
+err:
+	if (data)
+		free(data);
+	fclose(f);
+}
+
+
+static void
+piv_pcache_save(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	FILE *f;
+	int i;
+	int ok = 1;
+
+	if (piv_pcache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return;
+
+	if (fwrite(PIV_PCACHE_MAGIC, 1, PIV_PCACHE_MAGIC_LEN, f) != PIV_PCACHE_MAGIC_LEN)
+		ok = 0;
+	for (i = 0; ok && i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		piv_obj_cache_t *obj = &priv->obj_cache[i];
+		u8 hdr[PIV_PCACHE_REC_HDR];
+
+		if (!piv_pcache_persistable(i) || !(obj->flags & PIV_OBJ_CACHE_VALID))
+			continue;
+		hdr[0] = (u8) i;
+		hdr[1] = (obj->obj_len >> 24) & 0xFF;
+		hdr[2] = (obj->obj_len >> 16) & 0xFF;
+		hdr[3] = (obj->obj_len >> 8) & 0xFF;
+		hdr[4] = obj->obj_len & 0xFF;
+		if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr)
+				|| (obj->obj_len && fwrite(obj->obj_data, 1, obj->obj_len, f) != obj->obj_len))
+			ok = 0;
+	}
+	if (fclose(f) != 0)
+		ok = 0;
+
+#ifdef _WIN32
+	if (ok)
+		unlink(fname);
+#endif
+	if (!ok || rename(tmpname, fname) != 0) {
+		sc_log(card->ctx, "cannot write the object cache %s", fname);
+		unlink(tmpname);
+	}
+}
+
+
 static int
 piv_finish(sc_card_t *card)
 {
@@ -2921,6 +3270,9 @@ piv_finish(sc_card_t *card)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	if (priv) {
+		sc_cache_unregister(&priv->mem_cache);
+		if (priv->pcache_state == PIV_PCACHE_LOADED && priv->pcache_dirty)
+			piv_pcache_save(card);
 		if (priv->w_buf)
 			free(priv->w_buf);
 		if (priv->offCardCertURL)
@@ -3129,6 +3481,55 @@ static int piv_match_card_continued(sc_card_t *card)
 }
 
 
+/*
+ * Called once from piv_init after the History and Discovery objects were
+ * processed. Marks every container known to be absent, so neither
+ * piv_get_cached_data nor the pkcs15 emulator probe for it any more:
+ * objects cached with zero length, i.e. not found on the card or recorded
+ * so in the persistent object cache. Retired key containers beyond the
+ * keysWithOnCardCerts count of the History object are already marked.
+ */
+static void piv_mark_absent_objects(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	int absent = 0;
+	int i;
+
+	for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		piv_obj_cache_t *obj = &priv->obj_cache[i];
+
+		if (piv_objects[i].flags & PIV_OBJECT_TYPE_PUBKEY)
+			continue;
+		if ((obj->flags & PIV_OBJ_CACHE_VALID) && obj->obj_len == 0)
+			obj->flags |= PIV_OBJ_CACHE_NOT_PRESENT;
+		if (obj->flags & PIV_OBJ_CACHE_NOT_PRESENT)
+			absent++;
+	}
+	sc_log(card->ctx, "%d objects can not be present", absent);
+}
+
+
+static int piv_pcache_enabled(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	scconf_block **blocks;
+	int enabled = 0;
+	int i;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", card->driver->short_name);
+		if (!blocks)
+			continue;
+		if (blocks[0])
+			enabled = scconf_get_bool(blocks[0], "persistent_object_cache", enabled);
+		free(blocks);
+	}
+	sc_log(ctx, "persistent object cache %s", enabled ? "enabled" : "disabled");
+	return enabled;
+}
+
+
 static int piv_init(sc_card_t *card)
 {
 	int r = 0;
@@ -3270,10 +3671,15 @@ static int piv_init(sc_card_t *card)
 	 * NIST 800-73-3 and NIST 800-73-2 so some older cards may 
 	 * not handle the request.
 	 */
+	if (piv_pcache_enabled(card))
+		piv_pcache_load(card);
+
 	piv_process_history(card);
 
 	piv_process_discovery(card);
 
+	piv_mark_absent_objects(card);
+
 	priv->pstate=PIV_STATE_NORMAL;
 	sc_unlock(card) ; /* obtained in piv_match */
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
@@ -34,6 +34,11 @@
 static const struct sc_card_operations *iso_ops = NULL;
 static struct sc_card_operations rtecp_ops;
 
+typedef struct rtecp_private_data {
+	/* algorithm flags of the last security environment set */
+	unsigned long algorithm_flags;
+} rtecp_private_data_t;
+
 static struct sc_card_driver rtecp_drv = {
 	"Rutoken ECP driver",
 	"rutoken_ecp",
@@ -62,12 +67,36 @@ static int rtecp_match_card(sc_card_t *card)
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, 0);
 }
 
+/* The card can hash GOST R 34.11 messages itself, when enabled with the
+ * gost_hash_on_card option of the card_driver block */
+static int rtecp_hash_on_card(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	scconf_block **blocks;
+	int enabled = 0;
+	int i;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", card->driver->short_name);
+		if (!blocks)
+			continue;
+		if (blocks[0])
+			enabled = scconf_get_bool(blocks[0], "gost_hash_on_card", enabled);
+		free(blocks);
+	}
+	return enabled;
+}
+
 static int rtecp_init(sc_card_t *card)
 {
 	sc_algorithm_info_t info;
 	unsigned long flags;
 
 	assert(card && card->ctx);
+	card->drv_data = calloc(1, sizeof(rtecp_private_data_t));
+	if (!card->drv_data)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
 	card->caps |= SC_CARD_CAP_RNG;
 	card->cla = 0;
 
@@ -88,11 +117,20 @@ static int rtecp_init(sc_card_t *card)
 	info.key_length = 256;
 	info.flags = SC_ALGORITHM_GOSTR3410_RAW | SC_ALGORITHM_ONBOARD_KEY_GEN
 		| SC_ALGORITHM_GOSTR3410_HASH_NONE;
+	if (rtecp_hash_on_card(card))
+		info.flags |= SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411;
 	_sc_card_add_algorithm(card, &info);
 
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, 0);
 }
 
+static int rtecp_finish(sc_card_t *card)
+{
+	free(card->drv_data);
+	card->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
 static void reverse(unsigned char *buf, size_t len)
 {
 	unsigned char tmp;
@@ -414,12 +452,61 @@ static int rtecp_decipher(sc_card_t *card,
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+static int rtecp_set_security_env(sc_card_t *card,
+		const sc_security_env_t *env, int se_num)
+{
+	rtecp_private_data_t *priv = card->drv_data;
+
+	assert(card && card->ctx && env && priv);
+	priv->algorithm_flags = env->algorithm_flags;
+	return iso_ops->set_security_env(card, env, se_num);
+}
+
+/* PSO: HASH of the whole message, sent with command chaining; the card
+ * returns the GOST R 34.11 hash in the order its PSO: CDS takes it */
+static int rtecp_hash(sc_card_t *card, const u8 *data, size_t data_len,
+		u8 *hash, size_t hash_len)
+{
+	sc_apdu_t apdu;
+	int r;
+
+	assert(card && card->ctx && (data || data_len == 0) && hash);
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0x2A, 0x90, 0x80);
+	apdu.lc = data_len;
+	apdu.data = data;
+	apdu.datalen = data_len;
+	apdu.resp = hash;
+	apdu.resplen = hash_len;
+	apdu.le = hash_len;
+	if (apdu.lc > 255)
+		apdu.flags |= SC_APDU_FLAGS_CHAINING;
+	r = sc_transmit_apdu(card, &apdu);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
+	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "HASH failed");
+	if (apdu.resplen != hash_len)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, (int)hash_len);
+}
+
 static int rtecp_compute_signature(sc_card_t *card,
 		const u8 *data, size_t data_len, u8 *out, size_t out_len)
 {
+	rtecp_private_data_t *priv = card->drv_data;
+	u8 hash[32];
 	int r;
 
-	assert(card && card->ctx && data && out);
+	assert(card && card->ctx && data && out && priv);
+	if (priv->algorithm_flags & SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411)
+	{
+		/* the message is hashed on the card, the hash is signed
+		 * as it comes out of the card */
+		r = rtecp_hash(card, data, data_len, hash, sizeof(hash));
+		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "On-card hash failed");
+		reverse(hash, sizeof(hash));
+		r = rtecp_cipher(card, hash, sizeof(hash), out, out_len, 1);
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
+	}
 	/* compute digital signature */
 	r = rtecp_cipher(card, data, data_len, out, out_len, 1);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
@@ -768,6 +855,7 @@ struct sc_card_driver * sc_get_rtecp_driver(void)
 
 	rtecp_ops.match_card = rtecp_match_card;
 	rtecp_ops.init = rtecp_init;
+	rtecp_ops.finish = rtecp_finish;
 	/* read_binary */
 	rtecp_ops.write_binary = NULL;
 	/* update_binary */
@@ -781,7 +869,7 @@ struct sc_card_driver * sc_get_rtecp_driver(void)
 	rtecp_ops.verify = rtecp_verify;
 	rtecp_ops.logout = rtecp_logout;
 	/* restore_security_env */
-	/* set_security_env */
+	rtecp_ops.set_security_env = rtecp_set_security_env;
 	rtecp_ops.decipher = rtecp_decipher;
 	rtecp_ops.compute_signature = rtecp_compute_signature;
 	rtecp_ops.change_reference_data = rtecp_change_reference_data;
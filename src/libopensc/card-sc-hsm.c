@@ -782,9 +782,8 @@ static int sc_hsm_logout(sc_card_t * card)
 
 
 
-static int sc_hsm_read_binary(sc_card_t *card,
-			       unsigned int idx, u8 *buf, size_t count,
-			       unsigned long flags)
+static int sc_hsm_read_ef_chunk(sc_card_t *card, int fid,
+			       unsigned int idx, u8 *buf, size_t count)
 {
 	sc_context_t *ctx = card->ctx;
 	sc_apdu_t apdu;
@@ -802,7 +801,7 @@ static int sc_hsm_read_binary(sc_card_t *card,
 	cmdbuff[3] = idx & 0xFF;
 
 	assert(count <= sc_get_max_recv_size(card));
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0xB1, 0x00, 0x00);
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0xB1, (fid >> 8) & 0xFF, fid & 0xFF);
 	apdu.data = cmdbuff;
 	apdu.datalen = 4;
 	apdu.lc = 4;
@@ -823,6 +822,45 @@ static int sc_hsm_read_binary(sc_card_t *card,
 
 
 
+static int sc_hsm_read_binary(sc_card_t *card,
+			       unsigned int idx, u8 *buf, size_t count,
+			       unsigned long flags)
+{
+	/* FID 0000 addresses the currently selected EF */
+	return sc_hsm_read_ef_chunk(card, 0, idx, buf, count);
+}
+
+
+
+/*
+ * Read an EF without selecting it first, using the largest responses the
+ * reader and card allow. Returns the number of bytes read.
+ */
+int sc_hsm_read_ef(sc_card_t *card, int fid, u8 *buf, size_t count)
+{
+	size_t max_le = sc_get_max_recv_size(card);
+	size_t todo, done = 0;
+	int r;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	while (done < count) {
+		todo = MIN(count - done, max_le);
+		r = sc_hsm_read_ef_chunk(card, fid, done, buf + done, todo);
+		if (r < 0) {
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		done += r;
+		if ((size_t)r < todo) {
+			break;
+		}
+	}
+
+	LOG_FUNC_RETURN(card->ctx, done);
+}
+
+
+
 static int sc_hsm_write_ef(sc_card_t *card,
 			       int fid,
 			       unsigned int idx, const u8 *buf, size_t count)
@@ -64,6 +64,7 @@ typedef struct sc_hsm_private_data {
 	u8 sopin[8];
 	u8 *EF_C_DevAut;
 	size_t EF_C_DevAut_len;
+	int filelist_cached;			/* File cache matches the current list of EFs */
 } sc_hsm_private_data_t;
 
 
@@ -28,10 +28,16 @@
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "reader-tr03119.h"
 #include "internal.h"
 #include "asn1.h"
+#include "iso7816.h"
+#include "gp.h"
+#include "probes.h"
 #include "common/compat_strlcpy.h"
 
 #ifdef ENABLE_SM
@@ -88,6 +94,8 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 
 	card->type = -1;
 	card->app_count = -1;
+	card->auth_serial = 1;
+	card->reset_serial = 1;
 
 	return card;
 }
@@ -149,7 +157,7 @@ size_t sc_get_max_recv_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_recv_size != 0
-			&& (card->reader->max_recv_size < card->max_recv_size))
+			&& (card->reader->max_recv_size < max_recv_size))
 		max_recv_size = card->reader->max_recv_size;
 
 	return max_recv_size;
@@ -177,12 +185,434 @@ size_t sc_get_max_send_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_send_size != 0
-			&& (card->reader->max_send_size < card->max_send_size))
+			&& (card->reader->max_send_size < max_send_size))
 		max_send_size = card->reader->max_send_size;
 
 	return max_send_size;
 }
 
+/* Number of ATRs for which the driver matched by probing is remembered */
+#define SC_ATR_INDEX_MATCHED_MAX 16
+
+struct sc_atr_index_entry {
+	u8 atr[SC_MAX_ATR_SIZE];	/* masked, if the entry has a mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+	size_t len;
+	int masked;
+	int driver;	/* index in ctx->card_drivers */
+	int entry;	/* index in the atr_map of the driver */
+};
+
+/* Lookup table for the ATRs configured for the card drivers, and the drivers
+ * that matched previously seen ATRs by probing */
+struct sc_atr_index {
+	struct sc_atr_index_entry *exact;	/* sorted by ATR */
+	size_t exact_count;
+	struct sc_atr_index_entry *masked;	/* in the order of the drivers */
+	size_t masked_count;
+	struct sc_atr_index_entry matched[SC_ATR_INDEX_MATCHED_MAX];
+	size_t matched_count;
+	size_t matched_next;
+};
+
+static int atr_index_entry_cmp(const void *a, const void *b)
+{
+	const struct sc_atr_index_entry *ea = a, *eb = b;
+	int r;
+
+	if (ea->len != eb->len)
+		return ea->len < eb->len ? -1 : 1;
+	r = memcmp(ea->atr, eb->atr, ea->len);
+	if (r)
+		return r;
+	/* keep the order of the drivers for equal ATRs */
+	if (ea->driver != eb->driver)
+		return ea->driver < eb->driver ? -1 : 1;
+	return ea->entry - eb->entry;
+}
+
+static int atr_index_atr_cmp(const void *key, const void *el)
+{
+	const struct sc_atr *atr = key;
+	const struct sc_atr_index_entry *e = el;
+
+	if (atr->len != e->len)
+		return atr->len < e->len ? -1 : 1;
+	return memcmp(atr->value, e->atr, atr->len);
+}
+
+/* Convert an ATR from the configuration in the form 3B:XX:..., for which
+ * match_atr_table() could match an ATR of the same length */
+static int atr_index_hex_to_bin(const char *hex, u8 *bin, size_t *len)
+{
+	size_t hex_len = strlen(hex);
+
+	*len = SC_MAX_ATR_SIZE;
+	if (sc_hex_to_bin(hex, bin, len) != SC_SUCCESS || *len == 0
+			|| hex_len != 3 * (*len) - 1)
+		return SC_ERROR_INVALID_DATA;
+	return SC_SUCCESS;
+}
+
+/* The drivers that matched seen ATRs are kept across processes in this file
+ * of the cache directory, one "ATR driver" line per ATR */
+#define SC_ATR_INDEX_CACHE_FILE "card_drivers"
+
+static int atr_index_cache_filename(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, SC_ATR_INDEX_CACHE_FILE);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static void atr_index_load_cache(sc_context_t *ctx, struct sc_atr_index *index)
+{
+	char fname[PATH_MAX], line[4 * SC_MAX_ATR_SIZE + 64];
+	FILE *f;
+
+	if (atr_index_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return;
+
+	while (index->matched_count < SC_ATR_INDEX_MATCHED_MAX
+			&& fgets(line, sizeof(line), f) != NULL) {
+		struct sc_atr_index_entry *e = &index->matched[index->matched_count];
+		char *name = strchr(line, ' ');
+		size_t i;
+
+		if (name == NULL)
+			continue;
+		*name++ = '\0';
+		name[strcspn(name, "\r\n")] = '\0';
+		if (atr_index_hex_to_bin(line, e->atr, &e->len) != SC_SUCCESS)
+			continue;
+		for (i = 0; ctx->card_drivers[i] != NULL; i++)
+			if (!strcmp(ctx->card_drivers[i]->short_name, name))
+				break;
+		if (ctx->card_drivers[i] == NULL)
+			continue;
+		e->driver = (int) i;
+		index->matched_count++;
+	}
+	fclose(f);
+	sc_log(ctx, "loaded %"SC_FORMAT_LEN_SIZE_T"u ATRs of matched card drivers", index->matched_count);
+}
+
+/* Called with ctx->mutex held */
+static void atr_index_save_cache(sc_context_t *ctx, struct sc_atr_index *index)
+{
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	char atr_hex[3 * SC_MAX_ATR_SIZE];
+	FILE *f;
+	size_t i;
+	int ok = 1;
+
+	if (atr_index_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+
+	f = fopen(tmpname, "w");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(ctx) < 0)
+			return;
+		f = fopen(tmpname, "w");
+	}
+	if (f == NULL)
+		return;
+
+	for (i = 0; i < index->matched_count; i++) {
+		const struct sc_atr_index_entry *e = &index->matched[i];
+
+		sc_bin_to_hex(e->atr, e->len, atr_hex, sizeof(atr_hex), ':');
+		if (fprintf(f, "%s %s\n", atr_hex, ctx->card_drivers[e->driver]->short_name) < 0)
+			ok = 0;
+	}
+	if (fclose(f) != 0)
+		ok = 0;
+
+#ifdef _WIN32
+	if (ok)
+		unlink(fname);
+#endif
+	if (!ok || rename(tmpname, fname) != 0) {
+		sc_log(ctx, "cannot write the card drivers cache %s", fname);
+		unlink(tmpname);
+	}
+}
+
+void _sc_free_atr_index(sc_context_t *ctx)
+{
+	if (ctx == NULL || ctx->atr_index == NULL)
+		return;
+	free(ctx->atr_index->exact);
+	free(ctx->atr_index->masked);
+	free(ctx->atr_index);
+	ctx->atr_index = NULL;
+}
+
+int _sc_build_atr_index(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+	size_t i, j, s, count = 0;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	_sc_free_atr_index(ctx);
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++)
+		count += ctx->card_drivers[i]->natrs;
+
+	index = calloc(1, sizeof *index);
+	if (index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (count) {
+		index->exact = calloc(count, sizeof *index->exact);
+		index->masked = calloc(count, sizeof *index->masked);
+		if (index->exact == NULL || index->masked == NULL) {
+			free(index->exact);
+			free(index->masked);
+			free(index);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+	}
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *driver = ctx->card_drivers[i];
+
+		/* sc_connect_card() ignores the ATRs assigned to the default driver */
+		if (driver->atr_map == NULL || !strcmp(driver->short_name, "default"))
+			continue;
+
+		for (j = 0; driver->atr_map[j].atr != NULL; j++) {
+			const struct sc_atr_table *src = &driver->atr_map[j];
+			struct sc_atr_index_entry *e;
+			size_t mask_len;
+
+			if (src->atrmask == NULL) {
+				e = &index->exact[index->exact_count];
+				if (atr_index_hex_to_bin(src->atr, e->atr, &e->len) != SC_SUCCESS)
+					continue;
+				index->exact_count++;
+			} else {
+				e = &index->masked[index->masked_count];
+				if (atr_index_hex_to_bin(src->atr, e->atr, &e->len) != SC_SUCCESS
+						|| atr_index_hex_to_bin(src->atrmask, e->mask, &mask_len) != SC_SUCCESS
+						|| mask_len != e->len)
+					continue;
+				for (s = 0; s < e->len; s++)
+					e->atr[s] &= e->mask[s];
+				e->masked = 1;
+				index->masked_count++;
+			}
+			e->driver = (int) i;
+			e->entry = (int) j;
+		}
+	}
+
+	if (index->exact_count)
+		qsort(index->exact, index->exact_count, sizeof *index->exact, atr_index_entry_cmp);
+
+	if (ctx->flags & SC_CTX_FLAG_CACHE_CARD_DRIVERS)
+		atr_index_load_cache(ctx, index);
+
+	ctx->atr_index = index;
+	sc_log(ctx, "ATR index: %"SC_FORMAT_LEN_SIZE_T"u exact and %"SC_FORMAT_LEN_SIZE_T"u masked ATRs",
+			index->exact_count, index->masked_count);
+	return SC_SUCCESS;
+}
+
+/* Find the first driver (in the order of ctx->card_drivers) that has the ATR
+ * in its configured atr_map. Returns the index of the driver or -1 */
+static int match_atr_index(sc_context_t *ctx, const struct sc_atr *atr, int *entry)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	const struct sc_atr_index_entry *found = NULL, *e;
+	u8 masked[SC_MAX_ATR_SIZE];
+	size_t i, s;
+
+	if (index == NULL || atr->len > SC_MAX_ATR_SIZE)
+		return -1;
+
+	e = bsearch(atr, index->exact, index->exact_count, sizeof *index->exact, atr_index_atr_cmp);
+	if (e != NULL) {
+		/* the first of the equal ATRs belongs to the first driver */
+		while (e > index->exact && atr_index_atr_cmp(atr, e - 1) == 0)
+			e--;
+		found = e;
+	}
+
+	for (i = 0; i < index->masked_count; i++) {
+		e = &index->masked[i];
+		if (found && (e->driver > found->driver
+					|| (e->driver == found->driver && e->entry > found->entry)))
+			break;
+		if (e->len != atr->len)
+			continue;
+		for (s = 0; s < e->len; s++)
+			masked[s] = atr->value[s] & e->mask[s];
+		if (memcmp(masked, e->atr, e->len) == 0) {
+			found = e;
+			break;
+		}
+	}
+
+	if (found == NULL)
+		return -1;
+	*entry = found->entry;
+	return found->driver;
+}
+
+/* Returns the index of the driver that matched the ATR by probing the last
+ * time it was seen, or -1 */
+static int atr_index_get_matched(sc_context_t *ctx, const struct sc_atr *atr)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	int driver = -1;
+	size_t i;
+
+	if (index == NULL)
+		return -1;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; i < index->matched_count; i++) {
+		if (atr_index_atr_cmp(atr, &index->matched[i]) == 0) {
+			driver = index->matched[i].driver;
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	return driver;
+}
+
+static void atr_index_set_matched(sc_context_t *ctx, const struct sc_atr *atr, int driver)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	struct sc_atr_index_entry *e = NULL;
+	size_t i;
+
+	if (index == NULL || atr->len > SC_MAX_ATR_SIZE)
+		return;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; i < index->matched_count; i++) {
+		if (atr_index_atr_cmp(atr, &index->matched[i]) == 0) {
+			e = &index->matched[i];
+			break;
+		}
+	}
+	if (e == NULL) {
+		if (index->matched_count < SC_ATR_INDEX_MATCHED_MAX) {
+			e = &index->matched[index->matched_count++];
+		} else {
+			/* replace the oldest entry */
+			e = &index->matched[index->matched_next];
+			index->matched_next = (index->matched_next + 1) % SC_ATR_INDEX_MATCHED_MAX;
+		}
+		memcpy(e->atr, atr->value, atr->len);
+		e->len = atr->len;
+	}
+	else if (e->driver == driver) {
+		sc_mutex_unlock(ctx, ctx->mutex);
+		return;
+	}
+	e->driver = driver;
+	if (ctx->flags & SC_CTX_FLAG_CACHE_CARD_DRIVERS)
+		atr_index_save_cache(ctx, index);
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+/* Try to match and initialize the card with one of the card drivers.
+ * Returns 1 if the driver accepted the card, 0 if not and an error code if
+ * the driver failed to initialize the card. */
+static int connect_probe_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	sc_context_t *ctx = card->ctx;
+	const struct sc_card_operations *ops = drv->ops;
+	int r;
+
+	if (ops == NULL || ops->match_card == NULL)   {
+		return 0;
+	}
+	else if (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
+			&& !strcmp("default", drv->short_name))   {
+		sc_log(ctx , "ignore 'default' card driver");
+		return 0;
+	}
+
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_log(ctx, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	if (r) {
+		sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
+/* If the driver left the APDU sizes to us, use extended length APDUs when
+ * both the card (historical bytes or EF.ATR) and the reader support them. */
+static void connect_detect_ext_apdu(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_reader_t *reader = card->reader;
+	const u8 *hist = reader->atr_info.hist_bytes;
+	size_t hist_len = reader->atr_info.hist_bytes_len;
+	const u8 *caps = NULL;
+	size_t caps_len = 0;
+	int ext = 0;
+
+	if (card->caps & SC_CARD_CAP_APDU_EXT
+			|| card->max_recv_size != 0 || card->max_send_size != 0
+			|| reader->active_protocol == SC_PROTO_T0)
+		return;
+	if (reader->max_recv_size != 0
+			&& reader->max_recv_size <= SC_READER_SHORT_APDU_MAX_RECV_SIZE)
+		return;
+
+	/* ISO 7816-4 card capabilities, third software function table */
+	if (hist != NULL && hist_len > 0) {
+		if (hist[0] == 0x80 && hist_len > 1)
+			caps = sc_compacttlv_find_tag(hist + 1, hist_len - 1, 0x73, &caps_len);
+		else if (hist[0] == 0x00 && hist_len > 4)
+			caps = sc_compacttlv_find_tag(hist + 1, hist_len - 4, 0x73, &caps_len);
+	}
+	if (caps != NULL && caps_len >= 3 && (caps[2] & ISO7816_CAP_EXTENDED_LENGTH))
+		ext = 1;
+
+	if (card->ef_atr != NULL
+			&& (card->ef_atr->card_capabilities & ISO7816_CAP_EXTENDED_LENGTH)) {
+		ext = 1;
+		/* subtract SW1-SW2 and header, Lc and Le of the command */
+		if (card->ef_atr->max_response_apdu > SC_READER_SHORT_APDU_MAX_RECV_SIZE + 2)
+			card->max_recv_size = card->ef_atr->max_response_apdu - 2;
+		if (card->ef_atr->max_command_apdu > SC_READER_SHORT_APDU_MAX_SEND_SIZE + 9)
+			card->max_send_size = card->ef_atr->max_command_apdu - 9;
+	}
+
+	if (ext) {
+		sc_log(ctx, "card announces extended length APDUs");
+		card->caps |= SC_CARD_CAP_APDU_EXT;
+	}
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
@@ -203,6 +633,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	r = reader->ops->connect(reader);
 	if (r)
 		goto err;
+	gp_card_cache_refresh(reader);
 
 	connected = 1;
 	card->reader = reader;
@@ -219,7 +650,11 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_log(ctx, "matching configured ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		if (ctx->atr_index != NULL) {
+			i = match_atr_index(ctx, &card->atr, &idx);
+			driver = i >= 0 ? _sc_load_card_driver(ctx, i) : NULL;
+		}
+		else for (i = 0; ctx->card_drivers[i] != NULL; i++) {
 			driver = ctx->card_drivers[i];
 
 			if (driver->atr_map == NULL ||
@@ -230,17 +665,21 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			sc_log(ctx, "trying driver '%s'", driver->short_name);
 			idx = _sc_match_atr(card, driver->atr_map, NULL);
 			if (idx >= 0) {
-				struct sc_atr_table *src = &driver->atr_map[idx];
-
-				sc_log(ctx, "matched driver '%s'", driver->name);
-				/* It's up to card driver to notice these correctly */
-				card->name = src->name;
-				card->type = src->type;
-				card->flags = src->flags;
-				break;
+				driver = _sc_load_card_driver(ctx, i);
+				if (driver != NULL)
+					break;
 			}
 			driver = NULL;
 		}
+		if (driver != NULL) {
+			struct sc_atr_table *src = &driver->atr_map[idx];
+
+			sc_log(ctx, "matched driver '%s'", driver->name);
+			/* It's up to card driver to notice these correctly */
+			card->name = src->name;
+			card->type = src->type;
+			card->flags = src->flags;
+		}
 	}
 
 	if (driver != NULL) {
@@ -262,8 +701,22 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 	else {
 		sc_card_t uninitialized = *card;
+		int matched = atr_index_get_matched(ctx, &card->atr);
+
+		/* Try the driver that matched this ATR before, then all drivers */
+		if (matched >= 0 && _sc_load_card_driver(ctx, matched) != NULL) {
+			struct sc_card_driver *drv = ctx->card_drivers[matched];
+
+			sc_log(ctx, "trying driver '%s', which matched the ATR before", drv->short_name);
+			r = connect_probe_driver(card, drv);
+			if (r < 0)
+				goto err;
+			if (r == 0)
+				sc_log(ctx, "driver '%s' did not match, probing all drivers", drv->short_name);
+		}
+
 		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		for (i = 0; card->driver == NULL && ctx->card_drivers[i] != NULL; i++) {
 			/* FIXME If we had a clean API description, we'd propably get a
 			 * cleaner implementation of the driver's match_card and init,
 			 * which should normally *not* modify the card object if
@@ -277,36 +730,14 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			 * `match_card()` and `init()`) */
 			*card = uninitialized;
 
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
-
-			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
-				continue;
-			}
-			else if (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
-				   	&& !strcmp("default", drv->short_name))   {
-				sc_log(ctx , "ignore 'default' card driver");
-				continue;
-			}
-
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
+			if ((int) i == matched || _sc_load_card_driver(ctx, i) == NULL)
 				continue;
-			sc_log(ctx, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
-					continue;
-				}
+			sc_log(ctx, "trying driver '%s'", ctx->card_drivers[i]->short_name);
+			r = connect_probe_driver(card, ctx->card_drivers[i]);
+			if (r < 0)
 				goto err;
-			}
-			break;
+			if (r == 1)
+				atr_index_set_matched(ctx, &card->atr, (int) i);
 		}
 	}
 	if (card->driver == NULL) {
@@ -317,6 +748,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	if (card->name == NULL)
 		card->name = card->driver->name;
 
+	connect_detect_ext_apdu(card);
+
 	/* initialize max_send_size/max_recv_size to a meaningful value */
 	card->max_recv_size = sc_get_max_recv_size(card);
 	card->max_send_size = sc_get_max_send_size(card);
@@ -363,7 +796,7 @@ int sc_disconnect_card(sc_card_t *card)
 			sc_log(ctx, "card driver finish() failed: %s", sc_strerror(r));
 	}
 
-	if (card->reader->ops->disconnect) {
+	if (!card->detached && card->reader->ops->disconnect) {
 		int r = card->reader->ops->disconnect(card->reader);
 		if (r)
 			sc_log(ctx, "disconnect() failed: %s", sc_strerror(r));
@@ -378,6 +811,73 @@ int sc_disconnect_card(sc_card_t *card)
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+int sc_detach_card(sc_card_t *card)
+{
+	if (!card)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (card->lock_count != 0)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_ALLOWED);
+	if (!card->detached && card->reader->ops->disconnect) {
+		int r = card->reader->ops->disconnect(card->reader);
+		if (r)
+			sc_log(card->ctx, "disconnect() failed: %s", sc_strerror(r));
+	}
+	card->detached = 1;
+	card->reattached = 0;
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
+int sc_reattach_card(sc_card_t *card, const struct sc_serial_number *serial)
+{
+	sc_reader_t *reader;
+	struct sc_serial_number serialnr;
+	int r;
+
+	if (!card || !serial || !card->detached)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	reader = card->reader;
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (reader->ops->connect == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	r = reader->ops->connect(reader);
+	LOG_TEST_RET(card->ctx, r, "connect() failed");
+	gp_card_cache_refresh(reader);
+	card->detached = 0;
+
+	/* the card starts over as after a reset */
+	sc_invalidate_cache(card);
+	card->auth_serial++;
+	card->reset_serial++;
+	card->reattached = 1;
+	memset(&card->serialnr, 0, sizeof card->serialnr);
+
+	if (reader->atr.len != card->atr.len
+			|| memcmp(reader->atr.value, card->atr.value, card->atr.len) != 0
+			|| reader->uid.len != card->uid.len
+			|| memcmp(reader->uid.value, card->uid.value, card->uid.len) != 0) {
+		r = SC_ERROR_WRONG_CARD;
+	} else {
+		memset(&serialnr, 0, sizeof serialnr);
+		r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serialnr);
+		if (r == SC_SUCCESS && (serialnr.len == 0 || serialnr.len != serial->len
+					|| memcmp(serialnr.value, serial->value, serialnr.len) != 0))
+			r = SC_ERROR_WRONG_CARD;
+	}
+	if (r != SC_SUCCESS) {
+		if (reader->ops->disconnect)
+			reader->ops->disconnect(reader);
+		card->detached = 1;
+		card->reattached = 0;
+		LOG_TEST_RET(card->ctx, r, "cannot take up the detached card again");
+	}
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
 int sc_reset(sc_card_t *card, int do_cold_reset)
 {
 	int r, r2;
@@ -393,6 +893,8 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
 	sc_invalidate_cache(card);
+	card->auth_serial++;
+	card->reset_serial++;
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -408,11 +910,13 @@ int sc_lock(sc_card_t *card)
 	int r = 0, r2 = 0;
 	int was_reset = 0;
 	int reader_lock_obtained  = 0;
+	int first_lock;
 
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	LOG_FUNC_CALLED(card->ctx);
+	SC_PROBE1(lock__wait, card);
 
 	r = sc_mutex_lock(card->ctx, card->mutex);
 	if (r != SC_SUCCESS)
@@ -421,19 +925,36 @@ int sc_lock(sc_card_t *card)
 		if (card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
 			while (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
-				sc_invalidate_cache(card);
+				/* nothing is cached between the retries */
+				if (was_reset == 0) {
+					sc_invalidate_cache(card);
+					card->auth_serial++;
+					card->reset_serial++;
+				}
 				if (was_reset++ > 4) /* TODO retry a few times */
 					break;
 				r = card->reader->ops->lock(card->reader);
 			}
-			if (r == 0)
+			if (r == 0) {
 				reader_lock_obtained = 1;
+				if (card->reattached) {
+					/* connected again by sc_reattach_card() */
+					card->reattached = 0;
+					was_reset = 1;
+				}
+				/* others may have selected a different file */
+				card->cache.selected_path.len = 0;
+				card->cache.selected_dir.len = 0;
+				card->cache.listed_dir.len = 0;
+				card->cache.se_valid = 0;
+			}
 		}
 		if (r == 0)
 			card->cache.valid = 1;
 	}
 	if (r == 0)
 		card->lock_count++;
+	first_lock = r == 0 && card->lock_count == 1;
 
 	if (r == 0 && was_reset > 0) {
 #ifdef ENABLE_SM
@@ -448,10 +969,15 @@ int sc_lock(sc_card_t *card)
 		r = r != SC_SUCCESS ? r : r2;
 	}
 
+	/* memory of cached objects evicted meanwhile, see cache.c */
+	if (first_lock)
+		sc_cache_collect(card);
+
 	/* give card driver a chance to do something when reader lock first obtained */
 	if (r == 0 && reader_lock_obtained == 1  && card->ops->card_reader_lock_obtained)
 		r = card->ops->card_reader_lock_obtained(card, was_reset);
 
+	SC_PROBE3(lock__acquire, card, first_lock, r);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -477,6 +1003,7 @@ int sc_unlock(sc_card_t *card)
 			 * the card cache useless. To not have a bad cache, we explicitly
 			 * invalidate it. */
 			sc_invalidate_cache(card);
+			card->auth_serial++;
 		}
 		/* release reader lock */
 		if (card->reader->ops->unlock != NULL)
@@ -488,12 +1015,24 @@ int sc_unlock(sc_card_t *card)
 		r = (r == SC_SUCCESS) ? r2 : r;
 	}
 
+	SC_PROBE2(lock__release, card, r);
 	return r;
 }
 
+/* The file system or the current file changed: forget what was selected
+ * and listed before */
+static void forget_selected_files(sc_card_t *card)
+{
+	card->cache.selected_path.len = 0;
+	card->cache.selected_dir.len = 0;
+	card->cache.listed_dir.len = 0;
+	card->cache.sfid_count = 0;
+}
+
 int sc_list_files(sc_card_t *card, u8 *buf, size_t buflen)
 {
-	int r;
+	struct sc_card_cache *cache;
+	int r, cacheable;
 
 	if (card == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -502,8 +1041,31 @@ int sc_list_files(sc_card_t *card, u8 *buf, size_t buflen)
 
 	if (card->ops->list_files == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	/* the listing is kept for the current DF, when it is known */
+	cache = &card->cache;
+	cacheable = (card->caps & SC_CARD_CAP_SELECT_CACHE) && card->lock_count > 0
+		&& cache->selected_dir.len != 0;
+	if (cacheable && cache->listed_dir.len == cache->selected_dir.len
+			&& memcmp(cache->listed_dir.value, cache->selected_dir.value,
+				cache->listed_dir.len) == 0) {
+		size_t len = cache->listed_len < buflen ? cache->listed_len : buflen & ~1;
+
+		sc_log(card->ctx, "files of the current DF already listed");
+		memcpy(buf, cache->listed_fids, len);
+		LOG_FUNC_RETURN(card->ctx, (int)len);
+	}
+
 	r = card->ops->list_files(card, buf, buflen);
 
+	/* a listing that filled the buffer may be truncated */
+	if (cacheable && r >= 0 && (size_t)r + 2 <= buflen
+			&& (size_t)r <= sizeof cache->listed_fids) {
+		cache->listed_dir = cache->selected_dir;
+		memcpy(cache->listed_fids, buf, r);
+		cache->listed_len = r;
+	}
+
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -534,6 +1096,7 @@ int sc_create_file(sc_card_t *card, sc_file_t *file)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
 	r = card->ops->create_file(card, file);
+	forget_selected_files(card);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -554,14 +1117,57 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	if (card->ops->delete_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->delete_file(card, path);
+	forget_selected_files(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/* Limits max to the chunk size that worked before for this card and reader */
+static size_t binary_chunk_size(sc_card_t *card, size_t max, int update)
+{
+	sc_reader_t *reader = card->reader;
+	size_t chunk;
+
+	if (reader->chunk_atr.len != card->atr.len
+			|| memcmp(reader->chunk_atr.value, card->atr.value, card->atr.len) != 0) {
+		reader->chunk_atr = card->atr;
+		reader->read_chunk_size = 0;
+		reader->update_chunk_size = 0;
+	}
+
+	chunk = update ? reader->update_chunk_size : reader->read_chunk_size;
+	if (chunk != 0 && chunk < max)
+		return chunk;
+	return max;
+}
+
+/* Remembers a smaller chunk size if a large transfer failed in a way that
+ * hints at the card or reader not coping with its length. Returns 1 if the
+ * transfer should be retried. */
+static int binary_chunk_backoff(sc_card_t *card, size_t count, int update, int r)
+{
+	sc_reader_t *reader = card->reader;
+	size_t min = update ? SC_READER_SHORT_APDU_MAX_SEND_SIZE : SC_READER_SHORT_APDU_MAX_RECV_SIZE;
+	size_t chunk;
+
+	if ((r != SC_ERROR_WRONG_LENGTH && r != SC_ERROR_TRANSMIT_FAILED)
+			|| count <= min)
+		return 0;
+
+	chunk = count / 2 > min ? count / 2 : min;
+	if (update)
+		reader->update_chunk_size = chunk;
+	else
+		reader->read_chunk_size = chunk;
+	sc_log(card->ctx, "%s of %"SC_FORMAT_LEN_SIZE_T"u bytes failed, retrying with %"SC_FORMAT_LEN_SIZE_T"u",
+			update ? "UPDATE BINARY" : "READ BINARY", count, chunk);
+	return 1;
+}
+
 int sc_read_binary(sc_card_t *card, unsigned int idx,
 		   unsigned char *buf, size_t count, unsigned long flags)
 {
-	size_t max_le = sc_get_max_recv_size(card);
+	size_t max_le;
 	int r;
 
 	if (card == NULL || card->ops == NULL || buf == NULL) {
@@ -571,6 +1177,7 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 	       count, idx);
 	if (count == 0)
 		return 0;
+	max_le = binary_chunk_size(card, sc_get_max_recv_size(card), 0);
 
 #ifdef ENABLE_SM
 	if (card->sm_ctx.ops.read_binary)   {
@@ -608,6 +1215,8 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, bytes_read);
 	}
 	r = card->ops->read_binary(card, idx, buf, count, flags);
+	if (r < 0 && binary_chunk_backoff(card, count, 0, r))
+		r = sc_read_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -660,7 +1269,7 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 int sc_update_binary(sc_card_t *card, unsigned int idx,
 		     const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = sc_get_max_send_size(card);
+	size_t max_lc;
 	int r;
 
 	if (card == NULL || card->ops == NULL || buf == NULL) {
@@ -670,6 +1279,7 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	       count, idx);
 	if (count == 0)
 		return 0;
+	max_lc = binary_chunk_size(card, sc_get_max_send_size(card), 1);
 
 #ifdef ENABLE_SM
 	if (card->sm_ctx.ops.update_binary)   {
@@ -709,6 +1319,8 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->update_binary(card, idx, buf, count, flags);
+	if (r < 0 && binary_chunk_backoff(card, count, 1, r))
+		r = sc_update_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -732,6 +1344,144 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 }
 
 
+static int find_sfid(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_card_cache *cache = &card->cache;
+	size_t i;
+
+	for (i = 0; i < cache->sfid_count; i++)
+		if (cache->sfid_path[i].len == path->len
+				&& memcmp(cache->sfid_path[i].value, path->value, path->len) == 0)
+			return (int)i;
+	return -1;
+}
+
+/* Tag 0x88 of the FCP holds the identifier in bits 8 to 4 */
+static void remember_sfid(sc_card_t *card, const sc_path_t *path, int sid)
+{
+	struct sc_card_cache *cache = &card->cache;
+	int i;
+
+	if (sid <= 0 || (sid & 0x07) != 0 || (sid >> 3) > 30)
+		return;
+
+	i = find_sfid(card, path);
+	if (i < 0) {
+		if (cache->sfid_count >= SC_MAX_CACHED_SFIDS)
+			return;
+		i = (int)cache->sfid_count++;
+		cache->sfid_path[i] = *path;
+	}
+	cache->sfid[i] = (u8)(sid >> 3);
+}
+
+/* Skips or shortens the SELECT based on what was selected before, for
+ * drivers with SC_CARD_CAP_SELECT_CACHE */
+static int select_file_cached(sc_card_t *card, const sc_path_t *in_path, sc_file_t **file)
+{
+	struct sc_card_cache *cache = &card->cache;
+	const sc_path_t *path = in_path;
+	sc_path_t rel;
+	int absolute, r;
+
+	/* only trusted while the card stays locked */
+	absolute = card->lock_count > 0
+		&& in_path->type == SC_PATH_TYPE_PATH && in_path->aid.len == 0
+		&& in_path->len >= 2
+		&& in_path->value[0] == 0x3F && in_path->value[1] == 0x00;
+
+	if (absolute && file == NULL
+			&& cache->selected_path.len == in_path->len
+			&& memcmp(cache->selected_path.value, in_path->value, in_path->len) == 0) {
+		sc_log(card->ctx, "file is already selected");
+		return SC_SUCCESS;
+	}
+
+	if (absolute && cache->listed_dir.len != 0
+			&& in_path->len == cache->listed_dir.len + 2
+			&& memcmp(cache->listed_dir.value, in_path->value, cache->listed_dir.len) == 0) {
+		size_t i;
+
+		for (i = 0; i + 1 < cache->listed_len; i += 2)
+			if (memcmp(cache->listed_fids + i, in_path->value + in_path->len - 2, 2) == 0)
+				break;
+		if (i + 1 >= cache->listed_len) {
+			sc_log(card->ctx, "file is not in the listing of its DF");
+			return SC_ERROR_FILE_NOT_FOUND;
+		}
+	}
+
+	if (absolute && cache->selected_dir.len != 0
+			&& in_path->len == cache->selected_dir.len + 2
+			&& memcmp(cache->selected_dir.value, in_path->value, cache->selected_dir.len) == 0) {
+		/* a child of the current DF */
+		memset(&rel, 0, sizeof rel);
+		rel.type = SC_PATH_TYPE_FILE_ID;
+		rel.len = 2;
+		memcpy(rel.value, in_path->value + in_path->len - 2, 2);
+		rel.index = in_path->index;
+		rel.count = in_path->count;
+		path = &rel;
+	}
+
+	r = card->ops->select_file(card, path, file);
+
+	cache->selected_path.len = 0;
+	cache->selected_dir.len = 0;
+	if (r != SC_SUCCESS || !absolute)
+		return r;
+
+	cache->selected_path = *in_path;
+	if (file != NULL && *file != NULL) {
+		cache->selected_dir = *in_path;
+		if ((*file)->type != SC_FILE_TYPE_DF)
+			cache->selected_dir.len -= 2;
+		if ((*file)->type == SC_FILE_TYPE_WORKING_EF
+				&& (*file)->ef_structure == SC_FILE_EF_TRANSPARENT)
+			remember_sfid(card, in_path, (*file)->sid);
+	}
+
+	return r;
+}
+
+
+int sc_read_file_by_sfid(sc_card_t *card, const sc_path_t *path, u8 **buf, size_t *len)
+{
+	struct sc_card_cache *cache;
+	int i, r;
+
+	if (card == NULL || path == NULL || buf == NULL || len == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	cache = &card->cache;
+
+	if (!(card->caps & SC_CARD_CAP_SELECT_CACHE) || card->lock_count == 0
+			|| path->type != SC_PATH_TYPE_PATH || path->aid.len != 0
+			|| cache->selected_dir.len == 0
+			|| path->len != cache->selected_dir.len + 2
+			|| memcmp(cache->selected_dir.value, path->value, cache->selected_dir.len) != 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	i = find_sfid(card, path);
+	if (i < 0)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	sc_log(card->ctx, "read %s by short EF identifier %u", sc_print_path(path), cache->sfid[i]);
+	*buf = NULL;
+	*len = 0;
+	r = iso7816_read_binary_sfid(card, cache->sfid[i], buf, len);
+
+	/* READ BINARY with a short EF identifier selects the EF */
+	cache->selected_path.len = 0;
+	if (r != SC_SUCCESS) {
+		free(*buf);
+		*buf = NULL;
+		*len = 0;
+		return r;
+	}
+	cache->selected_path = *path;
+
+	return SC_SUCCESS;
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
 	int r;
@@ -772,7 +1522,10 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
-	r = card->ops->select_file(card, in_path, file);
+	if (card->caps & SC_CARD_CAP_SELECT_CACHE)
+		r = select_file_cached(card, in_path, file);
+	else
+		r = card->ops->select_file(card, in_path, file);
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
 
 	if (file) {
@@ -873,6 +1626,55 @@ int sc_read_record(sc_card_t *card, unsigned int rec_nr, u8 *buf,
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+int sc_read_records(sc_card_t *card, unsigned int rec_nr, u8 *buf,
+		   size_t count, unsigned long flags)
+{
+	size_t len = 0, max_le;
+	int r;
+
+	if (card == NULL || buf == NULL || rec_nr == 0) {
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (card->ops->read_record == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	flags &= ~(SC_RECORD_ALL_FROM_REC_NR | SC_RECORD_BY_REC_NR);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
+	if (card->caps & SC_CARD_CAP_READ_ALL_RECORDS) {
+		max_le = sc_get_max_recv_size(card);
+		if (max_le > count)
+			max_le = count;
+		r = card->ops->read_record(card, rec_nr, buf, max_le,
+				flags | SC_RECORD_ALL_FROM_REC_NR);
+		/* a response as long as the APDU allows may miss records */
+		if (r < 0 || (size_t)r < max_le || max_le == count) {
+			sc_unlock(card);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		sc_log(card->ctx, "records do not fit into one response, read them one by one");
+	}
+
+	while (len < count && rec_nr <= 0xFE) {
+		r = card->ops->read_record(card, rec_nr, buf + len, count - len,
+				flags | SC_RECORD_BY_REC_NR);
+		if (r == SC_ERROR_RECORD_NOT_FOUND)
+			break;
+		if (r < 0) {
+			sc_unlock(card);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		len += r;
+		rec_nr++;
+	}
+	sc_unlock(card);
+
+	LOG_FUNC_RETURN(card->ctx, (int)len);
+}
+
 int sc_write_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 		    size_t count, unsigned long flags)
 {
@@ -1510,6 +2312,9 @@ sc_card_sm_check(struct sc_card *card)
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, rv, "Cannot initialize SM module");
 	}
 
+	if (scconf_get_bool(sm_conf_block, "keep_session", 0))
+		card->sm_ctx.sm_flags |= SM_FLAGS_KEEP_SESSION;
+
 	/* initialize SM session in the case of 'APDU TRANSMIT' SM mode */
 	sm_mode = scconf_get_str(sm_conf_block, "mode", NULL);
 	sc_log(ctx, "SM mode '%s'; 'open' handler %p", sm_mode, card->sm_ctx.ops.open);
@@ -44,6 +44,8 @@ enum {
 	SC_CARDCTL_GET_CHV_REFERENCE_IN_SE,
 	SC_CARDCTL_PKCS11_INIT_TOKEN,
 	SC_CARDCTL_PKCS11_INIT_PIN,
+	SC_CARDCTL_GET_FRESHNESS_TOKEN,
+	SC_CARDCTL_GET_CHANGE_COUNTER,
 
 	/*
 	 * GPK specific calls
@@ -340,6 +342,19 @@ typedef struct sc_cardctl_pkcs11_init_pin {
 	size_t			pin_len;
 } sc_cardctl_pkcs11_init_pin_t;
 
+/*
+ * Generic card_ctl calls: a value that changes whenever the content of the
+ * card changes, got with whatever is cheapest on the card.
+ * SC_CARDCTL_GET_CHANGE_COUNTER validates the file cache of cards without
+ * lastUpdate. Drivers return SC_CARDCTL_GET_FRESHNESS_TOKEN only if their
+ * PKCS #15 emulator just creates objects, so that the emulation cache can
+ * replace it.
+ */
+typedef struct sc_cardctl_freshness_token {
+	u8			value[32];
+	size_t			len;
+} sc_cardctl_freshness_token_t;
+
 /*
  * GPK lock file.
  * Parent DF of file must be selected.
@@ -153,63 +153,166 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
-static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
-	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
+/* Size of the first output buffer when the caller does not know better */
+#define DECOMPRESS_DEFAULT_HINT	2048
+
+struct sc_decompress_stream {
 	z_stream gz;
-	int err;
+	u8 *out;
+	size_t out_size;
+	int done;
+};
+
+int sc_decompress_stream_init(sc_decompress_stream_t **stream, int method, size_t size_hint) {
+	sc_decompress_stream_t *s;
 	int window_size = 15;
-	const int startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const int blockSize = inLen < 1024 ? 512 : inLen / 2;
-	int bufferSize = startSize;
-	if(gzip)
+	int err;
+
+	if (stream == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	switch(method) {
+	case COMPRESSION_ZLIB:
+		break;
+	case COMPRESSION_GZIP:
+	case COMPRESSION_AUTO:
+		/* let zlib tell a gzip from a zlib header */
 		window_size += 0x20;
-	memset(&gz, 0, sizeof(gz));
-	
-	gz.next_in = (u8*)in;
-	gz.avail_in = inLen;
+		break;
+	default:
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
 
-	err = inflateInit2(&gz, window_size);
-	if(err != Z_OK) return zerr_to_opensc(err);
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	s->out_size = size_hint ? size_hint : DECOMPRESS_DEFAULT_HINT;
+	s->out = malloc(s->out_size);
+	if (s->out == NULL) {
+		free(s);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	err = inflateInit2(&s->gz, window_size);
+	if (err != Z_OK) {
+		free(s->out);
+		free(s);
+		return zerr_to_opensc(err);
+	}
+	*stream = s;
+	return SC_SUCCESS;
+}
 
-	*outLen = 0;
-
-	while(1) {
-		/* Setup buffer... */
-		int num;
-		u8* buf = realloc(*out, bufferSize);
-		if(!buf) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			return Z_MEM_ERROR;
-		}
-		*out = buf;
-		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
-
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if(err != Z_STREAM_END && err != Z_OK) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			break;
+int sc_decompress_stream_update(sc_decompress_stream_t *stream, const u8* in, size_t inLen) {
+	int err;
+
+	if (stream == NULL || (in == NULL && inLen > 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	/* anything following the end of the compressed data is ignored */
+	if (stream->done)
+		return 1;
+
+	stream->gz.next_in = (u8*)in;
+	stream->gz.avail_in = inLen;
+	/* a full output buffer may leave output pending in zlib */
+	do {
+		if (stream->gz.total_out == stream->out_size) {
+			/* grow geometrically, the hint was too small */
+			u8 *buf = realloc(stream->out, 2 * stream->out_size);
+			if (buf == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+			stream->out = buf;
+			stream->out_size *= 2;
 		}
-		num = bufferSize - *outLen - gz.avail_out;
-		if(num > 0) {
-			*outLen += num;
-			bufferSize += num + blockSize;
+		stream->gz.next_out = stream->out + stream->gz.total_out;
+		stream->gz.avail_out = stream->out_size - stream->gz.total_out;
+
+		err = inflate(&stream->gz, Z_NO_FLUSH);
+		if (err == Z_STREAM_END) {
+			stream->done = 1;
+			return 1;
 		}
-		if(err == Z_STREAM_END) {
-			buf = realloc(buf, *outLen); /* Shrink it down, if it fails, just use old data */
-			if(buf) {
-				*out = buf;
-			}
+		/* Z_BUF_ERROR only tells that no progress was possible */
+		if (err != Z_OK && err != Z_BUF_ERROR)
+			return zerr_to_opensc(err);
+	} while (stream->gz.avail_in > 0 || stream->gz.avail_out == 0);
+	return SC_SUCCESS;
+}
+
+int sc_decompress_stream_final(sc_decompress_stream_t *stream, u8** out, size_t* outLen) {
+	u8 *buf;
+
+	if (stream == NULL || out == NULL || outLen == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (!stream->done)
+		return SC_ERROR_INVALID_DATA;
+
+	*outLen = stream->gz.total_out;
+	/* Shrink it down, if it fails, just use old data */
+	buf = realloc(stream->out, *outLen ? *outLen : 1);
+	*out = buf ? buf : stream->out;
+	stream->out = NULL;
+	return SC_SUCCESS;
+}
+
+void sc_decompress_stream_free(sc_decompress_stream_t *stream) {
+	if (stream == NULL)
+		return;
+	inflateEnd(&stream->gz);
+	free(stream->out);
+	free(stream);
+}
+
+int sc_decompress_read_binary(sc_card_t *card, unsigned int idx, size_t count,
+		int method, size_t size_hint, u8** out, size_t* outLen) {
+	sc_decompress_stream_t *stream = NULL;
+	size_t chunk = sc_get_max_recv_size(card);
+	u8 *buf;
+	int r;
+
+	if (chunk == 0 || chunk > count)
+		chunk = count;
+	buf = malloc(chunk ? chunk : 1);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_decompress_stream_init(&stream, method, size_hint);
+	if (r != SC_SUCCESS) {
+		free(buf);
+		return r;
+	}
+
+	/* inflate each piece as it arrives, stop at the end of the compressed data */
+	r = SC_SUCCESS;
+	while (count > 0 && r == SC_SUCCESS) {
+		r = sc_read_binary(card, idx, buf, MIN(chunk, count), 0);
+		if (r == 0)
+			r = SC_ERROR_FILE_END_REACHED;
+		if (r < 0)
 			break;
-		}
+		idx += r;
+		count -= r;
+		r = sc_decompress_stream_update(stream, buf, r);
 	}
-	inflateEnd(&gz);
-	return zerr_to_opensc(err);
+	if (r >= 0)
+		r = sc_decompress_stream_final(stream, out, outLen);
+	sc_decompress_stream_free(stream);
+	free(buf);
+	return r;
+}
+
+static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
+	sc_decompress_stream_t *stream = NULL;
+	int r;
+
+	r = sc_decompress_stream_init(&stream, method,
+			inLen < 1024 ? DECOMPRESS_DEFAULT_HINT : inLen * 2);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_decompress_stream_update(stream, in, inLen);
+	if (r >= 0)
+		r = sc_decompress_stream_final(stream, out, outLen);
+	sc_decompress_stream_free(stream);
+	return r;
 }
+
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
 	if(method == COMPRESSION_AUTO) {
 		method = detect_method(in, inLen);
@@ -219,9 +322,8 @@ int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, in
 	}
 	switch(method) {
 	case COMPRESSION_ZLIB:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 0);
 	case COMPRESSION_GZIP:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 1);
+		return sc_decompress_zlib_alloc(out, outLen, in, inLen, method);
 	default:
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
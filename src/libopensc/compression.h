@@ -33,5 +33,23 @@ int sc_compress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method)
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
+/* Decompression of data that arrives in pieces, e.g. from a loop of
+ * sc_read_binary() calls. 'size_hint' is the expected size of the
+ * decompressed data (0 if unknown), it sizes the output buffer up front.
+ * sc_decompress_stream_update() returns 1 once the end of the compressed
+ * data has been seen, 0 if it needs more input. sc_decompress_stream_final()
+ * hands over the decompressed data, which the caller frees. */
+typedef struct sc_decompress_stream sc_decompress_stream_t;
+
+int sc_decompress_stream_init(sc_decompress_stream_t **stream, int method, size_t size_hint);
+int sc_decompress_stream_update(sc_decompress_stream_t *stream, const u8* in, size_t inLen);
+int sc_decompress_stream_final(sc_decompress_stream_t *stream, u8** out, size_t* outLen);
+void sc_decompress_stream_free(sc_decompress_stream_t *stream);
+
+/* Read 'count' bytes of compressed data from the selected file at offset
+ * 'idx' and decompress them while reading */
+int sc_decompress_read_binary(sc_card_t *card, unsigned int idx, size_t count,
+		int method, size_t size_hint, u8** out, size_t* outLen);
+
 #endif
 
@@ -38,6 +38,8 @@
 
 #include "common/libscdl.h"
 #include "internal.h"
+#include "gp.h"
+#include "probes.h"
 
 static int ignored_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
@@ -76,10 +78,13 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 	if (reader == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
+	sc_apdu_stats_write(reader);
 	if (reader->ops->release)
 			reader->ops->release(reader);
 	free(reader->name);
 	free(reader->vendor);
+	free(reader->apdu_stats);
+	gp_card_cache_free(reader);
 	list_delete(&ctx->readers, reader);
 	free(reader);
 	return SC_SUCCESS;
@@ -90,71 +95,159 @@ struct _sc_driver_entry {
 	void *(*func)(void);
 };
 
+/* configure --with-card-drivers builds in only the listed drivers, for which
+ * it defines SC_DRIVER_<name> */
+#ifdef SC_CARD_DRIVERS_SELECTED
+#define SC_WITH_DRIVER(name)	SC_DRIVER_##name
+#else
+#define SC_WITH_DRIVER(name)	1
+#endif
+
 static const struct _sc_driver_entry internal_card_drivers[] = {
+#if SC_WITH_DRIVER(cardos)
 	{ "cardos",	(void *(*)(void)) sc_get_cardos_driver },
+#endif
+#if SC_WITH_DRIVER(flex)
 	{ "flex",	(void *(*)(void)) sc_get_cryptoflex_driver },
+#endif
+#if SC_WITH_DRIVER(cyberflex)
 	{ "cyberflex",	(void *(*)(void)) sc_get_cyberflex_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if SC_WITH_DRIVER(gpk)
 	{ "gpk",	(void *(*)(void)) sc_get_gpk_driver },
 #endif
+#endif
+#if SC_WITH_DRIVER(gemsafeV1)
 	{ "gemsafeV1",	(void *(*)(void)) sc_get_gemsafeV1_driver },
+#endif
+#if SC_WITH_DRIVER(asepcos)
 	{ "asepcos",	(void *(*)(void)) sc_get_asepcos_driver },
+#endif
+#if SC_WITH_DRIVER(starcos)
 	{ "starcos",	(void *(*)(void)) sc_get_starcos_driver },
+#endif
+#if SC_WITH_DRIVER(tcos)
 	{ "tcos",	(void *(*)(void)) sc_get_tcos_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if SC_WITH_DRIVER(oberthur)
 	{ "oberthur",	(void *(*)(void)) sc_get_oberthur_driver },
+#endif
+#if SC_WITH_DRIVER(authentic)
 	{ "authentic",	(void *(*)(void)) sc_get_authentic_driver },
+#endif
+#if SC_WITH_DRIVER(iasecc)
 	{ "iasecc",	(void *(*)(void)) sc_get_iasecc_driver },
 #endif
+#endif
+#if SC_WITH_DRIVER(belpic)
 	{ "belpic",	(void *(*)(void)) sc_get_belpic_driver },
+#endif
+#if SC_WITH_DRIVER(incrypto34)
 	{ "incrypto34", (void *(*)(void)) sc_get_incrypto34_driver },
+#endif
+#if SC_WITH_DRIVER(acos5)
 	{ "acos5",	(void *(*)(void)) sc_get_acos5_driver },
+#endif
+#if SC_WITH_DRIVER(akis)
 	{ "akis",	(void *(*)(void)) sc_get_akis_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if SC_WITH_DRIVER(entersafe)
 	{ "entersafe",(void *(*)(void)) sc_get_entersafe_driver },
+#endif
 #ifdef ENABLE_SM
+#if SC_WITH_DRIVER(epass2003)
 	{ "epass2003",(void *(*)(void)) sc_get_epass2003_driver },
 #endif
 #endif
+#endif
+#if SC_WITH_DRIVER(rutoken)
 	{ "rutoken",	(void *(*)(void)) sc_get_rutoken_driver },
+#endif
+#if SC_WITH_DRIVER(rutoken_ecp)
 	{ "rutoken_ecp",(void *(*)(void)) sc_get_rtecp_driver },
+#endif
+#if SC_WITH_DRIVER(myeid)
 	{ "myeid",      (void *(*)(void)) sc_get_myeid_driver },
+#endif
 #if defined(ENABLE_OPENSSL) && defined(ENABLE_SM)
+#if SC_WITH_DRIVER(dnie)
 	{ "dnie",       (void *(*)(void)) sc_get_dnie_driver },
 #endif
+#endif
+#if SC_WITH_DRIVER(masktech)
 	{ "masktech",	(void *(*)(void)) sc_get_masktech_driver },
+#endif
+#if SC_WITH_DRIVER(atrust_acos)
 	{ "atrust-acos",(void *(*)(void)) sc_get_atrust_acos_driver },
+#endif
+#if SC_WITH_DRIVER(westcos)
 	{ "westcos",	(void *(*)(void)) sc_get_westcos_driver },
+#endif
 
 /* Here should be placed drivers that need some APDU transactions in the
  * driver's `match_card()` function. */
 	/* MUSCLE card applet returns 9000 on whatever AID is selected, see
 	 * https://github.com/JavaCardOS/MuscleCard-Applet/blob/master/musclecard/src/com/musclecard/CardEdge/CardEdge.java#L326
 	 * put the muscle driver first to cope with this bug. */
+#if SC_WITH_DRIVER(muscle)
 	{ "muscle",	(void *(*)(void)) sc_get_muscle_driver },
+#endif
+#if SC_WITH_DRIVER(sc_hsm)
 	{ "sc-hsm",	(void *(*)(void)) sc_get_sc_hsm_driver },
+#endif
+#if SC_WITH_DRIVER(mcrd)
 	{ "mcrd",	(void *(*)(void)) sc_get_mcrd_driver },
+#endif
+#if SC_WITH_DRIVER(setcos)
 	{ "setcos",	(void *(*)(void)) sc_get_setcos_driver },
+#endif
+#if SC_WITH_DRIVER(PIV_II)
 	{ "PIV-II",	(void *(*)(void)) sc_get_piv_driver },
+#endif
+#if SC_WITH_DRIVER(cac)
 	{ "cac",	(void *(*)(void)) sc_get_cac_driver },
+#endif
+#if SC_WITH_DRIVER(itacns)
 	{ "itacns",	(void *(*)(void)) sc_get_itacns_driver },
+#endif
+#if SC_WITH_DRIVER(isoApplet)
 	{ "isoApplet",	(void *(*)(void)) sc_get_isoApplet_driver },
+#endif
 #ifdef ENABLE_ZLIB
+#if SC_WITH_DRIVER(gids)
 	{ "gids",	(void *(*)(void)) sc_get_gids_driver },
 #endif
+#endif
+#if SC_WITH_DRIVER(openpgp)
 	{ "openpgp",	(void *(*)(void)) sc_get_openpgp_driver },
+#endif
+#if SC_WITH_DRIVER(jpki)
 	{ "jpki",	(void *(*)(void)) sc_get_jpki_driver },
+#endif
+#if SC_WITH_DRIVER(coolkey)
 	{ "coolkey",	(void *(*)(void)) sc_get_coolkey_driver },
+#endif
+#if SC_WITH_DRIVER(npa)
 	{ "npa",	(void *(*)(void)) sc_get_npa_driver },
+#endif
 	/* The default driver should be last, as it handles all the
 	 * unrecognized cards. */
+#if SC_WITH_DRIVER(default)
 	{ "default",	(void *(*)(void)) sc_get_default_driver },
+#endif
 	{ NULL, NULL }
 };
 
 static const struct _sc_driver_entry old_card_drivers[] = {
+#if SC_WITH_DRIVER(miocos)
 	{ "miocos",	(void *(*)(void)) sc_get_miocos_driver },
+#endif
+#if SC_WITH_DRIVER(jcop)
 	{ "jcop",	(void *(*)(void)) sc_get_jcop_driver },
+#endif
 	{ NULL, NULL }
 };
 
@@ -314,6 +407,9 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	/* write out what the background writer still has */
+	sc_log_sink_set_file(ctx, filename);
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -365,7 +461,7 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	int err = 0;
 	const scconf_list *list;
 	const char *val;
-	int debug;
+	int debug, cache_size;
 #ifdef _WIN32
 	char expanded_val[PATH_MAX];
 	DWORD expanded_len;
@@ -375,6 +471,11 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	if (debug > ctx->debug)
 		ctx->debug = debug;
 
+	if (scconf_get_bool(block, "debug_async", ctx->log_sink != NULL))
+		sc_log_sink_create(ctx, scconf_get_int(block, "debug_file_max_size", -1));
+	else
+		sc_log_sink_free(ctx);
+
 	val = scconf_get_str(block, "debug_file", NULL);
 	if (val)   {
 #ifdef _WIN32
@@ -397,6 +498,24 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 				ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER))
 		ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	if (scconf_get_bool (block, "cache_card_drivers",
+				ctx->flags & SC_CTX_FLAG_CACHE_CARD_DRIVERS))
+		ctx->flags |= SC_CTX_FLAG_CACHE_CARD_DRIVERS;
+
+	if (scconf_get_bool (block, "apdu_statistics",
+				ctx->flags & SC_CTX_FLAG_APDU_STATS))
+		ctx->flags |= SC_CTX_FLAG_APDU_STATS;
+
+	val = scconf_get_str(block, "apdu_statistics_file", NULL);
+	if (val && ctx->apdu_stats_file == NULL) {
+		ctx->apdu_stats_file = strdup(val);
+		ctx->flags |= SC_CTX_FLAG_APDU_STATS;
+	}
+
+	cache_size = scconf_get_int(block, "memory_cache_size", -1);
+	if (cache_size >= 0)
+		sc_cache_manager_create(ctx, cache_size);
+
 	list = scconf_find_list(block, "card_drivers");
 	set_drivers(opts, list);
 
@@ -520,8 +639,6 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 
 	for (i = 0; i < opts->ccount; i++) {
 		struct sc_card_driver *(*func)(void) = NULL;
-		struct sc_card_driver *(**tfunc)(void) = &func;
-		void *dll = NULL;
 		int  j;
 
 		if (drv_count >= SC_MAX_CARD_DRIVERS - 1)   {
@@ -544,14 +661,23 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 				}
 			}
 		}
-		/* if not initialized assume external module */
-		if (func == NULL)
-			*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, ent->name);
-		/* if still null, assume driver not found */
+		/* if not initialized assume external module, which is loaded
+		 * when a card needs it */
 		if (func == NULL) {
-			sc_log(ctx, "Unable to load '%s'.", ent->name);
-			if (dll)
-				sc_dlclose(dll);
+			struct sc_card_driver *placeholder = calloc(1, sizeof *placeholder);
+			char *name = strdup(ent->name);
+
+			if (placeholder == NULL || name == NULL) {
+				free(placeholder);
+				free(name);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			placeholder->name = name;
+			placeholder->short_name = name;
+			ctx->card_drivers[drv_count] = placeholder;
+			ctx->card_driver_state[drv_count] = SC_CARD_DRIVER_PENDING;
+			ctx->card_drivers[drv_count + 1] = NULL;
+			drv_count++;
 			continue;
 		}
 
@@ -561,7 +687,7 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 			continue;
 		}
 
-		ctx->card_drivers[drv_count]->dll = dll;
+		ctx->card_drivers[drv_count]->dll = NULL;
 		ctx->card_drivers[drv_count]->atr_map = NULL;
 		ctx->card_drivers[drv_count]->natrs = 0;
 
@@ -575,6 +701,63 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	return SC_SUCCESS;
 }
 
+/* Called with ctx->mutex held */
+static struct sc_card_driver *load_pending_card_driver(sc_context_t *ctx, size_t i)
+{
+	struct sc_card_driver *placeholder = ctx->card_drivers[i];
+	struct sc_card_driver *(*func)(void) = NULL;
+	struct sc_card_driver *(**tfunc)(void) = &func;
+	struct sc_card_driver *driver = NULL;
+	void *dll = NULL;
+
+	if (ctx->card_driver_state[i] == SC_CARD_DRIVER_LOADED)
+		return placeholder;
+	if (ctx->card_driver_state[i] == SC_CARD_DRIVER_FAILED)
+		return NULL;
+
+	*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, placeholder->name);
+	if (func != NULL)
+		driver = func();
+	if (driver == NULL) {
+		sc_log(ctx, "Unable to load '%s'.", placeholder->name);
+		if (dll)
+			sc_dlclose(dll);
+		ctx->card_driver_state[i] = SC_CARD_DRIVER_FAILED;
+		return NULL;
+	}
+
+	/* the placeholder gets the ATRs of the configuration */
+	driver->dll = dll;
+	driver->atr_map = placeholder->atr_map;
+	driver->natrs = placeholder->natrs;
+	load_card_driver_options(ctx, driver);
+
+	ctx->card_drivers[i] = driver;
+	ctx->card_driver_state[i] = SC_CARD_DRIVER_LOADED;
+	if (ctx->forced_driver == placeholder)
+		ctx->forced_driver = driver;
+	free((char *) placeholder->name);
+	free(placeholder);
+
+	return driver;
+}
+
+struct sc_card_driver *_sc_load_card_driver(sc_context_t *ctx, size_t i)
+{
+	struct sc_card_driver *driver;
+
+	if (ctx == NULL || i >= SC_MAX_CARD_DRIVERS || ctx->card_drivers[i] == NULL)
+		return NULL;
+	if (ctx->card_driver_state[i] == SC_CARD_DRIVER_LOADED)
+		return ctx->card_drivers[i];
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	driver = load_pending_card_driver(ctx, i);
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	return driver;
+}
+
 static int load_card_atrs(sc_context_t *ctx)
 {
 	struct sc_card_driver *driver;
@@ -651,6 +834,49 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+#define SC_CONF_CACHE_FILE "opensc.conf.cache"
+
+/* Parses the configuration file through a binary snapshot in the cache
+ * directory, which saves lexing the file in every process */
+static int parse_config_file(sc_context_t *ctx)
+{
+	char dir[PATH_MAX], fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	int r;
+
+	/* The configuration is not known yet, so this is always the default
+	 * cache directory */
+	if (sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return scconf_parse(ctx->conf);
+	r = snprintf(fname, sizeof(fname), "%s/%s", dir, SC_CONF_CACHE_FILE);
+	if (r < 0 || (size_t) r >= sizeof(fname))
+		return scconf_parse(ctx->conf);
+
+	if (scconf_read_cache(ctx->conf, fname) == 1)
+		return 1;
+
+	r = scconf_parse(ctx->conf);
+	if (r == 1) {
+		int w;
+
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+		errno = 0;
+		w = scconf_write_cache(ctx->conf, tmpname);
+		if (w != 0 && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+			w = scconf_write_cache(ctx->conf, tmpname);
+		if (w == 0) {
+#ifdef _WIN32
+			remove(fname);
+#endif
+			if (rename(tmpname, fname) != 0)
+				remove(tmpname);
+		} else {
+			remove(tmpname);
+		}
+	}
+
+	return r;
+}
+
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
 	int i, r, count = 0;
@@ -686,7 +912,7 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->conf = scconf_new(conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
+	r = parse_config_file(ctx);
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
 	if (r < 0)
@@ -779,18 +1005,29 @@ int sc_context_repair(sc_context_t **ctx_out)
 	 * card drivers - so rebuild the ATR's
 	 */
 	load_card_atrs(*ctx_out);
+	_sc_build_atr_index(*ctx_out);
 
 	/* TODO: May need to re-open any card driver DLL's */
 
 	return SC_SUCCESS;
 }
 
+#ifdef ENABLE_TRACELOGGING
+/* name hash of "OpenSC", so that the provider can be enabled by its name */
+TRACELOGGING_DEFINE_PROVIDER(sc_trace_provider, "OpenSC",
+	(0x0b7da103, 0xa9e0, 0x5b7b, 0xb4, 0x8e, 0x45, 0x10, 0x4b, 0xd6, 0x55, 0xd9));
+
+/* contexts in this module, the provider is registered while there are some */
+static LONG sc_trace_contexts = 0;
+#endif
+
 int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
 	sc_context_t		*ctx;
 	struct _sc_ctx_options	opts;
 	int			r;
 	char			*driver;
+	const char		*env;
 
 	if (ctx_out == NULL || parm == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -799,6 +1036,10 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	if (ctx == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	memset(&opts, 0, sizeof(opts));
+#ifdef ENABLE_TRACELOGGING
+	if (InterlockedIncrement(&sc_trace_contexts) == 1)
+		TraceLoggingRegister(sc_trace_provider);
+#endif
 
 	/* set the application name if set in the parameter options */
 	if (parm->app_name != NULL)
@@ -828,6 +1069,21 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 
 	process_config_file(ctx, &opts);
+	/* lets test scripts count the APDUs of any tool */
+	env = getenv("OPENSC_APDU_STATS");
+	if (env && *env) {
+		free(ctx->apdu_stats_file);
+		ctx->apdu_stats_file = strdup(env);
+		ctx->flags |= SC_CTX_FLAG_APDU_STATS;
+	}
+	if (ctx->cache_mgr == NULL) {
+		/* no memory_cache_size configured, only count */
+		r = sc_cache_manager_create(ctx, 0);
+		if (r != SC_SUCCESS) {
+			sc_release_context(ctx);
+			return r;
+		}
+	}
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -840,6 +1096,9 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* virtual cards replace the readers, e.g. for reproducible benchmarks */
+	if (sc_virtual_reader_enabled(ctx))
+		ctx->reader_driver = sc_get_virtual_driver();
 
 	r = ctx->reader_driver->ops->init(ctx);
 	if (r != SC_SUCCESS)   {
@@ -857,14 +1116,45 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	_sc_build_atr_index(ctx);
 
 	del_drvs(&opts);
-	sc_ctx_detect_readers(ctx);
+	if (!(ctx->flags & SC_CTX_FLAG_DEFER_READERS))
+		sc_ctx_detect_readers(ctx);
 	*ctx_out = ctx;
 
 	return SC_SUCCESS;
 }
 
+int sc_context_reset_readers(sc_context_t *ctx)
+{
+	int r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+
+	/* The handles were inherited from the parent process and must neither
+	 * be used nor released here, see SC_CTX_FLAG_TERMINATE */
+	ctx->flags |= SC_CTX_FLAG_TERMINATE;
+	while (list_size(&ctx->readers)) {
+		sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
+		_sc_delete_reader(ctx, rdr);
+	}
+	if (ctx->reader_driver->ops->finish != NULL)
+		ctx->reader_driver->ops->finish(ctx);
+	ctx->reader_drv_data = NULL;
+	ctx->flags &= ~SC_CTX_FLAG_TERMINATE;
+
+	/* configuration, card drivers and ATR tables are kept as they are */
+	r = ctx->reader_driver->ops->init(ctx);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(ctx, r);
+
+	sc_ctx_detect_readers(ctx);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 /* Used by minidriver to pass in provided handles to reader-pcsc */
 int sc_ctx_use_reader(sc_context_t *ctx, void *pcsc_context_handle, void *pcsc_card_handle)
 {
@@ -896,6 +1186,34 @@ int sc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **
 }
 
 
+int sc_wait_for_reader_event(sc_context_t *ctx, unsigned int event_mask,
+		struct sc_reader_event *event, int timeout, void **reader_states)
+{
+	const struct sc_reader_operations *ops;
+	int r;
+
+	if (ctx == NULL || event == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	ops = ctx->reader_driver->ops;
+	if (ops->wait_for_reader_event != NULL)
+		return ops->wait_for_reader_event(ctx, event_mask, event, timeout, reader_states);
+	if (ops->wait_for_event == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	/* the driver only tells about the event, ask for the card */
+	memset(event, 0, sizeof *event);
+	r = ops->wait_for_event(ctx, event_mask, &event->reader, &event->event,
+			timeout, reader_states);
+	if (r == SC_SUCCESS && event->reader != NULL
+			&& sc_detect_card_presence(event->reader) > 0) {
+		event->flags = SC_READER_CARD_PRESENT;
+		event->atr = event->reader->atr;
+	}
+	return r;
+}
+
+
 int sc_release_context(sc_context_t *ctx)
 {
 	unsigned int i;
@@ -912,6 +1230,7 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	_sc_free_atr_index(ctx);
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -919,9 +1238,14 @@ int sc_release_context(sc_context_t *ctx)
 			_sc_free_atr(ctx, drv);
 		if (drv->dll)
 			sc_dlclose(drv->dll);
+		if (ctx->card_driver_state[i] != SC_CARD_DRIVER_LOADED) {
+			free((char *) drv->name);
+			free(drv);
+		}
 	}
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
+	sc_profile_cache_free(ctx);
 	if (ctx->mutex != NULL) {
 		int r = sc_mutex_destroy(ctx, ctx->mutex);
 		if (r != SC_SUCCESS) {
@@ -931,15 +1255,22 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	sc_log_sink_free(ctx);
+	sc_cache_manager_free(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
 		free(ctx->debug_filename);
 	if (ctx->app_name != NULL)
 		free(ctx->app_name);
+	free(ctx->apdu_stats_file);
 	list_destroy(&ctx->readers);
 	sc_mem_clear(ctx, sizeof(*ctx));
 	free(ctx);
+#ifdef ENABLE_TRACELOGGING
+	if (InterlockedDecrement(&sc_trace_contexts) == 0)
+		TraceLoggingUnregister(sc_trace_provider);
+#endif
 	return SC_SUCCESS;
 }
 
@@ -955,6 +1286,9 @@ int sc_set_card_driver(sc_context_t *ctx, const char *short_name)
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
 		if (strcmp(short_name, drv->short_name) == 0) {
+			drv = load_pending_card_driver(ctx, i);
+			if (drv == NULL)
+				break;
 			ctx->forced_driver = drv;
 			match = 1;
 			break;
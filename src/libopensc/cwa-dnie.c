@@ -36,6 +36,7 @@
 #include "cardctl.h"
 #include "internal.h"
 #include "cwa14890.h"
+#include "common/compat_strlcpy.h"
 
 #include "cwa-dnie.h"
 
@@ -364,6 +365,100 @@ int dnie_read_file(sc_card_t * card,
  * @param cert where to store resulting data
  * @return SC_SUCCESS if ok, else error code
  */
+
+/**
+ * Process wide store of the ICC certificates.
+ *
+ * Every secure channel creation needs the ICC intermediate CA and ICC
+ * certificates. They never change for a card, so once read they are kept
+ * by ICC serial number and file path for all card handles of the process.
+ */
+#define DNIE_CERT_STORE_SIZE 8
+
+static struct dnie_cert_entry {
+	u8 sn[8];
+	char path[16];
+	u8 *der;
+	size_t der_len;
+} dnie_cert_store[DNIE_CERT_STORE_SIZE];
+static unsigned int dnie_cert_store_next = 0;
+
+static int dnie_cert_store_get(sc_card_t * card, const char *certpath,
+			       u8 ** buffer, size_t * length)
+{
+	struct sm_cwa_session *sm = &card->sm_ctx.info.session.cwa;
+	int res = SC_ERROR_OBJECT_NOT_FOUND;
+	int i;
+
+	sc_mutex_lock(card->ctx, card->ctx->mutex);
+	for (i = 0; i < DNIE_CERT_STORE_SIZE; i++) {
+		struct dnie_cert_entry *e = &dnie_cert_store[i];
+
+		if (!e->der || memcmp(e->sn, sm->icc.sn, sizeof(e->sn))
+				|| strcmp(e->path, certpath))
+			continue;
+		*buffer = malloc(e->der_len);
+		if (*buffer == NULL) {
+			res = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		memcpy(*buffer, e->der, e->der_len);
+		*length = e->der_len;
+		res = SC_SUCCESS;
+		break;
+	}
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+	return res;
+}
+
+static void dnie_cert_store_put(sc_card_t * card, const char *certpath,
+				const u8 * buffer, size_t length)
+{
+	struct sm_cwa_session *sm = &card->sm_ctx.info.session.cwa;
+	struct dnie_cert_entry *e;
+	u8 *der;
+
+	if (strlen(certpath) >= sizeof(e->path))
+		return;
+	der = malloc(length);
+	if (der == NULL)
+		return;
+	memcpy(der, buffer, length);
+
+	sc_mutex_lock(card->ctx, card->ctx->mutex);
+	e = &dnie_cert_store[dnie_cert_store_next];
+	dnie_cert_store_next = (dnie_cert_store_next + 1) % DNIE_CERT_STORE_SIZE;
+	free(e->der);
+	memcpy(e->sn, sm->icc.sn, sizeof(e->sn));
+	strlcpy(e->path, certpath, sizeof(e->path));
+	e->der = der;
+	e->der_len = length;
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+}
+
+/**
+ * Drop the stored certificates of the card.
+ *
+ * Used when the secure channel could not be created with them.
+ * @param card Pointer to card driver structure
+ */
+void dnie_forget_icc_certificates(sc_card_t * card)
+{
+	struct sm_cwa_session *sm = &card->sm_ctx.info.session.cwa;
+	int i;
+
+	sc_mutex_lock(card->ctx, card->ctx->mutex);
+	for (i = 0; i < DNIE_CERT_STORE_SIZE; i++) {
+		struct dnie_cert_entry *e = &dnie_cert_store[i];
+
+		if (e->der && !memcmp(e->sn, sm->icc.sn, sizeof(e->sn))) {
+			free(e->der);
+			memset(e, 0, sizeof(*e));
+		}
+	}
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+}
+
 static int dnie_read_certificate(sc_card_t * card, char *certpath, X509 ** cert)
 {
 	sc_file_t *file = NULL;
@@ -374,11 +469,16 @@ static int dnie_read_certificate(sc_card_t * card, char *certpath, X509 ** cert)
 	int res = SC_SUCCESS;
 
 	LOG_FUNC_CALLED(card->ctx);
-	sc_format_path(certpath, &path);
-	res = dnie_read_file(card, &path, &file, &buffer, &bufferlen);
-	if (res != SC_SUCCESS) {
-		msg = "Cannot get intermediate CA cert";
-		goto read_cert_end;
+	if (dnie_cert_store_get(card, certpath, &buffer, &bufferlen) == SC_SUCCESS) {
+		sc_log(card->ctx, "Using stored certificate %s", certpath);
+	} else {
+		sc_format_path(certpath, &path);
+		res = dnie_read_file(card, &path, &file, &buffer, &bufferlen);
+		if (res != SC_SUCCESS) {
+			msg = "Cannot get intermediate CA cert";
+			goto read_cert_end;
+		}
+		dnie_cert_store_put(card, certpath, buffer, bufferlen);
 	}
 	buffer2 = buffer;
 	*cert = d2i_X509(NULL, (const unsigned char **)&buffer2, bufferlen);
@@ -1040,6 +1040,12 @@ int cwa_create_secure_channel(sc_card_t * card,
 		card->sm_ctx.sm_mode = SM_MODE_NONE;
 		sc_log(ctx, "Setting CWA SM status to none");
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	case CWA_SM_WARM:	/* keep an established channel */
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT) {
+			sc_log(ctx, "CWA SM channel already established");
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* fall through */
 	case CWA_SM_ON:	/* force sm initialization process */
 		sc_log(ctx, "CWA SM initialization requested");
 		break;
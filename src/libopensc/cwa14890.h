@@ -30,6 +30,7 @@
 /* Flags for setting SM status */
 #define CWA_SM_OFF        0x00	/** Disable SM channel */
 #define CWA_SM_ON         0x01	/** Enable SM channel */
+#define CWA_SM_WARM       0x02	/** Enable SM channel, keep it if already established */
 
 /* TAGS for encoded APDU's */
 #define CWA_SM_PLAIN_TAG  0x81	/** Plain value (to be protected by CC) */
@@ -23,8 +23,14 @@
 #endif
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
@@ -152,6 +158,180 @@ parse_dir_record(sc_card_t *card, u8 ** buf, size_t *buflen, int rec_nr)
 }
 
 
+/* With file caching enabled, the content of EF(DIR) is kept in the cache
+ * directory under the ATR and the serial number or UID of the card. It is
+ * used instead of reading EF(DIR) as long as the FCI returned by the SELECT
+ * still matches the one stored with it. Record structured EF(DIR)s are
+ * stored as a sequence of records, each prefixed with its two byte length. */
+#define EF_DIR_CACHE_MAGIC	"EFDIR01"
+#define RANDOM_UID_INDICATOR	0x08
+
+struct ef_dir_cache_header {
+	char magic[8];
+	unsigned int size;
+	unsigned int ef_structure;
+	unsigned int record_length;
+	unsigned int record_count;
+};
+
+static int ef_dir_cache_filename(sc_card_t *card, char *buf, size_t bufsize)
+{
+	const u8 *id;
+	size_t id_len;
+	char dir[PATH_MAX], atr_hex[2 * SC_MAX_ATR_SIZE + 1], id_hex[2 * SC_MAX_SERIALNR + 1];
+	scconf_block *conf_block;
+	int r;
+
+	conf_block = sc_get_conf_block(card->ctx, "framework", "pkcs15", 1);
+	if (!conf_block || !scconf_get_bool(conf_block, "use_file_caching", 0))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if (card->serialnr.len > 0) {
+		id = card->serialnr.value;
+		id_len = card->serialnr.len;
+	} else if (card->uid.len > 0 && card->uid.value[0] != RANDOM_UID_INDICATOR) {
+		id = card->uid.value;
+		id_len = card->uid.len;
+	} else {
+		/* the ATR alone does not identify the content of EF(DIR) */
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	if (id_len > SC_MAX_SERIALNR)
+		id_len = SC_MAX_SERIALNR;
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr_hex, sizeof(atr_hex), 0);
+	sc_bin_to_hex(id, id_len, id_hex, sizeof(id_hex), 0);
+	r = snprintf(buf, bufsize, "%s/efdir_%s_%s", dir, atr_hex, id_hex);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static void ef_dir_cache_header_init(const sc_file_t *file, struct ef_dir_cache_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, EF_DIR_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->size = (unsigned int) file->size;
+	hdr->ef_structure = (unsigned int) file->ef_structure;
+	hdr->record_length = (unsigned int) file->record_length;
+	hdr->record_count = (unsigned int) file->record_count;
+}
+
+/* Returns the cached content of EF(DIR) if it is still valid, or NULL */
+static u8 *ef_dir_cache_read(sc_card_t *card, size_t max_len, size_t *len)
+{
+	struct ef_dir_cache_header hdr, cached;
+	char fname[PATH_MAX];
+	u8 *data;
+	FILE *f;
+
+	if (ef_dir_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return NULL;
+
+	ef_dir_cache_header_init(card->ef_dir, &hdr);
+	data = malloc(max_len + 1);
+	if (data == NULL
+			|| fread(&cached, 1, sizeof(cached), f) != sizeof(cached)
+			|| memcmp(&cached, &hdr, sizeof(hdr)) != 0) {
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	/* one byte more than allowed to detect an oversized cache file */
+	*len = fread(data, 1, max_len + 1, f);
+	fclose(f);
+	if (*len == 0 || *len > max_len) {
+		free(data);
+		return NULL;
+	}
+	sc_log(card->ctx, "EF(DIR) content read from the cache %s", fname);
+	return data;
+}
+
+static void ef_dir_cache_write(sc_card_t *card, const u8 *data, size_t len)
+{
+	struct ef_dir_cache_header hdr;
+	char fname[PATH_MAX];
+	FILE *f;
+	int ok;
+
+	if (len == 0 || ef_dir_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(fname, "wb");
+	}
+	if (f == NULL)
+		return;
+
+	ef_dir_cache_header_init(card->ef_dir, &hdr);
+	ok = fwrite(&hdr, 1, sizeof(hdr), f) == sizeof(hdr)
+		&& fwrite(data, 1, len, f) == len;
+	if (fclose(f) != 0 || !ok) {
+		sc_log(card->ctx, "cannot write the EF(DIR) cache %s", fname);
+		unlink(fname);
+	}
+}
+
+static void ef_dir_cache_forget(sc_card_t *card)
+{
+	char fname[PATH_MAX];
+
+	if (ef_dir_cache_filename(card, fname, sizeof(fname)) == SC_SUCCESS)
+		unlink(fname);
+}
+
+/* Reads the records of EF(DIR) with one READ RECORD in the format of the
+ * cache, each record prefixed with its length. NULL if not every record
+ * is a single TLV object, which is needed to tell the records apart. */
+static u8 *ef_dir_read_all_records(sc_card_t *card, size_t max_len, size_t *len)
+{
+	u8 raw[15 * 256], *data;
+	size_t raw_len, pos = 0;
+	int r, nr;
+
+	r = sc_read_records(card, 1, raw, sizeof(raw), 0);
+	if (r <= 0 || (size_t) r >= sizeof(raw))
+		return NULL;
+	raw_len = r;
+
+	data = malloc(max_len);
+	if (data == NULL)
+		return NULL;
+	*len = 0;
+	for (nr = 0; pos < raw_len && nr < 15; nr++) {
+		const u8 *p = raw + pos;
+		unsigned int cla, tag;
+		size_t taglen, rec_size;
+
+		if (sc_asn1_read_tag(&p, raw_len - pos, &cla, &tag, &taglen) != SC_SUCCESS
+				|| p == NULL || taglen > raw_len - (size_t) (p - raw))
+			break;
+		rec_size = (p - raw) + taglen - pos;
+		if (rec_size > 256 || *len + 2 + rec_size > max_len)
+			break;
+		data[(*len)++] = (u8) (rec_size >> 8);
+		data[(*len)++] = (u8) rec_size;
+		memcpy(data + *len, raw + pos, rec_size);
+		*len += rec_size;
+		pos += rec_size;
+	}
+	if (pos < raw_len && nr < 15) {
+		sc_log(card->ctx, "EF(DIR) records cannot be told apart, read them one by one");
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
 int sc_enum_apps(sc_card_t *card)
 {
 	struct sc_context *ctx = card->ctx;
@@ -185,16 +365,20 @@ int sc_enum_apps(sc_card_t *card)
 		if (file_size == 0)
 			LOG_FUNC_RETURN(ctx, 0);
 
-		buf = malloc(file_size);
-		if (buf == NULL)
-			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-		p = buf;
-		r = sc_read_binary(card, 0, buf, file_size, 0);
-		if (r < 0) {
-			free(buf);
-			LOG_TEST_RET(ctx, r, "sc_read_binary() failed");
+		buf = ef_dir_cache_read(card, file_size, &bufsize);
+		if (buf == NULL) {
+			buf = malloc(file_size);
+			if (buf == NULL)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			r = sc_read_binary(card, 0, buf, file_size, 0);
+			if (r < 0) {
+				free(buf);
+				LOG_TEST_RET(ctx, r, "sc_read_binary() failed");
+			}
+			bufsize = r;
+			ef_dir_cache_write(card, buf, bufsize);
 		}
-		bufsize = r;
+		p = buf;
 		while (bufsize > 0) {
 			if (card->app_count == SC_MAX_CARD_APPS) {
 				sc_log(ctx, "Too many applications on card");
@@ -210,16 +394,43 @@ int sc_enum_apps(sc_card_t *card)
 	}
 	else {	/* record structure */
 		unsigned char buf[256], *p;
+		/* records read from the card, each prefixed with its length */
+		u8 records[15 * (2 + 256)], *cached;
+		size_t records_len = 0, cached_len = 0, pos = 0;
 		unsigned int rec_nr;
 		size_t rec_size;
 
+		cached = ef_dir_cache_read(card, sizeof(records), &cached_len);
+		if (cached == NULL && (card->caps & SC_CARD_CAP_READ_ALL_RECORDS)) {
+			cached = ef_dir_read_all_records(card, sizeof(records), &cached_len);
+			if (cached != NULL)
+				ef_dir_cache_write(card, cached, cached_len);
+		}
+
 		/* Arbitrary set '16' as maximal number of records to check out:
 		 * to avoid endless loop because of some incomplete cards/drivers */
 		for (rec_nr = 1; rec_nr < 16; rec_nr++) {
-			r = sc_read_record(card, rec_nr, buf, sizeof(buf), SC_RECORD_BY_REC_NR);
-			if (r == SC_ERROR_RECORD_NOT_FOUND)
-				break;
-			LOG_TEST_RET(ctx, r, "read_record() failed");
+			if (cached != NULL) {
+				if (pos + 2 > cached_len)
+					break;
+				rec_size = (size_t) cached[pos] << 8 | cached[pos + 1];
+				if (rec_size > sizeof(buf) || pos + 2 + rec_size > cached_len)
+					break;
+				memcpy(buf, cached + pos + 2, rec_size);
+				pos += 2 + rec_size;
+				r = (int) rec_size;
+			} else {
+				r = sc_read_record(card, rec_nr, buf, sizeof(buf), SC_RECORD_BY_REC_NR);
+				if (r == SC_ERROR_RECORD_NOT_FOUND)
+					break;
+				LOG_TEST_RET(ctx, r, "read_record() failed");
+				if ((size_t) r > sizeof(buf))
+					r = sizeof(buf);
+				records[records_len++] = (u8) (r >> 8);
+				records[records_len++] = (u8) r;
+				memcpy(records + records_len, buf, r);
+				records_len += r;
+			}
 
 			if (card->app_count == SC_MAX_CARD_APPS) {
 				sc_log(ctx, "Too many applications on card");
@@ -230,6 +441,12 @@ int sc_enum_apps(sc_card_t *card)
 			p = buf;
 			parse_dir_record(card, &p, &rec_size, (int)rec_nr);
 		}
+
+		if (cached != NULL)
+			free(cached);
+		else if (card->app_count < SC_MAX_CARD_APPS)
+			/* only a complete list of records is worth caching */
+			ef_dir_cache_write(card, records, records_len);
 	}
 
 	/* Move known PKCS#15 applications to the head of the list */
@@ -393,6 +610,7 @@ int sc_update_dir(sc_card_t *card, sc_app_info_t *app)
 
 	sc_format_path("3F002F00", &path);
 
+	ef_dir_cache_forget(card);
 	r = sc_select_file(card, &path, &file);
 	LOG_TEST_RET(card->ctx, r, "unable to select EF(DIR)");
 
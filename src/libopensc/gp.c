@@ -24,7 +24,11 @@
 #include "config.h"
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "internal.h"
+#include "gp.h"
 
 /* The AID of the Card Manager defined by Open Platform 2.0.1 specification */
 static const struct sc_aid gp_card_manager = {
@@ -37,6 +41,105 @@ static const struct sc_aid gp_isd_rid = {
 };
 
 
+/* What the card in a reader answered to GET DATA (CPLC) and to the AID
+ * SELECTs. It is kept in the reader for as long as the same card stays
+ * inserted, so that a card connected to again is not asked twice. */
+#define GP_CACHE_MAX_AIDS	16
+
+struct gp_card_cache {
+	struct sc_atr atr;
+	u8 cplc[SC_CPLC_DER_SIZE];
+	size_t cplc_len;
+	struct {
+		struct sc_aid aid;
+		int present;
+	} aids[GP_CACHE_MAX_AIDS];
+	size_t aid_count;
+};
+
+static struct gp_card_cache *
+gp_card_cache(struct sc_card *card, int create)
+{
+	struct sc_reader *reader = card->reader;
+	struct gp_card_cache *cache;
+
+	if (reader == NULL)
+		return NULL;
+	cache = reader->gp_cache;
+	if (cache != NULL && (cache->atr.len != card->atr.len
+			|| memcmp(cache->atr.value, card->atr.value, card->atr.len) != 0)) {
+		free(cache);
+		cache = reader->gp_cache = NULL;
+	}
+	if (cache == NULL && create) {
+		cache = calloc(1, sizeof *cache);
+		if (cache != NULL) {
+			cache->atr = card->atr;
+			reader->gp_cache = cache;
+		}
+	}
+	return cache;
+}
+
+/* Drop the cache once the reader reports that the card was removed or changed */
+void
+gp_card_cache_refresh(struct sc_reader *reader)
+{
+	if (!(reader->flags & SC_READER_CARD_PRESENT)
+			|| (reader->flags & SC_READER_CARD_CHANGED))
+		gp_card_cache_free(reader);
+}
+
+void
+gp_card_cache_free(struct sc_reader *reader)
+{
+	free(reader->gp_cache);
+	reader->gp_cache = NULL;
+}
+
+/* Returns 1 if the AID was selected on the card before, 0 if the card
+ * answered that it does not have it, or an error if this is not known */
+int
+gp_aid_cached(struct sc_card *card, const struct sc_aid *aid)
+{
+	struct gp_card_cache *cache = gp_card_cache(card, 0);
+	size_t i;
+
+	if (cache == NULL)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	for (i = 0; i < cache->aid_count; i++)
+		if (cache->aids[i].aid.len == aid->len
+				&& !memcmp(cache->aids[i].aid.value, aid->value, aid->len))
+			return cache->aids[i].present;
+	return SC_ERROR_OBJECT_NOT_FOUND;
+}
+
+/* Record the result of a SELECT of the AID. Only a success and
+ * SC_ERROR_FILE_NOT_FOUND tell whether the card has the application. */
+void
+gp_aid_cache_update(struct sc_card *card, const struct sc_aid *aid, int r)
+{
+	struct gp_card_cache *cache;
+	size_t i;
+
+	if (r < 0 && r != SC_ERROR_FILE_NOT_FOUND)
+		return;
+	cache = gp_card_cache(card, 1);
+	if (cache == NULL)
+		return;
+	for (i = 0; i < cache->aid_count; i++)
+		if (cache->aids[i].aid.len == aid->len
+				&& !memcmp(cache->aids[i].aid.value, aid->value, aid->len))
+			break;
+	if (i == cache->aid_count) {
+		if (cache->aid_count == GP_CACHE_MAX_AIDS)
+			return;
+		cache->aids[i].aid = *aid;
+		cache->aid_count++;
+	}
+	cache->aids[i].present = r >= 0;
+}
+
 /* Select AID */
 int
 gp_select_aid(struct sc_card *card, const struct sc_aid *aid)
@@ -44,6 +147,11 @@ gp_select_aid(struct sc_card *card, const struct sc_aid *aid)
 	struct sc_apdu apdu;
 	int rv;
 
+	if (gp_aid_cached(card, aid) == 0) {
+		sc_log(card->ctx, "the card does not have the application (cached)");
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xA4, 0x04, 0x0C);
 	apdu.lc = aid->len;
 	apdu.data = aid->value;
@@ -55,12 +163,62 @@ gp_select_aid(struct sc_card *card, const struct sc_aid *aid)
 		return rv;
 
 	rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	gp_aid_cache_update(card, aid, rv);
 	if (rv < 0)
 		return rv;
 
 	return apdu.resplen;
 }
 
+/* Get the CPLC data, tag and length included. Unless it is cached, this
+ * selects the card manager and asks it with GET DATA. */
+int
+gp_get_cplc_data(struct sc_card *card, u8 *buf, size_t buflen)
+{
+	struct gp_card_cache *cache;
+	struct sc_apdu apdu;
+	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	int rv;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	cache = gp_card_cache(card, 0);
+	if (cache != NULL && cache->cplc_len > 0) {
+		sc_log(card->ctx, "CPLC data taken from the cache");
+		if (buflen > cache->cplc_len)
+			buflen = cache->cplc_len;
+		memcpy(buf, cache->cplc, buflen);
+		LOG_FUNC_RETURN(card->ctx, (int) buflen);
+	}
+
+	rv = gp_select_card_manager(card);
+	LOG_TEST_RET(card->ctx, rv, "cannot select the card manager");
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xCA,
+			(SC_CPLC_TAG >> 8) & 0xFF, SC_CPLC_TAG & 0xFF);
+	apdu.cla = 0x80;	/* GlobalPlatform proprietary class */
+	apdu.le = SC_CPLC_DER_SIZE;
+	apdu.resp = rbuf;
+	apdu.resplen = sizeof rbuf;
+
+	rv = sc_transmit_apdu(card, &apdu);
+	LOG_TEST_RET(card->ctx, rv, "APDU transmit failed");
+	rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	LOG_TEST_RET(card->ctx, rv, "GET DATA (CPLC) failed");
+
+	if (apdu.resplen <= SC_CPLC_DER_SIZE) {
+		cache = gp_card_cache(card, 1);
+		if (cache != NULL) {
+			memcpy(cache->cplc, rbuf, apdu.resplen);
+			cache->cplc_len = apdu.resplen;
+		}
+	}
+	if (buflen > apdu.resplen)
+		buflen = apdu.resplen;
+	memcpy(buf, rbuf, buflen);
+	LOG_FUNC_RETURN(card->ctx, (int) buflen);
+}
+
 /* Select the Open Platform Card Manager */
 int
 gp_select_card_manager(struct sc_card *card)
@@ -35,6 +35,14 @@ extern "C" {
 int gp_select_aid(struct sc_card *card, const struct sc_aid *aid);
 int gp_select_card_manager(struct sc_card *card);
 int gp_select_isd_rid(struct sc_card *card);
+int gp_get_cplc_data(struct sc_card *card, u8 *buf, size_t buflen);
+
+/* Results of the AID SELECTs and of GET DATA (CPLC), per reader while the
+ * same card stays inserted */
+int gp_aid_cached(struct sc_card *card, const struct sc_aid *aid);
+void gp_aid_cache_update(struct sc_card *card, const struct sc_aid *aid, int r);
+void gp_card_cache_refresh(struct sc_reader *reader);
+void gp_card_cache_free(struct sc_reader *reader);
 
 #ifdef __cplusplus
 }
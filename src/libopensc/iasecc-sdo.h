@@ -320,6 +320,7 @@ int iasecc_sdo_encode_rsa_update(struct sc_context *, struct iasecc_sdo *, struc
 int iasecc_sdo_parse_card_answer(struct sc_context *, unsigned char *, size_t, struct iasecc_sm_card_answer *);
 int iasecc_docp_copy(struct sc_context *, struct iasecc_sdo_docp *, struct iasecc_sdo_docp *);
 int iasecc_se_get_info(struct sc_card *card, struct iasecc_se_info *se);
+int iasecc_se_get_crt_by_reference(struct sc_card *card, int reference, struct sc_crt *crt);
 
 int iasecc_sm_external_authentication(struct sc_card *card, unsigned skey_ref, int *tries_left);
 int iasecc_sm_pin_verify(struct sc_card *card, unsigned se_num, struct sc_pin_cmd_data *data, int *tries_left);
@@ -331,4 +332,5 @@ int iasecc_sm_delete_file(struct sc_card *card, unsigned se_num, unsigned int fi
 int iasecc_sm_rsa_generate(struct sc_card *card, unsigned se_num, struct iasecc_sdo *sdo);
 int iasecc_sm_rsa_update(struct sc_card *card, unsigned se_num, struct iasecc_sdo_rsa_update *udata);
 int iasecc_sm_sdo_update(struct sc_card *card, unsigned se_num, struct iasecc_sdo_update *update);
+void iasecc_sm_close_session(struct sc_card *card);
 #endif
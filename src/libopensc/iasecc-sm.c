@@ -136,6 +136,8 @@ sm_release (struct sc_card *card, struct sc_remote_data *rdata,
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
 	rv = card->sm_ctx.module.ops.finalize(ctx, sm_info, rdata, out, out_len);
+	if (rv < 0)
+		sm_info->session.cwa.established = 0;
 
 	sm_restore_sc_context(card, sm_info);
 	LOG_FUNC_RETURN(ctx, rv);
@@ -162,6 +164,7 @@ iasecc_sm_external_authentication(struct sc_card *card, unsigned skey_ref, int *
 		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot do 'External Authentication' without SM activated ");
 
 	strlcpy(sm_info->config_section, card->sm_ctx.config_section, sizeof(sm_info->config_section));
+	cwa_session->established = 0;
 	sm_info->cmd = SM_CMD_EXTERNAL_AUTH;
 	sm_info->serialnr = card->serialnr;
 	sm_info->card_type = card->type;
@@ -219,26 +222,17 @@ iasecc_sm_se_mutual_authentication(struct sc_card *card, unsigned se_num)
 {
 	struct sc_context *ctx = card->ctx;
 	struct sm_info *sm_info = &card->sm_ctx.info;
-	struct iasecc_se_info se;
 	struct sc_crt *crt =  &sm_info->session.cwa.params.crt_at;
 	struct sc_apdu apdu;
 	unsigned char sbuf[0x100];
 	int rv, offs;
 
-	memset(&se, 0, sizeof(se));
-
-	se.reference = se_num;
 	crt->usage = IASECC_UQB_AT_MUTUAL_AUTHENTICATION;
 	crt->tag = IASECC_CRT_TAG_AT;
 
-	rv = iasecc_se_get_info(card, &se);
-	LOG_TEST_RET(ctx, rv, "Get SE info error");
-
-	rv = iasecc_se_get_crt(card, &se, crt);
+	rv = iasecc_se_get_crt_by_reference(card, se_num, crt);
 	LOG_TEST_RET(ctx, rv, "Cannot get authentication CRT");
 
-	sc_file_free(se.df);
-
 	/* MSE SET Mutual Authentication SK scheme */
 	offs = 0;
 	sbuf[offs++] = IASECC_CRT_TAG_ALGO;
@@ -263,23 +257,23 @@ iasecc_sm_se_mutual_authentication(struct sc_card *card, unsigned se_num)
 #endif
 
 
-int
-iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
+#ifdef ENABLE_SM
+/*
+ * Mutual authentication for the SE 'se_num': the SM module derives the session
+ * keys from the answer when the first command of the session is secured.
+ */
+static int
+iasecc_sm_open_session(struct sc_card *card, unsigned se_num)
 {
 	struct sc_context *ctx = card->ctx;
-#ifdef ENABLE_SM
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
 	struct sm_info *sm_info = &card->sm_ctx.info;
 	struct sm_cwa_session *cwa_session = &sm_info->session.cwa;
 	struct sc_remote_data rdata;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
-
-	strlcpy(sm_info->config_section, card->sm_ctx.config_section, sizeof(sm_info->config_section));
-	sm_info->cmd = cmd;
-	sm_info->serialnr = card->serialnr;
-	sm_info->card_type = card->type;
-	sm_info->sm_type = SM_TYPE_CWA14890;
+	cwa_session->established = 0;
 
 	rv = iasecc_sm_se_mutual_authentication(card, se_num);
 	LOG_TEST_RET(ctx, rv, "iasecc_sm_initialize() MUTUAL AUTHENTICATION failed");
@@ -289,9 +283,6 @@ iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
 
 	sc_remote_data_init(&rdata);
 
-	rv = sm_save_sc_context(card, sm_info);
-	LOG_TEST_RET(ctx, rv, "iasecc_sm_initialize() cannot save current context");
-
 	if (!card->sm_ctx.module.ops.initialize)
 		LOG_TEST_RET(ctx, SC_ERROR_SM_NOT_INITIALIZED, "iasecc_sm_initialize() no SM module");
 	rv = card->sm_ctx.module.ops.initialize(ctx, sm_info, &rdata);
@@ -320,6 +311,47 @@ iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
 	if (cwa_session->mdata_len != 0x48)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "iasecc_sm_initialize() invalid MUTUAL AUTHENTICATE result data");
 
+	prv->sm_se_num = se_num;
+	prv->sm_df_path = sm_info->current_path_df;
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+#endif
+
+
+int
+iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
+{
+	struct sc_context *ctx = card->ctx;
+#ifdef ENABLE_SM
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct sm_info *sm_info = &card->sm_ctx.info;
+	struct sm_cwa_session *cwa_session = &sm_info->session.cwa;
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+
+	strlcpy(sm_info->config_section, card->sm_ctx.config_section, sizeof(sm_info->config_section));
+	sm_info->cmd = cmd;
+	sm_info->serialnr = card->serialnr;
+	sm_info->card_type = card->type;
+	sm_info->sm_type = SM_TYPE_CWA14890;
+
+	rv = sm_save_sc_context(card, sm_info);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_initialize() cannot save current context");
+
+	/* The SE is relative to the current DF, both have to match the kept session */
+	if ((card->sm_ctx.sm_flags & SM_FLAGS_KEEP_SESSION) && cwa_session->established
+			&& prv->sm_se_num == se_num
+			&& prv->sm_df_path.len == sm_info->current_path_df.len
+			&& !memcmp(prv->sm_df_path.value, sm_info->current_path_df.value, prv->sm_df_path.len))   {
+		sc_log(ctx, "iasecc_sm_initialize() keep SM session of SE#%i", se_num);
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	rv = iasecc_sm_open_session(card, se_num);
+	LOG_TEST_RET(ctx, rv, "iasecc_sm_initialize() cannot open SM session");
+
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 #else
 	LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "built without support of Secure-Messaging");
@@ -328,6 +360,15 @@ iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
 }
 
 
+void
+iasecc_sm_close_session(struct sc_card *card)
+{
+#ifdef ENABLE_SM
+	card->sm_ctx.info.session.cwa.established = 0;
+#endif
+}
+
+
 #ifdef ENABLE_SM
 static int
 iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
@@ -337,14 +378,19 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 	struct sc_context *ctx = card->ctx;
 	struct sm_info *sm_info = &card->sm_ctx.info;
 	struct sm_cwa_session *session = &sm_info->session.cwa;
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
 	struct sc_remote_apdu *rapdu = NULL;
-	int rv;
+	int rv, kept;
 
 	LOG_FUNC_CALLED(ctx);
 	if (!card->sm_ctx.module.ops.get_apdus)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
+again:
+	kept = session->established;
 	rv =  card->sm_ctx.module.ops.get_apdus(ctx, sm_info, session->mdata, session->mdata_len, rdata);
+	if (rv < 0)
+		session->established = 0;
 	LOG_TEST_RET(ctx, rv, "iasecc_sm_cmd() 'GET APDUS' failed");
 
 	sc_log(ctx, "iasecc_sm_cmd() %i remote APDUs to transmit", rdata->length);
@@ -365,6 +411,18 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 		rv = sc_check_sw(card, apdu->sw1, apdu->sw2);
 		if (rv < 0 && !(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL))   {
 			sc_log(ctx, "iasecc_sm_cmd() APDU error rv:%i", rv);
+			/* The card has closed the kept session: nothing was executed,
+			 * start a new session and secure the command again */
+			if (kept && rapdu == rdata->data && apdu->sw1 == 0x69
+					&& (apdu->sw2 == 0x87 || apdu->sw2 == 0x88))   {
+				sc_log(ctx, "iasecc_sm_cmd() SM session closed by card, re-keying");
+				rdata->free(rdata);
+				sc_remote_data_init(rdata);
+
+				rv = iasecc_sm_open_session(card, prv->sm_se_num);
+				LOG_TEST_RET(ctx, rv, "iasecc_sm_cmd() cannot open SM session");
+				goto again;
+			}
 			break;
 		}
 		sc_log(ctx,
@@ -372,6 +430,9 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 		       apdu->resplen);
 	}
 
+	if (rv < 0)
+		session->established = 0;
+
 	LOG_FUNC_RETURN(ctx, rv);
 }
 #endif
@@ -124,6 +124,19 @@ struct iasecc_io_buffer_sizes {
 	size_t recv_sc;
 };
 
+/* 'GET DATA' answer for one tag of a SDO, see iasecc_sdo_get_tagged_data() */
+struct iasecc_sdo_cache {
+	unsigned char sdo_class, sdo_ref;
+	int sdo_tag;
+	struct sc_path df_path;		/* current DF, empty if unknown */
+
+	int rv;				/* SC_SUCCESS, or the error of 'GET DATA' */
+	unsigned char *data;
+	size_t len;
+
+	struct iasecc_sdo_cache *next;
+};
+
 struct iasecc_private_data {
 	struct iasecc_version version;
 	struct iasecc_io_buffer_sizes max_sizes;
@@ -133,5 +146,9 @@ struct iasecc_private_data {
 	unsigned op_method, op_ref;
 
 	struct iasecc_se_info *se_info;
+	struct iasecc_sdo_cache *sdo_cache;
+
+	unsigned sm_se_num;		/* SE and DF of the current SM session */
+	struct sc_path sm_df_path;
 };
 #endif
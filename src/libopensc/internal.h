@@ -83,6 +83,17 @@ int _sc_parse_atr(struct sc_reader *reader);
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+/* External card drivers are loaded on first use, until then
+ * ctx->card_drivers holds a placeholder with the configured name */
+#define SC_CARD_DRIVER_LOADED	0
+#define SC_CARD_DRIVER_PENDING	1
+#define SC_CARD_DRIVER_FAILED	2
+/* Returns the card driver at the index, loading it if necessary, or NULL if
+ * it is not available */
+struct sc_card_driver *_sc_load_card_driver(struct sc_context *ctx, size_t i);
+/* Build the lookup table of the ATRs of all card drivers for sc_connect_card() */
+int _sc_build_atr_index(struct sc_context *ctx);
+void _sc_free_atr_index(struct sc_context *ctx);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -255,10 +266,97 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 #define sc_apdu_log(ctx, level, data, len, is_outgoing) \
 	sc_debug_hex(ctx, level, is_outgoing != 0 ? "Outgoing APDU" : "Incoming APDU", data, len)
 
+/**
+ * Appends the APDU statistics of the reader to the file configured with
+ * apdu_statistics_file or OPENSC_APDU_STATS, one line per INS byte:
+ * application, reader, INS, count, errors, bytes out, bytes in, time (us)
+ * @param  reader  sc_reader_t object
+ */
+void sc_apdu_stats_write(sc_reader_t *reader);
+
+/**
+ * Tells if sc_set_security_env() would skip this environment because it is
+ * still set on the card, see SC_CARD_CAP_KEEP_SECURITY_ENV
+ */
+int sc_security_env_is_set(sc_card_t *card, const sc_security_env_t *env, int se_num);
+
+/**
+ * Reads the whole transparent EF at the absolute path by its short EF
+ * identifier instead of selecting it first. Only done with
+ * SC_CARD_CAP_SELECT_CACHE while the card is locked, the DF of the EF is
+ * the current DF and the identifier is known from an earlier SELECT;
+ * SC_ERROR_NOT_SUPPORTED otherwise. `*buf` is allocated.
+ */
+int sc_read_file_by_sfid(sc_card_t *card, const sc_path_t *path, u8 **buf, size_t *len);
+
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cryptotokenkit_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
+int sc_virtual_reader_enabled(struct sc_context *ctx);
+
+/* Free the profile files parsed by pkcs15init (pkcs15init/profile.c) */
+void sc_profile_cache_free(struct sc_context *ctx);
+
+/* Debug log written by a background thread (log.c). max_size is the size in
+ * KiB after which the log file is rotated, 0 for no rotation and negative to
+ * keep the current setting. */
+int sc_log_sink_create(struct sc_context *ctx, int max_size);
+/* Called before ctx->debug_file is replaced by the given file */
+void sc_log_sink_set_file(struct sc_context *ctx, const char *filename);
+void sc_log_sink_free(struct sc_context *ctx);
+
+/*
+ * Memory of the caches kept by card drivers, accounted against the
+ * memory_cache_size budget of the context (cache.c). A driver embeds a
+ * struct sc_cache in its private data and a struct sc_cache_entry in
+ * each cached object. When the budget is exceeded the least recently
+ * used entries of all caches are evicted: their memory is given back
+ * through the evict callback the next time sc_lock() is called for the
+ * card that owns them, so a driver never has its data freed while it is
+ * in use by another thread. evict returns nonzero to keep the entry.
+ */
+struct sc_cache;
+
+struct sc_cache_entry {
+	struct sc_cache_entry *prev, *next;
+	struct sc_cache *cache;
+	size_t size;
+	int state;		/* SC_CACHE_ENTRY_* */
+};
+
+#define SC_CACHE_ENTRY_UNUSED	0
+#define SC_CACHE_ENTRY_ACTIVE	1
+#define SC_CACHE_ENTRY_EVICTED	2
+
+struct sc_cache {
+	const char *name;
+	struct sc_card *card;
+	int (*evict)(struct sc_cache *cache, struct sc_cache_entry *entry);
+	void *data;		/* for the driver */
+	size_t size;		/* bytes in active entries */
+	size_t entries;
+	unsigned long hits, misses, evictions;
+	struct sc_cache_entry *evicted;	/* freed at the next sc_lock() */
+	struct sc_cache *next;
+};
+
+void sc_cache_register(struct sc_card *card, struct sc_cache *cache, const char *name,
+		int (*evict)(struct sc_cache *, struct sc_cache_entry *), void *data);
+/* Forgets the entries of the cache, the driver frees their memory */
+void sc_cache_unregister(struct sc_cache *cache);
+/* Adds the entry or updates its size */
+void sc_cache_add(struct sc_cache *cache, struct sc_cache_entry *entry, size_t size);
+/* Updates the size of an entry that is in the cache */
+void sc_cache_resize(struct sc_cache *cache, struct sc_cache_entry *entry, size_t size);
+void sc_cache_remove(struct sc_cache *cache, struct sc_cache_entry *entry);
+void sc_cache_hit(struct sc_cache *cache, struct sc_cache_entry *entry);
+void sc_cache_miss(struct sc_cache *cache);
+/* Gives back the memory of the evicted entries of the card (see sc_lock) */
+void sc_cache_collect(struct sc_card *card);
+int sc_cache_manager_create(struct sc_context *ctx, size_t budget);
+void sc_cache_manager_free(struct sc_context *ctx);
 
 #ifdef __cplusplus
 }
@@ -185,7 +185,9 @@ iso7816_read_record(struct sc_card *card,
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB2, rec_nr, 0);
 	apdu.p2 = (flags & SC_RECORD_EF_ID_MASK) << 3;
-	if (flags & SC_RECORD_BY_REC_NR)
+	if (flags & SC_RECORD_ALL_FROM_REC_NR)
+		apdu.p2 |= 0x05;
+	else if (flags & SC_RECORD_BY_REC_NR)
 		apdu.p2 |= 0x04;
 
 	apdu.le = count;
@@ -38,6 +38,7 @@
 struct jpki_private_data {
 	sc_file_t *mf;
 	int selected;
+	unsigned int selected_ef;	/* EF selected in the AP, 0 if unknown */
 	int logged_in;
 };
 
@@ -44,6 +44,214 @@
 
 #include "internal.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define SC_LOG_ASYNC
+#define SC_LOG_RING_SIZE (256 * 1024)
+
+/* Messages formatted by the logging threads are queued here and written to
+ * ctx->debug_file by a background thread, so that logging does not wait for
+ * the file. While the writer runs, nothing else uses ctx->debug_file. */
+struct sc_log_sink {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	pid_t pid;
+	int started;
+	int stop;
+	struct sc_context *ctx;
+	/* path of ctx->debug_file for the rotation, NULL if not a file */
+	char *filename;
+	long max_size;
+	unsigned long dropped;
+	/* the queued bytes are ring[tail % SC_LOG_RING_SIZE] up to head */
+	size_t head;
+	size_t tail;
+	char ring[SC_LOG_RING_SIZE];
+	/* taken from the ring by the writer */
+	char out[16 * 1024];
+};
+
+static void sc_log_sink_rotate(struct sc_log_sink *sink, long *size)
+{
+	struct sc_context *ctx = sink->ctx;
+	size_t len = strlen(sink->filename) + 3;
+	char *old = malloc(len);
+
+	if (old == NULL)
+		return;
+	snprintf(old, len, "%s.1", sink->filename);
+	fclose(ctx->debug_file);
+	rename(sink->filename, old);
+	free(old);
+	ctx->debug_file = fopen(sink->filename, "a");
+	*size = 0;
+}
+
+static void *sc_log_sink_thread(void *arg)
+{
+	struct sc_log_sink *sink = arg;
+	struct sc_context *ctx = sink->ctx;
+	unsigned long dropped;
+	long size = 0;
+	size_t len, pos;
+
+	if (ctx->debug_file != NULL && sink->filename != NULL) {
+		fseek(ctx->debug_file, 0, SEEK_END);
+		size = ftell(ctx->debug_file);
+	}
+
+	pthread_mutex_lock(&sink->lock);
+	for (;;) {
+		while (sink->head == sink->tail && !sink->dropped && !sink->stop)
+			pthread_cond_wait(&sink->cond, &sink->lock);
+		if (sink->head == sink->tail && !sink->dropped)
+			break;
+
+		pos = sink->tail % SC_LOG_RING_SIZE;
+		len = sink->head - sink->tail;
+		if (len > SC_LOG_RING_SIZE - pos)
+			len = SC_LOG_RING_SIZE - pos;
+		if (len > sizeof(sink->out))
+			len = sizeof(sink->out);
+		memcpy(sink->out, sink->ring + pos, len);
+		sink->tail += len;
+		dropped = sink->dropped;
+		sink->dropped = 0;
+		pthread_mutex_unlock(&sink->lock);
+
+		if (ctx->debug_file != NULL) {
+			if (dropped)
+				size += fprintf(ctx->debug_file,
+						"%lu log messages dropped\n", dropped);
+			size += fwrite(sink->out, 1, len, ctx->debug_file);
+			fflush(ctx->debug_file);
+			if (sink->filename != NULL && sink->max_size > 0
+					&& size >= sink->max_size)
+				sc_log_sink_rotate(sink, &size);
+		}
+
+		pthread_mutex_lock(&sink->lock);
+	}
+	pthread_mutex_unlock(&sink->lock);
+
+	return NULL;
+}
+
+/* Waits for the queued messages to be written and stops the writer */
+static void sc_log_sink_stop(struct sc_log_sink *sink)
+{
+	pthread_mutex_lock(&sink->lock);
+	if (!sink->started || sink->pid != getpid()) {
+		pthread_mutex_unlock(&sink->lock);
+		return;
+	}
+	sink->stop = 1;
+	pthread_cond_signal(&sink->cond);
+	pthread_mutex_unlock(&sink->lock);
+
+	pthread_join(sink->thread, NULL);
+	sink->started = 0;
+	sink->stop = 0;
+}
+
+/* Queues a formatted message. Returns 0 if the caller has to write the
+ * message itself. */
+static int sc_log_sink_write(struct sc_log_sink *sink, const char *msg, size_t len)
+{
+	size_t pos, part;
+
+	if (sink->started && sink->pid != getpid()) {
+		/* the writer did not survive fork() */
+		pthread_mutex_init(&sink->lock, NULL);
+		pthread_cond_init(&sink->cond, NULL);
+		sink->started = 0;
+		sink->head = sink->tail = 0;
+	}
+
+	pthread_mutex_lock(&sink->lock);
+	if (!sink->started) {
+		sink->pid = getpid();
+		if (pthread_create(&sink->thread, NULL, sc_log_sink_thread, sink) != 0) {
+			pthread_mutex_unlock(&sink->lock);
+			return 0;
+		}
+		sink->started = 1;
+	}
+	if (sink->head - sink->tail + len > SC_LOG_RING_SIZE) {
+		/* the writer cannot keep up: rather lose the message than wait */
+		sink->dropped++;
+	} else {
+		pos = sink->head % SC_LOG_RING_SIZE;
+		part = SC_LOG_RING_SIZE - pos;
+		if (part > len)
+			part = len;
+		memcpy(sink->ring + pos, msg, part);
+		memcpy(sink->ring, msg + part, len - part);
+		sink->head += len;
+	}
+	pthread_cond_signal(&sink->cond);
+	pthread_mutex_unlock(&sink->lock);
+
+	return 1;
+}
+#endif
+
+int sc_log_sink_create(sc_context_t *ctx, int max_size)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_sink *sink = ctx->log_sink;
+
+	if (sink == NULL) {
+		sink = calloc(1, sizeof(struct sc_log_sink));
+		if (sink == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		pthread_mutex_init(&sink->lock, NULL);
+		pthread_cond_init(&sink->cond, NULL);
+		sink->ctx = ctx;
+		if (ctx->debug_filename != NULL && strcmp(ctx->debug_filename, "stdout")
+				&& strcmp(ctx->debug_filename, "stderr"))
+			sink->filename = strdup(ctx->debug_filename);
+		ctx->log_sink = sink;
+	}
+	if (max_size >= 0)
+		sink->max_size = (long) max_size * 1024;
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void sc_log_sink_set_file(sc_context_t *ctx, const char *filename)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_sink *sink = ctx->log_sink;
+
+	if (sink == NULL)
+		return;
+	sc_log_sink_stop(sink);
+	free(sink->filename);
+	sink->filename = NULL;
+	if (filename != NULL && strcmp(filename, "stdout") && strcmp(filename, "stderr"))
+		sink->filename = strdup(filename);
+#endif
+}
+
+void sc_log_sink_free(sc_context_t *ctx)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_sink *sink = ctx->log_sink;
+
+	if (sink == NULL)
+		return;
+	sc_log_sink_stop(sink);
+	pthread_cond_destroy(&sink->cond);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink->filename);
+	free(sink);
+	ctx->log_sink = NULL;
+#endif
+}
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
@@ -123,6 +331,20 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 		return;
 #endif
 
+#ifdef SC_LOG_ASYNC
+	if (ctx->log_sink != NULL) {
+		n = strlen(buf);
+		if (n == 0 || buf[n-1] != '\n') {
+			if ((size_t)n + 1 >= sizeof(buf))
+				n--;
+			buf[n++] = '\n';
+			buf[n] = '\0';
+		}
+		if (sc_log_sink_write(ctx->log_sink, buf, n))
+			return;
+	}
+#endif
+
 	outf = ctx->debug_file;
 	if (outf == NULL)
 		return;
@@ -182,6 +404,8 @@ void _sc_debug_hex(sc_context_t *ctx, int type, const char *file, int line,
 	free(buf);
 }
 
+static const char hex_digits[16] = "0123456789ABCDEF";
+
 void sc_hex_dump(const u8 * in, size_t count, char *buf, size_t len)
 {
 	char *p = buf;
@@ -198,24 +422,25 @@ void sc_hex_dump(const u8 * in, size_t count, char *buf, size_t len)
 		size_t i;
 
 		for (i = 0; i < count && i < 16; i++) {
-			sprintf(p, "%02X ", *in);
+			*p++ = hex_digits[*in >> 4];
+			*p++ = hex_digits[*in & 0x0F];
+			*p++ = ' ';
 			if (isprint(*in))
 				ascbuf[i] = *in;
 			else
 				ascbuf[i] = '.';
-			p += 3;
 			in++;
 		}
 		count -= i;
 		ascbuf[i] = 0;
 		for (; i < 16 && lines; i++) {
-			strcat(p, "   ");
+			memcpy(p, "   ", 3);
 			p += 3;
 		}
-		strcat(p, ascbuf);
-		p += strlen(p);
-		sprintf(p, "\n");
-		p++;
+		memcpy(p, ascbuf, strlen(ascbuf));
+		p += strlen(ascbuf);
+		*p++ = '\n';
+		*p = 0;
 		lines++;
 	}
 }
@@ -227,25 +452,21 @@ sc_dump_hex(const u8 * in, size_t count)
 	size_t ii, size = sizeof(dump_buf) - 0x10;
 	size_t offs = 0;
 
-	memset(dump_buf, 0, sizeof(dump_buf));
+	dump_buf[0] = 0;
 	if (in == NULL)
 		return dump_buf;
 
 	for (ii=0; ii<count; ii++) {
-		if (ii && !(ii%16))   {
-			if (!(ii%48))
-				snprintf(dump_buf + offs, size - offs, "\n");
-			else
-				snprintf(dump_buf + offs, size - offs, " ");
-			offs = strlen(dump_buf);
-		}
+		if (ii && !(ii%16))
+			dump_buf[offs++] = (ii%48) ? ' ' : '\n';
 
-		snprintf(dump_buf + offs, size - offs, "%02X", *(in + ii));
-		offs += 2;
+		dump_buf[offs++] = hex_digits[in[ii] >> 4];
+		dump_buf[offs++] = hex_digits[in[ii] & 0x0F];
 
 		if (offs > size)
 			break;
 	}
+	dump_buf[offs] = 0;
 
 	if (ii<count)
 		snprintf(dump_buf + offs, sizeof(dump_buf) - offs, "....\n");
@@ -44,9 +44,33 @@ enum {
 #define __FUNCTION__ NULL
 #endif
 
+/* Messages above this level are compiled out. With DISABLE_TRACE_LOG
+ * (configure --disable-trace-log) this are the ASN.1 and card matching
+ * messages, and the tracing of function calls and returns is dropped too. */
+#ifndef SC_LOG_MAX_LEVEL
+#ifdef DISABLE_TRACE_LOG
+#define SC_LOG_MAX_LEVEL	SC_LOG_DEBUG_NORMAL
+#else
+#define SC_LOG_MAX_LEVEL	SC_LOG_DEBUG_MATCH
+#endif
+#endif
+
+/* Checked at the call site, so that the arguments of a message that is not
+ * logged are not evaluated at all */
+#define SC_LOG_ENABLED(ctx, level) \
+	((level) <= SC_LOG_MAX_LEVEL && (ctx) != NULL && (ctx)->debug >= (level))
+#ifdef DISABLE_TRACE_LOG
+#define SC_LOG_TRACE_ENABLED(ctx, level)	((void)(ctx), 0)
+#else
+#define SC_LOG_TRACE_ENABLED(ctx, level)	SC_LOG_ENABLED(ctx, level)
+#endif
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) sc_debug(ctx, SC_LOG_DEBUG_NORMAL, format , ## args)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -85,8 +109,10 @@ void _sc_log(struct sc_context *ctx, const char *format, ...);
  * @param[in] data  Binary data
  * @param[in] len   Length of \a data
  */
-#define sc_debug_hex(ctx, level, label, data, len) \
-    _sc_debug_hex(ctx, level, __FILE__, __LINE__, __FUNCTION__, label, data, len)
+#define sc_debug_hex(ctx, level, label, data, len) do { \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		_sc_debug_hex(ctx, level, __FILE__, __LINE__, __FUNCTION__, label, data, len); \
+} while (0)
 #define sc_log_hex(ctx, label, data, len) \
     sc_debug_hex(ctx, SC_LOG_DEBUG_NORMAL, label, data, len)
 /** 
@@ -108,13 +134,15 @@ void sc_hex_dump(const u8 *buf, size_t len, char *out, size_t outlen);
 const char * sc_dump_hex(const u8 * in, size_t count);
 const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	if (SC_LOG_TRACE_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
+	if (!SC_LOG_TRACE_ENABLED(ctx, level)) { \
+	} else if (_ret <= 0) { \
 		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
 	} else { \
@@ -128,8 +156,9 @@ const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -138,8 +167,9 @@ const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_GOTO_ERR(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		goto err; \
 	} \
 } while(0)
@@ -22,6 +22,7 @@
 #include "config.h"
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "internal.h"
@@ -72,26 +73,37 @@ int msc_list_objects(sc_card_t* card, u8 next, mscfs_file_t* file) {
 	return 1;
 }
 
+/* READ OBJECT and WRITE OBJECT carry the length of their chunk in one
+ * byte. The chunks of a large object are sent in batches, so that a reader
+ * that can batch APDUs does not need a round trip for each of them */
+#define MSC_MAX_CHUNK	255
+#define MSC_MAX_BATCH	8
+
+static void msc_format_read(sc_card_t *card, sc_apdu_t *apdu, u8 *header,
+		msc_id objectId, int offset, u8 *data, size_t dataLength)
+{
+	sc_format_apdu(card, apdu, SC_APDU_CASE_4_SHORT, 0x56, 0x00, 0x00);
+	memcpy(header, objectId.id, 4);
+	ulong2bebytes(header + 4, offset);
+	header[8] = (u8)dataLength;
+	apdu->data = header;
+	apdu->datalen = 9;
+	apdu->lc = 9;
+	apdu->le = dataLength;
+	apdu->resplen = dataLength;
+	apdu->resp = data;
+}
+
 int msc_partial_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength)
 {
 	u8 buffer[9];
 	sc_apdu_t apdu;
 	int r;
 	
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0x56, 0x00, 0x00);
-	
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 		"READ: Offset: %x\tLength: %"SC_FORMAT_LEN_SIZE_T"u\n", offset,
 		 dataLength);
-	memcpy(buffer, objectId.id, 4);
-	ulong2bebytes(buffer + 4, offset);
-	buffer[8] = (u8)dataLength;
-	apdu.data = buffer;
-	apdu.datalen = 9;
-	apdu.lc = 9;
-	apdu.le = dataLength;
-	apdu.resplen = dataLength;
-	apdu.resp = data; 
+	msc_format_read(card, &apdu, buffer, objectId, offset, data, dataLength);
 	r = sc_transmit_apdu(card, &apdu);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
 	if(apdu.sw1 == 0x90 && apdu.sw2 == 0x00)
@@ -114,12 +126,24 @@ int msc_partial_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *da
 
 int msc_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength)
 {
+	sc_apdu_t apdus[MSC_MAX_BATCH];
+	u8 headers[MSC_MAX_BATCH][9];
+	size_t max_read_unit = MIN(MSC_MAX_READ, MSC_MAX_CHUNK);
+	size_t i, n, len;
 	int r;
-	size_t i;
-	size_t max_read_unit = MSC_MAX_READ;
 
-	for(i = 0; i < dataLength; i += max_read_unit) {
-		r = msc_partial_read_object(card, objectId, offset + i, data + i, MIN(dataLength - i, max_read_unit));
+	if (dataLength <= max_read_unit)
+		return msc_partial_read_object(card, objectId, offset, data, dataLength);
+
+	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
+		"READ: Offset: %x\tLength: %"SC_FORMAT_LEN_SIZE_T"u\n", offset,
+		 dataLength);
+	for(i = 0; i < dataLength; ) {
+		for(n = 0; n < MSC_MAX_BATCH && i < dataLength; n++, i += len) {
+			len = MIN(dataLength - i, max_read_unit);
+			msc_format_read(card, &apdus[n], headers[n], objectId, offset + i, data + i, len);
+		}
+		r = sc_transmit_apdus(card, apdus, n);
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Error in partial object read");
 	}
 	return dataLength;
@@ -127,15 +151,17 @@ int msc_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size
 
 int msc_zero_object(sc_card_t *card, msc_id objectId, size_t dataLength)
 {
-	u8 zeroBuffer[MSC_MAX_APDU];
-	size_t i;
-	size_t max_write_unit = MSC_MAX_SEND - 9; /* - 9 for object ID+length */
+	u8 *zeroBuffer;
+	int r;
 
-	memset(zeroBuffer, 0, max_write_unit);
-	for(i = 0; i < dataLength; i += max_write_unit) {
-		int r = msc_partial_update_object(card, objectId, i, zeroBuffer, MIN(dataLength - i, max_write_unit));
-		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Error in zeroing file update");
-	}
+	if (dataLength == 0)
+		return 0;
+	zeroBuffer = calloc(1, dataLength);
+	if (zeroBuffer == NULL)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+	r = msc_update_object(card, objectId, 0, zeroBuffer, dataLength);
+	free(zeroBuffer);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Error in zeroing file update");
 	return 0;
 }
 
@@ -176,6 +202,19 @@ int msc_create_object(sc_card_t *card, msc_id objectId, size_t objectSize, unsig
 	return objectSize;
 }
 
+static void msc_format_update(sc_card_t *card, sc_apdu_t *apdu, u8 *buffer,
+		msc_id objectId, int offset, const u8 *data, size_t dataLength)
+{
+	sc_format_apdu(card, apdu, SC_APDU_CASE_3_SHORT, 0x54, 0x00, 0x00);
+	memcpy(buffer, objectId.id, 4);
+	ulong2bebytes(buffer + 4, offset);
+	buffer[8] = (u8)dataLength;
+	memcpy(buffer + 9, data, dataLength);
+	apdu->lc = dataLength + 9;
+	apdu->data = buffer;
+	apdu->datalen = apdu->lc;
+}
+
 /* Update up to MSC_MAX_READ - 9 bytes */
 int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, const u8 *data, size_t dataLength)
 {
@@ -183,19 +222,12 @@ int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, cons
 	sc_apdu_t apdu;
 	int r;
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x54, 0x00, 0x00);
-	apdu.lc = dataLength + 9;
 	if (card->ctx->debug >= 2)
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 			 "WRITE: Offset: %x\tLength: %"SC_FORMAT_LEN_SIZE_T"u\n",
 			 offset, dataLength);
 	
-	memcpy(buffer, objectId.id, 4);
-	ulong2bebytes(buffer + 4, offset);
-	buffer[8] = (u8)dataLength;
-	memcpy(buffer + 9, data, dataLength);
-	apdu.data = buffer;
-	apdu.datalen = apdu.lc;
+	msc_format_update(card, &apdu, buffer, objectId, offset, data, dataLength);
 	r = sc_transmit_apdu(card, &apdu);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
 	if(apdu.sw1 == 0x90 && apdu.sw2 == 0x00)
@@ -219,11 +251,25 @@ int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, cons
 
 int msc_update_object(sc_card_t *card, msc_id objectId, int offset, const u8 *data, size_t dataLength)
 {
+	sc_apdu_t apdus[MSC_MAX_BATCH];
+	u8 buffers[MSC_MAX_BATCH][MSC_MAX_CHUNK + 9];
+	size_t max_write_unit = MIN(MSC_MAX_SEND, MSC_MAX_CHUNK + 9) - 9;
+	size_t i, n, len;
 	int r;
-	size_t i;
-	size_t max_write_unit = MSC_MAX_SEND - 9;
-	for(i = 0; i < dataLength; i += max_write_unit) {
-		r = msc_partial_update_object(card, objectId, offset + i, data + i, MIN(dataLength - i, max_write_unit));
+
+	if (dataLength <= max_write_unit)
+		return msc_partial_update_object(card, objectId, offset, data, dataLength);
+
+	if (card->ctx->debug >= 2)
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
+			 "WRITE: Offset: %x\tLength: %"SC_FORMAT_LEN_SIZE_T"u\n",
+			 offset, dataLength);
+	for(i = 0; i < dataLength; ) {
+		for(n = 0; n < MSC_MAX_BATCH && i < dataLength; n++, i += len) {
+			len = MIN(dataLength - i, max_write_unit);
+			msc_format_update(card, &apdus[n], buffers[n], objectId, offset + i, data + i, len);
+		}
+		r = sc_transmit_apdus(card, apdus, n);
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Error in partial object update");
 	}
 	return dataLength;
@@ -268,12 +268,35 @@ struct sc_ef_atr {
 	unsigned status;
 };
 
+#define SC_MAX_CACHED_SFIDS	16
+
 struct sc_card_cache {
 	struct sc_path current_path;
 
         struct sc_file *current_ef;
         struct sc_file *current_df;
 
+	/* With SC_CARD_CAP_SELECT_CACHE: the absolute path of the selected
+	 * file and of the DF holding it, len 0 if not known */
+	struct sc_path selected_path;
+	struct sc_path selected_dir;
+	/* With SC_CARD_CAP_SELECT_CACHE: the file IDs returned by
+	 * sc_list_files() for the DF listed_dir, len 0 if not known */
+	struct sc_path listed_dir;
+	u8 listed_fids[256];
+	size_t listed_len;
+	/* With SC_CARD_CAP_SELECT_CACHE: the short EF identifiers of the
+	 * transparent EFs, from the FCI of their SELECT by absolute path */
+	struct sc_path sfid_path[SC_MAX_CACHED_SFIDS];
+	u8 sfid[SC_MAX_CACHED_SFIDS];
+	size_t sfid_count;
+
+	/* With SC_CARD_CAP_KEEP_SECURITY_ENV: the environment last set with
+	 * sc_set_security_env(), if se_valid */
+	struct sc_security_env se;
+	int se_num;
+	int se_valid;
+
 	int valid;
 };
 
@@ -306,11 +329,30 @@ struct sc_reader_driver {
 #define SC_READER_CAP_PACE_ESIGN           0x00000008
 #define SC_READER_CAP_PACE_DESTROY_CHANNEL 0x00000010
 #define SC_READER_CAP_PACE_GENERIC         0x00000020
+/* the card is accessed over the air (ISO/IEC 14443), see reader-pcsc.c */
+#define SC_READER_CAP_CONTACTLESS          0x00000040
 
 /* reader send/receive length of short APDU */
 #define SC_READER_SHORT_APDU_MAX_SEND_SIZE 255
 #define SC_READER_SHORT_APDU_MAX_RECV_SIZE 256
 
+/* Latency histogram of the APDU statistics: bucket 0 counts the APDUs that
+ * took less than 1 ms, bucket i the ones that took 2^(i-1) to 2^i ms, and
+ * the last bucket all slower ones */
+#define SC_APDU_STATS_BUCKETS	16
+
+/* Statistics of the APDUs with one INS byte sent through a reader */
+struct sc_apdu_stats {
+	unsigned long count;		/* transmitted APDUs */
+	unsigned long errors;		/* failed transmissions */
+	unsigned long long bytes_out;	/* encoded command APDUs */
+	unsigned long long bytes_in;	/* responses including SW1 SW2 */
+	unsigned long get_response;	/* 61xx followed by GET RESPONSE */
+	unsigned long retransmit;	/* 6Cxx followed by re-transmission */
+	unsigned long long time_us;	/* total transmission time */
+	unsigned long latency[SC_APDU_STATS_BUCKETS];
+};
+
 typedef struct sc_reader {
 	struct sc_context *ctx;
 	const struct sc_reader_driver *driver;
@@ -334,6 +376,18 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	/* 256 entries indexed by the INS byte, with SC_CTX_FLAG_APDU_STATS */
+	struct sc_apdu_stats *apdu_stats;
+
+	/* READ/UPDATE BINARY sizes that worked for the card with this ATR,
+	 * 0 if not limited */
+	struct sc_atr chunk_atr;
+	size_t read_chunk_size;
+	size_t update_chunk_size;
+
+	/* CPLC data and AID SELECT results of the card in the reader, see gp.c */
+	struct gp_card_cache *gp_cache;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -396,6 +450,23 @@ struct sc_pin_cmd_data {
 	struct sc_apdu *apdu;		/* APDU of the PIN command */
 };
 
+/* Called when an APDU started with sc_transmit_apdu_submit() was
+ * transmitted, possibly from a different thread */
+typedef void (*sc_apdu_callback_t)(struct sc_apdu *apdu, void *arg);
+
+/* An event of a reader with the state that came with it, see
+ * sc_wait_for_reader_event() */
+struct sc_reader_event {
+	/* NULL if a reader was attached or detached */
+	struct sc_reader *reader;
+	/* ORed SC_EVENT_* */
+	unsigned int event;
+	/* SC_READER_CARD_PRESENT if a card is in the reader */
+	unsigned long flags;
+	/* of the card in the reader, if any */
+	struct sc_atr atr;
+};
+
 struct sc_reader_operations {
 	/* Called during sc_establish_context(), when the driver
 	 * is loaded */
@@ -416,6 +487,16 @@ struct sc_reader_operations {
 	int (*connect)(struct sc_reader *reader);
 	int (*disconnect)(struct sc_reader *reader);
 	int (*transmit)(struct sc_reader *reader, sc_apdu_t *apdu);
+	/* Optional: transmit several APDUs in one call. The driver stops
+	 * after the first APDU that did not return 90 00 and returns the
+	 * number of transmitted APDUs, or an error code. */
+	int (*transmit_batch)(struct sc_reader *reader, sc_apdu_t *apdus, size_t count);
+	/* Optional: start transmitting the APDU and return immediately.
+	 * transmit_wait() waits for the transmission and returns what
+	 * transmit() would have returned. callback may be NULL. */
+	int (*transmit_submit)(struct sc_reader *reader, sc_apdu_t *apdu,
+			sc_apdu_callback_t callback, void *arg);
+	int (*transmit_wait)(struct sc_reader *reader, sc_apdu_t *apdu);
 	int (*lock)(struct sc_reader *reader);
 	int (*unlock)(struct sc_reader *reader);
 	int (*set_protocol)(struct sc_reader *reader, unsigned int proto);
@@ -430,6 +511,10 @@ struct sc_reader_operations {
 	int (*wait_for_event)(struct sc_context *ctx, unsigned int event_mask,
 			sc_reader_t **event_reader, unsigned int *event,
 			int timeout, void **reader_states);
+	/* Optional: wait_for_event() that also reports the state of the
+	 * reader seen with the event */
+	int (*wait_for_reader_event)(struct sc_context *ctx, unsigned int event_mask,
+			struct sc_reader_event *event, int timeout, void **reader_states);
 	/* Reset a reader */
 	int (*reset)(struct sc_reader *, int);
 	/* Used to pass in PC/SC handles to minidriver */
@@ -485,6 +570,20 @@ struct sc_reader_operations {
 /* Card (or card driver) supports generating a session PIN */
 #define SC_CARD_CAP_SESSION_PIN	0x00000200
 
+/* sc_select_file() may skip selecting the file that is already selected
+ * and select a file in the current DF by its file identifier only. The
+ * list_files operation of such a driver must return all the files of the
+ * DF: a file missing in its listing is not selected at all */
+#define SC_CARD_CAP_SELECT_CACHE	0x00000400
+
+/* sc_set_security_env() may skip setting the environment that was set last,
+ * as long as the card stays locked and no file was selected since */
+#define SC_CARD_CAP_KEEP_SECURITY_ENV	0x00000800
+
+/* READ RECORD can return all the records from a record number up to the
+ * last one (P2 mode 101 of ISO 7816-4), see sc_read_records() */
+#define SC_CARD_CAP_READ_ALL_RECORDS	0x00001000
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -516,10 +615,29 @@ typedef struct sc_card {
 	int max_pin_len;
 
 	struct sc_card_cache cache;
+	/* Changed whenever the authentication state of the card may have
+	 * changed: on reset, logout and PIN commands other than GET_INFO */
+	unsigned int auth_serial;
+	/* Changed whenever the card lost its security status for sure: on
+	 * reset, or when a driver had to select its application again */
+	unsigned int reset_serial;
+	/* The connection to the reader was closed by sc_detach_card(); set
+	 * again by sc_reattach_card() until the next sc_lock() */
+	int detached;
+	int reattached;
 
 	struct sc_serial_number serialnr;
 	struct sc_version version;
 
+	/* APDU started with sc_transmit_apdu_submit() */
+	struct {
+		struct sc_apdu *apdu;
+		size_t olen;
+		int done;	/* already transmitted, with result */
+		int result;
+		unsigned long long start;
+	} async;
+
 	void *mutex;
 #ifdef ENABLE_SM
 	struct sm_context sm_ctx;
@@ -694,6 +812,10 @@ typedef struct {
 #define SC_CTX_FLAG_DEBUG_MEMORY			0x00000004
 #define SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER	0x00000008
 #define SC_CTX_FLAG_DISABLE_POPUPS			0x00000010
+#define SC_CTX_FLAG_CACHE_CARD_DRIVERS		0x00000020
+#define SC_CTX_FLAG_APDU_STATS			0x00000040
+/* sc_context_create() does not list the readers, sc_ctx_detect_readers() does */
+#define SC_CTX_FLAG_DEFER_READERS		0x00000080
 
 typedef struct sc_context {
 	scconf_context *conf;
@@ -712,11 +834,28 @@ typedef struct sc_context {
 	void *reader_drv_data;
 
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
+	/* whether the external card driver is still to be loaded */
+	unsigned char card_driver_state[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
 
+	struct sc_atr_index *atr_index;
+
+	/* profile files parsed by pkcs15init, see sc_profile_load() */
+	void *profile_cache;
+
+	/* background writer of the debug log, see debug_async */
+	void *log_sink;
+
+	/* memory budget of the card driver caches, see cache.c */
+	void *cache_mgr;
+
+	/* the APDU statistics of a reader are appended here when it is
+	 * released, see apdu_statistics_file */
+	char *apdu_stats_file;
+
 	unsigned int magic;
 } sc_context_t;
 
@@ -729,6 +868,73 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *, struct sc_apdu *);
 
+/** Sends a series of APDUs to the card while holding the card lock
+ *  @param  card   struct sc_card object to which the APDUs should be send
+ *  @param  apdus  array of sc_apdu_t objects to be send in this order
+ *  @param  count  number of APDUs in @a apdus
+ *  @return SC_SUCCESS if all APDUs returned a successful status word,
+ *          otherwise the error of the first APDU that failed. The APDUs
+ *          after the failed one are not transmitted.
+ */
+int sc_transmit_apdus(struct sc_card *card, struct sc_apdu *apdus, size_t count);
+
+/** Starts sending an APDU to the card without waiting for the response.
+ *  The card stays locked until sc_transmit_apdu_complete() was called for
+ *  the APDU, and must not be used otherwise in the meantime. If the reader
+ *  driver cannot transmit asynchronously, the APDU is transmitted before
+ *  this function returns. Command chaining and secure messaging are not
+ *  supported.
+ *  @param  card      struct sc_card object to which the APDU should be send
+ *  @param  apdu      sc_apdu_t object of the APDU to be send
+ *  @param  callback  called when sc_transmit_apdu_complete() would not
+ *                    block anymore, possibly from a different thread;
+ *                    may be NULL
+ *  @param  arg       passed to @a callback
+ *  @return SC_SUCCESS if the APDU was started and an error code otherwise
+ */
+int sc_transmit_apdu_submit(struct sc_card *card, struct sc_apdu *apdu,
+		sc_apdu_callback_t callback, void *arg);
+
+/** Waits for an APDU started with sc_transmit_apdu_submit() and does the
+ *  same processing of the response as sc_transmit_apdu().
+ *  @param  card  struct sc_card object to which the APDU was send
+ *  @param  apdu  sc_apdu_t object passed to sc_transmit_apdu_submit()
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_transmit_apdu_complete(struct sc_card *card, struct sc_apdu *apdu);
+
+/** Returns the statistics of the APDUs sent through the reader
+ *  @param  reader  sc_reader_t object
+ *  @param  ins     INS byte of the APDUs
+ *  @return statistics of the APDUs with this INS byte, or NULL if the
+ *          statistics are not collected (see SC_CTX_FLAG_APDU_STATS)
+ */
+const struct sc_apdu_stats *sc_get_apdu_stats(struct sc_reader *reader, unsigned int ins);
+
+/** Clears the statistics of the APDUs sent through the reader
+ *  @param  reader  sc_reader_t object
+ */
+void sc_reset_apdu_stats(struct sc_reader *reader);
+
+/* Statistics of one cache of a card driver */
+struct sc_cache_stats {
+	const char *name;	/* card driver of the cache */
+	size_t size;		/* bytes held */
+	size_t entries;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;	/* entries dropped to stay in memory_cache_size */
+};
+
+/** Returns the statistics of a cache of the card drivers
+ *  @param  ctx    OpenSC context
+ *  @param  idx    index of the cache, starting at 0
+ *  @param  stats  receives the statistics
+ *  @return SC_SUCCESS, or SC_ERROR_OBJECT_NOT_FOUND if there is no
+ *          cache with this index
+ */
+int sc_get_cache_stats(struct sc_context *ctx, size_t idx, struct sc_cache_stats *stats);
+
 void sc_format_apdu(struct sc_card *, struct sc_apdu *, int, int, int, int);
 
 int sc_check_apdu(struct sc_card *, const struct sc_apdu *);
@@ -824,6 +1030,16 @@ int sc_context_create(sc_context_t **ctx, const sc_context_param_t *parm);
  */
 int sc_release_context(sc_context_t *ctx);
 
+/**
+ * Re-establishes the reader driver of a context, e.g. in the child after
+ * fork(). The readers and the handles of the reader subsystem are dropped
+ * without being released and detected again, while the configuration and
+ * the card drivers of the context are kept.
+ * @param  ctx  OpenSC context
+ * @return SC_SUCCESS on success and an error code otherwise.
+ */
+int sc_context_reset_readers(sc_context_t *ctx);
+
 /**
  * Detect new readers available on system.
  * @param  ctx  OpenSC context
@@ -917,6 +1133,26 @@ int sc_connect_card(sc_reader_t *reader, struct sc_card **card);
  * @return SC_SUCCESS on success and an error code otherwise
  */
 int sc_disconnect_card(struct sc_card *card);
+/**
+ * Closes the connection to the reader of a card that was removed, but
+ * keeps the card structure and the state of the card driver, so that the
+ * card can be taken up again with sc_reattach_card() when it is inserted
+ * again. The card is freed with sc_disconnect_card().
+ * @param  card  The card to detach
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_detach_card(struct sc_card *card);
+/**
+ * Connects a detached card to its reader again, if the reader holds the
+ * same card: the ATR, the UID and the serial number read from the card
+ * must match. The card is then handled as after a reset.
+ * @param  card    The card to reattach
+ * @param  serial  The serial number of the card before it was detached
+ * @return SC_SUCCESS on success, SC_ERROR_WRONG_CARD if the reader holds
+ *         a different card and another error code otherwise; the card
+ *         stays detached on error
+ */
+int sc_reattach_card(struct sc_card *card, const struct sc_serial_number *serial);
 
 /**
  * Checks if a card is present in a reader
@@ -952,6 +1188,25 @@ int sc_wait_for_event(sc_context_t *ctx, unsigned int event_mask,
                       sc_reader_t **event_reader, unsigned int *event,
 		      int timeout, void **reader_states);
 
+/**
+ * Waits for an event on readers like sc_wait_for_event(), and reports
+ * with it whether a card is in the reader and the ATR of that card, as
+ * seen by the reader driver when the event occurred. Unlike with
+ * sc_wait_for_event(), the card does not need to be detected again to
+ * tell which card was inserted.
+ * @param ctx  pointer to a Context structure
+ * @param event_mask The types of events to wait for, see sc_wait_for_event()
+ * @param event (OUT) the event, the reader and its state
+ * @param timeout Amount of millisecs to wait; -1 means forever
+ * @param reader_states kept between the calls as with sc_wait_for_event(),
+ *   and freed in the same way
+ * @retval SC_ERROR_EVENT_TIMEOUT if the timeout occurred
+ * @retval < 0 if an error occurred
+ * @retval = 0 if a an event happened
+ */
+int sc_wait_for_reader_event(sc_context_t *ctx, unsigned int event_mask,
+		struct sc_reader_event *event, int timeout, void **reader_states);
+
 /**
  * Resets the card.
  * NOTE: only PC/SC backend implements this function at this moment.
@@ -1082,6 +1337,9 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx,
 #define SC_RECORD_BY_REC_NR		0x00100UL
 /** use currently selected record */
 #define SC_RECORD_CURRENT		0UL
+/** read all records from the specified record number up to the last one,
+ * see sc_read_records() */
+#define SC_RECORD_ALL_FROM_REC_NR	0x00200UL
 
 /**
  * Reads a record from the current (i.e. selected) file.
@@ -1094,6 +1352,22 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx,
  */
 int sc_read_record(struct sc_card *card, unsigned int rec_nr, u8 * buf,
 		   size_t count, unsigned long flags);
+/**
+ * Reads the records of the current (i.e. selected) file from the record
+ * rec_nr up to the last one. Cards with SC_CARD_CAP_READ_ALL_RECORDS
+ * return them with a single READ RECORD command, the records of the other
+ * cards are read one after the other.
+ * @param  card    struct sc_card object on which to issue the command
+ * @param  rec_nr  number of the first record to read, starting from 1
+ * @param  buf     Pointer to a buffer for storing the data
+ * @param  count   Size of the buffer
+ * @param  flags   flags (may contain a short file id of a file to select)
+ * @retval number of bytes read, the records following each other without
+ *         separation, or an error value. The last record may be truncated
+ *         if the buffer is filled.
+ */
+int sc_read_records(struct sc_card *card, unsigned int rec_nr, u8 * buf,
+		   size_t count, unsigned long flags);
 /**
  * Writes data to a record from the current (i.e. selected) file.
  * @param  card    struct sc_card object on which to issue the command
@@ -1188,6 +1462,17 @@ int sc_file_valid(const sc_file_t *file);
 sc_file_t * sc_file_new(void);
 void sc_file_free(sc_file_t *file);
 void sc_file_dup(sc_file_t **dest, const sc_file_t *src);
+/**
+ * Shares a file: the returned pointer is the same file, with one more
+ * reference to it, released by sc_file_free(). A holder that modifies a
+ * shared file calls sc_file_unshare() first.
+ */
+sc_file_t * sc_file_ref(sc_file_t *file);
+/**
+ * Copy-on-write: if *file is shared, replaces it with a private copy
+ * and drops the reference to the shared one
+ */
+int sc_file_unshare(sc_file_t **file);
 
 int sc_file_add_acl_entry(sc_file_t *file, unsigned int operation,
 			  unsigned int method, unsigned long key_ref);
@@ -1326,6 +1611,19 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen);
  * @param  len  length of the memory buffer
  */
 void sc_mem_clear(void *ptr, size_t len);
+/**
+ * Allocates zeroed memory for secrets that is kept out of the swap
+ * where the system allows it. Small buffers come from a pool of locked
+ * pages shared by the whole process.
+ * @param  len  length of the memory buffer
+ */
+void *sc_mem_secure_alloc(size_t len);
+/**
+ * Clears and frees memory from sc_mem_secure_alloc().
+ * @param  ptr  pointer to the memory buffer
+ * @param  len  length of the memory buffer, as passed to sc_mem_secure_alloc()
+ */
+void sc_mem_secure_free(void *ptr, size_t len);
 int sc_mem_reverse(unsigned char *buf, size_t len);
 
 int sc_get_cache_dir(sc_context_t *ctx, char *buf, size_t bufsize);
@@ -1374,7 +1672,8 @@ const u8 *sc_compacttlv_find_tag(const u8 *buf, size_t len, u8 tag, size_t *outl
 /**
  * Used to initialize the @c sc_remote_data structure --
  * reset the header of the 'remote APDUs' list, set the handlers
- * to manipulate the list.
+ * to manipulate the list. When the number of APDUs is known in
+ * advance, 'reserve' allocates them at once in a contiguous array.
  */
 void sc_remote_data_init(struct sc_remote_data *rdata);
 
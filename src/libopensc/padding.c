@@ -83,26 +83,16 @@ static const struct digest_info_prefix {
 
 /* add/remove pkcs1 BT01 padding */
 
-static int sc_pkcs1_add_01_padding(const u8 *in, size_t in_len,
-	u8 *out, size_t *out_len, size_t mod_length)
+/* Writes the BT01 padding in front of the 'data_len' bytes that are
+ * already at the end of the 'mod_length' bytes of 'out' */
+static void sc_pkcs1_fill_01_padding(u8 *out, size_t data_len, size_t mod_length)
 {
-	size_t i;
+	size_t pad_len = mod_length - data_len;
 
-	if (*out_len < mod_length)
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	if (in_len + 11 > mod_length)
-		return SC_ERROR_INVALID_ARGUMENTS;
-	i = mod_length - in_len;
-	memmove(out + i, in, in_len);
-	*out++ = 0x00;
-	*out++ = 0x01;
-	
-	memset(out, 0xFF, i - 3);
-	out += i - 3;
-	*out = 0x00;
-
-	*out_len = mod_length;
-	return SC_SUCCESS;
+	out[0] = 0x00;
+	out[1] = 0x01;
+	memset(out + 2, 0xFF, pad_len - 3);
+	out[pad_len - 1] = 0x00;
 }
 
 int
@@ -138,70 +128,123 @@ sc_pkcs1_strip_01_padding(struct sc_context *ctx, const u8 *in_dat, size_t in_le
 }
 
 
+/*
+ * Constant time helpers for the BT02 unpadding: masks are all ones for true
+ * and all zeros for false, no branch or memory access depends on their value.
+ */
+static unsigned int ct_msb(unsigned int a)
+{
+	return 0 - (a >> (sizeof(a) * 8 - 1));
+}
+
+static unsigned int ct_is_zero(unsigned int a)
+{
+	return ct_msb(~a & (a - 1));
+}
+
+static unsigned int ct_eq(unsigned int a, unsigned int b)
+{
+	return ct_is_zero(a ^ b);
+}
+
+static unsigned int ct_lt(unsigned int a, unsigned int b)
+{
+	return ct_msb(a ^ ((a ^ b) | ((a - b) ^ b)));
+}
+
+static unsigned int ct_select(unsigned int mask, unsigned int a, unsigned int b)
+{
+	return (mask & a) | (~mask & b);
+}
+
 /* remove pkcs1 BT02 padding (adding BT02 padding is currently not
- * needed/implemented) */
+ * needed/implemented)
+ *
+ * The padding is checked and removed in constant time, so that the
+ * time taken does not tell where the separator is or whether the padding
+ * was valid (Bleichenbacher's attack). */
 int
 sc_pkcs1_strip_02_padding(sc_context_t *ctx, const u8 *data, size_t len, u8 *out, size_t *out_len)
 {
-	unsigned int	n = 0;
+	unsigned int good, found = 0, zero_index = 0, msg_index, msg_len, i, shift;
+	size_t max_len, skip;
+	u8 *em, *msg;
 
 	LOG_FUNC_CALLED(ctx);
 	if (data == NULL || len < 3)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 
 	/* skip leading zero byte */
-	if (*data == 0) {
-		data++;
-		len--;
-	}
-	if (data[0] != 0x02)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
-	/* skip over padding bytes */
-	for (n = 1; n < len && data[n]; n++)
-		;
-	/* Must be at least 8 pad bytes */
-	if (n >= len || n < 9)
+	skip = ct_is_zero(data[0]) & 1;
+	data += skip;
+	len -= skip;
+	/* at least 8 pad bytes and the separator */
+	if (len < 10)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
-	n++;
+
+	good = ct_eq(data[0], 0x02);
+	for (i = 1; i < len; i++) {
+		unsigned int is_zero = ct_is_zero(data[i]);
+
+		zero_index = ct_select(~found & is_zero, i, zero_index);
+		found |= is_zero;
+	}
+	good &= found & ~ct_lt(zero_index, 9);
+	msg_index = zero_index + 1;
+	msg_len = (unsigned int)len - msg_index;
+
 	if (out == NULL)
 		/* just check the padding */
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		LOG_FUNC_RETURN(ctx, good ? SC_SUCCESS : SC_ERROR_WRONG_PADDING);
+
+	/* Shift the message to the start of a copy of the longest possible
+	 * message, in log(len) passes that do not depend on its position */
+	max_len = len - 10;
+	em = malloc(max_len ? max_len : 1);
+	if (em == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(em, data + 10, max_len);
+	msg = em;
+	msg_index = ct_select(good, msg_index - 10, 0);
+	for (shift = 1; shift < max_len; shift <<= 1) {
+		unsigned int mask = ~ct_is_zero(msg_index & shift);
+
+		for (i = 0; i + shift < max_len; i++)
+			msg[i] = (u8)ct_select(mask, msg[i + shift], msg[i]);
+	}
+	for (i = 0; i < max_len && i < *out_len; i++)
+		out[i] = (u8)ct_select(good & ct_lt(i, msg_len), msg[i], out[i]);
+	sc_mem_clear(em, max_len);
+	free(em);
 
-	/* Now move decrypted contents to head of buffer */
-	if (*out_len < len - n)
+	if (!good)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
+	if (*out_len < msg_len)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
-	*out_len = len - n;
-	memmove(out, data + n, *out_len);
+	*out_len = msg_len;
 
-	sc_log(ctx, "stripped output(%"SC_FORMAT_LEN_SIZE_T"u): %s", len - n,
-	       sc_dump_hex(out, len - n));
-	LOG_FUNC_RETURN(ctx, len - n);
+	sc_log(ctx, "stripped output(%u): %s", msg_len, sc_dump_hex(out, msg_len));
+	LOG_FUNC_RETURN(ctx, (int)msg_len);
 }
 
 /* add/remove DigestInfo prefix */
-static int sc_pkcs1_add_digest_info_prefix(unsigned int algorithm,
-	const u8 *in, size_t in_len, u8 *out, size_t *out_len)
+static const struct digest_info_prefix *sc_pkcs1_find_digest_info_prefix(unsigned int algorithm)
 {
 	int i;
 
-	for (i = 0; digest_info_prefix[i].algorithm != 0; i++) {
-		if (algorithm == digest_info_prefix[i].algorithm) {
-			const u8 *hdr      = digest_info_prefix[i].hdr;
-			size_t    hdr_len  = digest_info_prefix[i].hdr_len,
-			          hash_len = digest_info_prefix[i].hash_len;
-
-			if (in_len != hash_len || *out_len < (hdr_len + hash_len))
-				return SC_ERROR_INTERNAL;
-
-			memmove(out + hdr_len, in, hash_len);
-			memmove(out, hdr, hdr_len);
-			*out_len = hdr_len + hash_len;
-
-			return SC_SUCCESS;
-		}
-	}
+	for (i = 0; digest_info_prefix[i].algorithm != 0; i++)
+		if (algorithm == digest_info_prefix[i].algorithm)
+			return &digest_info_prefix[i];
+	return NULL;
+}
 
-	return SC_ERROR_INTERNAL;
+/* Writes the DigestInfo of the hash 'in' to 'out', which may overlap 'in' */
+static void sc_pkcs1_put_digest_info(const struct digest_info_prefix *prefix,
+	const u8 *in, u8 *out)
+{
+	memmove(out + prefix->hdr_len, in, prefix->hash_len);
+	if (prefix->hdr_len)
+		memcpy(out, prefix->hdr, prefix->hdr_len);
 }
 
 int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
@@ -231,13 +274,16 @@ int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 	return SC_ERROR_INTERNAL;
 }
 
-/* general PKCS#1 encoding function */
+/* general PKCS#1 encoding function
+ *
+ * The DigestInfo and the data are written once, straight to their final
+ * place in 'out', which may be the same buffer as 'in'. */
 int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	const u8 *in, size_t in_len, u8 *out, size_t *out_len, size_t mod_len)
 {
-	int    rv, i;
-	size_t tmp_len = *out_len;
-	const u8    *tmp = in;
+	const struct digest_info_prefix *prefix = NULL;
+	size_t data_len = in_len;
+	u8 *data;
 	unsigned int hash_algo, pad_algo;
 
 	LOG_FUNC_CALLED(ctx);
@@ -247,32 +293,47 @@ int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	sc_log(ctx, "hash algorithm 0x%X, pad algorithm 0x%X", hash_algo, pad_algo);
 
 	if (hash_algo != SC_ALGORITHM_RSA_HASH_NONE) {
-		i = sc_pkcs1_add_digest_info_prefix(hash_algo, in, in_len, out, &tmp_len);
-		if (i != SC_SUCCESS) {
+		prefix = sc_pkcs1_find_digest_info_prefix(hash_algo);
+		if (prefix != NULL)
+			data_len = prefix->hdr_len + prefix->hash_len;
+		if (prefix == NULL || in_len != prefix->hash_len || *out_len < data_len) {
 			sc_log(ctx, "Unable to add digest info 0x%x", hash_algo);
-			LOG_FUNC_RETURN(ctx, i);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 		}
-		tmp = out;
-	} else   {
-		tmp_len = in_len;
 	}
 
 	switch(pad_algo) {
 	case SC_ALGORITHM_RSA_PAD_NONE:
 		/* padding done by card => nothing to do */
-		if (out != tmp)
-			memcpy(out, tmp, tmp_len);
-		*out_len = tmp_len;
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		if (*out_len < data_len)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
+		data = out;
+		*out_len = data_len;
+		break;
 	case SC_ALGORITHM_RSA_PAD_PKCS1:
 		/* add pkcs1 bt01 padding */
-		rv = sc_pkcs1_add_01_padding(tmp, tmp_len, out, out_len, mod_len);
-		LOG_FUNC_RETURN(ctx, rv);
+		if (*out_len < mod_len)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+		if (data_len + 11 > mod_len)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+		data = out + mod_len - data_len;
+		*out_len = mod_len;
+		break;
 	default:
 		/* currently only pkcs1 padding is supported */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Unsupported padding algorithm 0x%x", pad_algo);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 	}
+
+	/* the data first: 'in' may be at the start of 'out' */
+	if (prefix != NULL)
+		sc_pkcs1_put_digest_info(prefix, in, data);
+	else
+		memmove(data, in, data_len);
+	if (pad_algo == SC_ALGORITHM_RSA_PAD_PKCS1)
+		sc_pkcs1_fill_01_padding(out, data_len, mod_len);
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 int sc_get_encoding_flags(sc_context_t *ctx,
@@ -29,13 +29,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#ifdef ENABLE_ZLIB
-#include <zlib.h>
-#endif
 
 #include "common/compat_strlcpy.h"
 #include "libopensc/pkcs15.h"
 #include "libopensc/log.h"
+#include "libopensc/compression.h"
 
 int sc_pkcs15emu_actalis_init_ex(sc_pkcs15_card_t *, struct sc_aid *, sc_pkcs15emu_opt_t *);
 
@@ -212,8 +210,8 @@ static int sc_pkcs15emu_actalis_init(sc_pkcs15_card_t * p15card)
 		sc_format_path(certPath[i], &cpath);
 
 		if (sc_select_file(card, &cpath, NULL) == SC_SUCCESS) {
-			unsigned char *compCert = NULL, *cert = NULL, size[2];
-			unsigned long compLen, len;
+			unsigned char *cert = NULL, size[2];
+			size_t compLen, len;
 
 			sc_pkcs15_cert_info_t cert_info;
 			sc_pkcs15_object_t cert_obj;
@@ -222,24 +220,15 @@ static int sc_pkcs15emu_actalis_init(sc_pkcs15_card_t * p15card)
 
 			sc_read_binary(card, 2, size, 2, 0);
 			compLen = (size[0] << 8) + size[1];
-			compCert = malloc(compLen * sizeof(unsigned char));
-			len = 3 * compLen;	/*Approximation of the uncompressed size */
-			cert = malloc(len * sizeof(unsigned char));
-			if (!cert || !compCert) {
-				free(cert);
-				free(compCert);
-				return SC_ERROR_OUT_OF_MEMORY;
-			}
-
-			sc_read_binary(card, 4, compCert, compLen, 0);
-
-			if (uncompress(cert, &len,
-				compCert, compLen) != Z_OK)
+			/* 3 * compLen approximates the uncompressed size */
+			if (sc_decompress_read_binary(card, 4, compLen, COMPRESSION_ZLIB,
+					3 * compLen, &cert, &len) != SC_SUCCESS)
 				return SC_ERROR_INTERNAL;
 			cpath.index = 0;
 			cpath.count = len;
 
 			sc_pkcs15_cache_file(p15card, &cpath, cert, len);
+			free(cert);
 			id.value[0] = j + 1;
 			id.len = 1;
 			cert_info.id = id;
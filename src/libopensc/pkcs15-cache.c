@@ -29,35 +29,42 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
 #include "internal.h"
+#include "cardctl.h"
 #include "pkcs15.h"
+#include "probes.h"
 
 #define RANDOM_UID_INDICATOR 0x08
-static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
-				   char *buf, size_t bufsize)
+/* Cache directory and card part of the cache file names, for the card's
+ * content as of last_update (NULL for a card without lastUpdate) */
+static int generate_cache_prefix_at(struct sc_pkcs15_card *p15card,
+				    const char *last_update, char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-	char *last_update = NULL;
 	int  r;
-	unsigned u;
 
 	if (p15card->tokeninfo->serial_number == NULL
 			&& (p15card->card->uid.len == 0
 				|| p15card->card->uid.value[0] == RANDOM_UID_INDICATOR))
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	assert(path->len <= SC_MAX_PATH_SIZE);
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
 	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/");
 
-	last_update = sc_pkcs15_get_lastupdate(p15card);
 	if (!last_update)
 		last_update = "NODATE";
 
@@ -72,11 +79,64 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 					p15card->card->uid.len), last_update);
 	}
 
+	if (!buf || bufsize <= strlen(dir))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcpy(buf, dir);
+
+	return SC_SUCCESS;
+}
+
+/* lastUpdate of the card or, if it has none, the change counter of the
+ * driver, asked once per bind */
+static const char *cache_last_update(struct sc_pkcs15_card *p15card)
+{
+	const char *last_update = sc_pkcs15_get_lastupdate(p15card);
+	sc_cardctl_freshness_token_t counter;
+
+	if (last_update != NULL)
+		return last_update;
+	if (p15card->change_counter == NULL) {
+		memset(&counter, 0, sizeof(counter));
+		if (sc_card_ctl(p15card->card, SC_CARDCTL_GET_CHANGE_COUNTER, &counter) != SC_SUCCESS
+				|| counter.len > sizeof(counter.value))
+			counter.len = 0;
+		p15card->change_counter = malloc(2 * counter.len + 3);
+		if (p15card->change_counter == NULL)
+			return NULL;
+		p15card->change_counter[0] = '\0';
+		if (counter.len) {
+			strcpy(p15card->change_counter, "CC");
+			sc_bin_to_hex(counter.value, counter.len,
+					p15card->change_counter + 2, 2 * counter.len + 1, 0);
+		}
+	}
+	return *p15card->change_counter ? p15card->change_counter : NULL;
+}
+
+static int generate_cache_prefix(struct sc_pkcs15_card *p15card,
+				 char *buf, size_t bufsize)
+{
+	return generate_cache_prefix_at(p15card, cache_last_update(p15card),
+			buf, bufsize);
+}
+
+/* File part of the cache file names: AID, path and, for the entries
+ * holding only a part of a file, the offset and length of the part */
+#define CACHE_KEY_MAX	(2 * (SC_MAX_AID_SIZE + SC_MAX_PATH_SIZE) + 3 + 24)
+
+static int generate_cache_key(const sc_path_t *path, int ranged, char *buf, size_t bufsize)
+{
+	char key[CACHE_KEY_MAX];
+	unsigned u;
+
+	assert(path->len <= SC_MAX_PATH_SIZE);
+	key[0] = '\0';
+
 	if (path->aid.len &&
 		(path->type == SC_PATH_TYPE_FILE_ID || path->type == SC_PATH_TYPE_PATH))   {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
+		snprintf(key + strlen(key), sizeof(key) - strlen(key), "_");
 		for (u = 0; u < path->aid.len; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(key + strlen(key), sizeof(key) - strlen(key),
 					"%02X",  path->aid.value[u]);
 	}
 	else if (path->type != SC_PATH_TYPE_PATH)  {
@@ -88,42 +148,477 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 
 		if (path->len > 2 && memcmp(path->value, "\x3F\x00", 2) == 0)
 			offs = 2;
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
+		snprintf(key + strlen(key), sizeof(key) - strlen(key), "_");
 		for (u = 0; u < path->len - offs; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(key + strlen(key), sizeof(key) - strlen(key),
 					"%02X",  path->value[u + offs]);
 	}
 
-	if (!buf || bufsize < strlen(dir))
+	if (ranged && path->count >= 0)
+		snprintf(key + strlen(key), sizeof(key) - strlen(key),
+				"_R%u-%d", path->index, path->count);
+
+	if (!buf || bufsize <= strlen(key))
 		return SC_ERROR_BUFFER_TOO_SMALL;
-	strcpy(buf, dir);
+	strcpy(buf, key);
 
 	return SC_SUCCESS;
 }
 
-int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
-				const sc_path_t *path,
-				u8 **buf, size_t *bufsize)
+static int generate_cache_filename(struct sc_pkcs15_card *p15card,
+				   const sc_path_t *path, int ranged,
+				   char *buf, size_t bufsize)
 {
-	char fname[PATH_MAX];
-	int rv;
-	FILE *f;
+	char key[CACHE_KEY_MAX];
+	int r;
+
+	r = generate_cache_prefix(p15card, buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	r = generate_cache_key(path, ranged, key, sizeof(key));
+	if (r != SC_SUCCESS)
+		return r;
+	if (bufsize <= strlen(buf) + strlen(key))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(buf, key);
+
+	return SC_SUCCESS;
+}
+
+/*
+ * Cache store
+ *
+ * When use_file_cache_store is enabled all cached files of a card are kept
+ * in a single <prefix>.store file instead of one file per path. The file
+ * holds a sorted index of the entries followed by their content:
+ *
+ *   magic (8 bytes), entry count (4),
+ *   count * [ key length (2), key, content offset (4), content length (4) ],
+ *   contents
+ *
+ * The store is mapped into memory on first use, the lookups then run
+ * without any system call. Updates write a new store next to the old one
+ * and rename it into place.
+ *
+ * sc_pkcs15_map_cached_file() hands out pointers into the mapping. Once it
+ * did, the mapping is kept until the card is unbound, also when a newer
+ * store replaces it.
+ */
+#define CACHE_STORE_MAGIC	"OSCP15S1"
+#define CACHE_STORE_MAGIC_LEN	8
+
+struct cache_store_entry {
+	const char *key;
+	size_t keylen;
+	const u8 *data;
+	size_t len;
+};
+
+struct sc_pkcs15_cache_store {
+	char prefix[PATH_MAX];
+	u8 *map;
+	size_t size;
+	int mapped;
+	struct cache_store_entry *entries;
 	size_t count;
+	int stale;	/* the file was updated, map it again on the next lookup */
+	int borrowed;	/* pointers into the map were handed out */
+	struct sc_pkcs15_cache_store *retired;	/* older borrowed stores */
+};
+
+static void cache_put_u16(u8 *p, size_t v)
+{
+	p[0] = (v >> 8) & 0xFF;
+	p[1] = v & 0xFF;
+}
+
+static void cache_put_u32(u8 *p, size_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static size_t cache_get_u16(const u8 *p)
+{
+	return ((size_t) p[0] << 8) | p[1];
+}
+
+static size_t cache_get_u32(const u8 *p)
+{
+	return ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+}
+
+static int cache_store_entry_cmp(const void *a, const void *b)
+{
+	const struct cache_store_entry *ea = a, *eb = b;
+	int r = memcmp(ea->key, eb->key, ea->keylen < eb->keylen ? ea->keylen : eb->keylen);
+
+	if (r)
+		return r;
+	return (ea->keylen > eb->keylen) - (ea->keylen < eb->keylen);
+}
+
+static void cache_store_free(struct sc_pkcs15_cache_store *store)
+{
+	struct sc_pkcs15_cache_store *next;
+
+	for (; store != NULL; store = next) {
+		next = store->retired;
+#ifdef HAVE_SYS_MMAN_H
+		if (store->mapped)
+			munmap(store->map, store->size);
+		else
+#endif
+			free(store->map);
+		free(store->entries);
+		free(store);
+	}
+}
+
+/* Take the store off the card and return the stores that must be kept
+ * because their content is still borrowed */
+static struct sc_pkcs15_cache_store *cache_store_detach(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_cache_store *store = p15card->cache_store, *retired;
+
+	p15card->cache_store = NULL;
+	if (store == NULL)
+		return NULL;
+	if (store->borrowed) {
+		free(store->entries);
+		store->entries = NULL;
+		store->count = 0;
+		return store;
+	}
+	retired = store->retired;
+	store->retired = NULL;
+	cache_store_free(store);
+	return retired;
+}
+
+void sc_pkcs15_close_cache_store(struct sc_pkcs15_card *p15card)
+{
+	cache_store_free(p15card->cache_store);
+	p15card->cache_store = NULL;
+}
+
+/* Parse the index of the store, returns non-zero if it is corrupted */
+static int cache_store_parse(struct sc_pkcs15_cache_store *store)
+{
+	size_t offs, i, count;
+
+	if (store->size < CACHE_STORE_MAGIC_LEN + 4
+			|| memcmp(store->map, CACHE_STORE_MAGIC, CACHE_STORE_MAGIC_LEN))
+		return -1;
+	count = cache_get_u32(store->map + CACHE_STORE_MAGIC_LEN);
+	if (count > store->size)
+		return -1;
+	store->entries = calloc(count ? count : 1, sizeof *store->entries);
+	if (store->entries == NULL)
+		return -1;
+
+	offs = CACHE_STORE_MAGIC_LEN + 4;
+	for (i = 0; i < count; i++) {
+		struct cache_store_entry *entry = &store->entries[i];
+		size_t data_offs;
+
+		if (offs + 2 > store->size)
+			return -1;
+		entry->keylen = cache_get_u16(store->map + offs);
+		offs += 2;
+		if (offs + entry->keylen + 8 > store->size)
+			return -1;
+		entry->key = (const char *) store->map + offs;
+		offs += entry->keylen;
+		data_offs = cache_get_u32(store->map + offs);
+		entry->len = cache_get_u32(store->map + offs + 4);
+		offs += 8;
+		if (data_offs > store->size || entry->len > store->size - data_offs)
+			return -1;
+		entry->data = store->map + data_offs;
+	}
+	store->count = count;
+
+	return 0;
+}
+
+/* Get the store of the card, mapping it if this was not done yet */
+static int cache_store_open(struct sc_pkcs15_card *p15card, struct sc_pkcs15_cache_store **out)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cache_store *store;
+	char prefix[PATH_MAX], fname[PATH_MAX];
 	struct stat stbuf;
-	u8 *data = NULL;
+	FILE *f;
+	int r;
 
-	if (path->len < 2)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	r = generate_cache_prefix(p15card, prefix, sizeof(prefix));
+	if (r != SC_SUCCESS)
+		return r;
 
-	/* Accept full path or FILE-ID path with AID */
-	if ((path->type != SC_PATH_TYPE_PATH) && (path->type != SC_PATH_TYPE_FILE_ID || path->aid.len == 0))
-		return SC_ERROR_INVALID_ARGUMENTS;
+	/* The prefix changes once the serial number is known */
+	store = p15card->cache_store;
+	if (store != NULL && !store->stale && strcmp(store->prefix, prefix) == 0) {
+		*out = store;
+		return SC_SUCCESS;
+	}
 
-	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
-	rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (rv != SC_SUCCESS)
-		return rv;
-	sc_log(p15card->card->ctx, "read cached file %s", fname);
+	store = calloc(1, sizeof *store);
+	if (store == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	strcpy(store->prefix, prefix);
+	store->retired = cache_store_detach(p15card);
+	p15card->cache_store = store;
+	*out = store;
+
+	snprintf(fname, sizeof(fname), "%s.store", prefix);
+
+	/* A missing store is an empty one */
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return SC_SUCCESS;
+	if (fstat(fileno(f), &stbuf) || stbuf.st_size <= 0) {
+		fclose(f);
+		return SC_SUCCESS;
+	}
+	store->size = (size_t) stbuf.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	store->map = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	if (store->map == MAP_FAILED)
+		store->map = NULL;
+	else
+		store->mapped = 1;
+#endif
+	if (store->map == NULL) {
+		store->map = malloc(store->size);
+		if (store->map == NULL || fread(store->map, 1, store->size, f) != store->size) {
+			free(store->map);
+			store->map = NULL;
+		}
+	}
+	fclose(f);
+
+	if (store->map == NULL || cache_store_parse(store)) {
+		/* Use it as an empty store, it is replaced on the next update */
+		sc_log(ctx, "cannot use cache store %s", fname);
+#ifdef HAVE_SYS_MMAN_H
+		if (store->mapped)
+			munmap(store->map, store->size);
+		else
+#endif
+			free(store->map);
+		free(store->entries);
+		store->map = NULL;
+		store->mapped = 0;
+		store->size = 0;
+		store->entries = NULL;
+		store->count = 0;
+	}
+	sc_log(ctx, "cache store %s with %"SC_FORMAT_LEN_SIZE_T"u entries", fname, store->count);
+
+	return SC_SUCCESS;
+}
+
+static const struct cache_store_entry *cache_store_lookup(const struct sc_pkcs15_cache_store *store,
+		const char *key)
+{
+	struct cache_store_entry needle;
+
+	if (store->count == 0)
+		return NULL;
+	needle.key = key;
+	needle.keylen = strlen(key);
+	return bsearch(&needle, store->entries, store->count, sizeof *store->entries,
+			cache_store_entry_cmp);
+}
+
+/* Find the cached content of `path' in the store */
+static int cache_store_find(struct sc_pkcs15_card *p15card, const sc_path_t *path,
+		const u8 **data, size_t *len)
+{
+	struct sc_pkcs15_cache_store *store = NULL;
+	const struct cache_store_entry *entry = NULL;
+	char key[CACHE_KEY_MAX];
+	size_t offs = 0, count;
+	int r;
+
+	r = cache_store_open(p15card, &store);
+	if (r != SC_SUCCESS)
+		return r;
+
+	/* A part of a file is cached on its own if the whole file is not */
+	if (path->count >= 0) {
+		r = generate_cache_key(path, 1, key, sizeof(key));
+		if (r != SC_SUCCESS)
+			return r;
+		entry = cache_store_lookup(store, key);
+	}
+	if (entry != NULL) {
+		count = entry->len;
+	}
+	else {
+		r = generate_cache_key(path, 0, key, sizeof(key));
+		if (r != SC_SUCCESS)
+			return r;
+		entry = cache_store_lookup(store, key);
+		if (entry == NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+
+		count = entry->len;
+		if (path->count >= 0) {
+			offs = path->index;
+			count = path->count;
+			if (offs + count > entry->len)
+				return SC_ERROR_FILE_NOT_FOUND; /* cache entry bad? */
+		}
+	}
+
+	*data = entry->data + offs;
+	*len = count;
+	return SC_SUCCESS;
+}
+
+static int cache_store_read(struct sc_pkcs15_card *p15card, const sc_path_t *path,
+		u8 **buf, size_t *bufsize)
+{
+	const u8 *data = NULL;
+	size_t count = 0;
+	int r;
+
+	r = cache_store_find(p15card, path, &data, &count);
+	if (r != SC_SUCCESS)
+		return r;
+
+	if (*buf == NULL) {
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	else if (count > *bufsize) {
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	}
+	memcpy(*buf, data, count);
+	*bufsize = count;
+
+	return SC_SUCCESS;
+}
+
+/* Adds or replaces the entry of `path'. With drop_parts, the entries of
+ * parts of the file are removed, `path' must be the whole file. */
+static int cache_store_write(struct sc_pkcs15_card *p15card, const sc_path_t *path,
+		const u8 *data, size_t len, int drop_parts)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cache_store *store = NULL;
+	struct cache_store_entry *entries = NULL;
+	char key[CACHE_KEY_MAX];
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	u8 hdr[CACHE_STORE_MAGIC_LEN + 4], ent[2 + 8];
+	size_t count = 0, i, offs;
+	FILE *f = NULL;
+	int r;
+
+	r = generate_cache_key(path, 1, key, sizeof(key));
+	if (r != SC_SUCCESS)
+		return r;
+
+	/* Start from the current content on disk, another process
+	 * could have updated the store since it was mapped */
+	if (p15card->cache_store != NULL)
+		p15card->cache_store->stale = 1;
+	r = cache_store_open(p15card, &store);
+	if (r != SC_SUCCESS)
+		return r;
+
+	entries = calloc(store->count + 1, sizeof *entries);
+	if (entries == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < store->count; i++) {
+		const struct cache_store_entry *entry = &store->entries[i];
+
+		if (entry->keylen >= strlen(key) && !memcmp(entry->key, key, strlen(key))
+				&& (entry->keylen == strlen(key) || (drop_parts
+					&& entry->keylen > strlen(key) + 2
+					&& !memcmp(entry->key + strlen(key), "_R", 2))))
+			continue;
+		entries[count++] = *entry;
+	}
+	entries[count].key = key;
+	entries[count].keylen = strlen(key);
+	entries[count].data = data;
+	entries[count].len = len;
+	count++;
+	qsort(entries, count, sizeof *entries, cache_store_entry_cmp);
+
+	snprintf(fname, sizeof(fname), "%s.store", store->prefix);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			goto out;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL) {
+		r = SC_ERROR_INTERNAL;
+		goto out;
+	}
+
+	memcpy(hdr, CACHE_STORE_MAGIC, CACHE_STORE_MAGIC_LEN);
+	cache_put_u32(hdr + CACHE_STORE_MAGIC_LEN, count);
+	r = fwrite(hdr, 1, sizeof hdr, f) == sizeof hdr ? SC_SUCCESS : SC_ERROR_INTERNAL;
+
+	offs = sizeof hdr;
+	for (i = 0; i < count; i++)
+		offs += 2 + entries[i].keylen + 8;
+	for (i = 0; i < count && r == SC_SUCCESS; i++) {
+		cache_put_u16(ent, entries[i].keylen);
+		if (fwrite(ent, 1, 2, f) != 2
+				|| fwrite(entries[i].key, 1, entries[i].keylen, f) != entries[i].keylen)
+			r = SC_ERROR_INTERNAL;
+		cache_put_u32(ent, offs);
+		cache_put_u32(ent + 4, entries[i].len);
+		if (fwrite(ent, 1, 8, f) != 8)
+			r = SC_ERROR_INTERNAL;
+		offs += entries[i].len;
+	}
+	for (i = 0; i < count && r == SC_SUCCESS; i++)
+		if (fwrite(entries[i].data, 1, entries[i].len, f) != entries[i].len)
+			r = SC_ERROR_INTERNAL;
+
+	if (fclose(f) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+#ifdef _WIN32
+	if (r == SC_SUCCESS)
+		unlink(fname);
+#endif
+	if (r == SC_SUCCESS && rename(tmpname, fname) != 0)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "cannot update cache store %s", fname);
+		unlink(tmpname);
+	}
+
+out:
+	free(entries);
+	/* Map the new store on the next read */
+	store->stale = 1;
+	return r;
+}
+
+/* Read `count' bytes at `index' of the cache file, the whole file if `count' is negative */
+static int read_cache_file(const char *fname, size_t index, int count,
+			   u8 **buf, size_t *bufsize)
+{
+	int rv;
+	FILE *f;
+	size_t len;
+	struct stat stbuf;
+	u8 *data = NULL;
 
 	f = fopen(fname, "rb");
 	if (!f)
@@ -133,43 +628,43 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 		return  SC_ERROR_FILE_NOT_FOUND;
 	}
 
-	if (path->count < 0) {
-		count = stbuf.st_size;
+	if (count < 0) {
+		len = stbuf.st_size;
 	}
 	else {
-		count = path->count;
-		if (path->index + count > (size_t)stbuf.st_size)   {
+		len = count;
+		if (index + len > (size_t)stbuf.st_size)   {
 			rv = SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
 			goto err;
 		}
 
-		if (0 != fseek(f, (long)path->index, SEEK_SET)) {
+		if (0 != fseek(f, (long)index, SEEK_SET)) {
 			rv = SC_ERROR_FILE_NOT_FOUND;
 			goto err;
 		}
 	}
 
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
+		data = malloc(len ? len : 1);
 		if (data == NULL)   {
 			rv = SC_ERROR_OUT_OF_MEMORY;
 			goto err;
 		}
 	}
 	else {
-		if (count > *bufsize) {
+		if (len > *bufsize) {
 			rv =  SC_ERROR_BUFFER_TOO_SMALL;
 			goto err;
 		}
 		data = *buf;
 	}
 
-	if (count != fread(data, 1, count, f)) {
+	if (len != fread(data, 1, len, f)) {
 		rv = SC_ERROR_BUFFER_TOO_SMALL;
 		goto err;
 	}
 	*buf = data;
-	*bufsize = count;
+	*bufsize = len;
 
 	rv = SC_SUCCESS;
 
@@ -184,6 +679,82 @@ err:
 	return rv;
 }
 
+static int read_cached_file(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path,
+				u8 **buf, size_t *bufsize)
+{
+	char fname[PATH_MAX];
+	int rv;
+
+	if (path->len < 2)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	/* Accept full path or FILE-ID path with AID */
+	if ((path->type != SC_PATH_TYPE_PATH) && (path->type != SC_PATH_TYPE_FILE_ID || path->aid.len == 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
+	if (p15card->opts.use_file_cache_store)
+		return cache_store_read(p15card, path, buf, bufsize);
+
+	/* Parts of files shared by several objects (e.g. certificates
+	 * in a container EF) are cached on their own */
+	if (path->count >= 0) {
+		rv = generate_cache_filename(p15card, path, 1, fname, sizeof(fname));
+		if (rv != SC_SUCCESS)
+			return rv;
+		rv = read_cache_file(fname, 0, -1, buf, bufsize);
+		if (rv != SC_ERROR_FILE_NOT_FOUND) {
+			sc_log(p15card->card->ctx, "read cached file %s", fname);
+			return rv;
+		}
+	}
+
+	rv = generate_cache_filename(p15card, path, 0, fname, sizeof(fname));
+	if (rv != SC_SUCCESS)
+		return rv;
+	sc_log(p15card->card->ctx, "read cached file %s", fname);
+
+	return read_cache_file(fname, path->index, path->count, buf, bufsize);
+}
+
+int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path,
+				u8 **buf, size_t *bufsize)
+{
+	int rv = read_cached_file(p15card, path, buf, bufsize);
+
+	if (rv == SC_SUCCESS)
+		SC_PROBE_STR2(cache__hit, "file", p15card->card);
+	else
+		SC_PROBE_STR2(cache__miss, "file", p15card->card);
+	return rv;
+}
+
+/*
+ * Like sc_pkcs15_read_cached_file(), but returns the content in place in
+ * the cache store instead of a copy. The content stays valid until the
+ * card is unbound.
+ */
+int sc_pkcs15_map_cached_file(struct sc_pkcs15_card *p15card,
+			      const sc_path_t *path,
+			      const u8 **data, size_t *len)
+{
+	int r;
+
+	if (!p15card->opts.use_file_cache_store)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (path->len < 2)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if ((path->type != SC_PATH_TYPE_PATH) && (path->type != SC_PATH_TYPE_FILE_ID || path->aid.len == 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = cache_store_find(p15card, path, data, len);
+	if (r == SC_SUCCESS)
+		p15card->cache_store->borrowed = 1;
+	return r;
+}
+
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
@@ -193,7 +764,11 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	FILE *f;
 	size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	if (p15card->opts.use_file_cache_store)
+		return cache_store_write(p15card, path, buf, bufsize, 0);
+
+	/* Store a part of a file apart from the whole file */
+	r = generate_cache_filename(p15card, path, 1, fname, sizeof(fname));
 	if (r != 0)
 		return r;
 
@@ -220,3 +795,570 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	}
 	return 0;
 }
+
+/*
+ * Write-through from pkcs15init
+ *
+ * A file written to the card replaces its cache entry instead of leaving
+ * it stale, and when the card gets a new lastUpdate the cache files move
+ * to the names for the new lastUpdate, so the cache is still used after
+ * personalization.
+ */
+
+/* Calls cb for each file of directory `dir' whose name starts with `prefix' */
+static void cache_dir_foreach(const char *dir, const char *prefix,
+		void (*cb)(const char *dir, const char *name, void *arg), void *arg)
+{
+#ifdef _WIN32
+	char pattern[PATH_MAX];
+	WIN32_FIND_DATAA data;
+	HANDLE h;
+
+	if ((size_t) snprintf(pattern, sizeof(pattern), "%s/%s*", dir, prefix) >= sizeof(pattern))
+		return;
+	h = FindFirstFileA(pattern, &data);
+	if (h == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			cb(dir, data.cFileName, arg);
+	} while (FindNextFileA(h, &data));
+	FindClose(h);
+#else
+	DIR *d = opendir(dir);
+	struct dirent *ent;
+
+	if (d == NULL)
+		return;
+	while ((ent = readdir(d)) != NULL)
+		if (strncmp(ent->d_name, prefix, strlen(prefix)) == 0)
+			cb(dir, ent->d_name, arg);
+	closedir(d);
+#endif
+}
+
+/* Splits a cache file name into the directory and the base name */
+static char *cache_split_name(char *fname)
+{
+	char *base = strrchr(fname, '/');
+
+	if (base == NULL)
+		return NULL;
+	*base++ = '\0';
+	return base;
+}
+
+static void cache_unlink_part(const char *dir, const char *name, void *arg)
+{
+	char fname[PATH_MAX];
+
+	if ((size_t) snprintf(fname, sizeof(fname), "%s/%s", dir, name) < sizeof(fname))
+		unlink(fname);
+}
+
+/*
+ * Replaces the cached content of the file `path' with the content just
+ * written to the card. The parts of the file cached on their own are
+ * dropped.
+ */
+int sc_pkcs15_update_cached_file(struct sc_pkcs15_card *p15card,
+				 const sc_path_t *path,
+				 const u8 *buf, size_t bufsize)
+{
+	sc_path_t file_path = *path;
+	char fname[PATH_MAX + 2], *base;
+	int r;
+
+	if (path->len < 2)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if ((path->type != SC_PATH_TYPE_PATH) && (path->type != SC_PATH_TYPE_FILE_ID || path->aid.len == 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	file_path.index = 0;
+	file_path.count = -1;
+	sc_log(p15card->card->ctx, "update cache of %s", sc_print_path(&file_path));
+	if (p15card->opts.use_file_cache_store)
+		return cache_store_write(p15card, &file_path, buf, bufsize, 1);
+
+	r = generate_cache_filename(p15card, &file_path, 0, fname, PATH_MAX);
+	if (r != SC_SUCCESS)
+		return r;
+	base = cache_split_name(fname);
+	if (base != NULL) {
+		strcat(base, "_R");
+		cache_dir_foreach(fname, base, cache_unlink_part, NULL);
+	}
+
+	return sc_pkcs15_cache_file(p15card, &file_path, buf, bufsize);
+}
+
+struct cache_move {
+	const char *from;	/* base name prefixes */
+	const char *to;
+	int count;
+};
+
+static void cache_move_file(const char *dir, const char *name, void *arg)
+{
+	struct cache_move *move = arg;
+	const char *rest = name + strlen(move->from);
+	char from[PATH_MAX], to[PATH_MAX];
+
+	/* <prefix>_<key>, <prefix>.store or <prefix>_<key>.objects */
+	if (*rest != '_' && *rest != '.')
+		return;
+	if ((size_t) snprintf(from, sizeof(from), "%s/%s", dir, name) >= sizeof(from)
+			|| (size_t) snprintf(to, sizeof(to), "%s/%s%s", dir, move->to, rest) >= sizeof(to))
+		return;
+#ifdef _WIN32
+	unlink(to);
+#endif
+	if (rename(from, to) == 0)
+		move->count++;
+}
+
+/*
+ * Moves the cache files of the card from the names for `old_last_update'
+ * (NULL if the card had none) to the names for the current lastUpdate.
+ * pkcs15init calls this when it sets a new lastUpdate.
+ */
+int sc_pkcs15_move_cache(struct sc_pkcs15_card *p15card, const char *old_last_update)
+{
+	char old_prefix[PATH_MAX], new_prefix[PATH_MAX];
+	char *old_base, *new_base;
+	struct cache_move move;
+	int r;
+
+	/* without lastUpdate, the names were made from the change counter */
+	if (old_last_update == NULL && p15card->change_counter && *p15card->change_counter)
+		old_last_update = p15card->change_counter;
+	r = generate_cache_prefix_at(p15card, old_last_update, old_prefix, sizeof(old_prefix));
+	if (r == SC_SUCCESS)
+		r = generate_cache_prefix(p15card, new_prefix, sizeof(new_prefix));
+	if (r != SC_SUCCESS)
+		return r;
+	if (strcmp(old_prefix, new_prefix) == 0)
+		return SC_SUCCESS;
+
+	old_base = cache_split_name(old_prefix);
+	new_base = cache_split_name(new_prefix);
+	if (old_base == NULL || new_base == NULL)
+		return SC_ERROR_INTERNAL;
+	move.from = old_base;
+	move.to = new_base;
+	move.count = 0;
+	cache_dir_foreach(old_prefix, old_base, cache_move_file, &move);
+	sc_log(p15card->card->ctx, "moved %d cache files from %s to %s", move.count, old_base, new_base);
+
+	/* the mapped store has the old name */
+	if (p15card->cache_store != NULL)
+		p15card->cache_store->stale = 1;
+	return SC_SUCCESS;
+}
+
+/*
+ * Objects cache
+ *
+ * Keeps the content of every DF of the PKCS#15 application in a single
+ * file, next to the other cache files of the card. Binding a known card
+ * then enumerates all objects from one read of the cache directory
+ * instead of one file (or card access) per DF.
+ *
+ * Each DF is stored as: type (1 byte), path length (1), path, index (4),
+ * count (4), AID length (1), AID, content length (4), content.
+ */
+#define OBJECTS_CACHE_MAGIC	"OSC-P15-DF-1"
+
+static int generate_objects_cache_filename(struct sc_pkcs15_card *p15card,
+		char *buf, size_t bufsize)
+{
+	int r;
+
+	if (p15card->file_app == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = generate_cache_filename(p15card, &p15card->file_app->path, 0, buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	if (strlen(buf) + sizeof(".objects") > bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(buf, ".objects");
+
+	return SC_SUCCESS;
+}
+
+static int objects_cache_usable(struct sc_pkcs15_card *p15card)
+{
+	/* Emulators and cards with their own DF parsing do not
+	 * (only) use the DF content */
+	return !(p15card->flags & SC_PKCS15_CARD_FLAG_EMULATED)
+		&& p15card->ops.parse_df == NULL
+		&& p15card->df_list != NULL;
+}
+
+static void put_u32(u8 *p, unsigned int v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static unsigned int get_u32(const u8 *p)
+{
+	return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16)
+		| ((unsigned int) p[2] << 8) | p[3];
+}
+
+static size_t objects_cache_record(const struct sc_pkcs15_df *df, u8 *out)
+{
+	const struct sc_path *path = &df->path;
+	size_t len = 0;
+
+	out[len++] = (u8) df->type;
+	out[len++] = (u8) path->len;
+	memcpy(out + len, path->value, path->len);
+	len += path->len;
+	put_u32(out + len, (unsigned int) path->index);
+	len += 4;
+	put_u32(out + len, (unsigned int) path->count);
+	len += 4;
+	out[len++] = (u8) path->aid.len;
+	memcpy(out + len, path->aid.value, path->aid.len);
+	len += path->aid.len;
+
+	return len;
+}
+
+/* Parse the header of the stored DF at `p', returns non-zero if it is truncated */
+static int objects_cache_entry(const u8 *p, size_t size, size_t *hlen, size_t *len)
+{
+	size_t offs;
+
+	if (size < 2)
+		return -1;
+	offs = 2 + p[1] + 8;
+	if (offs + 1 > size)
+		return -1;
+	offs += 1 + p[offs];
+	if (offs + 4 > size)
+		return -1;
+	*len = get_u32(p + offs);
+	*hlen = offs + 4;
+	if (*len > size - *hlen)
+		return -1;
+	return 0;
+}
+
+#define OBJECTS_CACHE_RECORD_MAX	(1 + 1 + SC_MAX_PATH_SIZE + 4 + 4 + 1 + SC_MAX_AID_SIZE)
+
+void sc_pkcs15_close_objects_cache(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->objects_cache == NULL)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	if (p15card->objects_cache_mapped)
+		munmap(p15card->objects_cache, p15card->objects_cache_size);
+	else
+#endif
+		free(p15card->objects_cache);
+	p15card->objects_cache = NULL;
+	p15card->objects_cache_size = 0;
+	p15card->objects_cache_mapped = 0;
+}
+
+/*
+ * The DFs keep the objects cache as their content: the entries decoded
+ * from it borrow their values from there instead of copying them. The
+ * file is mapped copy-on-write, so the processes using the same card
+ * share its pages. It is only ever replaced by a rename, the mapping
+ * stays valid when another process stores a new one.
+ */
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	char fname[PATH_MAX];
+	u8 *data = NULL, record[OBJECTS_CACHE_RECORD_MAX];
+	const u8 **contents = NULL;
+	size_t *lengths = NULL, size, offs, len, i, ndfs = 0;
+	struct stat stbuf;
+	int mapped = 0;
+	FILE *f;
+	int r;
+
+	if (!objects_cache_usable(p15card) || p15card->objects_cache != NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = generate_objects_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+
+	f = fopen(fname, "rb");
+	if (!f)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fileno(f), &stbuf) || stbuf.st_size < (off_t) strlen(OBJECTS_CACHE_MAGIC)) {
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	size = (size_t) stbuf.st_size;
+#ifdef HAVE_SYS_MMAN_H
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	if (data == MAP_FAILED)
+		data = NULL;
+	else
+		mapped = 1;
+#endif
+	if (data == NULL) {
+		data = malloc(size);
+		if (data == NULL) {
+			fclose(f);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		len = fread(data, 1, size, f);
+		if (len != size) {
+			fclose(f);
+			r = SC_ERROR_FILE_NOT_FOUND;
+			goto err;
+		}
+	}
+	fclose(f);
+	if (memcmp(data, OBJECTS_CACHE_MAGIC, strlen(OBJECTS_CACHE_MAGIC))) {
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto err;
+	}
+
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		ndfs++;
+	contents = calloc(ndfs, sizeof *contents);
+	lengths = calloc(ndfs, sizeof *lengths);
+	if (contents == NULL || lengths == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+
+	/* Every DF of the card needs its content in the cache */
+	for (df = p15card->df_list, i = 0; df != NULL; df = df->next, i++) {
+		size_t rlen = objects_cache_record(df, record), hlen;
+
+		for (offs = strlen(OBJECTS_CACHE_MAGIC); offs < size; offs += hlen + len) {
+			if (objects_cache_entry(data + offs, size - offs, &hlen, &len))
+				break;
+			if (hlen == rlen + 4 && !memcmp(data + offs, record, rlen)) {
+				contents[i] = data + offs + hlen;
+				lengths[i] = len;
+				break;
+			}
+		}
+		if (contents[i] == NULL) {
+			sc_log(ctx, "DF %s not in the objects cache", sc_print_path(&df->path));
+			r = SC_ERROR_FILE_NOT_FOUND;
+			goto err;
+		}
+	}
+
+	/* From here on the DFs hold on to the data */
+	p15card->objects_cache = data;
+	p15card->objects_cache_size = size;
+	p15card->objects_cache_mapped = mapped;
+	data = NULL;
+
+	for (df = p15card->df_list, i = 0; df != NULL; df = df->next, i++) {
+		if (df->enumerated || df->content != NULL)
+			continue;
+		df->content = (u8 *) contents[i];
+		df->content_len = lengths[i];
+		df->content_cached = 1;
+		r = sc_pkcs15_decode_df(p15card, df, df->content, df->content_len);
+		if (r != SC_SUCCESS) {
+			struct sc_pkcs15_object *obj, *next;
+
+			/* Drop what was decoded, the DF is read from the card again */
+			sc_log(ctx, "Cannot decode cached DF %s: %s", sc_print_path(&df->path), sc_strerror(r));
+			for (obj = p15card->obj_list; obj != NULL; obj = next) {
+				next = obj->next;
+				if (obj->df == df) {
+					sc_pkcs15_remove_object(p15card, obj);
+					sc_pkcs15_free_object(obj);
+				}
+			}
+			df->enumerated = 0;
+			df->content = NULL;
+			df->content_len = 0;
+			df->content_cached = 0;
+			sc_pkcs15_uncache_objects(p15card);
+			/* The DFs decoded before keep the data */
+			goto err;
+		}
+	}
+	p15card->flags |= SC_PKCS15_CARD_FLAG_OBJECTS_CACHED;
+	sc_log(ctx, "%"SC_FORMAT_LEN_SIZE_T"u DFs read from objects cache%s", ndfs,
+			mapped ? " (mapped)" : "");
+	r = SC_SUCCESS;
+
+err:
+	free(contents);
+	free(lengths);
+	if (data != NULL) {
+#ifdef HAVE_SYS_MMAN_H
+		if (mapped)
+			munmap(data, size);
+		else
+#endif
+			free(data);
+	}
+	return r;
+}
+
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	u8 record[OBJECTS_CACHE_RECORD_MAX + 4];
+	FILE *f;
+	int r;
+
+	if (!objects_cache_usable(p15card)
+			|| (p15card->flags & (SC_PKCS15_CARD_FLAG_OBJECTS_CACHED | SC_PKCS15_CARD_FLAG_NO_OBJECTS_CACHE)))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	/* Wait until all DFs are parsed */
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if (!df->enumerated)
+			return SC_ERROR_NOT_SUPPORTED;
+
+	r = generate_objects_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			return r;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return SC_ERROR_INTERNAL;
+
+	r = SC_SUCCESS;
+	if (fwrite(OBJECTS_CACHE_MAGIC, 1, strlen(OBJECTS_CACHE_MAGIC), f) != strlen(OBJECTS_CACHE_MAGIC))
+		r = SC_ERROR_INTERNAL;
+	for (df = p15card->df_list; df != NULL && r == SC_SUCCESS; df = df->next) {
+		u8 *buf = NULL;
+		size_t buflen = 0, rlen;
+
+		/* Normally served by the file cache, the DF was just parsed */
+		r = sc_pkcs15_read_file(p15card, &df->path, &buf, &buflen);
+		if (r != SC_SUCCESS)
+			break;
+		rlen = objects_cache_record(df, record);
+		put_u32(record + rlen, (unsigned int) buflen);
+		rlen += 4;
+		if (fwrite(record, 1, rlen, f) != rlen || fwrite(buf, 1, buflen, f) != buflen)
+			r = SC_ERROR_INTERNAL;
+		free(buf);
+	}
+	if (fclose(f) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+
+	/* Replace the previous cache only with a complete one */
+#ifdef _WIN32
+	if (r == SC_SUCCESS)
+		unlink(fname);
+#endif
+	if (r == SC_SUCCESS && rename(tmpname, fname) != 0)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS) {
+		unlink(tmpname);
+		sc_log(ctx, "Cannot store the objects cache: %s", sc_strerror(r));
+		return r;
+	}
+
+	p15card->flags |= SC_PKCS15_CARD_FLAG_OBJECTS_CACHED;
+	sc_log(ctx, "objects cache stored in %s", fname);
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_uncache_objects(struct sc_pkcs15_card *p15card)
+{
+	char fname[PATH_MAX];
+
+	p15card->flags &= ~SC_PKCS15_CARD_FLAG_OBJECTS_CACHED;
+	p15card->flags |= SC_PKCS15_CARD_FLAG_NO_OBJECTS_CACHE;
+	if (generate_objects_cache_filename(p15card, fname, sizeof(fname)) == SC_SUCCESS)
+		unlink(fname);
+}
+
+/*
+ * Fill the file cache with all DFs and the public objects of the card:
+ * certificates, public keys and data objects. Objects that can not be read
+ * (e.g. they need a PIN) are skipped. Returns the number of objects read.
+ */
+int sc_pkcs15_prefetch_cache(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx;
+	struct sc_pkcs15_df *df;
+	struct sc_pkcs15_object *obj;
+	int r, count = 0;
+
+	if (p15card == NULL || p15card->card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	if (!p15card->opts.use_file_cache)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "File caching is disabled");
+
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (df->enumerated)
+			continue;
+		if (p15card->ops.parse_df)
+			r = p15card->ops.parse_df(p15card, df);
+		else
+			r = sc_pkcs15_parse_df(p15card, df);
+		if (r != SC_SUCCESS)
+			sc_log(ctx, "Cannot parse DF %s: %s", sc_print_path(&df->path), sc_strerror(r));
+	}
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (obj->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+			continue;
+
+		switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+		case SC_PKCS15_TYPE_CERT: {
+			struct sc_pkcs15_cert *cert = NULL;
+
+			r = sc_pkcs15_read_certificate(p15card,
+					(struct sc_pkcs15_cert_info *) obj->data, &cert);
+			sc_pkcs15_free_certificate(cert);
+			break;
+		}
+		case SC_PKCS15_TYPE_PUBKEY: {
+			struct sc_pkcs15_pubkey *pubkey = NULL;
+
+			r = sc_pkcs15_read_pubkey(p15card, obj, &pubkey);
+			sc_pkcs15_free_pubkey(pubkey);
+			break;
+		}
+		case SC_PKCS15_TYPE_DATA_OBJECT: {
+			struct sc_pkcs15_data *data = NULL;
+
+			r = sc_pkcs15_read_data_object(p15card,
+					(struct sc_pkcs15_data_info *) obj->data, &data);
+			sc_pkcs15_free_data_object(data);
+			break;
+		}
+		default:
+			continue;
+		}
+
+		if (r == SC_SUCCESS)
+			count++;
+		else
+			sc_log(ctx, "Cannot read object '%.*s': %s", (int) sizeof obj->label, obj->label, sc_strerror(r));
+	}
+
+	LOG_FUNC_RETURN(ctx, count);
+}
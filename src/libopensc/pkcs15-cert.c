@@ -35,29 +35,79 @@
 #include "asn1.h"
 #include "pkcs15.h"
 
+/* Is the pointer one of the values borrowed from the certificate DER? */
 static int
-parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert)
+cert_holds(const struct sc_pkcs15_cert *cert, const u8 *p)
+{
+	return p != NULL && cert->data.value != NULL
+		&& p >= cert->data.value && p < cert->data.value + cert->data.len;
+}
+
+
+/*
+ * Point to the DER TLV of a value decoded from the certificate. In DER the
+ * TLV is what re-encoding the value would give, so it is used in place
+ * instead of a copy. A non DER length falls back to re-encoding.
+ */
+static int
+cert_tlv(sc_context_t *ctx, struct sc_pkcs15_cert *cert, struct sc_asn1_entry *entry,
+		const u8 *value, size_t value_len, u8 **tlv, size_t *tlv_len)
+{
+	const u8 *p;
+	size_t hdr_len = 2, n;
+	unsigned int cla, tag;
+	size_t taglen;
+
+	if (value_len > 0x7F)
+		for (n = value_len; n > 0; n >>= 8)
+			hdr_len++;
+	if (cert_holds(cert, value) && (size_t)(value - cert->data.value) >= hdr_len) {
+		p = value - hdr_len;
+		if (sc_asn1_read_tag(&p, hdr_len + value_len, &cla, &tag, &taglen) == SC_SUCCESS
+				&& p == value && taglen == value_len) {
+			*tlv = (u8 *)value - hdr_len;
+			*tlv_len = hdr_len + value_len;
+			return SC_SUCCESS;
+		}
+	}
+
+	sc_format_asn1_entry(entry, (void *)value, &value_len, 1);
+	return sc_asn1_encode(ctx, entry, tlv, tlv_len);
+}
+
+
+/*
+ * Decode the certificate held in cert->data. With names_only just the
+ * version, serial, issuer and subject are located, which is enough to
+ * label and relate certificates. Otherwise the public key and the
+ * extensions are decoded as well.
+ */
+static int
+decode_x509_cert(sc_context_t *ctx, struct sc_pkcs15_cert *cert, int names_only)
 {
 	int r;
+	int version = 0;
 	struct sc_algorithm_id sig_alg;
 	struct sc_pkcs15_pubkey *pubkey = NULL;
-	unsigned char *serial = NULL, *issuer = NULL, *subject = NULL, *buf =  der->value;
-	size_t serial_len = 0, issuer_len = 0, subject_len = 0, data_len = 0, buflen = der->len;
+	unsigned char *serial = NULL, *issuer = NULL, *subject = NULL;
+	size_t serial_len = 0, issuer_len = 0, subject_len = 0;
+	unsigned char *extensions = NULL;
+	size_t extensions_len = 0;
 	struct sc_asn1_entry asn1_version[] = {
-		{ "version", SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, &cert->version, NULL },
+		{ "version", SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, &version, NULL },
 		{ NULL, 0, 0, 0, NULL, NULL }
 	};
 	struct sc_asn1_entry asn1_extensions[] = {
-		{ "x509v3",		SC_ASN1_OCTET_STRING,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL| SC_ASN1_ALLOC, &cert->extensions, &cert->extensions_len },
+		{ "x509v3",		SC_ASN1_OCTET_STRING,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_OPTIONAL| SC_ASN1_ALLOC, &extensions, &extensions_len },
 		{ NULL, 0, 0, 0, NULL, NULL }
 	};
 	struct sc_asn1_entry asn1_tbscert[] = {
 		{ "version",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 0 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_version, NULL },
-		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, &serial, &serial_len },
+		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC | SC_ASN1_BORROW, &serial, &serial_len },
 		{ "signature",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &issuer, &issuer_len },
+		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC | SC_ASN1_BORROW, &issuer, &issuer_len },
 		{ "validity",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &subject, &subject_len },
+		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC | SC_ASN1_BORROW, &subject, &subject_len },
 		/* Use a callback to get the algorithm, parameters and pubkey into sc_pkcs15_pubkey */
 		{ "subjectPublicKeyInfo",SC_ASN1_CALLBACK, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, sc_pkcs15_pubkey_from_spki_fields,  &pubkey },
 		{ "extensions",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 3 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_extensions, NULL },
@@ -85,53 +135,83 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	const u8 *obj;
 	size_t objlen;
 
-	memset(cert, 0, sizeof(*cert));
-	obj = sc_asn1_verify_tag(ctx, buf, buflen, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+	obj = sc_asn1_verify_tag(ctx, cert->data.value, cert->data.len, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
 	if (obj == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
 
-	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
-	cert->data.len = data_len;
+	if (names_only) {
+		/* skip over everything that would need decoding and allocations */
+		asn1_tbscert[6].type = SC_ASN1_STRUCT;
+		asn1_tbscert[6].parm = NULL;
+		asn1_tbscert[7].parm = NULL;
+		asn1_cert[1].type = SC_ASN1_STRUCT;
+		asn1_cert[1].parm = NULL;
+	}
 
 	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
-	cert->key = pubkey;
-	cert->version++;
-
-	LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 parsing of certificate failed");
+	if (!names_only) {
+		cert->key = pubkey;
+		cert->extensions = extensions;
+		cert->extensions_len = extensions_len;
+	}
+	if (r == SC_SUCCESS)
+		cert->version = version + 1;
 
-	if (!pubkey)
-		LOG_TEST_GOTO_ERR(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Unable to decode subjectPublicKeyInfo from cert");
+	LOG_TEST_RET(ctx, r, "ASN.1 parsing of certificate failed");
 
-	sc_asn1_clear_algorithm_id(&sig_alg);
+	if (!names_only) {
+		sc_asn1_clear_algorithm_id(&sig_alg);
+		if (!pubkey)
+			LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "Unable to decode subjectPublicKeyInfo from cert");
+	}
 
-	if (serial && serial_len)   {
-		sc_format_asn1_entry(asn1_serial_number + 0, serial, &serial_len, 1);
-		r = sc_asn1_encode(ctx, asn1_serial_number, &cert->serial, &cert->serial_len);
-		LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 encoding of serial failed");
+	if (serial && serial_len && !cert->serial)   {
+		r = cert_tlv(ctx, cert, asn1_serial_number, serial, serial_len, &cert->serial, &cert->serial_len);
+		LOG_TEST_RET(ctx, r, "ASN.1 encoding of serial failed");
 	}
 
-	if (subject && subject_len)   {
-		sc_format_asn1_entry(asn1_subject + 0, subject, &subject_len, 1);
-		r = sc_asn1_encode(ctx, asn1_subject, &cert->subject, &cert->subject_len);
-		LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 encoding of subject");
+	if (subject && subject_len && !cert->subject)   {
+		r = cert_tlv(ctx, cert, asn1_subject, subject, subject_len, &cert->subject, &cert->subject_len);
+		LOG_TEST_RET(ctx, r, "ASN.1 encoding of subject");
 	}
 
-	if (issuer && issuer_len)   {
-		sc_format_asn1_entry(asn1_issuer + 0, issuer, &issuer_len, 1);
-		r = sc_asn1_encode(ctx, asn1_issuer, &cert->issuer, &cert->issuer_len);
-		LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 encoding of issuer");
+	if (issuer && issuer_len && !cert->issuer)   {
+		r = cert_tlv(ctx, cert, asn1_issuer, issuer, issuer_len, &cert->issuer, &cert->issuer_len);
+		LOG_TEST_RET(ctx, r, "ASN.1 encoding of issuer");
 	}
 
-err:
-	free(serial);
-	free(subject);
-	free(issuer);
+	return SC_SUCCESS;
+}
+
 
-	return r;
+/* Decode the certificate in `der'. A `mapped' DER stays valid until the
+ * card is unbound and the certificate refers to it instead of a copy. */
+static int
+parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert,
+		int names_only, int mapped)
+{
+	const u8 *obj;
+	size_t objlen, data_len;
+
+	memset(cert, 0, sizeof(*cert));
+	obj = sc_asn1_verify_tag(ctx, der->value, der->len, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+	if (obj == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
+
+	data_len = objlen + (obj - der->value);
+	if (mapped) {
+		cert->data.value = der->value;
+		cert->data_mapped = 1;
+	}
+	else {
+		cert->data.value = malloc(data_len);
+		if (!cert->data.value)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		memcpy(cert->data.value, der->value, data_len);
+	}
+	cert->data.len = data_len;
+
+	return decode_x509_cert(ctx, cert, names_only);
 }
 
 
@@ -344,7 +424,7 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 	if (cert == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	rv = parse_x509_cert(ctx, cert_blob, cert);
+	rv = parse_x509_cert(ctx, cert_blob, cert, 0, 0);
 
 	*out = cert->key;
 	cert->key = NULL;
@@ -354,13 +434,14 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 }
 
 
-int
-sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
-		struct sc_pkcs15_cert **cert_out)
+static int
+read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		int names_only, struct sc_pkcs15_cert **cert_out)
 {
 	struct sc_context *ctx = NULL;
 	struct sc_pkcs15_cert *cert = NULL;
 	struct sc_pkcs15_der der;
+	const u8 *mapped = NULL;
 	int r;
 
 	if (p15card == NULL || info == NULL || cert_out == NULL) {
@@ -372,6 +453,19 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 	if (info->value.len && info->value.value)   {
 		sc_der_copy(&der, &info->value);
 	}
+	else if (info->path.len && p15card->opts.use_file_cache
+			&& sc_pkcs15_map_cached_file(p15card, &info->path, &mapped, &der.len) == SC_SUCCESS) {
+		/* Refer to the certificate in the cache store */
+		der.value = (u8 *) mapped;
+		if (info->path.aid.len > 0 && info->path.len >= 2) {
+			struct sc_path parent = info->path;
+
+			parent.len -= 2;
+			parent.type = SC_PATH_TYPE_PATH;
+			r = sc_select_file(p15card->card, &parent, NULL);
+			LOG_TEST_RET(ctx, r, "Unable to select certificate application.");
+		}
+	}
 	else if (info->path.len) {
 		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
 		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
@@ -382,22 +476,53 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 
 	cert = malloc(sizeof(struct sc_pkcs15_cert));
 	if (cert == NULL) {
-		free(der.value);
+		if (!mapped)
+			free(der.value);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
 	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(ctx, &der, cert)) {
-		free(der.value);
+	if (parse_x509_cert(ctx, &der, cert, names_only, mapped != NULL)) {
+		if (!mapped)
+			free(der.value);
 		sc_pkcs15_free_certificate(cert);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
 	}
-	free(der.value);
+	if (!mapped)
+		free(der.value);
 
 	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
+int
+sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_cert **cert_out)
+{
+	return read_certificate(p15card, info, 0, cert_out);
+}
+
+
+int
+sc_pkcs15_read_certificate_names(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_cert **cert_out)
+{
+	return read_certificate(p15card, info, 1, cert_out);
+}
+
+
+int
+sc_pkcs15_complete_certificate(struct sc_context *ctx, struct sc_pkcs15_cert *cert)
+{
+	if (cert == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (cert->key != NULL)
+		return SC_SUCCESS;
+
+	return decode_x509_cert(ctx, cert, 0);
+}
+
+
 static const struct sc_asn1_entry c_asn1_cred_ident[] = {
 	{ "idType",	SC_ASN1_INTEGER,      SC_ASN1_TAG_INTEGER, 0, NULL, NULL },
 	{ "idValue",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
@@ -462,6 +587,8 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	sc_format_asn1_entry(asn1_x509_cert_attr + 0, asn1_x509_cert_value_choice, NULL, 0);
 	sc_format_asn1_entry(asn1_x509_cert_value_choice + 0, &info.path, NULL, 0);
 	sc_format_asn1_entry(asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
+	if (sc_pkcs15_df_holds(obj->df, *buf))
+		asn1_x509_cert_value_choice[1].flags |= SC_ASN1_BORROW;
 	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
 	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
 
@@ -471,7 +598,7 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 
 	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
 	/* In case of error, trash the cert value (direct coding) */
-	if (r < 0 && der->value)
+	if (r < 0 && der->value && !sc_pkcs15_df_holds(obj->df, der->value))
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
@@ -542,10 +669,14 @@ sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert)
 	}
 
 	sc_pkcs15_free_pubkey(cert->key);
-	free(cert->subject);
-	free(cert->issuer);
-	free(cert->serial);
-	free(cert->data.value);
+	if (!cert_holds(cert, cert->subject))
+		free(cert->subject);
+	if (!cert_holds(cert, cert->issuer))
+		free(cert->issuer);
+	if (!cert_holds(cert, cert->serial))
+		free(cert->serial);
+	if (!cert->data_mapped)
+		free(cert->data.value);
 	free(cert->extensions);
 	free(cert);
 }
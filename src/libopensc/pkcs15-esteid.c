@@ -59,6 +59,48 @@ select_esteid_df (sc_card_t * card)
 	return r;
 }
 
+/* Long enough to cover the serial number of the certificate */
+#define ESTEID_CERT_HEAD_LEN	48
+
+/*
+ * The certificates can be renewed on the same card, so a cached copy is
+ * only kept if it starts like the one on the card. This costs a single
+ * short READ BINARY instead of reading the whole certificate.
+ */
+static int
+esteid_check_cached_cert (sc_pkcs15_card_t * p15card, const sc_path_t * path)
+{
+	sc_card_t *card = p15card->card;
+	unsigned char head[ESTEID_CERT_HEAD_LEN];
+	unsigned char *cached = NULL, *data = NULL;
+	size_t cached_len = 0, len = 0, head_len;
+	int r;
+
+	if (!p15card->opts.use_file_cache
+			|| sc_pkcs15_read_cached_file(p15card, path, &cached, &cached_len) != SC_SUCCESS)
+		return SC_SUCCESS;
+
+	head_len = MIN(cached_len, sizeof(head));
+	r = sc_select_file(card, path, NULL);
+	if (r == SC_SUCCESS)
+		r = sc_read_binary(card, 0, head, head_len, 0);
+	if (r >= 0 && (size_t) r == head_len && memcmp(head, cached, head_len) == 0) {
+		free(cached);
+		return SC_SUCCESS;
+	}
+	free(cached);
+
+	sc_log(card->ctx, "cached certificate %s is outdated", sc_print_path(path));
+	p15card->opts.use_file_cache = 0;
+	r = sc_pkcs15_read_file(p15card, path, &data, &len);
+	p15card->opts.use_file_cache = 1;
+	if (r == SC_SUCCESS) {
+		r = sc_pkcs15_cache_file(p15card, path, data, len);
+		free(data);
+	}
+	return r;
+}
+
 static int
 sc_pkcs15emu_esteid_init (sc_pkcs15_card_t * p15card)
 {
@@ -67,6 +109,7 @@ sc_pkcs15emu_esteid_init (sc_pkcs15_card_t * p15card)
 	int r, i;
 	size_t field_length = 0, modulus_length = 0;
 	sc_path_t tmppath;
+	scconf_block *conf_block;
 
 	set_string (&p15card->tokeninfo->label, "ID-kaart");
 	set_string (&p15card->tokeninfo->manufacturer_id, "AS Sertifitseerimiskeskus");
@@ -86,6 +129,12 @@ sc_pkcs15emu_esteid_init (sc_pkcs15_card_t * p15card)
 				  | SC_PKCS15_TOKEN_EID_COMPLIANT
 				  | SC_PKCS15_TOKEN_READONLY;
 
+	/* Cache the certificates by the document number, unless the
+	 * configuration tells otherwise */
+	conf_block = sc_get_conf_block(card->ctx, "framework", "pkcs15", 1);
+	if (!conf_block || scconf_get_bool(conf_block, "use_file_caching", -1) < 0)
+		p15card->opts.use_file_cache = 1;
+
 	/* add certificates */
 	for (i = 0; i < 2; i++) {
 		static const char *esteid_cert_names[2] = {
@@ -106,6 +155,9 @@ sc_pkcs15emu_esteid_init (sc_pkcs15_card_t * p15card)
 		cert_info.id.len = 1;
 		sc_format_path(esteid_cert_paths[i], &cert_info.path);
 		strlcpy(cert_obj.label, esteid_cert_names[i], sizeof(cert_obj.label));
+		r = esteid_check_cached_cert(p15card, &cert_info.path);
+		if (r < 0)
+			return SC_ERROR_INTERNAL;
 		r = sc_pkcs15emu_add_x509_cert(p15card, &cert_obj, &cert_info);
 		if (r < 0)
 			return SC_ERROR_INTERNAL;
@@ -28,13 +28,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#ifdef ENABLE_ZLIB
-#include <zlib.h>
-#endif
 
 #include "common/compat_strlcpy.h"
 #include "pkcs15.h"
 #include "log.h"
+#include "compression.h"
 
 int sc_pkcs15emu_infocamere_init_ex(sc_pkcs15_card_t *, struct sc_aid *aid,
 		sc_pkcs15emu_opt_t *);
@@ -463,8 +461,8 @@ static const u8 ATR_1400[] =
 static int loadCertificate(sc_pkcs15_card_t * p15card, int i,
 		const char *certPath, const char *certLabel)
 {
-	unsigned char *compCert = NULL, *cert = NULL, size[2];
-	unsigned long int compLen, len;
+	unsigned char *cert = NULL, size[2];
+	size_t compLen, len;
 	sc_pkcs15_cert_info_t cert_info;
 	sc_pkcs15_object_t cert_obj;
 	sc_path_t cpath;
@@ -483,18 +481,10 @@ static int loadCertificate(sc_pkcs15_card_t * p15card, int i,
 	sc_read_binary(card, 2, size, 2, 0);
 
 	compLen = (size[0] << 8) + size[1];
-	compCert = malloc(compLen * sizeof(unsigned char));
-	len = 4 * compLen;	/*Approximation of the uncompressed size */
-	cert = malloc(len * sizeof(unsigned char));
-	if (!cert || !compCert) {
-		free(cert);
-		free(compCert);
-		return SC_ERROR_OUT_OF_MEMORY;
-	}
-
-	sc_read_binary(card, 4, compCert, compLen, 0);
-
-	if ((r = uncompress(cert, &len, compCert, compLen)) != Z_OK) {
+	/* 4 * compLen approximates the uncompressed size */
+	r = sc_decompress_read_binary(card, 4, compLen, COMPRESSION_ZLIB,
+			4 * compLen, &cert, &len);
+	if (r != SC_SUCCESS) {
 		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "Zlib error: %d", r);
 		return SC_ERROR_INTERNAL;
 	}
@@ -503,6 +493,7 @@ static int loadCertificate(sc_pkcs15_card_t * p15card, int i,
 	cpath.count = len;
 
 	sc_pkcs15_cache_file(p15card, &cpath, cert, len);
+	free(cert);
 
 	id.len=1;
 	id.value[0] = i + 1;
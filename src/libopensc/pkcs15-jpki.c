@@ -54,7 +54,6 @@ sc_pkcs15emu_jpki_init(sc_pkcs15_card_t * p15card)
 	if (drvdata->selected != SELECT_JPKI_AP) {
 		rc = jpki_select_ap(card);
 		LOG_TEST_RET(card->ctx, rc, "select AP failed");
-		drvdata->selected = SELECT_JPKI_AP;
 	}
 
 	/* add certificates */
@@ -87,10 +87,21 @@ const unsigned char PinDomainID[3] = {0x53, 0x43, 0x4D};
 #define BASE_ID_PRV_DATA  0x60
 #define BASE_ID_PUB_DES   0x70
 
-static int sc_pkcs15emu_oberthur_add_prvkey(struct sc_pkcs15_card *, unsigned, unsigned);
-static int sc_pkcs15emu_oberthur_add_pubkey(struct sc_pkcs15_card *, unsigned, unsigned);
-static int sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *, unsigned);
-static int sc_pkcs15emu_oberthur_add_data(struct sc_pkcs15_card *, unsigned, unsigned, int);
+/* An entry of the public or private objects list, with the content of its files */
+struct oberthur_object {
+	unsigned int file_id;
+	unsigned int size;
+	unsigned char *info;	/* object info file */
+	size_t info_len;
+	unsigned char *value;	/* certificate value */
+	size_t value_len;
+	int rv;			/* result of reading the files */
+};
+
+static int sc_pkcs15emu_oberthur_add_prvkey(struct sc_pkcs15_card *, struct oberthur_object *);
+static int sc_pkcs15emu_oberthur_add_pubkey(struct sc_pkcs15_card *, struct oberthur_object *);
+static int sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *, struct oberthur_object *);
+static int sc_pkcs15emu_oberthur_add_data(struct sc_pkcs15_card *, struct oberthur_object *, int);
 
 int sc_pkcs15emu_oberthur_init_ex(struct sc_pkcs15_card *, struct sc_aid *, struct sc_pkcs15emu_opt *);
 
@@ -428,46 +439,140 @@ sc_oberthur_parse_containers (struct sc_pkcs15_card *p15card,
 }
 
 
+/*
+ * First pass over an objects list: read the info files of all the listed
+ * objects, and the values of the certificates, before any object is built.
+ * Once a private file cannot be read for the lack of the PIN, the other
+ * private objects of the same kind are not tried.
+ */
 static int
-sc_oberthur_parse_publicinfo (struct sc_pkcs15_card *p15card,
-		unsigned char *buff, size_t len, int postpone_allowed)
+sc_oberthur_read_objects(struct sc_pkcs15_card *p15card, unsigned char *buff, size_t len,
+		int private, struct oberthur_object **out, size_t *out_count)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	size_t ii;
-	int rv;
+	struct oberthur_object *objs;
+	int denied_keys = 0, denied_data = 0;
+	char ch_tmp[0x20];
+	size_t ii, count = 0;
 
 	LOG_FUNC_CALLED(ctx);
-	for (ii=0; ii<len; ii+=5)   {
-		unsigned int file_id, size;
+	*out = NULL;
+	*out_count = 0;
+
+	objs = calloc(len / 5 + 1, sizeof(struct oberthur_object));
+	if (!objs)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	for (ii=0; ii + 5 <= len; ii+=5)   {
+		struct oberthur_object *obj = &objs[count];
+		const char *df = private ? AWP_OBJECTS_DF_PRV : AWP_OBJECTS_DF_PUB;
+		int with_info = 0, *denied = NULL;
 
 		if(*(buff+ii) != 0xFF)
 			continue;
+		count++;
 
-		file_id = 0x100 * *(buff+ii + 1) + *(buff+ii + 2);
-		size = 0x100 * *(buff+ii + 3) + *(buff+ii + 4);
-		sc_log(ctx, "add public object(file-id:%04X,size:%X)", file_id, size);
+		obj->file_id = 0x100 * *(buff+ii + 1) + *(buff+ii + 2);
+		obj->size = 0x100 * *(buff+ii + 3) + *(buff+ii + 4);
 
 		switch (*(buff+ii + 1))   {
 		case BASE_ID_PUB_RSA :
-			rv = sc_pkcs15emu_oberthur_add_pubkey(p15card, file_id, size);
-			LOG_TEST_RET(ctx, rv, "Cannot parse public key info");
+		case BASE_ID_CERT :
+		case BASE_ID_PUB_DATA :
+			with_info = !private;
+			break;
+		case BASE_ID_PRV_RSA :
+			with_info = private;
+			denied = &denied_keys;
+			break;
+		case BASE_ID_PRV_DATA :
+			with_info = private;
+			denied = &denied_data;
+			break;
+		}
+		if (!with_info)
+			continue;
+
+		if (denied && *denied)   {
+			obj->rv = SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
+			continue;
+		}
+
+		snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", df, obj->file_id | 0x100);
+		obj->rv = sc_oberthur_read_file(p15card, ch_tmp, &obj->info, &obj->info_len, 1);
+		if (obj->rv == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED && denied)
+			*denied = 1;
+
+		if (obj->rv >= 0 && *(buff+ii + 1) == BASE_ID_CERT)   {
+			snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", df, obj->file_id);
+			obj->rv = sc_oberthur_read_file(p15card, ch_tmp, &obj->value, &obj->value_len, 1);
+		}
+	}
+
+	sc_log(ctx, "%"SC_FORMAT_LEN_SIZE_T"u %s objects read", count, private ? "private" : "public");
+	*out = objs;
+	*out_count = count;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+static void
+sc_oberthur_free_objects(struct oberthur_object *objs, size_t count)
+{
+	size_t ii;
+
+	for (ii=0; objs && ii<count; ii++)   {
+		free(objs[ii].info);
+		free(objs[ii].value);
+	}
+	free(objs);
+}
+
+
+static int
+sc_oberthur_parse_publicinfo (struct sc_pkcs15_card *p15card,
+		unsigned char *buff, size_t len, int postpone_allowed)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct oberthur_object *objs = NULL;
+	size_t ii, count = 0;
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+	rv = sc_oberthur_read_objects(p15card, buff, len, 0, &objs, &count);
+	LOG_TEST_RET(ctx, rv, "Cannot read public objects");
+
+	for (ii=0; rv >= 0 && ii<count; ii++)   {
+		struct oberthur_object *obj = &objs[ii];
+
+		sc_log(ctx, "add public object(file-id:%04X,size:%X)", obj->file_id, obj->size);
+
+		switch (obj->file_id >> 8)   {
+		case BASE_ID_PUB_RSA :
+			rv = sc_pkcs15emu_oberthur_add_pubkey(p15card, obj);
+			if (rv < 0)
+				sc_log(ctx, "Cannot parse public key info");
 			break;
 		case BASE_ID_CERT :
-			rv = sc_pkcs15emu_oberthur_add_cert(p15card, file_id);
-			LOG_TEST_RET(ctx, rv, "Cannot parse certificate info");
+			rv = sc_pkcs15emu_oberthur_add_cert(p15card, obj);
+			if (rv < 0)
+				sc_log(ctx, "Cannot parse certificate info");
 			break;
 		case BASE_ID_PUB_DES :
 			break;
 		case BASE_ID_PUB_DATA :
-			rv = sc_pkcs15emu_oberthur_add_data(p15card, file_id, size, 0);
-			LOG_TEST_RET(ctx, rv, "Cannot parse data info");
+			rv = sc_pkcs15emu_oberthur_add_data(p15card, obj, 0);
+			if (rv < 0)
+				sc_log(ctx, "Cannot parse data info");
 			break;
 		default:
-			LOG_TEST_RET(ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED, "Public object parse error");
+			rv = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+			sc_log(ctx, "Public object parse error");
 		}
 	}
 
-	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	sc_oberthur_free_objects(objs, count);
+	LOG_FUNC_RETURN(ctx, rv < 0 ? rv : SC_SUCCESS);
 }
 
 
@@ -476,64 +581,66 @@ sc_oberthur_parse_privateinfo (struct sc_pkcs15_card *p15card,
 		unsigned char *buff, size_t len, int postpone_allowed)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	size_t ii;
+	struct oberthur_object *objs = NULL;
+	size_t ii, count = 0;
 	int rv;
 	int no_more_private_keys = 0, no_more_private_data = 0;
 
 	LOG_FUNC_CALLED(ctx);
+	rv = sc_oberthur_read_objects(p15card, buff, len, 1, &objs, &count);
+	LOG_TEST_RET(ctx, rv, "Cannot read private objects");
 
-	for (ii=0; ii<len; ii+=5)   {
-		unsigned int file_id, size;
+	for (ii=0; rv >= 0 && ii<count; ii++)   {
+		struct oberthur_object *obj = &objs[ii];
+		struct sc_path path;
 
-		if(*(buff+ii) != 0xFF)
-			continue;
+		sc_log(ctx, "add private object (file-id:%04X, size:%X)", obj->file_id, obj->size);
 
-		file_id = 0x100 * *(buff+ii + 1) + *(buff+ii + 2);
-		size = 0x100 * *(buff+ii + 3) + *(buff+ii + 4);
-		sc_log(ctx, "add private object (file-id:%04X, size:%X)", file_id, size);
-
-		switch (*(buff+ii + 1))   {
+		switch (obj->file_id >> 8)   {
 		case BASE_ID_PRV_RSA :
 			if (no_more_private_keys)
 				break;
 
-			rv = sc_pkcs15emu_oberthur_add_prvkey(p15card, file_id, size);
+			rv = sc_pkcs15emu_oberthur_add_prvkey(p15card, obj);
 			if (rv == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED && postpone_allowed)   {
-				struct sc_path path;
-
 				sc_log(ctx, "postpone adding of the private keys");
 				sc_format_path("5011A5A5", &path);
 				rv = sc_pkcs15_add_df(p15card, SC_PKCS15_PRKDF, &path);
-				LOG_TEST_RET(ctx, rv, "Add PrkDF error");
+				if (rv < 0)
+					sc_log(ctx, "Add PrkDF error");
 				no_more_private_keys = 1;
 			}
-			LOG_TEST_RET(ctx, rv, "Cannot parse private key info");
+			else if (rv < 0)   {
+				sc_log(ctx, "Cannot parse private key info");
+			}
 			break;
 		case BASE_ID_PRV_DES :
 			break;
 		case BASE_ID_PRV_DATA :
-			sc_log(ctx, "*(buff+ii + 1):%X", *(buff+ii + 1));
 			if (no_more_private_data)
 				break;
 
-			rv = sc_pkcs15emu_oberthur_add_data(p15card, file_id, size, 1);
+			rv = sc_pkcs15emu_oberthur_add_data(p15card, obj, 1);
 			if (rv == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED && postpone_allowed)   {
-				struct sc_path path;
-
 				sc_log(ctx, "postpone adding of the private data");
 				sc_format_path("5011A6A6", &path);
 				rv = sc_pkcs15_add_df(p15card, SC_PKCS15_DODF, &path);
-				LOG_TEST_RET(ctx, rv, "Add DODF error");
+				if (rv < 0)
+					sc_log(ctx, "Add DODF error");
 				no_more_private_data = 1;
 			}
-			LOG_TEST_RET(ctx, rv, "Cannot parse private data info");
+			else if (rv < 0)   {
+				sc_log(ctx, "Cannot parse private data info");
+			}
 			break;
 		default:
-			LOG_TEST_RET(ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED, "Private object parse error");
+			rv = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+			sc_log(ctx, "Private object parse error");
 		}
 	}
 
-	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	sc_oberthur_free_objects(objs, count);
+	LOG_FUNC_RETURN(ctx, rv < 0 ? rv : SC_SUCCESS);
 }
 
 
@@ -546,15 +653,15 @@ sc_oberthur_parse_privateinfo (struct sc_pkcs15_card *p15card,
  * 	??(0x00:2)
  */
 static int
-sc_pkcs15emu_oberthur_add_pubkey(struct sc_pkcs15_card *p15card,
-		unsigned int file_id, unsigned int size)
+sc_pkcs15emu_oberthur_add_pubkey(struct sc_pkcs15_card *p15card, struct oberthur_object *obj)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_pkcs15_pubkey_info key_info;
 	struct sc_pkcs15_object key_obj;
 	char ch_tmp[0x100];
-	unsigned char *info_blob;
-	size_t len, info_len, offs;
+	unsigned char *info_blob = obj->info;
+	size_t len, info_len = obj->info_len, offs;
+	unsigned int file_id = obj->file_id, size = obj->size;
 	unsigned flags;
 	int rv;
 
@@ -564,9 +671,7 @@ sc_pkcs15emu_oberthur_add_pubkey(struct sc_pkcs15_card *p15card,
 	memset(&key_info, 0, sizeof(key_info));
 	memset(&key_obj, 0, sizeof(key_obj));
 
-	snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", AWP_OBJECTS_DF_PUB, file_id | 0x100);
-	rv = sc_oberthur_read_file(p15card, ch_tmp, &info_blob, &info_len, 1);
-	LOG_TEST_RET(ctx, rv, "Failed to add public key: read oberthur file error");
+	LOG_TEST_RET(ctx, obj->rv, "Failed to add public key: read oberthur file error");
 
 	/* Flags */
 	offs = 2;
@@ -622,13 +727,14 @@ sc_pkcs15emu_oberthur_add_pubkey(struct sc_pkcs15_card *p15card,
  * 	Serial encoded in LV or ASN.1	FIXME
  */
 static int
-sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *p15card, unsigned int file_id)
+sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *p15card, struct oberthur_object *obj)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_pkcs15_cert_info cinfo;
 	struct sc_pkcs15_object cobj;
-	unsigned char *info_blob, *cert_blob;
-	size_t info_len, cert_len, len, offs;
+	unsigned char *info_blob = obj->info;
+	size_t info_len = obj->info_len, len, offs;
+	unsigned int file_id = obj->file_id;
 	unsigned flags;
 	int rv;
 	char ch_tmp[0x20];
@@ -639,9 +745,7 @@ sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *p15card, unsigned int file
 	memset(&cinfo, 0, sizeof(cinfo));
 	memset(&cobj, 0, sizeof(cobj));
 
-	snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", AWP_OBJECTS_DF_PUB, file_id | 0x100);
-	rv = sc_oberthur_read_file(p15card, ch_tmp, &info_blob, &info_len, 1);
-	LOG_TEST_RET(ctx, rv, "Failed to add certificate: read oberthur file error");
+	LOG_TEST_RET(ctx, obj->rv, "Failed to add certificate: read oberthur file error");
 
 	if (info_len < 2)
 		LOG_TEST_RET(ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED, "Failed to add certificate: no 'tag'");
@@ -672,11 +776,9 @@ sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *p15card, unsigned int file
 
 	snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", AWP_OBJECTS_DF_PUB, file_id);
 	sc_format_path(ch_tmp, &cinfo.path);
-	rv = sc_oberthur_read_file(p15card, ch_tmp, &cert_blob, &cert_len, 1);
-	LOG_TEST_RET(ctx, rv, "Failed to add certificate: read certificate error");
 
-	cinfo.value.value = cert_blob;
-	cinfo.value.len = cert_len;
+	cinfo.value.value = obj->value;
+	cinfo.value.len = obj->value_len;
 
 	rv = sc_oberthur_get_certificate_authority(&cinfo.value, &cinfo.authority);
 	LOG_TEST_RET(ctx, rv, "Failed to add certificate: get certificate attributes error");
@@ -685,6 +787,8 @@ sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *p15card, unsigned int file
 		cobj.flags |= SC_PKCS15_CO_FLAG_MODIFIABLE;
 
 	rv = sc_pkcs15emu_add_x509_cert(p15card, &cobj, &cinfo);
+	if (rv >= 0)
+		obj->value = NULL;	/* now owned by the certificate object */
 
 	SC_FUNC_RETURN(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, rv);
 }
@@ -701,15 +805,15 @@ sc_pkcs15emu_oberthur_add_cert(struct sc_pkcs15_card *p15card, unsigned int file
  *	exponent(length:1, value:3)
  */
 static int
-sc_pkcs15emu_oberthur_add_prvkey(struct sc_pkcs15_card *p15card,
-		unsigned int file_id, unsigned int size)
+sc_pkcs15emu_oberthur_add_prvkey(struct sc_pkcs15_card *p15card, struct oberthur_object *obj)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_pkcs15_prkey_info kinfo;
 	struct sc_pkcs15_object kobj;
 	struct crypto_container ccont;
-	unsigned char *info_blob = NULL;
-	size_t info_len = 0;
+	unsigned char *info_blob = obj->info;
+	size_t info_len = obj->info_len;
+	unsigned int file_id = obj->file_id, size = obj->size;
 	unsigned flags;
 	size_t offs, len;
 	char ch_tmp[0x100];
@@ -748,9 +852,7 @@ sc_pkcs15emu_oberthur_add_prvkey(struct sc_pkcs15_card *p15card,
 			LOG_TEST_RET(ctx, SC_ERROR_INCONSISTENT_PROFILE, "Failed to add private key: friend not found");
 	}
 
-	snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", AWP_OBJECTS_DF_PRV, file_id | 0x100);
-	rv = sc_oberthur_read_file(p15card, ch_tmp, &info_blob, &info_len, 1);
-	LOG_TEST_RET(ctx, rv, "Failed to add private key: read oberthur file error");
+	LOG_TEST_RET(ctx, obj->rv, "Failed to add private key: read oberthur file error");
 
 	if (info_len < 2)
 		LOG_TEST_RET(ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED, "Failed to add private key: no 'tag'");
@@ -822,15 +924,16 @@ sc_pkcs15emu_oberthur_add_prvkey(struct sc_pkcs15_card *p15card,
 
 
 static int
-sc_pkcs15emu_oberthur_add_data(struct sc_pkcs15_card *p15card,
-		unsigned int file_id, unsigned int size, int private)
+sc_pkcs15emu_oberthur_add_data(struct sc_pkcs15_card *p15card, struct oberthur_object *obj,
+		int private)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_pkcs15_data_info dinfo;
 	struct sc_pkcs15_object dobj;
 	unsigned flags;
-	unsigned char *info_blob = NULL, *label = NULL, *app = NULL, *oid = NULL;
-	size_t info_len, label_len, app_len, oid_len, offs;
+	unsigned char *info_blob = obj->info, *label = NULL, *app = NULL, *oid = NULL;
+	size_t info_len = obj->info_len, label_len, app_len, oid_len, offs;
+	unsigned int file_id = obj->file_id, size = obj->size;
 	char ch_tmp[0x100];
 	int rv;
 
@@ -839,10 +942,7 @@ sc_pkcs15emu_oberthur_add_data(struct sc_pkcs15_card *p15card,
 	memset(&dinfo, 0, sizeof(dinfo));
 	memset(&dobj, 0, sizeof(dobj));
 
-	snprintf(ch_tmp, sizeof(ch_tmp), "%s%04X", private ? AWP_OBJECTS_DF_PRV : AWP_OBJECTS_DF_PUB, file_id | 0x100);
-
-	rv = sc_oberthur_read_file(p15card, ch_tmp, &info_blob, &info_len, 1);
-	LOG_TEST_RET(ctx, rv, "Failed to add data: read oberthur file error");
+	LOG_TEST_RET(ctx, obj->rv, "Failed to add data: read oberthur file error");
 
 	if (info_len < 2)
 		LOG_TEST_RET(ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED, "Failed to add certificate: no 'tag'");
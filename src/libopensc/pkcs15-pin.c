@@ -34,6 +34,8 @@
 
 int _sc_pkcs15_verify_pin(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 		const unsigned char *, size_t);
+static int pincache_holds(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		const u8 *, size_t);
 
 static const struct sc_asn1_entry c_asn1_com_ao_attr[] = {
 	{ "authId",       SC_ASN1_PKCS15_ID, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
@@ -308,12 +310,29 @@ sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *pi
 	 * is still open on card.
 	 */
 	if (pinlen == 0) {
+	    /* ask the card, a cached state must not skip a verification */
+	    auth_info->info_serial = 0;
 	    r = sc_pkcs15_get_pin_info(p15card, pin_obj);
 
 	    if (r == SC_SUCCESS && auth_info->logged_in == SC_PIN_STATE_LOGGED_IN)
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
+	/*
+	 * The PIN held by the PIN cache was verified already. While the card
+	 * reports it as verified, the same PIN is not sent again, which saves
+	 * the VERIFY and keeps the retry counter out of danger. Any other PIN
+	 * is verified as usual.
+	 */
+	if (pinlen > 0 && pincache_holds(p15card, pin_obj, pincode, pinlen)) {
+		r = sc_pkcs15_get_pin_info(p15card, pin_obj);
+		if (r == SC_SUCCESS && auth_info->logged_in == SC_PIN_STATE_LOGGED_IN) {
+			sc_log(ctx, "PIN(%s) is verified already", pin_obj->label);
+			sc_pkcs15_pincache_add(p15card, pin_obj, pincode, pinlen);
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
+
 	r = _validate_pin(p15card, auth_info, pinlen);
 
 	if (r)
@@ -697,6 +716,21 @@ int sc_pkcs15_get_pin_info(struct sc_pkcs15_card *p15card,
 		goto out;
 	}
 
+	/* Nothing changed since the last time, sc_lock() above notices resets.
+	 * Other processes may still have used the PIN, so the status is only
+	 * kept for 'pin_info_cache_timeout' seconds. Without a timeout only a
+	 * known login state is kept; for drivers that cannot tell, the card is
+	 * asked every time. */
+	if (p15card->opts.use_pin_info_cache
+			&& pin_info->info_serial == card->auth_serial
+			&& (p15card->opts.pin_info_cache_timeout > 0
+				? time(NULL) - pin_info->info_time < p15card->opts.pin_info_cache_timeout
+				: pin_info->logged_in != SC_PIN_STATE_UNKNOWN)) {
+		r = SC_SUCCESS;
+		goto out;
+	}
+	pin_info->info_serial = 0;
+
 	/* Try to update PIN info from card */
 	memset(&data, 0, sizeof(data));
 	data.cmd = SC_PIN_CMD_GET_INFO;
@@ -710,6 +744,8 @@ int sc_pkcs15_get_pin_info(struct sc_pkcs15_card *p15card,
 		/* tries_left must be supported or sc_pin_cmd should not return SC_SUCCESS */
 		pin_info->tries_left = data.pin1.tries_left;
 		pin_info->logged_in = data.pin1.logged_in;
+		pin_info->info_serial = card->auth_serial;
+		pin_info->info_time = time(NULL);
 	}
 
 out:
@@ -777,9 +813,49 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 	}
 
 	pin_obj->usage_counter = 0;
+	auth_info->cache_serial = p15card->card->reset_serial;
+	auth_info->cache_time = time(NULL);
 	sc_log(ctx, "PIN(%s) cached", pin_obj->label);
 }
 
+/* Remove a cached PIN that was not used for 'pin_cache_timeout' seconds */
+static int
+pincache_expired(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *pin_obj)
+{
+	struct sc_pkcs15_auth_info *auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+
+	if (p15card->opts.pin_cache_timeout <= 0
+			|| time(NULL) - auth_info->cache_time < p15card->opts.pin_cache_timeout)
+		return 0;
+
+	sc_log(p15card->card->ctx, "PIN(%s) idle for too long, removed from cache", pin_obj->label);
+	sc_pkcs15_free_object_content(pin_obj);
+	return 1;
+}
+
+/* Whether the PIN cache holds this PIN for pin_obj, for a login that is not
+ * context specific, since the last reset of the card */
+static int
+pincache_holds(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *pin_obj,
+		const u8 *pin, size_t pinlen)
+{
+	struct sc_pkcs15_auth_info *auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+	unsigned char diff = 0;
+	size_t i;
+
+	if (pin == NULL || auth_info->auth_method == SC_AC_CONTEXT_SPECIFIC
+			|| auth_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN
+			|| pin_obj->content.value == NULL || pin_obj->content.len != pinlen
+			|| auth_info->cache_serial != p15card->card->reset_serial
+			|| pincache_expired(p15card, pin_obj))
+		return 0;
+
+	/* in constant time */
+	for (i = 0; i < pinlen; i++)
+		diff |= pin_obj->content.value[i] ^ pin[i];
+	return diff == 0;
+}
+
 /* Validate the PIN code associated with an object */
 int
 sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs15_object_t *obj)
@@ -809,6 +885,9 @@ sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs15_ob
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
 	}
 
+	if (pin_obj->content.value && pincache_expired(p15card, pin_obj))
+		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
+
 	if (pin_obj->usage_counter >= p15card->opts.pin_cache_counter) {
 		sc_pkcs15_free_object_content(pin_obj);
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
@@ -830,6 +909,35 @@ sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs15_ob
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+/*
+ * Called with the card locked before the key 'obj' is used. Drops the cached
+ * PIN of the key once it has been idle for too long, and, if the card was
+ * reset since the PIN was cached, verifies it again right away instead of
+ * waiting for the operation to fail with "security status not satisfied".
+ */
+void
+sc_pkcs15_pincache_prepare(struct sc_pkcs15_card *p15card, const sc_pkcs15_object_t *obj)
+{
+	struct sc_pkcs15_auth_info *auth_info;
+	sc_pkcs15_object_t *pin_obj;
+
+	if (!p15card->opts.use_pin_cache || obj->auth_id.len == 0)
+		return;
+	if (sc_pkcs15_find_pin_by_auth_id(p15card, &obj->auth_id, &pin_obj) != SC_SUCCESS
+			|| !pin_obj->content.value || pincache_expired(p15card, pin_obj))
+		return;
+
+	auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+	auth_info->cache_time = time(NULL);
+	if (!p15card->opts.pin_cache_proactive
+			|| auth_info->cache_serial == p15card->card->reset_serial)
+		return;
+
+	sc_log(p15card->card->ctx, "Card was reset, revalidating PIN(%s)", pin_obj->label);
+	/* if this fails, the operation fails and reports it */
+	sc_pkcs15_pincache_revalidate(p15card, obj);
+}
+
 void sc_pkcs15_pincache_clear(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *objs[32];
@@ -177,79 +177,97 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	struct sc_pkcs15_keyinfo_gostparams *keyinfo_gostparams;
 	size_t usage_len = sizeof(info.usage);
 	size_t af_len = sizeof(info.access_flags);
-	struct sc_asn1_entry asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_com_prkey_attr[C_ASN1_COM_PRKEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_rsakey_attr[C_ASN1_RSAKEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_prk_rsa_attr[C_ASN1_PRK_RSA_ATTR_SIZE];
-	struct sc_asn1_entry asn1_dsakey_attr[C_ASN1_DSAKEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_prk_dsa_attr[C_ASN1_PRK_DSA_ATTR_SIZE];
-	struct sc_asn1_entry asn1_dsakey_i_p_attr[C_ASN1_DSAKEY_I_P_ATTR_SIZE];
-	struct sc_asn1_entry asn1_dsakey_value_attr[C_ASN1_DSAKEY_VALUE_ATTR_SIZE];
-	struct sc_asn1_entry asn1_gostr3410key_attr[C_ASN1_GOSTR3410KEY_ATTR_SIZE];
-	struct sc_asn1_entry asn1_prk_gostr3410_attr[C_ASN1_PRK_GOSTR3410_ATTR_SIZE];
-	struct sc_asn1_entry asn1_ecckey_attr[C_ASN1_ECCKEY_ATTR];
-	struct sc_asn1_entry asn1_prk_ecc_attr[C_ASN1_PRK_ECC_ATTR];
-	struct sc_asn1_entry asn1_prkey[C_ASN1_PRKEY_SIZE];
-	struct sc_asn1_entry asn1_supported_algorithms[C_ASN1_SUPPORTED_ALGORITHMS_SIZE];
-	struct sc_asn1_pkcs15_object rsa_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_rsa_attr};
-	struct sc_asn1_pkcs15_object dsa_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_dsa_attr};
-	struct sc_asn1_pkcs15_object gostr3410_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_gostr3410_attr};
-	struct sc_asn1_pkcs15_object ecc_prkey_obj = { obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_ecc_attr };
-
-	sc_copy_asn1_entry(c_asn1_prkey, asn1_prkey);
-	sc_copy_asn1_entry(c_asn1_supported_algorithms, asn1_supported_algorithms);
-
-	sc_copy_asn1_entry(c_asn1_prk_rsa_attr, asn1_prk_rsa_attr);
-	sc_copy_asn1_entry(c_asn1_rsakey_attr, asn1_rsakey_attr);
-	sc_copy_asn1_entry(c_asn1_prk_dsa_attr, asn1_prk_dsa_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_attr, asn1_dsakey_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_value_attr, asn1_dsakey_value_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_i_p_attr, asn1_dsakey_i_p_attr);
-	sc_copy_asn1_entry(c_asn1_prk_gostr3410_attr, asn1_prk_gostr3410_attr);
-	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, asn1_gostr3410key_attr);
-	sc_copy_asn1_entry(c_asn1_prk_ecc_attr, asn1_prk_ecc_attr);
-	sc_copy_asn1_entry(c_asn1_ecckey_attr, asn1_ecckey_attr);
-
-	sc_copy_asn1_entry(c_asn1_com_prkey_attr, asn1_com_prkey_attr);
-	sc_copy_asn1_entry(c_asn1_com_key_attr, asn1_com_key_attr);
-
-	sc_format_asn1_entry(asn1_prkey + 0, &rsa_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 1, &ecc_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 2, &dsa_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 3, &gostr3410_prkey_obj, NULL, 0);
-
-	sc_format_asn1_entry(asn1_prk_rsa_attr + 0, asn1_rsakey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_dsa_attr + 0, asn1_dsakey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_gostr3410_attr + 0, asn1_gostr3410key_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_ecc_attr + 0, asn1_ecckey_attr, NULL, 0);
-
-	sc_format_asn1_entry(asn1_rsakey_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_rsakey_attr + 1, &info.modulus_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_dsakey_attr + 0, asn1_dsakey_value_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_value_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_value_attr + 1, asn1_dsakey_i_p_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_i_p_attr + 0, &info.path, NULL, 0);
-
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 1, &gostr3410_params[0], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 2, &gostr3410_params[1], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 3, &gostr3410_params[2], NULL, 0);
-
-	sc_format_asn1_entry(asn1_ecckey_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_ecckey_attr + 1, &info.field_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_com_key_attr + 0, &info.id, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 1, &info.usage, &usage_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 2, &info.native, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 3, &info.access_flags, &af_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 4, &info.key_reference, NULL, 0);
-
-	for (i=0; i<SC_MAX_SUPPORTED_ALGORITHMS && (asn1_supported_algorithms + i)->name; i++)
-		sc_format_asn1_entry(asn1_supported_algorithms + i, &info.algo_refs[i], NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 5, asn1_supported_algorithms, NULL, 0);
-
-	sc_format_asn1_entry(asn1_com_prkey_attr + 0, &info.subject.value, &info.subject.len, 0);
+	struct sc_asn1_binding asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
+	struct sc_asn1_binding asn1_com_prkey_attr[C_ASN1_COM_PRKEY_ATTR_SIZE];
+	struct sc_asn1_binding asn1_rsakey_attr[C_ASN1_RSAKEY_ATTR_SIZE];
+	struct sc_asn1_binding asn1_prk_rsa_attr[C_ASN1_PRK_RSA_ATTR_SIZE];
+	struct sc_asn1_binding asn1_dsakey_attr[C_ASN1_DSAKEY_ATTR_SIZE];
+	struct sc_asn1_binding asn1_prk_dsa_attr[C_ASN1_PRK_DSA_ATTR_SIZE];
+	struct sc_asn1_binding asn1_dsakey_i_p_attr[C_ASN1_DSAKEY_I_P_ATTR_SIZE];
+	struct sc_asn1_binding asn1_dsakey_value_attr[C_ASN1_DSAKEY_VALUE_ATTR_SIZE];
+	struct sc_asn1_binding asn1_gostr3410key_attr[C_ASN1_GOSTR3410KEY_ATTR_SIZE];
+	struct sc_asn1_binding asn1_prk_gostr3410_attr[C_ASN1_PRK_GOSTR3410_ATTR_SIZE];
+	struct sc_asn1_binding asn1_ecckey_attr[C_ASN1_ECCKEY_ATTR];
+	struct sc_asn1_binding asn1_prk_ecc_attr[C_ASN1_PRK_ECC_ATTR];
+	struct sc_asn1_binding asn1_prkey[C_ASN1_PRKEY_SIZE];
+	struct sc_asn1_binding asn1_supported_algorithms[C_ASN1_SUPPORTED_ALGORITHMS_SIZE];
+	struct sc_asn1_binding class_attr = { NULL, NULL, c_asn1_com_key_attr, asn1_com_key_attr, 0 };
+	struct sc_asn1_binding subclass_attr = { NULL, NULL, c_asn1_com_prkey_attr, asn1_com_prkey_attr, 0 };
+	struct sc_asn1_binding rsa_type_attr = { NULL, NULL, c_asn1_prk_rsa_attr, asn1_prk_rsa_attr, 0 };
+	struct sc_asn1_binding dsa_type_attr = { NULL, NULL, c_asn1_prk_dsa_attr, asn1_prk_dsa_attr, 0 };
+	struct sc_asn1_binding gostr3410_type_attr = { NULL, NULL, c_asn1_prk_gostr3410_attr, asn1_prk_gostr3410_attr, 0 };
+	struct sc_asn1_binding ecc_type_attr = { NULL, NULL, c_asn1_prk_ecc_attr, asn1_prk_ecc_attr, 0 };
+	struct sc_asn1_pkcs15_object rsa_prkey_obj = { obj, NULL, NULL, NULL, &class_attr, &subclass_attr, &rsa_type_attr };
+	struct sc_asn1_pkcs15_object dsa_prkey_obj = { obj, NULL, NULL, NULL, &class_attr, &subclass_attr, &dsa_type_attr };
+	struct sc_asn1_pkcs15_object gostr3410_prkey_obj = { obj, NULL, NULL, NULL, &class_attr, &subclass_attr, &gostr3410_type_attr };
+	struct sc_asn1_pkcs15_object ecc_prkey_obj = { obj, NULL, NULL, NULL, &class_attr, &subclass_attr, &ecc_type_attr };
+
+	/* the static templates are used as they are, only the output is
+	 * bound here */
+	memset(asn1_com_key_attr, 0, sizeof(asn1_com_key_attr));
+	memset(asn1_com_prkey_attr, 0, sizeof(asn1_com_prkey_attr));
+	memset(asn1_rsakey_attr, 0, sizeof(asn1_rsakey_attr));
+	memset(asn1_prk_rsa_attr, 0, sizeof(asn1_prk_rsa_attr));
+	memset(asn1_dsakey_attr, 0, sizeof(asn1_dsakey_attr));
+	memset(asn1_prk_dsa_attr, 0, sizeof(asn1_prk_dsa_attr));
+	memset(asn1_dsakey_i_p_attr, 0, sizeof(asn1_dsakey_i_p_attr));
+	memset(asn1_dsakey_value_attr, 0, sizeof(asn1_dsakey_value_attr));
+	memset(asn1_gostr3410key_attr, 0, sizeof(asn1_gostr3410key_attr));
+	memset(asn1_prk_gostr3410_attr, 0, sizeof(asn1_prk_gostr3410_attr));
+	memset(asn1_ecckey_attr, 0, sizeof(asn1_ecckey_attr));
+	memset(asn1_prk_ecc_attr, 0, sizeof(asn1_prk_ecc_attr));
+	memset(asn1_prkey, 0, sizeof(asn1_prkey));
+	memset(asn1_supported_algorithms, 0, sizeof(asn1_supported_algorithms));
+
+	asn1_prkey[0].parm = &rsa_prkey_obj;
+	asn1_prkey[1].parm = &ecc_prkey_obj;
+	asn1_prkey[2].parm = &dsa_prkey_obj;
+	asn1_prkey[3].parm = &gostr3410_prkey_obj;
+
+	asn1_prk_rsa_attr[0].asn1 = c_asn1_rsakey_attr;
+	asn1_prk_rsa_attr[0].bind = asn1_rsakey_attr;
+	asn1_prk_dsa_attr[0].asn1 = c_asn1_dsakey_attr;
+	asn1_prk_dsa_attr[0].bind = asn1_dsakey_attr;
+	asn1_prk_gostr3410_attr[0].asn1 = c_asn1_gostr3410key_attr;
+	asn1_prk_gostr3410_attr[0].bind = asn1_gostr3410key_attr;
+	asn1_prk_ecc_attr[0].asn1 = c_asn1_ecckey_attr;
+	asn1_prk_ecc_attr[0].bind = asn1_ecckey_attr;
+
+	asn1_rsakey_attr[0].parm = &info.path;
+	asn1_rsakey_attr[1].parm = &info.modulus_length;
+
+	asn1_dsakey_attr[0].asn1 = c_asn1_dsakey_value_attr;
+	asn1_dsakey_attr[0].bind = asn1_dsakey_value_attr;
+	asn1_dsakey_value_attr[0].parm = &info.path;
+	asn1_dsakey_value_attr[1].asn1 = c_asn1_dsakey_i_p_attr;
+	asn1_dsakey_value_attr[1].bind = asn1_dsakey_i_p_attr;
+	asn1_dsakey_i_p_attr[0].parm = &info.path;
+
+	asn1_gostr3410key_attr[0].parm = &info.path;
+	asn1_gostr3410key_attr[1].parm = &gostr3410_params[0];
+	asn1_gostr3410key_attr[2].parm = &gostr3410_params[1];
+	asn1_gostr3410key_attr[3].parm = &gostr3410_params[2];
+
+	asn1_ecckey_attr[0].parm = &info.path;
+	asn1_ecckey_attr[1].parm = &info.field_length;
+
+	asn1_com_key_attr[0].parm = &info.id;
+	asn1_com_key_attr[1].parm = &info.usage;
+	asn1_com_key_attr[1].arg = &usage_len;
+	asn1_com_key_attr[2].parm = &info.native;
+	asn1_com_key_attr[3].parm = &info.access_flags;
+	asn1_com_key_attr[3].arg = &af_len;
+	asn1_com_key_attr[4].parm = &info.key_reference;
+
+	for (i=0; i<SC_MAX_SUPPORTED_ALGORITHMS && c_asn1_supported_algorithms[i].name; i++)
+		asn1_supported_algorithms[i].parm = &info.algo_refs[i];
+	asn1_com_key_attr[5].asn1 = c_asn1_supported_algorithms;
+	asn1_com_key_attr[5].bind = asn1_supported_algorithms;
+
+	asn1_com_prkey_attr[0].parm = &info.subject.value;
+	asn1_com_prkey_attr[0].arg = &info.subject.len;
+	if (sc_pkcs15_df_holds(obj->df, *buf))
+		asn1_com_prkey_attr[0].flags |= SC_ASN1_BORROW;
 
 	/* Fill in defaults */
 	memset(&info, 0, sizeof(info));
@@ -257,7 +275,7 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	info.native = 1;
 	memset(gostr3410_params, 0, sizeof(gostr3410_params));
 
-	r = sc_asn1_decode_choice(ctx, asn1_prkey, *buf, *buflen, buf, buflen);
+	r = sc_asn1_decode_template_choice(ctx, c_asn1_prkey, asn1_prkey, *buf, *buflen, buf, buflen);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "PrKey DF ASN.1 decoding failed");
@@ -39,6 +39,7 @@ extern struct sc_aid sc_hsm_aid;
 
 
 void sc_hsm_set_serialnr(sc_card_t *card, char *serial);
+int sc_hsm_read_ef(sc_card_t *card, int fid, u8 *buf, size_t count);
 
 
 
@@ -210,6 +211,7 @@ static const struct sc_asn1_entry c_asn1_req[C_ASN1_REQ_SIZE] = {
 static int read_file(sc_pkcs15_card_t * p15card, u8 fid[2],
 		u8 *efbin, size_t *len, int optional)
 {
+	sc_hsm_private_data_t *priv = (sc_hsm_private_data_t *) p15card->card->drv_data;
 	sc_path_t path;
 	int r;
 
@@ -218,17 +220,10 @@ static int read_file(sc_pkcs15_card_t * p15card, u8 fid[2],
 	path.aid = sc_hsm_aid;
 	/* we don't have a pre-known size of the file */
 	path.count = -1;
-	if (!p15card->opts.use_file_cache || !efbin
+	if (!p15card->opts.use_file_cache || !efbin || !priv->filelist_cached
 			|| SC_SUCCESS != sc_pkcs15_read_cached_file(p15card, &path, &efbin, len)) {
-		/* avoid re-selection of SC-HSM */
-		path.aid.len = 0;
-		r = sc_select_file(p15card->card, &path, NULL);
-		if (r < 0) {
-			sc_log(p15card->card->ctx, "Could not select EF");
-		} else {
-			r = sc_read_binary(p15card->card, 0, efbin, *len, 0);
-		}
-
+		/* read the EF without selecting it, saving one APDU per file */
+		r = sc_hsm_read_ef(p15card->card, (fid[0] << 8) | fid[1], efbin, *len);
 		if (r < 0) {
 			sc_log(p15card->card->ctx, "Could not read EF");
 			if (!optional) {
@@ -807,6 +802,42 @@ static int sc_pkcs15emu_sc_hsm_read_tokeninfo (sc_pkcs15_card_t * p15card)
 
 
 
+/*
+ * The cached descriptors are only valid as long as no key, certificate or data
+ * object has been added or removed since they were stored. The list of EFs
+ * returned by ENUMERATE OBJECTS reflects exactly that, so it is kept in the
+ * file cache next to the descriptors and compared on every bind.
+ */
+static void check_filelist_cache(sc_pkcs15_card_t * p15card,
+		const u8 *filelist, size_t filelistlength)
+{
+	sc_hsm_private_data_t *priv = (sc_hsm_private_data_t *) p15card->card->drv_data;
+	sc_path_t path;
+	u8 *cached = NULL;
+	size_t cachedlength = 0;
+
+	/* FID 0000 is never used for an EF on the SC-HSM */
+	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, (u8 *) "\x00\x00", 2, 0, 0);
+	path.aid = sc_hsm_aid;
+	path.count = -1;
+
+	priv->filelist_cached = 0;
+	if (SC_SUCCESS == sc_pkcs15_read_cached_file(p15card, &path, &cached, &cachedlength)) {
+		if (cachedlength == filelistlength
+				&& !memcmp(cached, filelist, filelistlength)) {
+			priv->filelist_cached = 1;
+		}
+		free(cached);
+	}
+
+	if (!priv->filelist_cached) {
+		sc_log(p15card->card->ctx, "List of EFs changed, refreshing cached descriptors");
+		sc_pkcs15_cache_file(p15card, &path, filelist, filelistlength);
+	}
+}
+
+
+
 /*
  * Initialize PKCS#15 emulation with user PIN, private keys, certificate and data objects
  *
@@ -831,6 +862,9 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* Token info and device certificate do not change with the key set */
+	priv->filelist_cached = 1;
+
 	appinfo = calloc(1, sizeof(struct sc_app_info));
 
 	if (appinfo == NULL) {
@@ -1008,6 +1042,10 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 	filelistlength = sc_list_files(card, filelist, sizeof(filelist));
 	LOG_TEST_RET(card->ctx, filelistlength, "Could not enumerate file and key identifier");
 
+	if (p15card->opts.use_file_cache) {
+		check_filelist_cache(p15card, filelist, filelistlength);
+	}
+
 	for (i = 0; i < filelistlength; i += 2) {
 		switch(filelist[i]) {
 		case KEY_PREFIX:
@@ -74,6 +74,10 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "invalid private key path");
 	}
 
+	/* the key file is still selected if its environment is still set */
+	if (sc_security_env_is_set(p15card->card, senv, 0))
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
 	r = sc_select_file(p15card->card, &path, NULL);
 	LOG_TEST_RET(ctx, r, "sc_select_file() failed");
 
@@ -95,6 +99,8 @@ static int use_key(struct sc_pkcs15_card *p15card,
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(p15card->card->ctx, r, "sc_lock() failed");
 
+	sc_pkcs15_pincache_prepare(p15card, obj);
+
 	do {
 		if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
 			r = select_key_file(p15card, prkey, senv);
@@ -341,6 +347,20 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Key type not supported");
 	}
 
+	/* GOST R 34.10 with the GOST R 34.11 hash computed by the card: the
+	 * message goes to the card as it is, whatever its length */
+	if (obj->type == SC_PKCS15_TYPE_PRKEY_GOSTR3410
+			&& (flags & SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411)
+			&& (alg_info->flags & SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411)) {
+		if (outlen < modlen)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+		senv.algorithm_flags = SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411;
+		r = use_key(p15card, obj, &senv, sc_compute_signature, in, inlen,
+				out, outlen);
+		LOG_TEST_RET(ctx, r, "use_key() failed");
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
 	/* Probably never happens, but better make sure */
 	if (inlen > sizeof(buf) || outlen < modlen)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
@@ -27,39 +27,141 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "common/libscdl.h"
 #include "internal.h"
 #include "asn1.h"
+#include "cardctl.h"
 #include "pkcs15.h"
 #include "pkcs15-syn.h"
 
+/* configure --with-pkcs15-emulators builds in only the listed emulators, for
+ * which it defines SC_EMULATOR_<name> */
+#ifdef SC_PKCS15_EMULATORS_SELECTED
+#define SC_WITH_EMULATOR(name)	SC_EMULATOR_##name
+#else
+#define SC_WITH_EMULATOR(name)	1
+#endif
+
 struct sc_pkcs15_emulator_handler builtin_emulators[] = {
+#if SC_WITH_EMULATOR(westcos)
 	{ "westcos",	sc_pkcs15emu_westcos_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(openpgp)
 	{ "openpgp",	sc_pkcs15emu_openpgp_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(infocamere)
 	{ "infocamere",	sc_pkcs15emu_infocamere_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(starcert)
 	{ "starcert",	sc_pkcs15emu_starcert_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(tcos)
 	{ "tcos",	sc_pkcs15emu_tcos_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(esteid)
 	{ "esteid",	sc_pkcs15emu_esteid_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(itacns)
 	{ "itacns",	sc_pkcs15emu_itacns_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(postecert)
 	{ "postecert",	sc_pkcs15emu_postecert_init_ex  },
+#endif
+#if SC_WITH_EMULATOR(PIV_II)
 	{ "PIV-II",     sc_pkcs15emu_piv_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(cac)
 	{ "cac",        sc_pkcs15emu_cac_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(gemsafeGPK)
 	{ "gemsafeGPK",	sc_pkcs15emu_gemsafeGPK_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(gemsafeV1)
 	{ "gemsafeV1",	sc_pkcs15emu_gemsafeV1_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(actalis)
 	{ "actalis",	sc_pkcs15emu_actalis_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(atrust_acos)
 	{ "atrust-acos",sc_pkcs15emu_atrust_acos_init_ex},
+#endif
+#if SC_WITH_EMULATOR(tccardos)
 	{ "tccardos",	sc_pkcs15emu_tccardos_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(entersafe)
 	{ "entersafe",  sc_pkcs15emu_entersafe_init_ex  },
+#endif
+#if SC_WITH_EMULATOR(pteid)
 	{ "pteid",	sc_pkcs15emu_pteid_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(oberthur)
 	{ "oberthur",   sc_pkcs15emu_oberthur_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(sc_hsm)
 	{ "sc-hsm",	sc_pkcs15emu_sc_hsm_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(dnie)
 	{ "dnie",       sc_pkcs15emu_dnie_init_ex   },
+#endif
+#if SC_WITH_EMULATOR(gids)
 	{ "gids",       sc_pkcs15emu_gids_init_ex   },
+#endif
+#if SC_WITH_EMULATOR(iasecc)
 	{ "iasecc",	sc_pkcs15emu_iasecc_init_ex   },
+#endif
+#if SC_WITH_EMULATOR(jpki)
 	{ "jpki",	sc_pkcs15emu_jpki_init_ex },
+#endif
+#if SC_WITH_EMULATOR(coolkey)
 	{ "coolkey",    sc_pkcs15emu_coolkey_init_ex	},
+#endif
+#if SC_WITH_EMULATOR(din66291)
 	{ "din66291",    sc_pkcs15emu_din_66291_init_ex	},
+#endif
+	{ NULL, NULL }
+};
+
+/*
+ * Emulators for the cards of a card driver. They are tried before all
+ * others, so that a card is not probed by the emulators of other cards
+ * first. The others are still tried if none of these matches.
+ */
+static const struct {
+	const char *driver;	/* short name of the card driver */
+	const char *emulator;
+} emulator_affinity[] = {
+	{ "westcos",	"westcos"	},
+	{ "openpgp",	"openpgp"	},
+	{ "cardos",	"infocamere"	},
+	{ "starcos",	"infocamere"	},
+	{ "starcos",	"starcert"	},
+	{ "tcos",	"tcos"		},
+	{ "mcrd",	"esteid"	},
+	{ "itacns",	"itacns"	},
+	{ "cardos",	"itacns"	},
+	{ "cardos",	"postecert"	},
+	{ "PIV-II",	"PIV-II"	},
+	{ "cac",	"cac"		},
+	{ "gpk",	"gemsafeGPK"	},
+	{ "gemsafeV1",	"gemsafeV1"	},
+	{ "cardos",	"actalis"	},
+	{ "atrust-acos","atrust-acos"	},
+	{ "cardos",	"tccardos"	},
+	{ "entersafe",	"entersafe"	},
+	{ "gemsafeV1",	"pteid"		},
+	{ "oberthur",	"oberthur"	},
+	{ "sc-hsm",	"sc-hsm"	},
+	{ "dnie",	"dnie"		},
+	{ "gids",	"gids"		},
+	{ "iasecc",	"iasecc"	},
+	{ "jpki",	"jpki"		},
+	{ "coolkey",	"coolkey"	},
 	{ NULL, NULL }
 };
 
@@ -102,63 +204,609 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
+static int emulator_is_affine(sc_card_t *card, const char *name)
+{
+	int i;
+
+	if (card->driver == NULL || card->driver->short_name == NULL)
+		return 0;
+	for (i = 0; emulator_affinity[i].driver; i++)
+		if (!strcmp(emulator_affinity[i].driver, card->driver->short_name)
+				&& !strcmp(emulator_affinity[i].emulator, name))
+			return 1;
+	return 0;
+}
+
+/* Tries the builtin emulators named in 'list', or all of them if it is
+ * NULL, those of the card driver first */
+static int try_builtin_emulators(sc_pkcs15_card_t *p15card, struct sc_aid *aid,
+		sc_pkcs15emu_opt_t *opts, const scconf_list *list, const char **used)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	const scconf_list *item;
+	const char *name;
+	int i, j, pass, r = SC_ERROR_WRONG_CARD;
+
+	for (pass = 0; pass < 2; pass++) {
+		item = list;
+		for (i = 0; ; i++) {
+			if (list != NULL) {
+				if (item == NULL)
+					break;
+				name = item->data;
+				item = item->next;
+			} else {
+				name = builtin_emulators[i].name;
+				if (name == NULL)
+					break;
+			}
+			/* first pass: the emulators of the card driver only */
+			if (emulator_is_affine(p15card->card, name) != !pass)
+				continue;
+
+			sc_log(ctx, "trying %s", name);
+			for (j = 0; builtin_emulators[j].name; j++)
+				if (!strcmp(builtin_emulators[j].name, name)) {
+					r = builtin_emulators[j].handler(p15card, aid, opts);
+					if (r == SC_SUCCESS) {
+						/* we got a hit */
+						*used = builtin_emulators[j].name;
+						return r;
+					}
+				}
+		}
+	}
+
+	return r;
+}
+
+/*
+ * Emulation cache. With file caching enabled, the objects created by a
+ * builtin emulator are stored in the cache directory and a later bind of
+ * the same card loads them instead of running the emulator. It is used
+ * only for cards whose driver returns a freshness token, a value that
+ * changes whenever the card content changes (SC_CARDCTL_GET_FRESHNESS_TOKEN).
+ * The token is stored with the objects and compared on every bind.
+ *
+ * A driver returns the token only if its emulator does nothing but create
+ * objects and fill tokenInfo. The store is skipped anyway if the emulator
+ * set operations or left data that cannot be written out. The cache file
+ * holds the structures as they are in memory, with their pointers
+ * replaced by the data they point to, so it is only valid for the build
+ * that wrote it. PIN values cached in AUTH objects are never written.
+ */
+#define EMU_CACHE_MAGIC		"EMUC0001"
+#define EMU_CACHE_MAX_BLOB	(64 * 1024)
+#define EMU_CACHE_MAX_OBJECTS	1024
+
+struct emu_cache_key {
+	int valid;
+	char fname[PATH_MAX];
+	sc_cardctl_freshness_token_t token;
+};
+
+struct emu_cache_header {
+	char magic[8];
+	size_t sizes[7];
+	size_t token_len;
+	u8 token[sizeof(((sc_cardctl_freshness_token_t *) 0)->value)];
+};
+
+union emu_cache_info {
+	struct sc_pkcs15_auth_info auth;
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_pubkey_info pubkey;
+	struct sc_pkcs15_cert_info cert;
+	struct sc_pkcs15_data_info data;
+};
+
+static void emu_cache_header_init(struct emu_cache_header *hdr, const sc_cardctl_freshness_token_t *token)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, EMU_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->sizes[0] = sizeof(struct sc_pkcs15_object);
+	hdr->sizes[1] = sizeof(struct sc_pkcs15_auth_info);
+	hdr->sizes[2] = sizeof(struct sc_pkcs15_prkey_info);
+	hdr->sizes[3] = sizeof(struct sc_pkcs15_pubkey_info);
+	hdr->sizes[4] = sizeof(struct sc_pkcs15_cert_info);
+	hdr->sizes[5] = sizeof(struct sc_pkcs15_data_info);
+	hdr->sizes[6] = sizeof(struct sc_auxiliary_data);
+	hdr->token_len = token->len;
+	memcpy(hdr->token, token->value, token->len);
+}
+
+/* Name of the cache file and current freshness token of the card */
+static int emu_cache_get_key(sc_pkcs15_card_t *p15card, const struct sc_aid *aid, struct emu_cache_key *key)
+{
+	sc_card_t *card = p15card->card;
+	sc_serial_number_t serial;
+	char dir[PATH_MAX], serial_hex[2 * SC_MAX_SERIALNR + 1], aid_hex[2 * SC_MAX_AID_SIZE + 2];
+	int r;
+
+	memset(key, 0, sizeof(*key));
+	if (!p15card->opts.use_file_cache || card->driver == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_card_ctl(card, SC_CARDCTL_GET_FRESHNESS_TOKEN, &key->token);
+	if (r != SC_SUCCESS || key->token.len == 0 || key->token.len > sizeof(key->token.value))
+		return SC_ERROR_NOT_SUPPORTED;
+	memset(&serial, 0, sizeof(serial));
+	r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serial);
+	if (r != SC_SUCCESS || serial.len == 0 || serial.len > SC_MAX_SERIALNR)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	sc_bin_to_hex(serial.value, serial.len, serial_hex, sizeof(serial_hex), 0);
+	aid_hex[0] = '\0';
+	if (aid != NULL && aid->len > 0 && aid->len <= SC_MAX_AID_SIZE) {
+		aid_hex[0] = '_';
+		sc_bin_to_hex(aid->value, aid->len, aid_hex + 1, sizeof(aid_hex) - 1, 0);
+	}
+	r = snprintf(key->fname, sizeof(key->fname), "%s/%s_%s%s.emu",
+			dir, card->driver->short_name, serial_hex, aid_hex);
+	if (r < 0 || (size_t) r >= sizeof(key->fname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	key->valid = 1;
+	return SC_SUCCESS;
+}
+
+static int emu_cache_put(FILE *f, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, f) == len ? SC_SUCCESS : SC_ERROR_FILE_NOT_FOUND;
+}
+
+/* A length, then the data. NULL is written as (size_t)-1 */
+static int emu_cache_put_blob(FILE *f, const void *data, size_t len)
+{
+	size_t n = data ? len : (size_t) -1;
+	int r;
+
+	r = emu_cache_put(f, &n, sizeof(n));
+	if (r == SC_SUCCESS && data != NULL)
+		r = emu_cache_put(f, data, len);
+	return r;
+}
+
+static int emu_cache_get(FILE *f, void *data, size_t len)
+{
+	return fread(data, 1, len, f) == len ? SC_SUCCESS : SC_ERROR_CORRUPTED_DATA;
+}
+
+static int emu_cache_get_blob(FILE *f, u8 **data, size_t *len)
+{
+	size_t n;
+	int r;
+
+	*data = NULL;
+	*len = 0;
+	r = emu_cache_get(f, &n, sizeof(n));
+	if (r != SC_SUCCESS || n == (size_t) -1)
+		return r;
+	if (n > EMU_CACHE_MAX_BLOB)
+		return SC_ERROR_CORRUPTED_DATA;
+	*data = malloc(n ? n : 1);
+	if (*data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*len = n;
+	r = emu_cache_get(f, *data, n);
+	if (r != SC_SUCCESS) {
+		free(*data);
+		*data = NULL;
+	}
+	return r;
+}
+
+static int emu_cache_get_string(FILE *f, char **str)
+{
+	u8 *data;
+	size_t len;
+	int r;
+
+	*str = NULL;
+	r = emu_cache_get_blob(f, &data, &len);
+	if (r != SC_SUCCESS || data == NULL)
+		return r;
+	if (len == 0 || data[len - 1] != '\0') {
+		free(data);
+		return SC_ERROR_CORRUPTED_DATA;
+	}
+	*str = (char *) data;
+	return SC_SUCCESS;
+}
+
+static int emu_cache_put_string(FILE *f, const char *str)
+{
+	return emu_cache_put_blob(f, str, str ? strlen(str) + 1 : 0);
+}
+
+/* Whether the state left by the emulator is made of objects and tokenInfo only */
+static int emu_cache_can_store(sc_pkcs15_card_t *p15card)
+{
+	const struct sc_pkcs15_object *obj;
+	const sc_pkcs15_tokeninfo_t *ti = p15card->tokeninfo;
+
+	if (p15card->ops.parse_df || p15card->ops.clear || p15card->ops.get_guid
+			|| p15card->dll_handle || ti->last_update.gtime || ti->preferred_language
+			|| ti->profile_indication.name || ti->seInfo || ti->supported_algos[0].reference)
+		return 0;
+	/* sc_pkcs15emu_object_add() puts the objects in the DF of their class */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (obj->emulated != NULL || obj->data == NULL || obj->df == NULL)
+			return 0;
+		switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+		case SC_PKCS15_TYPE_PRKEY:
+			if (((struct sc_pkcs15_prkey_info *) obj->data)->params.data
+					|| obj->df->type != SC_PKCS15_PRKDF)
+				return 0;
+			break;
+		case SC_PKCS15_TYPE_PUBKEY:
+			if (((struct sc_pkcs15_pubkey_info *) obj->data)->params.data
+					|| obj->df->type != SC_PKCS15_PUKDF)
+				return 0;
+			break;
+		case SC_PKCS15_TYPE_AUTH:
+			if (obj->df->type != SC_PKCS15_AODF)
+				return 0;
+			break;
+		case SC_PKCS15_TYPE_CERT:
+			if (obj->df->type != SC_PKCS15_CDF)
+				return 0;
+			break;
+		case SC_PKCS15_TYPE_DATA_OBJECT:
+			if (obj->df->type != SC_PKCS15_DODF)
+				return 0;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int emu_cache_put_object(FILE *f, const struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object o = *obj;
+	const struct sc_pkcs15_prkey_info *prkey;
+	const struct sc_pkcs15_pubkey_info *pubkey;
+	const struct sc_pkcs15_cert_info *cert;
+	const struct sc_pkcs15_data_info *data;
+	union emu_cache_info info;
+	int r;
+
+	o.data = o.emulated = NULL;
+	o.df = NULL;
+	o.next = o.prev = NULL;
+	o.content.value = NULL;
+	o.content.len = 0;
+	memset(&info, 0, sizeof(info));
+
+	r = emu_cache_put(f, &o, sizeof(o));
+	/* the content of AUTH objects is a cached PIN */
+	if (r == SC_SUCCESS)
+		r = emu_cache_put_blob(f, (obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_AUTH ?
+				NULL : obj->content.value, obj->content.len);
+	if (r != SC_SUCCESS)
+		return r;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_AUTH:
+		info.auth = *(struct sc_pkcs15_auth_info *) obj->data;
+		info.auth.logged_in = SC_PIN_STATE_UNKNOWN;
+		info.auth.info_serial = 0;
+		info.auth.cache_serial = 0;
+		info.auth.cache_time = 0;
+		return emu_cache_put(f, &info.auth, sizeof(info.auth));
+	case SC_PKCS15_TYPE_PRKEY:
+		prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
+		info.prkey = *prkey;
+		info.prkey.subject.value = NULL;
+		info.prkey.aux_data = NULL;
+		r = emu_cache_put(f, &info.prkey, sizeof(info.prkey));
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, prkey->subject.value, prkey->subject.len);
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, prkey->aux_data, sizeof(struct sc_auxiliary_data));
+		return r;
+	case SC_PKCS15_TYPE_PUBKEY:
+		pubkey = (const struct sc_pkcs15_pubkey_info *) obj->data;
+		info.pubkey = *pubkey;
+		info.pubkey.subject.value = NULL;
+		info.pubkey.direct.raw.value = NULL;
+		info.pubkey.direct.spki.value = NULL;
+		r = emu_cache_put(f, &info.pubkey, sizeof(info.pubkey));
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, pubkey->subject.value, pubkey->subject.len);
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, pubkey->direct.raw.value, pubkey->direct.raw.len);
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, pubkey->direct.spki.value, pubkey->direct.spki.len);
+		return r;
+	case SC_PKCS15_TYPE_CERT:
+		cert = (const struct sc_pkcs15_cert_info *) obj->data;
+		info.cert = *cert;
+		info.cert.value.value = NULL;
+		r = emu_cache_put(f, &info.cert, sizeof(info.cert));
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, cert->value.value, cert->value.len);
+		return r;
+	default:
+		data = (const struct sc_pkcs15_data_info *) obj->data;
+		info.data = *data;
+		info.data.data.value = NULL;
+		r = emu_cache_put(f, &info.data, sizeof(info.data));
+		if (r == SC_SUCCESS)
+			r = emu_cache_put_blob(f, data->data.value, data->data.len);
+		return r;
+	}
+}
+
+static void emu_cache_store(sc_pkcs15_card_t *p15card, const struct emu_cache_key *key, const char *emulator)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	const sc_pkcs15_tokeninfo_t *ti = p15card->tokeninfo;
+	const struct sc_pkcs15_object *obj;
+	struct emu_cache_header hdr;
+	char tmpname[PATH_MAX + 8];
+	size_t count = 0;
+	FILE *f;
+	int r;
+
+	if (!emu_cache_can_store(p15card)) {
+		sc_log(ctx, "emulator %s left state that is not cached", emulator);
+		return;
+	}
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		count++;
+	if (count > EMU_CACHE_MAX_OBJECTS)
+		return;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", key->fname);
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(ctx) < 0)
+			return;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return;
+
+	emu_cache_header_init(&hdr, &key->token);
+	r = emu_cache_put(f, &hdr, sizeof(hdr));
+	if (r == SC_SUCCESS)
+		r = emu_cache_put(f, &p15card->flags, sizeof(p15card->flags));
+	if (r == SC_SUCCESS)
+		r = emu_cache_put(f, &ti->version, sizeof(ti->version));
+	if (r == SC_SUCCESS)
+		r = emu_cache_put(f, &ti->flags, sizeof(ti->flags));
+	if (r == SC_SUCCESS)
+		r = emu_cache_put_string(f, ti->label);
+	if (r == SC_SUCCESS)
+		r = emu_cache_put_string(f, ti->manufacturer_id);
+	if (r == SC_SUCCESS)
+		r = emu_cache_put_string(f, ti->serial_number);
+	if (r == SC_SUCCESS)
+		r = emu_cache_put(f, &count, sizeof(count));
+	for (obj = p15card->obj_list; r == SC_SUCCESS && obj != NULL; obj = obj->next)
+		r = emu_cache_put_object(f, obj);
+	if (fclose(f) != 0)
+		r = SC_ERROR_FILE_NOT_FOUND;
+
+#ifdef _WIN32
+	if (r == SC_SUCCESS)
+		unlink(key->fname);
+#endif
+	if (r != SC_SUCCESS || rename(tmpname, key->fname) != 0) {
+		sc_log(ctx, "cannot write the emulation cache %s", key->fname);
+		unlink(tmpname);
+		return;
+	}
+	sc_log(ctx, "objects of emulator %s stored in %s", emulator, key->fname);
+}
+
+static void emu_cache_free_info(unsigned int type, union emu_cache_info *info)
+{
+	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		free(info->prkey.subject.value);
+		free(info->prkey.aux_data);
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		free(info->pubkey.subject.value);
+		free(info->pubkey.direct.raw.value);
+		free(info->pubkey.direct.spki.value);
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		free(info->cert.value.value);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		free(info->data.data.value);
+		break;
+	}
+}
+
+/* Reads an object and adds it to the card, which then owns the data */
+static int emu_cache_get_object(FILE *f, sc_pkcs15_card_t *p15card)
+{
+	struct sc_pkcs15_object obj;
+	union emu_cache_info info;
+	u8 *aux = NULL;
+	size_t len;
+	int r;
+
+	memset(&info, 0, sizeof(info));
+	r = emu_cache_get(f, &obj, sizeof(obj));
+	if (r == SC_SUCCESS)
+		r = emu_cache_get_blob(f, &obj.content.value, &obj.content.len);
+	if (r != SC_SUCCESS)
+		return r;
+
+	switch (obj.type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_AUTH:
+		r = emu_cache_get(f, &info.auth, sizeof(info.auth));
+		break;
+	case SC_PKCS15_TYPE_PRKEY:
+		r = emu_cache_get(f, &info.prkey, sizeof(info.prkey));
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &info.prkey.subject.value, &info.prkey.subject.len);
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &aux, &len);
+		if (r == SC_SUCCESS && aux != NULL && len != sizeof(struct sc_auxiliary_data))
+			r = SC_ERROR_CORRUPTED_DATA;
+		info.prkey.aux_data = (struct sc_auxiliary_data *) aux;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		r = emu_cache_get(f, &info.pubkey, sizeof(info.pubkey));
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &info.pubkey.subject.value, &info.pubkey.subject.len);
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &info.pubkey.direct.raw.value, &info.pubkey.direct.raw.len);
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &info.pubkey.direct.spki.value, &info.pubkey.direct.spki.len);
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		r = emu_cache_get(f, &info.cert, sizeof(info.cert));
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &info.cert.value.value, &info.cert.value.len);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		r = emu_cache_get(f, &info.data, sizeof(info.data));
+		if (r == SC_SUCCESS)
+			r = emu_cache_get_blob(f, &info.data.data.value, &info.data.data.len);
+		break;
+	default:
+		r = SC_ERROR_CORRUPTED_DATA;
+		break;
+	}
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15emu_object_add(p15card, obj.type, &obj, &info);
+	if (r != SC_SUCCESS) {
+		emu_cache_free_info(obj.type, &info);
+		free(obj.content.value);
+		return r;
+	}
+	return SC_SUCCESS;
+}
+
+static int emu_cache_load(sc_pkcs15_card_t *p15card, const struct emu_cache_key *key)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	sc_pkcs15_tokeninfo_t *ti = p15card->tokeninfo;
+	struct emu_cache_header hdr, cached;
+	char *label = NULL, *manufacturer_id = NULL, *serial_number = NULL;
+	unsigned int flags;
+	size_t count, i;
+	FILE *f;
+	int r;
+
+	f = fopen(key->fname, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	emu_cache_header_init(&hdr, &key->token);
+	r = emu_cache_get(f, &cached, sizeof(cached));
+	if (r != SC_SUCCESS || memcmp(&cached, &hdr, sizeof(hdr)) != 0) {
+		sc_log(ctx, "emulation cache %s is out of date", key->fname);
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	r = emu_cache_get(f, &flags, sizeof(flags));
+	if (r == SC_SUCCESS)
+		r = emu_cache_get(f, &ti->version, sizeof(ti->version));
+	if (r == SC_SUCCESS)
+		r = emu_cache_get(f, &ti->flags, sizeof(ti->flags));
+	if (r == SC_SUCCESS)
+		r = emu_cache_get_string(f, &label);
+	if (r == SC_SUCCESS)
+		r = emu_cache_get_string(f, &manufacturer_id);
+	if (r == SC_SUCCESS)
+		r = emu_cache_get_string(f, &serial_number);
+	if (r == SC_SUCCESS)
+		r = emu_cache_get(f, &count, sizeof(count));
+	if (r == SC_SUCCESS && count > EMU_CACHE_MAX_OBJECTS)
+		r = SC_ERROR_CORRUPTED_DATA;
+	for (i = 0; r == SC_SUCCESS && i < count; i++)
+		r = emu_cache_get_object(f, p15card);
+	fclose(f);
+
+	if (r != SC_SUCCESS) {
+		free(label);
+		free(manufacturer_id);
+		free(serial_number);
+		sc_log(ctx, "cannot load the emulation cache %s: %s", key->fname, sc_strerror(r));
+		/* start over with the emulators */
+		sc_pkcs15_card_clear(p15card);
+		unlink(key->fname);
+		return r;
+	}
+
+	p15card->flags = flags;
+	if (label) {
+		free(ti->label);
+		ti->label = label;
+	}
+	if (manufacturer_id) {
+		free(ti->manufacturer_id);
+		ti->manufacturer_id = manufacturer_id;
+	}
+	if (serial_number) {
+		free(ti->serial_number);
+		ti->serial_number = serial_number;
+	}
+	sc_log(ctx, "%"SC_FORMAT_LEN_SIZE_T"u objects loaded from the emulation cache %s", count, key->fname);
+	return SC_SUCCESS;
+}
+
 int
 sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
 {
 	sc_context_t		*ctx = p15card->card->ctx;
 	scconf_block		*conf_block, **blocks, *blk;
 	sc_pkcs15emu_opt_t	opts;
-	int			i, r = SC_ERROR_WRONG_CARD;
+	struct emu_cache_key	cache_key;
+	const char		*emulator = NULL;
+	int			i, r = SC_ERROR_WRONG_CARD, cached = 0;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 	memset(&opts, 0, sizeof(opts));
 	conf_block = NULL;
 
+
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
+	if (emu_cache_get_key(p15card, aid, &cache_key) == SC_SUCCESS
+			&& (!conf_block || scconf_get_bool(conf_block, "enable_builtin_emulation", 1))
+			&& emu_cache_load(p15card, &cache_key) == SC_SUCCESS) {
+		cached = 1;
+		r = SC_SUCCESS;
+		goto out;
+	}
+
 	if (!conf_block) {
 		/* no conf file found => try builtin drivers  */
 		sc_log(ctx, "no conf file (or section), trying all builtin emulators");
-		for (i = 0; builtin_emulators[i].name; i++) {
-			sc_log(ctx, "trying %s", builtin_emulators[i].name);
-			r = builtin_emulators[i].handler(p15card, aid, &opts);
-			if (r == SC_SUCCESS)
-				/* we got a hit */
-				goto out;
-		}
+		r = try_builtin_emulators(p15card, aid, &opts, NULL, &emulator);
 	} else {
 		/* we have a conf file => let's use it */
 		int builtin_enabled;
-		const scconf_list *list, *item;
+		const scconf_list *list;
 
 		builtin_enabled = scconf_get_bool(conf_block, "enable_builtin_emulation", 1);
 		list = scconf_find_list(conf_block, "builtin_emulators"); /* FIXME: rename to enabled_emulators */
 
 		if (builtin_enabled && list) {
 			/* get the list of enabled emulation drivers */
-			for (item = list; item; item = item->next) {
-				/* go through the list of builtin drivers */
-				const char *name = item->data;
-
-				sc_log(ctx, "trying %s", name);
-				for (i = 0; builtin_emulators[i].name; i++)
-					if (!strcmp(builtin_emulators[i].name, name)) {
-						r = builtin_emulators[i].handler(p15card, aid, &opts);
-						if (r == SC_SUCCESS)
-							/* we got a hit */
-							goto out;
-					}
-			}
+			r = try_builtin_emulators(p15card, aid, &opts, list, &emulator);
+			if (r == SC_SUCCESS)
+				goto out;
 		}
 		else if (builtin_enabled) {
 			sc_log(ctx, "no emulator list in config file, trying all builtin emulators");
-			for (i = 0; builtin_emulators[i].name; i++) {
-				sc_log(ctx, "trying %s", builtin_emulators[i].name);
-				r = builtin_emulators[i].handler(p15card, aid, &opts);
-				if (r == SC_SUCCESS)
-					/* we got a hit */
-					goto out;
-			}
+			r = try_builtin_emulators(p15card, aid, &opts, NULL, &emulator);
+			if (r == SC_SUCCESS)
+				goto out;
 		}
 
 		/* search for 'emulate foo { ... }' entries in the conf file */
@@ -182,6 +830,8 @@ out:
 	if (r == SC_SUCCESS) {
 		p15card->magic  = SC_PKCS15_CARD_MAGIC;
 		p15card->flags |= SC_PKCS15_CARD_FLAG_EMULATED;
+		if (!cached && emulator != NULL && cache_key.valid)
+			emu_cache_store(p15card, &cache_key, emulator);
 	} else {
 		if (r != SC_ERROR_WRONG_CARD)
 			sc_log(ctx, "Failed to load card emulator: %s", sc_strerror(r));
@@ -397,10 +1047,11 @@ int sc_pkcs15emu_object_add(sc_pkcs15_card_t *p15card, unsigned int type,
 	unsigned int	df_type;
 	size_t		data_len;
 
-	obj = calloc(1, sizeof(*obj));
+	obj = sc_pkcs15_new_object(p15card);
 	if (!obj)
 		return SC_ERROR_OUT_OF_MEMORY;
 	memcpy(obj, in_obj, sizeof(*obj));
+	obj->in_arena = 1;
 	obj->type  = type;
 
 	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
@@ -426,15 +1077,12 @@ int sc_pkcs15emu_object_add(sc_pkcs15_card_t *p15card, unsigned int type,
 		break;
 	default:
 		sc_log(p15card->card->ctx, "Unknown PKCS15 object type %d", type);
-		free(obj);
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 
 	obj->data = calloc(1, data_len);
-	if (obj->data == NULL) {
-		free(obj);
+	if (obj->data == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
-	}
 	memcpy(obj->data, data, data_len);
 
 	obj->df = sc_pkcs15emu_get_df(p15card, df_type);
@@ -38,6 +38,99 @@ int sc_pkcs15emu_tcos_init_ex(
 	struct sc_aid *,
 	sc_pkcs15emu_opt_t *opts);
 
+/* The records of the EF_KEYD and EF_PWDD files, which describe the keys
+ * and PINs of a TCOS 3 DF: each file is read once per bind, however many
+ * keys or PINs are looked up in it */
+#define TCOS_MAX_RECORDS	32
+
+struct tcos_record_file {
+	struct tcos_record_file *next;
+	sc_path_t path;
+	int count;
+	u8 *record[TCOS_MAX_RECORDS];
+	size_t len[TCOS_MAX_RECORDS];
+};
+
+struct tcos_records {
+	struct tcos_record_file *files;
+};
+
+static void free_records(struct tcos_records *recs)
+{
+	struct tcos_record_file *file;
+	int i;
+
+	while ((file = recs->files) != NULL) {
+		recs->files = file->next;
+		for (i = 0; i < file->count; i++)
+			free(file->record[i]);
+		free(file);
+	}
+}
+
+static struct tcos_record_file *read_records(
+	sc_card_t         *card,
+	struct tcos_records *recs,
+	const sc_path_t   *path
+){
+	struct tcos_record_file *file;
+	unsigned char buf[256];
+	int r;
+
+	for (file = recs->files; file != NULL; file = file->next)
+		if (sc_compare_path(&file->path, path))
+			return file;
+
+	if (sc_select_file(card, path, NULL) != SC_SUCCESS) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Select(%s) failed\n", sc_print_path(path));
+		return NULL;
+	}
+	file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return NULL;
+	file->path = *path;
+	while (file->count < TCOS_MAX_RECORDS
+			&& (r = sc_read_record(card, file->count + 1, buf, sizeof(buf), SC_RECORD_BY_REC_NR)) > 0) {
+		file->record[file->count] = malloc(r);
+		if (file->record[file->count] == NULL)
+			break;
+		memcpy(file->record[file->count], buf, r);
+		file->len[file->count++] = r;
+	}
+	file->next = recs->files;
+	recs->files = file;
+	return file;
+}
+
+/* Looks for the record with the reference 'ref' in an EF_KEYD or EF_PWDD;
+ * returns its length, 0 if there is none */
+static int find_record(
+	sc_card_t         *card,
+	struct tcos_records *recs,
+	const sc_path_t   *path,
+	unsigned char      ref,
+	unsigned char     *buf
+){
+	struct tcos_record_file *file = read_records(card, recs, path);
+	int i, n;
+
+	if (file == NULL)
+		return -1;
+	for (n = 0; n < file->count; n++) {
+		const u8 *rec = file->record[n];
+		size_t len = file->len[n];
+
+		if (len < 2 || rec[0] != 0xA0) continue;
+		for (i = 2; i < rec[1] + 2 && (size_t)i + 2 < len; i += 2 + rec[i+1]) {
+			if (rec[i] == 0x83 && rec[i+1] == 1 && rec[i+2] == ref) {
+				memcpy(buf, rec, len);
+				return (int)len;
+			}
+		}
+	}
+	return 0;
+}
+
 static int insert_cert(
 	sc_pkcs15_card_t *p15card,
 	const char       *path,
@@ -98,6 +191,7 @@ static int insert_cert(
 
 static int insert_key(
 	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs,
 	const char       *path,
 	unsigned char     id,
 	unsigned char     key_reference,
@@ -129,26 +223,14 @@ static int insert_key(
 	can_sign=can_crypt=0;
 	if(card->type==SC_CARD_TYPE_TCOS_V3){
 		unsigned char buf[256];
-		int i, rec_no=0;
+		int i;
 		if(prkey_info.path.len>=2) prkey_info.path.len-=2;
 		sc_append_file_id(&prkey_info.path, 0x5349);
-		if(sc_select_file(card, &prkey_info.path, NULL)!=SC_SUCCESS){
-			sc_debug(ctx, SC_LOG_DEBUG_NORMAL,
-				"Select(%s) failed\n",
-				sc_print_path(&prkey_info.path));
-			return 1;
-		}
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL,
 			"Searching for Key-Ref %02X\n", key_reference);
-		while((r=sc_read_record(card, ++rec_no, buf, sizeof(buf), SC_RECORD_BY_REC_NR))>0){
-			int found=0;
-			if(buf[0]!=0xA0) continue;
-			for(i=2;i<buf[1]+2;i+=2+buf[i+1]){
-				if(buf[i]==0x83 && buf[i+1]==1 && buf[i+2]==key_reference) ++found;
-			}
-			if(found) break;
-		}
-		if(r<=0){
+		r=find_record(card, recs, &prkey_info.path, key_reference, buf);
+		if(r<0) return 1;
+		if(r==0){
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL,"No EF_KEYD-Record found\n");
 			return 1;
 		}
@@ -183,6 +265,7 @@ static int insert_key(
 
 static int insert_pin(
 	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs,
 	const char       *path,
 	unsigned char     id,
 	unsigned char     auth_id,
@@ -220,31 +303,21 @@ static int insert_pin(
 
 	if(card->type==SC_CARD_TYPE_TCOS_V3){
 		unsigned char buf[256];
-		int i, rec_no=0;
+		int i, fbz=-1;
 		if(pin_info.path.len>=2) pin_info.path.len-=2;
 		sc_append_file_id(&pin_info.path, 0x5049);
-		if(sc_select_file(card, &pin_info.path, NULL)!=SC_SUCCESS){
-			sc_debug(ctx, SC_LOG_DEBUG_NORMAL,
-				"Select(%s) failed\n",
-				sc_print_path(&pin_info.path));
-			return 1;
-		}
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL,
 			"Searching for PIN-Ref %02X\n", pin_reference);
-		while((r=sc_read_record(card, ++rec_no, buf, sizeof(buf), SC_RECORD_BY_REC_NR))>0){
-			int found=0, fbz=-1;
-			if(buf[0]!=0xA0) continue;
-			for(i=2;i<buf[1]+2;i+=2+buf[i+1]){
-				if(buf[i]==0x83 && buf[i+1]==1 && buf[i+2]==pin_reference) ++found;
-				if(buf[i]==0x90) fbz=buf[i+1+buf[i+1]];
-			}
-			if(found) pin_info.tries_left=fbz;
-			if(found) break;
-		}
-		if(r<=0){
+		r=find_record(card, recs, &pin_info.path, pin_reference, buf);
+		if(r<0) return 1;
+		if(r==0){
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL,"No EF_PWDD-Record found\n");
 			return 1;
 		}
+		for(i=2;i<buf[1]+2 && i+1<r;i+=2+buf[i+1]){
+			if(buf[i]==0x90) fbz=buf[i+1+buf[i+1]];
+		}
+		pin_info.tries_left=fbz;
 	} else {
 		if(sc_select_file(card, &pin_info.path, &f)!=SC_SUCCESS
 			   	|| !f->prop_attr || f->prop_attr_len < 4){
@@ -273,7 +346,8 @@ static char *dirpath(char *dir, const char *path){
 }
 
 static int detect_netkey(
-	sc_pkcs15_card_t *p15card
+	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs
 ){
 	sc_card_t *card=p15card->card;
 	sc_path_t p;
@@ -306,30 +380,30 @@ static int detect_netkey(
 	insert_cert(p15card, dirpath(dir,c_auth), 0x47, 0, "Telesec Authentifizierungs Zertifikat");
 	insert_cert(p15card, dirpath(dir,"C201"), 0x48, 0, "Telesec 1024bit Zertifikat");
 
-	insert_key(p15card, dirpath(dir,"5331"), 0x45, 0x80, keylen, 4, "Signatur Schluessel");
-	insert_key(p15card, dirpath(dir,"53B1"), 0x46, 0x81, keylen, 3, "Verschluesselungs Schluessel");
-	insert_key(p15card, dirpath(dir,"5371"), 0x47, 0x82, keylen, 3, "Authentifizierungs Schluessel");
-	insert_key(p15card, dirpath(dir,"0000"), 0x48, 0x83, 1024,   3, "1024bit Schluessel");
+	insert_key(p15card, recs, dirpath(dir,"5331"), 0x45, 0x80, keylen, 4, "Signatur Schluessel");
+	insert_key(p15card, recs, dirpath(dir,"53B1"), 0x46, 0x81, keylen, 3, "Verschluesselungs Schluessel");
+	insert_key(p15card, recs, dirpath(dir,"5371"), 0x47, 0x82, keylen, 3, "Authentifizierungs Schluessel");
+	insert_key(p15card, recs, dirpath(dir,"0000"), 0x48, 0x83, 1024,   3, "1024bit Schluessel");
 
-	insert_pin(p15card, "5000", 1, 2, 0x00, 6, "PIN",
+	insert_pin(p15card, recs, "5000", 1, 2, 0x00, 6, "PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
-	insert_pin(p15card, "5001", 2, 0, 0x01, 8, "PUK",
+	insert_pin(p15card, recs, "5001", 2, 0, 0x01, 8, "PUK",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED |
 		SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN | SC_PKCS15_PIN_FLAG_SO_PIN
 	);
 	if(card->type==SC_CARD_TYPE_TCOS_V3){
-		insert_pin(p15card, dirpath(dir,"0000"), 3, 1, 0x83, 6, "NetKey PIN2",
+		insert_pin(p15card, recs, dirpath(dir,"0000"), 3, 1, 0x83, 6, "NetKey PIN2",
 			SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 			SC_PKCS15_PIN_FLAG_INITIALIZED
 		);
 	} else {
-		insert_pin(p15card, dirpath(dir,"5080"), 3, 1, 0x80, 6, "NetKey PIN0",
+		insert_pin(p15card, recs, dirpath(dir,"5080"), 3, 1, 0x80, 6, "NetKey PIN0",
 			SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 			SC_PKCS15_PIN_FLAG_INITIALIZED
 		);
 	}
-	insert_pin(p15card, dirpath(dir,"5081"), 4, 1, 0x81, 6, "NetKey PIN1",
+	insert_pin(p15card, recs, dirpath(dir,"5081"), 4, 1, 0x81, 6, "NetKey PIN1",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 		SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
@@ -346,17 +420,17 @@ static int detect_netkey(
 		insert_cert(p15card, dirpath(dir,"4332"), 0x49, 1, "SigG Zertifikat 3");
 		
 		if(card->type==SC_CARD_TYPE_TCOS_V3){
-			insert_key(p15card, dirpath(dir,"0000"), 0x49, 0x84, 2048, 5, "SigG Schluessel");
+			insert_key(p15card, recs, dirpath(dir,"0000"), 0x49, 0x84, 2048, 5, "SigG Schluessel");
 		} else {
-			insert_key(p15card, dirpath(dir,"5331"), 0x49, 0x80, 1024, 5, "SigG Schluessel");
+			insert_key(p15card, recs, dirpath(dir,"5331"), 0x49, 0x80, 1024, 5, "SigG Schluessel");
 		}
 
-		insert_pin(p15card, dirpath(dir,"5081"), 5, 0, 0x81, 6, "SigG PIN",
+		insert_pin(p15card, recs, dirpath(dir,"5081"), 5, 0, 0x81, 6, "SigG PIN",
 			SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 			SC_PKCS15_PIN_FLAG_INITIALIZED
 		);
 		if(card->type==SC_CARD_TYPE_TCOS_V3){
-			insert_pin(p15card, dirpath(dir,"0000"), 6, 0, 0x83, 8, "SigG PIN2",
+			insert_pin(p15card, recs, dirpath(dir,"0000"), 6, 0, 0x83, 8, "SigG PIN2",
 				SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 				SC_PKCS15_PIN_FLAG_INITIALIZED
 			);
@@ -367,7 +441,8 @@ static int detect_netkey(
 }
 
 static int detect_idkey(
-	sc_pkcs15_card_t *p15card
+	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs
 ){
 	sc_card_t *card=p15card->card;
 	sc_path_t p;
@@ -385,17 +460,17 @@ static int detect_idkey(
 	insert_cert(p15card, "DF074332", 0x45, 1, "Signatur Zertifikat 2");
 	insert_cert(p15card, "DF074333", 0x45, 1, "Signatur Zertifikat 3");
 
-	insert_key(p15card, "DF074E03", 0x45, 0x84, 2048, 1, "IDKey1");
-	insert_key(p15card, "DF074E04", 0x46, 0x85, 2048, 1, "IDKey2");
-	insert_key(p15card, "DF074E05", 0x47, 0x86, 2048, 1, "IDKey3");
-	insert_key(p15card, "DF074E06", 0x48, 0x87, 2048, 1, "IDKey4");
-	insert_key(p15card, "DF074E07", 0x49, 0x88, 2048, 1, "IDKey5");
-	insert_key(p15card, "DF074E08", 0x4A, 0x89, 2048, 1, "IDKey6");
+	insert_key(p15card, recs, "DF074E03", 0x45, 0x84, 2048, 1, "IDKey1");
+	insert_key(p15card, recs, "DF074E04", 0x46, 0x85, 2048, 1, "IDKey2");
+	insert_key(p15card, recs, "DF074E05", 0x47, 0x86, 2048, 1, "IDKey3");
+	insert_key(p15card, recs, "DF074E06", 0x48, 0x87, 2048, 1, "IDKey4");
+	insert_key(p15card, recs, "DF074E07", 0x49, 0x88, 2048, 1, "IDKey5");
+	insert_key(p15card, recs, "DF074E08", 0x4A, 0x89, 2048, 1, "IDKey6");
 
-	insert_pin(p15card, "5000", 1, 2, 0x00, 6, "PIN",
+	insert_pin(p15card, recs, "5000", 1, 2, 0x00, 6, "PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
-	insert_pin(p15card, "5001", 2, 0, 0x01, 8, "PUK",
+	insert_pin(p15card, recs, "5001", 2, 0, 0x01, 8, "PUK",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED |
 		SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN | SC_PKCS15_PIN_FLAG_SO_PIN
 	);
@@ -404,7 +479,8 @@ static int detect_idkey(
 }
 
 static int detect_signtrust(
-	sc_pkcs15_card_t *p15card
+	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs
 ){
 	if(insert_cert(p15card,"8000DF01C000", 0x45, 1, "Signatur Zertifikat")) return 1;
 	p15card->tokeninfo->manufacturer_id = strdup("Deutsche Post");
@@ -413,19 +489,19 @@ static int detect_signtrust(
 	insert_cert(p15card,"800082008220", 0x46, 1, "Verschluesselungs Zertifikat");
 	insert_cert(p15card,"800083008320", 0x47, 1, "Authentifizierungs Zertifikat");
 
-	insert_key(p15card,"8000DF015331", 0x45, 0x80, 1024, 1, "Signatur Schluessel");
-	insert_key(p15card,"800082008210", 0x46, 0x80, 1024, 2, "Verschluesselungs Schluessel");
-	insert_key(p15card,"800083008310", 0x47, 0x80, 1024, 3, "Authentifizierungs Schluessel");
+	insert_key(p15card, recs, "8000DF015331", 0x45, 0x80, 1024, 1, "Signatur Schluessel");
+	insert_key(p15card, recs, "800082008210", 0x46, 0x80, 1024, 2, "Verschluesselungs Schluessel");
+	insert_key(p15card, recs, "800083008310", 0x47, 0x80, 1024, 3, "Authentifizierungs Schluessel");
 
-	insert_pin(p15card,"8000DF010000", 1, 0, 0x81, 6, "Signatur PIN",
+	insert_pin(p15card, recs, "8000DF010000", 1, 0, 0x81, 6, "Signatur PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 		SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
-	insert_pin(p15card,"800082000040", 2, 0, 0x81, 6, "Verschluesselungs PIN",
+	insert_pin(p15card, recs, "800082000040", 2, 0, 0x81, 6, "Verschluesselungs PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 		SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
-	insert_pin(p15card,"800083000040", 3, 0, 0x81, 6, "Authentifizierungs PIN",
+	insert_pin(p15card, recs, "800083000040", 3, 0, 0x81, 6, "Authentifizierungs PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_LOCAL |
 		SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
@@ -434,7 +510,8 @@ static int detect_signtrust(
 }
 
 static int detect_datev(
-	sc_pkcs15_card_t *p15card
+	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs
 ){
 	if(insert_cert(p15card,"3000C500", 0x45, 0, "Signatur Zertifikat")) return 1;
 	p15card->tokeninfo->manufacturer_id = strdup("DATEV");
@@ -443,11 +520,11 @@ static int detect_datev(
 	insert_cert(p15card,"DF02C200", 0x46, 0, "Verschluesselungs Zertifikat");
 	insert_cert(p15card,"DF02C500", 0x47, 0, "Authentifizierungs Zertifikat");
 
-	insert_key(p15card,"30005371", 0x45, 0x82, 1024, 1, "Signatur Schluessel");
-	insert_key(p15card,"DF0253B1", 0x46, 0x81, 1024, 1, "Verschluesselungs Schluessel");
-	insert_key(p15card,"DF025371", 0x47, 0x82, 1024, 1, "Authentifizierungs Schluessel");
+	insert_key(p15card, recs, "30005371", 0x45, 0x82, 1024, 1, "Signatur Schluessel");
+	insert_key(p15card, recs, "DF0253B1", 0x46, 0x81, 1024, 1, "Verschluesselungs Schluessel");
+	insert_key(p15card, recs, "DF025371", 0x47, 0x82, 1024, 1, "Authentifizierungs Schluessel");
 
-	insert_pin(p15card,"5001", 1, 0, 0x01, 6, "PIN",
+	insert_pin(p15card, recs, "5001", 1, 0, 0x01, 6, "PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
 
@@ -455,7 +532,8 @@ static int detect_datev(
 }
 
 static int detect_unicard(
-	sc_pkcs15_card_t *p15card
+	sc_pkcs15_card_t *p15card,
+	struct tcos_records *recs
 ){
 	if(!insert_cert(p15card,"41004352", 0x45, 1, "Zertifikat 1")){
 		p15card->tokeninfo->manufacturer_id = strdup("JLU Giessen");
@@ -463,9 +541,9 @@ static int detect_unicard(
 
 		insert_cert(p15card,"41004353", 0x46, 1, "Zertifikat 2");
 		insert_cert(p15card,"41004354", 0x47, 1, "Zertifikat 3");
-		insert_key(p15card,"41005103", 0x45, 0x83, 1024, 1, "Schluessel 1");
-		insert_key(p15card,"41005104", 0x46, 0x84, 1024, 1, "Schluessel 2");
-		insert_key(p15card,"41005105", 0x47, 0x85, 1024, 1, "Schluessel 3");
+		insert_key(p15card, recs, "41005103", 0x45, 0x83, 1024, 1, "Schluessel 1");
+		insert_key(p15card, recs, "41005104", 0x46, 0x84, 1024, 1, "Schluessel 2");
+		insert_key(p15card, recs, "41005105", 0x47, 0x85, 1024, 1, "Schluessel 3");
 
 	} else if(!insert_cert(p15card,"41014352", 0x45, 1, "Zertifikat 1")){
 		p15card->tokeninfo->manufacturer_id = strdup("TU Darmstadt");
@@ -473,16 +551,16 @@ static int detect_unicard(
 
 		insert_cert(p15card,"41014353", 0x46, 1, "Zertifikat 2");
 		insert_cert(p15card,"41014354", 0x47, 1, "Zertifikat 3");
-		insert_key(p15card,"41015103", 0x45, 0x83, 1024, 1, "Schluessel 1");
-		insert_key(p15card,"41015104", 0x46, 0x84, 1024, 1, "Schluessel 2");
-		insert_key(p15card,"41015105", 0x47, 0x85, 1024, 1, "Schluessel 3");
+		insert_key(p15card, recs, "41015103", 0x45, 0x83, 1024, 1, "Schluessel 1");
+		insert_key(p15card, recs, "41015104", 0x46, 0x84, 1024, 1, "Schluessel 2");
+		insert_key(p15card, recs, "41015105", 0x47, 0x85, 1024, 1, "Schluessel 3");
 
 	} else return 1;
 
-	insert_pin(p15card,"5000", 1, 2, 0x00, 6, "PIN",
+	insert_pin(p15card, recs, "5000", 1, 2, 0x00, 6, "PIN",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED
 	);
-	insert_pin(p15card,"5008", 2, 0, 0x01, 8, "PUK",
+	insert_pin(p15card, recs, "5008", 2, 0, 0x01, 8, "PUK",
 		SC_PKCS15_PIN_FLAG_CASE_SENSITIVE | SC_PKCS15_PIN_FLAG_INITIALIZED |
 		SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN | SC_PKCS15_PIN_FLAG_SO_PIN
 	);
@@ -498,6 +576,7 @@ int sc_pkcs15emu_tcos_init_ex(
 	sc_card_t         *card = p15card->card;
 	sc_context_t      *ctx = p15card->card->ctx;
 	sc_serial_number_t serialnr;
+	struct tcos_records recs;
 	char               serial[30];
 	int i, r;
 
@@ -515,11 +594,14 @@ int sc_pkcs15emu_tcos_init_ex(
 	serial[19] = '\0';
         p15card->tokeninfo->serial_number = strdup(serial);
 
-	if(!detect_netkey(p15card)) return SC_SUCCESS;
-	if(!detect_idkey(p15card)) return SC_SUCCESS;
-	if(!detect_unicard(p15card)) return SC_SUCCESS;
-	if(!detect_signtrust(p15card)) return SC_SUCCESS;
-	if(!detect_datev(p15card)) return SC_SUCCESS;
+	memset(&recs, 0, sizeof(recs));
+	if(detect_netkey(p15card, &recs) && detect_idkey(p15card, &recs)
+			&& detect_unicard(p15card, &recs) && detect_signtrust(p15card, &recs)
+			&& detect_datev(p15card, &recs))
+		r = SC_ERROR_INTERNAL;
+	else
+		r = SC_SUCCESS;
+	free_records(&recs);
 
-	return SC_ERROR_INTERNAL;
+	return r;
 }
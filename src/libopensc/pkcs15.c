@@ -120,6 +120,9 @@ static const struct sc_asn1_entry c_asn1_tokeninfo[] = {
 static void sc_pkcs15_free_unusedspace(struct sc_pkcs15_card *);
 static void sc_pkcs15_remove_dfs(struct sc_pkcs15_card *);
 static void sc_pkcs15_remove_objects(struct sc_pkcs15_card *);
+static void sc_pkcs15_free_arena(struct sc_pkcs15_card *);
+static int sc_pkcs15_index_find(struct sc_pkcs15_card *, unsigned int,
+		const struct sc_pkcs15_id *, struct sc_pkcs15_object **);
 static int sc_pkcs15_aux_get_md_guid(struct sc_pkcs15_card *, const struct sc_pkcs15_object *,
 		unsigned, unsigned char *, size_t *);
 
@@ -769,8 +772,12 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_close_objects_cache(p15card);
+	sc_pkcs15_free_arena(p15card);
 	sc_pkcs15_free_unusedspace(p15card);
 	p15card->unusedspace_read = 0;
+	sc_pkcs15_close_cache_store(p15card);
+	free(p15card->change_counter);
 
 	sc_file_free(p15card->file_app);
 	sc_file_free(p15card->file_tokeninfo);
@@ -799,6 +806,8 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_close_objects_cache(p15card);
+	sc_pkcs15_free_arena(p15card);
 
 	p15card->df_list = NULL;
 	sc_file_free(p15card->file_app);
@@ -825,6 +834,8 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 		free(p15card->tokeninfo->last_update.gtime);
 		p15card->tokeninfo->last_update.gtime = NULL;
 	}
+	free(p15card->change_counter);
+	p15card->change_counter = NULL;
 	if (p15card->tokeninfo->preferred_language != NULL) {
 		free(p15card->tokeninfo->preferred_language);
 		p15card->tokeninfo->preferred_language = NULL;
@@ -1196,23 +1207,42 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
 	p15card->card = card;
-	p15card->opts.use_file_cache = 0;
+	/* over the air every file read from the card costs several round
+	 * trips, the cache is worth its disk space there */
+	p15card->opts.use_file_cache = card->reader
+		&& (card->reader->capabilities & SC_READER_CAP_CONTACTLESS) ? 1 : 0;
+	p15card->opts.use_file_cache_store = 0;
+	p15card->opts.cache_objects_on_bind = 1;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
+	p15card->opts.pin_cache_timeout = 0;
+	p15card->opts.pin_cache_proactive = 1;
+	p15card->opts.use_pin_info_cache = 1;
+	p15card->opts.pin_info_cache_timeout = 10;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.use_file_cache_store = scconf_get_bool(conf_block, "use_file_cache_store", p15card->opts.use_file_cache_store);
+		p15card->opts.cache_objects_on_bind = scconf_get_bool(conf_block, "cache_objects_on_bind", p15card->opts.cache_objects_on_bind);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
-	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
-			p15card->opts.use_file_cache, p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
-			p15card->opts.pin_cache_ignore_user_consent);
+		p15card->opts.pin_cache_timeout = scconf_get_int(conf_block, "pin_cache_timeout", p15card->opts.pin_cache_timeout);
+		p15card->opts.pin_cache_proactive = scconf_get_bool(conf_block, "pin_cache_proactive", p15card->opts.pin_cache_proactive);
+		p15card->opts.use_pin_info_cache = scconf_get_bool(conf_block, "use_pin_info_caching", p15card->opts.use_pin_info_cache);
+		p15card->opts.pin_info_cache_timeout = scconf_get_int(conf_block, "pin_info_cache_timeout", p15card->opts.pin_info_cache_timeout);
+	}
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_file_cache_store=%d cache_objects_on_bind=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d pin_cache_timeout=%d pin_cache_proactive=%d use_pin_info_cache=%d pin_info_cache_timeout=%d",
+			p15card->opts.use_file_cache, p15card->opts.use_file_cache_store,
+			p15card->opts.cache_objects_on_bind,
+			p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter,
+			p15card->opts.pin_cache_ignore_user_consent, p15card->opts.pin_cache_timeout,
+			p15card->opts.pin_cache_proactive, p15card->opts.use_pin_info_cache,
+			p15card->opts.pin_info_cache_timeout);
 
 	r = sc_lock(card);
 	if (r) {
@@ -1247,6 +1277,18 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 			goto error;
 	}
 done:
+	if (p15card->opts.use_file_cache
+			&& sc_pkcs15_read_cached_objects(p15card) == SC_ERROR_FILE_NOT_FOUND
+			&& p15card->opts.cache_objects_on_bind) {
+		struct sc_pkcs15_df *df;
+
+		/* The processes that bind the card next wait for our card lock:
+		 * parse every DF now, so that they find all of them in the
+		 * objects cache instead of reading them from the card too */
+		for (df = p15card->df_list; df != NULL; df = df->next)
+			if (!df->enumerated)
+				sc_pkcs15_parse_df(p15card, df);
+	}
 	*p15card_out = p15card;
 	sc_unlock(card);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -1273,20 +1315,14 @@ sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 }
 
 
+/* Make sure all the DFs holding objects of the given classes have been enumerated */
 static int
-__sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
-			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
-			sc_pkcs15_object_t **ret, size_t ret_size)
+sc_pkcs15_enum_dfs(struct sc_pkcs15_card *p15card, unsigned int class_mask)
 {
-	struct sc_pkcs15_object *obj = NULL;
 	struct sc_pkcs15_df	*df = NULL;
 	unsigned int	df_mask = 0;
-	size_t		match_count = 0;
 	int r;
 
-	if (type)
-		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
-
 	/* Make sure the class mask we have makes sense */
 	if (class_mask == 0
 	 || (class_mask & ~(SC_PKCS15_SEARCH_CLASS_PRKEY |
@@ -1311,8 +1347,6 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 	if (class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
 		df_mask |= (1 << SC_PKCS15_SKDF);
 
-	/* Make sure all the DFs we want to search have been
-	 * enumerated. */
 	for (df = p15card->df_list; df != NULL; df = df->next) {
 		if (!(df_mask & (1 << df->type)))   {
 			continue;
@@ -1328,6 +1362,25 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 			continue;
 	}
 
+	return SC_SUCCESS;
+}
+
+
+static int
+__sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
+			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
+			sc_pkcs15_object_t **ret, size_t ret_size)
+{
+	struct sc_pkcs15_object *obj = NULL;
+	size_t		match_count = 0;
+	int r;
+
+	if (type)
+		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
+
+	r = sc_pkcs15_enum_dfs(p15card, class_mask);
+	LOG_TEST_RET(p15card->card->ctx, r, "Cannot enumerate DFs");
+
 	/* And now loop over all objects */
 	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
 		/* Check object type */
@@ -1362,26 +1415,39 @@ sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
 }
 
 
-static int
-compare_obj_id(struct sc_pkcs15_object *obj, const struct sc_pkcs15_id *id)
+static const struct sc_pkcs15_id *
+get_obj_id(const struct sc_pkcs15_object *obj)
 {
 	void *data = obj->data;
 
+	if (data == NULL)
+		return NULL;
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_CERT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_cert_info *) data)->id, id);
+		return &((struct sc_pkcs15_cert_info *) data)->id;
 	case SC_PKCS15_TYPE_PRKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_prkey_info *) data)->id, id);
+		return &((struct sc_pkcs15_prkey_info *) data)->id;
 	case SC_PKCS15_TYPE_PUBKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_pubkey_info *) data)->id, id);
+		return &((struct sc_pkcs15_pubkey_info *) data)->id;
 	case SC_PKCS15_TYPE_SKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_skey_info *) data)->id, id);
+		return &((struct sc_pkcs15_skey_info *) data)->id;
 	case SC_PKCS15_TYPE_AUTH:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_auth_info *) data)->auth_id, id);
+		return &((struct sc_pkcs15_auth_info *) data)->auth_id;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_data_info *) data)->id, id);
+		return &((struct sc_pkcs15_data_info *) data)->id;
 	}
-	return 0;
+	return NULL;
+}
+
+
+static int
+compare_obj_id(struct sc_pkcs15_object *obj, const struct sc_pkcs15_id *id)
+{
+	const struct sc_pkcs15_id *obj_id = get_obj_id(obj);
+
+	if (obj_id == NULL)
+		return 0;
+	return sc_pkcs15_compare_id(obj_id, id);
 }
 
 
@@ -1565,6 +1631,10 @@ int sc_pkcs15_find_object_by_id(struct sc_pkcs15_card *p15card,
 	struct sc_pkcs15_search_key sk;
 	int	r;
 
+	r = sc_pkcs15_index_find(p15card, type, id, out);
+	if (r != SC_ERROR_NOT_SUPPORTED)
+		return r;
+
 	memset(&sk, 0, sizeof(sk));
 	sk.id = id;
 
@@ -1802,6 +1872,170 @@ sc_pkcs15_find_prkey_by_reference(struct sc_pkcs15_card *p15card, const struct s
 }
 
 
+/*
+ * Index of obj_list by object class and ID (auth ID for the AUTH objects),
+ * so that relating keys, certificates and PINs does not walk the list for
+ * every object. Each bucket keeps the objects in list order, the first
+ * match is the same one a search over obj_list would return.
+ */
+#define SC_PKCS15_INDEX_BUCKETS		64
+
+struct sc_pkcs15_index_entry {
+	struct sc_pkcs15_object *obj;
+	unsigned int class;
+	struct sc_pkcs15_id id;		/* as indexed, to detect changed IDs */
+	struct sc_pkcs15_index_entry *next;
+};
+
+struct sc_pkcs15_object_index {
+	struct sc_pkcs15_index_entry *buckets[SC_PKCS15_INDEX_BUCKETS];
+};
+
+
+static unsigned int
+sc_pkcs15_index_hash(unsigned int class, const struct sc_pkcs15_id *id)
+{
+	unsigned int h = class;
+	size_t ii;
+
+	for (ii = 0; ii < id->len && ii < sizeof(id->value); ii++)
+		h = h * 31 + id->value[ii];
+	return h % SC_PKCS15_INDEX_BUCKETS;
+}
+
+
+static void
+sc_pkcs15_index_free(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object_index *index = p15card->obj_index;
+	struct sc_pkcs15_index_entry *entry, *next;
+	size_t ii;
+
+	if (index == NULL)
+		return;
+	for (ii = 0; ii < SC_PKCS15_INDEX_BUCKETS; ii++)
+		for (entry = index->buckets[ii]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+	free(index);
+	p15card->obj_index = NULL;
+}
+
+
+static int
+sc_pkcs15_index_add(struct sc_pkcs15_object_index *index, struct sc_pkcs15_object *obj)
+{
+	const struct sc_pkcs15_id *id = get_obj_id(obj);
+	struct sc_pkcs15_index_entry *entry, **pp;
+
+	if (id == NULL)
+		return SC_SUCCESS;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	entry->obj = obj;
+	entry->class = obj->type & SC_PKCS15_TYPE_CLASS_MASK;
+	entry->id = *id;
+
+	pp = &index->buckets[sc_pkcs15_index_hash(entry->class, &entry->id)];
+	while (*pp != NULL)
+		pp = &(*pp)->next;
+	*pp = entry;
+
+	return SC_SUCCESS;
+}
+
+
+static void
+sc_pkcs15_index_remove(struct sc_pkcs15_object_index *index, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_index_entry *entry, **pp;
+	size_t ii;
+
+	for (ii = 0; ii < SC_PKCS15_INDEX_BUCKETS; ii++)
+		for (pp = &index->buckets[ii]; (entry = *pp) != NULL; pp = &entry->next)
+			if (entry->obj == obj) {
+				*pp = entry->next;
+				free(entry);
+				return;
+			}
+}
+
+
+static int
+sc_pkcs15_index_build(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *obj;
+
+	sc_pkcs15_index_free(p15card);
+	p15card->obj_index = calloc(1, sizeof(struct sc_pkcs15_object_index));
+	if (p15card->obj_index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (sc_pkcs15_index_add(p15card->obj_index, obj) != SC_SUCCESS) {
+			sc_pkcs15_index_free(p15card);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+
+	return SC_SUCCESS;
+}
+
+
+/* Returns SC_ERROR_NOT_SUPPORTED if the index cannot be used for the lookup */
+static int
+sc_pkcs15_index_find(struct sc_pkcs15_card *p15card, unsigned int type,
+		const struct sc_pkcs15_id *id, struct sc_pkcs15_object **out)
+{
+	struct sc_pkcs15_index_entry *entry;
+	unsigned int class;
+	int r, retry;
+
+	class = type & SC_PKCS15_TYPE_CLASS_MASK;
+	if (!type || class == 0 || id == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_pkcs15_enum_dfs(p15card, SC_PKCS15_TYPE_TO_CLASS(type));
+	if (r < 0)
+		return r;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (p15card->obj_index == NULL && sc_pkcs15_index_build(p15card) != SC_SUCCESS)
+			return SC_ERROR_NOT_SUPPORTED;
+
+		for (entry = p15card->obj_index->buckets[sc_pkcs15_index_hash(class, id)];
+				entry != NULL; entry = entry->next) {
+			if (!compare_obj_id(entry->obj, &entry->id))
+				break;
+			if (entry->class != class || !sc_pkcs15_compare_id(&entry->id, id))
+				continue;
+			if (entry->obj->type != type && (entry->obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
+				continue;
+			if (out)
+				*out = entry->obj;
+			return SC_SUCCESS;
+		}
+		if (entry == NULL)
+			return SC_ERROR_OBJECT_NOT_FOUND;
+
+		/* an ID changed behind our back */
+		sc_pkcs15_index_free(p15card);
+	}
+
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+
+void
+sc_pkcs15_reindex_objects(struct sc_pkcs15_card *p15card)
+{
+	if (p15card)
+		sc_pkcs15_index_free(p15card);
+}
+
+
 int
 sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
 {
@@ -1809,6 +2043,8 @@ sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *ob
 
 	if (!obj)
 		return 0;
+	if (p15card->obj_index && sc_pkcs15_index_add(p15card->obj_index, obj) != SC_SUCCESS)
+		sc_pkcs15_index_free(p15card);
 	obj->next = obj->prev = NULL;
 	if (p15card->obj_list == NULL) {
 		p15card->obj_list = obj;
@@ -1828,7 +2064,9 @@ sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object
 {
 	if (!obj)
 		return;
-	else if (obj->prev == NULL)
+	if (p15card->obj_index)
+		sc_pkcs15_index_remove(p15card->obj_index, obj);
+	if (obj->prev == NULL)
 		p15card->obj_list = obj->next;
 	else
 		obj->prev->next = obj->next;
@@ -1842,7 +2080,10 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *cur = NULL, *next = NULL;
 
-	if (!p15card || !p15card->obj_list)
+	if (!p15card)
+		return;
+	sc_pkcs15_index_free(p15card);
+	if (!p15card->obj_list)
 		return;
 	for (cur = p15card->obj_list; cur; cur = next)   {
 		next = cur->next;
@@ -1853,11 +2094,110 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 }
 
 
+/*
+ * The DFs and objects of a card live as long as the binding, they are
+ * carved out of larger chunks and released together with the card.
+ */
+#define SC_PKCS15_ARENA_CHUNK_SIZE	16384
+#define SC_PKCS15_ARENA_ALIGN		16
+
+struct sc_pkcs15_arena {
+	struct sc_pkcs15_arena *next;
+	size_t size, used;
+};
+
+#define SC_PKCS15_ARENA_HDR_SIZE \
+	((sizeof(struct sc_pkcs15_arena) + SC_PKCS15_ARENA_ALIGN - 1) & ~(size_t)(SC_PKCS15_ARENA_ALIGN - 1))
+
+
+static void *
+sc_pkcs15_arena_alloc(struct sc_pkcs15_card *p15card, size_t size)
+{
+	struct sc_pkcs15_arena *chunk = p15card->arena;
+	unsigned char *p;
+
+	size = (size + SC_PKCS15_ARENA_ALIGN - 1) & ~(size_t)(SC_PKCS15_ARENA_ALIGN - 1);
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > SC_PKCS15_ARENA_CHUNK_SIZE ? size : SC_PKCS15_ARENA_CHUNK_SIZE;
+
+		chunk = malloc(SC_PKCS15_ARENA_HDR_SIZE + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = p15card->arena;
+		p15card->arena = chunk;
+	}
+
+	p = (unsigned char *)chunk + SC_PKCS15_ARENA_HDR_SIZE + chunk->used;
+	chunk->used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+
+static void
+sc_pkcs15_free_arena(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_arena *chunk, *next;
+
+	for (chunk = p15card->arena; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	p15card->arena = NULL;
+}
+
+
+struct sc_pkcs15_object *
+sc_pkcs15_new_object(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *obj;
+
+	obj = sc_pkcs15_arena_alloc(p15card, sizeof(struct sc_pkcs15_object));
+	if (obj != NULL)
+		obj->in_arena = 1;
+	return obj;
+}
+
+
+/* Forget the values borrowed from the DF content, they are not ours to free */
+static void
+sc_pkcs15_unborrow_object(struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_prkey_info *prkey;
+	struct sc_pkcs15_pubkey_info *pubkey;
+	struct sc_pkcs15_cert_info *cert;
+
+	if (!obj->df || !obj->df->content || !obj->data)
+		return;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		prkey = (struct sc_pkcs15_prkey_info *)obj->data;
+		if (sc_pkcs15_df_holds(obj->df, prkey->subject.value))
+			prkey->subject.value = NULL;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		pubkey = (struct sc_pkcs15_pubkey_info *)obj->data;
+		if (sc_pkcs15_df_holds(obj->df, pubkey->subject.value))
+			pubkey->subject.value = NULL;
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		cert = (struct sc_pkcs15_cert_info *)obj->data;
+		if (sc_pkcs15_df_holds(obj->df, cert->value.value))
+			cert->value.value = NULL;
+		break;
+	}
+}
+
+
 void
 sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 {
 	if (!obj)
 		return;
+	sc_pkcs15_unborrow_object(obj);
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_PRKEY:
 		sc_pkcs15_free_prkey_info((sc_pkcs15_prkey_info_t *)obj->data);
@@ -1880,7 +2220,9 @@ sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 
 	sc_pkcs15_free_object_content(obj);
 
-	free(obj);
+	/* arena objects go away with the card */
+	if (!obj->in_arena)
+		free(obj);
 }
 
 
@@ -1889,7 +2231,7 @@ sc_pkcs15_add_df(struct sc_pkcs15_card *p15card, unsigned int type, const sc_pat
 {
 	struct sc_pkcs15_df *p, *newdf;
 
-	newdf = calloc(1, sizeof(struct sc_pkcs15_df));
+	newdf = sc_pkcs15_arena_alloc(p15card, sizeof(struct sc_pkcs15_df));
 	if (newdf == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	newdf->path = *path;
@@ -1920,7 +2262,8 @@ sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card)
 
 	for (cur = p15card->df_list; cur; cur = next)   {
 		next = cur->next;
-		free(cur);
+		if (!cur->content_cached)
+			free(cur->content);
 	}
 
 	p15card->df_list = NULL;
@@ -1931,8 +2274,12 @@ int
 sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
 		unsigned char **buf_out, size_t *bufsize_out)
 {
-	unsigned char *buf = NULL, *tmp = NULL, *p;
-	size_t bufsize = 0, tmpsize;
+	unsigned char *buf = NULL, *p;
+	size_t bufsize = 0, count = 0, i;
+	struct {
+		unsigned char *value;
+		size_t len;
+	} *entries;
 	const struct sc_pkcs15_object *obj;
 	int (* func)(struct sc_context *, const struct sc_pkcs15_object *nobj,
 		     unsigned char **nbuf, size_t *nbufsize) = NULL;
@@ -1970,26 +2317,48 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 		*bufsize_out = 0;
 		return 0;
 	}
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+	/* encode the entries first, so that the DF is written into one
+	 * buffer of the final size */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj->df == df)
+			count++;
+	if (count == 0) {
+		*buf_out = NULL;
+		*bufsize_out = 0;
+		return 0;
+	}
+	entries = calloc(count, sizeof *entries);
+	if (entries == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (obj = p15card->obj_list, i = 0; obj != NULL && i < count; obj = obj->next) {
 		if (obj->df != df)
 			continue;
-		r = func(ctx, obj, &tmp, &tmpsize);
-		if (r) {
-			free(tmp);
-			free(buf);
-			return r;
-		}
-		p = (u8 *) realloc(buf, bufsize + tmpsize);
-		if (!p) {
-			free(tmp);
-			free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
+		r = func(ctx, obj, &entries[i].value, &entries[i].len);
+		if (r)
+			goto out;
+		bufsize += entries[i++].len;
+	}
+	count = i;
+	if (bufsize) {
+		buf = malloc(bufsize);
+		if (buf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
 		}
-		buf = p;
-		memcpy(buf + bufsize, tmp, tmpsize);
-		free(tmp);
-		bufsize += tmpsize;
 	}
+	for (i = 0, p = buf; i < count; i++) {
+		if (entries[i].len == 0)
+			continue;
+		memcpy(p, entries[i].value, entries[i].len);
+		p += entries[i].len;
+	}
+	r = 0;
+out:
+	for (i = 0; i < count; i++)
+		free(entries[i].value);
+	free(entries);
+	if (r)
+		return r;
 	*buf_out = buf;
 	*bufsize_out = bufsize;
 
@@ -1998,22 +2367,16 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 
 
 int
-sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+sc_pkcs15_decode_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		const unsigned char *buf, size_t bufsize)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	unsigned char *buf;
 	const unsigned char *p;
-	size_t bufsize;
-	int r;
+	int r = 0;
 	struct sc_pkcs15_object *obj = NULL;
 	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
-	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
-
-	if (df->enumerated)
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
-
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
 		func = sc_pkcs15_decode_prkdf_entry;
@@ -2040,20 +2403,19 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		sc_log(ctx, "unknown DF type: %d", df->type);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
-	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
-	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
-		obj = calloc(1, sizeof(struct sc_pkcs15_object));
+		obj = sc_pkcs15_new_object(p15card);
 		if (obj == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto ret;
 		}
+		/* lets the entry decoder borrow from the DF content */
+		obj->df = df;
 		r = func(p15card, obj, &p, &bufsize);
 		if (r) {
-			free(obj);
 			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
 				r = 0;
 				break;
@@ -2067,7 +2429,6 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		if (r) {
 			if (obj->data)
 				free(obj->data);
-			free(obj);
 			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
 			goto ret;
 		}
@@ -2077,11 +2438,60 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
 
+int
+sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned char *buf;
+	size_t bufsize;
+	int r;
+
+	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
+
+	if (df->enumerated)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
+	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+
+	if (df->content == NULL) {
+		/* Kept with the DF, so the decoded entries can point into it */
+		df->content = buf;
+		df->content_len = bufsize;
+		r = sc_pkcs15_decode_df(p15card, df, buf, bufsize);
+	}
+	else {
+		r = sc_pkcs15_decode_df(p15card, df, buf, bufsize);
+		free(buf);
+	}
+
+	/* Once every DF is parsed, store them all in the objects cache */
+	if (p15card->opts.use_file_cache) {
+		if (r != SC_SUCCESS)
+			p15card->flags |= SC_PKCS15_CARD_FLAG_NO_OBJECTS_CACHE;
+		else
+			sc_pkcs15_cache_objects(p15card);
+	}
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+int
+sc_pkcs15_df_holds(const struct sc_pkcs15_df *df, const void *ptr)
+{
+	const unsigned char *p = ptr;
+
+	if (!df || !df->content || !p)
+		return 0;
+	return p >= df->content && p <= df->content + df->content_len;
+}
+
+
 int
 sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card, const struct sc_path *path,
 		const struct sc_pkcs15_id *auth_id)
@@ -2317,6 +2727,11 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 		r = sc_lock(p15card->card);
 		if (r)
 			goto fail;
+		/* a whole transparent EF of the current DF is read by its short
+		 * EF identifier, which saves the SELECT */
+		if (in_path->count < 0
+				&& sc_read_file_by_sfid(p15card->card, in_path, &data, &len) == SC_SUCCESS)
+			goto read_done;
 		r = sc_select_file(p15card->card, in_path, &file);
 		if (r)
 			goto fail_unlock;
@@ -2383,6 +2798,7 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 			/* sc_read_binary may return less than requested */
 			len = r;
 		}
+read_done:
 		sc_unlock(p15card->card);
 
 		sc_file_free(file);
@@ -2493,11 +2909,19 @@ sc_pkcs15_make_absolute_path(const struct sc_path *parent, struct sc_path *child
 }
 
 
+/* The content of authentication objects is a cached PIN */
+#define IS_SECRET_CONTENT(obj) \
+	(((obj)->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_AUTH)
+
 void sc_pkcs15_free_object_content(struct sc_pkcs15_object *obj)
 {
 	if (obj->content.value && obj->content.len)   {
-		sc_mem_clear(obj->content.value, obj->content.len);
-		free(obj->content.value);
+		if (IS_SECRET_CONTENT(obj)) {
+			sc_mem_secure_free(obj->content.value, obj->content.len);
+		} else {
+			sc_mem_clear(obj->content.value, obj->content.len);
+			free(obj->content.value);
+		}
 	}
 	obj->content.value = NULL;
 	obj->content.len = 0;
@@ -2521,7 +2945,10 @@ sc_pkcs15_allocate_object_content(struct sc_context *ctx, struct sc_pkcs15_objec
 	/* Need to pass by temporary variable,
 	 * because 'value' and 'content.value' pointers can be the sames.
 	 */
-	tmp_buf = calloc(sizeof *tmp_buf, len);
+	if (IS_SECRET_CONTENT(obj))
+		tmp_buf = sc_mem_secure_alloc(len);
+	else
+		tmp_buf = calloc(sizeof *tmp_buf, len);
 	if (!tmp_buf)
 		return SC_ERROR_OUT_OF_MEMORY;
 
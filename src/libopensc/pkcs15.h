@@ -25,6 +25,8 @@
 extern "C" {
 #endif
 
+#include <time.h>
+
 #include "libopensc/opensc.h"
 #include "libopensc/aux-data.h"
 
@@ -131,6 +133,14 @@ struct sc_pkcs15_auth_info {
 
 	int tries_left, max_tries, logged_in;
 	int max_unlocks;
+
+	/* card->auth_serial and time when the values above were read from the card */
+	unsigned int info_serial;
+	time_t info_time;
+
+	/* card->reset_serial and last use of the PIN in the PIN cache */
+	unsigned int cache_serial;
+	time_t cache_time;
  };
 typedef struct sc_pkcs15_auth_info sc_pkcs15_auth_info_t;
 
@@ -293,6 +303,7 @@ struct sc_pkcs15_cert {
 
 	/* DER encoded raw cert */
 	struct sc_pkcs15_der data;
+	int data_mapped;	/* data is in the card's cache store, not ours */
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
 
@@ -493,6 +504,8 @@ struct sc_pkcs15_object {
 	struct sc_pkcs15_object *next, *prev; /* used only internally */
 
 	struct sc_pkcs15_der content;
+
+	int in_arena; /* allocated by sc_pkcs15_new_object(), released with the card */
 };
 typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 
@@ -509,6 +522,8 @@ typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 #define SC_PKCS15_DF_TYPE_COUNT		9
 
 struct sc_pkcs15_card;
+struct sc_pkcs15_arena;
+struct sc_pkcs15_object_index;
 
 struct sc_pkcs15_df {
 	struct sc_path path;
@@ -516,6 +531,12 @@ struct sc_pkcs15_df {
 	unsigned int type;
 	int enumerated;
 
+	/* DF content as read by sc_pkcs15_parse_df(), entries decoded
+	 * from it borrow their subject and direct values from here */
+	unsigned char *content;
+	size_t content_len;
+	int content_cached;	/* content is in p15card->objects_cache, not ours */
+
 	struct sc_pkcs15_df *next, *prev;
 };
 typedef struct sc_pkcs15_df sc_pkcs15_df_t;
@@ -571,6 +592,8 @@ struct sc_pkcs15_operations   {
 			unsigned char *, size_t *);
 };
 
+struct sc_pkcs15_cache_store;
+
 typedef struct sc_pkcs15_card {
 	sc_card_t *card;
 	unsigned int flags;
@@ -588,9 +611,15 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		int use_file_cache_store;	/* keep all cached files in a single file */
+		int cache_objects_on_bind;	/* fill the objects cache before releasing the card */
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
+		int pin_cache_timeout;		/* seconds, 0 for none */
+		int pin_cache_proactive;	/* revalidate after a reset before use */
+		int use_pin_info_cache;
+		int pin_info_cache_timeout;	/* seconds, 0 for none */
 	} opts;
 
 	unsigned int magic;
@@ -600,6 +629,20 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_cache_store *cache_store;	/* mapped file cache store */
+	/* SC_CARDCTL_GET_CHANGE_COUNTER in hex, names the cache files of a
+	 * card without lastUpdate; empty if the driver has none */
+	char *change_counter;
+
+	/* Objects cache file the DFs were read from, mapped (shared with the
+	 * other processes that use it) when possible */
+	u8 *objects_cache;
+	size_t objects_cache_size;
+	int objects_cache_mapped;
+
+	struct sc_pkcs15_arena *arena;	/* DFs and objects, released by sc_pkcs15_card_clear() */
+	struct sc_pkcs15_object_index *obj_index;	/* obj_list by class and ID, built on demand */
+
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -610,6 +653,8 @@ typedef struct sc_pkcs15_card {
 
 /* flags suitable for struct sc_pkcs15_card */
 #define SC_PKCS15_CARD_FLAG_EMULATED			0x02000000
+#define SC_PKCS15_CARD_FLAG_OBJECTS_CACHED		0x04000000 /* DFs loaded from or stored in the objects cache */
+#define SC_PKCS15_CARD_FLAG_NO_OBJECTS_CACHE		0x08000000 /* DFs must not be stored in the objects cache */
 
 /* X509 bits for certificate usage extension */
 #define SC_X509_DIGITAL_SIGNATURE     0x0001UL
@@ -687,7 +732,7 @@ int sc_pkcs15_decode_pubkey(struct sc_context *,
 		struct sc_pkcs15_pubkey *, const u8 *, size_t);
 int sc_pkcs15_encode_pubkey(struct sc_context *,
 		struct sc_pkcs15_pubkey *, u8 **, size_t *);
-int sc_pkcs15_encode_pubkey_as_spki(struct sc_context *,
+int sc_pkcs15_encode_pubkey_as_spki(struct sc_context *,
 		struct sc_pkcs15_pubkey *, u8 **, size_t *);
 void sc_pkcs15_erase_pubkey(struct sc_pkcs15_pubkey *);
 void sc_pkcs15_free_pubkey(struct sc_pkcs15_pubkey *);
@@ -721,9 +766,18 @@ int sc_pkcs15_find_data_object_by_name(struct sc_pkcs15_card *p15card,
 				struct sc_pkcs15_object **out);
 void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object);
 
+/* The certificate can refer to the card's cache store, free it
+ * before unbinding the card */
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert);
+/* Reads the certificate, but only locates the serial, issuer and subject,
+ * the key and extensions are decoded by sc_pkcs15_complete_certificate() */
+int sc_pkcs15_read_certificate_names(struct sc_pkcs15_card *card,
+			       const struct sc_pkcs15_cert_info *info,
+			       struct sc_pkcs15_cert **cert);
+int sc_pkcs15_complete_certificate(struct sc_context *ctx,
+			       struct sc_pkcs15_cert *cert);
 void sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert);
 int sc_pkcs15_find_cert_by_id(struct sc_pkcs15_card *card,
 			      const struct sc_pkcs15_id *id,
@@ -805,6 +859,8 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card,
 			const struct sc_pkcs15_object *obj);
 void sc_pkcs15_pincache_clear(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_pincache_prepare(struct sc_pkcs15_card *p15card,
+			const struct sc_pkcs15_object *obj);
 
 int sc_pkcs15_encode_dir(struct sc_context *ctx,
 			struct sc_pkcs15_card *card,
@@ -841,8 +897,12 @@ int sc_pkcs15_encode_aodf_entry(struct sc_context *ctx,
 			const struct sc_pkcs15_object *obj, u8 **buf,
 			size_t *bufsize);
 
+int sc_pkcs15_decode_df(struct sc_pkcs15_card *p15card,
+			struct sc_pkcs15_df *df,
+			const u8 *buf, size_t bufsize);
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df);
+int sc_pkcs15_df_holds(const struct sc_pkcs15_df *df, const void *ptr);
 int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
 		      struct sc_pkcs15_df *df);
 int sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card,
@@ -875,6 +935,8 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj);
 void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 			     struct sc_pkcs15_object *obj);
+/* to be called after the ID of an object in the list has been changed */
+void sc_pkcs15_reindex_objects(struct sc_pkcs15_card *p15card);
 int sc_pkcs15_add_df(struct sc_pkcs15_card *, unsigned int, const sc_path_t *);
 
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
@@ -895,6 +957,7 @@ void sc_pkcs15_free_cert_info(sc_pkcs15_cert_info_t *cert);
 void sc_pkcs15_free_data_info(sc_pkcs15_data_info_t *data);
 void sc_pkcs15_free_auth_info(sc_pkcs15_auth_info_t *auth_info);
 void sc_pkcs15_free_object(struct sc_pkcs15_object *obj);
+struct sc_pkcs15_object *sc_pkcs15_new_object(struct sc_pkcs15_card *p15card);
 
 /* Generic file i/o */
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
@@ -905,9 +968,24 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
                                const struct sc_path *path,
                                u8 **buf, size_t *bufsize);
+int sc_pkcs15_map_cached_file(struct sc_pkcs15_card *p15card,
+			      const struct sc_path *path,
+			      const u8 **data, size_t *len);
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+/* Write-through of files written to the card, see pkcs15init */
+int sc_pkcs15_update_cached_file(struct sc_pkcs15_card *p15card,
+				 const struct sc_path *path,
+				 const u8 *buf, size_t bufsize);
+int sc_pkcs15_move_cache(struct sc_pkcs15_card *p15card, const char *old_last_update);
+void sc_pkcs15_close_cache_store(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_close_objects_cache(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_prefetch_cache(struct sc_pkcs15_card *p15card);
+/* Objects cache: the content of all DFs of the card in a single file */
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_uncache_objects(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -0,0 +1,97 @@
+/*
+ * probes.h: Static tracepoints
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _OPENSC_PROBES_H
+#define _OPENSC_PROBES_H
+
+/*
+ * Tracepoints on the hot paths, for measurements on live systems. They
+ * are USDT probes of the provider "opensc" for bpftrace, SystemTap or
+ * DTrace if built with `configure --enable-usdt`, and TraceLogging events
+ * of the ETW provider "OpenSC" for WPA or tracelog if built with
+ * ENABLE_TRACELOGGING (win32/Make.rules.mak). Otherwise they are empty.
+ * The probes, with their arguments:
+ *
+ *   pkcs11__entry	function name, session or slot handle (or 0)
+ *   pkcs11__return	function name, CK_RV
+ *   lock__wait		card				(sc_lock() called)
+ *   lock__acquire	card, first lock of the card, error
+ *   lock__release	card, error			(sc_unlock())
+ *   transmit__start	card, INS, Lc, Le
+ *   transmit__end	card, SW1 SW2, response length, error
+ *   sm__wrap		card, INS, error
+ *   sm__unwrap		card, SW1 SW2, error
+ *   cache__hit		"memory" or "file", card
+ *   cache__miss	"memory" or "file", card
+ *
+ * E.g. the time of the card operations of every function:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/opensc-pkcs11.so:opensc:pkcs11__entry
+ *	{ @start[tid] = nsecs; }
+ *	usdt:/usr/lib/opensc-pkcs11.so:opensc:pkcs11__return /@start[tid]/
+ *	{ @us[str(arg0)] = hist((nsecs - @start[tid]) / 1000); delete(@start[tid]); }'
+ *
+ * The PKCS#11 probes are in the module, the others in libopensc.
+ */
+
+#if defined(ENABLE_USDT)
+
+#include <sys/sdt.h>
+
+#define SC_PROBE1(name, a)		DTRACE_PROBE1(opensc, name, a)
+#define SC_PROBE2(name, a, b)		DTRACE_PROBE2(opensc, name, a, b)
+#define SC_PROBE3(name, a, b, c)	DTRACE_PROBE3(opensc, name, a, b, c)
+#define SC_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(opensc, name, a, b, c, d)
+#define SC_PROBE_STR2(name, s, a)	DTRACE_PROBE2(opensc, name, s, a)
+
+#elif defined(ENABLE_TRACELOGGING)
+
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+
+/* registered by sc_context_create() */
+TRACELOGGING_DECLARE_PROVIDER(sc_trace_provider);
+
+#define SC_PROBE_ARG(x, n)		TraceLoggingUInt64((UINT64) (UINT_PTR) (x), n)
+#define SC_PROBE1(name, a) \
+	TraceLoggingWrite(sc_trace_provider, #name, SC_PROBE_ARG(a, "arg0"))
+#define SC_PROBE2(name, a, b) \
+	TraceLoggingWrite(sc_trace_provider, #name, SC_PROBE_ARG(a, "arg0"), \
+		SC_PROBE_ARG(b, "arg1"))
+#define SC_PROBE3(name, a, b, c) \
+	TraceLoggingWrite(sc_trace_provider, #name, SC_PROBE_ARG(a, "arg0"), \
+		SC_PROBE_ARG(b, "arg1"), SC_PROBE_ARG(c, "arg2"))
+#define SC_PROBE4(name, a, b, c, d) \
+	TraceLoggingWrite(sc_trace_provider, #name, SC_PROBE_ARG(a, "arg0"), \
+		SC_PROBE_ARG(b, "arg1"), SC_PROBE_ARG(c, "arg2"), \
+		SC_PROBE_ARG(d, "arg3"))
+#define SC_PROBE_STR2(name, s, a) \
+	TraceLoggingWrite(sc_trace_provider, #name, TraceLoggingString(s, "arg0"), \
+		SC_PROBE_ARG(a, "arg1"))
+
+#else
+
+#define SC_PROBE1(name, a)		do { } while (0)
+#define SC_PROBE2(name, a, b)		do { } while (0)
+#define SC_PROBE3(name, a, b, c)	do { } while (0)
+#define SC_PROBE4(name, a, b, c, d)	do { } while (0)
+#define SC_PROBE_STR2(name, s, a)	do { } while (0)
+
+#endif
+
+#endif /* _OPENSC_PROBES_H */
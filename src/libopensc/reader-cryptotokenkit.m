@@ -32,6 +32,15 @@
 struct cryptotokenkit_private_data {
 	TKSmartCardSlot* tksmartcardslot;
 	TKSmartCard* tksmartcard;
+
+	/* APDU started with cryptotokenkit_transmit_submit(); the request
+	 * buffer and the semaphore are reused for every APDU of the reader */
+	NSMutableData *request;
+	dispatch_semaphore_t done;
+	sc_apdu_t *apdu;
+	int result;
+	sc_apdu_callback_t callback;
+	void *arg;
 };
 
 static struct sc_reader_operations cryptotokenkit_ops;
@@ -76,6 +85,12 @@ static int cryptotokenkit_release(sc_reader_t *reader)
 {
 	struct cryptotokenkit_private_data *priv = reader->drv_data;
 
+	if (priv->request != nil) {
+		[priv->request resetBytesInRange:NSMakeRange(0, [priv->request length])];
+		[priv->request release];
+	}
+	if (priv->done != NULL)
+		dispatch_release(priv->done);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -247,59 +262,95 @@ static int cryptotokenkit_unlock(sc_reader_t *reader)
 	LOG_FUNC_RETURN(reader->ctx, SC_SUCCESS);
 }
 
-static int cryptotokenkit_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+static void cryptotokenkit_transmit_reply(sc_reader_t *reader, NSData *response, NSError *error)
 {
-	size_t ssize = 0;
-	__block u8 *rbuf = NULL;
-	__block int r;
-	__block size_t rsize;
-	u8 *sbuf = NULL;
 	struct cryptotokenkit_private_data *priv = reader->drv_data;
-	dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+	sc_apdu_callback_t callback = priv->callback;
+	sc_apdu_t *apdu = priv->apdu;
+	void *arg = priv->arg;
+	int r;
 
-	LOG_FUNC_CALLED(reader->ctx);
+	/* the request may hold a PIN or a key */
+	[priv->request resetBytesInRange:NSMakeRange(0, [priv->request length])];
+
+	if (response) {
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, [response bytes], [response length], 0);
+		r = sc_apdu_set_resp(reader->ctx, apdu, [response bytes], [response length]);
+	} else {
+		r = convertError(error);
+	}
+
+	priv->result = r;
+	dispatch_semaphore_signal(priv->done);
+	if (callback != NULL)
+		callback(apdu, arg);
+}
+
+static int cryptotokenkit_transmit_submit(sc_reader_t *reader, sc_apdu_t *apdu,
+		sc_apdu_callback_t callback, void *arg)
+{
+	struct cryptotokenkit_private_data *priv = reader->drv_data;
+	size_t ssize;
+	int r;
+
+	if (priv->apdu != NULL)
+		return SC_ERROR_NOT_ALLOWED;
+
+	ssize = sc_apdu_get_length(apdu, reader->active_protocol);
+	if (ssize == 0)
+		return SC_ERROR_INTERNAL;
+	if (priv->request == nil) {
+		priv->request = [[NSMutableData alloc] initWithLength:ssize];
+	} else {
+		[priv->request setLength:ssize];
+	}
+	if (priv->done == NULL)
+		priv->done = dispatch_semaphore_create(0);
+	if (priv->request == nil || priv->done == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
 
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	r = sc_apdu2bytes(reader->ctx, apdu, reader->active_protocol,
+			[priv->request mutableBytes], ssize);
 	if (r != SC_SUCCESS)
-		goto err;
+		return r;
 
 	if (reader->name)
 		sc_log(reader->ctx, "reader '%s'", reader->name);
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, [priv->request bytes], ssize, 1);
 
-	[priv->tksmartcard transmitRequest:
-			[NSData dataWithBytes: sbuf length: ssize]
+	priv->apdu = apdu;
+	priv->callback = callback;
+	priv->arg = arg;
+	[priv->tksmartcard transmitRequest:priv->request
 			reply:^(NSData *response, NSError *error) {
-		if (response) {
-			rsize = [response length];
-			rbuf = malloc(rsize);
-			if (!rbuf) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-			} else {
-				memcpy(rbuf, (unsigned char*) [response bytes], rsize);
-				r = SC_SUCCESS;
-			}
-		} else {
-			r = convertError(error);
-		}
-		dispatch_semaphore_signal(sema);
+		cryptotokenkit_transmit_reply(reader, response, error);
 	}];
-	dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
-	if (r != SC_SUCCESS)
-		goto err;
 
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
-	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+	return SC_SUCCESS;
+}
 
-err:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rsize);
-		free(rbuf);
-	}
+static int cryptotokenkit_transmit_wait(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct cryptotokenkit_private_data *priv = reader->drv_data;
+
+	if (priv->apdu == NULL || priv->apdu != apdu)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	dispatch_semaphore_wait(priv->done, DISPATCH_TIME_FOREVER);
+	priv->apdu = NULL;
+
+	return priv->result;
+}
+
+static int cryptotokenkit_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	int r;
+
+	LOG_FUNC_CALLED(reader->ctx);
+
+	r = cryptotokenkit_transmit_submit(reader, apdu, NULL, NULL);
+	if (r == SC_SUCCESS)
+		r = cryptotokenkit_transmit_wait(reader, apdu);
 
 	LOG_FUNC_RETURN(reader->ctx, r);
 }
@@ -611,6 +662,8 @@ struct sc_reader_driver *sc_get_cryptotokenkit_driver(void)
 	cryptotokenkit_ops.lock = cryptotokenkit_lock;
 	cryptotokenkit_ops.unlock = cryptotokenkit_unlock;
 	cryptotokenkit_ops.transmit = cryptotokenkit_transmit;
+	cryptotokenkit_ops.transmit_submit = cryptotokenkit_transmit_submit;
+	cryptotokenkit_ops.transmit_wait = cryptotokenkit_transmit_wait;
 	cryptotokenkit_ops.perform_verify = cryptotokenkit_perform_verify;
 	cryptotokenkit_ops.perform_pace = NULL;
 	cryptotokenkit_ops.use_reader = cryptotokenkit_use_reader;
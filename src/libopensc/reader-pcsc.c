@@ -26,6 +26,9 @@
 #ifdef ENABLE_PCSC	/* empty file without pcsc */
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -42,6 +45,16 @@
 
 #include "pace.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sys/time.h>
+#define PCSC_STATE_LISTENER
+#define PCSC_STICKY_TRANSACTION
+#define PCSC_ASYNC_TRANSMIT
+#define PCSC_CONTEXT_POOL
+#include <unistd.h>
+#endif
+
 #ifdef HAVE_PCSCLITE_H
 #if !defined (__MAC_OS_X_VERSION_MIN_REQUIRED) || __MAC_OS_X_VERSION_MIN_REQUIRED < 101000
 #define HAVE_PCSCLITE 1
@@ -84,6 +97,11 @@ struct pcsc_global_private_data {
 	int enable_pinpad;
 	int fixed_pinlength;
 	int enable_pace;
+	int enable_contactless;
+	int enable_state_listener;
+	struct pcsc_state_listener *listener;
+	int transaction_idle_time;
+	struct pcsc_sticky *sticky;
 	size_t force_max_recv_size;
 	size_t force_max_send_size;
 	int connect_exclusive;
@@ -92,6 +110,10 @@ struct pcsc_global_private_data {
 	DWORD reconnect_action;
 	const char *provider_library;
 	void *dlhandle;
+	/* what detect_reader_features() found, by reader name */
+	struct pcsc_reader_features *features;
+	/* keep the features in the cache directory too */
+	int cache_features;
 	SCardEstablishContext_t SCardEstablishContext;
 	SCardReleaseContext_t SCardReleaseContext;
 	SCardConnect_t SCardConnect;
@@ -126,11 +148,348 @@ struct pcsc_private_data {
 	DWORD pin_properties_ioctl;
 
 	DWORD get_tlv_properties;
+	/* the TLV properties, read once by part10_get_tlv_properties() */
+	u8 tlv_properties[256];
+	size_t tlv_properties_len;
+
+	/* PIN verification block without the APDU, built last for the PIN
+	 * format in verify_format and reused while it stays the same */
+	u8 verify_block[sizeof(PIN_VERIFY_STRUCTURE)];
+	struct part10_pin_format {
+		unsigned int encoding;
+		size_t length_offset, pad_length, min_length, max_length;
+		int padding, display;
+	} verify_format;
+	int verify_block_valid;
 
 	int locked;
+#ifdef PCSC_STICKY_TRANSACTION
+	/* transaction kept open after pcsc_unlock() until sticky_until */
+	int sticky;
+	struct timeval sticky_until;
+	struct pcsc_private_data *sticky_next;
+#endif
+#ifdef PCSC_ASYNC_TRANSMIT
+	struct pcsc_async *async;
+#endif
+
+	/* Reused for every APDU, wiped after each use */
+	u8 *sbuf;
+	size_t sbuf_len;
+	u8 *rbuf;
+	size_t rbuf_len;
+};
+
+#define PCSC_PNP_NOTIFICATION "\\\\?PnP?\\Notification"
+
+/* The features of a reader model do not change: a reader attached again
+ * under the same name takes them from here, without being probed */
+struct pcsc_reader_features {
+	char *name;
+	DWORD verify_ioctl, verify_ioctl_start, verify_ioctl_finish;
+	DWORD modify_ioctl, modify_ioctl_start, modify_ioctl_finish;
+	DWORD pace_ioctl, pin_properties_ioctl, get_tlv_properties;
+	u8 tlv_properties[256];
+	size_t tlv_properties_len;
+	unsigned long capabilities;
+	size_t max_send_size, max_recv_size;
+	char *vendor;
+	unsigned char version_major, version_minor;
+	struct pcsc_reader_features *next;
+};
+
+static void pcsc_features_free(struct pcsc_global_private_data *gpriv)
+{
+	while (gpriv->features) {
+		struct pcsc_reader_features *f = gpriv->features;
+
+		gpriv->features = f->next;
+		free(f->name);
+		free(f->vendor);
+		free(f);
+	}
+}
+
+/* With cache_features the features are kept across processes in this file
+ * of the cache directory, one line per reader name. The configuration they
+ * were probed with is part of the line, a line of another one is ignored. */
+#define PCSC_FEATURES_CACHE_FILE "pcsc_features"
+
+static int pcsc_features_cache_filename(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, PCSC_FEATURES_CACHE_FILE);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* The configuration the features depend on */
+static void pcsc_features_conf(struct pcsc_global_private_data *gpriv, char *buf, size_t bufsize)
+{
+	snprintf(buf, bufsize, "%d %d %"SC_FORMAT_LEN_SIZE_T"u %"SC_FORMAT_LEN_SIZE_T"u",
+			gpriv->enable_pinpad, gpriv->enable_pace,
+			gpriv->force_max_send_size, gpriv->force_max_recv_size);
+}
+
+/* Splits off the next field of a line, up to a tab or the end of line */
+static char *pcsc_features_field(char **line)
+{
+	char *field = *line;
+	size_t len;
+
+	if (field == NULL)
+		return NULL;
+	len = strcspn(field, "\t\r\n");
+	if (field[len] == '\t') {
+		field[len] = '\0';
+		*line = field + len + 1;
+	} else {
+		field[len] = '\0';
+		*line = NULL;
+	}
+	return field;
+}
+
+static void pcsc_features_load(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	char fname[PATH_MAX], line[1024], conf[64];
+	FILE *f;
+
+	if (pcsc_features_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return;
+	pcsc_features_conf(gpriv, conf, sizeof(conf));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct pcsc_reader_features *feat;
+		char *rest = line, *name, *fconf, *ioctls, *caps, *tlv, *vendor;
+		unsigned long v[9], capabilities, send, recv;
+		unsigned int major, minor;
+		size_t tlv_len;
+
+		name = pcsc_features_field(&rest);
+		fconf = pcsc_features_field(&rest);
+		ioctls = pcsc_features_field(&rest);
+		caps = pcsc_features_field(&rest);
+		tlv = pcsc_features_field(&rest);
+		vendor = pcsc_features_field(&rest);
+		if (vendor == NULL || *name == '\0' || strcmp(fconf, conf) != 0)
+			continue;
+		if (sscanf(ioctls, "%lx %lx %lx %lx %lx %lx %lx %lx %lx", &v[0], &v[1], &v[2],
+					&v[3], &v[4], &v[5], &v[6], &v[7], &v[8]) != 9
+				|| sscanf(caps, "%lx %lu %lu %u %u", &capabilities, &send, &recv,
+					&major, &minor) != 5)
+			continue;
+
+		feat = calloc(1, sizeof *feat);
+		if (feat == NULL)
+			break;
+		tlv_len = sizeof(feat->tlv_properties);
+		if (sc_hex_to_bin(tlv, feat->tlv_properties, &tlv_len) != SC_SUCCESS
+				|| (feat->name = strdup(name)) == NULL) {
+			free(feat);
+			continue;
+		}
+		feat->tlv_properties_len = tlv_len;
+		feat->verify_ioctl = v[0];
+		feat->verify_ioctl_start = v[1];
+		feat->verify_ioctl_finish = v[2];
+		feat->modify_ioctl = v[3];
+		feat->modify_ioctl_start = v[4];
+		feat->modify_ioctl_finish = v[5];
+		feat->pace_ioctl = v[6];
+		feat->pin_properties_ioctl = v[7];
+		feat->get_tlv_properties = v[8];
+		feat->capabilities = capabilities;
+		feat->max_send_size = send;
+		feat->max_recv_size = recv;
+		feat->version_major = major;
+		feat->version_minor = minor;
+		feat->vendor = *vendor ? strdup(vendor) : NULL;
+		feat->next = gpriv->features;
+		gpriv->features = feat;
+	}
+	fclose(f);
+}
+
+static void pcsc_features_write(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8], conf[64];
+	char tlv[2 * sizeof(((struct pcsc_reader_features *) 0)->tlv_properties) + 1];
+	struct pcsc_reader_features *feat;
+	FILE *f;
+	int ok = 1;
+
+	if (pcsc_features_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	pcsc_features_conf(gpriv, conf, sizeof(conf));
+
+	f = fopen(tmpname, "w");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(ctx) < 0)
+			return;
+		f = fopen(tmpname, "w");
+	}
+	if (f == NULL)
+		return;
+
+	for (feat = gpriv->features; feat; feat = feat->next) {
+		const char *vendor = feat->vendor ? feat->vendor : "";
+
+		if (strpbrk(feat->name, "\t\r\n") != NULL)
+			continue;
+		if (strpbrk(vendor, "\t\r\n") != NULL)
+			vendor = "";
+		sc_bin_to_hex(feat->tlv_properties, feat->tlv_properties_len, tlv, sizeof(tlv), 0);
+		if (fprintf(f, "%s\t%s\t%lx %lx %lx %lx %lx %lx %lx %lx %lx\t%lx %lu %lu %u %u\t%s\t%s\n",
+					feat->name, conf,
+					(unsigned long) feat->verify_ioctl,
+					(unsigned long) feat->verify_ioctl_start,
+					(unsigned long) feat->verify_ioctl_finish,
+					(unsigned long) feat->modify_ioctl,
+					(unsigned long) feat->modify_ioctl_start,
+					(unsigned long) feat->modify_ioctl_finish,
+					(unsigned long) feat->pace_ioctl,
+					(unsigned long) feat->pin_properties_ioctl,
+					(unsigned long) feat->get_tlv_properties,
+					feat->capabilities,
+					(unsigned long) feat->max_send_size,
+					(unsigned long) feat->max_recv_size,
+					feat->version_major, feat->version_minor,
+					tlv, vendor) < 0)
+			ok = 0;
+	}
+	if (fclose(f) != 0)
+		ok = 0;
+
+#ifdef _WIN32
+	if (ok)
+		remove(fname);
+#endif
+	if (!ok || rename(tmpname, fname) != 0) {
+		sc_log(ctx, "cannot write the reader features cache %s", fname);
+		remove(tmpname);
+	}
+}
+
+/* What pcsc_wait_for_event() keeps in *reader_states between two calls */
+struct pcsc_wait_states {
+	/* events are taken from the state listener */
+	int listener;
+	/* listener events already looked at */
+	unsigned long seq;
+	/* otherwise, the states given to SCardGetStatusChange, terminated by
+	 * an entry without szReader */
+	SCARD_READERSTATE *states;
+};
+
+#ifdef PCSC_STATE_LISTENER
+#define PCSC_LISTENER_MAX_READERS 16
+#define PCSC_LISTENER_MAX_EVENTS 32
+#define PCSC_LISTENER_PNP ((size_t) -1)
+
+/* Reader states kept current by a background thread blocking in
+ * SCardGetStatusChange, so that presence checks can be answered from memory.
+ * The changes are also recorded as events, which pcsc_wait_for_event() takes
+ * without calling PC/SC itself. */
+struct pcsc_state_listener {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* broadcast on new events, when the thread stops and by pcsc_cancel() */
+	pthread_cond_t cond;
+	SCARDCONTEXT pcsc_ctx;
+	int started;
+	int running;
+	int stop;
+	size_t count;
+	struct {
+		char *name;
+		/* detached; kept so that the index stays with the name */
+		int removed;
+		int valid;
+		DWORD state;
+		DWORD atr_len;
+		unsigned char atr[SC_MAX_ATR_SIZE];
+	} readers[PCSC_LISTENER_MAX_READERS];
+	/* readers attached or detached, seen through the PnP notification */
+	int watch_pnp;
+	int pnp_valid;
+	DWORD pnp_state;
+	unsigned long pnp_changes;
+	/* pnp_changes when pcsc_detect_readers() last listed the readers */
+	int pnp_listed_valid;
+	unsigned long pnp_listed;
+	/* number of the cancel requests, see pcsc_cancel() */
+	unsigned long cancels;
+	/* ring of the last events, events[seq % PCSC_LISTENER_MAX_EVENTS] being
+	 * the next one to be written */
+	unsigned long seq;
+	struct {
+		size_t reader;	/* index in readers or PCSC_LISTENER_PNP */
+		unsigned int event;
+		/* state of the reader with the event */
+		DWORD state;
+		DWORD atr_len;
+		unsigned char atr[SC_MAX_ATR_SIZE];
+	} events[PCSC_LISTENER_MAX_EVENTS];
 };
+#endif
+
+#ifdef PCSC_STICKY_TRANSACTION
+/* Ends the transactions left open by pcsc_unlock() once they were idle for
+ * transaction_idle_time milliseconds */
+struct pcsc_sticky {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	struct pcsc_private_data *list;
+};
+#endif
+
+#ifdef PCSC_ASYNC_TRANSMIT
+/* Worker thread of a reader for pcsc_transmit_submit() */
+struct pcsc_async {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	sc_reader_t *reader;
+	sc_apdu_t *apdu;
+	int done;
+	int result;
+	sc_apdu_callback_t callback;
+	void *arg;
+};
+#endif
+
+#ifdef PCSC_CONTEXT_POOL
+#define PCSC_CONTEXT_POOL_SIZE 4
+
+/* PC/SC contexts of the released sc_context_t, kept for the next one of the
+ * process so that creating a context does not have to establish a new
+ * connection to the PC/SC service. Every entry holds a reference on its
+ * provider library, which the context belongs to. */
+static pthread_mutex_t pcsc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pcsc_pooled_context {
+	char *provider_library;
+	void *dlhandle;
+	SCARDCONTEXT pcsc_ctx;
+	pid_t pid;
+} pcsc_pool[PCSC_CONTEXT_POOL_SIZE];
+#endif
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
+static int refresh_attributes(sc_reader_t *reader, int use_listener);
 
 static DWORD pcsc_reset_action(const char *str)
 {
@@ -244,9 +603,10 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 		case SCARD_W_REMOVED_CARD:
 			return SC_ERROR_CARD_REMOVED;
 		default:
-			/* Translate strange errors from card removal to a proper return code */
-			pcsc_detect_card_presence(reader);
-			if (!(pcsc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			/* Translate strange errors from card removal to a proper return code.
+			 * Ask PC/SC directly, the listener may not have seen the removal yet. */
+			if (refresh_attributes(reader, 0) == SC_SUCCESS
+					&& !(reader->flags & SC_READER_CARD_PRESENT))
 				return SC_ERROR_CARD_REMOVED;
 			return SC_ERROR_TRANSMIT_FAILED;
 		}
@@ -258,10 +618,34 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 	return SC_SUCCESS;
 }
 
+/* Make sure the transmit buffer holds at least len bytes. Buffers are not
+ * shrunk, so a steady-state transmit does not allocate memory. */
+static int pcsc_transmit_buffer(u8 **buf, size_t *buflen, size_t len)
+{
+	u8 *p;
+	size_t size;
+
+	if (*buf != NULL && *buflen >= len)
+		return SC_SUCCESS;
+
+	/* grow in one step to the maximum size of short or extended APDUs */
+	size = len <= SC_MAX_APDU_BUFFER_SIZE ? SC_MAX_APDU_BUFFER_SIZE : SC_MAX_EXT_APDU_BUFFER_SIZE;
+	if (size < len)
+		size = len;
+	/* the APDUs carry PINs and keys */
+	p = sc_mem_secure_alloc(size);
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	sc_mem_secure_free(*buf, *buflen);
+	*buf = p;
+	*buflen = size;
+	return SC_SUCCESS;
+}
+
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t ssize, rsize, rbuflen = 0;
-	u8 *sbuf = NULL, *rbuf = NULL;
+	struct pcsc_private_data *priv = reader->drv_data;
+	size_t ssize = 0, rsize, rbuflen = 0;
 	int r;
 
 	/* we always use a at least 258 byte size big return buffer
@@ -270,47 +654,702 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
+	r = pcsc_transmit_buffer(&priv->rbuf, &priv->rbuf_len, rbuflen);
+	if (r != SC_SUCCESS)
 		goto out;
-	}
 
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	ssize = sc_apdu_get_length(apdu, reader->active_protocol);
+	if (ssize == 0) {
+		r = SC_ERROR_INTERNAL;
+		goto out;
+	}
+	r = pcsc_transmit_buffer(&priv->sbuf, &priv->sbuf_len, ssize);
 	if (r != SC_SUCCESS)
 		goto out;
+	if (sc_apdu2bytes(reader->ctx, apdu, reader->active_protocol, priv->sbuf, ssize) != SC_SUCCESS) {
+		r = SC_ERROR_INTERNAL;
+		goto out;
+	}
 	if (reader->name)
 		sc_log(reader->ctx, "reader '%s'", reader->name);
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->sbuf, ssize, 1);
 
-	r = pcsc_internal_transmit(reader, sbuf, ssize,
-				rbuf, &rsize, apdu->control);
+	r = pcsc_internal_transmit(reader, priv->sbuf, ssize,
+				priv->rbuf, &rsize, apdu->control);
 	if (r < 0) {
 		/* unable to transmit ... most likely a reader problem */
 		sc_log(reader->ctx, "unable to transmit");
 		goto out;
 	}
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->rbuf, rsize, 0);
 	/* set response */
-	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+	r = sc_apdu_set_resp(reader->ctx, apdu, priv->rbuf, rsize);
 
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
+	if (priv->sbuf != NULL)
+		sc_mem_clear(priv->sbuf, ssize <= priv->sbuf_len ? ssize : priv->sbuf_len);
+	if (priv->rbuf != NULL)
+		sc_mem_clear(priv->rbuf, rbuflen <= priv->rbuf_len ? rbuflen : priv->rbuf_len);
+
+	return r;
+}
+
+/* Encodes all APDUs up front into one buffer and sends them back to back,
+ * stopping after the first one that did not return 90 00 */
+static int pcsc_transmit_batch(sc_reader_t *reader, sc_apdu_t *apdus, size_t count)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	size_t ssize = 0, rbuflen = 258, rsize, len, off, i, n = 0;
+	int r;
+
+	for (i = 0; i < count; i++) {
+		len = sc_apdu_get_length(&apdus[i], reader->active_protocol);
+		if (len == 0)
+			return SC_ERROR_INTERNAL;
+		ssize += len;
+		if (apdus[i].resplen + 2 > rbuflen)
+			rbuflen = apdus[i].resplen + 2;
 	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
+	r = pcsc_transmit_buffer(&priv->rbuf, &priv->rbuf_len, rbuflen);
+	if (r != SC_SUCCESS)
+		return r;
+	r = pcsc_transmit_buffer(&priv->sbuf, &priv->sbuf_len, ssize);
+	if (r != SC_SUCCESS)
+		return r;
+	for (i = 0, off = 0; i < count; i++, off += len) {
+		len = sc_apdu_get_length(&apdus[i], reader->active_protocol);
+		if (sc_apdu2bytes(reader->ctx, &apdus[i], reader->active_protocol,
+					priv->sbuf + off, len) != SC_SUCCESS) {
+			r = SC_ERROR_INTERNAL;
+			goto out;
+		}
 	}
 
+	if (reader->name)
+		sc_log(reader->ctx, "reader '%s', %"SC_FORMAT_LEN_SIZE_T"u APDUs", reader->name, count);
+	for (i = 0, off = 0; i < count; i++, off += len) {
+		len = sc_apdu_get_length(&apdus[i], reader->active_protocol);
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->sbuf + off, len, 1);
+
+		rsize = apdus[i].resplen <= 256 ? 258 : apdus[i].resplen + 2;
+		r = pcsc_internal_transmit(reader, priv->sbuf + off, len,
+					priv->rbuf, &rsize, apdus[i].control);
+		if (r < 0) {
+			sc_log(reader->ctx, "unable to transmit");
+			goto out;
+		}
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->rbuf, rsize, 0);
+		r = sc_apdu_set_resp(reader->ctx, &apdus[i], priv->rbuf, rsize);
+		sc_mem_clear(priv->rbuf, rsize);
+		if (r != SC_SUCCESS)
+			goto out;
+		n++;
+		if (apdus[i].sw1 != 0x90 || apdus[i].sw2 != 0x00)
+			break;
+	}
+	r = (int) n;
+
+out:
+	sc_mem_clear(priv->sbuf, ssize);
+	sc_mem_clear(priv->rbuf, rbuflen);
+
 	return r;
 }
 
+/* Events that a change of the reader state from prev_state to state means */
+static unsigned int pcsc_state_events(DWORD prev_state, DWORD state)
+{
+	unsigned int events = 0;
+
+	if ((state & SCARD_STATE_PRESENT) && !(prev_state & SCARD_STATE_PRESENT))
+		events |= SC_EVENT_CARD_INSERTED;
+	if ((prev_state & SCARD_STATE_PRESENT) && !(state & SCARD_STATE_PRESENT))
+		events |= SC_EVENT_CARD_REMOVED;
+	if ((state & SCARD_STATE_UNKNOWN) && !(prev_state & SCARD_STATE_UNKNOWN))
+		events |= SC_EVENT_READER_DETACHED;
+	if ((prev_state & SCARD_STATE_UNKNOWN) && !(state & SCARD_STATE_UNKNOWN))
+		events |= SC_EVENT_READER_ATTACHED;
+
+	return events;
+}
+
+#ifdef PCSC_STATE_LISTENER
+/* Called with the listener locked, after the state of the reader was
+ * updated */
+static void pcsc_listener_push(struct pcsc_state_listener *l, size_t reader,
+		unsigned int event)
+{
+	size_t i = l->seq % PCSC_LISTENER_MAX_EVENTS;
+
+	l->events[i].reader = reader;
+	l->events[i].event = event;
+	if (reader == PCSC_LISTENER_PNP) {
+		l->events[i].state = 0;
+		l->events[i].atr_len = 0;
+	} else {
+		l->events[i].state = l->readers[reader].state;
+		l->events[i].atr_len = l->readers[reader].atr_len;
+		memcpy(l->events[i].atr, l->readers[reader].atr, l->readers[reader].atr_len);
+	}
+	l->seq++;
+}
+
+static void *pcsc_listener_thread(void *arg)
+{
+	struct pcsc_global_private_data *gpriv = arg;
+	struct pcsc_state_listener *l = gpriv->listener;
+	SCARD_READERSTATE states[PCSC_LISTENER_MAX_READERS + 1];
+	size_t map[PCSC_LISTENER_MAX_READERS];
+	unsigned int event;
+	unsigned long seq;
+	size_t i, k, count, num_watch;
+	DWORD state;
+	LONG rv;
+
+	pthread_mutex_lock(&l->lock);
+	while (!l->stop) {
+		memset(states, 0, sizeof states);
+		for (i = 0, count = 0; i < l->count; i++) {
+			if (l->readers[i].removed)
+				continue;
+			map[count] = i;
+			states[count].szReader = l->readers[i].name;
+			states[count].dwCurrentState = l->readers[i].valid ?
+				l->readers[i].state : SCARD_STATE_UNAWARE;
+			count++;
+		}
+		num_watch = count;
+		if (l->watch_pnp) {
+			states[num_watch].szReader = PCSC_PNP_NOTIFICATION;
+			states[num_watch].dwCurrentState = l->pnp_valid ?
+				l->pnp_state : SCARD_STATE_UNAWARE;
+			num_watch++;
+		}
+		pthread_mutex_unlock(&l->lock);
+
+		rv = gpriv->SCardGetStatusChange(l->pcsc_ctx, INFINITE, states, num_watch);
+
+		pthread_mutex_lock(&l->lock);
+		if (rv == SCARD_S_SUCCESS) {
+			seq = l->seq;
+			for (k = 0; k < count; k++) {
+				i = map[k];
+				if (l->readers[i].removed)
+					continue;
+				state = states[k].dwEventState & ~SCARD_STATE_CHANGED;
+				event = l->readers[i].valid ?
+					pcsc_state_events(l->readers[i].state, state) : 0;
+				l->readers[i].state = state;
+				l->readers[i].atr_len = states[k].cbAtr;
+				if (l->readers[i].atr_len > SC_MAX_ATR_SIZE)
+					l->readers[i].atr_len = SC_MAX_ATR_SIZE;
+				memcpy(l->readers[i].atr, states[k].rgbAtr, l->readers[i].atr_len);
+				l->readers[i].valid = 1;
+				if (event)
+					pcsc_listener_push(l, i, event);
+			}
+			if (l->watch_pnp) {
+				if (l->pnp_valid && (states[count].dwEventState & SCARD_STATE_CHANGED)) {
+					l->pnp_changes++;
+					pcsc_listener_push(l, PCSC_LISTENER_PNP, SC_EVENT_READER_ATTACHED);
+				}
+				l->pnp_state = states[count].dwEventState & ~SCARD_STATE_CHANGED;
+				l->pnp_valid = 1;
+			}
+			if (l->seq != seq)
+				pthread_cond_broadcast(&l->cond);
+		} else if (rv != (LONG)SCARD_E_TIMEOUT && rv != (LONG)SCARD_E_CANCELLED) {
+			/* Service gone or similar: let the callers query PC/SC again */
+			break;
+		}
+	}
+	for (i = 0; i < l->count; i++)
+		l->readers[i].valid = 0;
+	l->pnp_valid = 0;
+	l->pnp_listed_valid = 0;
+	l->running = 0;
+	/* waiters fall back to PC/SC */
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->lock);
+
+	return NULL;
+}
+
+/* Starts watching the reader (if name is given); the thread is (re)started
+ * when needed. Called with the context of the caller, ie. not from the listener. */
+static void pcsc_listener_add(sc_context_t *ctx, const char *name)
+{
+	struct pcsc_global_private_data *gpriv = ctx->reader_drv_data;
+	struct pcsc_state_listener *l;
+	size_t i;
+	LONG rv;
+
+	if (!gpriv || !gpriv->enable_state_listener || gpriv->cardmod)
+		return;
+
+	if (gpriv->listener == NULL) {
+		if (name == NULL)
+			return;
+		l = calloc(1, sizeof *l);
+		if (l == NULL)
+			return;
+		if (pthread_mutex_init(&l->lock, NULL) != 0) {
+			free(l);
+			return;
+		}
+		if (pthread_cond_init(&l->cond, NULL) != 0) {
+			pthread_mutex_destroy(&l->lock);
+			free(l);
+			return;
+		}
+		l->pcsc_ctx = -1;
+#ifndef __APPLE__
+		/* OS X 10.6.2 - 10.12.6 do not support PnP notification */
+		l->watch_pnp = 1;
+#endif
+		gpriv->listener = l;
+	}
+	l = gpriv->listener;
+
+	pthread_mutex_lock(&l->lock);
+	for (i = 0; name && i < l->count; i++)
+		if (!strcmp(l->readers[i].name, name))
+			break;
+	if (name && i < l->count) {
+		/* reattached */
+		l->readers[i].removed = 0;
+	} else if (name && l->count < PCSC_LISTENER_MAX_READERS) {
+		l->readers[i].name = strdup(name);
+		if (l->readers[i].name != NULL)
+			l->count++;
+	}
+	if (l->running) {
+		pthread_mutex_unlock(&l->lock);
+		/* wake up the listener to include the new reader */
+		if (name)
+			gpriv->SCardCancel(l->pcsc_ctx);
+		return;
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	if (l->count == 0)
+		return;
+	if (l->started) {
+		/* the listener gave up earlier */
+		pthread_join(l->thread, NULL);
+		l->started = 0;
+	}
+	if (l->pcsc_ctx != (SCARDCONTEXT)-1) {
+		gpriv->SCardReleaseContext(l->pcsc_ctx);
+		l->pcsc_ctx = -1;
+	}
+	rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &l->pcsc_ctx);
+	if (rv != SCARD_S_SUCCESS) {
+		PCSC_LOG(ctx, "SCardEstablishContext(listener) failed", rv);
+		l->pcsc_ctx = -1;
+		return;
+	}
+	l->stop = 0;
+	l->running = 1;
+	if (pthread_create(&l->thread, NULL, pcsc_listener_thread, gpriv) != 0) {
+		sc_log(ctx, "Failed to start the PC/SC state listener");
+		l->running = 0;
+		return;
+	}
+	l->started = 1;
+	sc_log(ctx, "PC/SC state listener watching %"SC_FORMAT_LEN_SIZE_T"u readers", l->count);
+}
+
+/* Stops watching a reader that is gone */
+static void pcsc_listener_remove(sc_context_t *ctx, const char *name)
+{
+	struct pcsc_global_private_data *gpriv = ctx->reader_drv_data;
+	struct pcsc_state_listener *l = gpriv->listener;
+	size_t i;
+	int running = 0;
+
+	if (l == NULL)
+		return;
+
+	pthread_mutex_lock(&l->lock);
+	for (i = 0; i < l->count; i++) {
+		if (!l->readers[i].removed && !strcmp(l->readers[i].name, name)) {
+			l->readers[i].removed = 1;
+			l->readers[i].valid = 0;
+			running = l->running;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	/* PC/SC refuses to wait for an unknown reader, so the listener has to
+	 * start over without it */
+	if (running)
+		gpriv->SCardCancel(l->pcsc_ctx);
+}
+
+static void pcsc_listener_release(sc_context_t *ctx)
+{
+	struct pcsc_global_private_data *gpriv = ctx->reader_drv_data;
+	struct pcsc_state_listener *l = gpriv->listener;
+	size_t i;
+
+	if (l == NULL)
+		return;
+	if (ctx->flags & SC_CTX_FLAG_TERMINATE) {
+		/* after fork() the thread is gone and PC/SC must not be called */
+		return;
+	}
+
+	if (l->started) {
+		pthread_mutex_lock(&l->lock);
+		l->stop = 1;
+		while (l->running) {
+			/* a cancel may come before the listener is waiting again */
+			pthread_mutex_unlock(&l->lock);
+			gpriv->SCardCancel(l->pcsc_ctx);
+			msleep(10);
+			pthread_mutex_lock(&l->lock);
+		}
+		pthread_mutex_unlock(&l->lock);
+		pthread_join(l->thread, NULL);
+	}
+	if (l->pcsc_ctx != (SCARDCONTEXT)-1)
+		gpriv->SCardReleaseContext(l->pcsc_ctx);
+	for (i = 0; i < l->count; i++)
+		free(l->readers[i].name);
+	pthread_cond_destroy(&l->cond);
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+	gpriv->listener = NULL;
+}
+
+/* Copies the state seen by the listener to reader_state.dwEventState.
+ * Returns 0 if the state is not known and PC/SC has to be asked. */
+static int pcsc_listener_get_state(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_state_listener *l = priv->gpriv->listener;
+	size_t i;
+	int found = 0;
+
+	if (l == NULL)
+		return 0;
+
+	pthread_mutex_lock(&l->lock);
+	for (i = 0; i < l->count; i++) {
+		if (l->readers[i].valid && !strcmp(l->readers[i].name, reader->name)) {
+			priv->reader_state.dwEventState = l->readers[i].state;
+			priv->reader_state.cbAtr = l->readers[i].atr_len;
+			memcpy(priv->reader_state.rgbAtr, l->readers[i].atr, l->readers[i].atr_len);
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	return found;
+}
+
+/* Whether the listener follows all the readers of the context. Called with
+ * the listener locked. */
+static int pcsc_listener_watches_all(sc_context_t *ctx, struct pcsc_state_listener *l)
+{
+	sc_reader_t *reader;
+	unsigned int i;
+	size_t j;
+
+	if (!l->running)
+		return 0;
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		reader = sc_ctx_get_reader(ctx, i);
+		if (reader->flags & SC_READER_REMOVED)
+			continue;
+		for (j = 0; j < l->count; j++)
+			if (l->readers[j].valid && !strcmp(l->readers[j].name, reader->name))
+				break;
+		if (j == l->count)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Waits for the events recorded by the listener, see pcsc_wait_for_event().
+ * Returns SC_ERROR_NOT_SUPPORTED if the listener cannot tell about all
+ * the readers and PC/SC has to be asked. */
+static int pcsc_listener_wait(sc_context_t *ctx, unsigned int event_mask,
+		struct sc_reader_event *ev, int timeout, void **reader_states)
+{
+	struct pcsc_global_private_data *gpriv = ctx->reader_drv_data;
+	struct pcsc_state_listener *l = gpriv->listener;
+	struct pcsc_wait_states *ws = reader_states ? *reader_states : NULL;
+	const char *name = NULL;
+	unsigned long seq, cancels;
+	struct timeval now;
+	struct timespec until;
+	size_t reader, i = 0;
+	int r;
+
+	if (l == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if (timeout > 0) {
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec + timeout / 1000;
+		until.tv_nsec = now.tv_usec * 1000 + (long) (timeout % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&l->lock);
+	if (!pcsc_listener_watches_all(ctx, l)
+			|| ((event_mask & SC_EVENT_READER_ATTACHED) && !l->pnp_valid)) {
+		pthread_mutex_unlock(&l->lock);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	seq = ws && ws->listener ? ws->seq : l->seq;
+	cancels = l->cancels;
+
+	ev->event = 0;
+	for (;;) {
+		if (l->seq - seq > PCSC_LISTENER_MAX_EVENTS) {
+			sc_log(ctx, "%lu events were missed", l->seq - seq - PCSC_LISTENER_MAX_EVENTS);
+			seq = l->seq - PCSC_LISTENER_MAX_EVENTS;
+		}
+		while (seq != l->seq && !(ev->event & event_mask)) {
+			i = seq % PCSC_LISTENER_MAX_EVENTS;
+			reader = l->events[i].reader;
+			ev->event = l->events[i].event;
+			/* the names stay until the listener is released */
+			name = reader == PCSC_LISTENER_PNP ? NULL : l->readers[reader].name;
+			seq++;
+		}
+		if (ev->event & event_mask) {
+			if (l->events[i].state & SCARD_STATE_PRESENT)
+				ev->flags = SC_READER_CARD_PRESENT;
+			ev->atr.len = l->events[i].atr_len;
+			memcpy(ev->atr.value, l->events[i].atr, ev->atr.len);
+			r = SC_SUCCESS;
+			break;
+		}
+		ev->event = 0;
+		if (!l->running) {
+			r = SC_ERROR_NOT_SUPPORTED;
+			break;
+		}
+		if (l->cancels != cancels || timeout == 0) {
+			r = SC_ERROR_EVENT_TIMEOUT;
+			break;
+		}
+		if (timeout < 0)
+			pthread_cond_wait(&l->cond, &l->lock);
+		else if (pthread_cond_timedwait(&l->cond, &l->lock, &until) != 0)
+			/* take what came in meanwhile, then time out */
+			timeout = 0;
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	if (r == SC_SUCCESS) {
+		sc_log(ctx, "Matching event 0x%02X in reader %s", ev->event, name ? name : "(PnP)");
+		ev->reader = name ? sc_ctx_get_reader_by_name(ctx, name) : NULL;
+	}
+
+	if (reader_states && r != SC_ERROR_NOT_SUPPORTED) {
+		if (ws != NULL && !ws->listener) {
+			free(ws);
+			ws = NULL;
+		}
+		if (ws == NULL)
+			ws = calloc(1, sizeof *ws);
+		if (ws != NULL) {
+			ws->listener = 1;
+			ws->seq = seq;
+		}
+		*reader_states = ws;
+	}
+
+	return r;
+}
+
+/* Whether the reader list is unchanged since pcsc_detect_readers() last
+ * asked PC/SC for it, as far as the listener can tell. Otherwise, what is to
+ * be given to pcsc_listener_readers_listed() once the readers are listed. */
+static int pcsc_listener_readers_known(struct pcsc_global_private_data *gpriv,
+		int *pnp_valid, unsigned long *pnp_changes)
+{
+	struct pcsc_state_listener *l = gpriv->listener;
+	int known;
+
+	*pnp_valid = 0;
+	if (l == NULL)
+		return 0;
+
+	pthread_mutex_lock(&l->lock);
+	*pnp_valid = l->running && l->pnp_valid;
+	*pnp_changes = l->pnp_changes;
+	known = *pnp_valid && l->pnp_listed_valid && l->pnp_listed == l->pnp_changes;
+	pthread_mutex_unlock(&l->lock);
+
+	return known;
+}
+
+static void pcsc_listener_readers_listed(struct pcsc_global_private_data *gpriv,
+		int pnp_valid, unsigned long pnp_changes)
+{
+	struct pcsc_state_listener *l = gpriv->listener;
+
+	if (l == NULL || !pnp_valid)
+		return;
+
+	pthread_mutex_lock(&l->lock);
+	/* a listener restarted meanwhile has pnp_valid reset */
+	if (l->pnp_valid) {
+		l->pnp_listed = pnp_changes;
+		l->pnp_listed_valid = 1;
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+#endif
+
+#ifdef PCSC_ASYNC_TRANSMIT
+static void *pcsc_async_thread(void *arg)
+{
+	struct pcsc_async *a = arg;
+	sc_apdu_callback_t callback;
+	sc_apdu_t *apdu;
+	int r;
+
+	pthread_mutex_lock(&a->lock);
+	while (!a->stop) {
+		if (a->apdu == NULL || a->done) {
+			pthread_cond_wait(&a->cond, &a->lock);
+			continue;
+		}
+		apdu = a->apdu;
+		pthread_mutex_unlock(&a->lock);
+
+		r = pcsc_transmit(a->reader, apdu);
+
+		pthread_mutex_lock(&a->lock);
+		a->result = r;
+		a->done = 1;
+		callback = a->callback;
+		arg = a->arg;
+		pthread_cond_broadcast(&a->cond);
+		if (callback != NULL) {
+			pthread_mutex_unlock(&a->lock);
+			callback(apdu, arg);
+			pthread_mutex_lock(&a->lock);
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+static int pcsc_transmit_submit(sc_reader_t *reader, sc_apdu_t *apdu,
+		sc_apdu_callback_t callback, void *arg)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_async *a = priv->async;
+	int r = SC_SUCCESS;
+
+	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
+		return SC_ERROR_NOT_ALLOWED;
+
+	if (a == NULL) {
+		a = calloc(1, sizeof *a);
+		if (a == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		a->reader = reader;
+		if (pthread_mutex_init(&a->lock, NULL) != 0) {
+			free(a);
+			return SC_ERROR_INTERNAL;
+		}
+		if (pthread_cond_init(&a->cond, NULL) != 0) {
+			pthread_mutex_destroy(&a->lock);
+			free(a);
+			return SC_ERROR_INTERNAL;
+		}
+		if (pthread_create(&a->thread, NULL, pcsc_async_thread, a) != 0) {
+			pthread_cond_destroy(&a->cond);
+			pthread_mutex_destroy(&a->lock);
+			free(a);
+			sc_log(reader->ctx, "Failed to start the transmit thread");
+			return SC_ERROR_INTERNAL;
+		}
+		priv->async = a;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	if (a->apdu != NULL) {
+		r = SC_ERROR_NOT_ALLOWED;
+	} else {
+		a->apdu = apdu;
+		a->done = 0;
+		a->callback = callback;
+		a->arg = arg;
+		pthread_cond_broadcast(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return r;
+}
+
+static int pcsc_transmit_wait(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_async *a = priv->async;
+	int r;
+
+	if (a == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	pthread_mutex_lock(&a->lock);
+	if (a->apdu != apdu) {
+		pthread_mutex_unlock(&a->lock);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+	while (!a->done)
+		pthread_cond_wait(&a->cond, &a->lock);
+	r = a->result;
+	a->apdu = NULL;
+	a->done = 0;
+	pthread_mutex_unlock(&a->lock);
+
+	return r;
+}
+
+static void pcsc_async_release(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_async *a = priv->async;
+
+	/* after fork() the thread is gone */
+	if (a == NULL || (reader->ctx->flags & SC_CTX_FLAG_TERMINATE))
+		return;
+
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+	priv->async = NULL;
+}
+#endif
+
 /* Calls SCardGetStatusChange on the reader to set ATR and associated flags
- * (card present/changed) */
-static int refresh_attributes(sc_reader_t *reader)
+ * (card present/changed). With use_listener, the state recorded by the
+ * background listener is used instead, if there is one. */
+static int refresh_attributes(sc_reader_t *reader, int use_listener)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 	int old_flags = reader->flags;
@@ -330,6 +1369,14 @@ static int refresh_attributes(sc_reader_t *reader)
 		priv->reader_state.dwCurrentState = priv->reader_state.dwEventState;
 	}
 
+#ifdef PCSC_STATE_LISTENER
+	if (use_listener && pcsc_listener_get_state(reader)) {
+		if (priv->reader_state.dwEventState == priv->reader_state.dwCurrentState)
+			rv = SCARD_E_TIMEOUT;
+		else
+			rv = SCARD_S_SUCCESS;
+	} else
+#endif
 	rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
 
 	if (rv != SCARD_S_SUCCESS) {
@@ -411,7 +1458,7 @@ static int pcsc_detect_card_presence(sc_reader_t *reader)
 	int rv;
 	LOG_FUNC_CALLED(reader->ctx);
 
-	rv = refresh_attributes(reader);
+	rv = refresh_attributes(reader, 1);
 	if (rv != SC_SUCCESS)
 		LOG_FUNC_RETURN(reader->ctx, rv);
 	LOG_FUNC_RETURN(reader->ctx, reader->flags);
@@ -462,7 +1509,7 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 
 	sc_log(reader->ctx, "Reconnecting to the card...");
 
-	r = refresh_attributes(reader);
+	r = refresh_attributes(reader, 0);
 	if (r!= SC_SUCCESS)
 		return r;
 
@@ -495,6 +1542,9 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 
 static void initialize_uid(sc_reader_t *reader)
 {
+	/* the UID of the previous card must not be taken for this one */
+	reader->uid.len = 0;
+
 	if (reader->flags & SC_READER_ENABLE_ESCAPE) {
 		sc_apdu_t apdu;
 		/* though we only expect 10 bytes max, we want to set the Le to 0x00 to not
@@ -523,6 +1573,37 @@ static void initialize_uid(sc_reader_t *reader)
 	}
 }
 
+/* Readers announce their contactless interface in the name, e.g.
+ * "ACS ACR122U PICC Interface" or "Identiv uTrust 3700 F CL Reader" */
+static const char *pcsc_contactless_names[] = {
+	"Contactless", "contactless", "PICC", "NFC", "RFID", " CL ", "-CL ", NULL
+};
+
+/* Tags the reader with SC_READER_CAP_CONTACTLESS when the card answered
+ * the GET UID of PC/SC pt. 3 or the reader name says it is contactless.
+ * Every APDU costs a radio round trip then, which the upper layers
+ * may use to trade a few defaults for fewer APDUs. */
+static void initialize_contactless(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	int i;
+
+	reader->capabilities &= ~SC_READER_CAP_CONTACTLESS;
+	if (!priv->gpriv->enable_contactless)
+		return;
+
+	if (reader->uid.len == 0) {
+		for (i = 0; pcsc_contactless_names[i] != NULL; i++)
+			if (strstr(reader->name, pcsc_contactless_names[i]))
+				break;
+		if (pcsc_contactless_names[i] == NULL)
+			return;
+	}
+
+	sc_log(reader->ctx, "%s: card is accessed contactless", reader->name);
+	reader->capabilities |= SC_READER_CAP_CONTACTLESS;
+}
+
 static int pcsc_connect(sc_reader_t *reader)
 {
 	DWORD active_proto, tmp, protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
@@ -533,7 +1614,7 @@ static int pcsc_connect(sc_reader_t *reader)
 
 	LOG_FUNC_CALLED(reader->ctx);
 
-	r = refresh_attributes(reader);
+	r = refresh_attributes(reader, 0);
 	if (r != SC_SUCCESS)
 		LOG_FUNC_RETURN(reader->ctx, r);
 
@@ -582,6 +1663,7 @@ static int pcsc_connect(sc_reader_t *reader)
 	} else {
 		initialize_uid(reader);
 	}
+	initialize_contactless(reader);
 
 	/* After connect reader is not locked yet */
 	priv->locked = 0;
@@ -589,10 +1671,168 @@ static int pcsc_connect(sc_reader_t *reader)
 	return SC_SUCCESS;
 }
 
+#ifdef PCSC_STICKY_TRANSACTION
+/* Called with the sticky lock held */
+static void pcsc_sticky_unlink(struct pcsc_private_data *priv)
+{
+	struct pcsc_private_data **p;
+
+	for (p = &priv->gpriv->sticky->list; *p != NULL; p = &(*p)->sticky_next) {
+		if (*p == priv) {
+			*p = priv->sticky_next;
+			break;
+		}
+	}
+	priv->sticky_next = NULL;
+	priv->sticky = 0;
+}
+
+static void *pcsc_sticky_thread(void *arg)
+{
+	struct pcsc_global_private_data *gpriv = arg;
+	struct pcsc_sticky *s = gpriv->sticky;
+	struct pcsc_private_data *priv, *next, *first;
+	struct timeval now;
+	struct timespec until;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop) {
+		gettimeofday(&now, NULL);
+		first = NULL;
+		for (priv = s->list; priv != NULL; priv = next) {
+			next = priv->sticky_next;
+			if (!timercmp(&priv->sticky_until, &now, >)) {
+				pcsc_sticky_unlink(priv);
+				gpriv->SCardEndTransaction(priv->pcsc_card,
+						gpriv->transaction_end_action);
+			} else if (first == NULL
+					|| timercmp(&priv->sticky_until, &first->sticky_until, <)) {
+				first = priv;
+			}
+		}
+		if (first != NULL) {
+			until.tv_sec = first->sticky_until.tv_sec;
+			until.tv_nsec = first->sticky_until.tv_usec * 1000;
+			pthread_cond_timedwait(&s->cond, &s->lock, &until);
+		} else {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/* Keeps the transaction of the reader open for transaction_idle_time.
+ * Returns 0 if the transaction has to be ended now. */
+static int pcsc_sticky_keep(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	struct pcsc_sticky *s = gpriv->sticky;
+	struct timeval idle;
+
+	if (gpriv->transaction_idle_time <= 0 || !priv->locked)
+		return 0;
+
+	if (s == NULL) {
+		s = calloc(1, sizeof *s);
+		if (s == NULL)
+			return 0;
+		if (pthread_mutex_init(&s->lock, NULL) != 0) {
+			free(s);
+			return 0;
+		}
+		if (pthread_cond_init(&s->cond, NULL) != 0) {
+			pthread_mutex_destroy(&s->lock);
+			free(s);
+			return 0;
+		}
+		gpriv->sticky = s;
+		if (pthread_create(&s->thread, NULL, pcsc_sticky_thread, gpriv) != 0) {
+			sc_log(reader->ctx, "Failed to start the PC/SC transaction timer");
+			gpriv->sticky = NULL;
+			pthread_cond_destroy(&s->cond);
+			pthread_mutex_destroy(&s->lock);
+			free(s);
+			gpriv->transaction_idle_time = 0;
+			return 0;
+		}
+	}
+
+	idle.tv_sec = gpriv->transaction_idle_time / 1000;
+	idle.tv_usec = (gpriv->transaction_idle_time % 1000) * 1000;
+
+	pthread_mutex_lock(&s->lock);
+	gettimeofday(&priv->sticky_until, NULL);
+	timeradd(&priv->sticky_until, &idle, &priv->sticky_until);
+	priv->sticky = 1;
+	priv->sticky_next = s->list;
+	s->list = priv;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return 1;
+}
+
+/* Takes back a transaction kept open by pcsc_sticky_keep(). Returns 1 if
+ * the reader is still in the transaction. */
+static int pcsc_sticky_reclaim(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_sticky *s = priv->gpriv->sticky;
+	int r;
+
+	if (s == NULL)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	r = priv->sticky;
+	if (r)
+		pcsc_sticky_unlink(priv);
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+/* Ends a transaction kept open by pcsc_sticky_keep() right away */
+static void pcsc_sticky_end(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	if (pcsc_sticky_reclaim(reader) && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE))
+		priv->gpriv->SCardEndTransaction(priv->pcsc_card,
+				priv->gpriv->transaction_end_action);
+}
+
+static void pcsc_sticky_release(sc_context_t *ctx)
+{
+	struct pcsc_global_private_data *gpriv = ctx->reader_drv_data;
+	struct pcsc_sticky *s = gpriv->sticky;
+
+	if (s == NULL || (ctx->flags & SC_CTX_FLAG_TERMINATE))
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+	gpriv->sticky = NULL;
+}
+#endif
+
 static int pcsc_disconnect(sc_reader_t * reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+#ifdef PCSC_STICKY_TRANSACTION
+	pcsc_sticky_end(reader);
+#endif
 	if (!priv->gpriv->cardmod && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE)) {
 		LONG rv = priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 		PCSC_TRACE(reader, "SCardDisconnect returned", rv);
@@ -615,6 +1855,14 @@ static int pcsc_lock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef PCSC_STICKY_TRANSACTION
+	if (pcsc_sticky_reclaim(reader)) {
+		sc_log(reader->ctx, "%s: continuing the open transaction", reader->name);
+		priv->locked = 1;
+		return SC_SUCCESS;
+	}
+#endif
+
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 
@@ -665,6 +1913,13 @@ static int pcsc_unlock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef PCSC_STICKY_TRANSACTION
+	if (pcsc_sticky_keep(reader)) {
+		priv->locked = 0;
+		return SC_SUCCESS;
+	}
+#endif
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -679,6 +1934,14 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+#ifdef PCSC_ASYNC_TRANSMIT
+	pcsc_async_release(reader);
+#endif
+#ifdef PCSC_STICKY_TRANSACTION
+	pcsc_sticky_end(reader);
+#endif
+	sc_mem_secure_free(priv->sbuf, priv->sbuf_len);
+	sc_mem_secure_free(priv->rbuf, priv->rbuf_len);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -715,6 +1978,15 @@ static int pcsc_cancel(sc_context_t *ctx)
 	if (ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef PCSC_STATE_LISTENER
+	if (gpriv->listener != NULL) {
+		/* wake up the callers waiting for listener events */
+		pthread_mutex_lock(&gpriv->listener->lock);
+		gpriv->listener->cancels++;
+		pthread_cond_broadcast(&gpriv->listener->cond);
+		pthread_mutex_unlock(&gpriv->listener->lock);
+	}
+#endif
 #ifndef _WIN32
 	if (gpriv->pcsc_wait_ctx != -1) {
 		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
@@ -743,6 +2015,69 @@ static struct sc_reader_driver pcsc_drv = {
 	NULL
 };
 
+#ifdef PCSC_CONTEXT_POOL
+/* Takes a pooled PC/SC context of the same provider library, if any */
+static void pcsc_pool_get(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	pid_t pid = getpid();
+	size_t i;
+
+	pthread_mutex_lock(&pcsc_pool_lock);
+	for (i = 0; i < PCSC_CONTEXT_POOL_SIZE; i++) {
+		struct pcsc_pooled_context *p = &pcsc_pool[i];
+
+		if (p->provider_library == NULL)
+			continue;
+		if (p->pid == pid) {
+			if (gpriv->pcsc_ctx != (SCARDCONTEXT)-1
+					|| strcmp(p->provider_library, gpriv->provider_library))
+				continue;
+			gpriv->pcsc_ctx = p->pcsc_ctx;
+		}
+		/* the contexts inherited through fork() are dropped without
+		 * being released, they belong to the parent */
+		sc_dlclose(p->dlhandle);
+		free(p->provider_library);
+		memset(p, 0, sizeof(*p));
+	}
+	pthread_mutex_unlock(&pcsc_pool_lock);
+
+	if (gpriv->pcsc_ctx != (SCARDCONTEXT)-1)
+		sc_log(ctx, "Reusing a pooled PC/SC context");
+}
+
+/* Returns the PC/SC context to the pool. Returns 0 if the pool is full and
+ * the context has to be released by the caller. */
+static int pcsc_pool_put(struct pcsc_global_private_data *gpriv)
+{
+	struct pcsc_pooled_context *p = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&pcsc_pool_lock);
+	for (i = 0; i < PCSC_CONTEXT_POOL_SIZE && p == NULL; i++) {
+		if (pcsc_pool[i].provider_library == NULL)
+			p = &pcsc_pool[i];
+	}
+	if (p != NULL) {
+		p->provider_library = strdup(gpriv->provider_library);
+		p->dlhandle = sc_dlopen(gpriv->provider_library);
+		if (p->provider_library == NULL || p->dlhandle == NULL) {
+			if (p->dlhandle != NULL)
+				sc_dlclose(p->dlhandle);
+			free(p->provider_library);
+			memset(p, 0, sizeof(*p));
+			p = NULL;
+		} else {
+			p->pcsc_ctx = gpriv->pcsc_ctx;
+			p->pid = getpid();
+		}
+	}
+	pthread_mutex_unlock(&pcsc_pool_lock);
+
+	return p != NULL;
+}
+#endif
+
 static int pcsc_init(sc_context_t *ctx)
 {
 	struct pcsc_global_private_data *gpriv;
@@ -769,6 +2104,7 @@ static int pcsc_init(sc_context_t *ctx)
 	gpriv->enable_pinpad = 1;
 	gpriv->fixed_pinlength = 0;
 	gpriv->enable_pace = 1;
+	gpriv->enable_contactless = 1;
 	gpriv->pcsc_ctx = -1;
 	gpriv->pcsc_wait_ctx = -1;
 	/* max send/receive sizes: if exist in configuration these options overwrite
@@ -794,10 +2130,18 @@ static int pcsc_init(sc_context_t *ctx)
 				gpriv->fixed_pinlength);
 		gpriv->enable_pace = scconf_get_bool(conf_block, "enable_pace",
 				gpriv->enable_pace);
+		gpriv->enable_contactless = scconf_get_bool(conf_block,
+				"enable_contactless", gpriv->enable_contactless);
+		gpriv->enable_state_listener = scconf_get_bool(conf_block,
+				"enable_state_listener", gpriv->enable_state_listener);
+		gpriv->transaction_idle_time = scconf_get_int(conf_block,
+				"transaction_idle_time", gpriv->transaction_idle_time);
 		gpriv->force_max_send_size = scconf_get_int(conf_block,
 				"max_send_size", gpriv->force_max_send_size);
 		gpriv->force_max_recv_size = scconf_get_int(conf_block,
 				"max_recv_size", gpriv->force_max_recv_size);
+		gpriv->cache_features = scconf_get_bool(conf_block,
+				"cache_features", gpriv->cache_features);
 	}
 
 	if (gpriv->cardmod) {
@@ -808,15 +2152,18 @@ static int pcsc_init(sc_context_t *ctx)
 		gpriv->disconnect_action = SCARD_LEAVE_CARD;
 		gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 		gpriv->reconnect_action = SCARD_LEAVE_CARD;
+		gpriv->transaction_idle_time = 0;
 	}
 	sc_log(ctx,
 			"PC/SC options: connect_exclusive=%d disconnect_action=%u transaction_end_action=%u"
-			" reconnect_action=%u enable_pinpad=%d enable_pace=%d",
+			" reconnect_action=%u enable_pinpad=%d enable_pace=%d"
+			" enable_state_listener=%d transaction_idle_time=%d cache_features=%d",
 			gpriv->connect_exclusive,
 			(unsigned int)gpriv->disconnect_action,
 			(unsigned int)gpriv->transaction_end_action,
 			(unsigned int)gpriv->reconnect_action, gpriv->enable_pinpad,
-			gpriv->enable_pace);
+			gpriv->enable_pace, gpriv->enable_state_listener,
+			gpriv->transaction_idle_time, gpriv->cache_features);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -878,6 +2225,13 @@ static int pcsc_init(sc_context_t *ctx)
 		goto out;
 	}
 
+#ifdef PCSC_CONTEXT_POOL
+	if (!gpriv->cardmod)
+		pcsc_pool_get(ctx, gpriv);
+#endif
+	if (gpriv->cache_features)
+		pcsc_features_load(ctx, gpriv);
+
 	ctx->reader_drv_data = gpriv;
 	gpriv = NULL;
 	ret = SC_SUCCESS;
@@ -900,11 +2254,22 @@ static int pcsc_finish(sc_context_t *ctx)
 	LOG_FUNC_CALLED(ctx);
 
 	if (gpriv) {
+#ifdef PCSC_STICKY_TRANSACTION
+		pcsc_sticky_release(ctx);
+#endif
+#ifdef PCSC_STATE_LISTENER
+		pcsc_listener_release(ctx);
+#endif
 		if (!gpriv->cardmod && gpriv->pcsc_ctx != (SCARDCONTEXT)-1 &&
-				!(ctx->flags & SC_CTX_FLAG_TERMINATE))
+				!(ctx->flags & SC_CTX_FLAG_TERMINATE)
+#ifdef PCSC_CONTEXT_POOL
+				&& !pcsc_pool_put(gpriv)
+#endif
+				)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		pcsc_features_free(gpriv);
 		free(gpriv);
 	}
 
@@ -974,6 +2339,45 @@ err:
 static int
 part10_find_property_by_tag(unsigned char buffer[], int length,
 	int tag_searched);
+
+/*
+ * The TLV properties of the reader, read with card_handle or, if NULL, on
+ * the connection of the reader. They are read once and kept.
+ */
+static int part10_get_tlv_properties(sc_reader_t *reader, SCARDHANDLE *card_handle,
+		const u8 **buf, size_t *len)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	int r;
+
+	if (!priv->get_tlv_properties || !priv->gpriv)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if (priv->tlv_properties_len == 0) {
+		size_t rcount = sizeof priv->tlv_properties;
+
+		if (card_handle) {
+			DWORD n = 0;
+
+			if (SCARD_S_SUCCESS != priv->gpriv->SCardControl(*card_handle,
+						priv->get_tlv_properties, NULL, 0, priv->tlv_properties,
+						sizeof priv->tlv_properties, &n))
+				return SC_ERROR_TRANSMIT_FAILED;
+			rcount = n;
+		} else {
+			r = pcsc_internal_transmit(reader, NULL, 0, priv->tlv_properties,
+					&rcount, priv->get_tlv_properties);
+			if (r != SC_SUCCESS)
+				return r;
+		}
+		priv->tlv_properties_len = rcount;
+	}
+
+	*buf = priv->tlv_properties;
+	*len = priv->tlv_properties_len;
+	return SC_SUCCESS;
+}
+
 /**
  * @brief Detects reader's maximum data size
  *
@@ -983,8 +2387,8 @@ part10_find_property_by_tag(unsigned char buffer[], int length,
  */
 static size_t part10_detect_max_data(sc_reader_t *reader, SCARDHANDLE card_handle)
 {
-	u8 rbuf[256];
-	DWORD rcount = sizeof rbuf;
+	const u8 *rbuf;
+	size_t rcount;
 	struct pcsc_private_data *priv = NULL;
 	/* 0 means extended APDU not supported */
 	size_t max_data = 0;
@@ -997,13 +2401,13 @@ static size_t part10_detect_max_data(sc_reader_t *reader, SCARDHANDLE card_handl
 		goto err;
 
 	if (priv->get_tlv_properties && priv->gpriv) {
-		if (SCARD_S_SUCCESS != priv->gpriv->SCardControl(card_handle,
-				priv->get_tlv_properties, NULL, 0, rbuf, sizeof(rbuf), &rcount)) {
+		if (SC_SUCCESS != part10_get_tlv_properties(reader, &card_handle,
+					&rbuf, &rcount)) {
 			sc_log(reader->ctx, "PC/SC v2 part 10: Get TLV properties failed!");
 			goto err;
 		}
 
-		r = part10_find_property_by_tag(rbuf, rcount,
+		r = part10_find_property_by_tag((u8 *) rbuf, (int) rcount,
 				PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize);
 		sc_log(reader->ctx, "get dwMaxAPDUDataSize property returned %i", r);
 
@@ -1018,8 +2422,8 @@ err:
 static int part10_get_vendor_product(struct sc_reader *reader,
 		SCARDHANDLE card_handle, int *id_vendor, int *id_product)
 {
-	u8 rbuf[256];
-	DWORD rcount = sizeof rbuf;
+	const u8 *rbuf;
+	size_t rcount;
 	struct pcsc_private_data *priv;
 	int this_vendor = -1, this_product = -1;
 
@@ -1030,17 +2434,16 @@ static int part10_get_vendor_product(struct sc_reader *reader,
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	if (priv->get_tlv_properties && priv->gpriv) {
-		if (SCARD_S_SUCCESS != priv->gpriv->SCardControl(card_handle,
-					priv->get_tlv_properties, NULL, 0, rbuf, sizeof(rbuf),
-					&rcount)) {
+		if (SC_SUCCESS != part10_get_tlv_properties(reader, &card_handle,
+					&rbuf, &rcount)) {
 			sc_log(reader->ctx,
 					"PC/SC v2 part 10: Get TLV properties failed!");
 			return SC_ERROR_TRANSMIT_FAILED;
 		}
 
-		this_vendor = part10_find_property_by_tag(rbuf, rcount,
+		this_vendor = part10_find_property_by_tag((u8 *) rbuf, (int) rcount,
 				PCSCv2_PART10_PROPERTY_wIdVendor);
-		this_product = part10_find_property_by_tag(rbuf, rcount,
+		this_product = part10_find_property_by_tag((u8 *) rbuf, (int) rcount,
 				PCSCv2_PART10_PROPERTY_wIdProduct);
 	}
 
@@ -1054,6 +2457,83 @@ static int part10_get_vendor_product(struct sc_reader *reader,
 	return SC_SUCCESS;
 }
 
+static void pcsc_features_save(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	struct pcsc_reader_features *f;
+
+	for (f = gpriv->features; f; f = f->next)
+		if (!strcmp(f->name, reader->name))
+			break;
+	if (f == NULL) {
+		f = calloc(1, sizeof *f);
+		if (f == NULL)
+			return;
+		f->name = strdup(reader->name);
+		if (f->name == NULL) {
+			free(f);
+			return;
+		}
+		f->next = gpriv->features;
+		gpriv->features = f;
+	}
+
+	f->verify_ioctl = priv->verify_ioctl;
+	f->verify_ioctl_start = priv->verify_ioctl_start;
+	f->verify_ioctl_finish = priv->verify_ioctl_finish;
+	f->modify_ioctl = priv->modify_ioctl;
+	f->modify_ioctl_start = priv->modify_ioctl_start;
+	f->modify_ioctl_finish = priv->modify_ioctl_finish;
+	f->pace_ioctl = priv->pace_ioctl;
+	f->pin_properties_ioctl = priv->pin_properties_ioctl;
+	f->get_tlv_properties = priv->get_tlv_properties;
+	memcpy(f->tlv_properties, priv->tlv_properties, priv->tlv_properties_len);
+	f->tlv_properties_len = priv->tlv_properties_len;
+	/* found per card by pcsc_connect() */
+	f->capabilities = reader->capabilities & ~SC_READER_CAP_CONTACTLESS;
+	f->max_send_size = reader->max_send_size;
+	f->max_recv_size = reader->max_recv_size;
+	free(f->vendor);
+	f->vendor = reader->vendor ? strdup(reader->vendor) : NULL;
+	f->version_major = reader->version_major;
+	f->version_minor = reader->version_minor;
+}
+
+/* Returns 1 if the reader got the features saved under its name */
+static int pcsc_features_restore(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_reader_features *f;
+
+	for (f = priv->gpriv->features; f; f = f->next)
+		if (!strcmp(f->name, reader->name))
+			break;
+	if (f == NULL)
+		return 0;
+
+	priv->verify_ioctl = f->verify_ioctl;
+	priv->verify_ioctl_start = f->verify_ioctl_start;
+	priv->verify_ioctl_finish = f->verify_ioctl_finish;
+	priv->modify_ioctl = f->modify_ioctl;
+	priv->modify_ioctl_start = f->modify_ioctl_start;
+	priv->modify_ioctl_finish = f->modify_ioctl_finish;
+	priv->pace_ioctl = f->pace_ioctl;
+	priv->pin_properties_ioctl = f->pin_properties_ioctl;
+	priv->get_tlv_properties = f->get_tlv_properties;
+	memcpy(priv->tlv_properties, f->tlv_properties, f->tlv_properties_len);
+	priv->tlv_properties_len = f->tlv_properties_len;
+	reader->capabilities |= f->capabilities;
+	reader->max_send_size = f->max_send_size;
+	reader->max_recv_size = f->max_recv_size;
+	if (f->vendor && !reader->vendor)
+		reader->vendor = strdup(f->vendor);
+	reader->version_major = f->version_major;
+	reader->version_minor = f->version_minor;
+	sc_log(reader->ctx, "Features of '%s' known from a previous probe", reader->name);
+	return 1;
+}
+
 static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
 	sc_context_t *ctx = reader->ctx;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
@@ -1206,7 +2686,7 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 		if (max_data > 0) {
 			sc_log(ctx, "Reader supports transceiving %d bytes of data",
 					max_data);
-			if (priv->gpriv->force_max_send_size)
+			if (!priv->gpriv->force_max_send_size)
 				reader->max_send_size = max_data;
 			else
 				sc_log(ctx, "Sending is limited to %"SC_FORMAT_LEN_SIZE_T"u bytes of data"
@@ -1243,6 +2723,10 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 			reader->version_minor = (i >> 16) & 0xFF;
 		}
 	}
+
+	pcsc_features_save(reader);
+	if (gpriv->cache_features)
+		pcsc_features_write(ctx, gpriv);
 }
 
 int pcsc_add_reader(sc_context_t *ctx,
@@ -1279,7 +2763,10 @@ int pcsc_add_reader(sc_context_t *ctx,
 	ret = _sc_add_reader(ctx, reader);
 
 	if (ret == SC_SUCCESS) {
-		refresh_attributes(reader);
+		refresh_attributes(reader, 0);
+#ifdef PCSC_STATE_LISTENER
+		pcsc_listener_add(ctx, reader->name);
+#endif
 	}
 
 err1:
@@ -1296,6 +2783,10 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 	const char *mszGroups = NULL;
 	int ret = SC_ERROR_INTERNAL;
 	size_t i;
+#ifdef PCSC_STATE_LISTENER
+	unsigned long pnp_changes = 0;
+	int pnp_valid = 0;
+#endif
 
 	LOG_FUNC_CALLED(ctx);
 
@@ -1310,6 +2801,14 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		goto out;
 	}
 
+#ifdef PCSC_STATE_LISTENER
+	if (pcsc_listener_readers_known(gpriv, &pnp_valid, &pnp_changes)) {
+		sc_log(ctx, "No PC/SC reader was attached or detached since the last probe");
+		ret = SC_SUCCESS;
+		goto out;
+	}
+#endif
+
 	sc_log(ctx, "Probing PC/SC readers");
 
 	do {
@@ -1387,9 +2886,24 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 			memmove(reader_name, next_reader_name,
 					(reader_buf + reader_buf_size) - next_reader_name);
 			reader_buf_size -= (next_reader_name - reader_name);
-		} else {
+			if (reader->flags & SC_READER_REMOVED) {
+				struct pcsc_private_data *priv = reader->drv_data;
+
+				/* reattached before its slots were released: keep
+				 * the reader and have the card detected again */
+				sc_log(ctx, "Reader '%s' is back", reader->name);
+				reader->flags &= ~SC_READER_REMOVED;
+				priv->reader_state.dwEventState = SCARD_STATE_UNAWARE;
+#ifdef PCSC_STATE_LISTENER
+				pcsc_listener_add(ctx, reader->name);
+#endif
+			}
+		} else if (!(reader->flags & SC_READER_REMOVED)) {
 			/* existing reader not found */
 			reader->flags |= SC_READER_REMOVED;
+#ifdef PCSC_STATE_LISTENER
+			pcsc_listener_remove(ctx, reader->name);
+#endif
 		}
 	}
 
@@ -1407,6 +2921,8 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 
 		/* check for pinpad support early, to allow opensc-tool -l display accurate information */
 		priv = reader->drv_data;
+		if (pcsc_features_restore(reader))
+			continue;
 		if (priv->reader_state.dwEventState & SCARD_STATE_EXCLUSIVE)
 			continue;
 
@@ -1437,6 +2953,11 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		}
 	}
 
+#ifdef PCSC_STATE_LISTENER
+	pcsc_listener_readers_listed(gpriv, pnp_valid, pnp_changes);
+	/* restart the listener if it stopped with the PC/SC service */
+	pcsc_listener_add(ctx, NULL);
+#endif
 	ret = SC_SUCCESS;
 
 out:
@@ -1446,13 +2967,14 @@ out:
 }
 
 
-/* Wait for an event to occur.
+/* Wait for an event to occur. Without ev, only the reader states are freed.
  */
-static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event,
-		int timeout, void **reader_states)
+static int pcsc_wait_for_reader_event(sc_context_t *ctx, unsigned int event_mask,
+		struct sc_reader_event *ev, int timeout, void **reader_states)
 {
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
 	LONG rv;
+	struct pcsc_wait_states *ws = NULL;
 	SCARD_READERSTATE *rgReaderStates;
 	size_t i;
 	unsigned int num_watch;
@@ -1461,30 +2983,64 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 
 	LOG_FUNC_CALLED(ctx);
 
-	if (!event_reader && !event && reader_states)   {
+	if (!ev && reader_states)   {
 		sc_log(ctx, "free allocated reader states");
 		free(*reader_states);
 		*reader_states = NULL;
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 	}
+	if (ev)
+		memset(ev, 0, sizeof *ev);
 
-	if (reader_states == NULL || *reader_states == NULL) {
-		rgReaderStates = calloc(sc_ctx_get_reader_count(ctx) + 2, sizeof(SCARD_READERSTATE));
-		if (!rgReaderStates)
+#ifdef PCSC_STATE_LISTENER
+	if (ev) {
+		r = pcsc_listener_wait(ctx, event_mask, ev, timeout, reader_states);
+		if (r != SC_ERROR_NOT_SUPPORTED)
+			LOG_FUNC_RETURN(ctx, r);
+		sc_log(ctx, "Waiting for the events through PC/SC");
+	}
+#endif
+
+	if (reader_states != NULL && *reader_states != NULL) {
+		ws = *reader_states;
+		if (ws->listener) {
+			/* the listener stopped, start over */
+			free(ws);
+			ws = NULL;
+			*reader_states = NULL;
+		}
+	}
+
+	if (ws == NULL) {
+		size_t names_len = 0;
+		char *names;
+
+		/* The names are copied behind the states, so that kept states
+		 * stay valid when a reader is removed from the context */
+		num_watch = sc_ctx_get_reader_count(ctx);
+		for (i = 0; i < num_watch; i++)
+			names_len += strlen(sc_ctx_get_reader(ctx, i)->name) + 1;
+		ws = calloc(1, sizeof *ws + (num_watch + 2) * sizeof(SCARD_READERSTATE) + names_len);
+		if (!ws)
 			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		rgReaderStates = ws->states = (SCARD_READERSTATE *) (ws + 1);
+		names = (char *) (rgReaderStates + num_watch + 2);
 
 		/* Find out the current status */
-		num_watch = sc_ctx_get_reader_count(ctx);
 		sc_log(ctx, "Trying to watch %d readers", num_watch);
 		for (i = 0; i < num_watch; i++) {
-			rgReaderStates[i].szReader = sc_ctx_get_reader(ctx, i)->name;
+			size_t len = strlen(sc_ctx_get_reader(ctx, i)->name) + 1;
+
+			memcpy(names, sc_ctx_get_reader(ctx, i)->name, len);
+			rgReaderStates[i].szReader = names;
 			rgReaderStates[i].dwCurrentState = SCARD_STATE_UNAWARE;
 			rgReaderStates[i].dwEventState = SCARD_STATE_UNAWARE;
+			names += len;
 		}
 #ifndef __APPLE__
 	   	/* OS X 10.6.2 - 10.12.6 do not support PnP notification */
 		if (event_mask & SC_EVENT_READER_ATTACHED) {
-			rgReaderStates[i].szReader = "\\\\?PnP?\\Notification";
+			rgReaderStates[i].szReader = PCSC_PNP_NOTIFICATION;
 			rgReaderStates[i].dwCurrentState = SCARD_STATE_UNAWARE;
 			rgReaderStates[i].dwEventState = SCARD_STATE_UNAWARE;
 			num_watch++;
@@ -1492,7 +3048,7 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 #endif
 	}
 	else {
-		rgReaderStates = (SCARD_READERSTATE *)(*reader_states);
+		rgReaderStates = ws->states;
 		for (num_watch = 0; rgReaderStates[num_watch].szReader; num_watch++)
 			sc_log(ctx, "re-use reader '%s'", rgReaderStates[num_watch].szReader);
 	}
@@ -1509,7 +3065,7 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 #else
 	gpriv->pcsc_wait_ctx = gpriv->pcsc_ctx;
 #endif
-	if (!event_reader || !event)
+	if (!ev)
 	{
 		r = SC_ERROR_INTERNAL;
 		goto out;
@@ -1518,7 +3074,6 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 #ifdef __APPLE__
 	if (num_watch == 0) {
 		sc_log(ctx, "No readers available, PnP notification not supported");
-		*event_reader = NULL;
 		r = SC_ERROR_NO_READERS_FOUND;
 		goto out;
 	}
@@ -1541,7 +3096,7 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 
 		/* Scan the current state of all readers to see if they
 		 * match any of the events we're polling for */
-		*event = 0;
+		ev->event = 0;
 		for (i = 0, rsp = rgReaderStates; i < num_watch; i++, rsp++) {
 			DWORD state, prev_state;
 			sc_log(ctx, "'%s' before=0x%08X now=0x%08X",
@@ -1554,35 +3109,22 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 			if (state & SCARD_STATE_CHANGED) {
 
 				/* check for hotplug events  */
-				if (!strcmp(rgReaderStates[i].szReader, "\\\\?PnP?\\Notification")) {
+				if (!strcmp(rgReaderStates[i].szReader, PCSC_PNP_NOTIFICATION)) {
 					sc_log(ctx, "detected hotplug event");
-					*event |= SC_EVENT_READER_ATTACHED;
-					*event_reader = NULL;
-				}
-
-				if ((state & SCARD_STATE_PRESENT) && !(prev_state & SCARD_STATE_PRESENT)) {
-					sc_log(ctx, "card inserted event");
-					*event |= SC_EVENT_CARD_INSERTED;
+					ev->event |= SC_EVENT_READER_ATTACHED;
+					ev->reader = NULL;
 				}
 
-				if ((prev_state & SCARD_STATE_PRESENT) && !(state & SCARD_STATE_PRESENT)) {
-					sc_log(ctx, "card removed event");
-					*event |= SC_EVENT_CARD_REMOVED;
-				}
-
-				if ((state & SCARD_STATE_UNKNOWN) && !(prev_state & SCARD_STATE_UNKNOWN)) {
-					sc_log(ctx, "reader detached event");
-					*event |= SC_EVENT_READER_DETACHED;
-				}
+				ev->event |= pcsc_state_events(prev_state, state);
 
-				if ((prev_state & SCARD_STATE_UNKNOWN) && !(state & SCARD_STATE_UNKNOWN)) {
-					sc_log(ctx, "reader re-attached event");
-					*event |= SC_EVENT_READER_ATTACHED;
-				}
-
-				if (*event & event_mask) {
-					sc_log(ctx, "Matching event 0x%02X in reader %s", *event, rsp->szReader);
-					*event_reader = sc_ctx_get_reader_by_name(ctx, rsp->szReader);
+				if (ev->event & event_mask) {
+					sc_log(ctx, "Matching event 0x%02X in reader %s", ev->event, rsp->szReader);
+					ev->reader = sc_ctx_get_reader_by_name(ctx, rsp->szReader);
+					/* the state came with the event, no need to ask for it again */
+					if (state & SCARD_STATE_PRESENT)
+						ev->flags = SC_READER_CARD_PRESENT;
+					ev->atr.len = rsp->cbAtr > SC_MAX_ATR_SIZE ? SC_MAX_ATR_SIZE : rsp->cbAtr;
+					memcpy(ev->atr.value, rsp->rgbAtr, ev->atr.len);
 					r = SC_SUCCESS;
 					goto out;
 				}
@@ -1627,16 +3169,34 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 	}
 out:
 	if (!reader_states)   {
-		free(rgReaderStates);
+		free(ws);
 	}
 	else if (*reader_states == NULL)   {
 		sc_log(ctx, "return allocated 'reader states'");
-		*reader_states = rgReaderStates;
+		*reader_states = ws;
 	}
 
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event,
+		int timeout, void **reader_states)
+{
+	struct sc_reader_event ev;
+	int r;
+
+	if (!event_reader || !event) {
+		if (reader_states)
+			return pcsc_wait_for_reader_event(ctx, event_mask, NULL, timeout, reader_states);
+		return SC_ERROR_INTERNAL;
+	}
+
+	r = pcsc_wait_for_reader_event(ctx, event_mask, &ev, timeout, reader_states);
+	*event_reader = ev.reader;
+	*event = ev.event;
+	return r;
+}
+
 
 
 /*
@@ -1662,6 +3222,24 @@ static int part10_build_verify_pin_block(struct sc_reader *reader, u8 * buf, siz
 	u8 tmp;
 	unsigned int tmp16;
 	PIN_VERIFY_STRUCTURE *pin_verify  = (PIN_VERIFY_STRUCTURE *)buf;
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct part10_pin_format format;
+
+	/* Everything but the APDU only depends on the PIN format and the
+	 * reader, so a block built for the same format is reused as is */
+	memset(&format, 0, sizeof format);
+	format.encoding = data->pin1.encoding;
+	format.length_offset = data->pin1.length_offset;
+	format.pad_length = data->pin1.pad_length;
+	format.min_length = data->pin1.min_length;
+	format.max_length = data->pin1.max_length;
+	format.padding = !!(data->flags & SC_PIN_CMD_NEED_PADDING);
+	format.display = !!(reader->capabilities & SC_READER_CAP_DISPLAY);
+	if (priv->verify_block_valid
+			&& !memcmp(&format, &priv->verify_format, sizeof format)) {
+		memcpy(buf, priv->verify_block, sizeof(PIN_VERIFY_STRUCTURE));
+		goto apdu;
+	}
 
 	/* PIN verification control message */
 	pin_verify->bTimerOut = SC_CCID_PIN_TIMEOUT;
@@ -1727,6 +3305,11 @@ static int part10_build_verify_pin_block(struct sc_reader *reader, u8 * buf, siz
 	pin_verify->bTeoPrologue[1] = 0x00;
 	pin_verify->bTeoPrologue[2] = 0x00;
 
+	memcpy(priv->verify_block, buf, sizeof(PIN_VERIFY_STRUCTURE));
+	priv->verify_format = format;
+	priv->verify_block_valid = 1;
+
+apdu:
 	/* APDU itself */
 	LOG_TEST_RET(reader->ctx,
 			sc_apdu2bytes(reader->ctx, apdu,
@@ -1907,8 +3490,8 @@ static int
 part10_check_pin_min_max(sc_reader_t *reader, struct sc_pin_cmd_data *data)
 {
 	int r;
-	unsigned char buffer[256];
-	size_t length = sizeof buffer;
+	const u8 *buffer;
+	size_t length;
 	struct pcsc_private_data *priv = reader->drv_data;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) reader->ctx->reader_drv_data;
 	struct sc_pin_cmd_pin *pin_ref =
@@ -1924,13 +3507,13 @@ part10_check_pin_min_max(sc_reader_t *reader, struct sc_pin_cmd_data *data)
 	if (!priv->get_tlv_properties)
 		return 0;
 
-	r = pcsc_internal_transmit(reader, NULL, 0, buffer, &length,
-		priv->get_tlv_properties);
+	/* read once for the reader, not for each PIN command */
+	r = part10_get_tlv_properties(reader, NULL, &buffer, &length);
 	LOG_TEST_RET(reader->ctx, r,
 		"PC/SC v2 part 10: Get TLV properties failed!");
 
 	/* minimum pin size */
-	r = part10_find_property_by_tag(buffer, length,
+	r = part10_find_property_by_tag((u8 *) buffer, (int) length,
 		PCSCv2_PART10_PROPERTY_bMinPINSize);
 	if (r >= 0)
 	{
@@ -1941,7 +3524,7 @@ part10_check_pin_min_max(sc_reader_t *reader, struct sc_pin_cmd_data *data)
 	}
 
 	/* maximum pin size */
-	r = part10_find_property_by_tag(buffer, length,
+	r = part10_find_property_by_tag((u8 *) buffer, (int) length,
 		PCSCv2_PART10_PROPERTY_bMaxPINSize);
 	if (r >= 0)
 	{
@@ -2358,6 +3941,11 @@ struct sc_reader_driver * sc_get_pcsc_driver(void)
 	pcsc_ops.finish = pcsc_finish;
 	pcsc_ops.detect_readers = pcsc_detect_readers;
 	pcsc_ops.transmit = pcsc_transmit;
+	pcsc_ops.transmit_batch = pcsc_transmit_batch;
+#ifdef PCSC_ASYNC_TRANSMIT
+	pcsc_ops.transmit_submit = pcsc_transmit_submit;
+	pcsc_ops.transmit_wait = pcsc_transmit_wait;
+#endif
 	pcsc_ops.detect_card_presence = pcsc_detect_card_presence;
 	pcsc_ops.lock = pcsc_lock;
 	pcsc_ops.unlock = pcsc_unlock;
@@ -2366,6 +3954,7 @@ struct sc_reader_driver * sc_get_pcsc_driver(void)
 	pcsc_ops.disconnect = pcsc_disconnect;
 	pcsc_ops.perform_verify = pcsc_pin_cmd;
 	pcsc_ops.wait_for_event = pcsc_wait_for_event;
+	pcsc_ops.wait_for_reader_event = pcsc_wait_for_reader_event;
 	pcsc_ops.cancel = pcsc_cancel;
 	pcsc_ops.reset = pcsc_reset;
 	pcsc_ops.use_reader = pcsc_use_reader;
@@ -0,0 +1,736 @@
+/*
+ * reader-virtual.c: Reader driver for virtual cards
+ *
+ * A virtual card either replays a recorded APDU transcript or emulates
+ * a file system from a host directory. Together with a configurable
+ * latency per APDU it allows reproducible measurements without hardware.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "internal.h"
+#include "common/compat_strlcpy.h"
+
+#define GET_PRIV_DATA(r) ((struct virtual_private_data *) (r)->drv_data)
+
+#define VIRTUAL_PATH_MAX	1024
+#define VIRTUAL_LINE_MAX	4096
+
+/* A command of the transcript with its responses, replayed in turn */
+struct virtual_apdu {
+	u8 *cmd;
+	size_t cmd_len;
+	struct virtual_resp {
+		u8 *data;
+		size_t len;
+	} *resp;
+	size_t resp_count;
+	size_t next;
+};
+
+struct virtual_private_data {
+	char *source;			/* transcript file or directory */
+	int is_directory;
+	unsigned long latency;		/* microseconds per APDU */
+
+	/* transcript */
+	struct virtual_apdu *apdus;
+	size_t apdu_count;
+	size_t last;			/* command of the next response while loading */
+
+	/* file system: host paths of the current DF and EF */
+	char df[VIRTUAL_PATH_MAX];
+	char ef[VIRTUAL_PATH_MAX];
+	char df_name[2 * SC_MAX_AID_SIZE + 1];	/* AID of the current DF, if selected by name */
+};
+
+static void virtual_sleep(unsigned long usec)
+{
+	if (usec == 0)
+		return;
+#ifdef _WIN32
+	Sleep((usec + 999) / 1000);
+#else
+	{
+		struct timespec ts;
+
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = (usec % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	return toupper((unsigned char) c) - 'A' + 10;
+}
+
+/* Parse up to 'max' bytes of two hex digits, optionally separated by blanks or ':' */
+static size_t parse_hex_bytes(const char *line, u8 *out, size_t max)
+{
+	size_t n = 0;
+
+	while (n < max) {
+		while (*line == ' ' || *line == '\t' || *line == ':')
+			line++;
+		if (!isxdigit((unsigned char) line[0]) || !isxdigit((unsigned char) line[1]))
+			break;
+		out[n++] = (u8) (hex_nibble(line[0]) << 4 | hex_nibble(line[1]));
+		line += 2;
+	}
+	return n;
+}
+
+static int transcript_add(struct virtual_private_data *priv, int outgoing,
+		const u8 *data, size_t len)
+{
+	struct virtual_apdu *apdu;
+	struct virtual_resp *resp;
+	size_t i;
+
+	if (outgoing) {
+		for (i = 0; i < priv->apdu_count; i++)
+			if (priv->apdus[i].cmd_len == len && !memcmp(priv->apdus[i].cmd, data, len))
+				break;
+		if (i == priv->apdu_count) {
+			apdu = realloc(priv->apdus, (i + 1) * sizeof(*apdu));
+			if (apdu == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+			priv->apdus = apdu;
+			apdu = &priv->apdus[i];
+			memset(apdu, 0, sizeof(*apdu));
+			apdu->cmd = malloc(len);
+			if (apdu->cmd == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+			memcpy(apdu->cmd, data, len);
+			apdu->cmd_len = len;
+			priv->apdu_count++;
+		}
+		priv->last = i;
+		return SC_SUCCESS;
+	}
+
+	if (priv->apdu_count == 0 || len < 2)
+		return SC_ERROR_INVALID_DATA;
+	apdu = &priv->apdus[priv->last];
+	resp = realloc(apdu->resp, (apdu->resp_count + 1) * sizeof(*resp));
+	if (resp == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	apdu->resp = resp;
+	resp = &apdu->resp[apdu->resp_count];
+	resp->data = malloc(len);
+	if (resp->data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(resp->data, data, len);
+	resp->len = len;
+	apdu->resp_count++;
+	return SC_SUCCESS;
+}
+
+/*
+ * Load a transcript: "ATR: <hex>", "> <command hex>" and "< <response hex>"
+ * lines, or an OpenSC debug log with its "Outgoing APDU" and "Incoming APDU"
+ * dumps. Repeated commands get their responses in the recorded order.
+ */
+static int transcript_load(sc_reader_t *reader, struct virtual_private_data *priv)
+{
+	sc_context_t *ctx = reader->ctx;
+	char line[VIRTUAL_LINE_MAX];
+	size_t len = 0, expected = 0;
+	int outgoing = 0, r = SC_SUCCESS;
+	const char *p;
+	u8 *buf;
+	FILE *f;
+
+	f = fopen(priv->source, "r");
+	if (f == NULL) {
+		sc_log(ctx, "Unable to open the transcript '%s'", priv->source);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	buf = malloc(SC_MAX_EXT_APDU_BUFFER_SIZE);
+	if (buf == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	while (r == SC_SUCCESS && fgets(line, sizeof(line), f) != NULL) {
+		if (expected) {
+			/* hex dump of the debug log, 16 bytes per line */
+			size_t want = expected - len > 16 ? 16 : expected - len;
+
+			len += parse_hex_bytes(line, buf + len, want);
+			if (len == expected) {
+				r = transcript_add(priv, outgoing, buf, len);
+				expected = 0;
+			}
+			continue;
+		}
+
+		if ((p = strstr(line, "Outgoing APDU (")) != NULL
+				|| (p = strstr(line, "Incoming APDU (")) != NULL) {
+			unsigned long n;
+
+			outgoing = p[0] == 'O';
+			if (sscanf(p + 15, "%lu", &n) == 1 && n > 0 && n <= SC_MAX_EXT_APDU_BUFFER_SIZE) {
+				expected = n;
+				len = 0;
+			}
+		} else if (!strncmp(line, "ATR:", 4)) {
+			reader->atr.len = parse_hex_bytes(line + 4, reader->atr.value, SC_MAX_ATR_SIZE);
+		} else if (line[0] == '>' || line[0] == '<') {
+			len = parse_hex_bytes(line + 1, buf, SC_MAX_EXT_APDU_BUFFER_SIZE);
+			if (len > 0)
+				r = transcript_add(priv, line[0] == '>', buf, len);
+		}
+	}
+	fclose(f);
+	free(buf);
+
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "Invalid transcript '%s'", priv->source);
+	else
+		sc_log(ctx, "Transcript '%s': %"SC_FORMAT_LEN_SIZE_T"u distinct commands",
+				priv->source, priv->apdu_count);
+	return r;
+}
+
+static size_t transcript_transmit(struct virtual_private_data *priv,
+		const u8 *cmd, size_t cmd_len, u8 *rbuf, size_t rbuflen)
+{
+	struct virtual_apdu *apdu;
+	struct virtual_resp *resp;
+	size_t i;
+
+	for (i = 0; i < priv->apdu_count; i++) {
+		apdu = &priv->apdus[i];
+		if (apdu->cmd_len == cmd_len && !memcmp(apdu->cmd, cmd, cmd_len) && apdu->resp_count)
+			break;
+	}
+	if (i == priv->apdu_count) {
+		/* not recorded: instruction not supported */
+		rbuf[0] = 0x6D;
+		rbuf[1] = 0x00;
+		return 2;
+	}
+
+	resp = &apdu->resp[apdu->next];
+	apdu->next = (apdu->next + 1) % apdu->resp_count;
+	if (resp->len > rbuflen) {
+		/* keep the status words */
+		memcpy(rbuf, resp->data, rbuflen - 2);
+		memcpy(rbuf + rbuflen - 2, resp->data + resp->len - 2, 2);
+		return rbuflen;
+	}
+	memcpy(rbuf, resp->data, resp->len);
+	return resp->len;
+}
+
+/* Host path of the child 'name' of the directory 'dir', 0 if it does not exist */
+static int fs_child(const char *dir, const char *name, char *out, struct stat *st)
+{
+	if (snprintf(out, VIRTUAL_PATH_MAX, "%s/%s", dir, name) >= VIRTUAL_PATH_MAX)
+		return 0;
+	return stat(out, st) == 0;
+}
+
+static int fs_child_fid(const char *dir, const u8 *fid, char *out, struct stat *st)
+{
+	char name[5];
+
+	snprintf(name, sizeof(name), "%02X%02X", fid[0], fid[1]);
+	return fs_child(dir, name, out, st);
+}
+
+/* Build the FCP of the current file in 'rbuf' */
+static size_t fs_fcp(struct virtual_private_data *priv, int is_df, const struct stat *st, u8 *rbuf)
+{
+	const char *path = is_df ? priv->df : priv->ef;
+	const char *name = strrchr(path, '/');
+	size_t n = 2, aid_len;
+	u8 fid[2];
+
+	rbuf[n++] = 0x82;
+	rbuf[n++] = 0x01;
+	rbuf[n++] = is_df ? 0x38 : 0x01;
+	if (name && parse_hex_bytes(name + 1, fid, 2) == 2 && strlen(name + 1) == 4) {
+		rbuf[n++] = 0x83;
+		rbuf[n++] = 0x02;
+		rbuf[n++] = fid[0];
+		rbuf[n++] = fid[1];
+	} else if (is_df && strcmp(priv->df, priv->source) == 0) {
+		rbuf[n++] = 0x83;
+		rbuf[n++] = 0x02;
+		rbuf[n++] = 0x3F;
+		rbuf[n++] = 0x00;
+	}
+	if (!is_df) {
+		rbuf[n++] = 0x80;
+		rbuf[n++] = 0x02;
+		rbuf[n++] = (u8) ((st->st_size >> 8) & 0xFF);
+		rbuf[n++] = (u8) (st->st_size & 0xFF);
+	}
+	if (is_df && priv->df_name[0]) {
+		aid_len = strlen(priv->df_name) / 2;
+		rbuf[n++] = 0x84;
+		rbuf[n++] = (u8) aid_len;
+		n += parse_hex_bytes(priv->df_name, rbuf + n, aid_len);
+	}
+	rbuf[n++] = 0x8A;
+	rbuf[n++] = 0x01;
+	rbuf[n++] = 0x05;
+
+	rbuf[0] = 0x62;
+	rbuf[1] = (u8) (n - 2);
+	return n;
+}
+
+static size_t fs_select(struct virtual_private_data *priv, const sc_apdu_t *apdu, u8 *rbuf)
+{
+	char path[VIRTUAL_PATH_MAX], parent[VIRTUAL_PATH_MAX];
+	char aid[2 * SC_MAX_AID_SIZE + 1];
+	const u8 *data = apdu->data;
+	size_t len = apdu->datalen, i, n;
+	struct stat st;
+	int found = 0;
+	char *slash;
+
+	aid[0] = '\0';
+	switch (apdu->p1) {
+	case 0x00:
+		if (len == 0 || (len == 2 && data[0] == 0x3F && data[1] == 0x00)) {
+			strlcpy(path, priv->source, sizeof(path));
+			found = stat(path, &st) == 0;
+			break;
+		}
+		/* fall through */
+	case 0x01:
+	case 0x02:
+		if (len != 2)
+			break;
+		found = fs_child_fid(priv->df, data, path, &st);
+		if (!found && apdu->p1 == 0x00) {
+			/* a sibling of the current DF */
+			strlcpy(parent, priv->df, sizeof(parent));
+			slash = strrchr(parent, '/');
+			if (slash && strcmp(priv->df, priv->source) != 0) {
+				*slash = '\0';
+				found = fs_child_fid(parent, data, path, &st);
+			}
+		}
+		break;
+	case 0x03:
+		strlcpy(path, priv->df, sizeof(path));
+		slash = strrchr(path, '/');
+		if (slash && strcmp(priv->df, priv->source) != 0)
+			*slash = '\0';
+		found = stat(path, &st) == 0;
+		break;
+	case 0x04:
+		/* a DF selected by name is a directory named with its AID in hex */
+		if (len == 0 || len > SC_MAX_AID_SIZE)
+			break;
+		for (i = 0; i < len; i++)
+			snprintf(aid + 2 * i, 3, "%02X", data[i]);
+		found = fs_child(priv->source, aid, path, &st);
+		if (!found)
+			found = fs_child(priv->df, aid, path, &st);
+		break;
+	case 0x08:
+	case 0x09:
+		if (len == 0 || len % 2)
+			break;
+		strlcpy(path, apdu->p1 == 0x08 ? priv->source : priv->df, sizeof(path));
+		found = stat(path, &st) == 0;
+		for (n = 0; n < len && found; n += 2) {
+			if (n == 0 && data[0] == 0x3F && data[1] == 0x00)
+				continue;
+			strlcpy(parent, path, sizeof(parent));
+			found = fs_child_fid(parent, data + n, path, &st);
+		}
+		break;
+	}
+
+	if (!found) {
+		rbuf[0] = 0x6A;
+		rbuf[1] = 0x82;
+		return 2;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		strlcpy(priv->df, path, sizeof(priv->df));
+		strlcpy(priv->df_name, aid, sizeof(priv->df_name));
+		priv->ef[0] = '\0';
+	} else {
+		strlcpy(priv->ef, path, sizeof(priv->ef));
+	}
+
+	n = 0;
+	if ((apdu->p2 & 0x0C) != 0x0C)
+		n = fs_fcp(priv, S_ISDIR(st.st_mode), &st, rbuf);
+	rbuf[n++] = 0x90;
+	rbuf[n++] = 0x00;
+	return n;
+}
+
+static size_t fs_read_binary(struct virtual_private_data *priv, const sc_apdu_t *apdu,
+		u8 *rbuf, size_t rbuflen)
+{
+	size_t offset = ((apdu->p1 & 0x7F) << 8) | apdu->p2;
+	size_t want = apdu->le ? apdu->le : 256, n = 0;
+	struct stat st;
+	FILE *f;
+
+	if (apdu->p1 & 0x80) {
+		/* short EF identifiers are not emulated */
+		rbuf[0] = 0x69;
+		rbuf[1] = 0x81;
+		return 2;
+	}
+	if (priv->ef[0] == '\0' || stat(priv->ef, &st) != 0) {
+		rbuf[0] = 0x69;
+		rbuf[1] = 0x86;
+		return 2;
+	}
+	if (offset >= (size_t) st.st_size) {
+		rbuf[0] = 0x6B;
+		rbuf[1] = 0x00;
+		return 2;
+	}
+
+	if (want > rbuflen - 2)
+		want = rbuflen - 2;
+	f = fopen(priv->ef, "rb");
+	if (f != NULL) {
+		if (fseek(f, (long) offset, SEEK_SET) == 0)
+			n = fread(rbuf, 1, want, f);
+		fclose(f);
+	}
+	rbuf[n++] = 0x90;
+	rbuf[n++] = 0x00;
+	return n;
+}
+
+/*
+ * Emulate an ISO 7816-4 card over the directory: SELECT and READ BINARY
+ * work on its files, PIN and security environment commands succeed, and
+ * the cryptographic commands return filler data of the expected length.
+ */
+static size_t fs_transmit(struct virtual_private_data *priv, const sc_apdu_t *apdu,
+		u8 *rbuf, size_t rbuflen)
+{
+	size_t n = 0, want;
+
+	switch (apdu->ins) {
+	case 0xA4:	/* SELECT FILE */
+		return fs_select(priv, apdu, rbuf);
+	case 0xB0:	/* READ BINARY */
+		return fs_read_binary(priv, apdu, rbuf, rbuflen);
+	case 0x20:	/* VERIFY */
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2C:	/* RESET RETRY COUNTER */
+		break;
+	case 0x2A:	/* PERFORM SECURITY OPERATION */
+	case 0x84:	/* GET CHALLENGE */
+	case 0x88:	/* INTERNAL AUTHENTICATE */
+		want = apdu->le ? apdu->le : 256;
+		if (want > rbuflen - 2)
+			want = rbuflen - 2;
+		for (n = 0; n < want; n++)
+			rbuf[n] = (u8) (n * 7 + 1);
+		break;
+	default:
+		rbuf[0] = 0x6D;
+		rbuf[1] = 0x00;
+		return 2;
+	}
+	rbuf[n++] = 0x90;
+	rbuf[n++] = 0x00;
+	return n;
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	size_t ssize, rsize, rbuflen;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	int r;
+
+	rbuflen = apdu->resplen + 2;
+	if (rbuflen < SC_MAX_APDU_BUFFER_SIZE)
+		rbuflen = SC_MAX_APDU_BUFFER_SIZE;
+	rbuf = malloc(rbuflen);
+	if (rbuf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	virtual_sleep(priv->latency);
+	if (priv->is_directory)
+		rsize = fs_transmit(priv, apdu, rbuf, rbuflen);
+	else
+		rsize = transcript_transmit(priv, sbuf, ssize, rbuf, rbuflen);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	sc_mem_clear(rbuf, rbuflen);
+	free(rbuf);
+	return r;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	reader->flags |= SC_READER_CARD_PRESENT;
+	return reader->flags;
+}
+
+static int virtual_reset_state(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	size_t i;
+
+	for (i = 0; i < priv->apdu_count; i++)
+		priv->apdus[i].next = 0;
+	strlcpy(priv->df, priv->source, sizeof(priv->df));
+	priv->ef[0] = '\0';
+	priv->df_name[0] = '\0';
+	return SC_SUCCESS;
+}
+
+static int virtual_connect(sc_reader_t *reader)
+{
+	if (reader->atr.len == 0) {
+		sc_log(reader->ctx, "No ATR for the virtual card");
+		return SC_ERROR_CARD_NOT_PRESENT;
+	}
+	reader->active_protocol = SC_PROTO_T1;
+	_sc_parse_atr(reader);
+	return virtual_reset_state(reader);
+}
+
+static int virtual_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	return virtual_reset_state(reader);
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	size_t i, j;
+
+	if (priv == NULL)
+		return SC_SUCCESS;
+	for (i = 0; i < priv->apdu_count; i++) {
+		for (j = 0; j < priv->apdus[i].resp_count; j++)
+			free(priv->apdus[i].resp[j].data);
+		free(priv->apdus[i].resp);
+		free(priv->apdus[i].cmd);
+	}
+	free(priv->apdus);
+	free(priv->source);
+	free(priv);
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_drv = {
+	"Virtual cards",
+	"virtual",
+	&virtual_ops,
+	NULL
+};
+
+static int virtual_add_reader(sc_context_t *ctx, const char *source, unsigned long latency)
+{
+	struct virtual_private_data *priv;
+	sc_reader_t *reader;
+	char namebuf[128];
+	struct stat st;
+	const char *base;
+	FILE *f;
+	char line[3 * SC_MAX_ATR_SIZE + 8];
+	int r;
+
+	if (stat(source, &st) != 0) {
+		sc_log(ctx, "Virtual card '%s' not found", source);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	reader = calloc(1, sizeof(sc_reader_t));
+	priv = calloc(1, sizeof(struct virtual_private_data));
+	if (reader == NULL || priv == NULL) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	reader->ctx = ctx;
+	reader->drv_data = priv;
+	reader->ops = &virtual_ops;
+	reader->driver = &virtual_drv;
+	reader->max_send_size = SC_READER_SHORT_APDU_MAX_SEND_SIZE;
+	reader->max_recv_size = SC_READER_SHORT_APDU_MAX_RECV_SIZE;
+	reader->supported_protocols = SC_PROTO_T1;
+	priv->latency = latency;
+	priv->is_directory = S_ISDIR(st.st_mode);
+	priv->source = strdup(source);
+	if (priv->source == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	/* the paths of the emulated files are built with '/' */
+	if (priv->is_directory && strlen(priv->source) > 1
+			&& priv->source[strlen(priv->source) - 1] == '/')
+		priv->source[strlen(priv->source) - 1] = '\0';
+
+	if (priv->is_directory) {
+		/* the ATR is written in hex in the file "atr" of the directory */
+		snprintf(namebuf, sizeof(namebuf), "%s/atr", priv->source);
+		f = fopen(namebuf, "r");
+		if (f != NULL) {
+			if (fgets(line, sizeof(line), f) != NULL)
+				reader->atr.len = parse_hex_bytes(line, reader->atr.value, SC_MAX_ATR_SIZE);
+			fclose(f);
+		}
+		r = SC_SUCCESS;
+	} else {
+		r = transcript_load(reader, priv);
+	}
+	if (r != SC_SUCCESS)
+		goto err;
+
+	base = strrchr(priv->source, '/');
+	snprintf(namebuf, sizeof(namebuf), "Virtual card %s",
+			base && base[1] ? base + 1 : priv->source);
+	reader->name = strdup(namebuf);
+	if (reader->name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+
+	r = _sc_add_reader(ctx, reader);
+	if (r == SC_SUCCESS)
+		return r;
+
+err:
+	virtual_release(reader);
+	free(reader->name);
+	free(reader);
+	return r;
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const scconf_list *list = NULL;
+	unsigned long latency = 0;
+	const char *env;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block) {
+		latency = scconf_get_int(conf_block, "latency", 0);
+		list = scconf_find_list(conf_block, "cards");
+	}
+	env = getenv("OPENSC_VIRTUAL_LATENCY");
+	if (env)
+		latency = strtoul(env, NULL, 10);
+
+	env = getenv("OPENSC_VIRTUAL_READER");
+	if (env && *env) {
+		virtual_add_reader(ctx, env, latency);
+		return SC_SUCCESS;
+	}
+	for (; list != NULL; list = list->next)
+		virtual_add_reader(ctx, list->data, latency);
+
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	return SC_SUCCESS;
+}
+
+int sc_virtual_reader_enabled(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const char *env = getenv("OPENSC_VIRTUAL_READER");
+
+	if (env && *env)
+		return 1;
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	return conf_block && scconf_get_bool(conf_block, "enable", 0);
+}
+
+struct sc_reader_driver * sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.lock = virtual_lock;
+	virtual_ops.unlock = virtual_unlock;
+	virtual_ops.release = virtual_release;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.reset = virtual_reset;
+	virtual_ops.perform_verify = NULL;
+	virtual_ops.perform_pace = NULL;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_drv;
+}
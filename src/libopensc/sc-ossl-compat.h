@@ -69,6 +69,7 @@ extern "C" {
 #define EVP_PKEY_get0_DSA(x)		(x->pkey.dsa)
 #define EVP_PKEY_up_ref(user_key)	CRYPTO_add(&user_key->references, 1, CRYPTO_LOCK_EVP_PKEY)
 #define ASN1_STRING_get0_data(x)	ASN1_STRING_data(x)
+#define EVP_MD_CTX_reset(x)		EVP_MD_CTX_cleanup(x)
 #endif
 #endif
 
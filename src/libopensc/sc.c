@@ -30,11 +30,15 @@
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/crypto.h>     /* for OPENSSL_cleanse */
 #endif
 
 #include "internal.h"
+#include "gp.h"
 
 #ifdef PACKAGE_VERSION
 static const char *sc_version = PACKAGE_VERSION;
@@ -47,6 +51,28 @@ const char *sc_get_version(void)
     return sc_version;
 }
 
+static const char hex_digits[16] = "0123456789abcdef";
+
+/* value of the ASCII hex digits, 0xFF for other characters */
+static const u8 hex_values[128] = {
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,
+	0x08,0x09,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+};
+
 int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 {
 	int err = SC_SUCCESS;
@@ -62,22 +88,13 @@ int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 		int byte = 0, nybbles = 2;
 
 		while (nybbles-- && *in && *in != ':' && *in != ' ') {
-			char c;
-			byte <<= 4;
-			c = *in++;
-			if ('0' <= c && c <= '9')
-				c -= '0';
-			else
-			if ('a' <= c && c <= 'f')
-				c = c - 'a' + 10;
-			else
-			if ('A' <= c && c <= 'F')
-				c = c - 'A' + 10;
-			else {
+			unsigned char c = (unsigned char)*in++;
+
+			if (c >= sizeof(hex_values) || hex_values[c] == 0xFF) {
 				err = SC_ERROR_INVALID_ARGUMENTS;
 				goto out;
 			}
-			byte |= c;
+			byte = (byte << 4) | hex_values[c];
 		}
 
 		/* Detect premature end of string before byte is complete */
@@ -112,12 +129,15 @@ int sc_bin_to_hex(const u8 *in, size_t in_len, char *out, size_t out_len,
 	pos = out;
 	end = out + out_len;
 	for (n = 0; n < in_len; n++) {
-		if (pos + 3 + sep_len >= end)
+		if (pos + 3 + sep_len >= end) {
+			if (n)
+				*pos = '\0';
 			return SC_ERROR_BUFFER_TOO_SMALL;
+		}
 		if (n && sep_len)
 			*pos++ = sep;
-		sprintf(pos, "%02x", in[n]);
-		pos += 2;
+		*pos++ = hex_digits[in[n] >> 4];
+		*pos++ = hex_digits[in[n] & 0x0F];
 	}
 	*pos = '\0';
 	return SC_SUCCESS;
@@ -277,6 +297,8 @@ int sc_detect_card_presence(sc_reader_t *reader)
 		LOG_FUNC_RETURN(reader->ctx, SC_ERROR_NOT_SUPPORTED);
 
 	r = reader->ops->detect_card_presence(reader);
+	if (r >= 0)
+		gp_card_cache_refresh(reader);
 	LOG_FUNC_RETURN(reader->ctx, r);
 }
 
@@ -478,6 +500,9 @@ int sc_file_add_acl_entry(sc_file_t *file, unsigned int operation,
 	_new->key_ref = key_ref;
 	_new->next = NULL;
 
+	if (method == SC_AC_SYMBOLIC)
+		file->acl_symbolic_mask |= 1U << operation;
+
 	p = file->acl[operation];
 	if (p == NULL) {
 		file->acl[operation] = _new;
@@ -527,6 +552,7 @@ void sc_file_clear_acl_entries(sc_file_t *file, unsigned int operation)
 		return;
 	}
 
+	file->acl_symbolic_mask &= ~(1U << operation);
 	e = file->acl[operation];
 	if (e == (sc_acl_entry_t *) 1 ||
 	    e == (sc_acl_entry_t *) 2 ||
@@ -558,6 +584,10 @@ void sc_file_free(sc_file_t *file)
 	unsigned int i;
 	if (file == NULL || !sc_file_valid(file))
 		return;
+	if (file->refs > 0) {
+		file->refs--;
+		return;
+	}
 	file->magic = 0;
 	for (i = 0; i < SC_MAX_AC_OPS; i++)
 		sc_file_clear_acl_entries(file, i);
@@ -572,6 +602,30 @@ void sc_file_free(sc_file_t *file)
 	free(file);
 }
 
+sc_file_t * sc_file_ref(sc_file_t *file)
+{
+	if (sc_file_valid(file))
+		file->refs++;
+	return file;
+}
+
+int sc_file_unshare(sc_file_t **file)
+{
+	sc_file_t *copy;
+
+	if (file == NULL || !sc_file_valid(*file))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if ((*file)->refs == 0)
+		return SC_SUCCESS;
+
+	sc_file_dup(&copy, *file);
+	if (copy == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	sc_file_free(*file);
+	*file = copy;
+	return SC_SUCCESS;
+}
+
 void sc_file_dup(sc_file_t **dest, const sc_file_t *src)
 {
 	sc_file_t *newf;
@@ -837,6 +891,143 @@ void sc_mem_clear(void *ptr, size_t len)
 	}
 }
 
+/*
+ * Memory for secrets
+ *
+ * Small buffers come from a process-wide pool of locked pages with fixed
+ * size classes of 32 to 4096 bytes. The pages are locked once when they are
+ * mapped and stay with the pool, so that unlocking the memory of one buffer
+ * does not unlock another secret on the same page and a buffer does not cost
+ * a system call. Larger buffers get pages of their own. Every buffer is
+ * cleared when it is freed.
+ */
+#define SECURE_MEM_MIN_SHIFT	5
+#define SECURE_MEM_CLASSES	8	/* 32 to 4096 bytes */
+#define SECURE_MEM_CHUNK_SIZE	(16 * 1024)
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef _WIN32
+static SRWLOCK secure_mem_lock = SRWLOCK_INIT;
+#define secure_mem_acquire()	AcquireSRWLockExclusive(&secure_mem_lock)
+#define secure_mem_release()	ReleaseSRWLockExclusive(&secure_mem_lock)
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t secure_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+#define secure_mem_acquire()	pthread_mutex_lock(&secure_mem_lock)
+#define secure_mem_release()	pthread_mutex_unlock(&secure_mem_lock)
+#else
+#define secure_mem_acquire()
+#define secure_mem_release()
+#endif
+
+/* Free buffers of each class, linked through their first bytes */
+static void *secure_mem_free_list[SECURE_MEM_CLASSES];
+
+/* Zeroed pages which are kept out of the swap where the system allows it */
+static void *secure_pages_alloc(size_t len)
+{
+	void *p;
+
+#ifdef _WIN32
+	p = VirtualAlloc(NULL, len, MEM_COMMIT, PAGE_READWRITE);
+	if (p != NULL)
+		VirtualLock(p, len);
+#elif defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	/* best effort: the limit of locked memory may be low */
+	mlock(p, len);
+#else
+	p = calloc(1, len);
+#ifdef HAVE_SYS_MMAN_H
+	if (p != NULL)
+		mlock(p, len);
+#endif
+#endif
+	return p;
+}
+
+static void secure_pages_free(void *p, size_t len)
+{
+#ifdef _WIN32
+	VirtualUnlock(p, len);
+	VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	munlock(p, len);
+	munmap(p, len);
+#else
+#ifdef HAVE_SYS_MMAN_H
+	munlock(p, len);
+#endif
+	free(p);
+#endif
+}
+
+/* The size class of a buffer of `len' bytes, SECURE_MEM_CLASSES if the
+ * buffer is too large for the pool */
+static unsigned int secure_mem_class(size_t len)
+{
+	unsigned int cls = 0;
+
+	while (cls < SECURE_MEM_CLASSES && len > ((size_t) 1 << (SECURE_MEM_MIN_SHIFT + cls)))
+		cls++;
+	return cls;
+}
+
+void *sc_mem_secure_alloc(size_t len)
+{
+	unsigned int cls = secure_mem_class(len);
+	size_t size, i;
+	u8 *p;
+
+	if (cls == SECURE_MEM_CLASSES)
+		return secure_pages_alloc(len);
+	size = (size_t) 1 << (SECURE_MEM_MIN_SHIFT + cls);
+
+	secure_mem_acquire();
+	if (secure_mem_free_list[cls] == NULL) {
+		p = secure_pages_alloc(SECURE_MEM_CHUNK_SIZE);
+		if (p == NULL) {
+			secure_mem_release();
+			return NULL;
+		}
+		for (i = SECURE_MEM_CHUNK_SIZE; i >= size; i -= size) {
+			*(void **) (p + i - size) = secure_mem_free_list[cls];
+			secure_mem_free_list[cls] = p + i - size;
+		}
+	}
+	p = secure_mem_free_list[cls];
+	secure_mem_free_list[cls] = *(void **) p;
+	secure_mem_release();
+
+	/* the rest of the buffer was cleared when it was freed */
+	memset(p, 0, sizeof(void *));
+	return p;
+}
+
+void sc_mem_secure_free(void *ptr, size_t len)
+{
+	unsigned int cls = secure_mem_class(len);
+
+	if (ptr == NULL)
+		return;
+
+	if (cls == SECURE_MEM_CLASSES) {
+		sc_mem_clear(ptr, len);
+		secure_pages_free(ptr, len);
+		return;
+	}
+
+	sc_mem_clear(ptr, (size_t) 1 << (SECURE_MEM_MIN_SHIFT + cls));
+	secure_mem_acquire();
+	*(void **) ptr = secure_mem_free_list[cls];
+	secure_mem_free_list[cls] = ptr;
+	secure_mem_release();
+}
+
 int sc_mem_reverse(unsigned char *buf, size_t len)
 {
 	unsigned char ch;
@@ -858,14 +1049,19 @@ static int
 sc_remote_apdu_allocate(struct sc_remote_data *rdata,
 		struct sc_remote_apdu **new_rapdu)
 {
-	struct sc_remote_apdu *rapdu = NULL, *rr;
+	struct sc_remote_apdu *rapdu = NULL;
 
 	if (!rdata)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	rapdu = calloc(1, sizeof(struct sc_remote_apdu));
-	if (rapdu == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+	if (rdata->pool_used < rdata->pool_size)   {
+		rapdu = rdata->pool + rdata->pool_used++;
+	}
+	else   {
+		rapdu = calloc(1, sizeof(struct sc_remote_apdu));
+		if (rapdu == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
 
 	rapdu->apdu.data = &rapdu->sbuf[0];
 	rapdu->apdu.resp = &rapdu->rbuf[0];
@@ -877,13 +1073,29 @@ sc_remote_apdu_allocate(struct sc_remote_data *rdata,
 	if (rdata->data == NULL)   {
 		rdata->data = rapdu;
 		rdata->length = 1;
-		return SC_SUCCESS;
 	}
+	else   {
+		rdata->last->next = rapdu;
+		rdata->length++;
+	}
+	rdata->last = rapdu;
+
+	return SC_SUCCESS;
+}
+
+static int
+sc_remote_apdu_reserve(struct sc_remote_data *rdata, size_t count)
+{
+	if (!rdata || rdata->pool)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (!count)
+		return SC_SUCCESS;
 
-	for (rr = rdata->data; rr->next; rr = rr->next)
-		;
-	rr->next = rapdu;
-	rdata->length++;
+	rdata->pool = calloc(count, sizeof(struct sc_remote_apdu));
+	if (rdata->pool == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	rdata->pool_size = count;
+	rdata->pool_used = 0;
 
 	return SC_SUCCESS;
 }
@@ -900,9 +1112,13 @@ sc_remote_apdu_free (struct sc_remote_data *rdata)
 	while(rapdu)   {
 		struct sc_remote_apdu *rr = rapdu->next;
 
-		free(rapdu);
+		if (rapdu < rdata->pool || rapdu >= rdata->pool + rdata->pool_size)
+			free(rapdu);
 		rapdu = rr;
 	}
+	free(rdata->pool);
+	rdata->pool = NULL;
+	rdata->pool_size = rdata->pool_used = 0;
 }
 
 void sc_remote_data_init(struct sc_remote_data *rdata)
@@ -913,6 +1129,7 @@ void sc_remote_data_init(struct sc_remote_data *rdata)
 
 	rdata->alloc = sc_remote_apdu_allocate;
 	rdata->free = sc_remote_apdu_free;
+	rdata->reserve = sc_remote_apdu_reserve;
 }
 
 static unsigned long  sc_CRC_tab32[256];
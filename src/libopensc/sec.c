@@ -63,6 +63,15 @@ int sc_compute_signature(sc_card_t *card,
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+int sc_security_env_is_set(sc_card_t *card, const sc_security_env_t *env, int se_num)
+{
+	/* only trusted while the card stays locked */
+	return (card->caps & SC_CARD_CAP_KEEP_SECURITY_ENV)
+		&& card->lock_count > 0 && card->cache.se_valid
+		&& card->cache.se_num == se_num
+		&& memcmp(&card->cache.se, env, sizeof *env) == 0;
+}
+
 int sc_set_security_env(sc_card_t *card,
 			const sc_security_env_t *env,
 			int se_num)
@@ -75,7 +84,18 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	if (sc_security_env_is_set(card, env, se_num)) {
+		sc_log(card->ctx, "security environment is already set");
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
 	r = card->ops->set_security_env(card, env, se_num);
+	card->cache.se_valid = 0;
+	if (r == SC_SUCCESS && (card->caps & SC_CARD_CAP_KEEP_SECURITY_ENV)
+			&& card->lock_count > 0) {
+		memcpy(&card->cache.se, env, sizeof *env);
+		card->cache.se_num = se_num;
+		card->cache.se_valid = 1;
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -89,6 +109,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.se_valid = 0;
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -112,6 +133,7 @@ int sc_logout(sc_card_t *card)
 {
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
+	card->auth_serial++;
 	return card->ops->logout(card);
 }
 
@@ -168,6 +190,8 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	if (data->cmd != SC_PIN_CMD_GET_INFO)
+		card->auth_serial++;
 	if (card->ops->pin_cmd) {
 		r = card->ops->pin_cmd(card, data, tries_left);
 	} else if (!(data->flags & SC_PIN_CMD_USE_PINPAD)) {
@@ -30,6 +30,7 @@
 #include "internal.h"
 #include "asn1.h"
 #include "sm.h"
+#include "probes.h"
 
 #ifdef ENABLE_SM
 static const struct sc_asn1_entry c_asn1_sm_response[4] = {
@@ -137,6 +138,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 
 	/* get SM encoded APDU */
 	rv = card->sm_ctx.ops.get_sm_apdu(card, apdu, &sm_apdu);
+	SC_PROBE3(sm__wrap, card, apdu->ins, rv);
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
 		/* SM wrap of this APDU is ignored by card driver.
 		 * Send plain APDU to the reader driver */
@@ -167,6 +169,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 
 	/* decode SM answer and free temporary SM related data */
 	rv = card->sm_ctx.ops.free_sm_apdu(card, apdu, &sm_apdu);
+	SC_PROBE3(sm__unwrap, card, (apdu->sw1 << 8) | apdu->sw2, rv);
 	if (rv < 0)
 		sc_sm_stop(card);
 
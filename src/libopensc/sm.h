@@ -52,6 +52,9 @@ extern "C" {
 /** use SM for all commands */
 #define SM_MODE_TRANSMIT	0x200
 
+/** keep an established SM session for the following commands in the same card lock */
+#define SM_FLAGS_KEEP_SESSION	0x01
+
 #define SM_CMD_INITIALIZE		0x10
 #define SM_CMD_MUTUAL_AUTHENTICATION	0x20
 #define SM_CMD_RSA			0x100
@@ -72,6 +75,7 @@ extern "C" {
 #define SM_CMD_APDU			0x500
 #define SM_CMD_APDU_TRANSMIT		0x501
 #define SM_CMD_APDU_RAW			0x502
+#define SM_CMD_APDU_TRANSMIT_BATCH	0x503
 #define SM_CMD_APPLET			0x600
 #define SM_CMD_APPLET_DELETE		0x601
 #define SM_CMD_APPLET_LOAD		0x602
@@ -202,6 +206,9 @@ struct sm_cwa_session {
 
 	unsigned char mdata[0x48];
 	size_t mdata_len;
+
+	int established;	/* session keys derived from 'mdata' and in use */
+	unsigned ssc_count;	/* APDUs secured with the current session keys */
 };
 
 /*
@@ -305,6 +312,9 @@ struct sm_card_operations {
  *	API to use external SM modules:
  *	- 'initialize' - get APDU(s) to initialize SM session;
  *	- 'get apdus' - get secured APDUs to execute particular command;
+ *	  for SM_CMD_APDU_TRANSMIT_BATCH the plain APDUs in 'out' are secured
+ *	  in place and in list order, their data has to be in 'sbuf';
+ *	  modules that do not know this command return SC_ERROR_NOT_SUPPORTED;
  *	- 'finalize' - get APDU(s) to finalize SM session;
  *	- 'module init' - initialize external module (allocate data, read configuration, ...);
  *	- 'module cleanup' - free resources allocated by external module.
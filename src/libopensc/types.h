@@ -236,6 +236,9 @@ typedef struct sc_file {
 	int id;		/* file identifier (2 bytes) */
 	int sid;	/* short EF identifier (1 byte) */
 	struct sc_acl_entry *acl[SC_MAX_AC_OPS]; /* Access Control List */
+	/* one bit per operation whose ACL has SC_AC_SYMBOLIC entries, kept
+	 * by sc_file_add_acl_entry() and sc_file_clear_acl_entries() */
+	unsigned int acl_symbolic_mask;
 
 	int record_length; /* In case of fixed-length or cyclic EF */
 	int record_count;  /* Valid, if not transparent EF or DF */
@@ -253,6 +256,7 @@ typedef struct sc_file {
 	unsigned char *encoded_content;	/* file's content encoded to be used in the file creation command */
 	size_t encoded_content_len;	/* size of file's encoded content in bytes */
 
+	unsigned int refs;	/* references besides the first, see sc_file_ref() */
 	unsigned int magic;
 } sc_file_t;
 
@@ -383,6 +387,17 @@ struct sc_remote_data {
  	 * @param rdata Self pointer to the @c sc_remote_data
   	 */
 	void (*free)(struct sc_remote_data *rdata);
+	/**
+	 * Handler to preallocate a contiguous array of @c sc_remote_apdu data,
+	 * used by the following @c alloc calls before they fall back to
+	 * allocating the members one by one
+	 * @param rdata Self pointer to the @c sc_remote_data
+	 * @param count Number of members that are expected
+	 */
+	int (*reserve)(struct sc_remote_data *rdata, size_t count);
+
+	struct sc_remote_apdu *pool, *last;
+	size_t pool_size, pool_used;
 };
 
 
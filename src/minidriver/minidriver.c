@@ -133,15 +133,22 @@ HINSTANCE g_inst;
 #define TLS1_2_PROTOCOL_VERSION 0x0303
 #define TLS_DERIVE_KEY_SIZE 48
 
+#define MD_FS_HASH_SIZE 16
+
 struct md_directory {
 	unsigned char name[9];
 
 	CARD_DIRECTORY_ACCESS_CONDITION acl;
 
+	/* in the order of creation, as enumerated */
 	struct md_file *files;
 	struct md_directory *subdirs;
+	/* the same, hashed by name, see md_fs_hash() */
+	struct md_file *file_hash[MD_FS_HASH_SIZE];
+	struct md_directory *dir_hash[MD_FS_HASH_SIZE];
 
 	struct md_directory *next;
+	struct md_directory *hash_next;
 };
 
 struct md_file {
@@ -153,6 +160,7 @@ struct md_file {
 	size_t size;
 
 	struct md_file *next;
+	struct md_file *hash_next;
 };
 
 struct md_pkcs15_container {
@@ -163,6 +171,8 @@ struct md_pkcs15_container {
 	size_t size_key_exchange, size_sign;
 
 	struct sc_pkcs15_object *cert_obj, *prkey_obj, *pubkey_obj;
+	/* card algorithm of an RSA private key, see md_cont_set_key() */
+	struct sc_algorithm_info *alg_info;
 	// BOOL guid_overwrite;
 };
 
@@ -179,6 +189,37 @@ struct md_guid_conversion {
 #define MD_MAX_CONVERSIONS 50
 struct md_guid_conversion md_static_conversions[MD_MAX_CONVERSIONS] = {0};
 
+/*
+ * Content of the 'soft' files read from a card, shared by all the contexts
+ * of the process acquired for the same card (reader, ATR, 'cardid', 'cardcf').
+ */
+struct md_shared_file {
+	unsigned char name[9];
+	unsigned char *blob;
+	size_t size;
+	struct md_shared_file *next;
+};
+
+struct md_shared_card {
+	char *reader;
+	unsigned char atr[SC_MAX_ATR_SIZE];
+	size_t atr_len;
+	unsigned char cardid[MD_CARDID_SIZE];
+	size_t cardid_len;
+	CARD_CACHE_FILE_FORMAT cardcf;
+
+	struct md_shared_file *files;
+
+	/* number of contexts attached, and whether the card has changed since */
+	int refs;
+	BOOL stale;
+
+	struct md_shared_card *next;
+};
+
+static CRITICAL_SECTION md_shared_lock;
+static struct md_shared_card *md_shared_cards = NULL;
+
 typedef struct _VENDOR_SPECIFIC
 {
 	BOOL initialized;
@@ -190,9 +231,14 @@ typedef struct _VENDOR_SPECIFIC
 	struct sc_card *card;
 	struct sc_pkcs15_card *p15card;
 
+	/* identity of the associated card, to tell a reset from a card change */
+	struct sc_atr atr;
+	struct sc_serial_number serialnr;
+
 	struct md_pkcs15_container p15_containers[MD_MAX_KEY_CONTAINERS];
 
 	struct md_directory root;
+	struct md_shared_card *shared;
 
 	SCARDCONTEXT hSCardCtx;
 	SCARDHANDLE hScard;
@@ -215,6 +261,11 @@ static DWORD associate_card(PCARD_DATA pCardData);
 static void disassociate_card(PCARD_DATA pCardData);
 static DWORD md_pkcs15_delete_object(PCARD_DATA pCardData, struct sc_pkcs15_object *obj);
 static DWORD md_fs_init(PCARD_DATA pCardData);
+static void md_fs_materialize(PCARD_DATA pCardData, struct md_directory *prev);
+static void md_fs_free_tree(PCARD_DATA pCardData, struct md_directory *root);
+static void md_shared_attach(PCARD_DATA pCardData);
+static void md_shared_publish(PCARD_DATA pCardData);
+static void md_shared_release(PCARD_DATA pCardData, BOOL invalidate);
 static void md_fs_finalize(PCARD_DATA pCardData);
 
 #if defined(__GNUC__)
@@ -301,6 +352,7 @@ static void loghex(PCARD_DATA pCardData, int level, PBYTE data, size_t len)
 static DWORD reinit_card(PCARD_DATA pCardData)
 {
 	VENDOR_SPECIFIC *vs;
+	struct md_directory prev_root;
 	DWORD r;
 
 	if (!pCardData)
@@ -312,14 +364,22 @@ static DWORD reinit_card(PCARD_DATA pCardData)
 
 	logprintf(pCardData, 2, "trying to reinit card\n");
 
+	memset(&prev_root, 0, sizeof(prev_root));
 	if (vs->initialized) {
+		/* the card was reset or removed: the other contexts must not reuse what we shared */
+		md_shared_release(pCardData, TRUE);
 		disassociate_card(pCardData);
-		md_fs_finalize(pCardData);
+		/* keep the content read from the card, it may still be good */
+		prev_root = vs->root;
+		vs->root.files = NULL;
+		vs->root.subdirs = NULL;
+		memset(vs->root.file_hash, 0, sizeof(vs->root.file_hash));
+		memset(vs->root.dir_hash, 0, sizeof(vs->root.dir_hash));
 	}
 
 	r = associate_card(pCardData);
 	if (r != SCARD_S_SUCCESS)
-		return r;
+		goto out;
 
 	r = md_fs_init(pCardData);
 	if (r != SCARD_S_SUCCESS) {
@@ -327,10 +387,16 @@ static DWORD reinit_card(PCARD_DATA pCardData)
 			  "reinit_card md_fs_init failed, r = 0x%lX\n",
 			  (unsigned long)r);
 		disassociate_card(pCardData);
-		return r;
+		goto out;
 	}
 
-	return SCARD_S_SUCCESS;
+	md_shared_attach(pCardData);
+	md_fs_materialize(pCardData, &prev_root);
+	md_shared_publish(pCardData);
+
+out:
+	md_fs_free_tree(pCardData, &prev_root);
+	return r;
 }
 
 static BOOL lock(PCARD_DATA pCardData)
@@ -356,6 +422,51 @@ static void unlock(PCARD_DATA pCardData)
 	}
 }
 
+/* Read the serial number (UID) of the card, bypassing the value cached by the driver */
+static int
+md_card_serialnr(struct sc_card *card, struct sc_serial_number *serialnr)
+{
+	struct sc_serial_number cached = card->serialnr;
+	int r;
+
+	memset(&card->serialnr, 0, sizeof(card->serialnr));
+	memset(serialnr, 0, sizeof(*serialnr));
+	r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, serialnr);
+	if (r != SC_SUCCESS)   {
+		card->serialnr = cached;
+		memset(serialnr, 0, sizeof(*serialnr));
+	}
+	return r;
+}
+
+/*
+ * Whether the card in the reader is still the one that was associated:
+ * same ATR and, when the card tells it, same serial number.
+ */
+static BOOL
+md_card_same_identity(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct sc_serial_number serialnr;
+
+	if (vs->reader->atr.len != vs->atr.len
+			|| memcmp(vs->reader->atr.value, vs->atr.value, vs->atr.len))   {
+		logprintf(pCardData, 2, "ATR changed\n");
+		return FALSE;
+	}
+
+	if (vs->serialnr.len)   {
+		if (md_card_serialnr(vs->card, &serialnr) != SC_SUCCESS
+				|| serialnr.len != vs->serialnr.len
+				|| memcmp(serialnr.value, vs->serialnr.value, serialnr.len))   {
+			logprintf(pCardData, 2, "serial number changed\n");
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static DWORD reinit_card_for(PCARD_DATA pCardData, const char *name)
 {
 	DWORD r;
@@ -440,6 +551,18 @@ check_card_reader_status(PCARD_DATA pCardData, const char *name)
 		return reinit_card_for(pCardData, name);
 	}
 
+	if (r & SC_READER_CARD_CHANGED)   {
+		if (!md_card_same_identity(pCardData))   {
+			logprintf(pCardData, 1, "card changed, trying to reinit\n");
+			return reinit_card_for(pCardData, name);
+		}
+
+		/* same card, only reset: keep the binding, forget the login state */
+		logprintf(pCardData, 2, "card reset, keeping the association\n");
+		sc_pkcs15_pincache_clear(vs->p15card);
+		sc_invalidate_cache(vs->card);
+	}
+
 	return SCARD_S_SUCCESS;
 }
 
@@ -889,6 +1012,36 @@ md_cont_flags_from_key(PCARD_DATA pCardData, struct sc_pkcs15_object *key_obj, u
 }
 
 
+/* Binds the private key to the container and looks up its card algorithm
+ * once, the operations on the container then start from there */
+static void
+md_cont_set_key(PCARD_DATA pCardData, struct md_pkcs15_container *cont, struct sc_pkcs15_object *key_obj)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*) pCardData->pvVendorSpecific;
+	struct sc_pkcs15_prkey_info *prkey_info = (struct sc_pkcs15_prkey_info *)key_obj->data;
+
+	cont->prkey_obj = key_obj;
+	cont->id = prkey_info->id;
+	cont->alg_info = NULL;
+	if (key_obj->type == SC_PKCS15_TYPE_PRKEY_RSA)
+		cont->alg_info = sc_card_find_rsa_alg(vs->p15card->card,
+				(unsigned int) prkey_info->modulus_length);
+}
+
+
+/* Bucket of a file or directory name; names longer than the stored ones
+ * land in the bucket of their prefix and then fail the comparison */
+static unsigned int
+md_fs_hash(const char *name)
+{
+	unsigned int hash = 0;
+	size_t ii;
+
+	for (ii = 0; ii < sizeof(((struct md_file *)0)->name) - 1 && name[ii]; ii++)
+		hash = hash * 31 + (unsigned char)name[ii];
+	return hash % MD_FS_HASH_SIZE;
+}
+
 /* Search directory by name and optionally by name of it's parent */
 static DWORD
 md_fs_find_directory(PCARD_DATA pCardData, struct md_directory *parent, char *name, struct md_directory **out)
@@ -913,12 +1066,11 @@ md_fs_find_directory(PCARD_DATA pCardData, struct md_directory *parent, char *na
 		dir = parent;
 	}
 	else   {
-		dir = parent->subdirs;
+		dir = parent->dir_hash[md_fs_hash(name)];
 		while(dir)   {
-			if (strlen(name) > sizeof dir->name
-					|| !strncmp((char *)dir->name, name, sizeof dir->name))
+			if (!strncmp((char *)dir->name, name, sizeof dir->name))
 				break;
-			dir = dir->next;
+			dir = dir->hash_next;
 		}
 	}
 
@@ -934,13 +1086,15 @@ md_fs_find_directory(PCARD_DATA pCardData, struct md_directory *parent, char *na
 
 
 static DWORD
-md_fs_add_directory(PCARD_DATA pCardData, struct md_directory **head, char *name,
+md_fs_add_directory(PCARD_DATA pCardData, struct md_directory *parent, char *name,
 		CARD_FILE_ACCESS_CONDITION acl,
 		struct md_directory **out)
 {
 	struct md_directory *new_dir = NULL;
+	struct md_directory **head;
+	unsigned int hash;
 
-	if (!pCardData || !head || !name)
+	if (!pCardData || !parent || !name)
 		return SCARD_E_INVALID_PARAMETER;
 
 	new_dir = pCardData->pfnCspAlloc(sizeof(struct md_directory));
@@ -951,6 +1105,7 @@ md_fs_add_directory(PCARD_DATA pCardData, struct md_directory **head, char *name
 	strlcpy((char *)new_dir->name, name, sizeof(new_dir->name));
 	new_dir->acl = acl;
 
+	head = &parent->subdirs;
 	if (*head == NULL)   {
 		*head = new_dir;
 	}
@@ -961,6 +1116,10 @@ md_fs_add_directory(PCARD_DATA pCardData, struct md_directory **head, char *name
 		last->next = new_dir;
 	}
 
+	hash = md_fs_hash((char *)new_dir->name);
+	new_dir->hash_next = parent->dir_hash[hash];
+	parent->dir_hash[hash] = new_dir;
+
 	if (out)
 		*out = new_dir;
 
@@ -993,11 +1152,10 @@ md_fs_find_file(PCARD_DATA pCardData, char *parent, char *name, struct md_file *
 		return SCARD_E_INVALID_PARAMETER;
 	}
 
-	for (file = dir->files; file!=NULL;)   {
-		if (sizeof file->name < strlen(name)
-				|| !strncmp((char *)file->name, name, sizeof file->name))
+	for (file = dir->file_hash[md_fs_hash(name)]; file!=NULL;)   {
+		if (!strncmp((char *)file->name, name, sizeof file->name))
 			break;
-		file = file->next;
+		file = file->hash_next;
 	}
 	if (!file)
 		return SCARD_E_FILE_NOT_FOUND;
@@ -1011,12 +1169,14 @@ md_fs_find_file(PCARD_DATA pCardData, char *parent, char *name, struct md_file *
 
 
 static DWORD
-md_fs_add_file(PCARD_DATA pCardData, struct md_file **head, char *name, CARD_FILE_ACCESS_CONDITION acl,
+md_fs_add_file(PCARD_DATA pCardData, struct md_directory *dir, char *name, CARD_FILE_ACCESS_CONDITION acl,
 		unsigned char *blob, size_t size, struct md_file **out)
 {
 	struct md_file *new_file = NULL;
+	struct md_file **head;
+	unsigned int hash;
 
-	if (!pCardData || !head || !name)
+	if (!pCardData || !dir || !name)
 		return SCARD_E_INVALID_PARAMETER;
 
 	new_file = pCardData->pfnCspAlloc(sizeof(struct md_file));
@@ -1041,6 +1201,7 @@ md_fs_add_file(PCARD_DATA pCardData, struct md_file **head, char *name, CARD_FIL
 			memset(new_file->blob, 0, size);
 	}
 
+	head = &dir->files;
 	if (*head == NULL)   {
 		*head = new_file;
 	}
@@ -1051,6 +1212,10 @@ md_fs_add_file(PCARD_DATA pCardData, struct md_file **head, char *name, CARD_FIL
 		last->next = new_file;
 	}
 
+	hash = md_fs_hash((char *)new_file->name);
+	new_file->hash_next = dir->file_hash[hash];
+	dir->file_hash[hash] = new_file;
+
 	if (out)
 		*out = new_file;
 
@@ -1076,9 +1241,8 @@ static DWORD
 md_fs_delete_file(PCARD_DATA pCardData, char *parent, char *name)
 {
 	VENDOR_SPECIFIC *vs;
-	struct md_file *file = NULL, *file_to_rm = NULL;
+	struct md_file **prev, *file_to_rm = NULL;
 	struct md_directory *dir = NULL;
-	int deleted = 0;
 	DWORD dwret;
 
 	if (!pCardData || !name)
@@ -1103,27 +1267,23 @@ md_fs_delete_file(PCARD_DATA pCardData, char *parent, char *name)
 		return SCARD_E_FILE_NOT_FOUND;
 	}
 
-	if (sizeof dir->files->name < strlen(name)
-			|| !strncmp((char *)dir->files->name, name, sizeof dir->files->name))   {
-		file_to_rm = dir->files;
-		dir->files = dir->files->next;
-		md_fs_free_file(pCardData, file_to_rm);
-		dwret = SCARD_S_SUCCESS;
+	for (prev = &dir->file_hash[md_fs_hash(name)]; *prev != NULL; prev = &(*prev)->hash_next)   {
+		if (!strncmp((char *)(*prev)->name, name, sizeof (*prev)->name))
+			break;
+	}
+	if (*prev == NULL)   {
+		dwret = SCARD_E_FILE_NOT_FOUND;
 	}
 	else   {
-		for (file = dir->files; file!=NULL; file = file->next)   {
-			if (!file->next)
-				break;
-			if (sizeof file->next->name < strlen(name)
-					|| !strncmp((char *)file->next->name, name, sizeof file->next->name))   {
-				file_to_rm = file->next;
-				file->next = file->next->next;
-				md_fs_free_file(pCardData, file_to_rm);
-				deleted = 1;
-				break;
-			}
-		}
-		dwret = deleted ? SCARD_S_SUCCESS : SCARD_E_FILE_NOT_FOUND;
+		file_to_rm = *prev;
+		*prev = file_to_rm->hash_next;
+
+		for (prev = &dir->files; *prev != file_to_rm; prev = &(*prev)->next)
+			;
+		*prev = file_to_rm->next;
+
+		md_fs_free_file(pCardData, file_to_rm);
+		dwret = SCARD_S_SUCCESS;
 	}
 
 	if (!strcmp(parent, "mscp"))   {
@@ -1147,29 +1307,22 @@ md_fs_delete_file(PCARD_DATA pCardData, char *parent, char *name)
 	return dwret;
 }
 
+/* Free the files and the subdirectories of 'root' */
 static void
-md_fs_finalize(PCARD_DATA pCardData)
+md_fs_free_tree(PCARD_DATA pCardData, struct md_directory *root)
 {
-	VENDOR_SPECIFIC *vs;
 	struct md_file *file = NULL, *file_to_rm;
 	struct md_directory *dir = NULL, *dir_to_rm;
 
-	if (!pCardData)
-		return;
-
-	vs = pCardData->pvVendorSpecific;
-	if (!vs)
-		return;
-
-	file = vs->root.files;
+	file = root->files;
 	while (file != NULL) {
 		file_to_rm = file;
 		file = file->next;
 		md_fs_free_file(pCardData, file_to_rm);
 	}
-	vs->root.files = NULL;
+	root->files = NULL;
 
-	dir = vs->root.subdirs;
+	dir = root->subdirs;
 	while(dir)   {
 		file = dir->files;
 		while (file != NULL) {
@@ -1181,7 +1334,24 @@ md_fs_finalize(PCARD_DATA pCardData)
 		dir = dir->next;
 		pCardData->pfnCspFree(dir_to_rm);
 	}
-	vs->root.subdirs = NULL;
+	root->subdirs = NULL;
+	memset(root->file_hash, 0, sizeof(root->file_hash));
+	memset(root->dir_hash, 0, sizeof(root->dir_hash));
+}
+
+static void
+md_fs_finalize(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs;
+
+	if (!pCardData)
+		return;
+
+	vs = pCardData->pvVendorSpecific;
+	if (!vs)
+		return;
+
+	md_fs_free_tree(pCardData, &vs->root);
 }
 
 /*
@@ -1532,23 +1702,108 @@ md_fs_read_content(PCARD_DATA pCardData, char *parent, struct md_file *file)
 	return SCARD_E_FILE_NOT_FOUND;
 }
 
+/* FNV-1a, folds the data into hash */
+static unsigned int
+md_cardcf_fold(unsigned int hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t ii;
+
+	for (ii = 0; ii < len; ii++)   {
+		hash ^= p[ii];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
 /*
- * Set content of 'cardcf',
- * for that look for the possible source in the following order:
- * - data from the dedicated PKCS#15 'DATA' object;
- * - 'lastUpdate' attribute of tokenInfo;
- * - random data.
+ * Freshness derived from the PKCS#15 objects of the given type:
+ * it changes when an object is added, removed or moved on the card.
+ */
+static WORD
+md_cardcf_objects_freshness(PCARD_DATA pCardData, unsigned int type)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct sc_pkcs15_object *objs[MD_MAX_KEY_CONTAINERS];
+	unsigned int hash = 2166136261U;
+	int rv, ii;
+
+	rv = sc_pkcs15_get_objects(vs->p15card, type, objs, MD_MAX_KEY_CONTAINERS);
+	if (rv < 0)   {
+		logprintf(pCardData, 0, "object enumeration failed: %s\n", sc_strerror(rv));
+		return 0;
+	}
+
+	hash = md_cardcf_fold(hash, &rv, sizeof(rv));
+	for (ii = 0; ii < rv; ii++)   {
+		struct sc_pkcs15_id *id = NULL;
+		struct sc_path *path = NULL;
+
+		if ((objs[ii]->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_CERT)   {
+			struct sc_pkcs15_cert_info *cert_info = (struct sc_pkcs15_cert_info *) objs[ii]->data;
+			id = &cert_info->id;
+			path = &cert_info->path;
+		}
+		else if ((objs[ii]->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_PRKEY)   {
+			struct sc_pkcs15_prkey_info *prkey_info = (struct sc_pkcs15_prkey_info *) objs[ii]->data;
+			id = &prkey_info->id;
+			path = &prkey_info->path;
+		}
+
+		hash = md_cardcf_fold(hash, &objs[ii]->type, sizeof(objs[ii]->type));
+		hash = md_cardcf_fold(hash, objs[ii]->label, strlen(objs[ii]->label));
+		if (id)
+			hash = md_cardcf_fold(hash, id->value, id->len);
+		if (path)   {
+			hash = md_cardcf_fold(hash, path->value, path->len);
+			hash = md_cardcf_fold(hash, &path->index, sizeof(path->index));
+		}
+	}
+
+	return (WORD)(hash ^ (hash >> 16));
+}
+
+/*
+ * Set content of 'cardcf'.
+ * Base CSP keeps the files read from the card in its own cache, and uses
+ * it as long as the freshness counters of 'cardcf' are the same as when
+ * the files were cached. The counters are derived from:
+ * - 'lastUpdate' attribute of tokenInfo, if the card has one;
+ * - otherwise, the list of the private key and certificate objects.
+ * So they stay the same from one session to the next, and change when
+ * the content of the card changes.
  */
 static DWORD
 md_set_cardcf(PCARD_DATA pCardData, struct md_file *file)
 {
-	CARD_CACHE_FILE_FORMAT empty = {0};
+	VENDOR_SPECIFIC *vs;
+	CARD_CACHE_FILE_FORMAT cardcf = {0};
+	char *last_update = NULL;
 	DWORD dwret;
 
 	if (!pCardData || !file)
 		return SCARD_E_INVALID_PARAMETER;
 
-	dwret = md_fs_set_content(pCardData, file, (unsigned char *)(&empty), MD_CARDCF_LENGTH);
+	vs = pCardData->pvVendorSpecific;
+	if (!vs || !vs->p15card)
+		return SCARD_E_INVALID_PARAMETER;
+
+	if (vs->p15card->tokeninfo)
+		last_update = sc_pkcs15_get_lastupdate(vs->p15card);
+	if (last_update)   {
+		unsigned int hash = md_cardcf_fold(2166136261U, last_update, strlen(last_update));
+
+		logprintf(pCardData, 3, "set 'cardcf' from lastUpdate '%s'\n", last_update);
+		cardcf.wContainersFreshness = (WORD)(hash ^ (hash >> 16));
+		cardcf.wFilesFreshness = cardcf.wContainersFreshness;
+	}
+	else   {
+		logprintf(pCardData, 3, "set 'cardcf' from the PKCS#15 objects\n");
+		cardcf.wContainersFreshness = md_cardcf_objects_freshness(pCardData, SC_PKCS15_TYPE_PRKEY);
+		cardcf.wFilesFreshness = md_cardcf_objects_freshness(pCardData, SC_PKCS15_TYPE_CERT);
+	}
+
+	dwret = md_fs_set_content(pCardData, file, (unsigned char *)(&cardcf), MD_CARDCF_LENGTH);
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
@@ -1578,13 +1833,13 @@ md_set_cardapps(PCARD_DATA pCardData, struct md_file *file)
 
 /* check if the card has root certificates. If yes, notify the base csp by creating the msroots file */
 static DWORD
-md_fs_add_msroots(PCARD_DATA pCardData, struct md_file **head)
+md_fs_add_msroots(PCARD_DATA pCardData, struct md_directory *dir)
 {
 	VENDOR_SPECIFIC *vs;
 	int rv, ii, cert_num;
 	DWORD dwret;
 	struct sc_pkcs15_object *prkey_objs[MD_MAX_KEY_CONTAINERS];
-	if (!pCardData || !head)
+	if (!pCardData || !dir)
 		return SCARD_E_INVALID_PARAMETER;
 
 	vs = (VENDOR_SPECIFIC *) pCardData->pvVendorSpecific;
@@ -1600,7 +1855,7 @@ md_fs_add_msroots(PCARD_DATA pCardData, struct md_file **head)
 	for(ii = 0; ii < cert_num; ii++)   {
 		struct sc_pkcs15_cert_info *cert_info = (struct sc_pkcs15_cert_info *) prkey_objs[ii]->data;
 		if (cert_info->authority) {
-			dwret = md_fs_add_file(pCardData, head, "msroots", EveryoneReadUserWriteAc, NULL, 0, NULL);
+			dwret = md_fs_add_file(pCardData, dir, "msroots", EveryoneReadUserWriteAc, NULL, 0, NULL);
 			if (dwret != SCARD_S_SUCCESS)
 				return dwret;
 			return SCARD_S_SUCCESS;
@@ -1641,6 +1896,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 	struct sc_pkcs15_object *prkey_objs[MD_MAX_KEY_CONTAINERS];
 	pin_mode_t pin_mode = SCF_NONE;
 	int pin_cont_idx = -1;
+	struct md_directory *mscp = NULL;
 
 	if (!pCardData || !file)
 		return SCARD_E_INVALID_PARAMETER;
@@ -1650,6 +1906,11 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 	if (!vs)
 		return SCARD_E_INVALID_PARAMETER;
 
+	/* the certificate files are created next to 'cmapfile' */
+	dwret = md_fs_find_directory(pCardData, NULL, "mscp", &mscp);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
 	dwret = md_get_pin_by_role(pCardData, ROLE_USER, &vs->pin_objs[ROLE_USER]);
 	if (dwret != SCARD_S_SUCCESS)   {
 		logprintf(pCardData, 2, "Cannot get User PIN object");
@@ -1846,8 +2107,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 			  "Container[%i]'s key-exchange:%"SC_FORMAT_LEN_SIZE_T"u, sign:%"SC_FORMAT_LEN_SIZE_T"u\n",
 			  ii, cont->size_key_exchange, cont->size_sign);
 
-		cont->id = prkey_info->id;
-		cont->prkey_obj = prkey_objs[ii];
+		md_cont_set_key(pCardData, cont, prkey_objs[ii]);
 
 		/* Try to find the friend objects: certificate and public key */
 		if (!sc_pkcs15_find_cert_by_id(vs->p15card, &cont->id, &cont->cert_obj))
@@ -2023,7 +2283,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 				if (vs->p15_containers[ii].size_key_exchange)   {
 					snprintf(k_name, sizeof(k_name), "kxc%02i", ii);
 					k_name[sizeof(k_name) - 1] = 0;
-					dwret = md_fs_add_file(pCardData, &(file->next), k_name, file->acl, NULL, 0, NULL);
+					dwret = md_fs_add_file(pCardData, mscp, k_name, file->acl, NULL, 0, NULL);
 					if (dwret != SCARD_S_SUCCESS)
 						return dwret;
 				}
@@ -2031,7 +2291,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 				if (vs->p15_containers[ii].size_sign)   {
 					snprintf(k_name, sizeof(k_name), "ksc%02i", ii);
 					k_name[sizeof(k_name) - 1] = 0;
-					dwret = md_fs_add_file(pCardData, &(file->next), k_name, file->acl, NULL, 0, NULL);
+					dwret = md_fs_add_file(pCardData, mscp, k_name, file->acl, NULL, 0, NULL);
 					if (dwret != SCARD_S_SUCCESS)
 						return dwret;
 				}
@@ -2042,7 +2302,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 		}
 	}
 
-	dwret = md_fs_add_msroots(pCardData, &(file->next));
+	dwret = md_fs_add_msroots(pCardData, mscp);
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
@@ -2072,32 +2332,32 @@ md_fs_init(PCARD_DATA pCardData)
 
 	vs = pCardData->pvVendorSpecific;
 
-	dwret = md_fs_add_file(pCardData, &(vs->root.files), "cardid", EveryoneReadAdminWriteAc, NULL, 0, &cardid);
+	dwret = md_fs_add_file(pCardData, &vs->root, "cardid", EveryoneReadAdminWriteAc, NULL, 0, &cardid);
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 	dwret = md_set_cardid(pCardData, cardid);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 
-	dwret = md_fs_add_file(pCardData, &(vs->root.files), "cardcf", EveryoneReadUserWriteAc, NULL, 0, &cardcf);
+	dwret = md_fs_add_file(pCardData, &vs->root, "cardcf", EveryoneReadUserWriteAc, NULL, 0, &cardcf);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 	dwret = md_set_cardcf(pCardData, cardcf);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 
-	dwret = md_fs_add_file(pCardData, &(vs->root.files), "cardapps", EveryoneReadAdminWriteAc, NULL, 0, &cardapps);
+	dwret = md_fs_add_file(pCardData, &vs->root, "cardapps", EveryoneReadAdminWriteAc, NULL, 0, &cardapps);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 	dwret = md_set_cardapps(pCardData, cardapps);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 
-	dwret = md_fs_add_directory(pCardData, &(vs->root.subdirs), "mscp", UserCreateDeleteDirAc, &mscp);
+	dwret = md_fs_add_directory(pCardData, &vs->root, "mscp", UserCreateDeleteDirAc, &mscp);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 
-	dwret = md_fs_add_file(pCardData, &(mscp->files), "cmapfile", EveryoneReadUserWriteAc, NULL, 0, &cmapfile);
+	dwret = md_fs_add_file(pCardData, mscp, "cmapfile", EveryoneReadUserWriteAc, NULL, 0, &cmapfile);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 	dwret = md_set_cmapfile(pCardData, cmapfile);
@@ -2119,6 +2379,292 @@ ret_cleanup:
 	return dwret;
 }
 
+/* Whether the file 'name' has the same content in both lists */
+static BOOL
+md_fs_same_content(struct md_file *files1, struct md_file *files2, char *name)
+{
+	while (files1 && strncmp((char *)files1->name, name, sizeof files1->name))
+		files1 = files1->next;
+	while (files2 && strncmp((char *)files2->name, name, sizeof files2->name))
+		files2 = files2->next;
+
+	return files1 && files2 && files1->blob && files2->blob
+		&& files1->size == files2->size
+		&& !memcmp(files1->blob, files2->blob, files1->size);
+}
+
+/*
+ * Fill the content of the 'soft' files of 'mscp' that come from the card
+ * (certificates, 'msroots') in one pass, instead of on the first
+ * CardReadFile() of each, which Windows logon issues in large numbers.
+ * If 'cardid' and 'cardcf' did not change since 'prev' was built,
+ * the content is taken over from 'prev' without reading the card.
+ * Files that cannot be read are left to CardReadFile().
+ */
+static void
+md_fs_materialize(PCARD_DATA pCardData, struct md_directory *prev)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct md_directory *mscp = NULL, *prev_mscp = NULL;
+	struct md_file *file, *prev_file;
+	DWORD dwret;
+
+	if (md_fs_find_directory(pCardData, NULL, "mscp", &mscp) != SCARD_S_SUCCESS)
+		return;
+
+	if (prev && md_fs_same_content(prev->files, vs->root.files, "cardid")
+			&& md_fs_same_content(prev->files, vs->root.files, "cardcf"))
+		md_fs_find_directory(pCardData, prev, "mscp", &prev_mscp);
+
+	for (file = mscp->files; file != NULL; file = file->next)   {
+		if (file->blob)
+			continue;
+
+		for (prev_file = prev_mscp ? prev_mscp->files : NULL; prev_file != NULL; prev_file = prev_file->next)   {
+			if (prev_file->blob && !strncmp((char *)prev_file->name, (char *)file->name, sizeof file->name))   {
+				file->blob = prev_file->blob;
+				file->size = prev_file->size;
+				prev_file->blob = NULL;
+				prev_file->size = 0;
+				break;
+			}
+		}
+		if (file->blob)   {
+			logprintf(pCardData, 3, "'%s' content taken over\n", (char *)file->name);
+			continue;
+		}
+
+		dwret = md_fs_read_content(pCardData, "mscp", file);
+		if (dwret != SCARD_S_SUCCESS)
+			logprintf(pCardData, 2, "cannot read '%s' content now: %lX\n",
+				  (char *)file->name, (unsigned long)dwret);
+	}
+}
+
+static void
+md_shared_free(struct md_shared_card *shared)
+{
+	struct md_shared_file *file, *file_to_rm;
+
+	file = shared->files;
+	while (file != NULL) {
+		file_to_rm = file;
+		file = file->next;
+		free(file_to_rm->blob);
+		free(file_to_rm);
+	}
+	free(shared->reader);
+	free(shared);
+}
+
+/* Unlink 'shared' from the list and free it; called with 'md_shared_lock' held */
+static void
+md_shared_remove(struct md_shared_card *shared)
+{
+	struct md_shared_card **pp;
+
+	for (pp = &md_shared_cards; *pp != NULL; pp = &(*pp)->next)   {
+		if (*pp == shared)   {
+			*pp = shared->next;
+			md_shared_free(shared);
+			return;
+		}
+	}
+}
+
+/*
+ * Whether 'shared' describes the card of the context:
+ * the same reader and ATR, and unchanged 'cardid' and 'cardcf'.
+ */
+static BOOL
+md_shared_match(PCARD_DATA pCardData, struct md_shared_card *shared,
+		struct md_file *cardid, struct md_file *cardcf)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+
+	return strcmp(shared->reader, vs->reader->name) == 0
+		&& shared->atr_len == pCardData->cbAtr
+		&& !memcmp(shared->atr, pCardData->pbAtr, shared->atr_len)
+		&& shared->cardid_len == cardid->size
+		&& !memcmp(shared->cardid, cardid->blob, cardid->size)
+		&& cardcf->size == sizeof(shared->cardcf)
+		&& !memcmp(&shared->cardcf, cardcf->blob, sizeof(shared->cardcf));
+}
+
+/*
+ * Attach the context to the content already read from the same card by
+ * another context of the process, and copy it into the files of 'mscp'
+ * which have no content yet.
+ * Entries left by another card in the same reader are dropped.
+ */
+static void
+md_shared_attach(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct md_shared_card *shared, *next, *found = NULL;
+	struct md_shared_file *sfile;
+	struct md_directory *mscp = NULL;
+	struct md_file *cardid = NULL, *cardcf = NULL, *file;
+
+	if (vs->shared || !vs->reader || !vs->reader->name)
+		return;
+
+	md_fs_find_file(pCardData, NULL, "cardid", &cardid);
+	md_fs_find_file(pCardData, NULL, "cardcf", &cardcf);
+	if (!cardid || !cardid->blob || cardid->size > MD_CARDID_SIZE || !cardcf || !cardcf->blob
+			|| pCardData->cbAtr > SC_MAX_ATR_SIZE)
+		return;
+	if (md_fs_find_directory(pCardData, NULL, "mscp", &mscp) != SCARD_S_SUCCESS)
+		return;
+
+	EnterCriticalSection(&md_shared_lock);
+	for (shared = md_shared_cards; shared != NULL; shared = next)   {
+		next = shared->next;
+		if (strcmp(shared->reader, vs->reader->name))
+			continue;
+
+		if (!found && !shared->stale && md_shared_match(pCardData, shared, cardid, cardcf))
+			found = shared;
+		else if (shared->refs == 0)
+			md_shared_remove(shared);
+		else
+			shared->stale = TRUE;
+	}
+
+	if (found)   {
+		for (file = mscp->files; file != NULL; file = file->next)   {
+			if (file->blob)
+				continue;
+			for (sfile = found->files; sfile != NULL; sfile = sfile->next)
+				if (!strncmp((char *)sfile->name, (char *)file->name, sizeof file->name))
+					break;
+			if (!sfile)
+				continue;
+
+			file->blob = pCardData->pfnCspAlloc(sfile->size);
+			if (!file->blob)
+				continue;
+			CopyMemory(file->blob, sfile->blob, sfile->size);
+			file->size = sfile->size;
+			logprintf(pCardData, 3, "'%s' content shared\n", (char *)file->name);
+		}
+		found->refs++;
+		vs->shared = found;
+	}
+	LeaveCriticalSection(&md_shared_lock);
+}
+
+/*
+ * Make the content of the files of 'mscp' available to the next contexts
+ * acquired for the same card.
+ */
+static void
+md_shared_publish(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct md_shared_card *shared;
+	struct md_shared_file *sfile;
+	struct md_directory *mscp = NULL;
+	struct md_file *cardid = NULL, *cardcf = NULL, *file;
+
+	if (!vs->initialized || !vs->reader || !vs->reader->name)
+		return;
+
+	md_fs_find_file(pCardData, NULL, "cardid", &cardid);
+	md_fs_find_file(pCardData, NULL, "cardcf", &cardcf);
+	if (!cardid || !cardid->blob || cardid->size > MD_CARDID_SIZE
+			|| !cardcf || !cardcf->blob || cardcf->size != sizeof(shared->cardcf)
+			|| pCardData->cbAtr > SC_MAX_ATR_SIZE)
+		return;
+	if (md_fs_find_directory(pCardData, NULL, "mscp", &mscp) != SCARD_S_SUCCESS)
+		return;
+
+	EnterCriticalSection(&md_shared_lock);
+	shared = vs->shared;
+	if (!shared)   {
+		shared = calloc(1, sizeof(struct md_shared_card));
+		if (!shared)
+			goto out;
+		shared->reader = strdup(vs->reader->name);
+		if (!shared->reader)   {
+			free(shared);
+			goto out;
+		}
+		memcpy(shared->atr, pCardData->pbAtr, pCardData->cbAtr);
+		shared->atr_len = pCardData->cbAtr;
+		memcpy(shared->cardid, cardid->blob, cardid->size);
+		shared->cardid_len = cardid->size;
+		memcpy(&shared->cardcf, cardcf->blob, sizeof(shared->cardcf));
+		shared->refs = 1;
+		shared->next = md_shared_cards;
+		md_shared_cards = shared;
+		vs->shared = shared;
+	}
+
+	for (file = mscp->files; file != NULL; file = file->next)   {
+		if (!file->blob || !strcmp((char *)file->name, "cmapfile"))
+			continue;
+		for (sfile = shared->files; sfile != NULL; sfile = sfile->next)
+			if (!strncmp((char *)sfile->name, (char *)file->name, sizeof file->name))
+				break;
+		if (sfile)
+			continue;
+
+		sfile = calloc(1, sizeof(struct md_shared_file));
+		if (!sfile)
+			break;
+		sfile->blob = malloc(file->size ? file->size : 1);
+		if (!sfile->blob)   {
+			free(sfile);
+			break;
+		}
+		memcpy(sfile->name, file->name, sizeof(sfile->name));
+		memcpy(sfile->blob, file->blob, file->size);
+		sfile->size = file->size;
+		sfile->next = shared->files;
+		shared->files = sfile;
+	}
+out:
+	LeaveCriticalSection(&md_shared_lock);
+}
+
+/*
+ * Detach the context from the shared content.
+ * With 'invalidate' the content is not given to the next contexts anymore,
+ * because the card was reset or its files were changed through this context.
+ */
+static void
+md_shared_release(PCARD_DATA pCardData, BOOL invalidate)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct md_shared_card *shared;
+
+	if (!vs || !vs->shared)
+		return;
+
+	EnterCriticalSection(&md_shared_lock);
+	shared = vs->shared;
+	vs->shared = NULL;
+	shared->refs--;
+	if (invalidate)
+		shared->stale = TRUE;
+	if (shared->stale && shared->refs == 0)
+		md_shared_remove(shared);
+	LeaveCriticalSection(&md_shared_lock);
+}
+
+static void
+md_shared_cleanup(void)
+{
+	struct md_shared_card *shared;
+
+	while (md_shared_cards != NULL)   {
+		shared = md_shared_cards;
+		md_shared_cards = shared->next;
+		md_shared_free(shared);
+	}
+}
+
 /* Create SC context */
 static DWORD
 md_create_context(PCARD_DATA pCardData, VENDOR_SPECIFIC *vs)
@@ -2452,7 +2998,7 @@ md_pkcs15_generate_key(PCARD_DATA pCardData, DWORD idx, DWORD key_type, DWORD ke
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
-	cont->id = ((struct sc_pkcs15_prkey_info *)cont->prkey_obj->data)->id;
+	md_cont_set_key(pCardData, cont, cont->prkey_obj);
 	cont->index = idx;
 	cont->flags = CONTAINER_MAP_VALID_CONTAINER;
 
@@ -2589,7 +3135,7 @@ md_pkcs15_store_key(PCARD_DATA pCardData, DWORD idx, DWORD key_type, BYTE *blob,
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
-	cont->id = ((struct sc_pkcs15_prkey_info *)cont->prkey_obj->data)->id;
+	md_cont_set_key(pCardData, cont, cont->prkey_obj);
 	cont->index = idx;
 	cont->flags |= CONTAINER_MAP_VALID_CONTAINER;
 
@@ -3181,6 +3727,7 @@ DWORD WINAPI CardDeleteContext(__inout PCARD_DATA  pCardData)
 	hScard_lock = vs->hScard_lock;
 	EnterCriticalSection(&hScard_lock);
 
+	md_shared_release(pCardData, FALSE);
 	disassociate_card(pCardData);
 	md_fs_finalize(pCardData);
 
@@ -4015,7 +4562,7 @@ DWORD WINAPI CardCreateFile(__in PCARD_DATA pCardData,
 		goto err;
 	}
 
-	dwret = md_fs_add_file(pCardData, &dir->files, pszFileName, AccessCondition, NULL, cbInitialCreationSize, NULL);
+	dwret = md_fs_add_file(pCardData, dir, pszFileName, AccessCondition, NULL, cbInitialCreationSize, NULL);
 	if (dwret != SCARD_S_SUCCESS)
 		goto err;
 
@@ -4140,6 +4687,7 @@ DWORD WINAPI CardWriteFile(__in PCARD_DATA pCardData,
 	}
 
 	if (pszDirectoryName && !strcmp(pszDirectoryName, "mscp"))   {
+		md_shared_release(pCardData, TRUE);
 		if ((strstr(pszFileName, "kxc") == pszFileName) || (strstr(pszFileName, "ksc") == pszFileName))	{
 			dwret = md_pkcs15_store_certificate(pCardData, pszFileName, pbData, cbData);
 			if (dwret != SCARD_S_SUCCESS)
@@ -4181,6 +4729,8 @@ DWORD WINAPI CardDeleteFile(__in PCARD_DATA pCardData,
 			  (unsigned long)dwret);
 		goto err;
 	}
+	if (pszDirectoryName && !strcmp(pszDirectoryName, "mscp"))
+		md_shared_release(pCardData, TRUE);
 
 err:
 	unlock(pCardData);
@@ -4381,6 +4931,7 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	struct sc_pkcs15_prkey_info *prkey_info;
 	BYTE *pbuf = NULL, *pbuf2 = NULL;
 	struct sc_pkcs15_object *pkey = NULL;
+	struct md_pkcs15_container *cont;
 	struct sc_algorithm_info *alg_info = NULL;
 
 	logprintf(pCardData, 1, "\nP:%lu T:%lu pCardData:%p ",
@@ -4429,7 +4980,8 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 			  pInfo->pPaddingInfo,
 			  (unsigned int)pInfo->dwPaddingType);
 
-	pkey = vs->p15_containers[pInfo->bContainerIndex].prkey_obj;
+	cont = &vs->p15_containers[pInfo->bContainerIndex];
+	pkey = cont->prkey_obj;
 	if (!pkey)   {
 		logprintf(pCardData, 2, "CardRSADecrypt prkey not found\n");
 		dwret = SCARD_E_NO_KEY_CONTAINER;
@@ -4457,7 +5009,7 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	loghex(pCardData, 7, pbuf, pInfo->cbData);
 
 	prkey_info = (struct sc_pkcs15_prkey_info *)(pkey->data);
-	alg_info = sc_card_find_rsa_alg(vs->p15card->card, (unsigned int) prkey_info->modulus_length);
+	alg_info = cont->alg_info;
 	if (!alg_info)   {
 		logprintf(pCardData, 2,
 			  "Cannot get appropriate RSA card algorithm for key size %"SC_FORMAT_LEN_SIZE_T"u\n",
@@ -6794,6 +7346,9 @@ DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags
 	dwret = md_fs_init(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_disassoc;
+	md_shared_attach(pCardData);
+	md_fs_materialize(pCardData, NULL);
+	md_shared_publish(pCardData);
 
 	logprintf(pCardData, 1, "OpenSC init done.\n");
 	logprintf(pCardData, 1, "Supplied version %lu - version used %lu.\n",
@@ -6906,6 +7461,9 @@ static DWORD associate_card(PCARD_DATA pCardData)
 		return SCARD_E_UNKNOWN_CARD;
 	}
 
+	vs->atr = vs->card->atr;
+	md_card_serialnr(vs->card, &vs->serialnr);
+
 	vs->initialized = TRUE;
 
 	return SCARD_S_SUCCESS;
@@ -6946,6 +7504,8 @@ static void disassociate_card(PCARD_DATA pCardData)
 	}
 
 	vs->reader = NULL;
+	memset(&vs->atr, 0, sizeof(vs->atr));
+	memset(&vs->serialnr, 0, sizeof(vs->serialnr));
 
 	vs->hSCardCtx = -1;
 	vs->hScard = -1;
@@ -6989,8 +7549,11 @@ BOOL APIENTRY DllMain( HINSTANCE hinstDLL,
 		g_inst = hinstDLL;
 		sc_notify_instance = hinstDLL;
 		sc_notify_init();
+		InitializeCriticalSection(&md_shared_lock);
 		break;
 	case DLL_PROCESS_DETACH:
+		md_shared_cleanup();
+		DeleteCriticalSection(&md_shared_lock);
 		sc_notify_close();
 		break;
 	}
@@ -3,11 +3,13 @@ TOPDIR = ..\..
 TARGET1			= opensc-pkcs11.dll
 TARGET2			= onepin-opensc-pkcs11.dll
 TARGET3			= pkcs11-spy.dll
+TARGET4			= pkcs11-spy-decode.exe
 
 OBJECTS			= pkcs11-global.obj pkcs11-session.obj pkcs11-object.obj misc.obj slot.obj \
 				  mechanism.obj openssl.obj framework-pkcs15.obj framework-pkcs15init.obj \
 				  debug.obj pkcs11-display.obj versioninfo-pkcs11.res
 OBJECTS3		= pkcs11-spy.obj pkcs11-display.obj versioninfo-pkcs11-spy.res
+OBJECTS4		= pkcs11-spy-decode.obj pkcs11-display.obj
 
 LIBS = $(TOPDIR)\src\libopensc\opensc_a.lib \
 	   $(TOPDIR)\src\pkcs15init\pkcs15init.lib \
@@ -21,7 +23,7 @@ LIBS = $(TOPDIR)\src\libopensc\opensc_a.lib \
 	   $(TOPDIR)\src\pkcs15init\pkcs15init.lib
 LIBS3 = $(TOPDIR)\src\common\libpkcs11.lib $(TOPDIR)\src\common\libscdl.lib $(TOPDIR)\src\common\common.lib
 
-all: $(TARGET1) $(TARGET2) $(TARGET3)
+all: $(TARGET1) $(TARGET2) $(TARGET3) $(TARGET4)
 
 !INCLUDE $(TOPDIR)\win32\Make.rules.mak
 
@@ -38,3 +40,6 @@ $(TARGET2): $(OBJECTS) $(LIBS)
 $(TARGET3): $(OBJECTS3) $(LIBS3)
 	link $(LINKFLAGS) /dll /implib:$*.lib /out:$(TARGET3) $(OBJECTS3) $(LIBS3) $(OPENSSL_LIB) gdi32.lib advapi32.lib
 	if EXIST $(TARGET3).manifest mt -manifest $(TARGET3).manifest -outputresource:$(TARGET3);2
+
+$(TARGET4): $(OBJECTS4)
+	link $(LINKFLAGS) /out:$(TARGET4) $(OBJECTS4) $(OPENSSL_LIB) gdi32.lib advapi32.lib
@@ -64,8 +64,15 @@ struct pkcs15_fw_data {
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
+	/* PKCS15_DEFER_* types whose objects are created on first use, and
+	 * the slot the public objects of the token go to */
+	unsigned int			deferred;
+	struct sc_pkcs11_slot *		public_slot;
 };
 
+#define PKCS15_DEFER_CERT	0x01
+#define PKCS15_DEFER_DATA	0x02
+
 struct pkcs15_any_object {
 	struct sc_pkcs11_object		base;
 	unsigned int			refcount;
@@ -93,6 +100,13 @@ struct pkcs15_prkey_object {
 
 	struct sc_pkcs15_prkey_info *	prv_info;
 	struct sc_pkcs15_pubkey *	pub_data;
+
+	/* The algorithms of the token the key can be used with, as bits of
+	 * their index in supported_algos of the TokenInfo, and the result of
+	 * pkcs15_prkey_can_do() for the mechanisms none of them matches */
+	unsigned int			sign_algos;
+	unsigned int			decrypt_algos;
+	CK_RV				algos_rv;
 };
 #define prv_flags		base.base.flags
 #define prv_p15obj		base.p15_object
@@ -104,6 +118,13 @@ struct pkcs15_pubkey_object {
 
 	struct sc_pkcs15_pubkey_info *	pub_info;	/* NULL for key extracted from cert */
 	struct sc_pkcs15_pubkey *	pub_data;
+
+	/* Encodings of pub_data, built on the first C_GetAttributeValue that
+	 * needs them and kept so the size query and the fetch that follows
+	 * do not encode the key twice */
+	struct sc_pkcs15_der		enc_value;
+	struct sc_pkcs15_der		enc_spki;
+	struct sc_pkcs15_der		enc_point;
 };
 #define pub_flags		base.base.flags
 #define pub_p15obj		base.p15_object
@@ -129,6 +150,8 @@ struct pkcs15_skey_object {
 
 	struct sc_pkcs15_skey_info *info;
 	struct sc_pkcs15_skey *valueXXXX;
+	/* session key created on the host, owns its PKCS#15 object */
+	int in_memory;
 };
 
 #define skey_flags	base.base.flags
@@ -199,7 +222,7 @@ static CK_RV	get_modulus_bits(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
 static CK_RV	get_usage_bit(unsigned int usage, CK_ATTRIBUTE_PTR attr);
 static CK_RV	get_gostr3410_params(const u8 *, size_t, CK_ATTRIBUTE_PTR);
-static CK_RV	get_ec_pubkey_point(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
+static CK_RV	get_ec_pubkey_point(struct pkcs15_pubkey_object *, CK_ATTRIBUTE_PTR);
 static CK_RV	get_ec_pubkey_params(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
 static int	lock_card(struct pkcs15_fw_data *);
 static int	unlock_card(struct pkcs15_fw_data *);
@@ -492,6 +515,9 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_pkey(&obj->base.pkey);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -527,6 +553,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	struct sc_pkcs15_object *auth;
 	struct sc_pkcs15_auth_info *pin_info;
 	CK_RV rv;
+	void *slot_lock = NULL;
 
 	sc_log(context, "C_GetTokenInfo(%lx)", slotID);
 	if (pInfo == NULL_PTR)
@@ -547,6 +574,8 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
+	sc_pkcs11_lock_slot(slot, &slot_lock);
+
 	fw_data = (struct pkcs15_fw_data *) slot->p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data) {
 		rv = sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetTokenInfo");
@@ -576,7 +605,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot_lock);
 	sc_log(context, "C_GetTokenInfo(%lx) returns 0x%lX", slotID, rv);
 	return rv;
 }
@@ -651,7 +680,8 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 		p15_cert = NULL;			/* will read cert when needed */
 	}
 	else    {
-		rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert);
+		/* the names are enough for now, the key is decoded when asked for */
+		rv = sc_pkcs15_read_certificate_names(fw_data->p15_card, p15_info, &p15_cert);
 		if (rv < 0)
 			return rv;
 	}
@@ -676,14 +706,6 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 	if (rv < 0)
 		return rv;
 
-	if (p15_cert) {
-		 /* make a copy of public key from the cert */
-		if (!obj2->pub_data)
-			rv = sc_pkcs15_pubkey_from_cert(context, &p15_cert->data, &obj2->pub_data);
-		if (rv < 0)
-			return rv;
-	}
-
 	obj2->pub_genfrom = object;
 	object->cert_pubkey = obj2;
 
@@ -752,6 +774,47 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 }
 
 
+/*
+ * Resolve the algorithm references of the key to the algorithms supported
+ * by the token, so that pkcs15_prkey_can_do() does not search the TokenInfo
+ * on every operation.
+ */
+static void
+pkcs15_prkey_resolve_algos(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *prkey)
+{
+	struct sc_pkcs15_prkey_info *pkinfo = prkey->prv_info;
+	struct sc_supported_algo_info *token_algos;
+	int ii, jj;
+
+	prkey->sign_algos = 0;
+	prkey->decrypt_algos = 0;
+	/* There are no usage algorithms specified for this key */
+	prkey->algos_rv = CKR_FUNCTION_NOT_SUPPORTED;
+	if (!pkinfo || !pkinfo->algo_refs[0])
+		return;
+
+	prkey->algos_rv = CKR_GENERAL_ERROR;
+	if (!fw_data->p15_card->tokeninfo)
+		return;
+	token_algos = &fw_data->p15_card->tokeninfo->supported_algos[0];
+
+	for (ii = 0; ii < SC_MAX_SUPPORTED_ALGORITHMS && pkinfo->algo_refs[ii]; ii++) {
+		/* Look for algorithm supported by token referenced in the list of key's algorithms */
+		for (jj = 0; jj < SC_MAX_SUPPORTED_ALGORITHMS && (token_algos + jj)->reference; jj++)
+			if (pkinfo->algo_refs[ii] == (token_algos + jj)->reference)
+				break;
+		/* The algorithms after an unknown reference are not used */
+		if ((jj == SC_MAX_SUPPORTED_ALGORITHMS) || !(token_algos + jj)->reference)
+			return;
+
+		if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_COMPUTE_SIGNATURE)
+			prkey->sign_algos |= 1U << jj;
+		if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_DECIPHER)
+			prkey->decrypt_algos |= 1U << jj;
+	}
+	prkey->algos_rv = CKR_MECHANISM_INVALID;
+}
+
 static int
 __pkcs15_create_prkey_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *prkey, struct pkcs15_any_object **prkey_object)
@@ -761,8 +824,10 @@ __pkcs15_create_prkey_object(struct pkcs15_fw_data *fw_data,
 
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 			prkey, &pkcs15_prkey_ops, sizeof(struct pkcs15_prkey_object));
-	if (rv >= 0)
+	if (rv >= 0) {
 		object->prv_info = (struct sc_pkcs15_prkey_info *) prkey->data;
+		pkcs15_prkey_resolve_algos(fw_data, object);
+	}
 
 	if (prkey_object != NULL)
 		*prkey_object = (struct pkcs15_any_object *) object;
@@ -792,6 +857,22 @@ __pkcs15_create_data_object(struct pkcs15_fw_data *fw_data,
 }
 
 
+/* Free the PKCS#15 object of a session key, wiping the key value */
+static void
+pkcs15_skey_free_in_memory(struct sc_pkcs15_object *object,
+		struct sc_pkcs15_skey_info *info)
+{
+	if (info) {
+		if (info->data.value) {
+			sc_mem_clear(info->data.value, info->data.len);
+			free(info->data.value);
+		}
+		free(info);
+	}
+	free(object);
+}
+
+
 #ifdef USE_PKCS15_INIT
 static int
 __pkcs15_create_secret_key_object(struct pkcs15_fw_data *fw_data,
@@ -802,8 +883,9 @@ __pkcs15_create_secret_key_object(struct pkcs15_fw_data *fw_data,
 
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &skey,
 			object, &pkcs15_skey_ops, sizeof(struct pkcs15_skey_object));
-	if (rv >= 0)
-	    skey->info = (struct sc_pkcs15_skey_info *) object->data;
+	if (rv < 0)
+		return rv;
+	skey->info = (struct sc_pkcs15_skey_info *) object->data;
 
 	if (skey_object != NULL)
 		*skey_object = (struct pkcs15_any_object *) skey;
@@ -813,6 +895,18 @@ __pkcs15_create_secret_key_object(struct pkcs15_fw_data *fw_data,
 #endif
 
 
+static int
+pkcs15_object_created(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *p15_object)
+{
+	unsigned int i;
+
+	for (i = 0; i < fw_data->num_objects; i++)
+		if (fw_data->objects[i]->p15_object == p15_object)
+			return 1;
+	return 0;
+}
+
+
 static int
 pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const char *name,
 		int (*create)(struct pkcs15_fw_data *, struct sc_pkcs15_object *,
@@ -825,8 +919,12 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 	if (rv >= 0)
 		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
-	for (i = 0; rv >= 0 && i < count; i++)
+	for (i = 0; rv >= 0 && i < count; i++) {
+		/* may have been created ahead by pkcs15_prefetch() */
+		if (pkcs15_object_created(fw_data, p15_object[i]))
+			continue;
 		rv = create(fw_data, p15_object[i], NULL);
+	}
 
 	return count;
 }
@@ -955,25 +1053,111 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 
 	if (cert->cert_data)
 		return 0;
-	rv = sc_pkcs15_read_certificate(fw_data->p15_card, cert->cert_info, &cert->cert_data);
+	rv = sc_pkcs15_read_certificate_names(fw_data->p15_card, cert->cert_info, &cert->cert_data);
 	if (rv < 0)
 		return rv;
 
-	obj2 = cert->cert_pubkey;
-	/* make a copy of public key from the cert data */
-	if (!obj2->pub_data)
-		rv = sc_pkcs15_pubkey_from_cert(context, &cert->cert_data->data, &obj2->pub_data);
-
 	/* Find missing labels for certificate */
 	pkcs15_cert_extract_label(cert);
 
-	/* now that we have the cert and pub key, lets see if we can bind anything else */
+	/* now that we have the cert, lets see if we can bind anything else */
 	pkcs15_bind_related_objects(fw_data);
 
 	return rv;
 }
 
 
+/* Certificates are first read only as far as their names, the public
+ * key is decoded when one of the key attributes is asked for */
+static int
+check_cert_key_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
+{
+	struct pkcs15_pubkey_object *obj2;
+	int rv;
+
+	rv = check_cert_data_read(fw_data, cert);
+	if (rv < 0)
+		return rv;
+
+	obj2 = cert->cert_pubkey;
+	if (!obj2 || obj2->pub_data)
+		return 0;
+
+	rv = sc_pkcs15_complete_certificate(context, cert->cert_data);
+	if (rv < 0)
+		return rv;
+
+	/* make a copy of public key from the cert data */
+	return sc_pkcs15_dup_pubkey(context, cert->cert_data->key, &obj2->pub_data);
+}
+
+
+/*
+ * Register the object in the attribute index of the slot. Only values
+ * that are available without accessing the card and do not change later
+ * are indexed, everything else is left unknown.
+ */
+static void
+pkcs15_index_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj)
+{
+	CK_OBJECT_CLASS clazz;
+	CK_ATTRIBUTE attrs[3];
+	CK_ULONG count = 0;
+	struct sc_pkcs15_id *id = NULL;
+	struct sc_pkcs15_object *p15_object = obj->p15_object;
+
+	switch (__p15_type(obj) & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		clazz = CKO_PRIVATE_KEY;
+		id = &((struct pkcs15_prkey_object *) obj)->prv_info->id;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		clazz = CKO_PUBLIC_KEY;
+		if (((struct pkcs15_pubkey_object *) obj)->pub_info)
+			id = &((struct pkcs15_pubkey_object *) obj)->pub_info->id;
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		clazz = CKO_CERTIFICATE;
+#ifdef ZERO_CKAID_FOR_CA_CERTS
+		if (!((struct pkcs15_cert_object *) obj)->cert_info->authority)
+#endif
+		id = &((struct pkcs15_cert_object *) obj)->cert_info->id;
+		/* The label may be extracted from the certificate when it is read */
+		if (((struct pkcs15_cert_object *) obj)->cert_data == NULL)
+			p15_object = NULL;
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		clazz = CKO_DATA;
+		break;
+	case SC_PKCS15_TYPE_SKEY:
+		clazz = CKO_SECRET_KEY;
+		if (((struct pkcs15_skey_object *) obj)->info)
+			id = &((struct pkcs15_skey_object *) obj)->info->id;
+		break;
+	default:
+		slot_index_add(slot, &obj->base, NULL, 0);
+		return;
+	}
+
+	attrs[count].type = CKA_CLASS;
+	attrs[count].pValue = &clazz;
+	attrs[count++].ulValueLen = sizeof(clazz);
+	if (id != NULL) {
+		attrs[count].type = CKA_ID;
+		attrs[count].pValue = id->value;
+		attrs[count++].ulValueLen = id->len;
+	}
+	if (p15_object != NULL) {
+		attrs[count].type = CKA_LABEL;
+		attrs[count].pValue = p15_object->label;
+		attrs[count++].ulValueLen = strnlen(p15_object->label, sizeof p15_object->label);
+	}
+
+	if (slot_index_add(slot, &obj->base, attrs, count) != CKR_OK)
+		sc_log(context, "Slot:%lX Cannot index object 0x%lx", slot->id, obj->base.handle);
+}
+
+
 static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
@@ -988,18 +1172,20 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (sc_pkcs11_array_find(&slot->objects, obj) >= 0)
 		return;
 
 	if (pHandle != NULL)
 		*pHandle = handle;
 
-	list_append(&slot->objects, obj);
+	if (0 > sc_pkcs11_array_append(&slot->objects, obj))
+		return;
 	sc_log(context, "Slot:%lX Setting object handle of 0x%lx to 0x%lx",
 	       slot->id, obj->base.handle, handle);
 	obj->base.handle = handle;
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
+	pkcs15_index_object(slot, obj);
 
 	/* Add related objects
 	 * XXX prevent infinite recursion when a card specifies two certificates
@@ -1176,15 +1362,9 @@ _pkcs15_create_typed_objects(struct pkcs15_fw_data *fw_data)
 	if (rv < 0)
 		return rv;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
-			__pkcs15_create_cert_object);
-	if (rv < 0)
-		return rv;
-
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
-			__pkcs15_create_data_object);
-	if (rv < 0)
-		return rv;
+	/* Reading the CDF and DODF and the names of the certificates is left
+	 * for when a search asks for those objects */
+	fw_data->deferred = PKCS15_DEFER_CERT | PKCS15_DEFER_DATA;
 
 	/* Match up related keys and certificates */
 	pkcs15_bind_related_objects(fw_data);
@@ -1394,6 +1574,124 @@ _add_public_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data)
 }
 
 
+/* Create the objects of the deferred 'types' and add them to the slots of
+ * the token the same way pkcs15_create_tokens() does */
+static int
+pkcs15_create_deferred_objects(struct sc_pkcs11_card *p11card, struct pkcs15_fw_data *fw_data,
+		unsigned int types)
+{
+	unsigned int i, j;
+	int rv = 0;
+
+	types &= fw_data->deferred;
+	if (!types)
+		return 0;
+	fw_data->deferred &= ~types;
+
+	if (types & PKCS15_DEFER_CERT)
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
+				__pkcs15_create_cert_object);
+	if (rv >= 0 && (types & PKCS15_DEFER_DATA))
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
+				__pkcs15_create_data_object);
+	if (rv < 0)
+		return rv;
+
+	pkcs15_bind_related_objects(fw_data);
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+		struct sc_pkcs15_object *auth;
+
+		if (slot->p11card != p11card || p11card->fws_data[slot->fw_data_idx] != fw_data)
+			continue;
+
+		/* the certificates go with their private keys */
+		for (j = 0; j < fw_data->num_objects; j++) {
+			struct pkcs15_any_object *obj = fw_data->objects[j];
+
+			if (is_cert(obj) && obj->related_privkey
+					&& sc_pkcs11_array_find(&slot->objects, obj->related_privkey) >= 0)
+				pkcs15_add_object(slot, obj, NULL);
+		}
+
+		auth = slot_data_auth(slot->fw_data);
+		if (auth)
+			_add_pin_related_objects(slot, auth, fw_data, NULL);
+	}
+	_add_public_objects(fw_data->public_slot, fw_data);
+
+	return 0;
+}
+
+
+/* Called before the objects of the slot are searched, 'clazz' is the
+ * class asked for or (CK_OBJECT_CLASS) -1 */
+static CK_RV
+pkcs15_load_objects(struct sc_pkcs11_slot *slot, CK_OBJECT_CLASS clazz)
+{
+	struct sc_pkcs11_card *p11card = slot->p11card;
+	struct pkcs15_fw_data *fw_data;
+	unsigned int types;
+	int rv;
+
+	if (!p11card)
+		return CKR_OK;
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
+	if (!fw_data || !fw_data->deferred)
+		return CKR_OK;
+
+	switch (clazz) {
+	case CKO_CERTIFICATE:
+	case CKO_PUBLIC_KEY:	/* also made from the certificates */
+		types = PKCS15_DEFER_CERT;
+		break;
+	case CKO_DATA:
+		types = PKCS15_DEFER_DATA;
+		break;
+	case (CK_OBJECT_CLASS) -1:
+		types = PKCS15_DEFER_CERT | PKCS15_DEFER_DATA;
+		break;
+	default:
+		return CKR_OK;
+	}
+
+	rv = pkcs15_create_deferred_objects(p11card, fw_data, types);
+	return rv < 0 ? sc_to_cryptoki_error(rv, "C_FindObjectsInit") : CKR_OK;
+}
+
+
+/* Read one of the public certificates whose objects are deferred. The
+ * object is only added to the slots by pkcs15_create_deferred_objects() */
+static CK_RV
+pkcs15_prefetch(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_card *p11card = slot->p11card;
+	struct pkcs15_fw_data *fw_data;
+	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
+	int i, count, rv;
+
+	if (!p11card)
+		return CKR_TOKEN_NOT_PRESENT;
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
+	if (!fw_data || !(fw_data->deferred & PKCS15_DEFER_CERT))
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	count = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_CERT_X509, p15_object, MAX_OBJECTS);
+	for (i = 0; i < count; i++) {
+		if (p15_object[i]->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+			continue;
+		if (pkcs15_object_created(fw_data, p15_object[i]))
+			continue;
+		sc_log(context, "Prefetch certificate '%.*s'", (int) sizeof p15_object[i]->label, p15_object[i]->label);
+		rv = __pkcs15_create_cert_object(fw_data, p15_object[i], NULL);
+		return rv < 0 ? sc_to_cryptoki_error(rv, "prefetch") : CKR_OK;
+	}
+
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
 static CK_RV
 pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
 {
@@ -1427,6 +1725,11 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		return sc_to_cryptoki_error(rv, NULL);
 	sc_log(context, "Found %d FW objects objects", fw_data->num_objects);
 
+	/* the objects of a card that is taken up again after it was removed
+	 * were seen in the slots of before */
+	for (i = 0; i < (int) fw_data->num_objects; i++)
+		fw_data->objects[i]->base.flags &= ~SC_PKCS11_OBJECT_SEEN;
+
 	/* Create slots for all non-unblock, non-so PINs if:
 	 *  - 'UserPIN' cannot be identified (VT: for some cards with incomplete PIN flags);
 	 *  - configuration impose to create slot for all PINs.
@@ -1502,12 +1805,35 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		sc_log(context, "Add public objects to slot %p", slot);
 		_add_public_objects(slot, fw_data);
 	}
+	fw_data->public_slot = slot;
 
 	sc_log(context, "All tokens created");
 	return CKR_OK;
 }
 
 
+static CK_RV
+pkcs15_park(struct sc_pkcs11_card *p11card)
+{
+	int i;
+
+	for (i = 0; i < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; i++) {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+
+		if (!fw_data)
+			continue;
+		/* kept locked by lock_login */
+		if (fw_data->locked)
+			return CKR_FUNCTION_FAILED;
+		sc_pkcs15_pincache_clear(fw_data->p15_card);
+		sc_mem_clear(fw_data->user_puk, sizeof fw_data->user_puk);
+		fw_data->user_puk_len = 0;
+	}
+
+	return CKR_OK;
+}
+
+
 static CK_RV
 pkcs15_release_token(struct sc_pkcs11_card *p11card, void *fw_token)
 {
@@ -1925,7 +2251,7 @@ pkcs15_initialize(struct sc_pkcs11_slot *slot, void *ptr,
 		return sc_to_cryptoki_error(rc, "C_InitToken");
 	}
 
-	rv = card_removed(p11card->reader);
+	rv = card_removed(p11card->reader, 0);
 	if (rv != CKR_OK)   {
 		sc_log(context, "remove card error 0x%lX", rv);
 		return rv;
@@ -2207,7 +2533,7 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 	struct sc_pkcs15_skey_info *skey_info;
 	CK_KEY_TYPE key_type;
 	CK_BBOOL _token = FALSE;
-	int rv;
+	int rv, rc;
 	char label[SC_PKCS15_MAX_LABEL_SIZE];
 
 	memset(&args, 0, sizeof(args));
@@ -2226,8 +2552,10 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 		return rv;
 
 	switch (key_type) {
-		/* Only support GENERIC_SECRET for now */
+		/* AES and DES3 keys can be used by the ciphers run on the host */
 		case CKK_GENERIC_SECRET:
+		case CKK_AES:
+		case CKK_DES3:
 			break;
 		default:
 			return CKR_ATTRIBUTE_VALUE_INVALID;
@@ -2334,14 +2662,25 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 	}
 
 	/* Create a new pkcs11 object for it */
-	__pkcs15_create_secret_key_object(fw_data, key_obj, &key_any_obj);
+	rc = __pkcs15_create_secret_key_object(fw_data, key_obj, &key_any_obj);
+	if (rc < 0) {
+		rv = sc_to_cryptoki_error(rc, "C_CreateObject");
+		goto out;
+	}
+	((struct pkcs15_skey_object *) key_any_obj)->in_memory = 1;
+	key_obj = NULL;
 	pkcs15_add_object(slot, key_any_obj, phObject);
 
 	rv = CKR_OK;
 
 out:
-	free(args.key.data); /* if allocated */
-	free(key_obj);
+	if (args.key.data) {
+		sc_mem_clear(args.key.data, args.key.data_len);
+		free(args.key.data);
+	}
+	if (key_obj) {
+		pkcs15_skey_free_in_memory(key_obj, key_obj->data);
+	}
 	return rv;
 }
 
@@ -2630,6 +2969,11 @@ pkcs15_create_object(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_CreateObject");
 
+	/* the new object must not be created a second time later */
+	rc = pkcs15_create_deferred_objects(p11card, fw_data, fw_data->deferred);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, "C_CreateObject");
+
 	rv = attr_find(pTemplate, ulCount, CKA_CLASS, &_class, NULL);
 	if (rv != CKR_OK)
 		return rv;
@@ -3048,25 +3392,35 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 	return CKR_FUNCTION_NOT_SUPPORTED;
 #else
 	struct pkcs15_any_object *any_obj = (struct pkcs15_any_object*) object;
+	struct pkcs15_skey_object *skey = (struct pkcs15_skey_object*) object;
+	struct sc_pkcs15_object *p15_object = skey->skey_p15obj;
+	struct sc_pkcs15_skey_info *info = skey->info;
 	struct sc_pkcs11_card *p11card = session->slot->p11card;
 	struct pkcs15_fw_data *fw_data = NULL;
+	int in_memory = skey->in_memory;
 	int rv;
 
 	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GenerateKeyPair");
-	/* TODO assuming this is a session only object. */
-	rv = sc_lock(p11card->card);
-	if (rv < 0)
-		return sc_to_cryptoki_error(rv, "C_DestroyObject");
+	/* The session keys are only in memory, the card is not needed */
+	if (!in_memory) {
+		rv = sc_lock(p11card->card);
+		if (rv < 0)
+			return sc_to_cryptoki_error(rv, "C_DestroyObject");
+	}
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcount */
-	list_delete(&session->slot->objects, any_obj);
+	sc_pkcs11_array_remove(&session->slot->objects, any_obj);
+	slot_index_remove(session->slot, (struct sc_pkcs11_object *) any_obj);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
-	sc_unlock(p11card->card);
+	if (!in_memory)
+		sc_unlock(p11card->card);
+	else if (rv == SC_SUCCESS)
+		pkcs15_skey_free_in_memory(p15_object, info);
 
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_DestroyObject");
@@ -3118,7 +3472,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		struct pkcs15_pubkey_object *pubkey = any_obj->related_pubkey;
 
 		/* Check if key is not removed in between */
-		if (list_locate(&session->slot->objects, ao_pubkey) > 0) {
+		if (sc_pkcs11_array_find(&session->slot->objects, ao_pubkey) >= 0) {
 			sc_log(context, "Found related pubkey %p", any_obj->related_pubkey);
 
 			/* Delete reference to related certificate of the public key PKCS#11 object */
@@ -3128,7 +3482,8 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				sc_pkcs11_array_remove(&session->slot->objects, ao_pubkey);
+				slot_index_remove(session->slot, (struct sc_pkcs11_object *) ao_pubkey);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -3146,7 +3501,8 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcount */
-		list_delete(&session->slot->objects, any_obj);
+		sc_pkcs11_array_remove(&session->slot->objects, any_obj);
+		slot_index_remove(session->slot, (struct sc_pkcs11_object *) any_obj);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3197,7 +3553,10 @@ struct sc_pkcs11_framework_ops framework_pkcs15 = {
 	NULL,
 	NULL,
 #endif
-	pkcs15_get_random
+	pkcs15_get_random,
+	pkcs15_load_objects,
+	pkcs15_prefetch,
+	pkcs15_park
 };
 
 
@@ -3542,6 +3901,8 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 			/* Try to find public key or certificate with the public key */
 			unsigned int i;
 
+			pkcs15_create_deferred_objects(p11card, fw_data, PKCS15_DEFER_CERT);
+
 			for (i = 0; i < fw_data->num_objects; i++) {
 				struct pkcs15_any_object *obj = fw_data->objects[i];
 				struct pkcs15_cert_object *cert;
@@ -3552,7 +3913,7 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 					if (cert->cert_prvkey != prkey)
 						continue;
 
-					if (check_cert_data_read(fw_data, cert) == 0)   {
+					if (check_cert_key_read(fw_data, cert) == 0)   {
 						key = cert->cert_pubkey->pub_data;
 						sc_log(context, "found friend certificate's public key %p", key);
 					}
@@ -3888,8 +4249,10 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 	struct sc_pkcs11_card *p11card = session->slot->p11card;
 	struct pkcs15_fw_data *fw_data = NULL;
 	struct pkcs15_prkey_object *prkey;
-	unsigned char decrypted[512]; /* FIXME: Will not work for keys above 4096 bits */
+	unsigned char *decrypted;
+	size_t decrypted_len = 512; /* FIXME: Will not work for keys above 4096 bits */
 	int	buff_too_small, rv, flags = 0, prkey_has_path = 0;
+	CK_RV ck_rv = CKR_OK;
 
 	sc_log(context, "Initiating decryption.");
 
@@ -3919,34 +4282,42 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 		return CKR_MECHANISM_INVALID;
 	}
 
+	/* The plaintext is kept out of the swap and cleared afterwards */
+	decrypted = sc_mem_secure_alloc(decrypted_len);
+	if (decrypted == NULL)
+		return CKR_HOST_MEMORY;
+
 	rv = sc_lock(p11card->card);
-	if (rv < 0)
+	if (rv < 0) {
+		sc_mem_secure_free(decrypted, decrypted_len);
 		return sc_to_cryptoki_error(rv, "C_Decrypt");
+	}
 
 	rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, flags,
-			pEncryptedData, ulEncryptedDataLen, decrypted, sizeof(decrypted));
+			pEncryptedData, ulEncryptedDataLen, decrypted, decrypted_len);
 
 	if (rv < 0 && !sc_pkcs11_conf.lock_login && !prkey_has_path)
 		if (reselect_app_df(fw_data->p15_card) == SC_SUCCESS)
 			rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, flags,
-					pEncryptedData, ulEncryptedDataLen, decrypted, sizeof(decrypted));
+					pEncryptedData, ulEncryptedDataLen, decrypted, decrypted_len);
 
 	sc_unlock(p11card->card);
 
 	sc_log(context, "Decryption complete. Result %d.", rv);
 
-	if (rv < 0)
-		return sc_to_cryptoki_error(rv, "C_Decrypt");
-
-	buff_too_small = (*pulDataLen < (CK_ULONG)rv);
-	*pulDataLen = rv;
-	if (pData == NULL_PTR)
-		return CKR_OK;
-	if (buff_too_small)
-		return CKR_BUFFER_TOO_SMALL;
-	memcpy(pData, decrypted, *pulDataLen);
+	if (rv < 0) {
+		ck_rv = sc_to_cryptoki_error(rv, "C_Decrypt");
+	} else {
+		buff_too_small = (*pulDataLen < (CK_ULONG)rv);
+		*pulDataLen = rv;
+		if (pData != NULL_PTR && buff_too_small)
+			ck_rv = CKR_BUFFER_TOO_SMALL;
+		else if (pData != NULL_PTR)
+			memcpy(pData, decrypted, *pulDataLen);
+	}
 
-	return CKR_OK;
+	sc_mem_secure_free(decrypted, decrypted_len);
+	return ck_rv;
 }
 
 
@@ -4032,45 +4403,28 @@ pkcs15_prkey_can_do(struct sc_pkcs11_session *session, void *obj,
 	struct sc_pkcs11_card *p11card = session->slot->p11card;
 	struct pkcs15_fw_data *fw_data = NULL;
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
-	struct sc_pkcs15_prkey_info *pkinfo = NULL;
 	struct sc_supported_algo_info *token_algos = NULL;
-	int ii, jj;
+	unsigned int algos = 0;
+	int jj;
 
 	if (!prkey || !prkey->prv_info)
 		return CKR_KEY_FUNCTION_NOT_PERMITTED;
 
-	pkinfo = prkey->prv_info;
-	/* Return in there are no usage algorithms specified for this key. */
-	if (!pkinfo->algo_refs[0])
-		return CKR_FUNCTION_NOT_SUPPORTED;
+	if (flags == CKF_SIGN)
+		algos = prkey->sign_algos;
+	else if (flags == CKF_DECRYPT)
+		algos = prkey->decrypt_algos;
+	if (!algos)
+		return prkey->algos_rv;
 
 	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
 	token_algos = &fw_data->p15_card->tokeninfo->supported_algos[0];
 
-	for (ii=0;ii<SC_MAX_SUPPORTED_ALGORITHMS && pkinfo->algo_refs[ii];ii++)   {
-		/* Look for algorithm supported by token referenced in the list of key's algorithms */
-		for (jj=0;jj<SC_MAX_SUPPORTED_ALGORITHMS && (token_algos + jj)->reference; jj++)
-			if (pkinfo->algo_refs[ii] == (token_algos + jj)->reference)
-				break;
-		if ((jj == SC_MAX_SUPPORTED_ALGORITHMS) || !(token_algos + jj)->reference)
-			return CKR_GENERAL_ERROR;
-
-		if ((token_algos + jj)->mechanism != mech_type)
-			continue;
-
-		if (flags == CKF_SIGN)
-			if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_COMPUTE_SIGNATURE)
-				break;
-
-		if (flags == CKF_DECRYPT)
-			if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_DECIPHER)
-				break;
-	}
-
-	if (ii == SC_MAX_SUPPORTED_ALGORITHMS || !pkinfo->algo_refs[ii])
-		return CKR_MECHANISM_INVALID;
+	for (jj = 0; algos; jj++, algos >>= 1)
+		if ((algos & 1) && (token_algos + jj)->mechanism == mech_type)
+			return CKR_OK;
 
-	return CKR_OK;
+	return prkey->algos_rv;
 }
 
 
@@ -4096,10 +4450,62 @@ pkcs15_pubkey_release(void *object)
 {
 	struct pkcs15_pubkey_object *pubkey = (struct pkcs15_pubkey_object*) object;
 	struct sc_pkcs15_pubkey *key_data = pubkey->pub_data;
+	u8 *enc_value = pubkey->enc_value.value;
+	u8 *enc_spki = pubkey->enc_spki.value;
+	u8 *enc_point = pubkey->enc_point.value;
 
-	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0)
+	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0) {
 		if (key_data)
 			sc_pkcs15_free_pubkey(key_data);
+		free(enc_value);
+		free(enc_spki);
+		free(enc_point);
+	}
+}
+
+/*
+ * Return the cached encoding of the public key for CKA_VALUE, CKA_SPKI
+ * or CKA_EC_POINT, encoding it on first use.
+ */
+static int
+pkcs15_pubkey_encoding(struct pkcs15_pubkey_object *pubkey, CK_ATTRIBUTE_TYPE type,
+		struct sc_pkcs15_der **out)
+{
+	struct sc_pkcs15_pubkey *key = pubkey->pub_data;
+	struct sc_pkcs15_der *der;
+	int rc;
+
+	switch (type) {
+	case CKA_VALUE:
+		der = &pubkey->enc_value;
+		break;
+	case CKA_SPKI:
+		der = &pubkey->enc_spki;
+		break;
+	case CKA_EC_POINT:
+		der = &pubkey->enc_point;
+		break;
+	default:
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	if (der->value == NULL) {
+		if (type == CKA_VALUE)
+			rc = sc_pkcs15_encode_pubkey(context, key, &der->value, &der->len);
+		else if (type == CKA_SPKI)
+			rc = sc_pkcs15_encode_pubkey_as_spki(context, key, &der->value, &der->len);
+		else
+			rc = sc_pkcs15_encode_pubkey_ec(context, &key->u.ec, &der->value, &der->len);
+		if (rc != SC_SUCCESS) {
+			free(der->value);
+			der->value = NULL;
+			der->len = 0;
+			return rc;
+		}
+	}
+
+	*out = der;
+	return SC_SUCCESS;
 }
 
 
@@ -4139,8 +4545,13 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 		case CKA_EC_PARAMS:
 		case CKA_EC_POINT:
 			if (pubkey->pub_data == NULL)
-				if (SC_SUCCESS != check_cert_data_read(fw_data, cert))
-					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_cert_data_read");
+				if (SC_SUCCESS != check_cert_key_read(fw_data, cert))
+					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_cert_key_read");
+			break;
+		case CKA_KEY_TYPE:
+			/* without a key to look at, RSA is assumed below */
+			if (pubkey->pub_data == NULL && cert != NULL)
+				check_cert_key_read(fw_data, cert);
 			break;
 	}
 
@@ -4256,31 +4667,12 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 			memcpy(attr->pValue, pubkey->pub_info->direct.spki.value, pubkey->pub_info->direct.spki.len);
 		}
 		else if (pubkey->pub_data)   {
-			unsigned char *value = NULL;
-			size_t len;
-
-			if (attr->type != CKA_SPKI) {
-				if (sc_pkcs15_encode_pubkey(context, pubkey->pub_data, &value, &len))
-					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
-				} else {
-					if (sc_pkcs15_encode_pubkey_as_spki(context, pubkey->pub_data, &value, &len))
-					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
-				}
-
-			if (attr->pValue == NULL_PTR) {
-				attr->ulValueLen = len;
-				free(value);
-				return CKR_OK;
-			}
-			if (attr->ulValueLen < len) {
-				attr->ulValueLen = len;
-				free(value);
-				return CKR_BUFFER_TOO_SMALL;
-			}
-			attr->ulValueLen = len;
-			memcpy(attr->pValue, value, len);
+			struct sc_pkcs15_der *der = NULL;
 
-			free(value);
+			if (pkcs15_pubkey_encoding(pubkey, attr->type, &der) != SC_SUCCESS)
+				return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
+			check_attribute_buffer(attr, der->len);
+			memcpy(attr->pValue, der->value, der->len);
 		}
 		else if (attr->type != CKA_SPKI && pubkey->base.p15_object && pubkey->base.p15_object->content.value && pubkey->base.p15_object->content.len)   {
 			check_attribute_buffer(attr, pubkey->base.p15_object->content.len);
@@ -4302,7 +4694,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 	case CKA_EC_PARAMS:
 		return get_ec_pubkey_params(pubkey->pub_data, attr);
 	case CKA_EC_POINT:
-		return get_ec_pubkey_point(pubkey->pub_data, attr);
+		return get_ec_pubkey_point(pubkey, attr);
 
 	default:
 		return CKR_ATTRIBUTE_TYPE_INVALID;
@@ -4509,7 +4901,14 @@ struct sc_pkcs11_object_ops pkcs15_dobj_ops = {
 static void
 pkcs15_skey_release(void *object)
 {
-	__pkcs15_release_object((struct pkcs15_any_object *) object);
+	struct pkcs15_skey_object *skey = (struct pkcs15_skey_object*) object;
+	struct sc_pkcs15_object *p15_object = skey->skey_p15obj;
+	struct sc_pkcs15_skey_info *info = skey->info;
+	int in_memory = skey->in_memory;
+
+	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0
+			&& in_memory)
+		pkcs15_skey_free_in_memory(p15_object, info);
 }
 
 
@@ -4527,10 +4926,15 @@ pkcs15_skey_set_attribute(struct sc_pkcs11_session *session,
 	switch (attr->type) {
 	case CKA_VALUE:
 		if (attr->pValue) {
-			skey->info->data.value = calloc(1,attr->ulValueLen);
-			if (!skey->info->data.value)
+			u8 *value = calloc(1, attr->ulValueLen);
+			if (!value)
 				return CKR_HOST_MEMORY;
-			memcpy(skey->info->data.value, attr->pValue, attr->ulValueLen);
+			memcpy(value, attr->pValue, attr->ulValueLen);
+			if (skey->in_memory && skey->info->data.value) {
+				sc_mem_clear(skey->info->data.value, skey->info->data.len);
+				free(skey->info->data.value);
+			}
+			skey->info->data.value = value;
 			skey->info->data.len = attr->ulValueLen;
 		}
 		break;
@@ -4730,10 +5134,10 @@ get_ec_pubkey_params(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
 }
 
 static CK_RV
-get_ec_pubkey_point(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
+get_ec_pubkey_point(struct pkcs15_pubkey_object *pubkey, CK_ATTRIBUTE_PTR attr)
 {
-	unsigned char *value = NULL;
-	size_t value_len = 0;
+	struct sc_pkcs15_pubkey *key = pubkey->pub_data;
+	struct sc_pkcs15_der *der = NULL;
 	int rc;
 
 	if (key == NULL)
@@ -4741,24 +5145,12 @@ get_ec_pubkey_point(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
 
 	switch (key->algorithm) {
 	case SC_ALGORITHM_EC:
-		rc = sc_pkcs15_encode_pubkey_ec(context, &key->u.ec, &value, &value_len);
+		rc = pkcs15_pubkey_encoding(pubkey, CKA_EC_POINT, &der);
 		if (rc != SC_SUCCESS)
 			return sc_to_cryptoki_error(rc, NULL);
 
-		if (attr->pValue == NULL_PTR) {
-			attr->ulValueLen = value_len;
-			free(value);
-			return CKR_OK;
-		}
-		if (attr->ulValueLen < value_len) {
-			attr->ulValueLen = value_len;
-			free(value);
-			return CKR_BUFFER_TOO_SMALL;
-		}
-		attr->ulValueLen = value_len;
-
-		memcpy(attr->pValue, value, value_len);
-		free(value);
+		check_attribute_buffer(attr, der->len);
+		memcpy(attr->pValue, der->value, der->len);
 		return CKR_OK;
 	}
 
@@ -4978,6 +5370,8 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 #ifdef ENABLE_OPENSSL
 	/* That practise definitely conflicts with CKF_HW -- andre 2010-11-28 */
 	mech_info.flags |= CKF_VERIFY;
+	/* Like verification, these only need the public key and are done in software */
+	mech_info.flags |= CKF_ENCRYPT | CKF_VERIFY_RECOVER;
 #endif
 	mech_info.ulMinKeySize = ~0;
 	mech_info.ulMaxKeySize = 0;
@@ -5101,7 +5495,7 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 	/* TODO support other padding mechanisms */
 
 	if (rsa_flags & SC_ALGORITHM_RSA_PAD_PSS) {
-		mech_info.flags &= ~(CKF_DECRYPT|CKF_VERIFY);
+		mech_info.flags &= ~(CKF_DECRYPT|CKF_VERIFY|CKF_ENCRYPT|CKF_VERIFY_RECOVER);
 
 		mt = sc_pkcs11_new_fw_mechanism(CKM_RSA_PKCS_PSS, &mech_info, CKK_RSA, NULL, NULL);
 		rc = sc_pkcs11_register_mechanism(p11card, mt);
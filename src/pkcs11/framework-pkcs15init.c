@@ -180,7 +180,10 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL, /* init_pin */
 	NULL, /* create_object */
 	NULL, /* gen_keypair */
-	NULL  /* get_random */
+	NULL, /* get_random */
+	NULL, /* load_objects */
+	NULL, /* prefetch */
+	NULL  /* park */
 };
 
 #else /* ifdef USE_PKCS15_INIT */
@@ -197,7 +200,10 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL,	/* init_pin */
 	NULL,	/* create_object */
 	NULL,	/* gen_keypair */
-	NULL	/* get_random */
+	NULL,	/* get_random */
+	NULL,	/* load_objects */
+	NULL,	/* prefetch */
+	NULL	/* park */
 };
 
 #endif
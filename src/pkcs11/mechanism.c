@@ -41,8 +41,32 @@ struct signature_data {
 	sc_pkcs11_operation_t *	md;
 	CK_BYTE			buffer[4096/8];
 	unsigned int		buffer_len;
+	unsigned int		buffer_max;	/* largest raw input accepted */
+	/* the whole message, for the mechanisms hashed by the card */
+	CK_BYTE			*message;
+	CK_ULONG		message_len;
 };
 
+/*
+ * Position in mech_index of the first mechanism of type mech, or
+ * with 'after' set, of the first one behind all mechanisms of type mech
+ */
+static unsigned int
+find_mechanism_index(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech, int after)
+{
+	unsigned int lo = 0, hi = p11card->nmechanisms, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (p11card->mech_index[mid]->mech < mech
+				|| (after && p11card->mech_index[mid]->mech == mech))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 /*
  * Register a mechanism
  */
@@ -51,15 +75,29 @@ sc_pkcs11_register_mechanism(struct sc_pkcs11_card *p11card,
 				sc_pkcs11_mechanism_type_t *mt)
 {
 	sc_pkcs11_mechanism_type_t **p;
+	unsigned int n;
 
 	if (mt == NULL)
 		return CKR_HOST_MEMORY;
 
+	p = (sc_pkcs11_mechanism_type_t **) realloc(p11card->mech_index,
+			(p11card->nmechanisms + 1) * sizeof(*p));
+	if (p == NULL)
+		return CKR_HOST_MEMORY;
+	p11card->mech_index = p;
+
 	p = (sc_pkcs11_mechanism_type_t **) realloc(p11card->mechanisms,
 			(p11card->nmechanisms + 2) * sizeof(*p));
 	if (p == NULL)
 		return CKR_HOST_MEMORY;
 	p11card->mechanisms = p;
+
+	/* insert behind the mechanisms of the same type registered earlier */
+	n = find_mechanism_index(p11card, mt->mech, 1);
+	memmove(p11card->mech_index + n + 1, p11card->mech_index + n,
+			(p11card->nmechanisms - n) * sizeof(*p));
+	p11card->mech_index[n] = mt;
+
 	p[p11card->nmechanisms++] = mt;
 	p[p11card->nmechanisms] = NULL;
 	return CKR_OK;
@@ -74,9 +112,11 @@ sc_pkcs11_find_mechanism(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech,
 	sc_pkcs11_mechanism_type_t *mt;
 	unsigned int n;
 
-	for (n = 0; n < p11card->nmechanisms; n++) {
-		mt = p11card->mechanisms[n];
-		if (mt && mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
+	for (n = find_mechanism_index(p11card, mech, 0); n < p11card->nmechanisms; n++) {
+		mt = p11card->mech_index[n];
+		if (mt->mech != mech)
+			break;
+		if ((mt->mech_info.flags & flags) == flags)
 			return mt;
 	}
 	return NULL;
@@ -290,6 +330,10 @@ sc_pkcs11_sign_update(struct sc_pkcs11_session *session,
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto done;
 	}
+	if (op->batch_len) {
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+		goto done;
+	}
 
 	rv = op->type->sign_update(op, pData, ulDataLen);
 
@@ -317,6 +361,10 @@ sc_pkcs11_sign_final(struct sc_pkcs11_session *session,
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto done;
 	}
+	if (op->batch_len) {
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+		goto done;
+	}
 
 	rv = op->type->sign_final(op, pSignature, pulSignatureLen);
 
@@ -352,6 +400,127 @@ done:
 	LOG_FUNC_RETURN(context, rv);
 }
 
+/*
+ * Batch signature: the inputs are signed one after the other with the
+ * mechanism of the batch, restarting its operation for every input, while
+ * the card stays locked.
+ */
+CK_RV
+sc_pkcs11_sign_batch_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechanism,
+		    struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type)
+{
+	CK_OPENSC_SIGN_BATCH_PARAMS *params;
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	params = (CK_OPENSC_SIGN_BATCH_PARAMS *) pMechanism->pParameter;
+	if (params == NULL || pMechanism->ulParameterLen != sizeof(*params)
+			|| params->ulItemLen == 0
+			|| params->mechanism.mechanism == CKM_OPENSC_SIGN_BATCH)
+		LOG_FUNC_RETURN(context, CKR_MECHANISM_PARAM_INVALID);
+
+	rv = sc_pkcs11_sign_init(session, &params->mechanism, key, key_type);
+	if (rv == CKR_OK && session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op) == CKR_OK)
+		op->batch_len = params->ulItemLen;
+
+	LOG_FUNC_RETURN(context, rv);
+}
+
+CK_RV
+sc_pkcs11_sign_batch(struct sc_pkcs11_session *session, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		     CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	sc_pkcs11_operation_t *op;
+	struct sc_pkcs11_object *key;
+	CK_MECHANISM mechanism;
+	CK_MECHANISM_TYPE key_type;
+	CK_ULONG item_len, count, length, len, i;
+	struct sc_card *card;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+
+	item_len = op->batch_len;
+	if (item_len == 0 || ulDataLen == 0 || ulDataLen % item_len) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+		LOG_FUNC_RETURN(context, CKR_DATA_LEN_RANGE);
+	}
+	count = ulDataLen / item_len;
+
+	rv = sc_pkcs11_sign_size(session, &length);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+	if (pSignature == NULL || *pulSignatureLen < count * length) {
+		*pulSignatureLen = count * length;
+		LOG_FUNC_RETURN(context, pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK);
+	}
+
+	/* what is needed to restart the operation for the next input */
+	mechanism = op->mechanism;
+	key = ((struct signature_data *) op->priv_data)->key;
+	key_type = op->type->key_type;
+	op->batch_len = 0;
+
+	card = session->slot->p11card->card;
+	rv = sc_to_cryptoki_error(sc_lock(card), "C_Sign");
+	if (rv != CKR_OK) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+		LOG_FUNC_RETURN(context, rv);
+	}
+
+	rv = restore_login_state(session->slot);
+	for (i = 0; i < count && rv == CKR_OK; i++) {
+		if (i > 0)
+			rv = sc_pkcs11_sign_init(session, &mechanism, key, key_type);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_sign_update(session, pData + i * item_len, item_len);
+		len = length;
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_sign_final(session, pSignature + i * length, &len);
+		if (rv == CKR_OK && len != length) {
+			sc_log(context, "Signature %lu has %lu bytes instead of %lu", i, len, length);
+			rv = CKR_GENERAL_ERROR;
+		}
+	}
+	rv = reset_login_state(session->slot, rv);
+	sc_unlock(card);
+
+	/* the operation of an input that failed may still be active */
+	if (session->operation[SC_PKCS11_OPERATION_SIGN] != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+	if (rv == CKR_OK)
+		*pulSignatureLen = count * length;
+
+	LOG_FUNC_RETURN(context, rv);
+}
+
+/*
+ * Largest input of a mechanism that signs the raw data. Raw RSA takes
+ * at most the modulus, PKCS#1 v1.5 padding uses up 11 bytes of it;
+ * anything else is only bound by the size of the buffer.
+ */
+static unsigned int
+sc_pkcs11_raw_input_max(sc_pkcs11_operation_t *operation)
+{
+	struct signature_data *data = (struct signature_data *) operation->priv_data;
+	CK_ULONG len, max = sizeof(data->buffer);
+
+	if (data->info == NULL && operation->type->sign_size != NULL
+			&& (operation->mechanism.mechanism == CKM_RSA_PKCS
+			|| operation->mechanism.mechanism == CKM_RSA_X_509)
+			&& operation->type->sign_size(operation, &len) == CKR_OK) {
+		if (operation->mechanism.mechanism == CKM_RSA_PKCS)
+			len = len > 11 ? len - 11 : 0;
+		if (len < max)
+			max = len;
+	}
+	return (unsigned int) max;
+}
+
 /*
  * Initialize a signature operation
  */
@@ -408,6 +577,8 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 	}
 
 	operation->priv_data = data;
+	if (data->md == NULL)
+		data->buffer_max = sc_pkcs11_raw_input_max(operation);
 	LOG_FUNC_RETURN(context, CKR_OK);
 }
 
@@ -425,8 +596,25 @@ sc_pkcs11_signature_update(sc_pkcs11_operation_t *operation,
 		LOG_FUNC_RETURN(context, rv);
 	}
 
+	/* The card hashes the message itself: it has no size limit */
+	if (operation->mechanism.mechanism == CKM_GOSTR3410_WITH_GOSTR3411) {
+		CK_BYTE *message;
+
+		if (ulPartLen > (CK_ULONG)-1 - data->message_len)
+			LOG_FUNC_RETURN(context, CKR_DATA_LEN_RANGE);
+		message = realloc(data->message, data->message_len + ulPartLen);
+		if (message == NULL && data->message_len + ulPartLen != 0)
+			LOG_FUNC_RETURN(context, CKR_HOST_MEMORY);
+		data->message = message;
+		if (ulPartLen)
+			memcpy(data->message + data->message_len, pPart, ulPartLen);
+		data->message_len += ulPartLen;
+		sc_log(context, "data length %lu", data->message_len);
+		LOG_FUNC_RETURN(context, CKR_OK);
+	}
+
 	/* This signature mechanism operates on the raw data */
-	if (data->buffer_len + ulPartLen > sizeof(data->buffer))
+	if (ulPartLen > data->buffer_max - data->buffer_len)
 		LOG_FUNC_RETURN(context, CKR_DATA_LEN_RANGE);
 	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
 	data->buffer_len += ulPartLen;
@@ -456,6 +644,14 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		data->buffer_len = len;
 	}
 
+	if (operation->mechanism.mechanism == CKM_GOSTR3410_WITH_GOSTR3411) {
+		sc_log(context, "%lu bytes to hash and sign", data->message_len);
+		rv = data->key->ops->sign(operation->session, data->key, &operation->mechanism,
+				data->message ? data->message : data->buffer, data->message_len,
+				pSignature, pulSignatureLen);
+		LOG_FUNC_RETURN(context, rv);
+	}
+
 	sc_log(context, "%u bytes to sign", data->buffer_len);
 	rv = data->key->ops->sign(operation->session, data->key, &operation->mechanism,
 			data->buffer, data->buffer_len, pSignature, pulSignatureLen);
@@ -514,6 +710,7 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	if (!data)
 	    return;
 	sc_pkcs11_release_operation(&data->md);
+	free(data->message);
 	memset(data, 0, sizeof(*data));
 	free(data);
 }
@@ -607,6 +804,100 @@ done:
 	return rv;
 }
 
+/*
+ * Decode the public key of an object for the operations done in software.
+ * This is the only step that needs the object; the operations themselves
+ * only use the decoded key and so do not depend on the card.
+ */
+static CK_RV
+sc_pkcs11_load_public_key(struct sc_pkcs11_session *session, struct sc_pkcs11_object *key)
+{
+	CK_ATTRIBUTE attr = {CKA_SPKI, NULL, 0};
+	CK_RV rv;
+
+	if (key->pkey != NULL)
+		return CKR_OK;
+
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	attr.pValue = calloc(1, attr.ulValueLen);
+	if (!attr.pValue)
+		return CKR_HOST_MEMORY;
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_load_pkey(attr.pValue, attr.ulValueLen, &key->pkey);
+	free(attr.pValue);
+
+	return rv;
+}
+
+/*
+ * Initialize a verify recover operation; it shares the verification
+ * state of the session with C_VerifyInit
+ */
+CK_RV
+sc_pkcs11_verif_recover_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechanism,
+		struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	int rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->p11card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_VERIFY_RECOVER);
+	if (mt == NULL || mt->verif_recover == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_VERIFY, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	rv = mt->verif_init(operation, key);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_load_public_key(operation->session, key);
+
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_verif_recover(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_VERIFY, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->verif_recover == NULL) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+
+	rv = op->type->verif_recover(op, pSignature, ulSignatureLen, pData, pulDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY);
+
+	return rv;
+}
+
 /*
  * Initialize a verify operation
  */
@@ -656,6 +947,8 @@ sc_pkcs11_verify_init(sc_pkcs11_operation_t *operation,
 	}
 
 	operation->priv_data = data;
+	if (data->md == NULL)
+		data->buffer_max = sc_pkcs11_raw_input_max(operation);
 	return CKR_OK;
 }
 
@@ -673,13 +966,59 @@ sc_pkcs11_verify_update(sc_pkcs11_operation_t *operation,
 	}
 
 	/* This verification mechanism operates on the raw data */
-	if (data->buffer_len + ulPartLen > sizeof(data->buffer))
+	if (ulPartLen > data->buffer_max - data->buffer_len)
 		return CKR_DATA_LEN_RANGE;
 	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
 	data->buffer_len += ulPartLen;
 	return CKR_OK;
 }
 
+static CK_RV
+sc_pkcs11_verify_recover(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data *) operation->priv_data;
+	return sc_pkcs11_verify_recover_data(data->key->pkey, operation->mechanism.mechanism,
+			pSignature, ulSignatureLen, pData, pulDataLen);
+}
+
+/*
+ * Initialize an encryption operation; the public key is used in software
+ */
+static CK_RV
+sc_pkcs11_encrypt_init(sc_pkcs11_operation_t *operation,
+		struct sc_pkcs11_object *key)
+{
+	struct signature_data *data;
+	CK_RV rv;
+
+	rv = sc_pkcs11_load_public_key(operation->session, key);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (!(data = calloc(1, sizeof(*data))))
+		return CKR_HOST_MEMORY;
+	data->key = key;
+
+	operation->priv_data = data;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_encrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data *) operation->priv_data;
+	return sc_pkcs11_encrypt_data(data->key->pkey, operation->mechanism.mechanism,
+			pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+}
+
 static CK_RV
 sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
@@ -704,9 +1043,11 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 	if (rv != CKR_OK)
 		return rv;
 
+	/* the key was already decoded by a previous verification */
+	if (key->pkey != NULL)
+		goto verify;
 	if (key_type != CKK_GOSTR3410)
 		attr.type = CKA_SPKI;
-		
 
 	rv = key->ops->get_attribute(operation->session, key, &attr);
 	if (rv != CKR_OK)
@@ -727,10 +1068,12 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			goto done;
 	}
 
+verify:
 	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
 		params, sizeof(params),
 		operation->mechanism.mechanism, data->md,
-		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
+		data->buffer, data->buffer_len, pSignature, ulSignatureLen,
+		&key->pkey);
 
 done:
 	free(pubkey_value);
@@ -801,7 +1144,182 @@ sc_pkcs11_decr(struct sc_pkcs11_session *session,
 	return rv;
 }
 
-/* Derive one key from another, and return results in created object */
+CK_RV
+sc_pkcs11_decr_update(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	/* Only the mechanisms run on the host decrypt in parts */
+	if (op->type->decrypt_update == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = op->type->decrypt_update(op, pEncryptedPart, ulEncryptedPartLen,
+			pPart, pulPartLen);
+
+	if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_DECRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_decr_final(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->decrypt_final == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = op->type->decrypt_final(op, pLastPart, pulLastPartLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && (pLastPart != NULL || rv != CKR_OK))
+		session_stop_operation(session, SC_PKCS11_OPERATION_DECRYPT);
+
+	return rv;
+}
+
+/*
+ * Whether the active decryption runs on the host, with a key held in
+ * memory, so the card and the lock of its slot are not needed
+ */
+int
+sc_pkcs11_decr_on_host(struct sc_pkcs11_session *session)
+{
+	sc_pkcs11_operation_t *op;
+
+	if (session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op) != CKR_OK)
+		return 0;
+	return !(op->type->mech_info.flags & CKF_HW);
+}
+
+#ifdef ENABLE_OPENSSL
+/*
+ * Initialize an encryption context. The operation is done in software
+ * with the public key, so the card is not involved after this.
+ */
+CK_RV
+sc_pkcs11_encr_init(struct sc_pkcs11_session *session,
+			CK_MECHANISM_PTR pMechanism,
+			struct sc_pkcs11_object *key,
+			CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->p11card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_ENCRYPT);
+	if (mt == NULL || mt->encrypt_init == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_ENCRYPT, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	rv = mt->encrypt_init(operation, key);
+
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = op->type->encrypt(op, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pEncryptedData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr_update(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	/* Encryption with a public key is single part only */
+	if (op->type->encrypt_update == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = op->type->encrypt_update(op, pPart, ulPartLen,
+			pEncryptedPart, pulEncryptedPartLen);
+
+	if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr_final(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->encrypt_final == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = op->type->encrypt_final(op, pLastEncryptedPart, pulLastEncryptedPartLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && (pLastEncryptedPart != NULL || rv != CKR_OK))
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+#endif
+
+/* Derive one key from another, and return results in created object.
+ * ulValueLen is the CKA_VALUE_LEN of the template, 0 if not given.
+ * The card only computes the ECDH shared secret, a KDF asked for in the
+ * ECDH parameters is run on the host. */
 CK_RV
 sc_pkcs11_deri(struct sc_pkcs11_session *session,
 	CK_MECHANISM_PTR pMechanism,
@@ -809,13 +1327,15 @@ sc_pkcs11_deri(struct sc_pkcs11_session *session,
 	CK_KEY_TYPE key_type,
 	CK_SESSION_HANDLE hSession,
 	CK_OBJECT_HANDLE hdkey,
-	struct sc_pkcs11_object * dkey)
+	struct sc_pkcs11_object * dkey,
+	CK_ULONG ulValueLen)
 {
 
 	struct sc_pkcs11_card *p11card;
 	sc_pkcs11_operation_t *operation;
 	sc_pkcs11_mechanism_type_t *mt;
-	CK_BYTE_PTR keybuf = NULL;
+	CK_ECDH1_DERIVE_PARAMS *ecdh_params = NULL;
+	CK_BYTE_PTR keybuf = NULL, kdfbuf = NULL;
 	CK_ULONG ulDataLen = 0;
 	CK_ATTRIBUTE template[] = {
 		{CKA_VALUE, keybuf, 0}
@@ -837,6 +1357,30 @@ sc_pkcs11_deri(struct sc_pkcs11_session *session,
 	if (mt->key_type != key_type)
 		return CKR_KEY_TYPE_INCONSISTENT;
 
+	if (pMechanism->mechanism == CKM_ECDH1_DERIVE
+			|| pMechanism->mechanism == CKM_ECDH1_COFACTOR_DERIVE) {
+		if (pMechanism->pParameter == NULL
+				|| pMechanism->ulParameterLen != sizeof(CK_ECDH1_DERIVE_PARAMS))
+			return CKR_MECHANISM_PARAM_INVALID;
+		ecdh_params = (CK_ECDH1_DERIVE_PARAMS *) pMechanism->pParameter;
+		if (ecdh_params->kdf == CKD_NULL) {
+			ecdh_params = NULL;
+		}
+		else {
+#ifdef ENABLE_OPENSSL
+			rv = sc_pkcs11_ecdh_kdf(ecdh_params->kdf, NULL, 0, NULL, 0, NULL, 0);
+			if (rv != CKR_OK)
+				return rv;
+			if (ulValueLen == 0)
+				return CKR_TEMPLATE_INCOMPLETE;
+			if (ecdh_params->ulSharedDataLen && ecdh_params->pSharedData == NULL)
+				return CKR_MECHANISM_PARAM_INVALID;
+#else
+			return CKR_MECHANISM_PARAM_INVALID;
+#endif
+		}
+	}
+
 
 	rv = session_start_operation(session, SC_PKCS11_OPERATION_DERIVE, mt, &operation);
 	if (rv != CKR_OK)
@@ -875,6 +1419,26 @@ sc_pkcs11_deri(struct sc_pkcs11_session *session,
 	if (rv != CKR_OK)
 	    goto out;
 
+#ifdef ENABLE_OPENSSL
+	if (ecdh_params && ulDataLen > 0) {
+		kdfbuf = calloc(1, ulValueLen);
+		if (!kdfbuf) {
+			rv = CKR_HOST_MEMORY;
+			goto out;
+		}
+		rv = sc_pkcs11_ecdh_kdf(ecdh_params->kdf, keybuf, ulDataLen,
+				ecdh_params->pSharedData, ecdh_params->ulSharedDataLen,
+				kdfbuf, ulValueLen);
+		memset(keybuf, 0, ulDataLen);
+		if (rv != CKR_OK)
+			goto out;
+		/* The derived key replaces the shared secret */
+		free(keybuf);
+		keybuf = kdfbuf;
+		kdfbuf = NULL;
+		ulDataLen = ulValueLen;
+	}
+#endif
 
 /* add the CKA_VALUE attribute to the template if it was returned
  * if not assume it is on the card...
@@ -895,6 +1459,7 @@ out:
 
 	if (keybuf)
 	    free(keybuf);
+	free(kdfbuf);
 	return rv;
 }
 
@@ -909,6 +1474,9 @@ sc_pkcs11_decrypt_init(sc_pkcs11_operation_t *operation,
 	struct signature_data *data;
 	CK_RV rv;
 
+	if (key->ops->decrypt == NULL_PTR)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
 	if (!(data = calloc(1, sizeof(*data))))
 		return CKR_HOST_MEMORY;
 
@@ -995,8 +1563,16 @@ sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE mech,
 		mt->verif_init = sc_pkcs11_verify_init;
 		mt->verif_update = sc_pkcs11_verify_update;
 		mt->verif_final = sc_pkcs11_verify_final;
+		if (pInfo->flags & CKF_VERIFY_RECOVER)
+			mt->verif_recover = sc_pkcs11_verify_recover;
 #endif
 	}
+#ifdef ENABLE_OPENSSL
+	if (pInfo->flags & CKF_ENCRYPT) {
+		mt->encrypt_init = sc_pkcs11_encrypt_init;
+		mt->encrypt = sc_pkcs11_encrypt;
+	}
+#endif
 	if (pInfo->flags & CKF_UNWRAP) {
 		/* TODO */
 	}
@@ -1047,7 +1623,7 @@ sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *p11card,
 		return CKR_MECHANISM_INVALID;
 
 	/* These hash-based mechs can only be used for sign/verify */
-	mech_info.flags &= (CKF_SIGN | CKF_SIGN_RECOVER | CKF_VERIFY | CKF_VERIFY_RECOVER);
+	mech_info.flags &= (CKF_SIGN | CKF_VERIFY);
 
 	info = calloc(1, sizeof(*info));
 	if (!info)
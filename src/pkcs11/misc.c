@@ -22,6 +22,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -55,6 +63,51 @@ void strcpy_bp(u8 * dst, const char *src, size_t dstsize)
 	memcpy((char *)dst, src, c);
 }
 
+int sc_pkcs11_array_append(struct sc_pkcs11_array *array, void *item)
+{
+	if (array->count == array->allocated) {
+		unsigned int allocated = array->allocated ? 2 * array->allocated : 8;
+		void **items = realloc(array->items, allocated * sizeof *items);
+
+		if (items == NULL)
+			return -1;
+		array->items = items;
+		array->allocated = allocated;
+	}
+	array->items[array->count++] = item;
+	return 0;
+}
+
+/* Returns the position of the item or -1 if it is not in the array */
+int sc_pkcs11_array_find(const struct sc_pkcs11_array *array, const void *item)
+{
+	unsigned int i;
+
+	for (i = 0; i < array->count; i++)
+		if (array->items[i] == item)
+			return (int) i;
+	return -1;
+}
+
+/* Removes the item and keeps the order of the remaining items */
+int sc_pkcs11_array_remove(struct sc_pkcs11_array *array, const void *item)
+{
+	int i = sc_pkcs11_array_find(array, item);
+
+	if (i < 0)
+		return -1;
+	array->count--;
+	memmove(&array->items[i], &array->items[i + 1],
+			(array->count - i) * sizeof *array->items);
+	return 0;
+}
+
+void sc_pkcs11_array_free(struct sc_pkcs11_array *array)
+{
+	free(array->items);
+	memset(array, 0, sizeof *array);
+}
+
 
 static CK_RV sc_to_cryptoki_error_common(int rc)
 {
@@ -138,16 +191,15 @@ CK_RV restore_login_state(struct sc_pkcs11_slot *slot)
 	CK_RV r = CKR_OK;
 
 	if (sc_pkcs11_conf.atomic && slot) {
-		if (list_iterator_start(&slot->logins)) {
-			struct sc_pkcs11_login *login = list_iterator_next(&slot->logins);
-			while (login) {
-				r = slot->p11card->framework->login(slot, login->userType,
-						login->pPin, login->ulPinLen);
-				if (r != CKR_OK)
-					break;
-				login = list_iterator_next(&slot->logins);
-			}
-			list_iterator_stop(&slot->logins);
+		unsigned int i;
+
+		for (i = 0; i < slot->logins.count; i++) {
+			struct sc_pkcs11_login *login = slot->logins.items[i];
+
+			r = slot->p11card->framework->login(slot, login->userType,
+					login->pPin, login->ulPinLen);
+			if (r != CKR_OK)
+				break;
 		}
 	}
 
@@ -196,7 +248,7 @@ CK_RV push_login_state(struct sc_pkcs11_slot *slot,
 	}
 	login->userType = userType;
 
-	if (0 > list_append(&slot->logins, login)) {
+	if (0 > sc_pkcs11_array_append(&slot->logins, login)) {
 		goto err;
 	}
 
@@ -217,17 +269,13 @@ err:
 
 void pop_login_state(struct sc_pkcs11_slot *slot)
 {
-	if (slot) {
-		unsigned int size = list_size(&slot->logins);
-		if (size > 0) {
-			struct sc_pkcs11_login *login = list_get_at(&slot->logins, size-1);
-			if (login) {
-				sc_mem_clear(login->pPin, login->ulPinLen);
-				free(login->pPin);
-				free(login);
-			}
-			if (0 > list_delete_at(&slot->logins, size-1))
-				sc_log(context, "Error deleting login state");
+	if (slot && slot->logins.count > 0) {
+		struct sc_pkcs11_login *login = slot->logins.items[--slot->logins.count];
+
+		if (login) {
+			sc_mem_clear(login->pPin, login->ulPinLen);
+			free(login->pPin);
+			free(login);
 		}
 	}
 }
@@ -235,12 +283,12 @@ void pop_login_state(struct sc_pkcs11_slot *slot)
 void pop_all_login_states(struct sc_pkcs11_slot *slot)
 {
 	if (sc_pkcs11_conf.atomic && slot) {
-		struct sc_pkcs11_login *login = list_fetch(&slot->logins);
-		while (login) {
+		while (slot->logins.count > 0) {
+			struct sc_pkcs11_login *login = slot->logins.items[--slot->logins.count];
+
 			sc_mem_clear(login->pPin, login->ulPinLen);
 			free(login->pPin);
 			free(login);
-			login = list_fetch(&slot->logins);
 		}
 	}
 }
@@ -303,6 +351,73 @@ CK_RV session_stop_operation(struct sc_pkcs11_session * session, int type)
 	return CKR_OK;
 }
 
+CK_RV session_start_message(struct sc_pkcs11_session * session, int type, int op_type,
+			    CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey, CK_KEY_TYPE key_type)
+{
+	struct sc_pkcs11_message *msg;
+
+	if (type < 0 || type >= SC_PKCS11_MESSAGE_MAX)
+		return CKR_ARGUMENTS_BAD;
+
+	if (session->message[type] != NULL)
+		return CKR_OPERATION_ACTIVE;
+
+	if (!(msg = calloc(1, sizeof(*msg))))
+		return CKR_HOST_MEMORY;
+
+	/* The parameters must outlive the call of C_Message*Init() */
+	msg->mechanism = *pMechanism;
+	if (pMechanism->pParameter && pMechanism->ulParameterLen) {
+		msg->mechanism.pParameter = malloc(pMechanism->ulParameterLen);
+		if (!msg->mechanism.pParameter) {
+			free(msg);
+			return CKR_HOST_MEMORY;
+		}
+		memcpy(msg->mechanism.pParameter, pMechanism->pParameter,
+				pMechanism->ulParameterLen);
+	} else {
+		msg->mechanism.pParameter = NULL;
+	}
+	msg->key = hKey;
+	msg->key_type = key_type;
+	msg->op_type = op_type;
+
+	session->message[type] = msg;
+	return CKR_OK;
+}
+
+CK_RV session_get_message(struct sc_pkcs11_session * session, int type, struct sc_pkcs11_message ** message)
+{
+	if (type < 0 || type >= SC_PKCS11_MESSAGE_MAX)
+		return CKR_ARGUMENTS_BAD;
+
+	if (!(*message = session->message[type]))
+		return CKR_OPERATION_NOT_INITIALIZED;
+
+	return CKR_OK;
+}
+
+CK_RV session_stop_message(struct sc_pkcs11_session * session, int type)
+{
+	struct sc_pkcs11_message *msg;
+
+	if (type < 0 || type >= SC_PKCS11_MESSAGE_MAX)
+		return CKR_ARGUMENTS_BAD;
+
+	if (!(msg = session->message[type]))
+		return CKR_OPERATION_NOT_INITIALIZED;
+
+	if (msg->active && session->operation[msg->op_type])
+		session_stop_operation(session, msg->op_type);
+	if (msg->mechanism.pParameter) {
+		sc_mem_clear(msg->mechanism.pParameter, msg->mechanism.ulParameterLen);
+		free(msg->mechanism.pParameter);
+	}
+	free(msg);
+	session->message[type] = NULL;
+	return CKR_OK;
+}
+
 CK_RV attr_extract(CK_ATTRIBUTE_PTR pAttr, void *ptr, size_t * sizep)
 {
 	unsigned int size;
@@ -444,6 +559,7 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	scconf_block *conf_block = NULL;
 	char *unblock_style = NULL;
 	char *create_slots_for_pins = NULL, *op, *tmp;
+	const char *token_pool;
 
 	/* Set defaults */
 	conf->max_virtual_slots = 16;
@@ -458,6 +574,15 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->pin_unblock_style = SC_PKCS11_PIN_UNBLOCK_NOT_ALLOWED;
 	conf->create_puk_slot = 0;
 	conf->create_slots_flags = SC_PKCS11_SLOT_CREATE_ALL;
+	conf->per_slot_locking = 0;
+	conf->detect_threads = 0;
+	conf->token_pool[0] = '\0';
+	conf->random_drbg = 0;
+	conf->random_reseed_interval = 256;
+	conf->prefetch_certificates = 0;
+	conf->keep_removed_cards = 0;
+	conf->removed_card_timeout = 300;
+	conf->lazy_detection = 0;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -471,6 +596,24 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 		conf->lock_login = 1;
 	conf->lock_login = scconf_get_bool(conf_block, "lock_login", conf->lock_login);
 	conf->init_sloppy = scconf_get_bool(conf_block, "init_sloppy", conf->init_sloppy);
+	conf->per_slot_locking = scconf_get_bool(conf_block, "per_slot_locking", conf->per_slot_locking);
+	conf->detect_threads = scconf_get_int(conf_block, "detect_threads", conf->detect_threads);
+	conf->random_drbg = scconf_get_bool(conf_block, "random_drbg", conf->random_drbg);
+	conf->random_reseed_interval = scconf_get_int(conf_block, "random_reseed_interval", conf->random_reseed_interval);
+	if (conf->random_reseed_interval == 0)
+		conf->random_reseed_interval = 1;
+	conf->prefetch_certificates = scconf_get_bool(conf_block, "prefetch_certificates", conf->prefetch_certificates);
+	conf->keep_removed_cards = scconf_get_int(conf_block, "keep_removed_cards", conf->keep_removed_cards);
+	conf->removed_card_timeout = scconf_get_int(conf_block, "removed_card_timeout", conf->removed_card_timeout);
+	conf->lazy_detection = scconf_get_bool(conf_block, "lazy_detection", conf->lazy_detection);
+	token_pool = scconf_get_str(conf_block, "token_pool", NULL);
+	if (token_pool) {
+		strncpy(conf->token_pool, token_pool, sizeof conf->token_pool - 1);
+		conf->token_pool[sizeof conf->token_pool - 1] = '\0';
+	}
+	/* the members of a token pool are known by their token labels */
+	if (conf->token_pool[0])
+		conf->lazy_detection = 0;
 
 	unblock_style = (char *)scconf_get_str(conf_block, "user_pin_unblock_style", NULL);
 	if (unblock_style && !strcmp(unblock_style, "set_pin_in_unlogged_session"))
@@ -499,8 +642,37 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	sc_log(ctx, "PKCS#11 options: max_virtual_slots=%d slots_per_card=%d "
 		 "lock_login=%d atomic=%d pin_unblock_style=%d "
-		 "create_slots_flags=0x%X",
+		 "create_slots_flags=0x%X per_slot_locking=%d detect_threads=%u "
+		 "prefetch_certificates=%d keep_removed_cards=%u "
+		 "removed_card_timeout=%u token_pool='%s' lazy_detection=%d",
 		 conf->max_virtual_slots, conf->slots_per_card,
 		 conf->lock_login, conf->atomic, conf->pin_unblock_style,
-		 conf->create_slots_flags);
+		 conf->create_slots_flags, conf->per_slot_locking,
+		 conf->detect_threads, conf->prefetch_certificates,
+		 conf->keep_removed_cards, conf->removed_card_timeout, conf->token_pool,
+		 conf->lazy_detection);
+}
+
+sc_timestamp_t sc_pkcs11_clock_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (sc_timestamp_t)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (sc_timestamp_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (sc_timestamp_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (sc_timestamp_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
 }
@@ -22,9 +22,12 @@
 #include "config.h"
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <openssl/bn.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <openssl/opensslv.h>
@@ -42,6 +45,7 @@
 #include <openssl/crypto.h>
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L */
 
+#include "libopensc/sc-ossl-compat.h"
 #include "sc-pkcs11.h"
 
 static CK_RV	sc_pkcs11_openssl_md_init(sc_pkcs11_operation_t *);
@@ -50,6 +54,17 @@ static CK_RV	sc_pkcs11_openssl_md_update(sc_pkcs11_operation_t *,
 static CK_RV	sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG_PTR);
 static void	sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *);
+static CK_RV	sc_pkcs11_openssl_encrypt_init(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+static CK_RV	sc_pkcs11_openssl_decrypt_init(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+static CK_RV	sc_pkcs11_openssl_cipher(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+static CK_RV	sc_pkcs11_openssl_cipher_update(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+static CK_RV	sc_pkcs11_openssl_cipher_final(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+static void	sc_pkcs11_openssl_cipher_release(sc_pkcs11_operation_t *);
 
 static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	CKM_SHA_1,
@@ -61,8 +76,9 @@ static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -78,8 +94,9 @@ static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -95,8 +112,9 @@ static sc_pkcs11_mechanism_type_t openssl_sha384_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -112,8 +130,9 @@ static sc_pkcs11_mechanism_type_t openssl_sha512_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -130,8 +149,9 @@ static sc_pkcs11_mechanism_type_t openssl_gostr3411_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -148,8 +168,9 @@ static sc_pkcs11_mechanism_type_t openssl_md5_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -165,8 +186,34 @@ static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
-	NULL, NULL, NULL,	/* verif_* */
-	NULL, NULL,		/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL, NULL, NULL,	/* decrypt_* */
+	NULL, NULL, NULL, NULL,	/* encrypt_* */
+	NULL,			/* derive */
+	NULL,			/* mech_data */
+	NULL,			/* free_mech_data */
+};
+
+/* Template of the symmetric ciphers, with the secret keys kept in memory,
+ * e.g. derived with C_DeriveKey. No CKF_HW: these run on the host and do
+ * not need the card. See register_cipher(). */
+static sc_pkcs11_mechanism_type_t openssl_cipher_mech = {
+	0,
+	{ 0, 0, CKF_ENCRYPT | CKF_DECRYPT },
+	0,
+	sizeof(struct sc_pkcs11_operation),
+	sc_pkcs11_openssl_cipher_release,
+	NULL, NULL, NULL,	/* md_* */
+	NULL, NULL, NULL, NULL,	/* sign_* */
+	NULL, NULL, NULL, NULL,	/* verif_* */
+	sc_pkcs11_openssl_decrypt_init,
+	sc_pkcs11_openssl_cipher,
+	sc_pkcs11_openssl_cipher_update,
+	sc_pkcs11_openssl_cipher_final,
+	sc_pkcs11_openssl_encrypt_init,
+	sc_pkcs11_openssl_cipher,
+	sc_pkcs11_openssl_cipher_update,
+	sc_pkcs11_openssl_cipher_final,
 	NULL,			/* derive */
 	NULL,			/* mech_data */
 	NULL,			/* free_mech_data */
@@ -180,6 +227,61 @@ static void * dup_mem(void *in, size_t in_len)
 	return out;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static void free_md(const void *md)
+{
+	EVP_MD_free((EVP_MD *) md);
+}
+#endif
+
+/*
+ * Register a digest mechanism. With OpenSSL 3.0 the implementation is
+ * fetched once here, not implicitly on every EVP_DigestInit_ex().
+ */
+static void register_md(struct sc_pkcs11_card *p11card,
+		sc_pkcs11_mechanism_type_t *mt, const char *name, const EVP_MD *md)
+{
+	sc_pkcs11_mechanism_type_t *new_mt;
+
+	mt->mech_data = md;
+	mt->free_mech_data = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (name) {
+		EVP_MD *fetched = EVP_MD_fetch(NULL, name, NULL);
+		if (fetched) {
+			mt->mech_data = fetched;
+			mt->free_mech_data = free_md;
+		}
+	}
+#else
+	(void)name;
+#endif
+	new_mt = dup_mem(mt, sizeof *mt);
+	if (sc_pkcs11_register_mechanism(p11card, new_mt) != CKR_OK) {
+		if (new_mt && new_mt->free_mech_data)
+			new_mt->free_mech_data(new_mt->mech_data);
+		free(new_mt);
+	}
+	mt->mech_data = NULL;
+	mt->free_mech_data = NULL;
+}
+
+static void register_cipher(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech,
+		CK_KEY_TYPE key_type, CK_ULONG min_key_size, CK_ULONG max_key_size)
+{
+	sc_pkcs11_mechanism_type_t *mt;
+
+	mt = dup_mem(&openssl_cipher_mech, sizeof openssl_cipher_mech);
+	if (mt == NULL)
+		return;
+	mt->mech = mech;
+	mt->mech_info.ulMinKeySize = min_key_size;
+	mt->mech_info.ulMaxKeySize = max_key_size;
+	mt->key_type = key_type;
+	if (sc_pkcs11_register_mechanism(p11card, mt) != CKR_OK)
+		free(mt);
+}
+
 void
 sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *p11card)
 {
@@ -229,22 +331,26 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *p11card)
 #endif
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE) */
 
-	openssl_sha1_mech.mech_data = EVP_sha1();
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha1_mech, sizeof openssl_sha1_mech));
-	openssl_sha256_mech.mech_data = EVP_sha256();
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha256_mech, sizeof openssl_sha256_mech));
-	openssl_sha384_mech.mech_data = EVP_sha384();
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha384_mech, sizeof openssl_sha384_mech));
-	openssl_sha512_mech.mech_data = EVP_sha512();
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha512_mech, sizeof openssl_sha512_mech));
-	openssl_md5_mech.mech_data = EVP_md5();
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_md5_mech, sizeof openssl_md5_mech));
-	openssl_ripemd160_mech.mech_data = EVP_ripemd160();
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_ripemd160_mech, sizeof openssl_ripemd160_mech));
+	register_md(p11card, &openssl_sha1_mech, "SHA1", EVP_sha1());
+	register_md(p11card, &openssl_sha256_mech, "SHA256", EVP_sha256());
+	register_md(p11card, &openssl_sha384_mech, "SHA384", EVP_sha384());
+	register_md(p11card, &openssl_sha512_mech, "SHA512", EVP_sha512());
+	register_md(p11card, &openssl_md5_mech, "MD5", EVP_md5());
+	register_md(p11card, &openssl_ripemd160_mech, "RIPEMD160", EVP_ripemd160());
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
-	openssl_gostr3411_mech.mech_data = EVP_get_digestbynid(NID_id_GostR3411_94);
-	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_gostr3411_mech, sizeof openssl_gostr3411_mech));
+	/* the GOST digest comes from the engine loaded above */
+	register_md(p11card, &openssl_gostr3411_mech, NULL,
+			EVP_get_digestbynid(NID_id_GostR3411_94));
 #endif
+
+	register_cipher(p11card, CKM_AES_ECB, CKK_AES, 16, 32);
+	register_cipher(p11card, CKM_AES_CBC, CKK_AES, 16, 32);
+	register_cipher(p11card, CKM_AES_CBC_PAD, CKK_AES, 16, 32);
+	register_cipher(p11card, CKM_AES_CTR, CKK_AES, 16, 32);
+	register_cipher(p11card, CKM_AES_GCM, CKK_AES, 16, 32);
+	register_cipher(p11card, CKM_DES3_ECB, CKK_DES3, 24, 24);
+	register_cipher(p11card, CKM_DES3_CBC, CKK_DES3, 24, 24);
+	register_cipher(p11card, CKM_DES3_CBC_PAD, CKK_DES3, 24, 24);
 }
 
 
@@ -263,10 +369,13 @@ static CK_RV sc_pkcs11_openssl_md_init(sc_pkcs11_operation_t *op)
 	if (!op || !(mt = op->type) || !(md = (EVP_MD *) mt->mech_data))
 		return CKR_ARGUMENTS_BAD;
 
-	if (!(md_ctx = EVP_MD_CTX_create()))
+	if (op->session && op->session->md_ctx_pool_len > 0)
+		md_ctx = op->session->md_ctx_pool[--op->session->md_ctx_pool_len];
+	else if (!(md_ctx = EVP_MD_CTX_create()))
 		return CKR_HOST_MEMORY;
-	EVP_DigestInit(md_ctx, md);
 	op->priv_data = md_ctx;
+	if (!EVP_DigestInit_ex(md_ctx, md, NULL))
+		return CKR_GENERAL_ERROR;
 	return CKR_OK;
 }
 
@@ -294,12 +403,410 @@ static CK_RV sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *op,
 	return CKR_OK;
 }
 
+/*
+ * The context goes back to the session for the next operation; it is
+ * only destroyed when the pool is full.
+ */
 static void sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *op)
 {
 	EVP_MD_CTX	*md_ctx = DIGEST_CTX(op);
+	struct sc_pkcs11_session *session = op->session;
+
+	if (md_ctx) {
+		if (session && session->md_ctx_pool_len < SC_PKCS11_MD_CTX_POOL
+				&& EVP_MD_CTX_reset(md_ctx))
+			session->md_ctx_pool[session->md_ctx_pool_len++] = md_ctx;
+		else
+			EVP_MD_CTX_destroy(md_ctx);
+	}
+	op->priv_data = NULL;
+}
+
+void sc_pkcs11_openssl_release_session(struct sc_pkcs11_session *session)
+{
+	while (session->md_ctx_pool_len > 0)
+		EVP_MD_CTX_destroy(session->md_ctx_pool[--session->md_ctx_pool_len]);
+}
+
+/*
+ * Handle OpenSSL ciphers. The key value is copied into the cipher
+ * context by the init, the key object is not used after it.
+ * The multi-part operations stream through OpenSSL, only the partial
+ * block it holds back and the possible AES-GCM tag are not returned yet.
+ */
+static const struct openssl_cipher {
+	CK_MECHANISM_TYPE mech;
+	CK_ULONG key_len;
+	const EVP_CIPHER *(*cipher)(void);
+} openssl_ciphers[] = {
+	{ CKM_AES_ECB,		16, EVP_aes_128_ecb },
+	{ CKM_AES_ECB,		24, EVP_aes_192_ecb },
+	{ CKM_AES_ECB,		32, EVP_aes_256_ecb },
+	{ CKM_AES_CBC,		16, EVP_aes_128_cbc },
+	{ CKM_AES_CBC,		24, EVP_aes_192_cbc },
+	{ CKM_AES_CBC,		32, EVP_aes_256_cbc },
+	{ CKM_AES_CBC_PAD,	16, EVP_aes_128_cbc },
+	{ CKM_AES_CBC_PAD,	24, EVP_aes_192_cbc },
+	{ CKM_AES_CBC_PAD,	32, EVP_aes_256_cbc },
+	{ CKM_AES_CTR,		16, EVP_aes_128_ctr },
+	{ CKM_AES_CTR,		24, EVP_aes_192_ctr },
+	{ CKM_AES_CTR,		32, EVP_aes_256_ctr },
+	{ CKM_AES_GCM,		16, EVP_aes_128_gcm },
+	{ CKM_AES_GCM,		24, EVP_aes_192_gcm },
+	{ CKM_AES_GCM,		32, EVP_aes_256_gcm },
+	{ CKM_DES3_ECB,		24, EVP_des_ede3 },
+	{ CKM_DES3_CBC,		24, EVP_des_ede3_cbc },
+	{ CKM_DES3_CBC_PAD,	24, EVP_des_ede3_cbc },
+};
+
+struct openssl_cipher_data {
+	EVP_CIPHER_CTX *ctx;
+	int encrypt;
+	int padding;		/* CKM_*_CBC_PAD */
+	int gcm;
+	CK_ULONG block_size;	/* 1 for AES-CTR and AES-GCM */
+	CK_ULONG pending;	/* input not returned yet, see above */
+	CK_ULONG tag_len;	/* AES-GCM */
+	unsigned char tag[16];	/* AES-GCM decryption: the last input bytes */
+	uint64_t ctr_left;	/* AES-CTR: bytes left before the counter wraps */
+};
+
+#define CIPHER_DATA(op) \
+	((struct openssl_cipher_data *) (op)->priv_data)
+
+#define CIPHER_LEN_ERROR(data) \
+	((data)->encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE)
+
+static const EVP_CIPHER *openssl_cipher(CK_MECHANISM_TYPE mech, CK_ULONG key_len)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof openssl_ciphers / sizeof *openssl_ciphers; i++)
+		if (openssl_ciphers[i].mech == mech && openssl_ciphers[i].key_len == key_len)
+			return openssl_ciphers[i].cipher();
+	return NULL;
+}
+
+/* Bytes of keystream the counter block allows, with the counter in
+ * its ulCounterBits low order bits */
+static uint64_t ctr_limit(const CK_AES_CTR_PARAMS *ctr)
+{
+	uint64_t value = 0;
+	int i;
+
+	if (ctr->ulCounterBits >= 60)
+		return UINT64_MAX;
+	for (i = 8; i < 16; i++)
+		value = value << 8 | ctr->cb[i];
+	value &= ((uint64_t) 1 << ctr->ulCounterBits) - 1;
+	return (((uint64_t) 1 << ctr->ulCounterBits) - value) * 16;
+}
+
+static CK_RV sc_pkcs11_openssl_cipher_init(sc_pkcs11_operation_t *op,
+		struct sc_pkcs11_object *key, int encrypt)
+{
+	CK_MECHANISM_PTR mech = &op->mechanism;
+	struct openssl_cipher_data *data;
+	unsigned char value[32];
+	CK_ATTRIBUTE attr = { CKA_VALUE, NULL, 0 };
+	const EVP_CIPHER *cipher;
+	const unsigned char *iv = NULL;
+	CK_GCM_PARAMS *gcm = NULL;
+	CK_AES_CTR_PARAMS *ctr = NULL;
+	CK_ULONG iv_len = 0;
+	int outl;
+	CK_RV rv;
+
+	/* Only the keys held in memory can be used */
+	rv = key->ops->get_attribute(op->session, key, &attr);
+	if (rv != CKR_OK || attr.ulValueLen == 0)
+		return CKR_KEY_TYPE_INCONSISTENT;
+	if (attr.ulValueLen > sizeof value)
+		return CKR_KEY_SIZE_RANGE;
+	attr.pValue = value;
+	rv = key->ops->get_attribute(op->session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	cipher = openssl_cipher(mech->mechanism, attr.ulValueLen);
+	if (cipher == NULL) {
+		rv = CKR_KEY_SIZE_RANGE;
+		goto out;
+	}
+
+	switch (mech->mechanism) {
+	case CKM_AES_ECB:
+	case CKM_DES3_ECB:
+		if (mech->ulParameterLen != 0) {
+			rv = CKR_MECHANISM_PARAM_INVALID;
+			goto out;
+		}
+		break;
+	case CKM_AES_GCM:
+		if (mech->pParameter == NULL || mech->ulParameterLen != sizeof(CK_GCM_PARAMS)) {
+			rv = CKR_MECHANISM_PARAM_INVALID;
+			goto out;
+		}
+		gcm = (CK_GCM_PARAMS *) mech->pParameter;
+		if (gcm->pIv == NULL || gcm->ulIvLen == 0 || gcm->ulIvLen > INT_MAX
+				|| gcm->ulTagBits % 8 || gcm->ulTagBits < 32 || gcm->ulTagBits > 128
+				|| (gcm->ulAADLen && gcm->pAAD == NULL) || gcm->ulAADLen > INT_MAX) {
+			rv = CKR_MECHANISM_PARAM_INVALID;
+			goto out;
+		}
+		iv = gcm->pIv;
+		break;
+	case CKM_AES_CTR:
+		if (mech->pParameter == NULL || mech->ulParameterLen != sizeof(CK_AES_CTR_PARAMS)) {
+			rv = CKR_MECHANISM_PARAM_INVALID;
+			goto out;
+		}
+		ctr = (CK_AES_CTR_PARAMS *) mech->pParameter;
+		if (ctr->ulCounterBits == 0 || ctr->ulCounterBits > 128) {
+			rv = CKR_MECHANISM_PARAM_INVALID;
+			goto out;
+		}
+		iv = ctr->cb;
+		break;
+	default:
+		iv_len = EVP_CIPHER_iv_length(cipher);
+		if (mech->pParameter == NULL || mech->ulParameterLen != iv_len) {
+			rv = CKR_MECHANISM_PARAM_INVALID;
+			goto out;
+		}
+		iv = mech->pParameter;
+		break;
+	}
+
+	data = calloc(1, sizeof *data);
+	if (data == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	op->priv_data = data;
+	data->encrypt = encrypt;
+	data->padding = mech->mechanism == CKM_AES_CBC_PAD
+		|| mech->mechanism == CKM_DES3_CBC_PAD;
+	data->gcm = gcm != NULL;
+	data->block_size = EVP_CIPHER_block_size(cipher);
+	data->ctr_left = ctr ? ctr_limit(ctr) : UINT64_MAX;
+	data->ctx = EVP_CIPHER_CTX_new();
+	if (data->ctx == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+
+	rv = CKR_GENERAL_ERROR;
+	if (!EVP_CipherInit_ex(data->ctx, cipher, NULL, NULL, NULL, encrypt))
+		goto out;
+	if (gcm) {
+		data->tag_len = gcm->ulTagBits / 8;
+		if (!EVP_CIPHER_CTX_ctrl(data->ctx, EVP_CTRL_GCM_SET_IVLEN, (int) gcm->ulIvLen, NULL))
+			goto out;
+	}
+	if (!EVP_CipherInit_ex(data->ctx, NULL, NULL, value, iv, encrypt))
+		goto out;
+	if (gcm && gcm->ulAADLen
+			&& !EVP_CipherUpdate(data->ctx, NULL, &outl, gcm->pAAD, (int) gcm->ulAADLen))
+		goto out;
+	EVP_CIPHER_CTX_set_padding(data->ctx, data->padding);
+	rv = CKR_OK;
+
+out:
+	/* The parameters are not used after this */
+	op->mechanism.pParameter = NULL;
+	op->mechanism.ulParameterLen = 0;
+	OPENSSL_cleanse(value, sizeof value);
+	return rv;
+}
+
+static CK_RV sc_pkcs11_openssl_encrypt_init(sc_pkcs11_operation_t *op,
+		struct sc_pkcs11_object *key)
+{
+	return sc_pkcs11_openssl_cipher_init(op, key, 1);
+}
+
+static CK_RV sc_pkcs11_openssl_decrypt_init(sc_pkcs11_operation_t *op,
+		struct sc_pkcs11_object *key)
+{
+	return sc_pkcs11_openssl_cipher_init(op, key, 0);
+}
+
+/* Output of an update with in_len more bytes, and what is pending after it */
+static CK_ULONG cipher_update_len(struct openssl_cipher_data *data,
+		CK_ULONG in_len, CK_ULONG *pending)
+{
+	CK_ULONG n = data->pending + in_len, len;
+
+	if (data->gcm && !data->encrypt) {
+		/* the last bytes may be the tag */
+		len = n > data->tag_len ? n - data->tag_len : 0;
+	}
+	else {
+		len = n - n % data->block_size;
+		/* the last block is kept to remove the padding */
+		if (data->padding && !data->encrypt && len == n && len > 0)
+			len -= data->block_size;
+	}
+	*pending = n - len;
+	return len;
+}
+
+/* Output of the final with the pending bytes; an upper bound when the
+ * padding is removed */
+static CK_RV cipher_final_len(struct openssl_cipher_data *data,
+		CK_ULONG pending, CK_ULONG *len)
+{
+	if (data->gcm) {
+		if (!data->encrypt && pending != data->tag_len)
+			return CKR_ENCRYPTED_DATA_LEN_RANGE;
+		*len = data->encrypt ? data->tag_len : 0;
+	}
+	else if (data->padding) {
+		if (!data->encrypt && pending != data->block_size)
+			return CKR_ENCRYPTED_DATA_LEN_RANGE;
+		*len = data->block_size;
+	}
+	else {
+		if (pending != 0)
+			return CIPHER_LEN_ERROR(data);
+		*len = 0;
+	}
+	return CKR_OK;
+}
+
+/* C_EncryptUpdate and C_DecryptUpdate */
+static CK_RV sc_pkcs11_openssl_cipher_update(sc_pkcs11_operation_t *op,
+		CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	struct openssl_cipher_data *data = CIPHER_DATA(op);
+	CK_ULONG len, pending;
+	int outl = 0, l;
 
-	if (md_ctx)
-		EVP_MD_CTX_destroy(md_ctx);
+	if (in_len > INT_MAX)
+		return CIPHER_LEN_ERROR(data);
+	len = cipher_update_len(data, in_len, &pending);
+	if (out == NULL) {
+		*out_len = len;
+		return CKR_OK;
+	}
+	if (*out_len < len) {
+		*out_len = len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	if (in_len > data->ctr_left)
+		return CIPHER_LEN_ERROR(data);
+
+	if (data->gcm && !data->encrypt) {
+		/* Decrypt all but the last tag_len bytes seen, held in data->tag */
+		CK_ULONG from_tag = len < data->pending ? len : data->pending;
+
+		if (from_tag) {
+			if (!EVP_CipherUpdate(data->ctx, out, &l, data->tag, (int) from_tag))
+				return CKR_GENERAL_ERROR;
+			outl += l;
+		}
+		if (len > from_tag) {
+			if (!EVP_CipherUpdate(data->ctx, out + outl, &l, in, (int) (len - from_tag)))
+				return CKR_GENERAL_ERROR;
+			outl += l;
+		}
+		memmove(data->tag, data->tag + from_tag, data->pending - from_tag);
+		memcpy(data->tag + data->pending - from_tag, in + (len - from_tag),
+				in_len - (len - from_tag));
+	}
+	else if (in_len > 0) {
+		if (!EVP_CipherUpdate(data->ctx, out, &outl, in, (int) in_len))
+			return CKR_GENERAL_ERROR;
+	}
+	data->pending = pending;
+	data->ctr_left -= in_len;
+	*out_len = outl;
+	return CKR_OK;
+}
+
+/* C_EncryptFinal and C_DecryptFinal */
+static CK_RV sc_pkcs11_openssl_cipher_final(sc_pkcs11_operation_t *op,
+		CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	struct openssl_cipher_data *data = CIPHER_DATA(op);
+	CK_ULONG len;
+	int outl = 0;
+	CK_RV rv;
+
+	rv = cipher_final_len(data, data->pending, &len);
+	if (rv != CKR_OK)
+		return rv;
+	if (out == NULL) {
+		*out_len = len;
+		return CKR_OK;
+	}
+	if (*out_len < len) {
+		*out_len = len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	if (data->gcm && !data->encrypt
+			&& !EVP_CIPHER_CTX_ctrl(data->ctx, EVP_CTRL_GCM_SET_TAG,
+				(int) data->tag_len, data->tag))
+		return CKR_GENERAL_ERROR;
+	if (!EVP_CipherFinal_ex(data->ctx, out, &outl))
+		return data->encrypt ? CKR_GENERAL_ERROR : CKR_ENCRYPTED_DATA_INVALID;
+	if (data->gcm && data->encrypt) {
+		if (!EVP_CIPHER_CTX_ctrl(data->ctx, EVP_CTRL_GCM_GET_TAG,
+					(int) data->tag_len, out + outl))
+			return CKR_GENERAL_ERROR;
+		outl += (int) data->tag_len;
+	}
+	data->pending = 0;
+	*out_len = outl;
+	return CKR_OK;
+}
+
+/* Single part C_Encrypt and C_Decrypt */
+static CK_RV sc_pkcs11_openssl_cipher(sc_pkcs11_operation_t *op,
+		CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	struct openssl_cipher_data *data = CIPHER_DATA(op);
+	CK_ULONG len, final_len, pending, n;
+	CK_RV rv;
+
+	if (in_len > INT_MAX)
+		return CIPHER_LEN_ERROR(data);
+	len = cipher_update_len(data, in_len, &pending);
+	rv = cipher_final_len(data, pending, &final_len);
+	if (rv != CKR_OK)
+		return rv;
+	if (out == NULL) {
+		*out_len = len + final_len;
+		return CKR_OK;
+	}
+	if (*out_len < len + final_len) {
+		*out_len = len + final_len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	n = len;
+	rv = sc_pkcs11_openssl_cipher_update(op, in, in_len, out, &n);
+	if (rv != CKR_OK)
+		return rv;
+	len = *out_len - n;
+	rv = sc_pkcs11_openssl_cipher_final(op, out + n, &len);
+	if (rv != CKR_OK) {
+		OPENSSL_cleanse(out, n);
+		return rv;
+	}
+	*out_len = n + len;
+	return CKR_OK;
+}
+
+static void sc_pkcs11_openssl_cipher_release(sc_pkcs11_operation_t *op)
+{
+	struct openssl_cipher_data *data = CIPHER_DATA(op);
+
+	if (data) {
+		EVP_CIPHER_CTX_free(data->ctx);
+		free(data);
+	}
 	op->priv_data = NULL;
 }
 
@@ -317,88 +824,484 @@ static void reverse(unsigned char *buf, size_t len)
 	}
 }
 
-static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
-		const unsigned char *params, int params_len,
-		unsigned char *data, int data_len,
-		unsigned char *signat, int signat_len)
+/*
+ * A GOST R 34.10-2001 key uses one of a few parameter sets. The curve of
+ * each is generated once per process, keyed by the encoded parameter OID,
+ * and shared by all keys; EC_KEY_set_group() takes a copy of it.
+ */
+#define GOST_GROUP_CACHE_SIZE	4
+#define GOST_PARAMS_MAX_LEN	16
+
+static struct gost_group {
+	unsigned char params[GOST_PARAMS_MAX_LEN];
+	int params_len;
+	EC_GROUP *group;
+} gost_groups[GOST_GROUP_CACHE_SIZE];
+static unsigned int gost_groups_next;
+static void *gost_groups_lock;
+
+static EC_GROUP *gostr3410_new_group(const unsigned char *params, int params_len)
 {
 	EVP_PKEY *pkey;
-	EVP_PKEY_CTX *pkey_ctx = NULL;
-	EC_POINT *P;
-	BIGNUM *X, *Y;
-	ASN1_OCTET_STRING *octet = NULL;
-	const EC_GROUP *group = NULL;
+	EVP_PKEY_CTX *pkey_ctx;
+	EC_GROUP *group = NULL;
 	char paramset[2] = "A";
-	int r = -1, ret_vrf = 0;
+	int r;
+
+	/* FIXME: fully check params[] */
+	if (params_len <= 0 || params[params_len - 1] < 1 || params[params_len - 1] > 3)
+		return NULL;
+	paramset[0] += params[params_len - 1] - 1;
 
 	pkey = EVP_PKEY_new();
 	if (!pkey)
-		return CKR_HOST_MEMORY;
+		return NULL;
 	r = EVP_PKEY_set_type(pkey, NID_id_GostR3410_2001);
-	if (r == 1) {
-		pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
-		if (!pkey_ctx) {
-			EVP_PKEY_free(pkey);
-			return CKR_HOST_MEMORY;
-		}
-		/* FIXME: fully check params[] */
-		if (params_len > 0 && params[params_len - 1] >= 1 &&
-				params[params_len - 1] <= 3) {
-			paramset[0] += params[params_len - 1] - 1;
-			r = EVP_PKEY_CTX_ctrl_str(pkey_ctx, "paramset", paramset);
-		}
-		else
-			r = -1;
+	pkey_ctx = r == 1 ? EVP_PKEY_CTX_new(pkey, NULL) : NULL;
+	if (pkey_ctx) {
+		r = EVP_PKEY_CTX_ctrl_str(pkey_ctx, "paramset", paramset);
 		if (r == 1)
 			r = EVP_PKEY_paramgen_init(pkey_ctx);
 		if (r == 1)
 			r = EVP_PKEY_paramgen(pkey_ctx, &pkey);
 		if (r == 1 && EVP_PKEY_get0(pkey) != NULL)
-			group = EC_KEY_get0_group(EVP_PKEY_get0(pkey));
-		r = -1;
-		if (group)
-			octet = d2i_ASN1_OCTET_STRING(NULL, &pubkey, (long)pubkey_len);
-		if (group && octet) {
-			reverse(octet->data, octet->length);
-			Y = BN_bin2bn(octet->data, octet->length / 2, NULL);
-			X = BN_bin2bn((const unsigned char*)octet->data +
-					octet->length / 2, octet->length / 2, NULL);
-			ASN1_OCTET_STRING_free(octet);
-			P = EC_POINT_new(group);
-			if (P && X && Y)
-				r = EC_POINT_set_affine_coordinates_GFp(group,
-						P, X, Y, NULL);
-			BN_free(X);
-			BN_free(Y);
-			if (r == 1 && EVP_PKEY_get0(pkey) && P)
-				r = EC_KEY_set_public_key(EVP_PKEY_get0(pkey), P);
-			EC_POINT_free(P);
-		}
-		if (r == 1) {
-			r = EVP_PKEY_verify_init(pkey_ctx);
-			reverse(data, data_len);
-			if (r == 1)
-				ret_vrf = EVP_PKEY_verify(pkey_ctx, signat, signat_len,
-						data, data_len);
+			group = EC_GROUP_dup(EC_KEY_get0_group(EVP_PKEY_get0(pkey)));
+		EVP_PKEY_CTX_free(pkey_ctx);
+	}
+	EVP_PKEY_free(pkey);
+	return group;
+}
+
+/* Sets the curve of the parameter set on key */
+static int gostr3410_set_group(EC_KEY *key, const unsigned char *params, int params_len)
+{
+	struct gost_group *slot;
+	EC_GROUP *group;
+	int i, r = 0;
+
+	if (params_len <= 0 || params_len > GOST_PARAMS_MAX_LEN)
+		return 0;
+	sc_pkcs11_lock_mutex(gost_groups_lock);
+	for (i = 0; i < GOST_GROUP_CACHE_SIZE; i++) {
+		slot = &gost_groups[i];
+		if (slot->group && slot->params_len == params_len
+				&& memcmp(slot->params, params, params_len) == 0) {
+			r = EC_KEY_set_group(key, slot->group);
+			sc_pkcs11_unlock_mutex(gost_groups_lock);
+			return r;
 		}
 	}
+	sc_pkcs11_unlock_mutex(gost_groups_lock);
+
+	/* the generation may load the engine, it runs without the lock */
+	group = gostr3410_new_group(params, params_len);
+	if (!group)
+		return 0;
+	r = EC_KEY_set_group(key, group);
+
+	sc_pkcs11_lock_mutex(gost_groups_lock);
+	slot = &gost_groups[gost_groups_next++ % GOST_GROUP_CACHE_SIZE];
+	EC_GROUP_free(slot->group);
+	memcpy(slot->params, params, params_len);
+	slot->params_len = params_len;
+	slot->group = group;
+	sc_pkcs11_unlock_mutex(gost_groups_lock);
+	return r;
+}
+
+/*
+ * Builds the GOST public key from the little-endian coordinates in the
+ * octet string pubkey.
+ */
+static CK_RV gostr3410_load_pkey(const unsigned char *pubkey, int pubkey_len,
+		const unsigned char *params, int params_len, EVP_PKEY **pkey)
+{
+	EC_KEY *key;
+	EC_POINT *P = NULL;
+	BIGNUM *X = NULL, *Y = NULL;
+	ASN1_OCTET_STRING *octet = NULL;
+	const EC_GROUP *group;
+	int r = -1;
+
+	key = EC_KEY_new();
+	if (!key)
+		return CKR_HOST_MEMORY;
+	if (gostr3410_set_group(key, params, params_len) == 1)
+		octet = d2i_ASN1_OCTET_STRING(NULL, &pubkey, (long)pubkey_len);
+	if (octet) {
+		group = EC_KEY_get0_group(key);
+		reverse(octet->data, octet->length);
+		Y = BN_bin2bn(octet->data, octet->length / 2, NULL);
+		X = BN_bin2bn((const unsigned char*)octet->data +
+				octet->length / 2, octet->length / 2, NULL);
+		ASN1_OCTET_STRING_free(octet);
+		P = EC_POINT_new(group);
+		if (P && X && Y)
+			r = EC_POINT_set_affine_coordinates_GFp(group,
+					P, X, Y, NULL);
+		if (r == 1)
+			r = EC_KEY_set_public_key(key, P);
+		BN_free(X);
+		BN_free(Y);
+		EC_POINT_free(P);
+	}
+	if (r == 1) {
+		*pkey = EVP_PKEY_new();
+		if (*pkey && EVP_PKEY_assign(*pkey, NID_id_GostR3410_2001, key) == 1)
+			return CKR_OK;
+		EVP_PKEY_free(*pkey);
+		*pkey = NULL;
+	}
+	EC_KEY_free(key);
+	return CKR_GENERAL_ERROR;
+}
+
+static CK_RV gostr3410_verify_data(EVP_PKEY *pkey,
+		unsigned char *data, int data_len,
+		unsigned char *signat, int signat_len)
+{
+	EVP_PKEY_CTX *pkey_ctx;
+	int r, ret_vrf = 0;
+
+	pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pkey_ctx)
+		return CKR_HOST_MEMORY;
+	r = EVP_PKEY_verify_init(pkey_ctx);
+	reverse(data, data_len);
+	if (r == 1)
+		ret_vrf = EVP_PKEY_verify(pkey_ctx, signat, signat_len,
+				data, data_len);
 	EVP_PKEY_CTX_free(pkey_ctx);
-	EVP_PKEY_free(pkey);
 	if (r != 1)
 		return CKR_GENERAL_ERROR;
 	return ret_vrf == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
 }
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
 
+/* Called by C_Initialize() once the context exists */
+void sc_pkcs11_openssl_init(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	/* a lock inherited over fork() is in an unknown state, it is left alone */
+	sc_pkcs11_create_mutex(&gost_groups_lock);
+#endif
+}
+
+/* Called by C_Finalize() before the context is released */
+void sc_pkcs11_openssl_cleanup(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	int i;
+
+	for (i = 0; i < GOST_GROUP_CACHE_SIZE; i++) {
+		EC_GROUP_free(gost_groups[i].group);
+		gost_groups[i].group = NULL;
+	}
+	sc_pkcs11_free_mutex(&gost_groups_lock);
+#endif
+}
+
+/*
+ * Decode the SPKI of a public key into *pkey, unless that was done before
+ */
+CK_RV sc_pkcs11_load_pkey(const unsigned char *pubkey, int pubkey_len, void **pkey)
+{
+	const unsigned char *pubkey_tmp = pubkey;
+
+	if (*pkey != NULL)
+		return CKR_OK;
+	if (pubkey == NULL)
+		return CKR_ARGUMENTS_BAD;
+	*pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+	if (*pkey == NULL)
+		return CKR_GENERAL_ERROR;
+	return CKR_OK;
+}
+
+/*
+ * Public key operations of CKM_RSA_PKCS and CKM_RSA_X_509, done in
+ * software with a key decoded by sc_pkcs11_load_pkey().
+ */
+static CK_RV rsa_public_op(void *pkey, CK_MECHANISM_TYPE mech, int encrypt,
+		CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	RSA *rsa;
+	unsigned char *buf = NULL;
+	int pad, size, len;
+	CK_RV rv;
+
+	if (mech == CKM_RSA_PKCS)
+		pad = RSA_PKCS1_PADDING;
+	else if (mech == CKM_RSA_X_509)
+		pad = RSA_NO_PADDING;
+	else
+		return CKR_MECHANISM_INVALID;
+
+	if (pkey == NULL || !(rsa = EVP_PKEY_get1_RSA((EVP_PKEY *) pkey)))
+		return CKR_KEY_TYPE_INCONSISTENT;
+	size = RSA_size(rsa);
+
+	/* size query; the recovered data is never longer than the modulus */
+	if (out == NULL) {
+		*out_len = size;
+		rv = CKR_OK;
+		goto done;
+	}
+	if (encrypt && *out_len < (CK_ULONG) size) {
+		*out_len = size;
+		rv = CKR_BUFFER_TOO_SMALL;
+		goto done;
+	}
+
+	if (!(buf = malloc(size))) {
+		rv = CKR_HOST_MEMORY;
+		goto done;
+	}
+	if (encrypt) {
+		if (in_len > (CK_ULONG) size
+				|| (pad == RSA_PKCS1_PADDING && in_len > (CK_ULONG) size - 11)) {
+			rv = CKR_DATA_LEN_RANGE;
+			goto done;
+		}
+		if (pad == RSA_NO_PADDING) {
+			/* raw input is a big-endian number, it gets left padded */
+			memset(buf, 0, size - in_len);
+			memcpy(buf + size - in_len, in, in_len);
+			len = RSA_public_encrypt(size, buf, out, rsa, pad);
+		}
+		else {
+			len = RSA_public_encrypt(in_len, in, out, rsa, pad);
+		}
+		if (len <= 0) {
+			rv = CKR_DATA_INVALID;
+			goto done;
+		}
+		*out_len = len;
+	}
+	else {
+		if (in_len != (CK_ULONG) size) {
+			rv = CKR_SIGNATURE_LEN_RANGE;
+			goto done;
+		}
+		len = RSA_public_decrypt(in_len, in, buf, rsa, pad);
+		if (len < 0) {
+			rv = CKR_SIGNATURE_INVALID;
+			goto done;
+		}
+		if (*out_len < (CK_ULONG) len) {
+			*out_len = len;
+			rv = CKR_BUFFER_TOO_SMALL;
+			goto done;
+		}
+		memcpy(out, buf, len);
+		*out_len = len;
+	}
+	rv = CKR_OK;
+
+done:
+	if (buf) {
+		OPENSSL_cleanse(buf, size);
+		free(buf);
+	}
+	RSA_free(rsa);
+	return rv;
+}
+
+CK_RV sc_pkcs11_encrypt_data(void *pkey, CK_MECHANISM_TYPE mech,
+		CK_BYTE_PTR inp, CK_ULONG inp_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return rsa_public_op(pkey, mech, 1, inp, inp_len, out, out_len);
+}
+
+CK_RV sc_pkcs11_verify_recover_data(void *pkey, CK_MECHANISM_TYPE mech,
+		CK_BYTE_PTR signat, CK_ULONG signat_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return rsa_public_op(pkey, mech, 0, signat, signat_len, out, out_len);
+}
+
+void sc_pkcs11_free_pkey(void **pkey)
+{
+	if (pkey && *pkey) {
+		EVP_PKEY_free((EVP_PKEY *) *pkey);
+		*pkey = NULL;
+	}
+}
+
+/*
+ * HMAC_DRBG with SHA-256 (NIST SP 800-90A, 10.1.2). It is seeded with
+ * entropy from the card and serves C_GenerateRandom on the host, so only
+ * the reseeding needs the card.
+ */
+#define DRBG_OUTLEN		32
+/* bytes produced by one generate request */
+#define DRBG_MAX_REQUEST	4096
+
+struct sc_pkcs11_drbg {
+	unsigned char key[DRBG_OUTLEN];
+	unsigned char v[DRBG_OUTLEN];
+	unsigned int reseed_counter;
+};
+
+static void drbg_hmac(struct sc_pkcs11_drbg *drbg, const unsigned char *data,
+		size_t len, unsigned char *out)
+{
+	unsigned char md[DRBG_OUTLEN];
+	unsigned int mdlen = sizeof md;
+
+	HMAC(EVP_sha256(), drbg->key, sizeof drbg->key, data, len, md, &mdlen);
+	memcpy(out, md, sizeof md);
+	OPENSSL_cleanse(md, sizeof md);
+}
+
+static void drbg_update(struct sc_pkcs11_drbg *drbg,
+		const unsigned char *data, size_t len)
+{
+	unsigned char buf[DRBG_OUTLEN + 1 + SC_PKCS11_DRBG_SEED_LEN];
+	unsigned char i;
+
+	if (len > SC_PKCS11_DRBG_SEED_LEN)
+		len = SC_PKCS11_DRBG_SEED_LEN;
+	for (i = 0; i < 2; i++) {
+		memcpy(buf, drbg->v, DRBG_OUTLEN);
+		buf[DRBG_OUTLEN] = i;
+		if (len)
+			memcpy(buf + DRBG_OUTLEN + 1, data, len);
+		drbg_hmac(drbg, buf, DRBG_OUTLEN + 1 + len, drbg->key);
+		drbg_hmac(drbg, drbg->v, DRBG_OUTLEN, drbg->v);
+		if (len == 0)
+			break;
+	}
+	OPENSSL_cleanse(buf, sizeof buf);
+}
+
+/* Instantiate the DRBG if *drbg is NULL, reseed it otherwise */
+CK_RV sc_pkcs11_drbg_seed(struct sc_pkcs11_drbg **drbg,
+		const unsigned char *seed, size_t len)
+{
+	if (drbg == NULL || seed == NULL)
+		return CKR_ARGUMENTS_BAD;
+	if (*drbg == NULL) {
+		*drbg = calloc(1, sizeof **drbg);
+		if (*drbg == NULL)
+			return CKR_HOST_MEMORY;
+		memset((*drbg)->v, 0x01, DRBG_OUTLEN);
+	}
+	drbg_update(*drbg, seed, len);
+	(*drbg)->reseed_counter = 1;
+	return CKR_OK;
+}
+
+/* Whether the DRBG has to be (re)seeded after interval requests */
+int sc_pkcs11_drbg_needs_seed(struct sc_pkcs11_drbg *drbg, unsigned int interval)
+{
+	return drbg == NULL || drbg->reseed_counter > interval;
+}
+
+void sc_pkcs11_drbg_generate(struct sc_pkcs11_drbg *drbg,
+		CK_BYTE_PTR out, CK_ULONG len)
+{
+	while (len > 0) {
+		CK_ULONG request = len < DRBG_MAX_REQUEST ? len : DRBG_MAX_REQUEST;
+
+		len -= request;
+		while (request > 0) {
+			CK_ULONG n = request < DRBG_OUTLEN ? request : DRBG_OUTLEN;
+
+			drbg_hmac(drbg, drbg->v, DRBG_OUTLEN, drbg->v);
+			memcpy(out, drbg->v, n);
+			out += n;
+			request -= n;
+		}
+		drbg_update(drbg, NULL, 0);
+		drbg->reseed_counter++;
+	}
+}
+
+void sc_pkcs11_drbg_free(struct sc_pkcs11_drbg *drbg)
+{
+	if (drbg) {
+		OPENSSL_cleanse(drbg, sizeof *drbg);
+		free(drbg);
+	}
+}
+
+/*
+ * ANSI X9.63 key derivation, the KDFs of CK_ECDH1_DERIVE_PARAMS. The card
+ * only computes the shared secret z, the digests run here with one
+ * context for all the counter blocks.
+ */
+CK_RV sc_pkcs11_ecdh_kdf(CK_ULONG kdf, const unsigned char *z, size_t z_len,
+		const unsigned char *shared, size_t shared_len,
+		CK_BYTE_PTR out, CK_ULONG out_len)
+{
+	const EVP_MD *md;
+	EVP_MD_CTX *md_ctx;
+	unsigned char digest[EVP_MAX_MD_SIZE], counter[4];
+	unsigned int digest_len;
+	unsigned long i;
+	CK_RV rv = CKR_OK;
+
+	switch (kdf) {
+	case CKD_SHA1_KDF:
+		md = EVP_sha1();
+		break;
+	case CKD_SHA224_KDF:
+		md = EVP_sha224();
+		break;
+	case CKD_SHA256_KDF:
+		md = EVP_sha256();
+		break;
+	case CKD_SHA384_KDF:
+		md = EVP_sha384();
+		break;
+	case CKD_SHA512_KDF:
+		md = EVP_sha512();
+		break;
+	default:
+		return CKR_MECHANISM_PARAM_INVALID;
+	}
+	if (out == NULL)
+		return CKR_OK;
+
+	md_ctx = EVP_MD_CTX_create();
+	if (md_ctx == NULL)
+		return CKR_HOST_MEMORY;
+	for (i = 1; out_len > 0; i++) {
+		counter[0] = (i >> 24) & 0xFF;
+		counter[1] = (i >> 16) & 0xFF;
+		counter[2] = (i >> 8) & 0xFF;
+		counter[3] = i & 0xFF;
+		if (!EVP_DigestInit_ex(md_ctx, md, NULL)
+				|| !EVP_DigestUpdate(md_ctx, z, z_len)
+				|| !EVP_DigestUpdate(md_ctx, counter, sizeof counter)
+				|| (shared_len && !EVP_DigestUpdate(md_ctx, shared, shared_len))
+				|| !EVP_DigestFinal_ex(md_ctx, digest, &digest_len)) {
+			rv = CKR_GENERAL_ERROR;
+			break;
+		}
+		if (digest_len > out_len)
+			digest_len = (unsigned int) out_len;
+		memcpy(out, digest, digest_len);
+		out += digest_len;
+		out_len -= digest_len;
+	}
+	OPENSSL_cleanse(digest, sizeof digest);
+	EVP_MD_CTX_destroy(md_ctx);
+	return rv;
+}
+
 /* If no hash function was used, finish with RSA_public_decrypt().
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
+ *
+ * If pkey_cache is given, the public key decoded by the first call is kept
+ * there and used instead of pubkey by the following ones.
  */
 CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 			const unsigned char *pubkey_params, int pubkey_params_len,
 			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, int data_len,
-			unsigned char *signat, int signat_len)
+			unsigned char *signat, int signat_len, void **pkey_cache)
 {
 	int res;
 	CK_RV rv = CKR_GENERAL_ERROR;
@@ -408,9 +1311,23 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	if (mech == CKM_GOSTR3410)
 	{
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
-		return gostr3410_verify_data(pubkey, pubkey_len,
-				pubkey_params, pubkey_params_len,
-				data, data_len, signat, signat_len);
+		if (pkey_cache && *pkey_cache) {
+			pkey = (EVP_PKEY *) *pkey_cache;
+			EVP_PKEY_up_ref(pkey);
+		}
+		else {
+			rv = gostr3410_load_pkey(pubkey, pubkey_len,
+					pubkey_params, pubkey_params_len, &pkey);
+			if (rv != CKR_OK)
+				return rv;
+			if (pkey_cache) {
+				EVP_PKEY_up_ref(pkey);
+				*pkey_cache = pkey;
+			}
+		}
+		rv = gostr3410_verify_data(pkey, data, data_len, signat, signat_len);
+		EVP_PKEY_free(pkey);
+		return rv;
 #else
 		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
 		return CKR_FUNCTION_NOT_SUPPORTED;
@@ -423,11 +1340,21 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	 * And we need to support more then just RSA.
 	 * We can use d2i_PUBKEY which works for SPKI and any key type. 
 	 */
-	pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
+	if (pkey_cache) {
+		rv = sc_pkcs11_load_pkey(pubkey, pubkey_len, pkey_cache);
+		if (rv != CKR_OK)
+			return rv;
+		/* the cache keeps its own reference, the one released below is ours */
+		pkey = (EVP_PKEY *) *pkey_cache;
+		EVP_PKEY_up_ref(pkey);
+	}
+	else {
+		pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
 
-	pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+		pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+		if (pkey == NULL)
+			return CKR_GENERAL_ERROR;
+	}
 
 	if (md != NULL) {
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
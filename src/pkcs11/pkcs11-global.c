@@ -43,13 +43,20 @@
 
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
-list_t sessions;
-list_t virtual_slots;
+struct sc_pkcs11_array sessions;
+struct sc_pkcs11_array virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
 #endif
 static int in_finalize = 0;
+/* whether the readers of the context have been listed, see lazy_detection */
+static int readers_listed = 0;
+/* Statistics of the global lock, protected by it */
+static unsigned long global_lock_count = 0;
+static sc_timestamp_t global_lock_wait_time = 0;
+static sc_timestamp_t global_lock_wait_max = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
+extern CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0;
 
 #ifdef PKCS11_THREAD_LOCKING
 
@@ -192,25 +199,29 @@ static sc_thread_context_t sc_thread_ctx = {
 	sc_unlock_mutex, sc_destroy_mutex, NULL
 };
 
-/* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
-}
-static int slot_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (slot->id == *(CK_SLOT_ID *)key)
-		return 1;
-	return 0;
-}
 
 
+/* Removes the cards from the readers and frees all sessions and slots */
+static void release_slots(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++)
+		card_removed(sc_ctx_get_reader(context, i), 0);
+	card_forget_removed(NULL);
+
+	sc_pkcs11_free_sessions();
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		sc_pkcs11_slot_t *slot = virtual_slots.items[i];
+
+		sc_pkcs11_array_free(&slot->objects);
+		sc_pkcs11_array_free(&slot->logins);
+		sc_pkcs11_free_slot_lock(slot);
+		free(slot);
+	}
+	sc_pkcs11_array_free(&virtual_slots);
+}
 
 CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 {
@@ -222,18 +233,35 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	unsigned int i;
 	sc_context_param_t ctx_opts;
 
+	int forked = 0;
+
 #if !defined(_WIN32)
 	/* Handle fork() exception */
 	if (current_pid != initialized_pid) {
-		if (context)
+		if (context) {
+			/* Sessions, slots and the handles of the reader subsystem belong
+			 * to the parent. The configuration and the card drivers of the
+			 * context are kept and only the readers are set up again. */
 			context->flags |= SC_CTX_FLAG_TERMINATE;
-		C_Finalize(NULL_PTR);
+			sc_notify_close();
+			slot_prefetch_stop();
+			if (sc_pkcs11_lock() == CKR_OK) {
+				release_slots();
+				sc_pkcs11_free_lock();
+			}
+			if (sc_context_reset_readers(context) == SC_SUCCESS) {
+				forked = 1;
+			} else {
+				sc_release_context(context);
+				context = NULL;
+			}
+		}
 	}
 	initialized_pid = current_pid;
 	in_finalize = 0;
 #endif
 
-	if (context != NULL) {
+	if (context != NULL && !forked) {
 		sc_log(context, "C_Initialize(): Cryptoki already initialized\n");
 		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
 	}
@@ -244,45 +272,60 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	if (rv != CKR_OK)
 		goto out;
 
-	/* set context options */
-	memset(&ctx_opts, 0, sizeof(sc_context_param_t));
-	ctx_opts.ver        = 0;
-	ctx_opts.app_name   = MODULE_APP_NAME;
-	ctx_opts.thread_ctx = &sc_thread_ctx;
-
-	rc = sc_context_create(&context, &ctx_opts);
-	if (rc != SC_SUCCESS) {
-		rv = CKR_GENERAL_ERROR;
-		goto out;
-	}
+	if (forked) {
+		sc_log(context, "C_Initialize(): reusing the context after fork()");
+		readers_listed = 1;
+	} else {
+		/* set context options */
+		memset(&ctx_opts, 0, sizeof(sc_context_param_t));
+		ctx_opts.ver        = 0;
+		ctx_opts.app_name   = MODULE_APP_NAME;
+		ctx_opts.thread_ctx = &sc_thread_ctx;
+		ctx_opts.flags      = SC_CTX_FLAG_DEFER_READERS;
+
+		rc = sc_context_create(&context, &ctx_opts);
+		if (rc != SC_SUCCESS) {
+			rv = CKR_GENERAL_ERROR;
+			goto out;
+		}
 
-	/* Load configuration */
-	load_pkcs11_parameters(&sc_pkcs11_conf, context);
+		/* Load configuration */
+		load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
-	/* List of sessions */
-	if (0 != list_init(&sessions)) {
-		rv = CKR_HOST_MEMORY;
-		goto out;
+		/* With lazy_detection the readers are listed by C_GetSlotList() */
+		readers_listed = 0;
+		if (!sc_pkcs11_conf.lazy_detection) {
+			sc_ctx_detect_readers(context);
+			readers_listed = 1;
+		}
 	}
-	list_attributes_seeker(&sessions, session_list_seeker);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_openssl_init();
+#endif
 
-	/* List of slots */
-	if (0 != list_init(&virtual_slots)) {
-		rv = CKR_HOST_MEMORY;
-		goto out;
-	}
-	list_attributes_seeker(&virtual_slots, slot_list_seeker);
+	/* Lists of sessions and slots */
+	memset(&sessions, 0, sizeof sessions);
+	memset(&virtual_slots, 0, sizeof virtual_slots);
 
 	/* Create slots for readers found on initialization, only if in 2.11 mode */
 	for (i=0; i<sc_ctx_get_reader_count(context); i++)
 			initialize_reader(sc_ctx_get_reader(context, i));
 
+	if (sc_pkcs11_conf.token_pool[0]) {
+		rv = create_pool_slot();
+		if (rv != CKR_OK)
+			goto out;
+	}
+
 out:
 	if (context != NULL)
 		sc_log(context, "C_Initialize() = %s", lookup_enum ( RV_T, rv ));
 
 	if (rv != CKR_OK) {
 		if (context != NULL) {
+#ifdef ENABLE_OPENSSL
+			sc_pkcs11_openssl_cleanup();
+#endif
 			sc_release_context(context);
 			context = NULL;
 		}
@@ -295,9 +338,6 @@ out:
 
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
-	int i;
-	void *p;
-	sc_pkcs11_slot_t *slot;
 	CK_RV rv;
 
 	if (pReserved != NULL_PTR)
@@ -308,6 +348,9 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	/* the prefetch thread takes the locks that are destroyed below */
+	slot_prefetch_stop();
+
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -317,21 +360,11 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	/* cancel pending calls */
 	in_finalize = 1;
 	sc_cancel(context);
-	/* remove all cards from readers */
-	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
-		card_removed(sc_ctx_get_reader(context, i));
-
-	while ((p = list_fetch(&sessions)))
-		free(p);
-	list_destroy(&sessions);
-
-	while ((slot = list_fetch(&virtual_slots))) {
-		list_destroy(&slot->objects);
-		list_destroy(&slot->logins);
-		free(slot);
-	}
-	list_destroy(&virtual_slots);
+	release_slots();
 
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_openssl_cleanup();
+#endif
 	sc_release_context(context);
 	context = NULL;
 
@@ -379,6 +412,142 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 	return CKR_OK;
 }
 
+/* Statistics of the slot lock and the calls are updated under the lock of
+ * the slot only, so with per_slot_locking they may be read in the middle of
+ * an update */
+static void get_slot_statistics(struct sc_pkcs11_slot *slot, CK_OPENSC_SLOT_STATISTICS_PTR st)
+{
+	const struct sc_apdu_stats *apdu;
+	unsigned int ins;
+
+	memset(st, 0, sizeof *st);
+	st->slotID = slot->id;
+	st->ulCalls = slot->stats.calls;
+	st->ullCallTime = slot->stats.call_time;
+	st->ullCallTimeMax = slot->stats.call_time_max;
+	st->ulLockWaits = slot->stats.lock_waits;
+	st->ullLockWaitTime = slot->stats.lock_wait_time;
+	st->ulBinds = slot->stats.binds;
+	st->ullBindTime = slot->stats.bind_time;
+
+	if (slot->reader == NULL)
+		return;
+	for (ins = 0; ins < 256; ins++) {
+		apdu = sc_get_apdu_stats(slot->reader, ins);
+		if (apdu == NULL)
+			break;
+		st->ulApdus += apdu->count;
+		st->ulApduErrors += apdu->errors;
+		st->ullApduTime += apdu->time_us;
+	}
+}
+
+static CK_RV C_OpenSC_GetStatistics(CK_OPENSC_STATISTICS_PTR pStatistics)
+{
+	struct sc_cache_stats cache;
+	unsigned int i;
+	size_t idx;
+	CK_RV rv;
+
+	if (pStatistics == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	/* includes the acquisition for this call */
+	pStatistics->ulLocks = global_lock_count;
+	pStatistics->ullLockWaitTime = global_lock_wait_time;
+	pStatistics->ullLockWaitTimeMax = global_lock_wait_max;
+
+	pStatistics->ulCacheHits = 0;
+	pStatistics->ulCacheMisses = 0;
+	pStatistics->ulCacheEvictions = 0;
+	pStatistics->ulCacheSize = 0;
+	for (idx = 0; sc_get_cache_stats(context, idx, &cache) == SC_SUCCESS; idx++) {
+		pStatistics->ulCacheHits += cache.hits;
+		pStatistics->ulCacheMisses += cache.misses;
+		pStatistics->ulCacheEvictions += cache.evictions;
+		pStatistics->ulCacheSize += cache.size;
+	}
+
+	if (pStatistics->pSlots != NULL_PTR) {
+		if (pStatistics->ulSlotCount < virtual_slots.count) {
+			rv = CKR_BUFFER_TOO_SMALL;
+		} else {
+			for (i = 0; i < virtual_slots.count; i++)
+				get_slot_statistics((struct sc_pkcs11_slot *) virtual_slots.items[i],
+						&pStatistics->pSlots[i]);
+		}
+	}
+	pStatistics->ulSlotCount = virtual_slots.count;
+
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+static CK_OPENSC_FUNCTION_LIST opensc_function_list = {
+	{ 1, 0 },
+	C_OpenSC_GetStatistics
+};
+
+/* The 3.0 interface comes first, it is the default of C_GetInterface() */
+static CK_INTERFACE interfaces[] = {
+	{ (CK_UTF8CHAR_PTR) "PKCS 11", &pkcs11_function_list_3_0, 0 },
+	{ (CK_UTF8CHAR_PTR) "PKCS 11", &pkcs11_function_list, 0 },
+	{ (CK_UTF8CHAR_PTR) CK_OPENSC_INTERFACE_NAME, &opensc_function_list, 0 }
+};
+#define NUM_INTERFACES	(sizeof(interfaces) / sizeof(interfaces[0]))
+
+CK_RV C_GetInterfaceList(CK_INTERFACE_PTR pInterfacesList, /* receives the interfaces */
+			 CK_ULONG_PTR pulCount)            /* receives the number of interfaces */
+{
+	if (pulCount == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	if (pInterfacesList == NULL_PTR) {
+		*pulCount = NUM_INTERFACES;
+		return CKR_OK;
+	}
+	if (*pulCount < NUM_INTERFACES) {
+		*pulCount = NUM_INTERFACES;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(pInterfacesList, interfaces, sizeof(interfaces));
+	*pulCount = NUM_INTERFACES;
+	return CKR_OK;
+}
+
+CK_RV C_GetInterface(CK_UTF8CHAR_PTR pInterfaceName, /* name of the interface, NULL for any */
+		     CK_VERSION_PTR pVersion,        /* version of the interface, NULL for any */
+		     CK_INTERFACE_PTR_PTR ppInterface, /* receives the interface */
+		     CK_FLAGS flags)                 /* flags the interface must have */
+{
+	unsigned int i;
+
+	if (ppInterface == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	for (i = 0; i < NUM_INTERFACES; i++) {
+		/* Every function list starts with its version */
+		CK_VERSION_PTR version = (CK_VERSION_PTR) interfaces[i].pFunctionList;
+
+		if (pInterfaceName != NULL_PTR
+				&& strcmp((char *) pInterfaceName, (char *) interfaces[i].pInterfaceName))
+			continue;
+		if (pVersion != NULL_PTR
+				&& (pVersion->major != version->major || pVersion->minor != version->minor))
+			continue;
+		if ((interfaces[i].flags & flags) != flags)
+			continue;
+		*ppInterface = &interfaces[i];
+		return CKR_OK;
+	}
+	return CKR_ARGUMENTS_BAD;
+}
+
 CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token present */
 		    CK_SLOT_ID_PTR pSlotList,     /* receives the array of slot IDs */
 		    CK_ULONG_PTR   pulCount)      /* receives the number of slots */
@@ -401,12 +570,14 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 			pSlotList==NULL_PTR? "plug-n-play":"refresh");
 
 	/* Slot list can only change in v2.20 */
-	if (pSlotList == NULL_PTR)
+	if (pSlotList == NULL_PTR || !readers_listed) {
 		sc_ctx_detect_readers(context);
+		readers_listed = 1;
+	}
 
 	card_detect_all();
 
-	found = calloc(list_size(&virtual_slots), sizeof(CK_SLOT_ID));
+	found = calloc(virtual_slots.count, sizeof(CK_SLOT_ID));
 
 	if (found == NULL) {
 		rv = CKR_HOST_MEMORY;
@@ -415,8 +586,8 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 
 	prev_reader = NULL;
 	numMatches = 0;
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	for (i=0; i<virtual_slots.count; i++) {
+		slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
 		/* the list of available slots contains:
 		 * - if present, virtual hotplug slot;
 		 * - any slot with token;
@@ -523,7 +694,7 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 			now = get_current_time();
 			if (now >= slot->slot_state_expires || now == 0) {
 				/* Update slot status */
-				rv = card_detect(slot->reader);
+				rv = card_detect_deferred(slot->reader);
 				sc_log(context, "C_GetSlotInfo() card detect rv 0x%lX", rv);
 
 				if (rv == CKR_TOKEN_NOT_RECOGNIZED || rv == CKR_OK)
@@ -612,6 +783,12 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		goto out;
 	}
 
+	/* The members of a token pool are initialized through their own slot */
+	if (slot->id != slotID) {
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+		goto out;
+	}
+
 	if (!slot->p11card || !slot->p11card->framework
 		   || !slot->p11card->framework->init_token) {
 		sc_log(context, "C_InitToken() not supported by framework");
@@ -620,9 +797,9 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	}
 
 	/* Make sure there's no open session for this token */
-	for (i=0; i<list_size(&sessions); i++) {
-		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
-		if (session->slot == slot) {
+	for (i=0; i<sessions.count; i++) {
+		session = (struct sc_pkcs11_session*)sessions.items[i];
+		if (session && session->slot == slot) {
 			rv = CKR_SESSION_EXISTS;
 			goto out;
 		}
@@ -730,6 +907,10 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if (global_lock)
 		return CKR_OK;
 
+	global_lock_count = 0;
+	global_lock_wait_time = 0;
+	global_lock_wait_max = 0;
+
 	/* No CK_C_INITIALIZE_ARGS pointer, no locking */
 	if (!args)
 		return CKR_OK;
@@ -774,14 +955,22 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 
 CK_RV sc_pkcs11_lock(void)
 {
+	sc_timestamp_t start, wait;
+
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
 	if (!global_lock)
 		return CKR_OK;
 	if (global_locking)  {
+		start = sc_pkcs11_clock_us();
 		while (global_locking->LockMutex(global_lock) != CKR_OK)
 			;
+		wait = sc_pkcs11_clock_us() - start;
+		global_lock_count++;
+		global_lock_wait_time += wait;
+		if (wait > global_lock_wait_max)
+			global_lock_wait_max = wait;
 	}
 
 	return CKR_OK;
@@ -803,6 +992,12 @@ void sc_pkcs11_unlock(void)
 	__sc_pkcs11_unlock(global_lock);
 }
 
+/* Whether the application asked for locking in C_Initialize() */
+int sc_pkcs11_lock_enabled(void)
+{
+	return global_lock != NULL;
+}
+
 /*
  * Free the lock - note the lock must be held when
  * you come here
@@ -828,6 +1023,438 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Per-slot locking
+ *
+ * With `per_slot_locking` enabled the global lock only protects the
+ * session and slot lists. An entry point locates its session or slot under
+ * the global lock and then switches over to the lock of the slot with
+ * sc_pkcs11_lock_slot(), so that card operations on independent readers can
+ * run in parallel. Lock order is always global lock first, slot lock second.
+ */
+
+
+#if defined(PKCS11_THREAD_LOCKING) && defined(HAVE_PTHREAD)
+/*
+ * With the locking of the operating system, the lock of a slot is a queue
+ * rather than a plain mutex. A caller takes its ticket under the global lock
+ * and waits for its turn without it, so that it does not hold up the callers
+ * of the other slots. The callers of a slot are served in the order they
+ * came, the interactive calls like C_Login or C_GetTokenInfo before the
+ * cryptographic operations waiting in the queue. Draining a slot waits for
+ * all the callers that are already queued.
+ */
+#define HAVE_SLOT_QUEUE
+
+enum {
+	SLOT_QUEUE_INTERACTIVE = 0,
+	SLOT_QUEUE_BULK,
+	SLOT_QUEUE_CLASSES
+};
+
+struct slot_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int busy;
+	/* next ticket to serve and next ticket to hand out, per class */
+	unsigned long head[SLOT_QUEUE_CLASSES];
+	unsigned long tail[SLOT_QUEUE_CLASSES];
+};
+
+static int slot_queue_used(void)
+{
+	return global_locking == &_def_locks;
+}
+
+static CK_RV slot_queue_create(void **lock)
+{
+	struct slot_queue *queue = calloc(1, sizeof *queue);
+
+	if (queue == NULL)
+		return CKR_HOST_MEMORY;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+	*lock = queue;
+	return CKR_OK;
+}
+
+static void slot_queue_destroy(void *lock)
+{
+	struct slot_queue *queue = lock;
+
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue);
+}
+
+/* Called with the global lock held */
+static unsigned long slot_queue_enter(void *lock, int cls)
+{
+	struct slot_queue *queue = lock;
+	unsigned long ticket;
+
+	pthread_mutex_lock(&queue->mutex);
+	ticket = queue->tail[cls]++;
+	pthread_mutex_unlock(&queue->mutex);
+	return ticket;
+}
+
+static void slot_queue_wait(void *lock, int cls, unsigned long ticket)
+{
+	struct slot_queue *queue = lock;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->busy || queue->head[cls] != ticket
+			|| (cls == SLOT_QUEUE_BULK
+				&& queue->head[SLOT_QUEUE_INTERACTIVE] != queue->tail[SLOT_QUEUE_INTERACTIVE]))
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	queue->busy = 1;
+	queue->head[cls]++;
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/* Called with the global lock held, so that no ticket is handed out
+ * while waiting for the queue to become empty */
+static void slot_queue_drain(void *lock)
+{
+	struct slot_queue *queue = lock;
+	int i, waiting;
+
+	pthread_mutex_lock(&queue->mutex);
+	do {
+		waiting = queue->busy;
+		for (i = 0; i < SLOT_QUEUE_CLASSES; i++)
+			waiting |= queue->head[i] != queue->tail[i];
+		if (waiting)
+			pthread_cond_wait(&queue->cond, &queue->mutex);
+	} while (waiting);
+	queue->busy = 1;
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+static void slot_queue_leave(void *lock)
+{
+	struct slot_queue *queue = lock;
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->busy = 0;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+}
+#endif
+
+static CK_RV slot_lock_create(void **lock)
+{
+#ifdef HAVE_SLOT_QUEUE
+	if (slot_queue_used())
+		return slot_queue_create(lock);
+#endif
+	return global_locking->CreateMutex(lock);
+}
+
+static void slot_lock_release(void *lock)
+{
+#ifdef HAVE_SLOT_QUEUE
+	if (slot_queue_used()) {
+		slot_queue_leave(lock);
+		return;
+	}
+#endif
+	__sc_pkcs11_unlock(lock);
+}
+
+CK_RV sc_pkcs11_create_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	if (!slot || slot->lock || !global_lock || !global_locking
+			|| !sc_pkcs11_conf.per_slot_locking)
+		return CKR_OK;
+
+	return slot_lock_create(&slot->lock);
+}
+
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	if (!slot || !slot->lock)
+		return;
+
+#ifdef HAVE_SLOT_QUEUE
+	if (slot_queue_used())
+		slot_queue_destroy(slot->lock);
+	else
+#endif
+	if (global_locking)
+		global_locking->DestroyMutex(slot->lock);
+	slot->lock = NULL;
+}
+
+/* All virtual slots of a reader share the card handle and the framework
+ * data, so they are serialized by the lock of the first slot of the reader.
+ * Must be called with the global lock held. */
+static void *slot_reader_lock(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	if (slot->reader == NULL)
+		return slot->lock;
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *tmp = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+		if (tmp->reader == slot->reader && tmp->lock)
+			return tmp->lock;
+	}
+	return slot->lock;
+}
+
+/*
+ * Give the reader of the slot its own lock even without `per_slot_locking`,
+ * for operations that keep the card busy for seconds, like on-card key
+ * generation, so that they do not block the whole module. The reader is
+ * handled as with per-slot locking from then on. Called with the global
+ * lock held.
+ */
+CK_RV sc_pkcs11_require_slot_lock(struct sc_pkcs11_slot *slot)
+{
+	if (!slot || !global_lock || !global_locking || slot_reader_lock(slot))
+		return CKR_OK;
+
+	return slot_lock_create(&slot->lock);
+}
+
+/*
+ * The slot the thread has taken with sc_pkcs11_lock_slot() and since when,
+ * so that sc_pkcs11_unlock_slot(), which only gets the lock, can count the
+ * call in the statistics of the slot. A thread takes one slot at a time.
+ */
+#if defined(_MSC_VER)
+#define SC_PKCS11_THREAD_LOCAL __declspec(thread)
+#else
+#define SC_PKCS11_THREAD_LOCAL __thread
+#endif
+
+static SC_PKCS11_THREAD_LOCAL struct sc_pkcs11_slot *held_slot = NULL;
+static SC_PKCS11_THREAD_LOCAL sc_timestamp_t held_since = 0;
+
+/* Called once the thread holds the slot, which it waited for since
+ * `start` if it is not 0 */
+static void slot_taken(struct sc_pkcs11_slot *slot, sc_timestamp_t start)
+{
+	sc_timestamp_t now = sc_pkcs11_clock_us();
+
+	if (start) {
+		slot->stats.lock_waits++;
+		slot->stats.lock_wait_time += now - start;
+	}
+	held_slot = slot;
+	held_since = now;
+}
+
+/* Called before the thread gives the slot back */
+static void slot_given_back(void)
+{
+	struct sc_pkcs11_slot *slot = held_slot;
+	sc_timestamp_t held;
+
+	if (slot == NULL)
+		return;
+	held = sc_pkcs11_clock_us() - held_since;
+	slot->stats.calls++;
+	slot->stats.call_time += held;
+	if (held > slot->stats.call_time_max)
+		slot->stats.call_time_max = held;
+	held_slot = NULL;
+}
+
+static CK_RV lock_slot(struct sc_pkcs11_slot *slot, void **lock, int bulk)
+{
+	void *slot_lock;
+	sc_timestamp_t start;
+
+	if (lock == NULL)
+		return CKR_ARGUMENTS_BAD;
+	*lock = NULL;
+
+	if (!slot)
+		return CKR_OK;
+
+	slot_lock = NULL;
+	if (global_lock && global_locking)
+		slot_lock = slot_reader_lock(slot);
+	if (!slot_lock) {
+		/* the global lock is kept */
+		slot_taken(slot, 0);
+		return CKR_OK;
+	}
+
+	start = sc_pkcs11_clock_us();
+#ifdef HAVE_SLOT_QUEUE
+	if (slot_queue_used()) {
+		int cls = bulk ? SLOT_QUEUE_BULK : SLOT_QUEUE_INTERACTIVE;
+		unsigned long ticket = slot_queue_enter(slot_lock, cls);
+
+		*lock = slot_lock;
+		__sc_pkcs11_unlock(global_lock);
+		slot_queue_wait(slot_lock, cls, ticket);
+		slot_taken(slot, start);
+		return CKR_OK;
+	}
+#endif
+	while (global_locking->LockMutex(slot_lock) != CKR_OK)
+		;
+	*lock = slot_lock;
+	__sc_pkcs11_unlock(global_lock);
+	slot_taken(slot, start);
+
+	return CKR_OK;
+}
+
+/*
+ * Called with the global lock held. If per-slot locking is in use, acquire
+ * the lock of the slot and release the global lock. `*lock` receives the
+ * lock to pass to sc_pkcs11_unlock_slot(); it is NULL if the global lock is
+ * still held.
+ */
+CK_RV sc_pkcs11_lock_slot(struct sc_pkcs11_slot *slot, void **lock)
+{
+	return lock_slot(slot, lock, 0);
+}
+
+/* The same for the cryptographic operations, which yield to the
+ * interactive calls waiting for the slot */
+CK_RV sc_pkcs11_lock_slot_bulk(struct sc_pkcs11_slot *slot, void **lock)
+{
+	return lock_slot(slot, lock, 1);
+}
+
+/*
+ * Called with the global lock held before a slot is modified or torn down.
+ * Waits for the operations running under the slot lock to finish and keeps
+ * both locks; the returned lock has to be released with
+ * sc_pkcs11_undrain_slot(), which leaves the global lock held.
+ */
+void *sc_pkcs11_drain_slot(struct sc_pkcs11_slot *slot)
+{
+	void *slot_lock;
+
+	if (!slot || !global_lock || !global_locking)
+		return NULL;
+
+	slot_lock = slot_reader_lock(slot);
+	if (slot_lock) {
+#ifdef HAVE_SLOT_QUEUE
+		if (slot_queue_used()) {
+			slot_queue_drain(slot_lock);
+			return slot_lock;
+		}
+#endif
+		while (global_locking->LockMutex(slot_lock) != CKR_OK)
+			;
+	}
+
+	return slot_lock;
+}
+
+void sc_pkcs11_undrain_slot(void *lock)
+{
+	if (lock)
+		slot_lock_release(lock);
+}
+
+void sc_pkcs11_unlock_slot(void *lock)
+{
+	slot_given_back();
+	if (lock)
+		slot_lock_release(lock);
+	else
+		sc_pkcs11_unlock();
+}
+
+/*
+ * Per-session locking
+ *
+ * With `per_slot_locking` the multi-part updates which only work on the
+ * state of the session, like hashing the data of C_SignUpdate, hold the
+ * lock of the session instead of the lock of the slot, so that they run
+ * while the card is busy with the requests of other sessions. The calls
+ * which start, finish or close the operation take the lock of the session
+ * as well. Lock order is global lock, session lock, slot lock.
+ */
+CK_RV sc_pkcs11_create_session_lock(struct sc_pkcs11_session *session)
+{
+	if (!session || session->lock || !global_lock || !global_locking
+			|| !sc_pkcs11_conf.per_slot_locking)
+		return CKR_OK;
+
+	return global_locking->CreateMutex(&session->lock);
+}
+
+void sc_pkcs11_free_session_lock(struct sc_pkcs11_session *session)
+{
+	if (!session || !session->lock)
+		return;
+
+	if (global_locking)
+		global_locking->DestroyMutex(session->lock);
+	session->lock = NULL;
+}
+
+/*
+ * Called with the global lock held, which is kept. Waits for the update
+ * running on the session; the operations of the session can not be used
+ * by other calls until sc_pkcs11_unlock_session() is called.
+ */
+void sc_pkcs11_lock_session(struct sc_pkcs11_session *session)
+{
+	if (!session || !session->lock || !global_locking)
+		return;
+
+	while (global_locking->LockMutex(session->lock) != CKR_OK)
+		;
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	if (session && session->lock)
+		__sc_pkcs11_unlock(session->lock);
+}
+
+/*
+ * A lock for the data that is shared by all slots, needed only when the
+ * calls do not keep the global lock through the operation
+ */
+CK_RV sc_pkcs11_create_mutex(void **mutex)
+{
+	*mutex = NULL;
+	if (!global_lock || !global_locking || !sc_pkcs11_conf.per_slot_locking)
+		return CKR_OK;
+
+	return global_locking->CreateMutex(mutex);
+}
+
+void sc_pkcs11_free_mutex(void **mutex)
+{
+	if (!*mutex)
+		return;
+
+	if (global_locking)
+		global_locking->DestroyMutex(*mutex);
+	*mutex = NULL;
+}
+
+void sc_pkcs11_lock_mutex(void *mutex)
+{
+	if (!mutex || !global_locking)
+		return;
+
+	while (global_locking->LockMutex(mutex) != CKR_OK)
+		;
+}
+
+void sc_pkcs11_unlock_mutex(void *mutex)
+{
+	if (mutex)
+		__sc_pkcs11_unlock(mutex);
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 11 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
@@ -899,3 +1526,99 @@ CK_FUNCTION_LIST pkcs11_function_list = {
 	C_CancelFunction,
 	C_WaitForSlotEvent
 };
+
+CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0 = {
+	{ 3, 0 },
+	C_Initialize,
+	C_Finalize,
+	C_GetInfo,
+	C_GetFunctionList,
+	C_GetSlotList,
+	C_GetSlotInfo,
+	C_GetTokenInfo,
+	C_GetMechanismList,
+	C_GetMechanismInfo,
+	C_InitToken,
+	C_InitPIN,
+	C_SetPIN,
+	C_OpenSession,
+	C_CloseSession,
+	C_CloseAllSessions,
+	C_GetSessionInfo,
+	C_GetOperationState,
+	C_SetOperationState,
+	C_Login,
+	C_Logout,
+	C_CreateObject,
+	C_CopyObject,
+	C_DestroyObject,
+	C_GetObjectSize,
+	C_GetAttributeValue,
+	C_SetAttributeValue,
+	C_FindObjectsInit,
+	C_FindObjects,
+	C_FindObjectsFinal,
+	C_EncryptInit,
+	C_Encrypt,
+	C_EncryptUpdate,
+	C_EncryptFinal,
+	C_DecryptInit,
+	C_Decrypt,
+	C_DecryptUpdate,
+	C_DecryptFinal,
+	C_DigestInit,
+	C_Digest,
+	C_DigestUpdate,
+	C_DigestKey,
+	C_DigestFinal,
+	C_SignInit,
+	C_Sign,
+	C_SignUpdate,
+	C_SignFinal,
+	C_SignRecoverInit,
+	C_SignRecover,
+	C_VerifyInit,
+	C_Verify,
+	C_VerifyUpdate,
+	C_VerifyFinal,
+	C_VerifyRecoverInit,
+	C_VerifyRecover,
+	C_DigestEncryptUpdate,
+	C_DecryptDigestUpdate,
+	C_SignEncryptUpdate,
+	C_DecryptVerifyUpdate,
+	C_GenerateKey,
+	C_GenerateKeyPair,
+	C_WrapKey,
+	C_UnwrapKey,
+	C_DeriveKey,
+	C_SeedRandom,
+	C_GenerateRandom,
+	C_GetFunctionStatus,
+	C_CancelFunction,
+	C_WaitForSlotEvent,
+	C_GetInterfaceList,
+	C_GetInterface,
+	C_LoginUser,
+	C_SessionCancel,
+	C_MessageEncryptInit,
+	C_EncryptMessage,
+	C_EncryptMessageBegin,
+	C_EncryptMessageNext,
+	C_MessageEncryptFinal,
+	C_MessageDecryptInit,
+	C_DecryptMessage,
+	C_DecryptMessageBegin,
+	C_DecryptMessageNext,
+	C_MessageDecryptFinal,
+	C_MessageSignInit,
+	C_SignMessage,
+	C_SignMessageBegin,
+	C_SignMessageNext,
+	C_MessageSignFinal,
+	C_MessageVerifyInit,
+	C_VerifyMessage,
+	C_VerifyMessageBegin,
+	C_VerifyMessageNext,
+	C_MessageVerifyFinal
+};
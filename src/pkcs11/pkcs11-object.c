@@ -44,8 +44,15 @@ static sc_pkcs11_mechanism_type_t find_mechanism = {
 	NULL,		/* verif_init */
 	NULL,		/* verif_update */
 	NULL,		/* verif_final */
+	NULL,		/* verif_recover */
 	NULL,		/* decrypt_init */
 	NULL,		/* decrypt */
+	NULL,		/* decrypt_update */
+	NULL,		/* decrypt_final */
+	NULL,		/* encrypt_init */
+	NULL,		/* encrypt */
+	NULL,		/* encrypt_update */
+	NULL,		/* encrypt_final */
 	NULL,		/* derive */
 	NULL,		/* mech_data */
 	NULL,		/* free_mech_data */
@@ -55,12 +62,80 @@ static void
 sc_find_release(sc_pkcs11_operation_t *operation)
 {
 	struct sc_pkcs11_find_operation *fop = (struct sc_pkcs11_find_operation *)operation;
+	CK_ULONG i;
+
+	sc_log(context,"freeing %lu candidates checked %lu at %p", fop->num_objects, fop->current_object, fop->objects);
+	free(fop->objects);
+	fop->objects = NULL;
+	if (fop->templ) {
+		for (i = 0; i < fop->templ_count; i++)
+			free(fop->templ[i].pValue);
+		free(fop->templ);
+		fop->templ = NULL;
+	}
+}
+
+
+/* Check the next candidate objects of the find operation until `max'
+ * matching ones are found */
+static CK_ULONG
+sc_find_next(struct sc_pkcs11_session *session, struct sc_pkcs11_find_operation *operation,
+		CK_OBJECT_HANDLE_PTR phObject, CK_ULONG max)
+{
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object *object;
+	CK_ULONG found = 0, j;
+	int match;
+
+	while (found < max && operation->current_object < operation->num_objects) {
+		object = operation->objects[operation->current_object++];
+
+		/* Skip the objects destroyed since the search was started */
+		if (operation->generation != slot->index.generation
+				&& sc_pkcs11_array_find(&slot->objects, object) < 0)
+			continue;
+		sc_log(context, "Object with handle 0x%lx", object->handle);
+
+		/* User not logged in and private object? */
+		if (operation->hide_private) {
+			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			        continue;
+			if (is_private) {
+				sc_log(context,
+				       "Object %lu/%lu: Private object and not logged in.",
+				       slot->id, object->handle);
+				continue;
+			}
+		}
+
+		/* Try to match every attribute */
+		match = 1;
+		for (j = 0; j < operation->templ_count; j++) {
+			if (object->ops->cmp_attribute(session, object, &operation->templ[j]) == 0) {
+				sc_log(context,
+				       "Object %lu/%lu: Attribute 0x%lx does NOT match.",
+				       slot->id, object->handle, operation->templ[j].type);
+				match = 0;
+				break;
+			}
+
+			if (context->debug >= 4) {
+				sc_log(context,
+				       "Object %lu/%lu: Attribute 0x%lx matches.",
+				       slot->id, object->handle, operation->templ[j].type);
+			}
+		}
 
-	sc_log(context,"freeing %d handles used %d  at %p", fop->allocated_handles, fop->num_handles, fop->handles);
-	if (fop->handles) {
-		free(fop->handles);
-		fop->handles = NULL;
+		if (match) {
+			sc_log(context, "Object %lu/%lu matches\n", slot->id,
+			       object->handle);
+			phObject[found++] = object->handle;
+		}
 	}
+
+	return found;
 }
 
 
@@ -69,19 +144,45 @@ get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
 		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
 {
 	struct sc_pkcs11_session *sess;
+	unsigned int i;
 	CK_RV rv;
 
 	rv = get_session(hSession, &sess);
 	if (rv != CKR_OK)
 		return rv;
 
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = NULL;
+	for (i = 0; i < sess->slot->objects.count; i++)
+		if (((struct sc_pkcs11_object *) sess->slot->objects.items[i])->handle == hObject) {
+			*object = sess->slot->objects.items[i];
+			break;
+		}
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
 	*session = sess;
 	return CKR_OK;
 }
 
+/* Hand a new object with CKA_TOKEN=FALSE to the session that created it */
+static void
+set_object_session(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject)
+{
+	struct sc_pkcs11_object *object;
+	CK_BBOOL is_token = TRUE;
+	CK_ATTRIBUTE token_attribute = {CKA_TOKEN, &is_token, sizeof(is_token)};
+	unsigned int i;
+
+	for (i = 0; i < session->slot->objects.count; i++) {
+		object = session->slot->objects.items[i];
+		if (object->handle != hObject)
+			continue;
+		if (object->ops->get_attribute(session, object, &token_attribute) == CKR_OK
+				&& is_token == FALSE)
+			object->session = session->handle;
+		break;
+	}
+}
+
 /* C_CreateObject can be called from C_DeriveKey
  * which is holding the sc_pkcs11_lock
  * So dont get the lock again. */
@@ -95,6 +196,7 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
+	void *slot_lock = NULL;
 
 	LOG_FUNC_CALLED(context);
 	if (pTemplate == NULL_PTR || ulCount == 0)
@@ -108,11 +210,12 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
+
+	if (use_lock)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 
 	if (session->slot->token_info.flags & CKF_WRITE_PROTECTED) {
 		rv = CKR_TOKEN_WRITE_PROTECTED;
@@ -124,10 +227,12 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
+	if (rv == CKR_OK && phObject != NULL)
+		set_object_session(session, *phObject);
 
 out:
 	if (use_lock)
-		sc_pkcs11_unlock();
+		sc_pkcs11_unlock_slot(slot_lock);
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -138,7 +243,8 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
-	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1));
 }
 
 
@@ -149,7 +255,8 @@ C_CopyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phNewObject)	/* receives handle of copy */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 
@@ -158,17 +265,21 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_OBJECT_HANDLE hObject)	/* the object's handle */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribute = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
 	rv = get_object_from_session(hSession, hObject, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -190,8 +301,8 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -200,7 +311,8 @@ C_GetObjectSize(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_OBJECT_HANDLE hObject,	/* the object's handle */
 		      CK_ULONG_PTR pulSize)	/* receives size of object */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 
@@ -220,19 +332,23 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	char object_name[64];
 	int j;
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	int res, res_type;
 	unsigned int i;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pTemplate == NULL_PTR || ulCount == 0)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_object_from_session(hSession, hObject, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -268,8 +384,8 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -280,20 +396,24 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount)		/* attributes in template */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	unsigned int i;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pTemplate == NULL_PTR || ulCount == 0)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
 	rv = get_object_from_session(hSession, hObject, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -310,11 +430,12 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		slot_index_update(session->slot, object, pTemplate, ulCount);
 	}
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -324,23 +445,23 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	void *slot_lock = NULL;
+	CK_ULONG i;
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pTemplate == NULL_PTR && ulCount > 0)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -352,77 +473,77 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
-	operation->current_handle = 0;
-	operation->num_handles = 0;
-	operation->allocated_handles = 0;
-	operation->handles = NULL;
 	slot = session->slot;
 
 	/* Check whether we should hide private objects */
-	hide_private = 0;
+	operation->hide_private = 0;
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
-		hide_private = 1;
-
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_log(context,
-				       "Object %lu/%lu: Private object and not logged in.",
-				       slot->id, object->handle);
+		operation->hide_private = 1;
+
+	/* Keep the template, the objects are matched in C_FindObjects */
+	if (ulCount) {
+		operation->templ = calloc(ulCount, sizeof(CK_ATTRIBUTE));
+		if (operation->templ == NULL) {
+			rv = CKR_HOST_MEMORY;
+			goto fail;
+		}
+		for (i = 0; i < ulCount; i++) {
+			operation->templ[i].type = pTemplate[i].type;
+			operation->templ[i].ulValueLen = pTemplate[i].ulValueLen;
+			operation->templ_count++;
+			if (pTemplate[i].pValue == NULL || pTemplate[i].ulValueLen == (CK_ULONG) -1)
 				continue;
+			operation->templ[i].pValue = malloc(pTemplate[i].ulValueLen ? pTemplate[i].ulValueLen : 1);
+			if (operation->templ[i].pValue == NULL) {
+				rv = CKR_HOST_MEMORY;
+				goto fail;
 			}
+			memcpy(operation->templ[i].pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
 		}
+	}
 
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context,
-				       "Object %lu/%lu: Attribute 0x%lx does NOT match.",
-				       slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
+	/* Let the framework create the objects it left out so far */
+	if (slot->p11card && slot->p11card->framework && slot->p11card->framework->load_objects) {
+		CK_OBJECT_CLASS clazz = (CK_OBJECT_CLASS) -1;
 
-			if (context->debug >= 4) {
-				sc_log(context,
-				       "Object %lu/%lu: Attribute 0x%lx matches.",
-				       slot->id, object->handle, pTemplate[j].type);
-			}
-		}
+		for (i = 0; i < ulCount; i++)
+			if (pTemplate[i].type == CKA_CLASS && pTemplate[i].pValue != NULL
+					&& pTemplate[i].ulValueLen == sizeof(CK_OBJECT_CLASS))
+				clazz = *(CK_OBJECT_CLASS *) pTemplate[i].pValue;
+		rv = slot->p11card->framework->load_objects(slot, clazz);
+		if (rv != CKR_OK)
+			goto fail;
+	}
 
-		if (match) {
-			sc_log(context, "Object %lu/%lu matches\n", slot->id,
-			       object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					goto out;
-				}
+	/* Restrict the search to the candidates from the attribute index,
+	 * check all objects of the token if the index can not be used */
+	operation->generation = slot->index.generation;
+	rv = slot_index_find(slot, pTemplate, ulCount, &operation->objects, &operation->num_objects);
+	if (rv == CKR_FUNCTION_NOT_SUPPORTED) {
+		operation->num_objects = slot->objects.count;
+		operation->objects = NULL;
+		if (operation->num_objects) {
+			operation->objects = malloc(operation->num_objects * sizeof(struct sc_pkcs11_object *));
+			if (operation->objects == NULL) {
+				rv = CKR_HOST_MEMORY;
+				goto fail;
 			}
-			operation->handles[operation->num_handles++] = object->handle;
+			memcpy(operation->objects, slot->objects.items,
+					operation->num_objects * sizeof(struct sc_pkcs11_object *));
 		}
+		rv = CKR_OK;
 	}
-	rv = CKR_OK;
+	if (rv != CKR_OK)
+		goto fail;
 
-	sc_log(context, "%d matching objects\n", operation->num_handles);
+	sc_log(context, "%lu candidate objects\n", operation->num_objects);
+	goto out;
 
+fail:
+	session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -433,18 +554,21 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulObjectCount)	/* actual number returned */
 {
 	CK_RV rv;
-	CK_ULONG to_return;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_find_operation *operation;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -452,18 +576,10 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
-	to_return = (CK_ULONG) operation->num_handles - operation->current_handle;
-	if (to_return > ulMaxObjectCount)
-		to_return = ulMaxObjectCount;
-
-	*pulObjectCount = to_return;
+	*pulObjectCount = sc_find_next(session, operation, phObject, ulMaxObjectCount);
 
-	memcpy(phObject, &operation->handles[operation->current_handle], to_return * sizeof(CK_OBJECT_HANDLE));
-
-	operation->current_handle += to_return;
-
-out:	sc_pkcs11_unlock();
-	return rv;
+out:	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -471,13 +587,17 @@ CK_RV
 C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -485,8 +605,8 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
-	return rv;
+out:	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 /*
@@ -498,23 +618,27 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism)	/* the digesting mechanism */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pMechanism == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -526,15 +650,19 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulDigestLen)	/* receives byte length of digest */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	CK_ULONG  ulBuflen = 0;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -558,8 +686,8 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -569,19 +697,23 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulPartLen)		/* bytes of data to be digested */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -589,7 +721,8 @@ CK_RV
 C_DigestKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_OBJECT_HANDLE hKey)	/* handle of secret key to digest */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 
@@ -599,19 +732,23 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulDigestLen)	/* receives byte count of digest */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -624,18 +761,24 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_KEY_TYPE key_type;
 	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
-	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_session *session = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pMechanism == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv == CKR_OK) {
+		sc_pkcs11_lock_session(session);
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	}
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -658,12 +801,16 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		goto out;
 	}
 
-	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
+	if (pMechanism->mechanism == CKM_OPENSC_SIGN_BATCH)
+		rv = sc_pkcs11_sign_batch_init(session, pMechanism, object, key_type);
+	else
+		rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	sc_pkcs11_unlock_session(session);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -675,17 +822,30 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
+	sc_pkcs11_operation_t *operation;
 	CK_ULONG length;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK) {
+		sc_pkcs11_lock_session(session);
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	}
 	if (rv != CKR_OK)
 		goto out;
 
+	if (session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &operation) == CKR_OK
+			&& operation->batch_len) {
+		rv = sc_pkcs11_sign_batch(session, pData, ulDataLen, pSignature, pulSignatureLen);
+		goto out;
+	}
+
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -710,8 +870,9 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	sc_pkcs11_unlock_session(session);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -721,19 +882,33 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulPartLen)		/* count of bytes to be signed */
 {
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK && session->lock) {
+		/* The data is only hashed or buffered on the host, the card is
+		 * not needed before C_SignFinal */
+		sc_pkcs11_lock_session(session);
+		sc_pkcs11_unlock();
+		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+		sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
+		sc_pkcs11_unlock_session(session);
+		SC_PKCS11_RETURN(rv);
+	}
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -745,12 +920,18 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 	CK_RV rv;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK) {
+		sc_pkcs11_lock_session(session);
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	}
 	if (rv != CKR_OK)
 		goto out;
 
@@ -774,8 +955,9 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	sc_pkcs11_unlock_session(session);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -784,7 +966,8 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of the signature key */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 
@@ -795,7 +978,8 @@ C_SignRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pSignature,		/* receives the signature */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 
@@ -804,7 +988,59 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of encryption key */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_BBOOL can_encrypt, can_wrap;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE encrypt_attribute = { CKA_ENCRYPT,	&can_encrypt,	sizeof(can_encrypt) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
+	CK_ATTRIBUTE wrap_attribute = { CKA_WRAP,	&can_wrap,	sizeof(can_wrap) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+	void *slot_lock = NULL;
+
+	if (pMechanism == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	/* The public key is decoded here, which may still need the card */
+	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	rv = object->ops->get_attribute(session, object, &encrypt_attribute);
+	if (rv != CKR_OK || !can_encrypt) {
+		/* Also accept WRAP, like C_DecryptInit accepts UNWRAP */
+		rv = object->ops->get_attribute(session, object, &wrap_attribute);
+		if (rv != CKR_OK || !can_wrap) {
+			rv = CKR_KEY_TYPE_INCONSISTENT;
+			goto out;
+		}
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
+
+out:
+	sc_log(context, "C_EncryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+#endif
 }
 
 
@@ -814,7 +1050,31 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
 		CK_ULONG_PTR pulEncryptedDataLen)
 {				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pulEncryptedDataLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	/* Done in software with the key decoded by C_EncryptInit: the lock
+	 * of the slot is not needed and the card is not involved */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr(session, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+
+	sc_log(context, "C_Encrypt() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	SC_PKCS11_RETURN(rv);
+#endif
 }
 
 CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -823,14 +1083,59 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 		      CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if ((pPart == NULL_PTR && ulPartLen > 0) || pulEncryptedPartLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	/* Only the ciphers run on the host support parts, see C_Encrypt */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr_update(session, pPart, ulPartLen,
+				pEncryptedPart, pulEncryptedPartLen);
+
+	sc_log(context, "C_EncryptUpdate() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	SC_PKCS11_RETURN(rv);
+#endif
 }
 
 CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastEncryptedPart,	/* receives encrypted last part */
 		     CK_ULONG_PTR pulLastEncryptedPartLen)
 {				/* receives byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pulLastEncryptedPartLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr_final(session, pLastEncryptedPart,
+				pulLastEncryptedPartLen);
+
+	sc_log(context, "C_EncryptFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	SC_PKCS11_RETURN(rv);
+#endif
 }
 
 CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -845,26 +1150,25 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pMechanism == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
 		goto out;
 	}
 
-	if (object->ops->decrypt == NULL_PTR) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto out;
-	}
-
 	rv = object->ops->get_attribute(session, object, &decrypt_attribute);
 	if (rv != CKR_OK || !can_decrypt) {
 		/* Also accept UNWRAP - apps call Decrypt when they mean Unwrap */
@@ -884,8 +1188,8 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -895,13 +1199,26 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulDataLen)
 {				/* receives decrypted byte count */
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK && sc_pkcs11_decr_on_host(session)) {
+		/* A session key in memory: like C_Encrypt, the card is not
+		 * involved and the global lock is enough */
+		rv = sc_pkcs11_decr(session, pEncryptedData,
+				ulEncryptedDataLen, pData, pulDataLen);
+		sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
+		sc_pkcs11_unlock();
+		SC_PKCS11_RETURN(rv);
+	}
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK) {
@@ -912,8 +1229,8 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -922,14 +1239,51 @@ CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pPart,	/* receives decrypted output */
 		      CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	if ((pEncryptedPart == NULL_PTR && ulEncryptedPartLen > 0) || pulPartLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	/* Only the ciphers run on the host support parts: like C_Encrypt,
+	 * the card is not involved and the global lock is enough */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_decr_update(session, pEncryptedPart,
+				ulEncryptedPartLen, pPart, pulPartLen);
+
+	sc_log(context, "C_DecryptUpdate() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastPart,	/* receives decrypted output */
 		     CK_ULONG_PTR pulLastPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	if (pulLastPartLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_decr_final(session, pLastPart, pulLastPartLen);
+
+	sc_log(context, "C_DecryptFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -938,7 +1292,8 @@ CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle
 			    CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 			    CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -947,7 +1302,8 @@ CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle
 			    CK_BYTE_PTR pPart,	/* receives decrypted output */
 			    CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -956,7 +1312,8 @@ CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 			  CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -965,7 +1322,8 @@ CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle
 			    CK_BYTE_PTR pPart,	/* receives decrypted output */
 			    CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -974,7 +1332,8 @@ CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    CK_ULONG ulCount,	/* number of attributes in template */
 		    CK_OBJECT_HANDLE_PTR phKey)
 {				/* receives handle of new key */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -987,17 +1346,19 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			CK_OBJECT_HANDLE_PTR phPrivateKey)
 {				/* gets priv. key handle */
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pMechanism == NULL_PTR
 			|| (pPublicKeyTemplate == NULL_PTR && ulPublicKeyAttributeCount > 0)
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
@@ -1006,6 +1367,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	/* the card may take seconds: only hold the lock of its reader */
+	rv = sc_pkcs11_require_slot_lock(session->slot);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	if (rv != CKR_OK)
+		goto out;
+
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -1025,8 +1393,8 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 
@@ -1037,7 +1405,8 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pWrappedKey,	/* receives the wrapped key */
 		CK_ULONG_PTR pulWrappedKeyLen)
 {				/* receives byte size of wrapped key */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1049,7 +1418,8 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		  CK_ULONG ulAttributeCount,	/* # of attributes in template */
 		  CK_OBJECT_HANDLE_PTR phKey)
 {				/* gets handle of recovered key */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1062,22 +1432,27 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 /* TODO: -DEE ECDH with Cofactor  on PIV is an example */
 /* TODO: need to do a lot of checking, will only support ECDH for now.*/
 	CK_RV rv;
+	void *slot_lock = NULL;
 	CK_BBOOL can_derive;
 	CK_KEY_TYPE key_type;
+	CK_ULONG value_len = 0;
 	CK_ATTRIBUTE derive_attribute = { CKA_DERIVE, &can_derive, sizeof(can_derive) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pMechanism == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1117,10 +1492,13 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			goto out;
 		}
 
+		/* Length of the key to derive with a KDF */
+		attr_find(pTemplate, ulAttributeCount, CKA_VALUE_LEN, &value_len, NULL);
+
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_deri(session, pMechanism, object, key_type,
-					hSession, *phKey, key_object);
+					hSession, *phKey, key_object, value_len);
 		/* TODO if (rv != CK_OK) need to destroy the object */
 		rv = reset_login_state(session->slot, rv);
 
@@ -1130,30 +1508,94 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		   CK_BYTE_PTR pSeed,	/* the seed material */
 		   CK_ULONG ulSeedLen)
 {				/* count of bytes of seed material */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+}
+
+#ifdef ENABLE_OPENSSL
+/*
+ * Serve C_GenerateRandom from the host DRBG of the card. Called and
+ * returns with the global lock held. Only the (re)seeding takes the
+ * slot lock to read entropy from the card, so the requests in between
+ * do not wait for the operations running on the slot.
+ */
+static CK_RV drbg_generate_random(CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen)
+{
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card;
+	unsigned char seed[SC_PKCS11_DRBG_SEED_LEN];
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+	p11card = session->slot->p11card;
+	if (p11card == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+	if (p11card->framework->get_random == NULL)
+		return CKR_RANDOM_NO_RNG;
+
+	if (sc_pkcs11_drbg_needs_seed(p11card->drbg, sc_pkcs11_conf.random_reseed_interval)) {
+		sc_log(context, "C_GenerateRandom(): seeding the DRBG from the card");
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+		rv = p11card->framework->get_random(session->slot, seed, sizeof seed);
+		if (slot_lock) {
+			sc_pkcs11_unlock_slot(slot_lock);
+			sc_pkcs11_lock();
+			/* the session or the card may be gone by now */
+			if (rv == CKR_OK)
+				rv = get_session(hSession, &session);
+			if (rv == CKR_OK && session->slot->p11card != p11card)
+				rv = CKR_DEVICE_REMOVED;
+		}
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_drbg_seed(&p11card->drbg, seed, sizeof seed);
+		sc_mem_clear(seed, sizeof seed);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	sc_pkcs11_drbg_generate(p11card->drbg, RandomData, ulRandomLen);
+	return CKR_OK;
 }
+#endif
 
 CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		       CK_BYTE_PTR RandomData,	/* receives the random data */
 		       CK_ULONG ulRandomLen)
 {				/* number of bytes to be generated */
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
+
+#ifdef ENABLE_OPENSSL
+	if (sc_pkcs11_conf.random_drbg) {
+		rv = drbg_generate_random(hSession, RandomData, ulRandomLen);
+		sc_pkcs11_unlock();
+		sc_log(context, "C_GenerateRandom() = %s", lookup_enum ( RV_T, rv ));
+		SC_PKCS11_RETURN(rv);
+	}
+#endif
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK) {
 		slot = session->slot;
 		if (slot->p11card->framework->get_random == NULL)
@@ -1162,43 +1604,49 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = slot->p11card->framework->get_random(slot, RandomData, ulRandomLen);
 	}
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot_lock);
 	sc_log(context, "C_GenerateRandom() = %s", lookup_enum ( RV_T, rv ));
-	return rv;
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
-	return CKR_FUNCTION_NOT_PARALLEL;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_PARALLEL);
 }
 
 CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
-	return CKR_FUNCTION_NOT_PARALLEL;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_PARALLEL);
 }
 
 CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		   CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
 		   CK_OBJECT_HANDLE hKey)
 {				/* handle of the verification key */
+	SC_PKCS11_PROBE_ENTRY(hSession);
 #ifndef ENABLE_OPENSSL
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 #else
 	CK_KEY_TYPE key_type;
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
 	if (pMechanism == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 
 	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1214,8 +1662,8 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 #endif
 }
 
@@ -1225,17 +1673,21 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	       CK_BYTE_PTR pSignature,	/* the signature to be verified */
 	       CK_ULONG ulSignatureLen)
 {				/* count of bytes of signature */
+	SC_PKCS11_PROBE_ENTRY(hSession);
 #ifndef ENABLE_OPENSSL
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 #else
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1249,8 +1701,8 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 #endif
 }
 
@@ -1258,23 +1710,27 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pPart,	/* plaintext data (digest) to compare */
 		     CK_ULONG ulPartLen)
 {				/* length of data (digest) in bytes */
+	SC_PKCS11_PROBE_ENTRY(hSession);
 #ifndef ENABLE_OPENSSL
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 #else
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 #endif
 }
 
@@ -1282,17 +1738,21 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    CK_BYTE_PTR pSignature,	/* the signature to be verified */
 		    CK_ULONG ulSignatureLen)
 {				/* count of bytes of signature */
+	SC_PKCS11_PROBE_ENTRY(hSession);
 #ifndef ENABLE_OPENSSL
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 #else
 	CK_RV rv;
+	void *slot_lock = NULL;
 	struct sc_pkcs11_session *session;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -1301,8 +1761,8 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 #endif
 }
 
@@ -1310,7 +1770,45 @@ CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
 			  CK_OBJECT_HANDLE hKey)
 {				/* handle of the verification key */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+
+	if (pMechanism == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_verif_recover_init(session, pMechanism, object, key_type);
+
+out:
+	sc_log(context, "C_VerifyRecoverInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+#endif
 }
 
 CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1319,7 +1817,30 @@ CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pData,	/* receives decrypted data (digest) */
 		      CK_ULONG_PTR pulDataLen)
 {				/* receives byte count of data */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pSignature == NULL_PTR || pulDataLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	/* Like C_Encrypt, done in software without the lock of the slot */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_verif_recover(session, pSignature, ulSignatureLen,
+				pData, pulDataLen);
+
+	sc_log(context, "C_VerifyRecover() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	SC_PKCS11_RETURN(rv);
+#endif
 }
 
 /*
@@ -1376,3 +1897,618 @@ int sc_pkcs11_any_cmp_attribute(struct sc_pkcs11_session *session, void *ptr, CK
 
 	return res;
 }
+
+/*
+ * Message-based operations of PKCS#11 3.0
+ *
+ * C_Message*Init() checks the key and keeps the mechanism and the key
+ * for the session. Every message then runs a regular operation started
+ * with them, so that it goes through the same paths as C_Sign(),
+ * C_Verify(), C_Encrypt() and C_Decrypt(); the per-message parameters
+ * are not used by any of our mechanisms and are ignored. Only signing
+ * and verification can be done in parts, like the regular operations.
+ */
+static const struct {
+	int op_type;
+	CK_ATTRIBUTE_TYPE usage, alt_usage;
+} message_types[SC_PKCS11_MESSAGE_MAX] = {
+	{ SC_PKCS11_OPERATION_ENCRYPT,	CKA_ENCRYPT,	CKA_WRAP },
+	{ SC_PKCS11_OPERATION_DECRYPT,	CKA_DECRYPT,	CKA_UNWRAP },
+	{ SC_PKCS11_OPERATION_SIGN,	CKA_SIGN,	0 },
+	{ SC_PKCS11_OPERATION_VERIFY,	0,		0 },
+};
+
+/* Start the operation of a message */
+static CK_RV
+message_begin(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session *session, int type)
+{
+	struct sc_pkcs11_message *msg;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+
+	rv = session_get_message(session, type, &msg);
+	if (rv != CKR_OK)
+		return rv;
+	if (msg->active && session->operation[msg->op_type])
+		return CKR_OPERATION_ACTIVE;
+	msg->active = 0;
+
+	/* The key may have been destroyed since C_Message*Init() */
+	rv = get_object_from_session(hSession, msg->key, &session, &object);
+	if (rv != CKR_OK)
+		return CKR_KEY_HANDLE_INVALID;
+
+	switch (type) {
+	case SC_PKCS11_MESSAGE_SIGN:
+		rv = sc_pkcs11_sign_init(session, &msg->mechanism, object, msg->key_type);
+		break;
+	case SC_PKCS11_MESSAGE_DECRYPT:
+		rv = sc_pkcs11_decr_init(session, &msg->mechanism, object, msg->key_type);
+		break;
+#ifdef ENABLE_OPENSSL
+	case SC_PKCS11_MESSAGE_VERIFY:
+		rv = sc_pkcs11_verif_init(session, &msg->mechanism, object, msg->key_type);
+		break;
+	case SC_PKCS11_MESSAGE_ENCRYPT:
+		rv = sc_pkcs11_encr_init(session, &msg->mechanism, object, msg->key_type);
+		break;
+#endif
+	default:
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	}
+	if (rv == CKR_OK)
+		msg->active = 1;
+	return rv;
+}
+
+/* The message begun by C_*MessageBegin(), if its operation still runs */
+static CK_RV
+message_get_active(struct sc_pkcs11_session *session, int type, struct sc_pkcs11_message **msg)
+{
+	CK_RV rv;
+
+	rv = session_get_message(session, type, msg);
+	if (rv != CKR_OK)
+		return rv;
+	if (!(*msg)->active || !session->operation[(*msg)->op_type]) {
+		(*msg)->active = 0;
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+	return CKR_OK;
+}
+
+/* Stop the operation of a message, which may already be stopped */
+static void
+message_end(struct sc_pkcs11_session *session, int type)
+{
+	struct sc_pkcs11_message *msg = session->message[type];
+
+	if (msg == NULL || !msg->active)
+		return;
+	if (session->operation[msg->op_type])
+		session_stop_operation(session, msg->op_type);
+	msg->active = 0;
+}
+
+static CK_RV
+message_init(const char *name, CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey, int type)
+{
+	CK_BBOOL can_do;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE usage_attr = { message_types[type].usage, &can_do, sizeof(can_do) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+	void *slot_lock = NULL;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	if ((type == SC_PKCS11_MESSAGE_SIGN && object->ops->sign == NULL_PTR)
+			|| (type == SC_PKCS11_MESSAGE_DECRYPT && object->ops->decrypt == NULL_PTR)) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+	if (usage_attr.type) {
+		rv = object->ops->get_attribute(session, object, &usage_attr);
+		if ((rv != CKR_OK || !can_do) && message_types[type].alt_usage) {
+			usage_attr.type = message_types[type].alt_usage;
+			rv = object->ops->get_attribute(session, object, &usage_attr);
+		}
+		if (rv != CKR_OK || !can_do) {
+			rv = CKR_KEY_TYPE_INCONSISTENT;
+			goto out;
+		}
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = session_start_message(session, type, message_types[type].op_type,
+			pMechanism, hKey, key_type);
+	if (rv != CKR_OK)
+		goto out;
+
+	/* Check the mechanism and the key now rather than on the first message */
+	rv = message_begin(hSession, session, type);
+	if (rv == CKR_OK)
+		message_end(session, type);
+	else
+		session_stop_message(session, type);
+
+out:
+	sc_log(context, "%s() = %s", name, lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	return rv;
+}
+
+static CK_RV
+message_final(const char *name, CK_SESSION_HANDLE hSession, int type)
+{
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+	void *slot_lock = NULL;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK) {
+		sc_pkcs11_lock_slot_bulk(session->slot, &slot_lock);
+		rv = session_stop_message(session, type);
+	}
+
+	sc_log(context, "%s() = %s", name, lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	return rv;
+}
+
+/* Look up the session of a message call and take the lock of its slot */
+static CK_RV
+message_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session, void **slot_lock)
+{
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, session);
+	if (rv == CKR_OK)
+		sc_pkcs11_lock_slot_bulk((*session)->slot, slot_lock);
+	else
+		sc_pkcs11_unlock();
+	return rv;
+}
+
+CK_RV C_MessageEncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			   CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
+			   CK_OBJECT_HANDLE hKey)
+{				/* handle of encryption key */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	SC_PKCS11_RETURN(message_init("C_MessageEncryptInit", hSession, pMechanism, hKey,
+			SC_PKCS11_MESSAGE_ENCRYPT));
+#endif
+}
+
+CK_RV C_EncryptMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		       CK_VOID_PTR pParameter,	/* message specific parameter */
+		       CK_ULONG ulParameterLen,	/* length of the parameter */
+		       CK_BYTE_PTR pAssociatedData,	/* data to authenticate */
+		       CK_ULONG ulAssociatedDataLen,	/* length of that data */
+		       CK_BYTE_PTR pPlaintext,	/* the plaintext data */
+		       CK_ULONG ulPlaintextLen,	/* bytes of plaintext data */
+		       CK_BYTE_PTR pCiphertext,	/* receives encrypted data */
+		       CK_ULONG_PTR pulCiphertextLen)
+{				/* receives encrypted byte count */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+
+	/* None of our mechanisms authenticates additional data */
+	if (pulCiphertextLen == NULL_PTR || ulAssociatedDataLen > 0)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_begin(hSession, session, SC_PKCS11_MESSAGE_ENCRYPT);
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_encr(session, pPlaintext, ulPlaintextLen,
+				pCiphertext, pulCiphertextLen);
+		message_end(session, SC_PKCS11_MESSAGE_ENCRYPT);
+	}
+
+	sc_log(context, "C_EncryptMessage() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+#endif
+}
+
+CK_RV C_EncryptMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			    CK_VOID_PTR pParameter,	/* message specific parameter */
+			    CK_ULONG ulParameterLen,	/* length of the parameter */
+			    CK_BYTE_PTR pAssociatedData,	/* data to authenticate */
+			    CK_ULONG ulAssociatedDataLen)
+{				/* length of that data */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+}
+
+CK_RV C_EncryptMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			   CK_VOID_PTR pParameter,	/* message specific parameter */
+			   CK_ULONG ulParameterLen,	/* length of the parameter */
+			   CK_BYTE_PTR pPlaintextPart,	/* the plaintext data */
+			   CK_ULONG ulPlaintextPartLen,	/* bytes of plaintext data */
+			   CK_BYTE_PTR pCiphertextPart,	/* receives encrypted data */
+			   CK_ULONG_PTR pulCiphertextPartLen,	/* receives encrypted byte count */
+			   CK_FLAGS flags)
+{				/* CKF_END_OF_MESSAGE for the last part */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+}
+
+CK_RV C_MessageEncryptFinal(CK_SESSION_HANDLE hSession)
+{				/* the session's handle */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(message_final("C_MessageEncryptFinal", hSession, SC_PKCS11_MESSAGE_ENCRYPT));
+}
+
+CK_RV C_MessageDecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			   CK_MECHANISM_PTR pMechanism,	/* the decryption mechanism */
+			   CK_OBJECT_HANDLE hKey)
+{				/* handle of the decryption key */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(message_init("C_MessageDecryptInit", hSession, pMechanism, hKey,
+			SC_PKCS11_MESSAGE_DECRYPT));
+}
+
+CK_RV C_DecryptMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		       CK_VOID_PTR pParameter,	/* message specific parameter */
+		       CK_ULONG ulParameterLen,	/* length of the parameter */
+		       CK_BYTE_PTR pAssociatedData,	/* data to authenticate */
+		       CK_ULONG ulAssociatedDataLen,	/* length of that data */
+		       CK_BYTE_PTR pCiphertext,	/* input encrypted data */
+		       CK_ULONG ulCiphertextLen,	/* count of bytes of input */
+		       CK_BYTE_PTR pPlaintext,	/* receives decrypted output */
+		       CK_ULONG_PTR pulPlaintextLen)
+{				/* receives decrypted byte count */
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	/* None of our mechanisms authenticates additional data */
+	if (pulPlaintextLen == NULL_PTR || ulAssociatedDataLen > 0)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_begin(hSession, session, SC_PKCS11_MESSAGE_DECRYPT);
+	if (rv == CKR_OK) {
+		rv = restore_login_state(session->slot);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_decr(session, pCiphertext, ulCiphertextLen,
+					pPlaintext, pulPlaintextLen);
+		rv = reset_login_state(session->slot, rv);
+		message_end(session, SC_PKCS11_MESSAGE_DECRYPT);
+	}
+
+	sc_log(context, "C_DecryptMessage() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+}
+
+CK_RV C_DecryptMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			    CK_VOID_PTR pParameter,	/* message specific parameter */
+			    CK_ULONG ulParameterLen,	/* length of the parameter */
+			    CK_BYTE_PTR pAssociatedData,	/* data to authenticate */
+			    CK_ULONG ulAssociatedDataLen)
+{				/* length of that data */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+}
+
+CK_RV C_DecryptMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			   CK_VOID_PTR pParameter,	/* message specific parameter */
+			   CK_ULONG ulParameterLen,	/* length of the parameter */
+			   CK_BYTE_PTR pCiphertextPart,	/* input encrypted data */
+			   CK_ULONG ulCiphertextPartLen,	/* count of bytes of input */
+			   CK_BYTE_PTR pPlaintextPart,	/* receives decrypted output */
+			   CK_ULONG_PTR pulPlaintextPartLen,	/* receives decrypted byte count */
+			   CK_FLAGS flags)
+{				/* CKF_END_OF_MESSAGE for the last part */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+}
+
+CK_RV C_MessageDecryptFinal(CK_SESSION_HANDLE hSession)
+{				/* the session's handle */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(message_final("C_MessageDecryptFinal", hSession, SC_PKCS11_MESSAGE_DECRYPT));
+}
+
+CK_RV C_MessageSignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
+			CK_OBJECT_HANDLE hKey)
+{				/* handle of the signature key */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(message_init("C_MessageSignInit", hSession, pMechanism, hKey,
+			SC_PKCS11_MESSAGE_SIGN));
+}
+
+/* The last part of a message to sign, or the whole of it */
+static CK_RV
+message_sign_final(struct sc_pkcs11_session *session, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	CK_ULONG length;
+	CK_RV rv;
+
+	/* Like C_Sign(): asking for the size keeps the message going */
+	rv = sc_pkcs11_sign_size(session, &length);
+	if (rv != CKR_OK)
+		return rv;
+	if (pSignature == NULL || length > *pulSignatureLen) {
+		*pulSignatureLen = length;
+		return pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+	}
+
+	rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
+	if (rv == CKR_OK) {
+		rv = restore_login_state(session->slot);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
+		rv = reset_login_state(session->slot, rv);
+	}
+	message_end(session, SC_PKCS11_MESSAGE_SIGN);
+	return rv;
+}
+
+CK_RV C_SignMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		    CK_VOID_PTR pParameter,	/* message specific parameter */
+		    CK_ULONG ulParameterLen,	/* length of the parameter */
+		    CK_BYTE_PTR pData,	/* the data to be signed */
+		    CK_ULONG ulDataLen,	/* count of bytes to be signed */
+		    CK_BYTE_PTR pSignature,	/* receives the signature */
+		    CK_ULONG_PTR pulSignatureLen)
+{				/* receives byte count of signature */
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	if (pulSignatureLen == NULL_PTR)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_begin(hSession, session, SC_PKCS11_MESSAGE_SIGN);
+	if (rv == CKR_OK) {
+		rv = message_sign_final(session, pData, ulDataLen, pSignature, pulSignatureLen);
+		message_end(session, SC_PKCS11_MESSAGE_SIGN);
+	}
+
+	sc_log(context, "C_SignMessage() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+}
+
+CK_RV C_SignMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			 CK_VOID_PTR pParameter,	/* message specific parameter */
+			 CK_ULONG ulParameterLen)
+{				/* length of the parameter */
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_begin(hSession, session, SC_PKCS11_MESSAGE_SIGN);
+
+	sc_log(context, "C_SignMessageBegin() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+}
+
+CK_RV C_SignMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			CK_VOID_PTR pParameter,	/* message specific parameter */
+			CK_ULONG ulParameterLen,	/* length of the parameter */
+			CK_BYTE_PTR pDataPart,	/* the data to be signed */
+			CK_ULONG ulDataPartLen,	/* count of bytes to be signed */
+			CK_BYTE_PTR pSignature,	/* receives the signature */
+			CK_ULONG_PTR pulSignatureLen)
+{				/* NULL if more parts follow */
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_message *msg;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_get_active(session, SC_PKCS11_MESSAGE_SIGN, &msg);
+	if (rv == CKR_OK && pulSignatureLen == NULL_PTR) {
+		rv = sc_pkcs11_sign_update(session, pDataPart, ulDataPartLen);
+		if (rv != CKR_OK)
+			message_end(session, SC_PKCS11_MESSAGE_SIGN);
+	} else if (rv == CKR_OK) {
+		rv = message_sign_final(session, pDataPart, ulDataPartLen,
+				pSignature, pulSignatureLen);
+	}
+
+	sc_log(context, "C_SignMessageNext() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+}
+
+CK_RV C_MessageSignFinal(CK_SESSION_HANDLE hSession)
+{				/* the session's handle */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(message_final("C_MessageSignFinal", hSession, SC_PKCS11_MESSAGE_SIGN));
+}
+
+CK_RV C_MessageVerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			  CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
+			  CK_OBJECT_HANDLE hKey)
+{				/* handle of the verification key */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	SC_PKCS11_RETURN(message_init("C_MessageVerifyInit", hSession, pMechanism, hKey,
+			SC_PKCS11_MESSAGE_VERIFY));
+#endif
+}
+
+#ifdef ENABLE_OPENSSL
+/* The last part of a message to verify, or the whole of it */
+static CK_RV
+message_verify_final(struct sc_pkcs11_session *session, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	CK_RV rv;
+
+	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
+	if (rv == CKR_OK) {
+		rv = restore_login_state(session->slot);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+		rv = reset_login_state(session->slot, rv);
+	}
+	message_end(session, SC_PKCS11_MESSAGE_VERIFY);
+	return rv;
+}
+#endif
+
+CK_RV C_VerifyMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		      CK_VOID_PTR pParameter,	/* message specific parameter */
+		      CK_ULONG ulParameterLen,	/* length of the parameter */
+		      CK_BYTE_PTR pData,	/* plaintext data to compare */
+		      CK_ULONG ulDataLen,	/* length of data in bytes */
+		      CK_BYTE_PTR pSignature,	/* the signature to be verified */
+		      CK_ULONG ulSignatureLen)
+{				/* count of bytes of signature */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_begin(hSession, session, SC_PKCS11_MESSAGE_VERIFY);
+	if (rv == CKR_OK)
+		rv = message_verify_final(session, pData, ulDataLen, pSignature, ulSignatureLen);
+
+	sc_log(context, "C_VerifyMessage() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+#endif
+}
+
+CK_RV C_VerifyMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			   CK_VOID_PTR pParameter,	/* message specific parameter */
+			   CK_ULONG ulParameterLen)
+{				/* length of the parameter */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_begin(hSession, session, SC_PKCS11_MESSAGE_VERIFY);
+
+	sc_log(context, "C_VerifyMessageBegin() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+#endif
+}
+
+CK_RV C_VerifyMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+			  CK_VOID_PTR pParameter,	/* message specific parameter */
+			  CK_ULONG ulParameterLen,	/* length of the parameter */
+			  CK_BYTE_PTR pDataPart,	/* plaintext data to compare */
+			  CK_ULONG ulDataPartLen,	/* length of data in bytes */
+			  CK_BYTE_PTR pSignature,	/* NULL if more parts follow */
+			  CK_ULONG ulSignatureLen)
+{				/* count of bytes of signature */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+#ifndef ENABLE_OPENSSL
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+#else
+	CK_RV rv;
+	void *slot_lock = NULL;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_message *msg;
+
+	rv = message_session(hSession, &session, &slot_lock);
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = message_get_active(session, SC_PKCS11_MESSAGE_VERIFY, &msg);
+	if (rv == CKR_OK && pSignature == NULL_PTR) {
+		rv = sc_pkcs11_verif_update(session, pDataPart, ulDataPartLen);
+		if (rv != CKR_OK)
+			message_end(session, SC_PKCS11_MESSAGE_VERIFY);
+	} else if (rv == CKR_OK) {
+		rv = message_verify_final(session, pDataPart, ulDataPartLen,
+				pSignature, ulSignatureLen);
+	}
+
+	sc_log(context, "C_VerifyMessageNext() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+#endif
+}
+
+CK_RV C_MessageVerifyFinal(CK_SESSION_HANDLE hSession)
+{				/* the session's handle */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(message_final("C_MessageVerifyFinal", hSession, SC_PKCS11_MESSAGE_VERIFY));
+}
@@ -20,4 +20,76 @@
 
 #define CKA_SPKI			(CKA_VENDOR_DEFINED | SC_VENDOR_DEFINED | 2UL)
 
+/*
+ * Batch signature. After C_SignInit() with this mechanism, C_Sign() takes
+ * the concatenation of inputs of ulItemLen bytes each, signs every one of
+ * them with the mechanism in the parameters and returns the signatures one
+ * after the other, each one as long as the signature of a single input.
+ * The token is kept locked for the whole batch, so that the card gets its
+ * security environment once. C_SignUpdate() and C_SignFinal() are not
+ * supported with it.
+ */
+#define CKM_OPENSC_SIGN_BATCH		(CKM_VENDOR_DEFINED | SC_VENDOR_DEFINED | 1UL)
+
+typedef struct CK_OPENSC_SIGN_BATCH_PARAMS {
+	CK_MECHANISM mechanism;		/* signature mechanism of every input */
+	CK_ULONG ulItemLen;		/* length of every input */
+} CK_OPENSC_SIGN_BATCH_PARAMS;
+
+/*
+ * Statistics of the running module, for monitoring. They are offered by
+ * the interface "Vendor OpenSC" of C_GetInterface(), whose function list
+ * is CK_OPENSC_FUNCTION_LIST. Unless noted otherwise the counters only
+ * grow until C_Finalize(); the times are in microseconds.
+ */
+#define CK_OPENSC_INTERFACE_NAME	"Vendor OpenSC"
+
+typedef struct CK_OPENSC_SLOT_STATISTICS {
+	CK_SLOT_ID slotID;
+	/* calls which used the card of the slot, and the time they held it */
+	CK_ULONG ulCalls;
+	unsigned long long ullCallTime;
+	unsigned long long ullCallTimeMax;
+	/* waits for the lock of the slot (only with per_slot_locking) */
+	CK_ULONG ulLockWaits;
+	unsigned long long ullLockWaitTime;
+	/* connections and binds of the cards inserted into the reader */
+	CK_ULONG ulBinds;
+	unsigned long long ullBindTime;
+	/* APDUs sent through the reader, if apdu_statistics is enabled */
+	CK_ULONG ulApdus;
+	CK_ULONG ulApduErrors;
+	unsigned long long ullApduTime;
+} CK_OPENSC_SLOT_STATISTICS;
+
+typedef CK_OPENSC_SLOT_STATISTICS *CK_OPENSC_SLOT_STATISTICS_PTR;
+
+typedef struct CK_OPENSC_STATISTICS {
+	/* acquisitions of the global lock and the time spent waiting for it */
+	CK_ULONG ulLocks;
+	unsigned long long ullLockWaitTime;
+	unsigned long long ullLockWaitTimeMax;
+	/* caches of the card drivers of the cards present, see
+	 * memory_cache_size; ulCacheSize is in bytes */
+	CK_ULONG ulCacheHits;
+	CK_ULONG ulCacheMisses;
+	CK_ULONG ulCacheEvictions;
+	CK_ULONG ulCacheSize;
+	/* on input the number of entries of pSlots, on output the number of
+	 * slots; with pSlots NULL_PTR the slots are only counted */
+	CK_ULONG ulSlotCount;
+	CK_OPENSC_SLOT_STATISTICS_PTR pSlots;
+} CK_OPENSC_STATISTICS;
+
+typedef CK_OPENSC_STATISTICS *CK_OPENSC_STATISTICS_PTR;
+
+typedef struct CK_OPENSC_FUNCTION_LIST {
+	CK_VERSION version;
+	/* Returns CKR_BUFFER_TOO_SMALL, and the number of slots, if
+	 * pSlots has fewer entries than there are slots */
+	CK_RV (*C_OpenSC_GetStatistics)(CK_OPENSC_STATISTICS_PTR pStatistics);
+} CK_OPENSC_FUNCTION_LIST;
+
+typedef CK_OPENSC_FUNCTION_LIST *CK_OPENSC_FUNCTION_LIST_PTR;
+
 #endif
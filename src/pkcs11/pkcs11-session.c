@@ -27,9 +27,33 @@
 
 #include "sc-pkcs11.h"
 
+/*
+ * A session handle is the position of the session in `sessions' plus one,
+ * the upper bits hold the generation of that position, which changes each
+ * time the position is reused, so that the handle of a closed session is
+ * not valid for a later session at the same position.
+ */
+#define SESSION_INDEX_BITS	16
+#define SESSION_INDEX_MASK	((1UL << SESSION_INDEX_BITS) - 1)
+#define SESSION_NO_FREE		((unsigned int) -1)
+
+struct session_entry {
+	unsigned long generation;
+	unsigned int next_free;		/* Next closed position, if this one is closed */
+};
+
+/* One entry for each allocated item of `sessions' */
+static struct session_entry *session_entries = NULL;
+static unsigned int session_free = SESSION_NO_FREE;
+
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	CK_SESSION_HANDLE i = (hSession & SESSION_INDEX_MASK) - 1;
+
+	*session = NULL;
+	if (i < sessions.count && sessions.items[i] != NULL
+			&& ((struct sc_pkcs11_session *) sessions.items[i])->handle == hSession)
+		*session = sessions.items[i];
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -44,16 +68,18 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
+	unsigned int i;
 
+	SC_PKCS11_PROBE_ENTRY(slotID);
 	if (!(flags & CKF_SERIAL_SESSION))
-		return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+		SC_PKCS11_RETURN(CKR_SESSION_PARALLEL_NOT_SUPPORTED);
 
 	if (flags & ~(CKF_SERIAL_SESSION | CKF_RW_SESSION))
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_OpenSession(0x%lx)", slotID);
 
@@ -67,36 +93,89 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		goto out;
 	}
 
+	/* reuse the position of the session closed last */
+	i = session_free;
+	if (i == SESSION_NO_FREE && sessions.count >= SESSION_INDEX_MASK) {
+		rv = CKR_SESSION_COUNT;
+		goto out;
+	}
+
 	session = (struct sc_pkcs11_session *)calloc(1, sizeof(struct sc_pkcs11_session));
 	if (session == NULL) {
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
-
-	/* make session handle from pointer and check its uniqueness */
-	session->handle = (CK_SESSION_HANDLE)(uintptr_t)session;
-	if (list_seek(&sessions, &session->handle) != NULL) {
-		sc_log(context, "C_OpenSession handle 0x%lx already exists", session->handle);
-
+	rv = sc_pkcs11_create_session_lock(session);
+	if (rv != CKR_OK) {
 		free(session);
-
-		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
+	if (i == SESSION_NO_FREE) {
+		unsigned int allocated = sessions.allocated;
+
+		i = sessions.count;
+		if (0 > sc_pkcs11_array_append(&sessions, session)) {
+			sc_pkcs11_free_session_lock(session);
+			free(session);
+			rv = CKR_HOST_MEMORY;
+			goto out;
+		}
+		if (sessions.allocated != allocated) {
+			struct session_entry *entries = realloc(session_entries,
+					sessions.allocated * sizeof *entries);
+
+			if (entries == NULL) {
+				sessions.count--;
+				sc_pkcs11_free_session_lock(session);
+				free(session);
+				rv = CKR_HOST_MEMORY;
+				goto out;
+			}
+			memset(entries + allocated, 0,
+					(sessions.allocated - allocated) * sizeof *entries);
+			session_entries = entries;
+		}
+	} else {
+		session_free = session_entries[i].next_free;
+	}
+	sessions.items[i] = session;
+	session->handle = (++session_entries[i].generation << SESSION_INDEX_BITS) | (i + 1);
 
 	session->slot = slot;
+	/* slot_get_token() picked a member of the token pool `slotID` */
+	if (slot->id != slotID && slot_get_slot(slotID, &session->pool) == CKR_OK)
+		session->pool->nsessions++;
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
 	slot->nsessions++;
-	list_append(&sessions, session);
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
 
 out:
 	sc_log(context, "C_OpenSession() = %s", lookup_enum(RV_T, rv));
 	sc_pkcs11_unlock();
-	return rv;
+	SC_PKCS11_RETURN(rv);
+}
+
+static CK_RV slot_logout(struct sc_pkcs11_slot *slot)
+{
+	if (slot->login_user < 0)
+		return CKR_USER_NOT_LOGGED_IN;
+
+	slot->login_user = -1;
+	if (sc_pkcs11_conf.atomic) {
+		pop_all_login_states(slot);
+		return CKR_OK;
+	}
+	return slot->p11card->framework->logout(slot);
+}
+
+/* Log out a slot that is no longer used by any session */
+static void slot_logout_idle(struct sc_pkcs11_slot *slot)
+{
+	if (slot->nsessions == 0 && slot->login_user >= 0 && !slot_in_used_pool(slot))
+		slot_logout(slot);
 }
 
 /* Internal version of C_CloseSession that gets called with
@@ -105,27 +184,65 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
+	unsigned int i;
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session)
+	if (get_session(hSession, &session) != CKR_OK)
 		return CKR_SESSION_HANDLE_INVALID;
 
+	/* Wait for an update still running on the operations of the session */
+	sc_pkcs11_lock_session(session);
+
 	/* If we're the last session using this slot, make sure
 	 * we log out */
 	slot = session->slot;
 	slot->nsessions--;
-	if (slot->nsessions == 0 && slot->login_user >= 0) {
-		slot->login_user = -1;
-		if (sc_pkcs11_conf.atomic)
-			pop_all_login_states(slot);
-		else
-			slot->p11card->framework->logout(slot);
+	if (session->pool)
+		session->pool->nsessions--;
+	slot_logout_idle(slot);
+
+	/* The last session of a token pool also logs out the idle members */
+	if (session->pool && session->pool->nsessions == 0) {
+		for (i = 0; i < virtual_slots.count; i++) {
+			struct sc_pkcs11_slot *member = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+			void *slot_lock = NULL;
+
+			if (member == slot || !slot_is_pool_member(session->pool, member))
+				continue;
+			/* the slots of one reader share the lock we already hold */
+			if (member->reader != slot->reader)
+				slot_lock = sc_pkcs11_drain_slot(member);
+			slot_logout_idle(member);
+			if (slot_lock)
+				sc_pkcs11_undrain_slot(slot_lock);
+		}
 	}
 
-	if (list_delete(&sessions, session) != 0)
-		sc_log(context, "Could not delete session from list!");
+	for (i = 0; i < SC_PKCS11_MESSAGE_MAX; i++)
+		if (session->message[i])
+			session_stop_message(session, i);
+	for (i = 0; i < SC_PKCS11_OPERATION_MAX; i++)
+		if (session->operation[i])
+			session_stop_operation(session, i);
+
+	/* The session objects only live in memory and go with their session */
+	for (i = slot->objects.count; i-- > 0; ) {
+		struct sc_pkcs11_object *object = slot->objects.items[i];
+
+		if (object->session == hSession && object->ops->destroy_object)
+			object->ops->destroy_object(session, object);
+	}
+
+	i = (unsigned int) (hSession & SESSION_INDEX_MASK) - 1;
+	sessions.items[i] = NULL;
+	session_entries[i].next_free = session_free;
+	session_free = i;
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_openssl_release_session(session);
+#endif
+	sc_pkcs11_unlock_session(session);
+	sc_pkcs11_free_session_lock(session);
 	free(session);
 	return CKR_OK;
 }
@@ -137,40 +254,92 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 	CK_RV rv = CKR_OK, error;
 	struct sc_pkcs11_session *session;
 	unsigned int i;
-	sc_log(context, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
-		session = list_get_at(&sessions, i);
-		if (session->slot->id == slotID)
+	sc_log(context, "real C_CloseAllSessions(0x%lx) %u", slotID, sessions.count);
+	for (i = 0; i < sessions.count; i++) {
+		session = sessions.items[i];
+		if (session && session->slot->id == slotID)
 			if ((error = sc_pkcs11_close_session(session->handle)) != CKR_OK)
 				rv = error;
 	}
 	return rv;
 }
 
+/* Close the sessions opened on a token pool, on whatever member they run.
+ * Called with the global lock held. */
+static CK_RV close_pool_sessions(CK_SLOT_ID poolID)
+{
+	CK_RV rv = CKR_OK, error;
+	struct sc_pkcs11_session *session;
+	void *slot_lock;
+	unsigned int i;
+
+	for (i = 0; i < sessions.count; i++) {
+		session = sessions.items[i];
+		if (!session || !session->pool || session->pool->id != poolID)
+			continue;
+		slot_lock = sc_pkcs11_drain_slot(session->slot);
+		if ((error = sc_pkcs11_close_session(session->handle)) != CKR_OK)
+			rv = error;
+		sc_pkcs11_undrain_slot(slot_lock);
+	}
+	return rv;
+}
+
+/* Frees all sessions without closing them, called from C_Finalize */
+void sc_pkcs11_free_sessions(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sessions.count; i++) {
+		struct sc_pkcs11_session *session = sessions.items[i];
+
+		if (session == NULL)
+			continue;
+#ifdef ENABLE_OPENSSL
+		sc_pkcs11_openssl_release_session(session);
+#endif
+		sc_pkcs11_free_session_lock(session);
+		free(session);
+	}
+	sc_pkcs11_array_free(&sessions);
+	free(session_entries);
+	session_entries = NULL;
+	session_free = SESSION_NO_FREE;
+}
+
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
+	if (get_session(hSession, &session) == CKR_OK)
+		slot_lock = sc_pkcs11_drain_slot(session->slot);
+
 	rv = sc_pkcs11_close_session(hSession);
 
+	sc_pkcs11_undrain_slot(slot_lock);
 	sc_pkcs11_unlock();
-	return rv;
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {				/* the token's slot */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
+	void *slot_lock;
 
+	SC_PKCS11_PROBE_ENTRY(slotID);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_CloseAllSessions(0x%lx)", slotID);
 
@@ -178,11 +347,18 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
+	if (slot->id != slotID) {
+		rv = close_pool_sessions(slotID);
+		goto out;
+	}
+
+	slot_lock = sc_pkcs11_drain_slot(slot);
 	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_undrain_slot(slot_lock);
 
 out:
 	sc_pkcs11_unlock();
-	return rv;
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -192,28 +368,29 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 	int logged_out;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pInfo == NULL_PTR)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
-	pInfo->slotID = session->slot->id;
+	pInfo->slotID = session->pool ? session->pool->id : session->slot->id;
 	pInfo->flags = session->flags;
 	pInfo->ulDeviceError = 0;
 
 	slot = session->slot;
+	sc_pkcs11_lock_slot(slot, &slot_lock);
 	logged_out = (slot_get_logged_in_state(slot) == SC_PIN_STATE_LOGGED_OUT);
 	if (slot->login_user == CKU_SO && !logged_out) {
 		pInfo->state = CKS_RW_SO_FUNCTIONS;
@@ -227,15 +404,16 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_BYTE_PTR pOperationState,	/* location receiving state */
 			  CK_ULONG_PTR pulOperationStateLen)
 {				/* location receiving state length */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
 }
 
 CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -244,7 +422,89 @@ CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_OBJECT_HANDLE hEncryptionKey,	/* handle of en/decryption key */
 			  CK_OBJECT_HANDLE hAuthenticationKey)
 {				/* handle of sign/verify key */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	SC_PKCS11_RETURN(CKR_FUNCTION_NOT_SUPPORTED);
+}
+
+static CK_RV slot_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
+		CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	CK_RV rv;
+
+	if (!(slot->token_info.flags & CKF_USER_PIN_INITIALIZED) && userType == CKU_USER)
+		return CKR_USER_PIN_NOT_INITIALIZED;
+
+	sc_log(context, "C_Login() slot->login_user %i", slot->login_user);
+	if (slot->login_user >= 0) {
+		if ((CK_USER_TYPE) slot->login_user == userType)
+			return CKR_USER_ALREADY_LOGGED_IN;
+		return CKR_USER_ANOTHER_ALREADY_LOGGED_IN;
+	}
+
+	rv = restore_login_state(slot);
+	if (rv == CKR_OK) {
+		sc_log(context, "C_Login() userType %li", userType);
+		rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
+		sc_log(context, "fLogin() rv %li", rv);
+	}
+	if (rv == CKR_OK)
+		rv = push_login_state(slot, userType, pPin, ulPinLen);
+	if (rv == CKR_OK) {
+		slot->login_user = userType;
+	}
+	return reset_login_state(slot, rv);
+}
+
+/* Log in the member of the session first, then the other members of its
+ * token pool, so that all the sessions of the pool share the login state.
+ * Called with the global lock held. */
+static CK_RV pool_login(struct sc_pkcs11_session *session, CK_USER_TYPE userType,
+		CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	void *slot_lock;
+	unsigned int i;
+	CK_RV rv, member_rv;
+
+	slot_lock = sc_pkcs11_drain_slot(session->slot);
+	rv = slot_login(session->slot, userType, pPin, ulPinLen);
+	sc_pkcs11_undrain_slot(slot_lock);
+	if (rv != CKR_OK)
+		return rv;
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *member = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+
+		if (member == session->slot || !slot_is_pool_member(session->pool, member))
+			continue;
+		slot_lock = sc_pkcs11_drain_slot(member);
+		member_rv = slot_login(member, userType, pPin, ulPinLen);
+		sc_pkcs11_undrain_slot(slot_lock);
+		if (member_rv != CKR_OK && member_rv != CKR_USER_ALREADY_LOGGED_IN)
+			sc_log(context, "Token pool: login to slot 0x%lx failed: %s",
+					member->id, lookup_enum(RV_T, member_rv));
+	}
+	return CKR_OK;
+}
+
+/* Called with the global lock held */
+static CK_RV pool_logout(struct sc_pkcs11_session *session)
+{
+	void *slot_lock;
+	unsigned int i;
+	CK_RV rv = CKR_USER_NOT_LOGGED_IN, member_rv;
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *member = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+
+		if (member != session->slot && !slot_is_pool_member(session->pool, member))
+			continue;
+		slot_lock = sc_pkcs11_drain_slot(member);
+		member_rv = slot_logout(member);
+		sc_pkcs11_undrain_slot(slot_lock);
+		if (member == session->slot)
+			rv = member_rv;
+	}
+	return rv;
 }
 
 CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -255,32 +515,32 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if (pPin == NULL_PTR && ulPinLen > 0)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
 	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC) {
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_Login(0x%lx, %lu)", hSession, userType);
 
 	slot = session->slot;
-
-	if (!(slot->token_info.flags & CKF_USER_PIN_INITIALIZED) && userType == CKU_USER) {
-		rv = CKR_USER_PIN_NOT_INITIALIZED;
+	if (session->pool && userType != CKU_CONTEXT_SPECIFIC) {
+		rv = pool_login(session, userType, pPin, ulPinLen);
 		goto out;
 	}
+	sc_pkcs11_lock_slot(slot, &slot_lock);
 
 	/* TODO: check if context specific is valid */
 	if (userType == CKU_CONTEXT_SPECIFIC) {
@@ -295,32 +555,27 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		}
 	}
 	else {
-		sc_log(context, "C_Login() slot->login_user %i", slot->login_user);
-		if (slot->login_user >= 0) {
-			if ((CK_USER_TYPE) slot->login_user == userType)
-				rv = CKR_USER_ALREADY_LOGGED_IN;
-			else
-				rv = CKR_USER_ANOTHER_ALREADY_LOGGED_IN;
-			goto out;
-		}
-
-		rv = restore_login_state(slot);
-		if (rv == CKR_OK) {
-			sc_log(context, "C_Login() userType %li", userType);
-			rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
-			sc_log(context, "fLogin() rv %li", rv);
-		}
-		if (rv == CKR_OK)
-			rv = push_login_state(slot, userType, pPin, ulPinLen);
-		if (rv == CKR_OK) {
-			slot->login_user = userType;
-		}
-		rv = reset_login_state(slot, rv);
+		rv = slot_login(slot, userType, pPin, ulPinLen);
 	}
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+}
+
+/* There are no user names on our tokens: only a login without one works */
+CK_RV C_LoginUser(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		  CK_USER_TYPE userType,	/* the user type */
+		  CK_UTF8CHAR_PTR pPin,	/* the user's PIN */
+		  CK_ULONG ulPinLen,	/* the length of the PIN */
+		  CK_UTF8CHAR_PTR pUsername,	/* the user's name */
+		  CK_ULONG ulUsernameLen)
+{				/* the length of the user's name */
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	if (pUsername != NULL_PTR && ulUsernameLen > 0)
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
+
+	SC_PKCS11_RETURN(C_Login(hSession, userType, pPin, ulPinLen));
 }
 
 CK_RV C_Logout(CK_SESSION_HANDLE hSession)
@@ -328,33 +583,31 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
-	slot = session->slot;
+	if (session->pool) {
+		rv = pool_logout(session);
+		goto out;
+	}
 
-	if (slot->login_user >= 0) {
-		slot->login_user = -1;
-		if (sc_pkcs11_conf.atomic)
-			pop_all_login_states(slot);
-		else
-			rv = slot->p11card->framework->logout(slot);
-	} else
-		rv = CKR_USER_NOT_LOGGED_IN;
+	slot = session->slot;
+	sc_pkcs11_lock_slot(slot, &slot_lock);
+	rv = slot_logout(slot);
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
@@ -362,20 +615,20 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	sc_log(context, "C_InitPIN() called, pin '%s'", pPin ? (char *) pPin : "<null>");
 	if (pPin == NULL_PTR && ulPinLen > 0)
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
@@ -383,6 +636,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 	slot = session->slot;
+	sc_pkcs11_lock_slot(slot, &slot_lock);
 	if (slot->login_user != CKU_SO) {
 		rv = CKR_USER_NOT_LOGGED_IN;
 	} else if (slot->p11card->framework->init_pin == NULL) {
@@ -397,8 +651,8 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
 
 CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
@@ -407,21 +661,22 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	void *slot_lock = NULL;
 
+	SC_PKCS11_PROBE_ENTRY(hSession);
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
-		return CKR_ARGUMENTS_BAD;
+		SC_PKCS11_RETURN(CKR_ARGUMENTS_BAD);
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
-		return rv;
+		SC_PKCS11_RETURN(rv);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	slot = session->slot;
+	sc_pkcs11_lock_slot(slot, &slot_lock);
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
 	if (!(session->flags & CKF_RW_SESSION)) {
@@ -435,6 +690,56 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	rv = reset_login_state(slot, rv);
 
 out:
-	sc_pkcs11_unlock();
-	return rv;
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
+}
+
+CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		      CK_FLAGS flags)
+{				/* the operations to cancel */
+	static const struct {
+		CK_FLAGS flag;
+		int type;
+	} messages[] = {
+		{ CKF_MESSAGE_ENCRYPT,	SC_PKCS11_MESSAGE_ENCRYPT },
+		{ CKF_MESSAGE_DECRYPT,	SC_PKCS11_MESSAGE_DECRYPT },
+		{ CKF_MESSAGE_SIGN,	SC_PKCS11_MESSAGE_SIGN },
+		{ CKF_MESSAGE_VERIFY,	SC_PKCS11_MESSAGE_VERIFY },
+	}, operations[] = {
+		{ CKF_FIND_OBJECTS,	SC_PKCS11_OPERATION_FIND },
+		{ CKF_SIGN,		SC_PKCS11_OPERATION_SIGN },
+		{ CKF_VERIFY,		SC_PKCS11_OPERATION_VERIFY },
+		{ CKF_DIGEST,		SC_PKCS11_OPERATION_DIGEST },
+		{ CKF_DECRYPT,		SC_PKCS11_OPERATION_DECRYPT },
+		{ CKF_DERIVE,		SC_PKCS11_OPERATION_DERIVE },
+		{ CKF_ENCRYPT,		SC_PKCS11_OPERATION_ENCRYPT },
+	};
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	void *slot_lock = NULL;
+	size_t i;
+
+	SC_PKCS11_PROBE_ENTRY(hSession);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		SC_PKCS11_RETURN(rv);
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	sc_log(context, "C_SessionCancel(0x%lx, 0x%lx)", hSession, flags);
+	sc_pkcs11_lock_slot(session->slot, &slot_lock);
+
+	/* Messages first, they may own an operation */
+	for (i = 0; i < sizeof(messages) / sizeof(messages[0]); i++)
+		if ((flags & messages[i].flag) && session->message[messages[i].type])
+			session_stop_message(session, messages[i].type);
+	for (i = 0; i < sizeof(operations) / sizeof(operations[0]); i++)
+		if ((flags & operations[i].flag) && session->operation[operations[i].type])
+			session_stop_operation(session, operations[i].type);
+
+out:
+	sc_pkcs11_unlock_slot(slot_lock);
+	SC_PKCS11_RETURN(rv);
 }
@@ -0,0 +1,379 @@
+/*
+ * pkcs11-spy-decode.c: turn a binary trace of the PKCS#11 spy into text
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307,
+ * USA
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pkcs11-display.h"
+#include "pkcs11-spy.h"
+
+/* Payload of the current record, read with the get_*() helpers */
+struct payload {
+	unsigned char *data;
+	size_t len, pos;
+	int error;
+};
+
+static const char *
+get_name(struct payload *p)
+{
+	const char *name = (const char *)p->data + p->pos;
+	size_t len;
+
+	for (len = 0; p->pos + len < p->len && name[len]; len++)
+		;
+	if (p->pos + len >= p->len) {
+		p->error = 1;
+		return "";
+	}
+	p->pos += len + 1;
+	return name;
+}
+
+static void *
+get_bytes(struct payload *p, size_t len)
+{
+	void *ptr = p->data + p->pos;
+
+	if (p->error || len > p->len - p->pos) {
+		p->error = 1;
+		return NULL;
+	}
+	p->pos += len;
+	return ptr;
+}
+
+static CK_ULONG
+get_ulong(struct payload *p)
+{
+	CK_ULONG value = 0;
+	void *ptr = get_bytes(p, sizeof value);
+
+	if (ptr)
+		memcpy(&value, ptr, sizeof value);
+	return value;
+}
+
+static uint64_t
+get_u64(struct payload *p)
+{
+	uint64_t value = 0;
+	void *ptr = get_bytes(p, sizeof value);
+
+	if (ptr)
+		memcpy(&value, ptr, sizeof value);
+	return value;
+}
+
+/* Read a data buffer; returns the flag, the content is in '*data' if present */
+static uint8_t
+get_data(struct payload *p, CK_ULONG *size, uint64_t *addr, void **data)
+{
+	uint8_t *flag;
+
+	*size = get_ulong(p);
+	*addr = get_u64(p);
+	*data = NULL;
+	flag = get_bytes(p, 1);
+	if (!flag)
+		return SPY_DATA_NONE;
+	if (*flag == SPY_DATA_PRESENT)
+		*data = get_bytes(p, *size);
+	return *flag;
+}
+
+static void
+print_time(FILE *f, uint64_t usec)
+{
+	time_t sec = (time_t)(usec / 1000000);
+	struct tm *tm = localtime(&sec);
+	char time_string[40];
+
+	strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", tm);
+	fprintf(f, "%s.%03ld\n", time_string, (long)(usec % 1000000) / 1000);
+}
+
+static void
+print_data(FILE *f, const char *dir, const char *name, struct payload *p)
+{
+	CK_ULONG size;
+	uint64_t addr;
+	void *data;
+	uint8_t flag = get_data(p, &size, &addr, &data);
+
+	fprintf(f, "[%s] %s ", dir, name);
+	if (flag == SPY_DATA_REDACTED)
+		fprintf(f, "REDACTED [size : 0x%lX (%ld)]\n", size, size);
+	else if (flag == SPY_DATA_NONE)
+		print_generic(f, 0, (CK_VOID_PTR)(uintptr_t)addr, size, NULL);
+	else
+		print_generic(f, 0, data ? data : (void *)"", size, NULL);
+}
+
+static void
+print_attributes(FILE *f, const char *dir, uint32_t type, struct payload *p)
+{
+	const char *name = get_name(p);
+	CK_ULONG count = get_ulong(p), i;
+	CK_ATTRIBUTE_PTR attrs;
+
+	fprintf(f, "[%s] %s[%ld]: \n", dir, name, count);
+	if (p->error || count > p->len / sizeof(CK_ULONG))
+		return;
+
+	attrs = calloc(count ? count : 1, sizeof(CK_ATTRIBUTE));
+	if (!attrs)
+		return;
+	for (i = 0; i < count && !p->error; i++) {
+		uint64_t addr;
+		uint8_t flag;
+
+		attrs[i].type = get_ulong(p);
+		flag = get_data(p, &attrs[i].ulValueLen, &addr, &attrs[i].pValue);
+		/* keep the NULL/non NULL distinction of the traced buffer */
+		if (flag != SPY_DATA_PRESENT && addr)
+			attrs[i].pValue = (CK_VOID_PTR)(uintptr_t)addr;
+		if (flag == SPY_DATA_REDACTED)
+			attrs[i].ulValueLen = (CK_ULONG)-1;
+	}
+	if (!p->error) {
+		if (type == SPY_REC_ATTR_REQ_IN)
+			print_attribute_list_req(f, attrs, count);
+		else
+			print_attribute_list(f, attrs, count);
+	}
+	free(attrs);
+}
+
+static void
+print_struct(FILE *f, struct payload *p)
+{
+	uint32_t kind = 0;
+	void *ptr = get_bytes(p, sizeof kind);
+	CK_ULONG arg;
+	size_t size;
+	void *data;
+
+	if (ptr)
+		memcpy(&kind, ptr, sizeof kind);
+	arg = get_ulong(p);
+	size = p->error ? 0 : p->len - p->pos;
+	data = get_bytes(p, size);
+	if (p->error)
+		return;
+
+	switch (kind) {
+	case SPY_STRUCT_INFO:
+		if (size >= sizeof(CK_INFO))
+			print_ck_info(f, data);
+		break;
+	case SPY_STRUCT_SLOT_LIST:
+		if (size >= arg * sizeof(CK_SLOT_ID))
+			print_slot_list(f, size ? data : NULL, arg);
+		break;
+	case SPY_STRUCT_SLOT_INFO:
+		if (size >= sizeof(CK_SLOT_INFO))
+			print_slot_info(f, data);
+		break;
+	case SPY_STRUCT_TOKEN_INFO:
+		if (size >= sizeof(CK_TOKEN_INFO))
+			print_token_info(f, data);
+		break;
+	case SPY_STRUCT_MECH_LIST:
+		if (size >= arg * sizeof(CK_MECHANISM_TYPE))
+			print_mech_list(f, size ? data : NULL, arg);
+		break;
+	case SPY_STRUCT_MECH_INFO:
+		if (size >= sizeof(CK_MECHANISM_INFO))
+			print_mech_info(f, arg, data);
+		break;
+	case SPY_STRUCT_SESSION_INFO:
+		if (size >= sizeof(CK_SESSION_INFO))
+			print_session_info(f, data);
+		break;
+	default:
+		fprintf(f, "Unknown structure %u\n", (unsigned int)kind);
+		break;
+	}
+}
+
+static int
+print_record(FILE *f, struct spy_trace_record *rec, struct payload *p, int *count, int with_thread)
+{
+	const char *name;
+	CK_ULONG value;
+	CK_RV rv;
+
+	switch (rec->type) {
+	case SPY_REC_TEXT:
+		fprintf(f, "%s", get_name(p));
+		break;
+	case SPY_REC_ENTER:
+		fprintf(f, "\n%d: %s\n", (*count)++, get_name(p));
+		if (with_thread)
+			fprintf(f, "[thread 0x%llx] ", (unsigned long long)rec->thread);
+		print_time(f, rec->time);
+		break;
+	case SPY_REC_RETURN:
+		rv = get_ulong(p);
+		fprintf(f, "Returned:  %ld %s\n", (unsigned long)rv, lookup_enum(RV_T, rv));
+		break;
+	case SPY_REC_ULONG_IN:
+	case SPY_REC_ULONG_OUT:
+		name = get_name(p);
+		value = get_ulong(p);
+		fprintf(f, "[%s] %s = 0x%lx\n", rec->type == SPY_REC_ULONG_IN ? "in" : "out", name, value);
+		break;
+	case SPY_REC_STRING_IN:
+	case SPY_REC_STRING_OUT:
+		name = get_name(p);
+		print_data(f, rec->type == SPY_REC_STRING_IN ? "in" : "out", name, p);
+		break;
+	case SPY_REC_DESC_OUT:
+		fprintf(f, "[out] %s: \n", get_name(p));
+		break;
+	case SPY_REC_ARRAY_OUT:
+		name = get_name(p);
+		value = get_ulong(p);
+		fprintf(f, "[out] %s[%ld]: \n", name, value);
+		break;
+	case SPY_REC_ATTR_REQ_IN:
+	case SPY_REC_ATTR_LIST_IN:
+		print_attributes(f, "in", rec->type, p);
+		break;
+	case SPY_REC_ATTR_LIST_OUT:
+		print_attributes(f, "out", rec->type, p);
+		break;
+	case SPY_REC_PTR_IN:
+		name = get_name(p);
+		fprintf(f, "[in] %s = %p\n", name, (void *)(uintptr_t)get_u64(p));
+		break;
+	case SPY_REC_STRUCT_OUT:
+		print_struct(f, p);
+		break;
+	case SPY_REC_DROPPED:
+		fprintf(f, "\n*** %llu records lost: trace buffer full ***\n",
+				(unsigned long long)get_u64(p));
+		break;
+	default:
+		fprintf(f, "\n*** unknown record type %u ***\n", (unsigned int)rec->type);
+		break;
+	}
+
+	return p->error ? -1 : 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t] [trace-file [output-file]]\n"
+			"Convert a binary trace of the PKCS#11 spy (PKCS11SPY_FORMAT=binary)\n"
+			"to the text format of the spy.\n"
+			"  -t  print the thread of each call\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *in = stdin, *out = stdout;
+	struct spy_trace_record rec;
+	struct spy_trace_header hdr;
+	struct payload p;
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	int count = 0, with_thread = 0, argi = 1, have_header = 0;
+
+	if (argi < argc && !strcmp(argv[argi], "-t")) {
+		with_thread = 1;
+		argi++;
+	}
+	if (argi < argc && argv[argi][0] == '-' && argv[argi][1]) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (argi < argc && strcmp(argv[argi], "-")) {
+		in = fopen(argv[argi], "rb");
+		if (!in) {
+			perror(argv[argi]);
+			return 1;
+		}
+	}
+	argi++;
+	if (argi < argc) {
+		out = fopen(argv[argi], "w");
+		if (!out) {
+			perror(argv[argi]);
+			return 1;
+		}
+	}
+
+	/* the header and the records start with 8 bytes that cannot be confused */
+	while (fread(&rec, 1, 8, in) == 8) {
+		if (!memcmp(&rec, SPY_TRACE_MAGIC, 8)) {
+			memcpy(&hdr, &rec, 8);
+			if (fread((char *)&hdr + 8, 1, sizeof hdr - 8, in) != sizeof hdr - 8)
+				break;
+			if (hdr.version != SPY_TRACE_VERSION || hdr.byte_order != SPY_TRACE_BYTE_ORDER
+					|| hdr.ulong_size != sizeof(CK_ULONG)) {
+				fprintf(stderr, "Trace written by an incompatible platform or version\n");
+				return 1;
+			}
+			have_header = 1;
+			count = 0;
+			continue;
+		}
+		if (!have_header) {
+			fprintf(stderr, "Not a PKCS#11 spy binary trace\n");
+			return 1;
+		}
+		if (fread((char *)&rec + 8, 1, sizeof rec - 8, in) != sizeof rec - 8)
+			break;
+
+		if (rec.length > buf_size) {
+			unsigned char *tmp = realloc(buf, rec.length);
+
+			if (!tmp) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+			buf = tmp;
+			buf_size = rec.length;
+		}
+		if (fread(buf, 1, rec.length, in) != rec.length)
+			break;
+
+		p.data = buf;
+		p.len = rec.length;
+		p.pos = 0;
+		p.error = 0;
+		if (print_record(out, &rec, &p, &count, with_thread))
+			fprintf(out, "\n*** malformed record ***\n");
+	}
+
+	free(buf);
+	if (in != stdin)
+		fclose(in);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -21,6 +21,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -31,8 +33,16 @@
 #include <time.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
 #define CRYPTOKI_EXPORTS
 #include "pkcs11-display.h"
+#include "pkcs11-spy.h"
 
 #define __PASTE(x,y)      x##y
 
@@ -50,11 +60,752 @@ static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
 
+/*
+ * Binary trace mode (PKCS11SPY_FORMAT=binary): the calls are recorded in a
+ * ring buffer, written to 'spy_output' by a background thread and turned
+ * into text offline by pkcs11-spy-decode. Without thread support the
+ * records are written synchronously.
+ */
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+#define SPY_TRACE_THREAD
+#endif
+
+#define SPY_TRACE_DEFAULT_BUFFER_SIZE	(1024 * 1024)
+
+static int spy_binary = 0;
+/* no call logging at all (PKCS11SPY_FORMAT=none), e.g. to only collect statistics */
+static int spy_silent = 0;
+/* do not record the content of the data buffers and of the non scalar attributes */
+static int spy_redact = 0;
+
+#ifdef SPY_TRACE_THREAD
+static unsigned char *spy_ring = NULL;
+static size_t spy_ring_size = SPY_TRACE_DEFAULT_BUFFER_SIZE;
+static size_t spy_ring_head = 0, spy_ring_tail = 0, spy_ring_used = 0;
+static uint64_t spy_dropped = 0;
+static int spy_writer_running = 0, spy_writer_stop = 0;
+#ifdef _WIN32
+static CRITICAL_SECTION spy_lock;
+static HANDLE spy_data_event = NULL;
+static HANDLE spy_writer = NULL;
+#else
+static pthread_mutex_t spy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spy_data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spy_drained_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t spy_writer;
+#endif
+#endif
+
+static uint64_t
+spy_trace_time(void)
+{
+#ifdef _WIN32
+	FILETIME ft;
+	ULARGE_INTEGER t;
+
+	GetSystemTimeAsFileTime(&ft);
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	/* 100ns since 1601 to microseconds since 1970 */
+	return t.QuadPart / 10 - 11644473600000000ULL;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static uint64_t
+spy_trace_thread(void)
+{
+#if defined(_WIN32)
+	return GetCurrentThreadId();
+#elif defined(HAVE_PTHREAD)
+	return (uint64_t)(uintptr_t)pthread_self();
+#else
+	return 0;
+#endif
+}
+
+#ifdef SPY_TRACE_THREAD
+static void
+spy_trace_lock(void)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&spy_lock);
+#else
+	pthread_mutex_lock(&spy_lock);
+#endif
+}
+
+static void
+spy_trace_unlock(void)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&spy_lock);
+#else
+	pthread_mutex_unlock(&spy_lock);
+#endif
+}
+
+static void
+spy_ring_put(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	while (len > 0) {
+		n = spy_ring_size - spy_ring_head;
+		if (n > len)
+			n = len;
+		memcpy(spy_ring + spy_ring_head, p, n);
+		spy_ring_head = (spy_ring_head + n) % spy_ring_size;
+		spy_ring_used += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* Write the content of the ring buffer to 'spy_output' */
+#ifdef _WIN32
+static DWORD WINAPI
+spy_writer_thread(LPVOID arg)
+#else
+static void *
+spy_writer_thread(void *arg)
+#endif
+{
+	size_t chunk;
+
+	spy_trace_lock();
+	for (;;) {
+		while (spy_ring_used == 0 && !spy_writer_stop) {
+#ifdef _WIN32
+			spy_trace_unlock();
+			WaitForSingleObject(spy_data_event, INFINITE);
+			spy_trace_lock();
+#else
+			pthread_cond_wait(&spy_data_cond, &spy_lock);
+#endif
+		}
+		if (spy_ring_used == 0)
+			break;
+
+		/* producers only write to the free part of the ring */
+		chunk = spy_ring_size - spy_ring_tail;
+		if (chunk > spy_ring_used)
+			chunk = spy_ring_used;
+		spy_trace_unlock();
+		fwrite(spy_ring + spy_ring_tail, 1, chunk, spy_output);
+		spy_trace_lock();
+		spy_ring_tail = (spy_ring_tail + chunk) % spy_ring_size;
+		spy_ring_used -= chunk;
+		if (spy_ring_used == 0) {
+			fflush(spy_output);
+#ifndef _WIN32
+			pthread_cond_broadcast(&spy_drained_cond);
+#endif
+		}
+	}
+	spy_trace_unlock();
+	fflush(spy_output);
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+static void
+spy_trace_start(void)
+{
+	if (!spy_binary || spy_writer_running)
+		return;
+
+	if (!spy_ring) {
+		spy_ring = malloc(spy_ring_size);
+		if (!spy_ring)
+			return;
+	}
+	spy_ring_head = spy_ring_tail = spy_ring_used = 0;
+	spy_writer_stop = 0;
+
+#ifdef _WIN32
+	if (!spy_data_event) {
+		InitializeCriticalSection(&spy_lock);
+		spy_data_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (!spy_data_event)
+			return;
+	}
+	spy_writer = CreateThread(NULL, 0, spy_writer_thread, NULL, 0, NULL);
+	spy_writer_running = spy_writer != NULL;
+#else
+	spy_writer_running = pthread_create(&spy_writer, NULL, spy_writer_thread, NULL) == 0;
+#endif
+}
+
+/* Write out what is in the ring buffer and stop the writer */
+static void
+spy_trace_stop(void)
+{
+	if (!spy_writer_running)
+		return;
+
+	spy_trace_lock();
+	spy_writer_stop = 1;
+#ifdef _WIN32
+	spy_trace_unlock();
+	SetEvent(spy_data_event);
+	WaitForSingleObject(spy_writer, INFINITE);
+	CloseHandle(spy_writer);
+	spy_writer = NULL;
+#else
+	pthread_cond_signal(&spy_data_cond);
+	spy_trace_unlock();
+	pthread_join(spy_writer, NULL);
+#endif
+	spy_writer_running = 0;
+}
+#endif
+
+/*
+ * Start a record of 'length' bytes of payload, to be given with
+ * spy_trace_put() and closed with spy_trace_end().
+ * Returns 0 if the record is dropped because the ring buffer is full.
+ */
+static int
+spy_trace_begin(uint32_t type, size_t length)
+{
+	struct spy_trace_record rec;
+
+	rec.type = type;
+	rec.length = (uint32_t)length;
+	rec.time = spy_trace_time();
+	rec.thread = spy_trace_thread();
+
+#ifdef SPY_TRACE_THREAD
+	if (spy_writer_running) {
+		struct spy_trace_record drop;
+		size_t need = sizeof rec + length;
+
+		spy_trace_lock();
+		if (spy_dropped)
+			need += sizeof drop + sizeof spy_dropped;
+		if (length > UINT32_MAX || need > spy_ring_size - spy_ring_used) {
+			spy_dropped++;
+			spy_trace_unlock();
+			return 0;
+		}
+		if (spy_dropped) {
+			drop.type = SPY_REC_DROPPED;
+			drop.length = sizeof spy_dropped;
+			drop.time = rec.time;
+			drop.thread = rec.thread;
+			spy_ring_put(&drop, sizeof drop);
+			spy_ring_put(&spy_dropped, sizeof spy_dropped);
+			spy_dropped = 0;
+		}
+		spy_ring_put(&rec, sizeof rec);
+		return 1;
+	}
+#endif
+	fwrite(&rec, 1, sizeof rec, spy_output);
+	return 1;
+}
+
+static void
+spy_trace_put(const void *data, size_t len)
+{
+#ifdef SPY_TRACE_THREAD
+	if (spy_writer_running) {
+		spy_ring_put(data, len);
+		return;
+	}
+#endif
+	fwrite(data, 1, len, spy_output);
+}
+
+static void
+spy_trace_end(void)
+{
+#ifdef SPY_TRACE_THREAD
+	if (spy_writer_running) {
+		spy_trace_unlock();
+#ifdef _WIN32
+		SetEvent(spy_data_event);
+#else
+		pthread_cond_signal(&spy_data_cond);
+#endif
+		return;
+	}
+#endif
+	fflush(spy_output);
+}
+
+/* Wait until everything recorded so far is in 'spy_output' */
+static void
+spy_trace_flush(void)
+{
+#ifdef SPY_TRACE_THREAD
+	if (spy_writer_running) {
+		spy_trace_lock();
+		while (spy_ring_used > 0) {
+#ifdef _WIN32
+			spy_trace_unlock();
+			SetEvent(spy_data_event);
+			Sleep(1);
+			spy_trace_lock();
+#else
+			pthread_cond_wait(&spy_drained_cond, &spy_lock);
+#endif
+		}
+		spy_trace_unlock();
+	}
+#endif
+	fflush(spy_output);
+}
+
+static void
+spy_trace_name(uint32_t type, const char *name)
+{
+	size_t len = strlen(name) + 1;
+
+	if (spy_trace_begin(type, len)) {
+		spy_trace_put(name, len);
+		spy_trace_end();
+	}
+}
+
+static void
+spy_trace_ulong(uint32_t type, const char *name, CK_ULONG value)
+{
+	size_t len = strlen(name) + 1;
+
+	if (spy_trace_begin(type, len + sizeof value)) {
+		spy_trace_put(name, len);
+		spy_trace_put(&value, sizeof value);
+		spy_trace_end();
+	}
+}
+
+static uint8_t
+spy_trace_data_flag(CK_VOID_PTR data, CK_ULONG size, int scalar)
+{
+	if (data == NULL || (CK_LONG)size == -1)
+		return SPY_DATA_NONE;
+	if (spy_redact && !(scalar && size <= sizeof(CK_ULONG)))
+		return SPY_DATA_REDACTED;
+	return SPY_DATA_PRESENT;
+}
+
+static size_t
+spy_trace_data_length(CK_ULONG size, uint8_t flag)
+{
+	return sizeof(CK_ULONG) + sizeof(uint64_t) + sizeof(uint8_t)
+		+ (flag == SPY_DATA_PRESENT ? size : 0);
+}
+
+static void
+spy_trace_data_put(CK_VOID_PTR data, CK_ULONG size, uint8_t flag)
+{
+	uint64_t addr = (uint64_t)(uintptr_t)data;
+
+	spy_trace_put(&size, sizeof size);
+	spy_trace_put(&addr, sizeof addr);
+	spy_trace_put(&flag, sizeof flag);
+	if (flag == SPY_DATA_PRESENT)
+		spy_trace_put(data, size);
+}
+
+static void
+spy_trace_string(uint32_t type, const char *name, CK_VOID_PTR data, CK_ULONG size)
+{
+	size_t len = strlen(name) + 1;
+	uint8_t flag = spy_trace_data_flag(data, size, 0);
+
+	if (spy_trace_begin(type, len + spy_trace_data_length(size, flag))) {
+		spy_trace_put(name, len);
+		spy_trace_data_put(data, size, flag);
+		spy_trace_end();
+	}
+}
+
+static void
+spy_trace_attributes(uint32_t type, const char *name, CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount, int values)
+{
+	size_t len = strlen(name) + 1, total;
+	CK_ULONG i;
+
+	total = len + sizeof ulCount;
+	for (i = 0; i < ulCount; i++)
+		total += sizeof(CK_ULONG) + spy_trace_data_length(pTemplate[i].ulValueLen, values
+				? spy_trace_data_flag(pTemplate[i].pValue, pTemplate[i].ulValueLen, 1)
+				: SPY_DATA_NONE);
+
+	if (!spy_trace_begin(type, total))
+		return;
+	spy_trace_put(name, len);
+	spy_trace_put(&ulCount, sizeof ulCount);
+	for (i = 0; i < ulCount; i++) {
+		spy_trace_put(&pTemplate[i].type, sizeof(CK_ULONG));
+		spy_trace_data_put(pTemplate[i].pValue, pTemplate[i].ulValueLen, values
+				? spy_trace_data_flag(pTemplate[i].pValue, pTemplate[i].ulValueLen, 1)
+				: SPY_DATA_NONE);
+	}
+	spy_trace_end();
+}
+
+static void
+spy_trace_header(void)
+{
+	struct spy_trace_header hdr;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, SPY_TRACE_MAGIC, sizeof hdr.magic);
+	hdr.version = SPY_TRACE_VERSION;
+	hdr.byte_order = SPY_TRACE_BYTE_ORDER;
+	hdr.ulong_size = sizeof(CK_ULONG);
+	fwrite(&hdr, 1, sizeof hdr, spy_output);
+	fflush(spy_output);
+}
+
+static void
+spy_printf(const char *format, ...)
+{
+	va_list args;
+
+	if (spy_silent)
+		return;
+	va_start(args, format);
+	if (spy_binary) {
+		char line[512];
+		int len = vsnprintf(line, sizeof line, format, args);
+
+		if (len >= (int)sizeof line)
+			len = sizeof line - 1;
+		if (len >= 0 && spy_trace_begin(SPY_REC_TEXT, len + 1)) {
+			spy_trace_put(line, len + 1);
+			spy_trace_end();
+		}
+	}
+	else {
+		vfprintf(spy_output, format, args);
+	}
+	va_end(args);
+}
+
+/*
+ * Call statistics (PKCS11SPY_STATS=yes): number of calls and latency of each
+ * function, and of each mechanism for the signature, verification and
+ * decryption functions. They are written to the output at C_Finalize()
+ * and, except on Windows, when the process receives SIGUSR1.
+ * The latency is measured from the entry to the return of the spy function,
+ * so it includes the logging unless PKCS11SPY_FORMAT is 'none' or 'binary'.
+ */
+#if defined(_MSC_VER)
+#define SPY_THREAD_LOCAL __declspec(thread)
+#else
+#define SPY_THREAD_LOCAL __thread
+#endif
+
+#define SPY_STATS_MAX		256
+#define SPY_STATS_BUCKETS	256
+#define SPY_STATS_SESSIONS	64
+#define SPY_STATS_NO_MECH	((CK_MECHANISM_TYPE)-1)
+
+/* operations that run over several calls with the mechanism of their Init */
+enum spy_op {
+	SPY_OP_SIGN,
+	SPY_OP_SIGN_RECOVER,
+	SPY_OP_VERIFY,
+	SPY_OP_VERIFY_RECOVER,
+	SPY_OP_DECRYPT
+};
+
+struct spy_stats {
+	const char *function;
+	CK_MECHANISM_TYPE mechanism;
+	uint64_t count, total, min, max;
+	/* log-scale latency histogram, for the percentiles */
+	uint64_t buckets[SPY_STATS_BUCKETS];
+};
+
+static int spy_stats_enabled = 0;
+static struct spy_stats *spy_stats = NULL;
+static size_t spy_stats_count = 0;
+static struct {
+	CK_SESSION_HANDLE session;
+	int op;
+	CK_MECHANISM_TYPE mechanism;
+} spy_stats_sessions[SPY_STATS_SESSIONS];
+static size_t spy_stats_sessions_next = 0;
+#ifndef _WIN32
+static volatile sig_atomic_t spy_stats_dump_requested = 0;
+#endif
+#if defined(_WIN32)
+static CRITICAL_SECTION spy_stats_lock;
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t spy_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* the call in progress in this thread */
+static SPY_THREAD_LOCAL const char *spy_call_function = NULL;
+static SPY_THREAD_LOCAL CK_MECHANISM_TYPE spy_call_mechanism = SPY_STATS_NO_MECH;
+static SPY_THREAD_LOCAL uint64_t spy_call_start = 0;
+
+static void
+spy_stats_lock_enter(void)
+{
+#if defined(_WIN32)
+	EnterCriticalSection(&spy_stats_lock);
+#elif defined(HAVE_PTHREAD)
+	pthread_mutex_lock(&spy_stats_lock);
+#endif
+}
+
+static void
+spy_stats_lock_leave(void)
+{
+#if defined(_WIN32)
+	LeaveCriticalSection(&spy_stats_lock);
+#elif defined(HAVE_PTHREAD)
+	pthread_mutex_unlock(&spy_stats_lock);
+#endif
+}
+
+/* Monotonic time in nanoseconds */
+static uint64_t
+spy_stats_clock(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000
+		+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+/* Four buckets per power of two: about 20% of resolution */
+static unsigned int
+spy_stats_bucket(uint64_t ns)
+{
+	unsigned int e = 0;
+
+	if (ns < 4)
+		return (unsigned int)ns;
+	while ((ns >> e) >= 8)
+		e++;
+	return 4 * (e + 1) + (unsigned int)((ns >> e) & 3);
+}
+
+static uint64_t
+spy_stats_bucket_max(unsigned int bucket)
+{
+	unsigned int e;
+
+	if (bucket < 4)
+		return bucket;
+	e = bucket / 4 - 1;
+	return ((uint64_t)(4 + bucket % 4 + 1) << e) - 1;
+}
+
+/* Mechanism of the operation started on the session by the last Init */
+static void
+spy_stats_op_init(CK_SESSION_HANDLE hSession, int op, CK_MECHANISM_PTR pMechanism)
+{
+	size_t i;
+
+	if (!spy_stats_enabled || !pMechanism)
+		return;
+
+	spy_call_mechanism = pMechanism->mechanism;
+	spy_stats_lock_enter();
+	for (i = 0; i < SPY_STATS_SESSIONS; i++)
+		if (spy_stats_sessions[i].session == hSession && spy_stats_sessions[i].op == op)
+			break;
+	if (i == SPY_STATS_SESSIONS) {
+		i = spy_stats_sessions_next;
+		spy_stats_sessions_next = (spy_stats_sessions_next + 1) % SPY_STATS_SESSIONS;
+	}
+	spy_stats_sessions[i].session = hSession;
+	spy_stats_sessions[i].op = op;
+	spy_stats_sessions[i].mechanism = pMechanism->mechanism;
+	spy_stats_lock_leave();
+}
+
+static void
+spy_stats_op(CK_SESSION_HANDLE hSession, int op)
+{
+	size_t i;
+
+	if (!spy_stats_enabled)
+		return;
+
+	spy_stats_lock_enter();
+	for (i = 0; i < SPY_STATS_SESSIONS; i++) {
+		if (spy_stats_sessions[i].session == hSession && spy_stats_sessions[i].op == op) {
+			spy_call_mechanism = spy_stats_sessions[i].mechanism;
+			break;
+		}
+	}
+	spy_stats_lock_leave();
+}
+
+static void
+spy_stats_add(const char *function, CK_MECHANISM_TYPE mechanism, uint64_t ns)
+{
+	struct spy_stats *st = NULL;
+	size_t i;
+
+	spy_stats_lock_enter();
+	for (i = 0; i < spy_stats_count; i++) {
+		if (spy_stats[i].function == function && spy_stats[i].mechanism == mechanism) {
+			st = &spy_stats[i];
+			break;
+		}
+	}
+	if (!st && spy_stats_count < SPY_STATS_MAX) {
+		st = &spy_stats[spy_stats_count++];
+		st->function = function;
+		st->mechanism = mechanism;
+		st->min = UINT64_MAX;
+	}
+	if (st) {
+		st->count++;
+		st->total += ns;
+		if (ns < st->min)
+			st->min = ns;
+		if (ns > st->max)
+			st->max = ns;
+		st->buckets[spy_stats_bucket(ns)]++;
+	}
+	spy_stats_lock_leave();
+}
+
+static uint64_t
+spy_stats_percentile(struct spy_stats *st, unsigned int percent)
+{
+	uint64_t rank = (st->count * percent + 99) / 100, seen = 0, value;
+	unsigned int i;
+
+	for (i = 0; i < SPY_STATS_BUCKETS; i++) {
+		seen += st->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	value = spy_stats_bucket_max(i);
+	return value > st->max ? st->max : value;
+}
+
+/* The statistics are written even when the calls are not logged */
+static void
+spy_stats_line(const char *format, ...)
+{
+	char line[256];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof line, format, args);
+	va_end(args);
+	if (spy_silent)
+		fputs(line, spy_output);
+	else
+		spy_printf("%s", line);
+}
+
+static void
+spy_stats_dump(void)
+{
+	struct spy_stats *st;
+	char mech[40];
+	size_t i;
+
+	if (!spy_stats_enabled)
+		return;
+
+	spy_stats_lock_enter();
+	spy_stats_line("\n*************** PKCS#11 spy statistics *****************\n");
+	spy_stats_line("%-24s %-28s %10s %12s %12s %12s %12s\n", "Function", "Mechanism",
+			"Calls", "Min (us)", "Mean (us)", "P99 (us)", "Max (us)");
+	for (i = 0; i < spy_stats_count; i++) {
+		st = &spy_stats[i];
+		if (st->mechanism == SPY_STATS_NO_MECH)
+			strcpy(mech, "-");
+		else if (lookup_enum(MEC_T, st->mechanism))
+			snprintf(mech, sizeof mech, "%s", lookup_enum(MEC_T, st->mechanism));
+		else
+			snprintf(mech, sizeof mech, "0x%08lx", (unsigned long)st->mechanism);
+		spy_stats_line("%-24s %-28s %10llu %12.1f %12.1f %12.1f %12.1f\n",
+				st->function, mech, (unsigned long long)st->count,
+				st->min / 1000.0, (double)st->total / st->count / 1000.0,
+				spy_stats_percentile(st, 99) / 1000.0, st->max / 1000.0);
+	}
+	spy_stats_lock_leave();
+	if (!spy_binary)
+		fflush(spy_output);
+}
+
+#ifndef _WIN32
+static void
+spy_stats_signal(int sig)
+{
+	/* written at the next call, not from the signal handler */
+	spy_stats_dump_requested = 1;
+}
+#endif
+
+static void
+spy_stats_init(void)
+{
+	const char *stats = getenv("PKCS11SPY_STATS");
+
+	if (!stats || (strcmp(stats, "yes") && strcmp(stats, "1")))
+		return;
+
+	spy_stats = calloc(SPY_STATS_MAX, sizeof(struct spy_stats));
+	if (!spy_stats)
+		return;
+#ifdef _WIN32
+	InitializeCriticalSection(&spy_stats_lock);
+#else
+	{
+		struct sigaction sa, old;
+
+		/* do not take over a handler of the application */
+		if (sigaction(SIGUSR1, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+			memset(&sa, 0, sizeof sa);
+			sa.sa_handler = spy_stats_signal;
+			sigemptyset(&sa.sa_mask);
+			sa.sa_flags = SA_RESTART;
+			sigaction(SIGUSR1, &sa, NULL);
+		}
+	}
+#endif
+	spy_stats_enabled = 1;
+}
+
 /* Inits the spy. If successful, po != NULL */
 static CK_RV
 init_spy(void)
 {
-	const char *output, *module;
+	const char *output, *module, *format, *mode = "a";
 	int rv = CKR_OK;
 #ifdef _WIN32
         char temp_path[PATH_MAX], expanded_path[PATH_MAX];
@@ -147,9 +898,29 @@ init_spy(void)
 	 * as we want to be able to override configuration file via
 	 * environment variables
 	 */
+	format = getenv("PKCS11SPY_FORMAT");
+	if (format && !strcmp(format, "binary")) {
+		const char *redact = getenv("PKCS11SPY_REDACT");
+		const char *size = getenv("PKCS11SPY_BUFFER_SIZE");
+
+		spy_binary = 1;
+		mode = "ab";
+		spy_redact = redact && (!strcmp(redact, "yes") || !strcmp(redact, "1"));
+#ifdef SPY_TRACE_THREAD
+		if (size && atol(size) >= 4096)
+			spy_ring_size = (size_t)atol(size);
+#else
+		(void)size;
+#endif
+	}
+	else if (format && !strcmp(format, "none")) {
+		spy_silent = 1;
+	}
+	spy_stats_init();
+
 	output = getenv("PKCS11SPY_OUTPUT");
 	if (output)
-		spy_output = fopen(output, "a");
+		spy_output = fopen(output, mode);
 
 #ifdef _WIN32
 	if (!spy_output) {
@@ -177,13 +948,23 @@ init_spy(void)
 			RegCloseKey( hKey );
 		}
 
-		spy_output = fopen(output, "a");
+		spy_output = fopen(output, mode);
 	}
 #endif
-	if (!spy_output)
+	if (!spy_output) {
+		/* no binary data to a terminal */
 		spy_output = stderr;
+		spy_binary = 0;
+	}
+
+	if (spy_binary) {
+		spy_trace_header();
+#ifdef SPY_TRACE_THREAD
+		spy_trace_start();
+#endif
+	}
 
-	fprintf(spy_output, "\n\n*************** OpenSC PKCS#11 spy *****************\n");
+	spy_printf("\n\n*************** OpenSC PKCS#11 spy *****************\n");
 
 	module = getenv("PKCS11SPY");
 #ifdef _WIN32
@@ -216,14 +997,14 @@ init_spy(void)
 	}
 #endif
 	if (module == NULL) {
-		fprintf(spy_output, "Error: no module specified. Please set PKCS11SPY environment.\n");
+		spy_printf("Error: no module specified. Please set PKCS11SPY environment.\n");
 		free(pkcs11_spy);
 		return CKR_DEVICE_ERROR;
 	}
 
 	modhandle = C_LoadModule(module, &po);
 	if (modhandle && po) {
-		fprintf(spy_output, "Loaded: \"%s\"\n", module);
+		spy_printf("Loaded: \"%s\"\n", module);
 	}
 	else {
 		po = NULL;
@@ -247,6 +1028,24 @@ enter(const char *function)
 	char time_string[40];
 #endif
 
+	if (spy_stats_enabled) {
+#ifndef _WIN32
+		if (spy_stats_dump_requested) {
+			spy_stats_dump_requested = 0;
+			spy_stats_dump();
+		}
+#endif
+		spy_call_function = function;
+		spy_call_mechanism = SPY_STATS_NO_MECH;
+		spy_call_start = spy_stats_clock();
+	}
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_name(SPY_REC_ENTER, function);
+		return;
+	}
+
 	fprintf(spy_output, "\n%d: %s\n", count++, function);
 #ifdef _WIN32
         GetLocalTime(&st);
@@ -264,6 +1063,20 @@ enter(const char *function)
 static CK_RV
 retne(CK_RV rv)
 {
+	if (spy_stats_enabled && spy_call_function) {
+		spy_stats_add(spy_call_function, spy_call_mechanism, spy_stats_clock() - spy_call_start);
+		spy_call_function = NULL;
+	}
+	if (spy_silent)
+		return rv;
+	if (spy_binary) {
+		if (spy_trace_begin(SPY_REC_RETURN, sizeof rv)) {
+			spy_trace_put(&rv, sizeof rv);
+			spy_trace_end();
+		}
+		return rv;
+	}
+
 	fprintf(spy_output, "Returned:  %ld %s\n", (unsigned long) rv, lookup_enum ( RV_T, rv ));
 	fflush(spy_output);
 	return rv;
@@ -273,6 +1086,12 @@ retne(CK_RV rv)
 static void
 spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_string(SPY_REC_STRING_IN, name, data, size);
+		return;
+	}
 	fprintf(spy_output, "[in] %s ", name);
 	print_generic(spy_output, 0, data, size, NULL);
 }
@@ -280,6 +1099,12 @@ spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 static void
 spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_string(SPY_REC_STRING_OUT, name, data, size);
+		return;
+	}
 	fprintf(spy_output, "[out] %s ", name);
 	print_generic(spy_output, 0, data, size, NULL);
 }
@@ -287,24 +1112,48 @@ spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 static void
 spy_dump_ulong_in(const char *name, CK_ULONG value)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_ulong(SPY_REC_ULONG_IN, name, value);
+		return;
+	}
 	fprintf(spy_output, "[in] %s = 0x%lx\n", name, value);
 }
 
 static void
 spy_dump_ulong_out(const char *name, CK_ULONG value)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_ulong(SPY_REC_ULONG_OUT, name, value);
+		return;
+	}
 	fprintf(spy_output, "[out] %s = 0x%lx\n", name, value);
 }
 
 static void
 spy_dump_desc_out(const char *name)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_name(SPY_REC_DESC_OUT, name);
+		return;
+	}
   fprintf(spy_output, "[out] %s: \n", name);
 }
 
 static void
 spy_dump_array_out(const char *name, CK_ULONG size)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_ulong(SPY_REC_ARRAY_OUT, name, size);
+		return;
+	}
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, size);
 }
 
@@ -312,6 +1161,12 @@ static void
 spy_attribute_req_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_attributes(SPY_REC_ATTR_REQ_IN, name, pTemplate, ulCount, 0);
+		return;
+	}
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
 	print_attribute_list_req(spy_output, pTemplate, ulCount);
 }
@@ -320,6 +1175,12 @@ static void
 spy_attribute_list_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_attributes(SPY_REC_ATTR_LIST_IN, name, pTemplate, ulCount, 1);
+		return;
+	}
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
 	print_attribute_list(spy_output, pTemplate, ulCount);
 }
@@ -328,6 +1189,12 @@ static void
 spy_attribute_list_out(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		spy_trace_attributes(SPY_REC_ATTR_LIST_OUT, name, pTemplate, ulCount, 1);
+		return;
+	}
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, ulCount);
 	print_attribute_list(spy_output, pTemplate, ulCount);
 }
@@ -335,9 +1202,89 @@ spy_attribute_list_out(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 static void
 print_ptr_in(const char *name, CK_VOID_PTR ptr)
 {
+	if (spy_silent)
+		return;
+	if (spy_binary) {
+		size_t len = strlen(name) + 1;
+		uint64_t addr = (uint64_t)(uintptr_t)ptr;
+
+		if (spy_trace_begin(SPY_REC_PTR_IN, len + sizeof addr)) {
+			spy_trace_put(name, len);
+			spy_trace_put(&addr, sizeof addr);
+			spy_trace_end();
+		}
+		return;
+	}
  	fprintf(spy_output, "[in] %s = %p\n", name, ptr);
 }
 
+static void
+spy_dump_struct_out(uint32_t kind, CK_ULONG arg, CK_VOID_PTR data)
+{
+	size_t size = 0;
+
+	if (spy_silent)
+		return;
+	if (!spy_binary) {
+		switch (kind) {
+		case SPY_STRUCT_INFO:
+			print_ck_info(spy_output, data);
+			break;
+		case SPY_STRUCT_SLOT_LIST:
+			print_slot_list(spy_output, data, arg);
+			break;
+		case SPY_STRUCT_SLOT_INFO:
+			print_slot_info(spy_output, data);
+			break;
+		case SPY_STRUCT_TOKEN_INFO:
+			print_token_info(spy_output, data);
+			break;
+		case SPY_STRUCT_MECH_LIST:
+			print_mech_list(spy_output, data, arg);
+			break;
+		case SPY_STRUCT_MECH_INFO:
+			print_mech_info(spy_output, arg, data);
+			break;
+		case SPY_STRUCT_SESSION_INFO:
+			print_session_info(spy_output, data);
+			break;
+		}
+		return;
+	}
+
+	switch (kind) {
+	case SPY_STRUCT_INFO:
+		size = sizeof(CK_INFO);
+		break;
+	case SPY_STRUCT_SLOT_LIST:
+		size = data ? arg * sizeof(CK_SLOT_ID) : 0;
+		break;
+	case SPY_STRUCT_SLOT_INFO:
+		size = sizeof(CK_SLOT_INFO);
+		break;
+	case SPY_STRUCT_TOKEN_INFO:
+		size = sizeof(CK_TOKEN_INFO);
+		break;
+	case SPY_STRUCT_MECH_LIST:
+		size = data ? arg * sizeof(CK_MECHANISM_TYPE) : 0;
+		break;
+	case SPY_STRUCT_MECH_INFO:
+		size = sizeof(CK_MECHANISM_INFO);
+		break;
+	case SPY_STRUCT_SESSION_INFO:
+		size = sizeof(CK_SESSION_INFO);
+		break;
+	}
+
+	if (spy_trace_begin(SPY_REC_STRUCT_OUT, sizeof kind + sizeof arg + size)) {
+		spy_trace_put(&kind, sizeof kind);
+		spy_trace_put(&arg, sizeof arg);
+		if (size)
+			spy_trace_put(data, size);
+		spy_trace_end();
+	}
+}
+
 CK_RV C_GetFunctionList
 (CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 {
@@ -352,6 +1299,58 @@ CK_RV C_GetFunctionList
 	return retne(CKR_OK);
 }
 
+/* The spy only logs the functions of the 2.x interface, it offers no other */
+static CK_INTERFACE spy_interface = { (CK_UTF8CHAR_PTR) "PKCS 11", NULL, 0 };
+
+CK_RV C_GetInterfaceList
+(CK_INTERFACE_PTR pInterfacesList, CK_ULONG_PTR pulCount)
+{
+	if (po == NULL) {
+		CK_RV rv = init_spy();
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	enter("C_GetInterfaceList");
+	if (pulCount == NULL_PTR)
+		return retne(CKR_ARGUMENTS_BAD);
+	if (pInterfacesList == NULL_PTR) {
+		*pulCount = 1;
+		return retne(CKR_OK);
+	}
+	if (*pulCount < 1) {
+		*pulCount = 1;
+		return retne(CKR_BUFFER_TOO_SMALL);
+	}
+	spy_interface.pFunctionList = pkcs11_spy;
+	pInterfacesList[0] = spy_interface;
+	*pulCount = 1;
+	return retne(CKR_OK);
+}
+
+CK_RV C_GetInterface
+(CK_UTF8CHAR_PTR pInterfaceName, CK_VERSION_PTR pVersion,
+ CK_INTERFACE_PTR_PTR ppInterface, CK_FLAGS flags)
+{
+	if (po == NULL) {
+		CK_RV rv = init_spy();
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	enter("C_GetInterface");
+	if (ppInterface == NULL_PTR)
+		return retne(CKR_ARGUMENTS_BAD);
+	if ((pInterfaceName != NULL_PTR && strcmp((char *) pInterfaceName, "PKCS 11"))
+			|| (pVersion != NULL_PTR && (pVersion->major != pkcs11_spy->version.major
+				|| pVersion->minor != pkcs11_spy->version.minor))
+			|| flags != 0)
+		return retne(CKR_ARGUMENTS_BAD);
+	spy_interface.pFunctionList = pkcs11_spy;
+	*ppInterface = &spy_interface;
+	return retne(CKR_OK);
+}
+
 CK_RV
 C_Initialize(CK_VOID_PTR pInitArgs)
 {
@@ -363,16 +1362,19 @@ C_Initialize(CK_VOID_PTR pInitArgs)
 			return rv;
 	}
 
+#ifdef SPY_TRACE_THREAD
+	spy_trace_start();
+#endif
 	enter("C_Initialize");
 	print_ptr_in("pInitArgs", pInitArgs);
 
 	if (pInitArgs) {
 		CK_C_INITIALIZE_ARGS *ptr = pInitArgs;
-		fprintf(spy_output, "     flags: %ld\n", ptr->flags);
+		spy_printf("     flags: %ld\n", ptr->flags);
 		if (ptr->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)
-			fprintf(spy_output, "       CKF_LIBRARY_CANT_CREATE_OS_THREADS\n");
+			spy_printf("       CKF_LIBRARY_CANT_CREATE_OS_THREADS\n");
 		if (ptr->flags & CKF_OS_LOCKING_OK)
-			fprintf(spy_output, "       CKF_OS_LOCKING_OK\n");
+			spy_printf("       CKF_OS_LOCKING_OK\n");
 	}
 
 	rv = po->C_Initialize(pInitArgs);
@@ -386,7 +1388,16 @@ C_Finalize(CK_VOID_PTR pReserved)
 
 	enter("C_Finalize");
 	rv = po->C_Finalize(pReserved);
-	return retne(rv);
+	retne(rv);
+	spy_stats_dump();
+	if (spy_binary) {
+		/* do not leave the writer running when the module is unloaded */
+#ifdef SPY_TRACE_THREAD
+		spy_trace_stop();
+#endif
+		spy_trace_flush();
+	}
+	return rv;
 }
 
 CK_RV
@@ -398,7 +1409,7 @@ C_GetInfo(CK_INFO_PTR pInfo)
 	rv = po->C_GetInfo(pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_ck_info(spy_output, pInfo);
+		spy_dump_struct_out(SPY_STRUCT_INFO, 0, pInfo);
 	}
 	return retne(rv);
 }
@@ -414,7 +1425,7 @@ C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
 	rv = po->C_GetSlotList(tokenPresent, pSlotList, pulCount);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pSlotList");
-		print_slot_list(spy_output, pSlotList, *pulCount);
+		spy_dump_struct_out(SPY_STRUCT_SLOT_LIST, *pulCount, pSlotList);
 		spy_dump_ulong_out("*pulCount", *pulCount);
 	}
 	return retne(rv);
@@ -430,7 +1441,7 @@ C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	rv = po->C_GetSlotInfo(slotID, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_slot_info(spy_output, pInfo);
+		spy_dump_struct_out(SPY_STRUCT_SLOT_INFO, 0, pInfo);
 	}
 	return retne(rv);
 }
@@ -446,7 +1457,7 @@ C_GetTokenInfo(CK_SLOT_ID slotID,
 	rv = po->C_GetTokenInfo(slotID, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_token_info(spy_output, pInfo);
+		spy_dump_struct_out(SPY_STRUCT_TOKEN_INFO, 0, pInfo);
 	}
 	return retne(rv);
 }
@@ -462,7 +1473,7 @@ C_GetMechanismList(CK_SLOT_ID  slotID, CK_MECHANISM_TYPE_PTR pMechanismList,
 	rv = po->C_GetMechanismList(slotID, pMechanismList, pulCount);
 	if(rv == CKR_OK) {
 		spy_dump_array_out("pMechanismList", *pulCount);
-		print_mech_list(spy_output, pMechanismList, *pulCount);
+		spy_dump_struct_out(SPY_STRUCT_MECH_LIST, *pulCount, pMechanismList);
 	}
 	return retne(rv);
 }
@@ -477,14 +1488,14 @@ C_GetMechanismInfo(CK_SLOT_ID  slotID, CK_MECHANISM_TYPE type,
 	enter("C_GetMechanismInfo");
 	spy_dump_ulong_in("slotID", slotID);
 	if (name)
-		fprintf(spy_output, "%30s \n", name);
+		spy_printf("%30s \n", name);
 	else
-		fprintf(spy_output, " Unknown Mechanism (%08lx)  \n", type);
+		spy_printf(" Unknown Mechanism (%08lx)  \n", type);
 
 	rv = po->C_GetMechanismInfo(slotID, type, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_mech_info(spy_output, type, pInfo);
+		spy_dump_struct_out(SPY_STRUCT_MECH_INFO, type, pInfo);
 	}
 	return retne(rv);
 }
@@ -538,8 +1549,8 @@ C_OpenSession(CK_SLOT_ID  slotID, CK_FLAGS  flags, CK_VOID_PTR  pApplication,
 	enter("C_OpenSession");
 	spy_dump_ulong_in("slotID", slotID);
 	spy_dump_ulong_in("flags", flags);
-	fprintf(spy_output, "pApplication=%p\n", pApplication);
-	fprintf(spy_output, "Notify=%p\n", (void *)Notify);
+	spy_printf("pApplication=%p\n", pApplication);
+	spy_printf("Notify=%p\n", (void *)Notify);
 	rv = po->C_OpenSession(slotID, flags, pApplication, Notify, phSession);
 	spy_dump_ulong_out("*phSession", *phSession);
 	return retne(rv);
@@ -576,7 +1587,7 @@ C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
 	rv = po->C_GetSessionInfo(hSession, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_session_info(spy_output, pInfo);
+		spy_dump_struct_out(SPY_STRUCT_SESSION_INFO, 0, pInfo);
 	}
 	return retne(rv);
 }
@@ -619,7 +1630,7 @@ C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
 
 	enter("C_Login");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "[in] userType = %s\n",
+	spy_printf("[in] userType = %s\n",
 			lookup_enum(USR_T, userType));
 	spy_dump_string_in("pPin[ulPinLen]", pPin, ulPinLen);
 	rv = po->C_Login(hSession, userType, pPin, ulPinLen);
@@ -762,7 +1773,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULON
 		CK_ULONG          i;
 		spy_dump_ulong_out("ulObjectCount", *pulObjectCount);
 		for (i = 0; i < *pulObjectCount; i++)
-			fprintf(spy_output, "Object 0x%lx matches\n", phObject[i]);
+			spy_printf("Object 0x%lx matches\n", phObject[i]);
 	}
 	return retne(rv);
 }
@@ -785,7 +1796,7 @@ C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT
 
 	enter("C_EncryptInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_EncryptInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -842,22 +1853,23 @@ C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT
 	CK_RV rv;
 
 	enter("C_DecryptInit");
+	spy_stats_op_init(hSession, SPY_OP_DECRYPT, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	switch (pMechanism->mechanism) {
 	case CKM_RSA_PKCS_OAEP:
 		if (pMechanism->pParameter != NULL) {
  			CK_RSA_PKCS_OAEP_PARAMS *param =
 				(CK_RSA_PKCS_OAEP_PARAMS *) pMechanism->pParameter;
-			fprintf(spy_output, "pMechanism->pParameter->hashAlg=%s\n",
+			spy_printf("pMechanism->pParameter->hashAlg=%s\n",
 				lookup_enum(MEC_T, param->hashAlg));
-			fprintf(spy_output, "pMechanism->pParameter->mgf=%s\n",
+			spy_printf("pMechanism->pParameter->mgf=%s\n",
 				lookup_enum(MGF_T, param->mgf));
-			fprintf(spy_output, "pMechanism->pParameter->source=%lu\n", param->source);
+			spy_printf("pMechanism->pParameter->source=%lu\n", param->source);
 			spy_dump_string_out("pSourceData[ulSourceDalaLen]", 
 				param->pSourceData, param->ulSourceDataLen);
 		} else {
-			fprintf(spy_output, "Parameters block for %s is empty...\n",
+			spy_printf("Parameters block for %s is empty...\n",
 				lookup_enum(MEC_T, pMechanism->mechanism));
 		}
 		break;
@@ -876,6 +1888,7 @@ C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG  ulEn
 	CK_RV rv;
 
 	enter("C_Decrypt");
+	spy_stats_op(hSession, SPY_OP_DECRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pEncryptedData[ulEncryptedDataLen]", pEncryptedData, ulEncryptedDataLen);
 	rv = po->C_Decrypt(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
@@ -892,6 +1905,7 @@ C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG
 	CK_RV rv;
 
 	enter("C_DecryptUpdate");
+	spy_stats_op(hSession, SPY_OP_DECRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pEncryptedPart[ulEncryptedPartLen]", pEncryptedPart, ulEncryptedPartLen);
 	rv = po->C_DecryptUpdate(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
@@ -907,6 +1921,7 @@ C_DecryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR p
 	CK_RV rv;
 
 	enter("C_DecryptFinal");
+	spy_stats_op(hSession, SPY_OP_DECRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_DecryptFinal(hSession, pLastPart, pulLastPartLen);
 	if (rv == CKR_OK)
@@ -922,7 +1937,7 @@ C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
 
 	enter("C_DigestInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	rv = po->C_DigestInit(hSession, pMechanism);
 	return retne(rv);
 }
@@ -987,8 +2002,9 @@ C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HA
 	CK_RV rv;
 
 	enter("C_SignInit");
+	spy_stats_op_init(hSession, SPY_OP_SIGN, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	switch (pMechanism->mechanism) {
 	case CKM_RSA_PKCS_PSS:
 	case CKM_SHA1_RSA_PKCS_PSS:
@@ -998,14 +2014,14 @@ C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HA
 		if (pMechanism->pParameter != NULL) {
 			CK_RSA_PKCS_PSS_PARAMS *param =
 				(CK_RSA_PKCS_PSS_PARAMS *) pMechanism->pParameter;
-			fprintf(spy_output, "pMechanism->pParameter->hashAlg=%s\n",
+			spy_printf("pMechanism->pParameter->hashAlg=%s\n",
 				lookup_enum(MEC_T, param->hashAlg));
-			fprintf(spy_output, "pMechanism->pParameter->mgf=%s\n",
+			spy_printf("pMechanism->pParameter->mgf=%s\n",
 				lookup_enum(MGF_T, param->mgf));
-			fprintf(spy_output, "pMechanism->pParameter->sLen=%lu\n",
+			spy_printf("pMechanism->pParameter->sLen=%lu\n",
 				param->sLen);
 		} else {
-			fprintf(spy_output, "Parameters block for %s is empty...\n",
+			spy_printf("Parameters block for %s is empty...\n",
 				lookup_enum(MEC_T, pMechanism->mechanism));
 		}
 		break;
@@ -1022,6 +2038,7 @@ C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen,
 	CK_RV rv;
 
 	enter("C_Sign");
+	spy_stats_op(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	rv = po->C_Sign(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
@@ -1037,6 +2054,7 @@ C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG  ulPartLen)
 	CK_RV rv;
 
 	enter("C_SignUpdate");
+	spy_stats_op(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pPart[ulPartLen]", pPart, ulPartLen);
 	rv = po->C_SignUpdate(hSession, pPart, ulPartLen);
@@ -1049,6 +2067,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pul
 	CK_RV rv;
 
 	enter("C_SignFinal");
+	spy_stats_op(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_SignFinal(hSession, pSignature, pulSignatureLen);
 	if (rv == CKR_OK)
@@ -1063,8 +2082,9 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OB
 	CK_RV rv;
 
 	enter("C_SignRecoverInit");
+	spy_stats_op_init(hSession, SPY_OP_SIGN_RECOVER, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n",
+	spy_printf("pMechanism->type=%s\n",
 			lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_SignRecoverInit(hSession, pMechanism, hKey);
@@ -1078,6 +2098,7 @@ C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen
 	CK_RV rv;
 
 	enter("C_SignRecover");
+	spy_stats_op(hSession, SPY_OP_SIGN_RECOVER);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	rv = po->C_SignRecover(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
@@ -1092,8 +2113,9 @@ C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_
 	CK_RV rv;
 
 	enter("C_VerifyInit");
+	spy_stats_op_init(hSession, SPY_OP_VERIFY, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_VerifyInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1106,6 +2128,7 @@ C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen,
 	CK_RV rv;
 
 	enter("C_Verify");
+	spy_stats_op(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	spy_dump_string_in("pSignature[ulSignatureLen]", pSignature, ulSignatureLen);
@@ -1119,6 +2142,7 @@ C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG  ulPartLe
 	CK_RV rv;
 
 	enter("C_VerifyUpdate");
+	spy_stats_op(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pPart[ulPartLen]", pPart, ulPartLen);
 	rv = po->C_VerifyUpdate(hSession, pPart, ulPartLen);
@@ -1131,6 +2155,7 @@ C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG  ulSi
 	CK_RV rv;
 
 	enter("C_VerifyFinal");
+	spy_stats_op(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pSignature[ulSignatureLen]", pSignature, ulSignatureLen);
 	rv = po->C_VerifyFinal(hSession, pSignature, ulSignatureLen);
@@ -1145,8 +2170,9 @@ C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 	CK_RV rv;
 
 	enter("C_VerifyRecoverInit");
+	spy_stats_op_init(hSession, SPY_OP_VERIFY_RECOVER, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_VerifyRecoverInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1159,6 +2185,7 @@ C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG  ul
 	CK_RV rv;
 
 	enter("C_VerifyRecover");
+	spy_stats_op(hSession, SPY_OP_VERIFY_RECOVER);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pSignature[ulSignatureLen]", pSignature, ulSignatureLen);
 	rv = po->C_VerifyRecover(hSession, pSignature, ulSignatureLen, pData, pulDataLen);
@@ -1239,7 +2266,7 @@ C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_GenerateKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_attribute_list_in("pTemplate", pTemplate, ulCount);
 	rv = po->C_GenerateKey(hSession, pMechanism, pTemplate, ulCount, phKey);
 	if (rv == CKR_OK)
@@ -1258,7 +2285,7 @@ C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_GenerateKeyPair");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_attribute_list_in("pPublicKeyTemplate", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 	spy_attribute_list_in("pPrivateKeyTemplate", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	rv = po->C_GenerateKeyPair(hSession, pMechanism,
@@ -1281,7 +2308,7 @@ C_WrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_WrapKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hWrappingKey", hWrappingKey);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_WrapKey(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen);
@@ -1301,7 +2328,7 @@ C_UnwrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_UnwrapKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hUnwrappingKey", hUnwrappingKey);
 	spy_dump_string_in("pWrappedKey[ulWrappedKeyLen]", pWrappedKey, ulWrappedKeyLen);
 	spy_attribute_list_in("pTemplate", pTemplate, ulAttributeCount);
@@ -1320,7 +2347,7 @@ C_DeriveKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_H
 
 	enter("C_DeriveKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_printf("pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
 	spy_dump_ulong_in("hBaseKey", hBaseKey);
 	spy_attribute_list_in("pTemplate", pTemplate, ulAttributeCount);
 	rv = po->C_DeriveKey(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey);
@@ -0,0 +1,99 @@
+#ifndef PKCS11_SPY_H
+#define PKCS11_SPY_H
+
+/*
+ * Binary trace format written by the PKCS#11 spy when
+ * PKCS11SPY_FORMAT=binary, and read back by pkcs11-spy-decode.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307,
+ * USA
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A trace is a sequence of records in the byte order and with the CK_ULONG
+ * size of the traced process, as given by the header. Each process appending
+ * to the trace file starts with its own header.
+ */
+#define SPY_TRACE_MAGIC		"P11SPYB1"
+#define SPY_TRACE_VERSION	1
+#define SPY_TRACE_BYTE_ORDER	0x01020304
+
+struct spy_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t ulong_size;
+	uint32_t reserved;
+};
+
+struct spy_trace_record {
+	uint32_t type;		/* SPY_REC_* */
+	uint32_t length;	/* of the payload following the record */
+	uint64_t time;		/* microseconds since the Epoch */
+	uint64_t thread;
+};
+
+/*
+ * Payload of the records. Names are NUL terminated strings, CK_ULONG values
+ * are in native size. Data buffers are preceded by their CK_ULONG size, the
+ * original address (uint64_t) and a uint8_t SPY_DATA_* flag; the bytes follow
+ * only with SPY_DATA_PRESENT.
+ */
+enum spy_record_type {
+	SPY_REC_TEXT = 1,	/* text line */
+	SPY_REC_ENTER,		/* function name */
+	SPY_REC_RETURN,		/* CK_RV */
+	SPY_REC_ULONG_IN,	/* name, CK_ULONG */
+	SPY_REC_ULONG_OUT,	/* name, CK_ULONG */
+	SPY_REC_STRING_IN,	/* name, data buffer */
+	SPY_REC_STRING_OUT,	/* name, data buffer */
+	SPY_REC_DESC_OUT,	/* name */
+	SPY_REC_ARRAY_OUT,	/* name, CK_ULONG size */
+	SPY_REC_ATTR_REQ_IN,	/* name, CK_ULONG count, count * (CK_ULONG type, data buffer) */
+	SPY_REC_ATTR_LIST_IN,	/* same as SPY_REC_ATTR_REQ_IN */
+	SPY_REC_ATTR_LIST_OUT,	/* same as SPY_REC_ATTR_REQ_IN */
+	SPY_REC_PTR_IN,		/* name, uint64_t address */
+	SPY_REC_STRUCT_OUT,	/* uint32_t SPY_STRUCT_*, CK_ULONG argument, raw structure */
+	SPY_REC_DROPPED		/* uint64_t number of records lost since the previous one */
+};
+
+enum spy_data_flag {
+	SPY_DATA_NONE = 0,	/* NULL buffer or unavailable length */
+	SPY_DATA_PRESENT,
+	SPY_DATA_REDACTED
+};
+
+/* Structures of SPY_REC_STRUCT_OUT and the meaning of their argument */
+enum spy_struct_kind {
+	SPY_STRUCT_INFO = 1,		/* CK_INFO */
+	SPY_STRUCT_SLOT_LIST,		/* argument CK_SLOT_ID count */
+	SPY_STRUCT_SLOT_INFO,		/* CK_SLOT_INFO */
+	SPY_STRUCT_TOKEN_INFO,		/* CK_TOKEN_INFO */
+	SPY_STRUCT_MECH_LIST,		/* argument CK_MECHANISM_TYPE count */
+	SPY_STRUCT_MECH_INFO,		/* argument mechanism type, CK_MECHANISM_INFO */
+	SPY_STRUCT_SESSION_INFO		/* CK_SESSION_INFO */
+};
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
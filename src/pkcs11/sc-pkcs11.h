@@ -26,6 +26,7 @@
 #include "libopensc/opensc.h"
 #include "libopensc/pkcs15.h"
 #include "libopensc/log.h"
+#include "libopensc/probes.h"
 
 #define CRYPTOKI_EXPORTS
 #include "pkcs11.h"
@@ -66,6 +67,7 @@ extern "C" {
 struct sc_pkcs11_session;
 struct sc_pkcs11_slot;
 struct sc_pkcs11_card;
+struct sc_pkcs11_drbg;
 
 struct sc_pkcs11_config {
 	unsigned int plug_and_play;
@@ -78,6 +80,15 @@ struct sc_pkcs11_config {
 	unsigned int create_puk_slot;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	unsigned char per_slot_locking;
+	unsigned int detect_threads;
+	char token_pool[33];
+	unsigned char random_drbg;
+	unsigned int random_reseed_interval;
+	unsigned char prefetch_certificates;
+	unsigned int keep_removed_cards;
+	unsigned int removed_card_timeout;
+	unsigned char lazy_detection;
 };
 
 /*
@@ -126,6 +137,9 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	void *pkey;	/* decoded public key kept by sc_pkcs11_load_pkey(), opaque */
+	CK_SESSION_HANDLE session;	/* owner of a session object, 0 for token objects */
+	unsigned int index_slots;	/* Slots of the card whose index view has the object */
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
@@ -173,6 +187,16 @@ struct sc_pkcs11_framework_ops {
 				CK_OBJECT_HANDLE_PTR, CK_OBJECT_HANDLE_PTR);
 	CK_RV (*get_random)(struct sc_pkcs11_slot *,
 				CK_BYTE_PTR, CK_ULONG);
+	/* Create the objects of the class that were left out by create_tokens,
+	 * before the slot is searched; (CK_OBJECT_CLASS) -1 for all classes */
+	CK_RV (*load_objects)(struct sc_pkcs11_slot *, CK_OBJECT_CLASS);
+	/* Read one more of these objects from the card ahead of time, called
+	 * by the prefetch thread under the lock of the slot; CKR_OK if there
+	 * may be more to read */
+	CK_RV (*prefetch)(struct sc_pkcs11_slot *);
+	/* Forget the secrets of a removed card that is kept to be taken up
+	 * again, see keep_removed_cards; the card is not kept on error */
+	CK_RV (*park)(struct sc_pkcs11_card *);
 };
 
 /*
@@ -186,6 +210,44 @@ typedef unsigned __int64   sc_timestamp_t;
 #endif
 
 #define SC_PKCS11_FRAMEWORK_DATA_MAX_NUM	4
+
+/* Counters of a slot for C_OpenSC_GetStatistics(), times in microseconds */
+struct sc_pkcs11_slot_stats {
+	unsigned long calls;		/* calls which took the slot */
+	sc_timestamp_t call_time;	/* time they held it */
+	sc_timestamp_t call_time_max;
+	unsigned long lock_waits;	/* of them waiting for the slot lock */
+	sc_timestamp_t lock_wait_time;
+	unsigned long binds;
+	sc_timestamp_t bind_time;
+};
+
+/*
+ * Hash index of a card's objects, keyed by the values of CKA_CLASS,
+ * CKA_ID and CKA_LABEL. Lookups return a superset of the matching
+ * objects: an object whose value is not known when it is indexed is
+ * returned as a candidate for every value of that attribute. The index
+ * is shared by the slots of the card, an object shown in several slots
+ * is indexed once; each slot only sees the objects with its bit set.
+ */
+struct sc_pkcs11_index_entry;
+
+struct sc_pkcs11_index {
+	struct sc_pkcs11_index_entry **buckets;
+	unsigned int size;			/* Number of buckets */
+	unsigned int entries;			/* Number of entries in the buckets */
+	unsigned long seq;			/* Insertion counter, preserves the object order */
+	unsigned int slots;			/* Bits of the slots using the index */
+	struct sc_pkcs11_index_entry *unknown;	/* Entries without a known value */
+};
+
+/* The objects of a slot in the index of its card */
+struct sc_pkcs11_index_view {
+	unsigned int bit;			/* Bit of the slot in index_slots of the objects */
+	unsigned int count;			/* Number of objects of the slot in the index */
+	unsigned long generation;		/* Changed whenever objects are added or removed */
+};
+
 struct sc_pkcs11_card {
 	sc_reader_t *reader;
 	sc_card_t *card;
@@ -195,6 +257,21 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+	/* The same mechanisms sorted by type, in registration order
+	 * for equal types; used by sc_pkcs11_find_mechanism() */
+	struct sc_pkcs11_mechanism_type **mech_index;
+
+	/* Host DRBG for C_GenerateRandom, if random_drbg is set */
+	struct sc_pkcs11_drbg *drbg;
+
+	/* With keep_removed_cards: the serial number that identifies the card,
+	 * the applications that were bound and when the card was removed */
+	struct sc_serial_number serial;
+	unsigned int bound_apps;
+	time_t removed;
+
+	/* Attribute index of the objects of all slots of the card */
+	struct sc_pkcs11_index index;
 };
 
 /* If the slot did already show with `C_GetSlotList`, then we need to keep this
@@ -202,6 +279,22 @@ struct sc_pkcs11_card {
  * the application calls `C_GetSlotList` with `NULL`. This flag tracks the
  * visibility to the application */
 #define SC_PKCS11_SLOT_FLAG_SEEN 1
+/* The slot of the `token_pool` option: it has no token of its own, its
+ * sessions are opened on the member tokens */
+#define SC_PKCS11_SLOT_FLAG_POOL 2
+/* With `lazy_detection`: there is a card in the reader of the slot, which
+ * slot_get_token() binds when the slot is used */
+#define SC_PKCS11_SLOT_FLAG_PENDING 4
+
+/*
+ * Growable array of pointers, used for the lists of slots, sessions,
+ * objects and logins. The items are kept in the order they were appended.
+ */
+struct sc_pkcs11_array {
+	void **items;
+	unsigned int count;		/* Number of used items */
+	unsigned int allocated;		/* Number of allocated items */
+};
 
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id;			/* ID of the slot */
@@ -212,14 +305,17 @@ struct sc_pkcs11_slot {
 	struct sc_pkcs11_card *p11card;	/* The card associated with this slot */
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
-	list_t objects;			/* Objects in this slot */
+	struct sc_pkcs11_array objects;	/* Objects in this slot */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 
 	int fw_data_idx;		/* Index of framework data */
 	struct sc_app_info *app_info;	/* Application associated to slot */
-	list_t logins;			/* tracks all calls to C_Login if atomic operations are requested */
+	struct sc_pkcs11_array logins;	/* tracks all calls to C_Login if atomic operations are requested */
 	int flags;
+	void *lock;			/* Serializes card operations if per_slot_locking is enabled */
+	struct sc_pkcs11_index_view index;	/* The objects in the attribute index of the card */
+	struct sc_pkcs11_slot_stats stats;
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
@@ -234,9 +330,33 @@ enum {
 	SC_PKCS11_OPERATION_DIGEST,
 	SC_PKCS11_OPERATION_DECRYPT,
 	SC_PKCS11_OPERATION_DERIVE,
+	SC_PKCS11_OPERATION_ENCRYPT,
 	SC_PKCS11_OPERATION_MAX
 };
 
+/* Message-based operations of PKCS#11 3.0 */
+enum {
+	SC_PKCS11_MESSAGE_ENCRYPT = 0,
+	SC_PKCS11_MESSAGE_DECRYPT,
+	SC_PKCS11_MESSAGE_SIGN,
+	SC_PKCS11_MESSAGE_VERIFY,
+	SC_PKCS11_MESSAGE_MAX
+};
+
+/* The mechanism and the key given to C_Message*Init(). Each message runs
+ * an operation of the matching type, started with them. */
+struct sc_pkcs11_message {
+	CK_MECHANISM mechanism;		/* with a copy of the parameters */
+	CK_OBJECT_HANDLE key;
+	CK_KEY_TYPE key_type;
+	int op_type;			/* SC_PKCS11_OPERATION_* of a message */
+	int active;			/* a message runs in operation[op_type] */
+};
+
+/* Digest contexts cached per session: a digest plus the hashes of
+ * a sign and a verify operation can be active at the same time */
+#define SC_PKCS11_MD_CTX_POOL	3
+
 /* This describes a PKCS11 mechanism */
 struct sc_pkcs11_mechanism_type {
 	CK_MECHANISM_TYPE mech;		/* algorithm: md5, sha1, ... */
@@ -268,11 +388,29 @@ struct sc_pkcs11_mechanism_type {
 					CK_BYTE_PTR, CK_ULONG);
 	CK_RV		  (*verif_final)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG);
+	CK_RV		  (*verif_recover)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 	CK_RV		  (*decrypt_init)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *);
 	CK_RV		  (*decrypt)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG,
 					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*decrypt_update)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*decrypt_final)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_init)(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+	CK_RV		  (*encrypt)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_update)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_final)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 	CK_RV		  (*derive)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *,
 					CK_BYTE_PTR, CK_ULONG,
@@ -292,14 +430,22 @@ struct sc_pkcs11_operation {
 	CK_MECHANISM	  mechanism;
 	struct sc_pkcs11_session *session;
 	void *		  priv_data;
+	CK_ULONG	  batch_len;	/* item length of CKM_OPENSC_SIGN_BATCH, 0 if not */
 };
 
 /* Find Operation */
-#define SC_PKCS11_FIND_INC_HANDLES	32
+/*
+ * The objects are matched lazily as C_FindObjects is called: the operation
+ * keeps the candidate objects and the position of the next one to check.
+ */
 struct sc_pkcs11_find_operation {
 	struct sc_pkcs11_operation operation;
-	int num_handles, current_handle, allocated_handles;
-	CK_OBJECT_HANDLE *handles;
+	struct sc_pkcs11_object **objects;	/* Candidate objects, in slot order */
+	CK_ULONG num_objects, current_object;
+	unsigned long generation;		/* slot->index.generation of the candidates */
+	CK_ATTRIBUTE_PTR templ;			/* Copy of the search template */
+	CK_ULONG templ_count;
+	int hide_private;
 };
 
 /*
@@ -310,27 +456,40 @@ struct sc_pkcs11_session {
 	CK_SESSION_HANDLE handle;
 	/* Session to this slot */
 	struct sc_pkcs11_slot *slot;
+	/* Token pool the session was opened on, NULL for the other sessions */
+	struct sc_pkcs11_slot *pool;
 	CK_FLAGS flags;
 	/* Notifications */
 	CK_NOTIFY notify_callback;
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Active message-based operations - one per type */
+	struct sc_pkcs11_message *message[SC_PKCS11_MESSAGE_MAX];
+	/* Digest contexts of finished operations, kept for reuse */
+	void *md_ctx_pool[SC_PKCS11_MD_CTX_POOL];
+	unsigned int md_ctx_pool_len;
+	/* Held by the host-only updates, if per_slot_locking is enabled */
+	void *lock;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
 /* Module variables */
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
-extern list_t sessions;
-extern list_t virtual_slots;
-extern list_t cards;
+/* Indexed by the session handle, closed sessions leave a NULL item */
+extern struct sc_pkcs11_array sessions;
+extern struct sc_pkcs11_array virtual_slots;
 
 /* Framework definitions */
 extern struct sc_pkcs11_framework_ops framework_pkcs15;
 extern struct sc_pkcs11_framework_ops framework_pkcs15init;
 
 void strcpy_bp(u8 *dst, const char *src, size_t dstsize);
+int sc_pkcs11_array_append(struct sc_pkcs11_array *, void *);
+int sc_pkcs11_array_find(const struct sc_pkcs11_array *, const void *);
+int sc_pkcs11_array_remove(struct sc_pkcs11_array *, const void *);
+void sc_pkcs11_array_free(struct sc_pkcs11_array *);
 CK_RV sc_to_cryptoki_error(int rc, const char *ctx);
 void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const char *function,
 		const char *info, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
@@ -339,16 +498,28 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 				info, pTemplate, ulCount)
 
 /* Slot and card handling functions */
-CK_RV card_removed(sc_reader_t *reader);
+CK_RV card_removed(sc_reader_t *reader, int keep);
+void card_forget_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
+void slot_prefetch_stop(void);
 CK_RV create_slot(sc_reader_t *reader);
+CK_RV create_pool_slot(void);
+int slot_is_pool_member(struct sc_pkcs11_slot *pool, struct sc_pkcs11_slot *slot);
+int slot_in_used_pool(struct sc_pkcs11_slot *slot);
 CK_RV initialize_reader(sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
+CK_RV card_detect_deferred(sc_reader_t *reader);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_index_add(struct sc_pkcs11_slot *, struct sc_pkcs11_object *, CK_ATTRIBUTE_PTR, CK_ULONG);
+void slot_index_remove(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_index_update(struct sc_pkcs11_slot *, struct sc_pkcs11_object *, CK_ATTRIBUTE_PTR, CK_ULONG);
+void slot_index_clear(struct sc_pkcs11_slot *);
+CK_RV slot_index_find(struct sc_pkcs11_slot *, CK_ATTRIBUTE_PTR, CK_ULONG,
+		struct sc_pkcs11_object ***, CK_ULONG *);
 int slot_get_logged_in_state(struct sc_pkcs11_slot *slot);
 
 /* Login tracking functions */
@@ -367,7 +538,13 @@ CK_RV session_start_operation(struct sc_pkcs11_session *,
 CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
+CK_RV session_start_message(struct sc_pkcs11_session *, int, int,
+			CK_MECHANISM_PTR, CK_OBJECT_HANDLE, CK_KEY_TYPE);
+CK_RV session_get_message(struct sc_pkcs11_session *, int,
+			struct sc_pkcs11_message **);
+CK_RV session_stop_message(struct sc_pkcs11_session *, int);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
+void sc_pkcs11_free_sessions(void);
 
 /* Generic secret key stuff */
 CK_RV sc_pkcs11_create_secret_key(struct sc_pkcs11_session *,
@@ -404,17 +581,32 @@ CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_sign_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign_batch_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_sign_batch(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+				CK_BYTE_PTR, CK_ULONG_PTR);
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_verif_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
+CK_RV sc_pkcs11_verif_recover_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_verif_recover(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_encr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 #endif
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_decr_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_decr_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
+int sc_pkcs11_decr_on_host(struct sc_pkcs11_session *);
 CK_RV sc_pkcs11_deri(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_KEY_TYPE,
-				CK_SESSION_HANDLE, CK_OBJECT_HANDLE, struct sc_pkcs11_object *);
+				CK_SESSION_HANDLE, CK_OBJECT_HANDLE, struct sc_pkcs11_object *,
+				CK_ULONG);
 sc_pkcs11_mechanism_type_t *sc_pkcs11_find_mechanism(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE, unsigned int);
 sc_pkcs11_mechanism_type_t *sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE,
@@ -426,6 +618,9 @@ void sc_pkcs11_release_operation(sc_pkcs11_operation_t **);
 CK_RV sc_pkcs11_register_generic_mechanisms(struct sc_pkcs11_card *);
 #ifdef ENABLE_OPENSSL
 void sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *);
+void sc_pkcs11_openssl_release_session(struct sc_pkcs11_session *);
+void sc_pkcs11_openssl_init(void);
+void sc_pkcs11_openssl_cleanup(void);
 #endif
 CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE, CK_MECHANISM_TYPE,
@@ -436,7 +631,26 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	const unsigned char *pubkey_params, int pubkey_params_len,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
-	unsigned char *signat, int signat_len);
+	unsigned char *signat, int signat_len, void **pkey);
+CK_RV sc_pkcs11_load_pkey(const unsigned char *pubkey, int pubkey_len, void **pkey);
+CK_RV sc_pkcs11_encrypt_data(void *pkey, CK_MECHANISM_TYPE mech,
+	CK_BYTE_PTR inp, CK_ULONG inp_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+CK_RV sc_pkcs11_verify_recover_data(void *pkey, CK_MECHANISM_TYPE mech,
+	CK_BYTE_PTR signat, CK_ULONG signat_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+void sc_pkcs11_free_pkey(void **pkey);
+
+/* Host DRBG seeded from the card, see pkcs11 random_drbg */
+#define SC_PKCS11_DRBG_SEED_LEN	48
+CK_RV sc_pkcs11_drbg_seed(struct sc_pkcs11_drbg **drbg,
+	const unsigned char *seed, size_t len);
+int sc_pkcs11_drbg_needs_seed(struct sc_pkcs11_drbg *drbg, unsigned int interval);
+void sc_pkcs11_drbg_generate(struct sc_pkcs11_drbg *drbg, CK_BYTE_PTR out, CK_ULONG len);
+void sc_pkcs11_drbg_free(struct sc_pkcs11_drbg *drbg);
+
+/* Host side KDF of ECDH, see CK_ECDH1_DERIVE_PARAMS */
+CK_RV sc_pkcs11_ecdh_kdf(CK_ULONG kdf, const unsigned char *z, size_t z_len,
+	const unsigned char *shared, size_t shared_len,
+	CK_BYTE_PTR out, CK_ULONG out_len);
 #endif
 
 /* Load configuration defaults */
@@ -447,6 +661,35 @@ CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+int sc_pkcs11_lock_enabled(void);
+CK_RV sc_pkcs11_lock_slot(struct sc_pkcs11_slot *, void **);
+CK_RV sc_pkcs11_lock_slot_bulk(struct sc_pkcs11_slot *, void **);
+void *sc_pkcs11_drain_slot(struct sc_pkcs11_slot *);
+void sc_pkcs11_undrain_slot(void *);
+void sc_pkcs11_unlock_slot(void *);
+CK_RV sc_pkcs11_create_slot_lock(struct sc_pkcs11_slot *);
+CK_RV sc_pkcs11_require_slot_lock(struct sc_pkcs11_slot *);
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_slot *);
+CK_RV sc_pkcs11_create_session_lock(struct sc_pkcs11_session *);
+void sc_pkcs11_free_session_lock(struct sc_pkcs11_session *);
+void sc_pkcs11_lock_session(struct sc_pkcs11_session *);
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *);
+CK_RV sc_pkcs11_create_mutex(void **);
+void sc_pkcs11_free_mutex(void **);
+void sc_pkcs11_lock_mutex(void *);
+void sc_pkcs11_unlock_mutex(void *);
+
+/* Monotonic time of the statistics, in microseconds (misc.c) */
+sc_timestamp_t sc_pkcs11_clock_us(void);
+
+/* Tracepoints of the Cryptoki functions, see libopensc/probes.h */
+#define SC_PKCS11_PROBE_ENTRY(handle) \
+	SC_PROBE_STR2(pkcs11__entry, __func__, (handle))
+#define SC_PKCS11_RETURN(rv) do { \
+		CK_RV probe_rv = (rv); \
+		SC_PROBE_STR2(pkcs11__return, __func__, probe_rv); \
+		return probe_rv; \
+	} while (0)
 
 #ifdef __cplusplus
 }
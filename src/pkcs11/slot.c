@@ -24,6 +24,11 @@
 
 #include <string.h>
 #include <stdlib.h>
+#if defined(PKCS11_THREAD_LOCKING) && defined(HAVE_PTHREAD)
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_PARALLEL_DETECT
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -37,14 +42,160 @@ static struct sc_pkcs11_framework_ops *frameworks[] = {
 	NULL
 };
 
+#ifdef HAVE_PARALLEL_DETECT
+/* While card_detect_all() binds several readers in parallel, this mutex
+ * serializes the changes of the slot list and of the sessions */
+static pthread_mutex_t detect_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int detect_parallel = 0;
+
+static void detect_lock(void)
+{
+	if (detect_parallel)
+		pthread_mutex_lock(&detect_mutex);
+}
+
+static void detect_unlock(void)
+{
+	if (detect_parallel)
+		pthread_mutex_unlock(&detect_mutex);
+}
+
+/*
+ * With `prefetch_certificates`, a thread reads the certificates of the
+ * tokens that were bound from the card while the application does not use
+ * it, one certificate per turn. It takes the lock of the slot like the
+ * cryptographic operations do, so the interactive calls waiting for the
+ * slot go first, and it only runs if the application asked for locking.
+ */
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetch_thread;
+static pid_t prefetch_pid = 0;	/* process that started the thread, 0 if none */
+static int prefetch_pending = 0;
+static int prefetch_stop = 0;
+
+static int prefetch_stopped(void)
+{
+	int stop;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	stop = prefetch_stop;
+	pthread_mutex_unlock(&prefetch_mutex);
+	return stop;
+}
+
+static void prefetch_slots(void)
+{
+	unsigned int i = 0;
+
+	while (!prefetch_stopped()) {
+		struct sc_pkcs11_slot *slot;
+		struct sc_pkcs11_card *p11card;
+		void *lock;
+		CK_RV rv;
+
+		if (sc_pkcs11_lock() != CKR_OK)
+			return;
+		if (i >= virtual_slots.count) {
+			sc_pkcs11_unlock();
+			return;
+		}
+		slot = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+		p11card = slot->p11card;
+		if (!p11card || !p11card->framework || !p11card->framework->prefetch) {
+			sc_pkcs11_unlock();
+			i++;
+			continue;
+		}
+		if (sc_pkcs11_lock_slot_bulk(slot, &lock) != CKR_OK) {
+			sc_pkcs11_unlock();
+			return;
+		}
+		/* the card may have been removed while waiting for the slot */
+		rv = CKR_TOKEN_NOT_PRESENT;
+		if (slot->p11card == p11card)
+			rv = p11card->framework->prefetch(slot);
+		sc_pkcs11_unlock_slot(lock);
+		if (rv != CKR_OK)
+			i++;
+	}
+}
+
+static void *prefetch_worker(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	while (!prefetch_stop) {
+		if (!prefetch_pending) {
+			pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+			continue;
+		}
+		prefetch_pending = 0;
+		pthread_mutex_unlock(&prefetch_mutex);
+		prefetch_slots();
+		pthread_mutex_lock(&prefetch_mutex);
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+
+	return NULL;
+}
+
+/* Called after a card was bound */
+static void prefetch_start(void)
+{
+	if (!sc_pkcs11_conf.prefetch_certificates || !sc_pkcs11_lock_enabled())
+		return;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	if (prefetch_pid != getpid() && !prefetch_stop) {
+		if (pthread_create(&prefetch_thread, NULL, prefetch_worker, NULL) == 0)
+			prefetch_pid = getpid();
+		else
+			sc_log(context, "Cannot start the prefetch thread");
+	}
+	prefetch_pending = 1;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+#else
+#define detect_lock()
+#define detect_unlock()
+#define prefetch_start()	do { } while (0)
+#endif
+
+/* Called without the global lock before the locks are destroyed */
+void slot_prefetch_stop(void)
+{
+#ifdef HAVE_PARALLEL_DETECT
+	pid_t pid;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	pid = prefetch_pid;
+	prefetch_stop = 1;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
+
+	/* after fork() the thread is left behind in the parent */
+	if (pid != 0 && pid == getpid())
+		pthread_join(prefetch_thread, NULL);
+
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_pid = 0;
+	prefetch_pending = 0;
+	prefetch_stop = 0;
+	pthread_mutex_unlock(&prefetch_mutex);
+#endif
+}
+
 static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
 {
 	unsigned int i;
 
 	/* Locate a slot related to the reader */
-	for (i = 0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader)
+	for (i = 0; i<virtual_slots.count; i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
+		if (slot->reader == reader && !(slot->flags & SC_PKCS11_SLOT_FLAG_POOL))
 			return slot;
 	}
 	return NULL;
@@ -68,18 +219,6 @@ static void init_slot_info(CK_SLOT_INFO_PTR pInfo, sc_reader_t *reader)
 	pInfo->firmwareVersion.minor = 0;
 }
 
-/* simclist helpers to locate interesting objects by ID */
-static int object_list_seeker(const void *el, const void *key)
-{
-	const struct sc_pkcs11_object *object = (struct sc_pkcs11_object *)el;
-
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (object->handle == *(CK_OBJECT_HANDLE*)key)
-		return 1;
-	return 0;
-}
-
 CK_RV create_slot(sc_reader_t *reader)
 {
 	/* find unused virtual hotplug slots */
@@ -87,35 +226,36 @@ CK_RV create_slot(sc_reader_t *reader)
 
 	/* create a new slot if no empty slot is available */
 	if (!slot) {
-		if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
+		if (virtual_slots.count >= sc_pkcs11_conf.max_virtual_slots)
 			return CKR_FUNCTION_FAILED;
 
 		slot = (struct sc_pkcs11_slot *)calloc(1, sizeof(struct sc_pkcs11_slot));
 		if (!slot)
 			return CKR_HOST_MEMORY;
 
-		list_append(&virtual_slots, slot);
-		if (0 != list_init(&slot->objects)) {
+		if (0 > sc_pkcs11_array_append(&virtual_slots, slot)) {
+			free(slot);
 			return CKR_HOST_MEMORY;
 		}
-		list_attributes_seeker(&slot->objects, object_list_seeker);
 
-		if (0 != list_init(&slot->logins)) {
+		if (CKR_OK != sc_pkcs11_create_slot_lock(slot)) {
 			return CKR_HOST_MEMORY;
 		}
 	} else {
 		/* reuse the old list of logins/objects since they should be empty */
-		list_t logins = slot->logins;
-		list_t objects = slot->objects;
+		struct sc_pkcs11_array logins = slot->logins;
+		struct sc_pkcs11_array objects = slot->objects;
+		void *lock = slot->lock;
 
 		memset(slot, 0, sizeof *slot);
 
 		slot->logins = logins;
 		slot->objects = objects;
+		slot->lock = lock;
 	}
 
 	slot->login_user = -1;
-	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
+	slot->id = (CK_SLOT_ID) sc_pkcs11_array_find(&virtual_slots, slot);
 	init_slot_info(&slot->slot_info, reader);
 	sc_log(context, "Initializing slot with id 0x%lx", slot->id);
 
@@ -130,6 +270,106 @@ CK_RV create_slot(sc_reader_t *reader)
 	return CKR_OK;
 }
 
+/*
+ * Token pool
+ *
+ * The `token_pool` option gathers the tokens with the given label, e.g.
+ * clones of one SmartCard-HSM, behind one more slot. The pool slot has no
+ * objects of its own: a session opened on it runs on the member with the
+ * fewest open sessions, so that the sessions of a multi-threaded
+ * application are spread over the cards and, with `per_slot_locking`, use
+ * them in parallel. The members are logged in and out together.
+ */
+int slot_is_pool_member(struct sc_pkcs11_slot *pool, struct sc_pkcs11_slot *slot)
+{
+	return slot->reader != NULL && (slot->slot_info.flags & CKF_TOKEN_PRESENT)
+		&& !memcmp(slot->token_info.label, pool->token_info.label, sizeof pool->token_info.label);
+}
+
+/* Whether the slot is a member of a pool that has open sessions, in which
+ * case it stays logged in even without sessions of its own */
+int slot_in_used_pool(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *pool = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+
+		if ((pool->flags & SC_PKCS11_SLOT_FLAG_POOL) && pool->nsessions
+				&& slot_is_pool_member(pool, slot))
+			return 1;
+	}
+	return 0;
+}
+
+/* The member of the pool with the fewest open sessions */
+static CK_RV pool_get_member(struct sc_pkcs11_slot *pool, struct sc_pkcs11_slot **slot)
+{
+	unsigned int i;
+
+	*slot = NULL;
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *tmp = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+
+		if (slot_is_pool_member(pool, tmp) && (*slot == NULL || tmp->nsessions < (*slot)->nsessions))
+			*slot = tmp;
+	}
+	if (*slot == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+
+	sc_log(context, "Token pool 0x%lx: using slot 0x%lx (%u sessions)", pool->id, (*slot)->id, (*slot)->nsessions);
+	return CKR_OK;
+}
+
+static void update_pool_slots(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		struct sc_pkcs11_slot *pool = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+		int present = 0;
+
+		if (!(pool->flags & SC_PKCS11_SLOT_FLAG_POOL))
+			continue;
+		for (j = 0; j < virtual_slots.count && !present; j++)
+			present = slot_is_pool_member(pool, virtual_slots.items[j]);
+
+		if (present && !(pool->slot_info.flags & CKF_TOKEN_PRESENT)) {
+			pool->slot_info.flags |= CKF_TOKEN_PRESENT;
+			pool->events = SC_EVENT_CARD_INSERTED;
+		} else if (!present && (pool->slot_info.flags & CKF_TOKEN_PRESENT)) {
+			pool->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+			pool->events = SC_EVENT_CARD_REMOVED;
+		}
+	}
+}
+
+CK_RV create_pool_slot(void)
+{
+	struct sc_pkcs11_slot *slot;
+
+	slot = (struct sc_pkcs11_slot *)calloc(1, sizeof(struct sc_pkcs11_slot));
+	if (!slot)
+		return CKR_HOST_MEMORY;
+
+	if (0 > sc_pkcs11_array_append(&virtual_slots, slot)) {
+		free(slot);
+		return CKR_HOST_MEMORY;
+	}
+
+	slot->login_user = -1;
+	slot->flags = SC_PKCS11_SLOT_FLAG_POOL;
+	slot->id = (CK_SLOT_ID) sc_pkcs11_array_find(&virtual_slots, slot);
+	init_slot_info(&slot->slot_info, NULL);
+	strcpy_bp(slot->slot_info.slotDescription, "Token pool", 64);
+	slot->slot_info.flags = CKF_REMOVABLE_DEVICE;
+	strcpy_bp(slot->token_info.label, sc_pkcs11_conf.token_pool, 32);
+	sc_log(context, "Created token pool slot 0x%lx for '%s'", slot->id, sc_pkcs11_conf.token_pool);
+
+	update_pool_slots();
+	return CKR_OK;
+}
+
 void empty_slot(struct sc_pkcs11_slot *slot)
 {
 	if (slot) {
@@ -140,9 +380,11 @@ void empty_slot(struct sc_pkcs11_slot *slot)
 			slot->reader = NULL;
 			init_slot_info(&slot->slot_info, NULL);
 		} else {
-			list_destroy(&slot->objects);
-			list_destroy(&slot->logins);
-			list_delete(&virtual_slots, slot);
+			slot_index_clear(slot);
+			sc_pkcs11_array_free(&slot->objects);
+			sc_pkcs11_array_free(&slot->logins);
+			sc_pkcs11_array_remove(&virtual_slots, slot);
+			sc_pkcs11_free_slot_lock(slot);
 			free(slot);
 		}
 	}
@@ -150,7 +392,7 @@ void empty_slot(struct sc_pkcs11_slot *slot)
 
 
 /* create slots associated with a reader, called whenever a reader is seen. */
-CK_RV initialize_reader(sc_reader_t *reader)
+static CK_RV create_reader_slots(sc_reader_t *reader)
 {
 	unsigned int i;
 	CK_RV rv;
@@ -161,10 +403,21 @@ CK_RV initialize_reader(sc_reader_t *reader)
 			return rv;
 	}
 
+	return CKR_OK;
+}
+
+CK_RV initialize_reader(sc_reader_t *reader)
+{
+	CK_RV rv;
+
+	rv = create_reader_slots(reader);
+	if (rv != CKR_OK)
+		return rv;
+
 	sc_log(context, "Initialize reader '%s': detect SC card presence", reader->name);
 	if (sc_detect_card_presence(reader))   {
 		sc_log(context, "Initialize reader '%s': detect PKCS11 card presence", reader->name);
-		card_detect(reader);
+		card_detect_deferred(reader);
 	}
 
 	sc_log(context, "Reader '%s' initialized", reader->name);
@@ -172,7 +425,132 @@ CK_RV initialize_reader(sc_reader_t *reader)
 }
 
 
-CK_RV card_removed(sc_reader_t * reader)
+/* Cards removed a short time ago, the latest last, see `keep_removed_cards` */
+static struct sc_pkcs11_array removed_cards;
+
+static void card_free(struct sc_pkcs11_card *p11card)
+{
+	unsigned int i;
+
+	p11card->framework->unbind(p11card);
+	sc_disconnect_card(p11card->card);
+	for (i=0; i < p11card->nmechanisms; ++i) {
+		if (p11card->mechanisms[i]->free_mech_data) {
+			p11card->mechanisms[i]->free_mech_data(p11card->mechanisms[i]->mech_data);
+		}
+		free(p11card->mechanisms[i]);
+	}
+	free(p11card->mechanisms);
+	free(p11card->mech_index);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_drbg_free(p11card->drbg);
+#endif
+	free(p11card);
+}
+
+/* Keeps the bound card to take it up again if it is inserted again soon */
+static int card_keep(struct sc_pkcs11_card *p11card)
+{
+	if (!sc_pkcs11_conf.keep_removed_cards || p11card->serial.len == 0
+			|| p11card->framework->park == NULL
+			|| p11card->framework->park(p11card) != CKR_OK
+			|| sc_detach_card(p11card->card) != SC_SUCCESS)
+		return 0;
+
+	p11card->removed = time(NULL);
+	if (removed_cards.count >= sc_pkcs11_conf.keep_removed_cards) {
+		struct sc_pkcs11_card *oldest = removed_cards.items[0];
+
+		sc_pkcs11_array_remove(&removed_cards, oldest);
+		card_free(oldest);
+	}
+	if (sc_pkcs11_array_append(&removed_cards, p11card) < 0)
+		return 0;
+	sc_log(context, "%s: card kept after removal", p11card->reader->name);
+	return 1;
+}
+
+/* Frees the kept cards of the reader, or of all readers if NULL */
+void card_forget_removed(sc_reader_t *reader)
+{
+	unsigned int i;
+
+	for (i = removed_cards.count; i-- > 0; ) {
+		struct sc_pkcs11_card *p11card = removed_cards.items[i];
+
+		if (reader == NULL || p11card->reader == reader) {
+			sc_pkcs11_array_remove(&removed_cards, p11card);
+			card_free(p11card);
+		}
+	}
+	if (removed_cards.count == 0)
+		sc_pkcs11_array_free(&removed_cards);
+}
+
+/* Takes up a kept card, if it is the one in the reader now */
+static struct sc_pkcs11_card *card_take_removed(sc_reader_t *reader)
+{
+	struct sc_pkcs11_card *p11card;
+	time_t now = time(NULL);
+	unsigned int i;
+
+	for (i = removed_cards.count; i-- > 0; ) {
+		detect_lock();
+		p11card = i < removed_cards.count ? removed_cards.items[i] : NULL;
+		if (p11card == NULL || p11card->reader != reader) {
+			detect_unlock();
+			continue;
+		}
+		if (now - p11card->removed > (time_t) sc_pkcs11_conf.removed_card_timeout) {
+			sc_pkcs11_array_remove(&removed_cards, p11card);
+			detect_unlock();
+			card_free(p11card);
+			continue;
+		}
+		detect_unlock();
+
+		/* cheap check before connecting */
+		if (reader->atr.len != p11card->card->atr.len
+				|| memcmp(reader->atr.value, p11card->card->atr.value, reader->atr.len) != 0)
+			continue;
+		if (sc_reattach_card(p11card->card, &p11card->serial) != SC_SUCCESS)
+			continue;
+
+		detect_lock();
+		sc_pkcs11_array_remove(&removed_cards, p11card);
+		detect_unlock();
+		sc_log(context, "%s: card taken up again", reader->name);
+		return p11card;
+	}
+
+	return NULL;
+}
+
+/* Creates the slots of a card taken up again from what was bound before */
+static CK_RV card_restore_tokens(struct sc_pkcs11_card *p11card)
+{
+	struct sc_app_info *app_generic = sc_pkcs15_get_application_by_type(p11card->card, "generic");
+	CK_RV rv = CKR_OK;
+	int j;
+
+	detect_lock();
+	if (app_generic || !p11card->card->app_count)
+		rv = p11card->framework->create_tokens(p11card, app_generic);
+	for (j = 0; rv == CKR_OK && j < p11card->card->app_count; j++) {
+		if (app_generic && app_generic == p11card->card->app[j])
+			continue;
+		if (j < 32 && !(p11card->bound_apps & (1U << j)))
+			continue;
+		rv = p11card->framework->create_tokens(p11card, p11card->card->app[j]);
+	}
+	detect_unlock();
+
+	return rv;
+}
+
+/* Releases the card in the reader and its slots. With `keep`, the card may
+ * be kept to be taken up again if it is inserted again */
+CK_RV card_removed(sc_reader_t * reader, int keep)
 {
 	unsigned int i;
 	struct sc_pkcs11_card *p11card = NULL;
@@ -180,8 +558,8 @@ CK_RV card_removed(sc_reader_t * reader)
 	sc_log(context, "%s: card removed", reader->name);
 
 
-	for (i=0; i < list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	for (i=0; i < virtual_slots.count; i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
 		if (slot->reader == reader) {
 			/* Save the "card" object */
 			if (slot->p11card)
@@ -190,19 +568,10 @@ CK_RV card_removed(sc_reader_t * reader)
 		}
 	}
 
-	if (p11card) {
-		p11card->framework->unbind(p11card);
-		sc_disconnect_card(p11card->card);
-		for (i=0; i < p11card->nmechanisms; ++i) {
-			if (p11card->mechanisms[i]->free_mech_data) {
-				p11card->mechanisms[i]->free_mech_data(p11card->mechanisms[i]->mech_data);
-			}
-			free(p11card->mechanisms[i]);
-		}
-		free(p11card->mechanisms);
-		free(p11card);
-	}
+	if (p11card && !(keep && card_keep(p11card)))
+		card_free(p11card);
 
+	update_pool_slots();
 	return CKR_OK;
 }
 
@@ -210,7 +579,8 @@ CK_RV card_removed(sc_reader_t * reader)
 CK_RV card_detect(sc_reader_t *reader)
 {
 	struct sc_pkcs11_card *p11card = NULL;
-	int free_p11card = 0;
+	int free_p11card = 0, bound = 0;
+	sc_timestamp_t bind_start;
 	int rc;
 	CK_RV rv;
 	unsigned int i;
@@ -226,7 +596,9 @@ again:
 	}
 	if (rc == 0) {
 		sc_log(context, "%s: card absent", reader->name);
-		card_removed(reader);	/* Release all resources */
+		detect_lock();
+		card_removed(reader, 1);	/* Release all resources */
+		detect_unlock();
 		return CKR_TOKEN_NOT_PRESENT;
 	}
 
@@ -238,20 +610,48 @@ again:
 		 * So better be fussy.
 		if (!retry--)
 			return CKR_TOKEN_NOT_PRESENT; */
-		card_removed(reader);
+		detect_lock();
+		card_removed(reader, 1);
+		detect_unlock();
 		goto again;
 	}
 
 	/* Locate a slot related to the reader */
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	detect_lock();
+	for (i=0; i<virtual_slots.count; i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
 		if (slot->reader == reader) {
 			p11card = slot->p11card;
 			break;
 		}
 	}
+	detect_unlock();
+
+	/* Take up the card again if it was removed a short time ago */
+	if (p11card == NULL && removed_cards.count > 0) {
+		p11card = card_take_removed(reader);
+		if (p11card != NULL) {
+			rv = card_restore_tokens(p11card);
+			if (rv != CKR_OK) {
+				sc_log(context, "%s: cannot restore the tokens: 0x%lX", reader->name, rv);
+				detect_lock();
+				for (i = 0; i < virtual_slots.count; i++)
+					if (((sc_pkcs11_slot_t *) virtual_slots.items[i])->p11card == p11card)
+						break;
+				if (i < virtual_slots.count)
+					card_removed(reader, 0);
+				else
+					card_free(p11card);
+				detect_unlock();
+				return rv;
+			}
+			sc_log(context, "%s: Detection ended", reader->name);
+			return CKR_OK;
+		}
+	}
 
 	/* Detect the card if it's not known already */
+	bind_start = sc_pkcs11_clock_us();
 	if (p11card == NULL) {
 		sc_log(context, "%s: First seen the card ", reader->name);
 		p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
@@ -275,11 +675,13 @@ again:
 		 * metadata may have changed. We re-initialize the metadata for every
 		 * slot of this reader here. */
 		if (reader->flags & SC_READER_ENABLE_ESCAPE) {
-			for (i = 0; i<list_size(&virtual_slots); i++) {
-				sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+			detect_lock();
+			for (i = 0; i<virtual_slots.count; i++) {
+				sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
 				if (slot->reader == reader)
 					init_slot_info(&slot->slot_info, reader);
 			}
+			detect_unlock();
 		}
 
 		sc_log(context, "%s: Connected SC card %p", reader->name, p11card->card);
@@ -305,6 +707,7 @@ again:
 
 		/* Initialize framework */
 		sc_log(context, "%s: Detected framework %d. Creating tokens.", reader->name, i);
+		bound = 1;
 		/* Bind 'generic' application or (emulated?) card without applications */
 		if (app_generic || !p11card->card->app_count)   {
 			scconf_block *conf_block = NULL;
@@ -333,7 +736,9 @@ again:
 			}
 
 			sc_log(context, "%s: Creating 'generic' token.", reader->name);
+			detect_lock();
 			rv = frameworks[i]->create_tokens(p11card, app_generic);
+			detect_unlock();
 			if (rv != CKR_OK)   {
 				sc_log(context,
 				       "%s: create 'generic' token error 0x%lX",
@@ -357,9 +762,13 @@ again:
 				       reader->name, app_name, rv);
 				continue;
 			}
+			if (j < 32)
+				p11card->bound_apps |= 1U << j;
 
 			sc_log(context, "%s: Creating %s token.", reader->name, app_name);
+			detect_lock();
 			rv = frameworks[i]->create_tokens(p11card, app_info);
+			detect_unlock();
 			if (rv != CKR_OK)   {
 				sc_log(context,
 				       "%s: create %s token error 0x%lX",
@@ -369,34 +778,202 @@ again:
 		}
 	}
 
+	/* identifies the card if it is inserted again after it was removed */
+	if (bound && sc_pkcs11_conf.keep_removed_cards
+			&& sc_card_ctl(p11card->card, SC_CARDCTL_GET_SERIALNR, &p11card->serial) != SC_SUCCESS)
+		p11card->serial.len = 0;
+
+	if (bound) {
+		sc_timestamp_t bind_time = sc_pkcs11_clock_us() - bind_start;
+
+		detect_lock();
+		for (i = 0; i < virtual_slots.count; i++) {
+			sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
+			if (slot->reader == reader) {
+				slot->stats.binds++;
+				slot->stats.bind_time += bind_time;
+			}
+		}
+		detect_unlock();
+	}
+
 	sc_log(context, "%s: Detection ended", reader->name);
+	if (bound && p11card->framework->prefetch)
+		prefetch_start();
 	return CKR_OK;
 
 fail:
 	if (free_p11card) {
+		detect_lock();
 		if (p11card->card != NULL)
 			sc_disconnect_card(p11card->card);
 		if (p11card->framework)
 			p11card->framework->unbind(p11card);
 		free(p11card);
+		detect_unlock();
 	}
 
 	return rv;
 }
 
 
+#ifdef HAVE_PARALLEL_DETECT
+struct detect_queue {
+	sc_reader_t **readers;
+	size_t count;
+	size_t next;
+};
+
+static void *detect_worker(void *arg)
+{
+	struct detect_queue *queue = (struct detect_queue *) arg;
+	sc_reader_t *reader;
+
+	for (;;) {
+		pthread_mutex_lock(&detect_mutex);
+		reader = queue->next < queue->count ? queue->readers[queue->next++] : NULL;
+		pthread_mutex_unlock(&detect_mutex);
+		if (reader == NULL)
+			break;
+		card_detect(reader);
+	}
+
+	return NULL;
+}
+
+/* Bind the cards of several readers on a small pool of threads. The slots
+ * of the readers were created beforehand in the order of the readers, so the
+ * slot IDs do not depend on the order in which the binding finishes. */
+static CK_RV card_detect_parallel(void)
+{
+	struct detect_queue queue;
+	pthread_t *threads = NULL;
+	size_t i, nthreads = 0;
+
+	queue.count = 0;
+	queue.next = 0;
+	queue.readers = calloc(sc_ctx_get_reader_count(context), sizeof(sc_reader_t *));
+	if (queue.readers == NULL)
+		return CKR_HOST_MEMORY;
+
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+
+		if (reader->flags & SC_READER_REMOVED) {
+			struct sc_pkcs11_slot *slot;
+			card_removed(reader, 0);
+			card_forget_removed(reader);
+			while ((slot = reader_get_slot(reader))) {
+				empty_slot(slot);
+			}
+			_sc_delete_reader(context, reader);
+			i--;
+			continue;
+		}
+		if (!reader_get_slot(reader)) {
+			if (create_reader_slots(reader) != CKR_OK)
+				continue;
+			sc_log(context, "Reader '%s' initialized", reader->name);
+		}
+		queue.readers[queue.count++] = reader;
+	}
+
+	if (queue.count > 1) {
+		nthreads = sc_pkcs11_conf.detect_threads;
+		if (nthreads > queue.count)
+			nthreads = queue.count;
+		/* the calling thread is one of the workers */
+		threads = calloc(nthreads - 1, sizeof *threads);
+		if (threads == NULL)
+			nthreads = 1;
+	}
+
+	sc_log(context, "Detect cards in %"SC_FORMAT_LEN_SIZE_T"u readers with %"SC_FORMAT_LEN_SIZE_T"u threads",
+			queue.count, nthreads ? nthreads : 1);
+	detect_parallel = 1;
+	for (i = 0; i + 1 < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, detect_worker, &queue) != 0)
+			break;
+	}
+	nthreads = i;
+	detect_worker(&queue);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	detect_parallel = 0;
+
+	free(threads);
+	free(queue.readers);
+	sc_log(context, "All cards detected");
+	return CKR_OK;
+}
+#endif
+
+/*
+ * card_detect(), except that with `lazy_detection` a card that is not bound
+ * yet is only noted on the first slot of its reader, which shows the token
+ * as present. slot_get_token() binds the card when the slot is used.
+ */
+CK_RV card_detect_deferred(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot;
+	unsigned int i;
+	int rc;
+
+	if (!sc_pkcs11_conf.lazy_detection)
+		return card_detect(reader);
+
+	for (i = 0; i < virtual_slots.count; i++) {
+		slot = (struct sc_pkcs11_slot *) virtual_slots.items[i];
+		if (slot->reader == reader && slot->p11card)
+			return card_detect(reader);
+	}
+	slot = reader_get_slot(reader);
+	if (slot == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+
+	rc = sc_detect_card_presence(reader);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, NULL);
+	if (rc & SC_READER_CARD_PRESENT) {
+		if (!(slot->flags & SC_PKCS11_SLOT_FLAG_PENDING)) {
+			sc_log(context, "%s: card found, it is bound on first use", reader->name);
+			slot->flags |= SC_PKCS11_SLOT_FLAG_PENDING;
+			slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+			slot->events = SC_EVENT_CARD_INSERTED;
+		}
+		return CKR_OK;
+	}
+	if (slot->flags & SC_PKCS11_SLOT_FLAG_PENDING) {
+		slot->flags &= ~SC_PKCS11_SLOT_FLAG_PENDING;
+		slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+		slot->events = SC_EVENT_CARD_REMOVED;
+	}
+	return CKR_TOKEN_NOT_PRESENT;
+}
+
 CK_RV
 card_detect_all(void)
 {
 	unsigned int i;
 
+#ifdef HAVE_PARALLEL_DETECT
+	if (sc_pkcs11_conf.detect_threads > 1 && !sc_pkcs11_conf.lazy_detection
+			&& sc_ctx_get_reader_count(context) > 1) {
+		CK_RV rv = card_detect_parallel();
+
+		update_pool_slots();
+		return rv;
+	}
+#endif
+
 	sc_log(context, "Detect all cards");
 	/* Detect cards in all initialized readers */
 	for (i=0; i< sc_ctx_get_reader_count(context); i++) {
 		sc_reader_t *reader = sc_ctx_get_reader(context, i);
 		if (reader->flags & SC_READER_REMOVED) {
 			struct sc_pkcs11_slot *slot;
-			card_removed(reader);
+			card_removed(reader, 0);
+			card_forget_removed(reader);
 			while ((slot = reader_get_slot(reader))) {
 				empty_slot(slot);
 			}
@@ -406,9 +983,10 @@ card_detect_all(void)
 			if (!reader_get_slot(reader))
 				initialize_reader(reader);
 			else
-				card_detect(sc_ctx_get_reader(context, i));
+				card_detect_deferred(reader);
 		}
 	}
+	update_pool_slots();
 	sc_log(context, "All cards detected");
 	return CKR_OK;
 }
@@ -420,12 +998,12 @@ CK_RV slot_allocate(struct sc_pkcs11_slot ** slot, struct sc_pkcs11_card * p11ca
 	struct sc_pkcs11_slot *tmp_slot = NULL;
 
 	/* Locate a free slot for this reader */
-	for (i=0; i< list_size(&virtual_slots); i++) {
-		tmp_slot = (struct sc_pkcs11_slot *)list_get_at(&virtual_slots, i);
+	for (i=0; i< virtual_slots.count; i++) {
+		tmp_slot = (struct sc_pkcs11_slot *)virtual_slots.items[i];
 		if (tmp_slot->reader == p11card->reader && tmp_slot->p11card == NULL)
 			break;
 	}
-	if (!tmp_slot || (i == list_size(&virtual_slots)))
+	if (!tmp_slot || (i == virtual_slots.count))
 		return CKR_FUNCTION_FAILED;
 	sc_log(context, "Allocated slot 0x%lx for card in reader %s", tmp_slot->id, p11card->reader->name);
 	tmp_slot->p11card = p11card;
@@ -436,10 +1014,24 @@ CK_RV slot_allocate(struct sc_pkcs11_slot ** slot, struct sc_pkcs11_card * p11ca
 
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 {
+	unsigned int i;
+
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	/* The ID is the position of the slot when it was created; it only
+	 * differs while a slot created before it was removed */
+	*slot = NULL;
+	if (id < virtual_slots.count
+			&& ((struct sc_pkcs11_slot *) virtual_slots.items[id])->id == id) {
+		*slot = virtual_slots.items[id];
+	} else {
+		for (i = 0; i < virtual_slots.count; i++)
+			if (((struct sc_pkcs11_slot *) virtual_slots.items[i])->id == id) {
+				*slot = virtual_slots.items[i];
+				break;
+			}
+	}
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
@@ -454,6 +1046,14 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (rv != CKR_OK)
 		return rv;
 
+	if ((*slot)->flags & SC_PKCS11_SLOT_FLAG_POOL)
+		return pool_get_member(*slot, slot);
+
+	if ((*slot)->flags & SC_PKCS11_SLOT_FLAG_PENDING) {
+		/* bind the card noted by card_detect_deferred() */
+		(*slot)->flags &= ~SC_PKCS11_SLOT_FLAG_PENDING;
+		(*slot)->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+	}
 	if (!((*slot)->slot_info.flags & CKF_TOKEN_PRESENT)) {
 		if ((*slot)->reader == NULL)
 			return CKR_TOKEN_NOT_PRESENT;
@@ -476,21 +1076,29 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	int rv, token_was_present;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_object *object;
+	void *slot_lock;
+	unsigned int i;
 
 	sc_log(context, "slot_token_removed(0x%lx)", id);
 	rv = slot_get_slot(id, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
+	/* Wait for the operations still running on this slot */
+	slot_lock = sc_pkcs11_drain_slot(slot);
+
 	token_was_present = (slot->slot_info.flags & CKF_TOKEN_PRESENT);
 
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
-	while ((object = list_fetch(&slot->objects))) {
+	slot_index_clear(slot);
+	for (i = 0; i < slot->objects.count; i++) {
+		object = slot->objects.items[i];
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	slot->objects.count = 0;
 
 	/* Release framework stuff */
 	if (slot->p11card != NULL) {
@@ -512,6 +1120,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 
 	memset(&slot->token_info, 0, sizeof slot->token_info);
 
+	sc_pkcs11_undrain_slot(slot_lock);
 	return CKR_OK;
 }
 
@@ -522,8 +1131,8 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	LOG_FUNC_CALLED(context);
 
 	card_detect_all();
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+	for (i=0; i<virtual_slots.count; i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) virtual_slots.items[i];
 		sc_log(context, "slot 0x%lx token: %lu events: 0x%02X",
 		       slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT),
 		       slot->events);
@@ -542,3 +1151,357 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	LOG_FUNC_RETURN(context, CKR_NO_EVENT);
 }
+
+/*
+ * Attribute index of the slot objects
+ */
+struct sc_pkcs11_index_entry {
+	struct sc_pkcs11_object *object;
+	CK_ATTRIBUTE_TYPE type;
+	unsigned int hash;
+	unsigned long seq;
+	struct sc_pkcs11_index_entry *next;
+};
+
+#define SC_PKCS11_INDEX_MIN_SIZE	64
+
+/* Attributes in the order of preference for a lookup */
+static const CK_ATTRIBUTE_TYPE index_types[] = { CKA_ID, CKA_LABEL, CKA_CLASS };
+#define INDEX_TYPES_COUNT	(sizeof index_types / sizeof index_types[0])
+
+static unsigned int index_hash(CK_ATTRIBUTE_TYPE type, const void *value, CK_ULONG len)
+{
+	const unsigned char *p = value;
+	unsigned int hash = 2166136261U ^ (unsigned int) type;
+	CK_ULONG i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void index_grow(struct sc_pkcs11_index *index)
+{
+	struct sc_pkcs11_index_entry **buckets, *entry, *next;
+	unsigned int size, i;
+
+	size = index->size ? index->size * 2 : SC_PKCS11_INDEX_MIN_SIZE;
+	buckets = calloc(size, sizeof *buckets);
+	if (buckets == NULL)
+		/* Keep the current table, it only gets slower */
+		return;
+
+	for (i = 0; i < index->size; i++) {
+		for (entry = index->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->size = size;
+}
+
+static int index_type_supported(CK_ATTRIBUTE_TYPE type)
+{
+	unsigned int i;
+
+	for (i = 0; i < INDEX_TYPES_COUNT; i++)
+		if (index_types[i] == type)
+			return 1;
+	return 0;
+}
+
+static CK_RV index_add_entries(struct sc_pkcs11_index *index, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attrs, CK_ULONG count)
+{
+	struct sc_pkcs11_index_entry *entries[INDEX_TYPES_COUNT];
+	unsigned int i;
+	CK_ULONG j;
+
+	if (index->size == 0 || index->entries >= 2 * index->size)
+		index_grow(index);
+	if (index->size == 0)
+		return CKR_HOST_MEMORY;
+
+	for (i = 0; i < INDEX_TYPES_COUNT; i++) {
+		entries[i] = calloc(1, sizeof *entries[i]);
+		if (entries[i] == NULL) {
+			while (i--)
+				free(entries[i]);
+			return CKR_HOST_MEMORY;
+		}
+	}
+
+	index->seq++;
+	for (i = 0; i < INDEX_TYPES_COUNT; i++) {
+		struct sc_pkcs11_index_entry *entry = entries[i];
+		CK_ATTRIBUTE_PTR attr = NULL;
+
+		for (j = 0; j < count; j++)
+			if (attrs[j].type == index_types[i] && attrs[j].pValue != NULL)
+				attr = &attrs[j];
+
+		entry->object = object;
+		entry->type = index_types[i];
+		entry->seq = index->seq;
+		if (attr == NULL) {
+			entry->next = index->unknown;
+			index->unknown = entry;
+		} else {
+			entry->hash = index_hash(attr->type, attr->pValue, attr->ulValueLen);
+			entry->next = index->buckets[entry->hash & (index->size - 1)];
+			index->buckets[entry->hash & (index->size - 1)] = entry;
+			index->entries++;
+		}
+	}
+
+	return CKR_OK;
+}
+
+static int index_remove_from(struct sc_pkcs11_index_entry **head,
+		struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_index_entry **pp = head, *entry;
+	int removed = 0;
+
+	while ((entry = *pp) != NULL) {
+		if (entry->object == object) {
+			*pp = entry->next;
+			free(entry);
+			removed++;
+		} else {
+			pp = &entry->next;
+		}
+	}
+	return removed;
+}
+
+static void index_remove_entries(struct sc_pkcs11_index *index, struct sc_pkcs11_object *object)
+{
+	unsigned int i;
+
+	for (i = 0; i < index->size; i++)
+		index->entries -= index_remove_from(&index->buckets[i], object);
+	index_remove_from(&index->unknown, object);
+}
+
+static void index_free(struct sc_pkcs11_index *index)
+{
+	struct sc_pkcs11_index_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < index->size; i++) {
+		while ((entry = index->buckets[i]) != NULL) {
+			index->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	while ((entry = index->unknown) != NULL) {
+		index->unknown = entry->next;
+		free(entry);
+	}
+	free(index->buckets);
+	memset(index, 0, sizeof *index);
+}
+
+/*
+ * Add an object of the slot to the index of its card. The known values of
+ * the indexed attributes are passed in `attrs', an attribute missing from
+ * `attrs' or passed without a value is treated as unknown. An object which
+ * another slot of the card already added is only made visible to the slot.
+ */
+CK_RV slot_index_add(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attrs, CK_ULONG count)
+{
+	struct sc_pkcs11_index *index;
+	unsigned int bit;
+	CK_RV rv;
+
+	if (slot->p11card == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	index = &slot->p11card->index;
+
+	if (slot->index.bit == 0) {
+		for (bit = 1; bit != 0 && (index->slots & bit); bit <<= 1)
+			;
+		if (bit == 0)
+			/* More slots than bits: the slot is searched without the index */
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		index->slots |= bit;
+		slot->index.bit = bit;
+	}
+	if (object->index_slots & slot->index.bit)
+		return CKR_OK;
+
+	if (object->index_slots == 0) {
+		rv = index_add_entries(index, object, attrs, count);
+		if (rv != CKR_OK)
+			return rv;
+	}
+	object->index_slots |= slot->index.bit;
+	slot->index.count++;
+	slot->index.generation++;
+
+	return CKR_OK;
+}
+
+void slot_index_remove(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	slot->index.generation++;
+	if (slot->p11card == NULL || !(object->index_slots & slot->index.bit))
+		return;
+
+	object->index_slots &= ~slot->index.bit;
+	if (object->index_slots == 0)
+		index_remove_entries(&slot->p11card->index, object);
+	if (slot->index.count)
+		slot->index.count--;
+}
+
+void slot_index_clear(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_index *index;
+	struct sc_pkcs11_object *object;
+	unsigned int i;
+
+	slot->index.generation++;
+	if (slot->p11card != NULL && slot->index.bit != 0) {
+		index = &slot->p11card->index;
+		for (i = 0; i < slot->objects.count; i++) {
+			object = slot->objects.items[i];
+			if (!(object->index_slots & slot->index.bit))
+				continue;
+			object->index_slots &= ~slot->index.bit;
+			if (object->index_slots == 0)
+				index_remove_entries(index, object);
+		}
+		index->slots &= ~slot->index.bit;
+		if (index->slots == 0)
+			index_free(index);
+	}
+	slot->index.bit = 0;
+	slot->index.count = 0;
+}
+
+static int index_entry_cmp(const void *a, const void *b)
+{
+	const struct sc_pkcs11_index_entry *ea = *(struct sc_pkcs11_index_entry * const *) a;
+	const struct sc_pkcs11_index_entry *eb = *(struct sc_pkcs11_index_entry * const *) b;
+
+	return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+/*
+ * Look up the candidates for the template. On success `objects' holds the
+ * objects of the slot which may match, in the order they were first added
+ * to the index of the card; they still have to be compared against the full template. Returns
+ * CKR_FUNCTION_NOT_SUPPORTED if the index can not be used for the template
+ * and the caller has to scan all objects of the slot.
+ */
+CK_RV slot_index_find(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		struct sc_pkcs11_object ***objects, CK_ULONG *count)
+{
+	struct sc_pkcs11_index *index;
+	struct sc_pkcs11_index_entry *entry, **found = NULL;
+	CK_ATTRIBUTE_PTR attr = NULL;
+	CK_ULONG num = 0, allocated = 0, i, j;
+	unsigned int hash, n;
+
+	*objects = NULL;
+	*count = 0;
+
+	/* The index needs to cover every object of the slot */
+	if (slot->p11card == NULL || slot->index.bit == 0
+			|| slot->index.count != slot->objects.count)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	index = &slot->p11card->index;
+	if (index->size == 0)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	for (n = 0; n < INDEX_TYPES_COUNT && attr == NULL; n++)
+		for (j = 0; j < ulCount; j++)
+			if (pTemplate[j].type == index_types[n] && pTemplate[j].pValue != NULL) {
+				attr = &pTemplate[j];
+				break;
+			}
+	if (attr == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	hash = index_hash(attr->type, attr->pValue, attr->ulValueLen);
+	for (n = 0; n < 2; n++) {
+		entry = n ? index->unknown : index->buckets[hash & (index->size - 1)];
+		for (; entry != NULL; entry = entry->next) {
+			if (entry->type != attr->type || (!n && entry->hash != hash)
+					|| !(entry->object->index_slots & slot->index.bit))
+				continue;
+			if (num >= allocated) {
+				struct sc_pkcs11_index_entry **tmp;
+
+				allocated = allocated ? allocated * 2 : 16;
+				tmp = realloc(found, allocated * sizeof *found);
+				if (tmp == NULL) {
+					free(found);
+					return CKR_HOST_MEMORY;
+				}
+				found = tmp;
+			}
+			found[num++] = entry;
+		}
+	}
+
+	if (num) {
+		qsort(found, num, sizeof *found, index_entry_cmp);
+		*objects = malloc(num * sizeof **objects);
+		if (*objects == NULL) {
+			free(found);
+			return CKR_HOST_MEMORY;
+		}
+		for (i = 0; i < num; i++)
+			(*objects)[i] = found[i]->object;
+	}
+	*count = num;
+	free(found);
+
+	return CKR_OK;
+}
+
+/*
+ * Called after attributes of an indexed object were modified: the values
+ * of the modified indexed attributes are not known any more.
+ */
+void slot_index_update(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct sc_pkcs11_index *index;
+	unsigned int i;
+	CK_ULONG j;
+
+	for (j = 0; j < ulCount; j++)
+		if (index_type_supported(pTemplate[j].type))
+			break;
+	if (j == ulCount || slot->p11card == NULL || object->index_slots == 0)
+		return;
+
+	/* Move the entries, which all slots showing the object share, to the
+	 * entries without a known value */
+	index = &slot->p11card->index;
+	for (i = 0; i < index->size; i++) {
+		struct sc_pkcs11_index_entry **pp = &index->buckets[i], *entry;
+
+		while ((entry = *pp) != NULL) {
+			if (entry->object == object) {
+				*pp = entry->next;
+				entry->next = index->unknown;
+				index->unknown = entry;
+				index->entries--;
+			} else {
+				pp = &entry->next;
+			}
+		}
+	}
+	slot->index.generation++;
+}
@@ -398,6 +398,23 @@ extern int	sc_pkcs15init_delete_by_path(struct sc_profile *,
 				struct sc_pkcs15_card *, const struct sc_path *);
 extern int	sc_pkcs15init_update_any_df(struct sc_pkcs15_card *, struct sc_profile *,
 			struct sc_pkcs15_df *, int);
+/* Group several updates of the card: the DFs, ODF and TokenInfo changed
+ * in between are written once by the outermost commit.
+ */
+extern int	sc_pkcs15init_begin_transaction(struct sc_pkcs15_card *,
+			struct sc_profile *);
+extern int	sc_pkcs15init_commit_transaction(struct sc_pkcs15_card *,
+			struct sc_profile *);
+/* Content of the files as last read from or written to the card,
+ * kept until the profile is released or the files are deleted.
+ */
+struct df_image;
+extern struct df_image *sc_pkcs15init_find_df_image(struct sc_profile *,
+			const struct sc_path *);
+extern struct df_image *sc_pkcs15init_keep_df_image(struct sc_profile *,
+			const struct sc_path *, unsigned char *, size_t);
+extern void	sc_pkcs15init_forget_df_image(struct sc_profile *,
+			const struct sc_path *);
 extern int	sc_pkcs15init_select_intrinsic_id(struct sc_pkcs15_card *, struct sc_profile *,
 			int, struct sc_pkcs15_id *, void *);
 
@@ -428,6 +428,13 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 	struct sc_context *ctx = profile->card->ctx;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->transaction.depth)   {
+		sc_log(ctx, "Unbind within a transaction: commit it");
+		profile->transaction.depth = 1;
+		r = sc_pkcs15init_commit_transaction(profile->transaction.p15card, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to commit the pending updates: %s", sc_strerror(r));
+	}
 	sc_log(ctx, "Pksc15init Unbind: %i:%p:%i", profile->dirty, profile->p15_data, profile->pkcs15.do_last_update);
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
@@ -517,6 +524,7 @@ sc_pkcs15init_erase_card(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	if (profile->ops->erase_card == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
+	sc_pkcs15init_forget_df_image(profile, NULL);
 	rv = profile->ops->erase_card(profile, p15card);
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -571,6 +579,7 @@ sc_pkcs15init_delete_by_path(struct sc_profile *profile, struct sc_pkcs15_card *
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "trying to delete '%s'", sc_print_path(file_path));
+	sc_pkcs15init_forget_df_image(profile, NULL);
 
 	/* For some cards, to delete file should be satisfied the 'DELETE' ACL of the file itself,
 	 * for the others the 'DELETE' ACL of parent.
@@ -653,6 +662,7 @@ sc_pkcs15init_rmdir(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 	if (df == NULL)
 		return SC_ERROR_INTERNAL;
 	sc_log(ctx, "sc_pkcs15init_rmdir(%s)", sc_print_path(&df->path));
+	sc_pkcs15init_forget_df_image(profile, NULL);
 
 	if (df->type == SC_FILE_TYPE_DF) {
 		r = sc_pkcs15init_authenticate(profile, p15card, df, SC_AC_OP_LIST_FILES);
@@ -1440,7 +1450,7 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 	struct sc_pkcs15_object *object = NULL;
 	struct sc_pkcs15_prkey_info *key_info = NULL;
 	struct sc_pkcs15_pubkey *pubkey = NULL;
-	int r, caller_supplied_id = 0;
+	int r, rv, caller_supplied_id = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	/* check supported key size */
@@ -1534,18 +1544,32 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 	r = sc_pkcs15_encode_pubkey(ctx, pubkey, &object->content.value, &object->content.len);
 	LOG_TEST_RET(ctx, r, "Failed to encode public key");
 
+	/* PrKDF and PuKDF are written once both objects are added */
+	r = sc_pkcs15init_begin_transaction(p15card, profile);
+	LOG_TEST_RET(ctx, r, "Failed to start the update of the DFs");
+
 	r = sc_pkcs15init_add_object(p15card, profile, SC_PKCS15_PRKDF, object);
-	LOG_TEST_RET(ctx, r, "Failed to add generated private key object");
+	if (r < 0)
+		sc_log(ctx, "Failed to add generated private key object");
 
 	if (!r && profile->ops->emu_store_data)   {
 		r = profile->ops->emu_store_data(p15card, profile, object, NULL, NULL);
 		if (r == SC_ERROR_NOT_IMPLEMENTED)
 			r = SC_SUCCESS;
-		LOG_TEST_RET(ctx, r, "Card specific 'store data' failed");
+		if (r < 0)
+			sc_log(ctx, "Card specific 'store data' failed");
+	}
+
+	if (r >= 0)   {
+		r = sc_pkcs15init_store_public_key(p15card, profile, &pubkey_args, NULL);
+		if (r < 0)
+			sc_log(ctx, "Failed to store public key");
 	}
 
-	r = sc_pkcs15init_store_public_key(p15card, profile, &pubkey_args, NULL);
-	LOG_TEST_RET(ctx, r, "Failed to store public key");
+	rv = sc_pkcs15init_commit_transaction(p15card, profile);
+	if (r >= 0)
+		r = rv;
+	LOG_TEST_RET(ctx, r, "Failed to store the generated key");
 
 	if (res_obj)
 		*res_obj = object;
@@ -2972,6 +2996,48 @@ sc_pkcs15init_update_dir(struct sc_pkcs15_card *p15card,
 }
 
 
+/*
+ * Replace the cached content of a file written to the card, instead of
+ * leaving a stale entry in the file cache.
+ */
+static void
+sc_pkcs15init_cache_written(struct sc_pkcs15_card *p15card, const struct sc_path *path,
+		const void *data, size_t datalen)
+{
+	if (!p15card->opts.use_file_cache)
+		return;
+	if (sc_pkcs15_update_cached_file(p15card, path, data, datalen) != SC_SUCCESS)
+		sc_log(p15card->card->ctx, "Cannot update the cache of %s", sc_print_path(path));
+}
+
+
+/*
+ * Set a new lastUpdate. The names of the cache files depend on it, so they
+ * are moved along: what pkcs15init wrote was written through to the cache.
+ */
+static int
+sc_pkcs15init_set_lastupdate(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_last_update *last_update = &p15card->tokeninfo->last_update;
+	char *old_update = NULL;
+	int r;
+
+	if (p15card->opts.use_file_cache)   {
+		const char *current = sc_pkcs15_get_lastupdate(p15card);
+
+		if (current)
+			old_update = strdup(current);
+	}
+	free(last_update->gtime);
+	last_update->gtime = NULL;
+	r = sc_pkcs15_get_generalized_time(p15card->card->ctx, &last_update->gtime);
+	if (r == SC_SUCCESS && p15card->opts.use_file_cache)
+		sc_pkcs15_move_cache(p15card, old_update);
+	free(old_update);
+	return r;
+}
+
+
 static int
 sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
 {
@@ -2981,13 +3047,13 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 	int		rv;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->transaction.depth)   {
+		profile->transaction.tokeninfo = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
 
 	/* set lastUpdate field */
-	if (p15card->tokeninfo->last_update.gtime != NULL)   {
-		free(p15card->tokeninfo->last_update.gtime);
-		p15card->tokeninfo->last_update.gtime = NULL;
-	}
-	rv = sc_pkcs15_get_generalized_time(ctx, &p15card->tokeninfo->last_update.gtime);
+	rv = sc_pkcs15init_set_lastupdate(p15card);
 	LOG_TEST_RET(ctx, rv, "Cannot allocate generalized time string");
 
 	if (profile->ops->emu_update_tokeninfo)
@@ -3028,9 +3094,7 @@ sc_pkcs15init_update_lastupdate(struct sc_pkcs15_card *p15card, struct sc_profil
 		size_t buflen;
 
 		/* update 'lastUpdate' file */
-		if (last_update->gtime != NULL)
-			free(last_update->gtime);
-		r = sc_pkcs15_get_generalized_time(ctx, &last_update->gtime);
+		r = sc_pkcs15init_set_lastupdate(p15card);
 		LOG_TEST_RET(ctx, r, "Cannot allocate generalized time string");
 
 		sc_copy_asn1_entry(c_asn1_last_update, asn1_last_update);
@@ -3073,25 +3137,160 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/* Changes closer than this are written with a single UPDATE BINARY */
+#define DF_UPDATE_MAX_GAP	16
+
+struct df_image *
+sc_pkcs15init_find_df_image(struct sc_profile *profile, const struct sc_path *path)
+{
+	struct df_image *image;
+
+	for (image = profile->df_images; image; image = image->next)
+		if (sc_compare_path(&image->path, path))
+			return image;
+	return NULL;
+}
+
+/* Forget the content of a file, or of all the files if path is NULL */
+void
+sc_pkcs15init_forget_df_image(struct sc_profile *profile, const struct sc_path *path)
+{
+	struct df_image **next = &profile->df_images, *image;
+
+	while ((image = *next) != NULL) {
+		if (path && !sc_compare_path(&image->path, path)) {
+			next = &image->next;
+			continue;
+		}
+		*next = image->next;
+		free(image->data);
+		free(image);
+	}
+}
+
+/* Remember the content of a file; the image takes over the data */
+struct df_image *
+sc_pkcs15init_keep_df_image(struct sc_profile *profile, const struct sc_path *path,
+		unsigned char *data, size_t len)
+{
+	struct df_image *image;
+
+	sc_pkcs15init_forget_df_image(profile, path);
+	image = calloc(1, sizeof(struct df_image));
+	if (image == NULL) {
+		free(data);
+		return NULL;
+	}
+	image->path = *path;
+	image->data = data;
+	image->len = len;
+	image->next = profile->df_images;
+	profile->df_images = image;
+	return image;
+}
+
 /*
- * Update any PKCS15 DF file (except ODF and DIR)
+ * Write a DF file, with UPDATE BINARY only for the ranges that differ from
+ * its known content. The content is read from the card the first time;
+ * if that is not possible the whole file is written.
  */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
-		struct sc_profile *profile,
-		struct sc_pkcs15_df *df,
-		int is_new)
+static int
+sc_pkcs15init_update_df_file(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
+		struct sc_file *file, unsigned char *data, size_t datalen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_card	*card = p15card->card;
+	struct sc_file	*selected_file = NULL;
+	struct df_image	*image;
+	unsigned char	*target = NULL;
+	size_t		size, offs, end, gap, written = 0;
+	int		r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!file)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	image = sc_pkcs15init_find_df_image(profile, &file->path);
+	r = sc_select_file(card, &file->path, &selected_file);
+	if (r < 0 || selected_file->size < datalen || (image && image->len != selected_file->size)) {
+		sc_pkcs15init_forget_df_image(profile, &file->path);
+		image = NULL;
+	}
+	else if (image == NULL && selected_file->size) {
+		image = calloc(1, sizeof(struct df_image));
+		if (image)
+			image->data = malloc(selected_file->size);
+		if (image && image->data
+				&& sc_read_binary(card, 0, image->data, selected_file->size, 0) == (int) selected_file->size) {
+			image->path = file->path;
+			image->len = selected_file->size;
+			image->next = profile->df_images;
+			profile->df_images = image;
+		}
+		else {
+			sc_log(ctx, "Cannot read the content of %s", sc_print_path(&file->path));
+			if (image)
+				free(image->data);
+			free(image);
+			image = NULL;
+		}
+	}
+	sc_file_free(selected_file);
+
+	if (image == NULL) {
+		r = sc_pkcs15init_update_file(profile, p15card, file, data, datalen);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	/* Same content as sc_pkcs15init_update_file(): the data, then zeros */
+	size = image->len;
+	target = calloc(1, size);
+	if (target == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(target, data, datalen);
+
+	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+	for (offs = 0; r >= 0 && offs < size; offs = end) {
+		if (target[offs] == image->data[offs]) {
+			end = offs + 1;
+			continue;
+		}
+		for (end = offs + 1, gap = 0; end + gap < size && gap < DF_UPDATE_MAX_GAP; ) {
+			if (target[end + gap] != image->data[end + gap]) {
+				end += gap + 1;
+				gap = 0;
+			}
+			else {
+				gap++;
+			}
+		}
+		r = sc_update_binary(card, offs, target + offs, end - offs, 0);
+		written += end - offs;
+	}
+
+	if (r < 0) {
+		sc_pkcs15init_forget_df_image(profile, &file->path);
+		free(target);
+		LOG_TEST_RET(ctx, r, "Failed to update DF file");
+	}
+	sc_log(ctx, "%s: %"SC_FORMAT_LEN_SIZE_T"u of %"SC_FORMAT_LEN_SIZE_T"u bytes written",
+			sc_print_path(&file->path), written, size);
+	sc_pkcs15init_cache_written(p15card, &file->path, target, size);
+	free(image->data);
+	image->data = target;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+static int
+sc_pkcs15init_write_df(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15_df *df, int *update_odf)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
 	struct sc_file	*file = NULL;
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
-	int		update_odf = is_new, r = 0;
-
-	LOG_FUNC_CALLED(ctx);
-	if (!df)
-		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
+	int		r;
 
 	r = sc_profile_get_file_by_path(profile, &df->path, &file);
 	if (r < 0 || file == NULL)
@@ -3099,7 +3298,7 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -3113,12 +3312,52 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 		if (profile->pkcs15.encode_df_length) {
 			df->path.count = bufsize;
 			df->path.index = 0;
-			update_odf = 1;
+			*update_odf = 1;
 		}
 		free(buf);
 	}
 	sc_file_free(file);
 
+	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
+	return SC_SUCCESS;
+}
+
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	struct sc_context	*ctx = p15card->card->ctx;
+	int		update_odf = is_new, r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!df)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
+
+	if (profile->transaction.depth && profile->transaction.p15card == p15card)   {
+		unsigned int i, count = profile->transaction.df_count;
+
+		for (i = 0; i < count && profile->transaction.df[i] != df; i++)
+			;
+		if (i < sizeof(profile->transaction.df) / sizeof(profile->transaction.df[0]))   {
+			sc_log(ctx, "Defer update of DF %s", sc_print_path(&df->path));
+			if (i == count)
+				profile->transaction.df[profile->transaction.df_count++] = df;
+			profile->transaction.odf |= is_new;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* no room left: write it now */
+	}
+
+	/* The cached content of the DFs is outdated now */
+	if (p15card->opts.use_file_cache)
+		sc_pkcs15_uncache_objects(p15card);
+
+	r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
 	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
 
 	/* Now update the ODF if we have to */
@@ -3129,6 +3368,67 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
 }
 
+
+int
+sc_pkcs15init_begin_transaction(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->transaction.depth && profile->transaction.p15card != p15card)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "Transaction already in progress for another card");
+
+	if (profile->transaction.depth++ == 0)   {
+		profile->transaction.p15card = p15card;
+		profile->transaction.df_count = 0;
+		profile->transaction.odf = 0;
+		profile->transaction.tokeninfo = 0;
+	}
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+int
+sc_pkcs15init_commit_transaction(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned int i;
+	int update_odf, r = SC_SUCCESS, rv;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!profile->transaction.depth || profile->transaction.p15card != p15card)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "No transaction in progress for this card");
+	if (--profile->transaction.depth)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	/* Write every DF once; go on after an error so that the card
+	 * matches the objects added so far as far as possible */
+	update_odf = profile->transaction.odf;
+	if (profile->transaction.df_count && p15card->opts.use_file_cache)
+		sc_pkcs15_uncache_objects(p15card);
+	for (i = 0; i < profile->transaction.df_count; i++)   {
+		rv = sc_pkcs15init_write_df(p15card, profile, profile->transaction.df[i], &update_odf);
+		if (rv < 0 && r == SC_SUCCESS)
+			r = rv;
+	}
+	if (update_odf)   {
+		rv = sc_pkcs15init_update_odf(p15card, profile);
+		if (rv < 0 && r == SC_SUCCESS)
+			r = rv;
+	}
+	if (profile->transaction.tokeninfo)   {
+		rv = sc_pkcs15init_update_tokeninfo(p15card, profile);
+		if (rv < 0 && r == SC_SUCCESS)
+			r = rv;
+	}
+
+	profile->transaction.p15card = NULL;
+	profile->transaction.df_count = 0;
+	profile->transaction.odf = 0;
+	profile->transaction.tokeninfo = 0;
+	LOG_FUNC_RETURN(ctx, r);
+}
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -3302,6 +3602,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 		default:
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot change ID attribute");
 		}
+		sc_pkcs15_reindex_objects(p15card);
 		break;
 	case P15_ATTR_TYPE_VALUE:
 		switch(df_type) {
@@ -3539,6 +3840,8 @@ sc_pkcs15init_update_certificate(struct sc_pkcs15_card *p15card,
 		else   {
 			path->count = -1;
 		}
+		/* the zeros after the certificate are never read */
+		sc_pkcs15init_cache_written(p15card, path, rawcert, certlen);
 
 		if (profile->ops->emu_update_any_df) {
 			r = profile->ops->emu_update_any_df(profile, p15card, SC_AC_OP_UPDATE, obj);
@@ -3961,6 +4264,7 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
 	sc_log(ctx, "path:%s; datalen:%i", sc_print_path(&file->path), datalen);
+	sc_pkcs15init_forget_df_image(profile, &file->path);
 
 	r = sc_select_file(p15card->card, &file->path, &selected_file);
 	if (!r)   {
@@ -4006,6 +4310,8 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
 	if (r >= 0 && datalen)
 		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	if (r >= 0 && datalen)
+		sc_pkcs15init_cache_written(p15card, &file->path, data, datalen);
 
 	if (copy)
 		free(copy);
@@ -4032,6 +4338,13 @@ sc_pkcs15init_fixup_acls(struct sc_pkcs15_card *p15card, struct sc_file *file,
 		const char	*what;
 		int		added = 0, num, ii;
 
+		/* Nothing to replace: an empty ACL becomes NONE, as below */
+		if (!(file->acl_symbolic_mask & (1U << op))) {
+			if (file->acl[op] == NULL)
+				sc_file_add_acl_entry(file, op, SC_AC_NONE, 0);
+			continue;
+		}
+
 		/* First, get original ACLs */
 		acl = sc_file_get_acl_entry(file, op);
 		for (num = 0; num < SC_MAX_OP_ACS && acl; num++, acl = acl->next)
@@ -4086,23 +4399,11 @@ sc_pkcs15init_fixup_file(struct sc_profile *profile,
 {
 	struct sc_context	*ctx = profile->card->ctx;
 	struct sc_acl_entry	so_acl, user_acl;
-	unsigned int	op, needfix = 0;
 	int		rv, pin_ref;
 
 	LOG_FUNC_CALLED(ctx);
-	/* First, loop over all ACLs to find out whether there
-	 * are still any symbolic references.
-	 */
-	for (op = 0; op < SC_MAX_AC_OPS; op++) {
-		const struct sc_acl_entry *acl;
-
-		acl = sc_file_get_acl_entry(file, op);
-		for (; acl; acl = acl->next)
-			if (acl->method == SC_AC_SYMBOLIC)
-				needfix++;
-	}
-
-	if (!needfix)
+	/* Are there still any symbolic references? */
+	if (!file->acl_symbolic_mask)
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
 	pin_ref = sc_pkcs15init_get_pin_reference(p15card, profile, SC_AC_SYMBOLIC, SC_PKCS15INIT_SO_PIN);
@@ -235,6 +235,91 @@ awp_update_blob(struct sc_context *ctx,
 }
 
 
+/*
+ * The container list and the object lists are read from the card once and
+ * kept with the file images of the profile, so that enrolling several
+ * objects does not read them again for each one. Changes are still written
+ * to the card as they are made, only the record or the list entry concerned,
+ * and then applied to the image.
+ *
+ * The file has to be selected; 'rlen' is the record length of the container
+ * list, 0 for the transparent object lists.
+ */
+static int
+awp_get_list_image(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		const struct sc_path *path, size_t len, size_t rlen, struct df_image **out)
+{
+	struct df_image *image;
+	unsigned char *data;
+	size_t offs;
+	int rv = 0;
+
+	image = sc_pkcs15init_find_df_image(profile, path);
+	if (image && image->len == len)   {
+		*out = image;
+		return SC_SUCCESS;
+	}
+
+	data = calloc(1, len ? len : 1);
+	if (!data)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	if (!rlen)   {
+		rv = sc_read_binary(p15card->card, 0, data, len, 0);
+		if (rv >= 0 && (size_t)rv != len)
+			rv = SC_ERROR_WRONG_LENGTH;
+	}
+	for (offs = 0; rlen && rv >= 0 && offs < len; offs += rlen)
+		rv = sc_read_record(p15card->card, (int)(offs / rlen) + 1, data + offs, rlen, SC_RECORD_BY_REC_NR);
+	if (rv < 0)   {
+		free(data);
+		return rv;
+	}
+
+	*out = sc_pkcs15init_keep_df_image(profile, path, data, len);
+	return *out ? SC_SUCCESS : SC_ERROR_OUT_OF_MEMORY;
+}
+
+
+/*
+ * Apply to the image of the container list a record that was appended
+ * (past the last record), updated, or deleted (data is NULL) on the card.
+ */
+static void
+awp_set_container_image(struct sc_profile *profile, struct sc_file *file,
+		int rec, const unsigned char *data)
+{
+	struct df_image *image;
+	size_t rlen = file->record_length, offs = (rec - 1) * rlen;
+	unsigned char *pp;
+
+	image = sc_pkcs15init_find_df_image(profile, &file->path);
+	if (!image)
+		return;
+
+	if (rec < 1 || rec > file->record_count + 1 || image->len != file->record_count * rlen)   {
+		sc_pkcs15init_forget_df_image(profile, &file->path);
+	}
+	else if (rec > file->record_count)   {
+		pp = realloc(image->data, image->len + rlen);
+		if (!pp)   {
+			sc_pkcs15init_forget_df_image(profile, &file->path);
+			return;
+		}
+		memcpy(pp + image->len, data, rlen);
+		image->data = pp;
+		image->len += rlen;
+	}
+	else if (data)   {
+		memcpy(image->data + offs, data, rlen);
+	}
+	else   {
+		memmove(image->data + offs, image->data + offs + rlen, image->len - offs - rlen);
+		image->len -= rlen;
+	}
+}
+
+
 static int
 awp_new_container_entry(struct sc_pkcs15_card *p15card, unsigned char *buff, int len)
 {
@@ -303,6 +388,11 @@ awp_create_container_record (struct sc_pkcs15_card *p15card, struct sc_profile *
 	if (!rv)
 		rv = sc_append_record(p15card->card, buff, list_file->record_length, SC_RECORD_BY_REC_NR);
 
+	if (rv >= 0)
+		awp_set_container_image(profile, list_file, list_file->record_count + 1, buff);
+	else
+		sc_pkcs15init_forget_df_image(profile, &list_file->path);
+
 	free(buff);
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, rv);
 }
@@ -345,6 +435,7 @@ awp_update_container_entry (struct sc_pkcs15_card *p15card, struct sc_profile *p
 		int rec, int offs)
 {
 	struct sc_context *ctx = p15card->card->ctx;
+	struct df_image *image = NULL;
 	int rv;
 	unsigned char *buff = NULL;
 
@@ -367,7 +458,11 @@ awp_update_container_entry (struct sc_pkcs15_card *p15card, struct sc_profile *p
 	else   {
 		rv = sc_select_file(p15card->card, &list_file->path, NULL);
 		if (!rv)
-			rv = sc_read_record(p15card->card, rec, buff, list_file->record_length, SC_RECORD_BY_REC_NR);
+			rv = awp_get_list_image(p15card, profile, &list_file->path,
+					list_file->record_count * list_file->record_length,
+					list_file->record_length, &image);
+		if (!rv)
+			memcpy(buff, image->data + (rec - 1) * list_file->record_length, list_file->record_length);
 	}
 	if (rv < 0)   {
 		free(buff);
@@ -414,6 +509,11 @@ awp_update_container_entry (struct sc_pkcs15_card *p15card, struct sc_profile *p
 		rv = sc_update_record(p15card->card, rec, buff, list_file->record_length, SC_RECORD_BY_REC_NR);
 	}
 
+	if (rv >= 0)
+		awp_set_container_image(profile, list_file, rec, buff);
+	else
+		sc_pkcs15init_forget_df_image(profile, &list_file->path);
+
 	free(buff);
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, rv);
 }
@@ -426,7 +526,9 @@ awp_update_container(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file *clist = NULL, *file = NULL;
 	struct sc_path  private_path;
+	struct df_image *image = NULL;
 	int rv = 0, rec, rec_offs;
+	size_t rlen;
 	unsigned char *list = NULL;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
@@ -459,9 +561,9 @@ awp_update_container(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 		goto done;
 	}
 
-	list = malloc(AWP_CONTAINER_RECORD_LEN * file->record_count);
-	if (!list)  {
-		rv = SC_ERROR_OUT_OF_MEMORY;
+	rlen = file->record_length;
+	if (rlen < AWP_CONTAINER_RECORD_LEN)   {
+		rv = SC_ERROR_INVALID_CARD;
 		goto done;
 	}
 
@@ -469,22 +571,17 @@ awp_update_container(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 	if (rv)
 		goto done;
 
-	for (rec=0; rec < file->record_count; rec++)   {
-		unsigned char tmp[256];
-
-		rv = sc_read_record(p15card->card, rec + 1, tmp, sizeof(tmp), SC_RECORD_BY_REC_NR);
-		if (rv >= AWP_CONTAINER_RECORD_LEN)
-			memcpy(list + rec*AWP_CONTAINER_RECORD_LEN, tmp, AWP_CONTAINER_RECORD_LEN);
-		else
-			goto done;
-	}
+	rv = awp_get_list_image(p15card, profile, &file->path, rlen * file->record_count, rlen, &image);
+	if (rv)
+		goto done;
+	list = image->data;
 
 	for (rec=0, rv=0; !rv && rec < file->record_count; rec++)   {
 		for (rec_offs=0; !rv && rec_offs<12; rec_offs+=6)   {
 			int offs;
 
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "rec %i; rec_offs %i", rec, rec_offs);
-			offs = rec*AWP_CONTAINER_RECORD_LEN + rec_offs;
+			offs = rec*rlen + rec_offs;
 			if (*(list + offs + 2))   {
 				unsigned char *buff = NULL;
 				int id_offs;
@@ -537,7 +634,6 @@ awp_update_container(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 done:
 	sc_file_free(clist);
 	sc_file_free(file);
-	if (list)  free(list);
 
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, rv);
 }
@@ -633,9 +729,10 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file *obj_file = NULL, *lst_file = NULL;
-	struct sc_file *file = NULL;
+	struct sc_file *file = NULL, *lst = NULL;
+	struct df_image *image = NULL;
 	char obj_name[NAME_MAX_LEN], lst_name[NAME_MAX_LEN];
-	unsigned char *buff = NULL;
+	unsigned char entry[5];
 	int rv;
 	unsigned ii;
 
@@ -698,12 +795,6 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 			file->size = 2048;
 	}
 
-	buff = malloc(lst_file->size);
-	if (!buff)   {
-		rv = SC_ERROR_OUT_OF_MEMORY;
-		goto done;
-	}
-
 	rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_READ);
 	if (rv)
 		goto done;
@@ -711,20 +802,20 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 	if (rv)
 		goto done;
 
-	rv = sc_select_file(p15card->card, &lst_file->path, NULL);
+	rv = sc_select_file(p15card->card, &lst_file->path, &lst);
 	if (rv == SC_ERROR_FILE_NOT_FOUND)
 		rv = sc_pkcs15init_create_file(profile, p15card, lst_file);
 	if (rv < 0)
 		goto done;
 
-	rv = sc_read_binary(p15card->card, 0, buff, lst_file->size, lst_file->ef_structure);
+	rv = awp_get_list_image(p15card, profile, &lst_file->path, lst ? lst->size : lst_file->size, 0, &image);
 	if (rv < 0)
 		goto done;
 
-	for (ii=0; ii < lst_file->size; ii+=5)
-		if (*(buff + ii) != COSM_LIST_TAG)
+	for (ii=0; ii + sizeof(entry) <= image->len; ii+=5)
+		if (*(image->data + ii) != COSM_LIST_TAG)
 			break;
-	if (ii>=lst_file->size)   {
+	if (ii + sizeof(entry) > image->len)   {
 		rv = SC_ERROR_UNKNOWN_DATA_RECEIVED;
 		goto done;
 	}
@@ -732,21 +823,23 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL,
 		 "ii %i, rv %i; %X; %"SC_FORMAT_LEN_SIZE_T"u",
 		 ii, rv, file->id, file->size);
-	*(buff + ii) = COSM_LIST_TAG;
-	*(buff + ii + 1) = (file->id >> 8) & 0xFF;
-	*(buff + ii + 2) = file->id & 0xFF;
-	*(buff + ii + 3) = (file->size >> 8) & 0xFF;
-	*(buff + ii + 4) = file->size & 0xFF;
+	entry[0] = COSM_LIST_TAG;
+	entry[1] = (file->id >> 8) & 0xFF;
+	entry[2] = file->id & 0xFF;
+	entry[3] = (file->size >> 8) & 0xFF;
+	entry[4] = file->size & 0xFF;
 
-	rv = sc_update_binary(p15card->card, ii, buff + ii, 5, 0);
+	rv = sc_update_binary(p15card->card, ii, entry, sizeof(entry), 0);
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "rv %i",rv);
-	if (rv < 0)
+	if (rv < 0)   {
+		sc_pkcs15init_forget_df_image(profile, &lst_file->path);
 		goto done;
+	}
+	memcpy(image->data + ii, entry, sizeof(entry));
 
 	rv = 0;
 done:
-	if (buff)
-		free(buff);
+	sc_file_free(lst);
 	sc_file_free(lst_file);
 	sc_file_free(obj_file);
 	sc_file_free(file);
@@ -1635,6 +1728,7 @@ awp_delete_from_container(struct sc_pkcs15_card *p15card,
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file *clist=NULL, *file=NULL;
+	struct df_image *image = NULL;
 	unsigned rec, rec_len;
 	int rv = 0, ii;
 	unsigned char *buff=NULL;
@@ -1648,17 +1742,17 @@ awp_delete_from_container(struct sc_pkcs15_card *p15card,
 	rv = sc_select_file(p15card->card, &clist->path, &file);
 	SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, rv, "AWP update contaner entry: cannot select container list file");
 
-	buff = malloc(file->record_length);
+	rec_len = file->record_length;
+	buff = malloc(rec_len);
 	if (!buff)
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY, "AWP update container entry: allocation error");
 
-	for (rec = 1; rec <= (unsigned)file->record_count; rec++)   {
-		rv = sc_read_record(p15card->card, rec, buff, file->record_length, SC_RECORD_BY_REC_NR);
-		if (rv < 0)   {
-			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "AWP update contaner entry: read record error %i", rv);
-			break;
-		}
-		rec_len = rv;
+	rv = awp_get_list_image(p15card, profile, &file->path, rec_len * file->record_count, rec_len, &image);
+	if (rv < 0)
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "AWP update contaner entry: read record error %i", rv);
+
+	for (rec = 1; rv >= 0 && rec <= (unsigned)file->record_count; rec++)   {
+		memcpy(buff, image->data + (rec - 1) * rec_len, rec_len);
 
 		for (ii=0; ii<12; ii+=2)
 			if (file_id == (*(buff+ii) * 0x100 + *(buff+ii+1)))
@@ -1683,6 +1777,11 @@ awp_delete_from_container(struct sc_pkcs15_card *p15card,
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "AWP update contaner entry: delete record error %i", rv);
 				break;
 			}
+
+			/* the next records move down by one */
+			awp_set_container_image(profile, file, rec, NULL);
+			file->record_count--;
+			rec--;
 		}
 		else   {
 			rv = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
@@ -1696,9 +1795,13 @@ awp_delete_from_container(struct sc_pkcs15_card *p15card,
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "AWP update contaner entry: update record error %i", rv);
 				break;
 			}
+			awp_set_container_image(profile, file, rec, buff);
 		}
 	}
 
+	if (rv < 0)
+		sc_pkcs15init_forget_df_image(profile, &file->path);
+
 	if (rv > 0)
 		rv = 0;
 
@@ -1716,10 +1819,11 @@ awp_remove_from_object_list( struct sc_pkcs15_card *p15card, struct sc_profile *
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file *lst_file=NULL, *lst=NULL;
+	struct df_image *image = NULL;
 	int rv = 0;
 	unsigned ii;
 	char lst_name[NAME_MAX_LEN];
-	unsigned char *buff=NULL;
+	unsigned char *buff;
 	unsigned char id[2];
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
@@ -1750,25 +1854,27 @@ awp_remove_from_object_list( struct sc_pkcs15_card *p15card, struct sc_profile *
 	rv = sc_pkcs15init_authenticate(profile, p15card, lst, SC_AC_OP_READ);
 	SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, rv, "AWP update object list: 'read' authentication failed");
 
-	buff = malloc(lst->size);
-	if (!buff)
-		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY, "AWP update object list: allocation error");
-
-	rv = sc_read_binary(p15card->card, 0, buff, lst->size, 0);
-	if (rv != (int)lst->size)
+	rv = awp_get_list_image(p15card, profile, &lst_file->path, lst->size, 0, &image);
+	if (rv < 0)
 		goto done;
+	buff = image->data;
 
 	id[0] = (obj_id >> 8) & 0xFF;
 	id[1] = obj_id & 0xFF;
-	for (ii=0; ii<lst->size; ii+=5)   {
+	for (ii=0; ii + 2 < image->len; ii+=5)   {
 		if (*(buff+ii)==0xFF && *(buff+ii+1)==id[0] && *(buff+ii+2)==id[1])   {
 			rv = sc_pkcs15init_authenticate(profile, p15card, lst, SC_AC_OP_UPDATE);
 			if (rv)
 				goto done;
 
 			rv = sc_update_binary(p15card->card, ii, (unsigned char *)"\0", 1, 0);
-			if (rv && rv!=1)
+			if (rv && rv!=1)   {
+				sc_pkcs15init_forget_df_image(profile, &lst_file->path);
 				rv = SC_ERROR_INVALID_CARD;
+			}
+			else   {
+				*(buff + ii) = 0;
+			}
 			break;
 		}
 	}
@@ -1776,8 +1882,6 @@ awp_remove_from_object_list( struct sc_pkcs15_card *p15card, struct sc_profile *
 	if (rv > 0)
 		rv = 0;
 done:
-	if (buff)
-		free(buff);
 	sc_file_free(lst);
 	sc_file_free(lst_file);
 
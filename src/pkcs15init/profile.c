@@ -34,6 +34,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <sys/stat.h>
 #include <assert.h>
 #include <stdlib.h>
 
@@ -44,6 +45,7 @@
 
 #include "common/compat_strlcpy.h"
 #include "scconf/scconf.h"
+#include "libopensc/internal.h"
 #include "libopensc/log.h"
 #include "libopensc/pkcs15.h"
 #include "pkcs15-init.h"
@@ -226,6 +228,8 @@ static struct {
 };
 
 static int		process_conf(struct sc_profile *, scconf_context *);
+static int		get_profile_conf(struct sc_context *, const char *,
+				scconf_context **);
 static int		process_block(struct state *, struct block *,
 				const char *, scconf_block *);
 static void		init_state(struct state *, struct state *);
@@ -256,6 +260,8 @@ static struct file_info *	add_file(sc_profile_t *, const char *,
 				sc_file_t *, struct file_info *);
 static void		free_file_list(struct file_info **);
 static void		append_file(sc_profile_t *, struct file_info *);
+static void		index_file(sc_profile_t *, struct file_info *);
+static void		index_files(sc_profile_t *, int);
 static struct auth_info *	new_key(struct sc_profile *,
 				unsigned int, unsigned int);
 static void		set_pin_defaults(struct sc_profile *,
@@ -334,6 +340,9 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 #endif
 
 	LOG_FUNC_CALLED(ctx);
+	/* the parser changes the files after adding them */
+	index_files(profile, 0);
+
 	for (i = 0; ctx->conf_blocks[i]; i++) {
 		profile_dir = scconf_get_str(ctx->conf_blocks[i], "profile_dir", NULL);
 		if (profile_dir)
@@ -363,24 +372,87 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
-	conf = scconf_new(path);
-	res = scconf_parse(conf);
+	res = get_profile_conf(ctx, path, &conf);
+	LOG_TEST_RET(ctx, res, "Cannot parse profile");
 
 	sc_log(ctx, "profile %s loaded ok", path);
 
-	if (res < 0) {
+	res = process_conf(profile, conf);
+	LOG_FUNC_RETURN(ctx, res);
+}
+
+/*
+ * The parsed profile files are kept with the context, as long as the
+ * files do not change: a bind only has to process them. The parsed
+ * files are not modified by process_conf(), so they can be shared.
+ */
+struct profile_cache {
+	struct profile_cache	*next;
+	char			*path;
+	time_t			mtime;
+	scconf_context		*conf;
+};
+
+static int
+get_profile_conf(struct sc_context *ctx, const char *path, scconf_context **out)
+{
+	struct profile_cache *entry;
+	scconf_context	*conf;
+	struct stat	st;
+	int		res;
+
+	if (stat(path, &st) != 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (entry = ctx->profile_cache; entry; entry = entry->next)
+		if (!strcmp(entry->path, path) && entry->mtime == st.st_mtime)
+			break;
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (entry) {
+		sc_log(ctx, "Using the parsed profile file %s", path);
+		*out = entry->conf;
+		return SC_SUCCESS;
+	}
+
+	conf = scconf_new(path);
+	if (conf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	res = scconf_parse(conf);
+	if (res <= 0) {
 		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+		return res < 0 ? SC_ERROR_FILE_NOT_FOUND : SC_ERROR_SYNTAX_ERROR;
 	}
 
-	if (res == 0) {
+	/* an outdated entry stays in the list: it may still be in use */
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+		free(entry);
 		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
+		return SC_ERROR_OUT_OF_MEMORY;
 	}
+	entry->mtime = st.st_mtime;
+	entry->conf = conf;
+	sc_mutex_lock(ctx, ctx->mutex);
+	entry->next = ctx->profile_cache;
+	ctx->profile_cache = entry;
+	sc_mutex_unlock(ctx, ctx->mutex);
 
-	res = process_conf(profile, conf);
-	scconf_free(conf);
-	LOG_FUNC_RETURN(ctx, res);
+	*out = conf;
+	return SC_SUCCESS;
+}
+
+void
+sc_profile_cache_free(struct sc_context *ctx)
+{
+	struct profile_cache *entry;
+
+	while ((entry = ctx->profile_cache) != NULL) {
+		ctx->profile_cache = entry->next;
+		scconf_free(entry->conf);
+		free(entry->path);
+		free(entry);
+	}
 }
 
 
@@ -419,8 +491,8 @@ sc_profile_finish(struct sc_profile *profile, const struct sc_app_info *app_info
 	if (!profile->df_info)
 		LOG_TEST_RET(ctx, SC_ERROR_INCONSISTENT_PROFILE, "Profile doesn't define a PKCS15-AppDF");
 
-	profile->p15_spec->file_app = profile->df_info->file;
-	profile->df_info->dont_free = 1;
+	sc_file_free(profile->p15_spec->file_app);
+	profile->p15_spec->file_app = sc_file_ref(profile->df_info->file);
 
 	for (pi = profile->pin_list; pi; pi = pi->next) {
 		const char	*name;
@@ -435,6 +507,8 @@ sc_profile_finish(struct sc_profile *profile, const struct sc_app_info *app_info
 
 		pi->file = fi;
 	}
+
+	index_files(profile, 1);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
 whine:
@@ -447,12 +521,19 @@ sc_profile_free(struct sc_profile *profile)
 {
 	struct auth_info *ai;
 	struct pin_info *pi;
+	struct df_image *di;
 	sc_macro_t	*mi;
 	sc_template_t	*ti;
 
 	if (profile->name)
 		free(profile->name);
 
+	while ((di = profile->df_images) != NULL) {
+		profile->df_images = di->next;
+		free(di->data);
+		free(di);
+	}
+
 	free_file_list(&profile->ef_list);
 
 	while ((ai = profile->auth_list) != NULL) {
@@ -1149,6 +1230,64 @@ static void append_file(sc_profile_t *profile, struct file_info *nfile)
 	while ((fi = *list) != NULL)
 		list = &fi->next;
 	*list = nfile;
+
+	if (profile->indexed)
+		index_file(profile, nfile);
+}
+
+static unsigned int
+name_hash(const char *name)
+{
+	unsigned int	hash = 0;
+
+	while (*name)
+		hash = hash * 31 + tolower((unsigned char) *name++);
+	return hash % SC_PROFILE_INDEX_SIZE;
+}
+
+static unsigned int
+path_hash(const sc_path_t *path)
+{
+	unsigned int	hash = 0;
+	size_t		i;
+
+	for (i = 0; i < path->len && i < SC_MAX_PATH_SIZE; i++)
+		hash = hash * 31 + path->value[i];
+	return hash % SC_PROFILE_INDEX_SIZE;
+}
+
+/*
+ * Add a file at the end of its index chains, so that the chains keep
+ * the order of ef_list.
+ */
+static void
+index_file(sc_profile_t *profile, struct file_info *fi)
+{
+	struct file_info	**chain;
+
+	fi->name_next = fi->path_next = NULL;
+	for (chain = &profile->name_index[name_hash(fi->ident)]; *chain; chain = &(*chain)->name_next)
+		;
+	*chain = fi;
+	for (chain = &profile->path_index[path_hash(&fi->file->path)]; *chain; chain = &(*chain)->path_next)
+		;
+	*chain = fi;
+}
+
+/*
+ * Build the file index, or drop it while the profile can still change
+ */
+static void
+index_files(sc_profile_t *profile, int enable)
+{
+	struct file_info	*fi;
+
+	memset(profile->name_index, 0, sizeof(profile->name_index));
+	memset(profile->path_index, 0, sizeof(profile->path_index));
+	profile->indexed = enable;
+	if (enable)
+		for (fi = profile->ef_list; fi; fi = fi->next)
+			index_file(profile, fi);
 }
 
 /*
@@ -1185,8 +1324,7 @@ free_file_list(struct file_info **list)
 	while ((fi = *list) != NULL) {
 		*list = fi->next;
 
-		if (fi->dont_free == 0)
-			sc_file_free(fi->file);
+		sc_file_free(fi->file);
 		free(fi->ident);
 		free(fi);
 	}
@@ -1202,7 +1340,7 @@ new_file(struct state *cur, const char *name, unsigned int type)
 	sc_profile_t	*profile = cur->profile;
 	struct file_info	*info;
 	sc_file_t	*file;
-	unsigned int	df_type = 0, dont_free = 0;
+	unsigned int	df_type = 0;
 
 	if ((info = sc_profile_find_file(profile, NULL, name)) != NULL)
 		return info;
@@ -1212,14 +1350,11 @@ new_file(struct state *cur, const char *name, unsigned int type)
 	if (strncasecmp(name, "PKCS15-", 7)) {
 		file = init_file(type);
 	} else if (!strcasecmp(name+7, "TokenInfo")) {
-		file = profile->p15_spec->file_tokeninfo;
-		dont_free = 1;
+		file = sc_file_ref(profile->p15_spec->file_tokeninfo);
 	} else if (!strcasecmp(name+7, "ODF")) {
-		file = profile->p15_spec->file_odf;
-		dont_free = 1;
+		file = sc_file_ref(profile->p15_spec->file_odf);
 	} else if (!strcasecmp(name+7, "UnusedSpace")) {
-		file = profile->p15_spec->file_unusedspace;
-		dont_free = 1;
+		file = sc_file_ref(profile->p15_spec->file_unusedspace);
 	} else if (!strcasecmp(name+7, "AppDF")) {
 		file = init_file(SC_FILE_TYPE_DF);
 	} else {
@@ -1235,8 +1370,8 @@ new_file(struct state *cur, const char *name, unsigned int type)
 			file->type == SC_FILE_TYPE_DF
 				? "DF" : file->type == SC_FILE_TYPE_BSO
 					? "BS0" : "EF");
-		if (strncasecmp(name, "PKCS15-", 7) ||
-			!strcasecmp(name+7, "AppDF"))
+		/* profile->df[] keeps the xDF files */
+		if (file != profile->df[df_type])
 			sc_file_free(file);
 		return NULL;
 	}
@@ -1246,7 +1381,6 @@ new_file(struct state *cur, const char *name, unsigned int type)
 		parse_error(cur, "memory allocation failed");
 		return NULL;
 	}
-	info->dont_free = dont_free;
 	return info;
 }
 
@@ -2027,7 +2161,8 @@ sc_profile_find_file(struct sc_profile *pro,
 	unsigned int		len;
 
 	len = path? path->len : 0;
-	for (fi = pro->ef_list; fi; fi = fi->next) {
+	fi = pro->indexed ? pro->name_index[name_hash(name)] : pro->ef_list;
+	for (; fi; fi = pro->indexed ? fi->name_next : fi->next) {
 		sc_path_t *fpath = &fi->file->path;
 
 		if (!strcasecmp(fi->ident, name) && fpath->len >= len && !memcmp(fpath->value, path->value, len))
@@ -2059,7 +2194,8 @@ sc_profile_find_file_by_path(struct sc_profile *pro, const sc_path_t *path)
 	if (!path || (!path->len && !path->aid.len))
 		return NULL;
 
-	for (fi = pro->ef_list; fi; fi = fi->next) {
+	fi = pro->indexed ? pro->path_index[path_hash(path)] : pro->ef_list;
+	for (; fi; fi = pro->indexed ? fi->path_next : fi->next) {
 		fp_path = &fi->file->path;
 		fpp_path = fi->parent ? &fi->parent->file->path : NULL;
 
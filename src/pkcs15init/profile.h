@@ -44,7 +44,6 @@ struct file_info {
 	char *			ident;
 	struct file_info *	next;
 	struct sc_file *	file;
-	unsigned int		dont_free;
 	struct file_info *	parent;
 
 	/* Template support */
@@ -57,6 +56,10 @@ struct file_info {
 	 * Sub-profile is loaded when binding to the particular application
 	 * of the multi-application PKCS#15 card. */
 	char *			profile_extension;
+
+	/* chains of the file index of the profile */
+	struct file_info *	name_next;
+	struct file_info *	path_next;
 };
 
 /* For now, we assume the PUK always resides
@@ -92,7 +95,18 @@ typedef struct sc_template {
 	struct file_info *	file;
 } sc_template_t;
 
+/* Last known content of a DF file, so that an update
+ * only writes the bytes that changed.
+ */
+struct df_image {
+	struct df_image *	next;
+	struct sc_path		path;
+	unsigned char *		data;
+	size_t			len;
+};
+
 #define SC_PKCS15INIT_MAX_OPTIONS 16
+#define SC_PROFILE_INDEX_SIZE	64
 struct sc_profile {
 	char *			name;
 	char *			options[SC_PKCS15INIT_MAX_OPTIONS];
@@ -105,6 +119,11 @@ struct sc_profile {
 	struct file_info *	mf_info;
 	struct file_info *	df_info;
 	struct file_info *	ef_list;
+
+	/* ef_list indexed by name and by path, once the profile is finished */
+	int			indexed;
+	struct file_info *	name_index[SC_PROFILE_INDEX_SIZE];
+	struct file_info *	path_index[SC_PROFILE_INDEX_SIZE];
 	struct sc_file *	df[SC_PKCS15_DF_TYPE_COUNT];
 
 	struct pin_info *	pin_list;
@@ -136,6 +155,18 @@ struct sc_profile {
 	 * has been changed) */
 	int			dirty;
 
+	/* DF, ODF and TokenInfo updates deferred until the
+	 * outermost sc_pkcs15init_commit_transaction() */
+	struct {
+		unsigned int	depth;
+		struct sc_pkcs15_card *p15card;
+		struct sc_pkcs15_df *df[2 * SC_PKCS15_DF_TYPE_COUNT];
+		unsigned int	df_count;
+		unsigned int	odf, tokeninfo;
+	} transaction;
+
+	struct df_image *	df_images;
+
 	/* PKCS15 object ID style */
 	unsigned int id_style;
 
@@ -0,0 +1,409 @@
+/*
+ * Binary snapshot of a parsed configuration file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "scconf.h"
+#include "internal.h"
+
+/*
+ * The snapshot is only ever read back on the host that wrote it, so all
+ * numbers are stored in host byte order.  It starts with a header that
+ * identifies the source file:
+ *
+ *   magic, byte order mark, mtime, size, file name
+ *
+ * followed by the items of the root block.  A block consists of its name
+ * list and its items, an item is stored as its type, key and value.
+ * Comments are dropped.  Strings are stored as length and data, lists as
+ * the number of elements and the strings.
+ */
+#define SCCONF_CACHE_MAGIC	"scconf-cache-1\n"
+#define SCCONF_CACHE_BOM	0x01020304U
+#define SCCONF_CACHE_NULL	0xFFFFFFFFU
+/* limits nesting when reading a corrupted snapshot */
+#define SCCONF_CACHE_MAX_DEPTH	32
+
+typedef struct {
+	const unsigned char *p;
+	size_t left;
+	int error;
+} scconf_cache_reader;
+
+static int cache_source_stat(const char *filename, unsigned long long *mtime,
+		unsigned long long *size)
+{
+	struct stat st;
+
+	if (!filename || stat(filename, &st) != 0) {
+		return -1;
+	}
+	*mtime = (unsigned long long) st.st_mtime;
+	*size = (unsigned long long) st.st_size;
+	return 0;
+}
+
+static void write_u32(FILE * f, unsigned int v, int *error)
+{
+	if (fwrite(&v, sizeof v, 1, f) != 1) {
+		*error = 1;
+	}
+}
+
+static void write_u64(FILE * f, unsigned long long v, int *error)
+{
+	if (fwrite(&v, sizeof v, 1, f) != 1) {
+		*error = 1;
+	}
+}
+
+static void write_str(FILE * f, const char *s, int *error)
+{
+	size_t len;
+
+	if (!s) {
+		write_u32(f, SCCONF_CACHE_NULL, error);
+		return;
+	}
+	len = strlen(s);
+	write_u32(f, (unsigned int) len, error);
+	if (len && fwrite(s, len, 1, f) != 1) {
+		*error = 1;
+	}
+}
+
+static void write_list(FILE * f, const scconf_list * list, int *error)
+{
+	write_u32(f, (unsigned int) scconf_list_array_length(list), error);
+	for (; list; list = list->next) {
+		write_str(f, list->data, error);
+	}
+}
+
+static void write_items(FILE * f, const scconf_block * block, int *error);
+
+static void write_block(FILE * f, const scconf_block * block, int *error)
+{
+	write_list(f, block->name, error);
+	write_items(f, block, error);
+}
+
+static void write_items(FILE * f, const scconf_block * block, int *error)
+{
+	const scconf_item *item;
+	unsigned int count = 0;
+
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK
+				|| item->type == SCCONF_ITEM_TYPE_VALUE) {
+			count++;
+		}
+	}
+	write_u32(f, count, error);
+
+	for (item = block->items; item; item = item->next) {
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_BLOCK:
+			write_u32(f, SCCONF_ITEM_TYPE_BLOCK, error);
+			write_str(f, item->key, error);
+			if (item->value.block) {
+				write_u32(f, 1, error);
+				write_block(f, item->value.block, error);
+			} else {
+				write_u32(f, 0, error);
+			}
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			write_u32(f, SCCONF_ITEM_TYPE_VALUE, error);
+			write_str(f, item->key, error);
+			write_list(f, item->value.list, error);
+			break;
+		}
+	}
+}
+
+int scconf_write_cache(const scconf_context * config, const char *filename)
+{
+	unsigned long long mtime, size;
+	FILE *f;
+	int error = 0;
+
+	if (!config || !filename
+			|| cache_source_stat(config->filename, &mtime, &size) != 0) {
+		return -1;
+	}
+	/* a file modified within the resolution of its mtime may still
+	 * change without a visible change of mtime and size */
+	if ((unsigned long long) time(NULL) < mtime + 2) {
+		return -1;
+	}
+	f = fopen(filename, "wb");
+	if (!f) {
+		return -1;
+	}
+
+	if (fwrite(SCCONF_CACHE_MAGIC, sizeof SCCONF_CACHE_MAGIC - 1, 1, f) != 1) {
+		error = 1;
+	}
+	write_u32(f, SCCONF_CACHE_BOM, &error);
+	write_u64(f, mtime, &error);
+	write_u64(f, size, &error);
+	write_str(f, config->filename, &error);
+	write_items(f, config->root, &error);
+
+	if (fclose(f) != 0) {
+		error = 1;
+	}
+	return error ? -1 : 0;
+}
+
+static const unsigned char *read_bytes(scconf_cache_reader * r, size_t len)
+{
+	const unsigned char *p = r->p;
+
+	if (r->error || r->left < len) {
+		r->error = 1;
+		return NULL;
+	}
+	r->p += len;
+	r->left -= len;
+	return p;
+}
+
+static unsigned int read_u32(scconf_cache_reader * r)
+{
+	const unsigned char *p = read_bytes(r, sizeof(unsigned int));
+	unsigned int v = 0;
+
+	if (p) {
+		memcpy(&v, p, sizeof v);
+	}
+	return v;
+}
+
+static unsigned long long read_u64(scconf_cache_reader * r)
+{
+	const unsigned char *p = read_bytes(r, sizeof(unsigned long long));
+	unsigned long long v = 0;
+
+	if (p) {
+		memcpy(&v, p, sizeof v);
+	}
+	return v;
+}
+
+/* returns a pointer into the snapshot, which is not terminated */
+static const char *read_str(scconf_cache_reader * r, size_t *len)
+{
+	unsigned int l = read_u32(r);
+
+	*len = 0;
+	if (r->error || l == SCCONF_CACHE_NULL) {
+		return NULL;
+	}
+	*len = l;
+	return (const char *) read_bytes(r, l);
+}
+
+static char *read_strdup(scconf_cache_reader * r)
+{
+	const char *s;
+	char *out;
+	size_t len;
+
+	s = read_str(r, &len);
+	if (!s) {
+		return NULL;
+	}
+	out = malloc(len + 1);
+	if (!out) {
+		r->error = 1;
+		return NULL;
+	}
+	memcpy(out, s, len);
+	out[len] = '\0';
+	return out;
+}
+
+static scconf_list *read_list(scconf_cache_reader * r)
+{
+	scconf_list *list = NULL, **tail = &list;
+	unsigned int count = read_u32(r);
+
+	while (!r->error && count--) {
+		scconf_list *rec = calloc(1, sizeof(scconf_list));
+
+		if (!rec) {
+			r->error = 1;
+			break;
+		}
+		*tail = rec;
+		tail = &rec->next;
+		rec->data = read_strdup(r);
+	}
+	return list;
+}
+
+static void read_items(scconf_cache_reader * r, scconf_block * block, int depth);
+
+static scconf_block *read_block(scconf_cache_reader * r, scconf_block * parent, int depth)
+{
+	scconf_block *block;
+
+	if (depth > SCCONF_CACHE_MAX_DEPTH) {
+		r->error = 1;
+		return NULL;
+	}
+	block = calloc(1, sizeof(scconf_block));
+	if (!block) {
+		r->error = 1;
+		return NULL;
+	}
+	block->parent = parent;
+	block->name = read_list(r);
+	read_items(r, block, depth);
+	return block;
+}
+
+static void read_items(scconf_cache_reader * r, scconf_block * block, int depth)
+{
+	scconf_item **tail = &block->items;
+	unsigned int count = read_u32(r);
+
+	while (!r->error && count--) {
+		scconf_item *item = calloc(1, sizeof(scconf_item));
+
+		if (!item) {
+			r->error = 1;
+			break;
+		}
+		*tail = item;
+		tail = &item->next;
+
+		item->type = (int) read_u32(r);
+		item->key = read_strdup(r);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_BLOCK:
+			if (read_u32(r)) {
+				item->value.block = read_block(r, block, depth + 1);
+			}
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			item->value.list = read_list(r);
+			break;
+		default:
+			item->type = SCCONF_ITEM_TYPE_COMMENT;
+			r->error = 1;
+			break;
+		}
+	}
+}
+
+static unsigned char *read_file(const char *filename, size_t *len)
+{
+	unsigned char *buf = NULL, *p;
+	size_t size = 0, n;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		return NULL;
+	}
+	do {
+		p = realloc(buf, size + 4096);
+		if (!p) {
+			free(buf);
+			fclose(f);
+			return NULL;
+		}
+		buf = p;
+		n = fread(buf + size, 1, 4096, f);
+		size += n;
+	} while (n == 4096);
+	if (ferror(f)) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+int scconf_read_cache(scconf_context * config, const char *filename)
+{
+	unsigned long long mtime, size;
+	scconf_cache_reader r;
+	scconf_block *root;
+	unsigned char *buf;
+	const unsigned char *magic;
+	const char *name;
+	size_t len;
+
+	if (!config || !filename
+			|| cache_source_stat(config->filename, &mtime, &size) != 0) {
+		return -1;
+	}
+	buf = read_file(filename, &len);
+	if (!buf) {
+		return -1;
+	}
+	r.p = buf;
+	r.left = len;
+	r.error = 0;
+
+	/* only use the snapshot if it was made from this very file */
+	magic = read_bytes(&r, sizeof SCCONF_CACHE_MAGIC - 1);
+	if (!magic || memcmp(magic, SCCONF_CACHE_MAGIC, sizeof SCCONF_CACHE_MAGIC - 1) != 0
+			|| read_u32(&r) != SCCONF_CACHE_BOM
+			|| read_u64(&r) != mtime
+			|| read_u64(&r) != size) {
+		free(buf);
+		return -1;
+	}
+	name = read_str(&r, &len);
+	if (!name || len != strlen(config->filename)
+			|| memcmp(name, config->filename, len) != 0) {
+		free(buf);
+		return -1;
+	}
+
+	root = calloc(1, sizeof(scconf_block));
+	if (!root) {
+		free(buf);
+		return -1;
+	}
+	read_items(&r, root, 0);
+	if (r.error || r.left) {
+		scconf_block_destroy(root);
+		free(buf);
+		return -1;
+	}
+	free(buf);
+
+	scconf_block_destroy(config->root);
+	config->root = root;
+	scconf_index_tree(root);
+	return 1;
+}
@@ -49,6 +49,11 @@ typedef struct _scconf_parser {
 	char emesg[256];
 } scconf_parser;
 
+/* Build the hash index of all blocks below and including block */
+extern void scconf_index_tree(scconf_block * block);
+/* Drop the hash index of block after its items were changed */
+extern void scconf_index_free(scconf_block * block);
+
 extern int scconf_lex_parse(scconf_parser * parser, const char *filename);
 extern int scconf_lex_parse_string(scconf_parser * parser,
 				   const char *config_string);
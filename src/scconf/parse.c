@@ -121,6 +121,7 @@ static scconf_item *scconf_item_add_internal(scconf_parser * parser, int type)
 	} else {
 		parser->block->items = item;
 	}
+	scconf_index_free(parser->block);
 	parser->current_item = parser->last_item = item;
 	return item;
 }
@@ -394,6 +395,9 @@ int scconf_parse(scconf_context * config)
 		r = 0;
 	} else {
 		r = 1;
+		/* index the tree now rather than on the first lookup, which may
+		 * come from several threads at once */
+		scconf_index_tree(config->root);
 	}
 
 	if (r <= 0)
@@ -421,6 +425,9 @@ int scconf_parse_string(scconf_context * config, const char *string)
 		r = 0;
 	} else {
 		r = 1;
+		/* index the tree now rather than on the first lookup, which may
+		 * come from several threads at once */
+		scconf_index_tree(config->root);
 	}
 
 	if (r <= 0)
@@ -30,6 +30,145 @@
 #include <ctype.h>
 
 #include "scconf.h"
+#include "internal.h"
+
+/* Blocks with fewer items are searched linearly */
+#define SCCONF_INDEX_MIN_ITEMS	8
+
+typedef struct _scconf_index_entry {
+	scconf_item *item;
+	/* next item with the same hash of the key */
+	struct _scconf_index_entry *next_key;
+	/* next block item with the same hash of key and block name */
+	struct _scconf_index_entry *next_name;
+} scconf_index_entry;
+
+struct _scconf_index {
+	/* number of buckets, a power of two, 0 for a small block */
+	unsigned int size;
+	scconf_index_entry **by_key;
+	scconf_index_entry **by_name;
+	scconf_index_entry *entries;
+};
+
+/* FNV-1a, case insensitive as the lookups */
+static unsigned int scconf_hash(unsigned int h, const char *s)
+{
+	for (; *s; s++) {
+		h ^= (unsigned char) tolower((unsigned char) *s);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+#define scconf_hash_key(key) scconf_hash(2166136261U, (key))
+#define scconf_hash_name(key, name) scconf_hash(scconf_hash_key(key) * 16777619U, (name))
+
+static const char *scconf_block_name(const scconf_item * item)
+{
+	if (item->type != SCCONF_ITEM_TYPE_BLOCK || !item->value.block
+			|| !item->value.block->name || !item->value.block->name->data) {
+		return NULL;
+	}
+	return item->value.block->name->data;
+}
+
+void scconf_index_free(scconf_block * block)
+{
+	if (block && block->index) {
+		free(block->index->by_key);
+		free(block->index->by_name);
+		free(block->index->entries);
+		free(block->index);
+		block->index = NULL;
+	}
+}
+
+static struct _scconf_index *scconf_index_build(scconf_block * block)
+{
+	struct _scconf_index *index;
+	scconf_item *item;
+	unsigned int count = 0, i, h;
+	const char *name;
+
+	index = calloc(1, sizeof(struct _scconf_index));
+	if (!index) {
+		return NULL;
+	}
+	for (item = block->items; item; item = item->next) {
+		if (item->key) {
+			count++;
+		}
+	}
+	if (count >= SCCONF_INDEX_MIN_ITEMS) {
+		for (index->size = 16; index->size < count; index->size <<= 1);
+		index->by_key = calloc(index->size, sizeof(scconf_index_entry *));
+		index->by_name = calloc(index->size, sizeof(scconf_index_entry *));
+		index->entries = calloc(count, sizeof(scconf_index_entry));
+		if (!index->by_key || !index->by_name || !index->entries) {
+			free(index->by_key);
+			free(index->by_name);
+			free(index->entries);
+			free(index);
+			return NULL;
+		}
+		i = 0;
+		for (item = block->items; item; item = item->next) {
+			if (item->key) {
+				index->entries[i++].item = item;
+			}
+		}
+		/* insert backwards, so that the chains are in the order of the
+		 * items */
+		while (i--) {
+			scconf_index_entry *e = &index->entries[i];
+
+			h = scconf_hash_key(e->item->key) & (index->size - 1);
+			e->next_key = index->by_key[h];
+			index->by_key[h] = e;
+
+			name = scconf_block_name(e->item);
+			if (name) {
+				h = scconf_hash_name(e->item->key, name) & (index->size - 1);
+				e->next_name = index->by_name[h];
+				index->by_name[h] = e;
+			}
+		}
+	}
+	block->index = index;
+	return index;
+}
+
+/* Returns the index of the block, or NULL if it is to be searched linearly */
+static const struct _scconf_index *scconf_index_get(const scconf_block * block)
+{
+	const struct _scconf_index *index = block->index;
+
+	if (!index) {
+		/* the index is a cache of the items */
+		index = scconf_index_build((scconf_block *) block);
+	}
+	if (!index || !index->size) {
+		return NULL;
+	}
+	return index;
+}
+
+void scconf_index_tree(scconf_block * block)
+{
+	scconf_item *item;
+
+	if (!block) {
+		return;
+	}
+	scconf_index_free(block);
+	scconf_index_build(block);
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK) {
+			scconf_index_tree(item->value.block);
+		}
+	}
+}
 
 scconf_context *scconf_new(const char *filename)
 {
@@ -64,6 +203,8 @@ void scconf_free(scconf_context * config)
 
 const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
 {
+	const struct _scconf_index *index;
+	const scconf_index_entry *e;
 	scconf_item *item;
 
 	if (!block) {
@@ -72,6 +213,17 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	if (!item_name) {
 		return NULL;
 	}
+	index = scconf_index_get(block);
+	if (index) {
+		e = index->by_key[scconf_hash_key(item_name) & (index->size - 1)];
+		for (; e; e = e->next_key) {
+			if (e->item->type == SCCONF_ITEM_TYPE_BLOCK &&
+			    strcasecmp(item_name, e->item->key) == 0) {
+				return e->item->value.block;
+			}
+		}
+		return NULL;
+	}
 	for (item = block->items; item; item = item->next) {
 		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
 		    strcasecmp(item_name, item->key) == 0) {
@@ -81,10 +233,28 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	return NULL;
 }
 
+static int scconf_blocks_append(scconf_block *** blocks, int *alloc_size, int *size, scconf_block * block)
+{
+	scconf_block **tmp;
+
+	if (*size + 1 >= *alloc_size) {
+		*alloc_size *= 2;
+		tmp = (scconf_block **) realloc(*blocks, sizeof(scconf_block *) * *alloc_size);
+		if (!tmp) {
+			return -1;
+		}
+		*blocks = tmp;
+	}
+	(*blocks)[(*size)++] = block;
+	return 0;
+}
+
 scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
 {
 	scconf_block **blocks = NULL, **tmp;
 	int alloc_size, size;
+	const struct _scconf_index *index;
+	const scconf_index_entry *e;
 	scconf_item *item;
 
 	if (!block) {
@@ -102,24 +272,44 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	}
 	blocks = tmp;
 
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			if (!item->value.block)
-				continue;
-			if (key && strcasecmp(key, item->value.block->name->data)) {
-				continue;
+	index = scconf_index_get(block);
+	if (index && key) {
+		/* only named blocks are in this chain */
+		e = index->by_name[scconf_hash_name(item_name, key) & (index->size - 1)];
+		for (; e; e = e->next_name) {
+			item = e->item;
+			if (strcasecmp(item_name, item->key) == 0
+					&& strcasecmp(key, item->value.block->name->data) == 0
+					&& scconf_blocks_append(&blocks, &alloc_size, &size, item->value.block) < 0) {
+				free(blocks);
+				return NULL;
 			}
-			if (size + 1 >= alloc_size) {
-				alloc_size *= 2;
-				tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
-				if (!tmp) {
+		}
+	} else if (index) {
+		e = index->by_key[scconf_hash_key(item_name) & (index->size - 1)];
+		for (; e; e = e->next_key) {
+			item = e->item;
+			if (item->type == SCCONF_ITEM_TYPE_BLOCK && item->value.block
+					&& strcasecmp(item_name, item->key) == 0
+					&& scconf_blocks_append(&blocks, &alloc_size, &size, item->value.block) < 0) {
+				free(blocks);
+				return NULL;
+			}
+		}
+	} else {
+		for (item = block->items; item; item = item->next) {
+			if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
+			    strcasecmp(item_name, item->key) == 0) {
+				if (!item->value.block)
+					continue;
+				if (key && strcasecmp(key, item->value.block->name->data)) {
+					continue;
+				}
+				if (scconf_blocks_append(&blocks, &alloc_size, &size, item->value.block) < 0) {
 					free(blocks);
 					return NULL;
 				}
-				blocks = tmp;
 			}
-			blocks[size++] = item->value.block;
 		}
 	}
 	blocks[size] = NULL;
@@ -128,11 +318,21 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 
 const scconf_list *scconf_find_list(const scconf_block * block, const char *option)
 {
+	const struct _scconf_index *index;
+	const scconf_index_entry *e;
 	scconf_item *item;
 
 	if (!block)
 		return NULL;
 
+	index = scconf_index_get(block);
+	if (index) {
+		e = index->by_key[scconf_hash_key(option) & (index->size - 1)];
+		for (; e; e = e->next_key)
+			if (e->item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, e->item->key) == 0)
+				return e->item->value.list;
+		return NULL;
+	}
 	for (item = block->items; item; item = item->next)
 		if (item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, item->key) == 0)
 			return item->value.list;
@@ -299,6 +499,7 @@ scconf_block *scconf_block_copy(const scconf_block * src, scconf_block ** dst)
 void scconf_block_destroy(scconf_block * block)
 {
 	if (block) {
+		scconf_index_free(block);
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
 		free(block);
@@ -58,6 +58,8 @@ struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	/* hash index of the items, private to scconf */
+	struct _scconf_index *index;
 };
 
 typedef struct {
@@ -86,6 +88,19 @@ extern int scconf_parse(scconf_context * config);
  */
 extern int scconf_parse_string(scconf_context * config, const char *string);
 
+/* Load config from a binary snapshot written by scconf_write_cache()
+ * The snapshot is only used if it was made from config->filename in its
+ * current state (same mtime and size).
+ * Returns 1 = ok, -1 = no usable snapshot
+ */
+extern int scconf_read_cache(scconf_context * config, const char *filename);
+
+/* Write a binary snapshot of the parsed config->filename
+ * Comments are not included.
+ * Returns 0 = ok, -1 = error
+ */
+extern int scconf_write_cache(const scconf_context * config, const char *filename);
+
 /* Write config to a file
  * If the filename is NULL, use the config->filename
  * Returns 0 = ok, else = errno
@@ -26,6 +26,7 @@
 #include "libopensc/log.h"
 #include "libopensc/opensc.h"
 #include "sm-eac.h"
+#include "sm-iso-internal.h"
 #include "sslutil.h"
 #include <stdlib.h>
 #include <string.h>
@@ -261,6 +262,8 @@ struct eac_sm_ctx {
 	BUF_MEM *eph_pub_key;
 	/** @brief Auxiliary Data */
 	BUF_MEM *auxiliary_data;
+	/** @brief EF.CardAccess the EAC context was initialized with */
+	BUF_MEM *ef_cardaccess;
 	char flags;
 };
 
@@ -272,6 +275,8 @@ extern BUF_MEM *BUF_MEM_create_init(const void *buf, size_t len);
 
 static int eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *data, size_t datalen, u8 **enc);
+static int eac_sm_decrypt_to(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *enc, size_t enclen, u8 *data, u8 *last_block);
 static int eac_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *enc, size_t enclen, u8 **data);
 static int eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
@@ -293,7 +298,8 @@ static void eac_sm_clear_free(const struct iso_sm_ctx *ctx);
 static struct eac_sm_ctx *
 eac_sm_ctx_create(EAC_CTX *ctx, const unsigned char *certificate_description,
 		size_t certificate_description_length,
-		const unsigned char *id_icc, size_t id_icc_length)
+		const unsigned char *id_icc, size_t id_icc_length,
+		const unsigned char *ef_cardaccess, size_t ef_cardaccess_length)
 {
 	struct eac_sm_ctx *out = malloc(sizeof *out);
 	if (!out)
@@ -317,6 +323,14 @@ eac_sm_ctx_create(EAC_CTX *ctx, const unsigned char *certificate_description,
 	} else
 		out->id_icc = NULL;
 
+	if (ef_cardaccess && ef_cardaccess_length) {
+		out->ef_cardaccess = BUF_MEM_create_init(ef_cardaccess,
+				ef_cardaccess_length);
+		if (!out->ef_cardaccess)
+			goto err;
+	} else
+		out->ef_cardaccess = NULL;
+
 	out->eph_pub_key = NULL;
 	out->auxiliary_data = NULL;
 
@@ -337,7 +351,8 @@ static int
 eac_sm_start(sc_card_t *card, EAC_CTX *eac_ctx,
 		const unsigned char *certificate_description,
 		size_t certificate_description_length,
-		const unsigned char *id_icc, size_t id_icc_length)
+		const unsigned char *id_icc, size_t id_icc_length,
+		const unsigned char *ef_cardaccess, size_t ef_cardaccess_length)
 {
 	int r;
 	struct iso_sm_ctx *sctx = NULL;
@@ -355,7 +370,7 @@ eac_sm_start(sc_card_t *card, EAC_CTX *eac_ctx,
 
 	sctx->priv_data = eac_sm_ctx_create(eac_ctx,
 			certificate_description, certificate_description_length,
-			id_icc, id_icc_length);
+			id_icc, id_icc_length, ef_cardaccess, ef_cardaccess_length);
 	if (!sctx->priv_data) {
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
@@ -364,6 +379,7 @@ eac_sm_start(sc_card_t *card, EAC_CTX *eac_ctx,
 	sctx->authenticate = eac_sm_authenticate;
 	sctx->encrypt = eac_sm_encrypt;
 	sctx->decrypt = eac_sm_decrypt;
+	sctx->decrypt_to = eac_sm_decrypt_to;
 	sctx->verify_authentication = eac_sm_verify_authentication;
 	sctx->pre_transmit = eac_sm_pre_transmit;
 	sctx->post_transmit = eac_sm_post_transmit;
@@ -381,9 +397,41 @@ err:
 	return r;
 }
 
+static struct eac_sm_ctx *get_eac_sm_ctx(sc_card_t *card)
+{
+	struct iso_sm_ctx *isosmctx;
+
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT
+			|| card->sm_ctx.ops.get_sm_apdu != iso_get_sm_apdu)
+		return NULL;
+
+	isosmctx = card->sm_ctx.info.cmd_data;
+	if (!isosmctx || isosmctx->clear_free != eac_sm_clear_free)
+		return NULL;
+
+	return isosmctx->priv_data;
+}
+
 static int get_ef_card_access(sc_card_t *card,
 		u8 **ef_cardaccess, size_t *length_ef_cardaccess)
 {
+	struct eac_sm_ctx *eacsmctx = get_eac_sm_ctx(card);
+	u8 *p;
+
+	if (eacsmctx && eacsmctx->ef_cardaccess) {
+		/* EF.CardAccess is static, reuse the one of the current EAC
+		 * session instead of reading it again */
+		p = realloc(*ef_cardaccess, eacsmctx->ef_cardaccess->length);
+		if (!p)
+			return SC_ERROR_OUT_OF_MEMORY;
+		/* Flawfinder: ignore */
+		memcpy(p, eacsmctx->ef_cardaccess->data,
+				eacsmctx->ef_cardaccess->length);
+		*ef_cardaccess = p;
+		*length_ef_cardaccess = eacsmctx->ef_cardaccess->length;
+		return SC_SUCCESS;
+	}
+
 	return iso7816_read_binary_sfid(card, SFID_EF_CARDACCESS, ef_cardaccess, length_ef_cardaccess);
 }
 
@@ -1346,7 +1394,8 @@ int perform_pace(sc_card_t *card,
 
 		r = eac_sm_start(card, eac_ctx, pace_input.certificate_description,
 				pace_input.certificate_description_length, pace_output->id_icc,
-				pace_output->id_icc_length);
+				pace_output->id_icc_length, pace_output->ef_cardaccess,
+				pace_output->ef_cardaccess_length);
 	}
 
 err:
@@ -1544,7 +1593,8 @@ int perform_terminal_authentication(sc_card_t *card,
 			goto err;
 		}
 
-		isosmctx->priv_data = eac_sm_ctx_create(eac_ctx, NULL, 0, NULL, 0);
+		isosmctx->priv_data = eac_sm_ctx_create(eac_ctx, NULL, 0, NULL, 0,
+				ef_cardaccess, ef_cardaccess_length);
 		if (!isosmctx->priv_data) {
 			r = SC_ERROR_INTERNAL;
 			goto err;
@@ -1879,7 +1929,7 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 	}
 
 	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT) {
-		r = eac_sm_start(card, ctx, NULL, 0, NULL, 0);
+		r = eac_sm_start(card, ctx, NULL, 0, NULL, 0, NULL, 0);
 	}
 
 err:
@@ -1990,6 +2040,50 @@ err:
 	return r;
 }
 
+static int
+eac_sm_decrypt_to(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *enc, size_t enclen, u8 *data, u8 *last_block)
+{
+	BUF_MEM *encbuf = NULL, *databuf = NULL;
+	int r;
+	struct eac_sm_ctx *eacsmctx;
+
+	if (!card || !ctx || !enc || !ctx->priv_data || !data || !last_block
+			|| enclen < ctx->block_length) {
+		r = SC_ERROR_INVALID_ARGUMENTS;
+		goto err;
+	}
+	eacsmctx = ctx->priv_data;
+
+	/* OpenPACE keeps the cipher context in the EAC_CTX across calls */
+	encbuf = BUF_MEM_create_init(enc, enclen);
+	databuf = EAC_decrypt(eacsmctx->ctx, encbuf);
+	if (!encbuf || !databuf) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not decrypt data.");
+		ssl_error(card->ctx);
+		r = SC_ERROR_INTERNAL;
+		goto err;
+	}
+
+	if (databuf->length != enclen) {
+		r = SC_ERROR_INTERNAL;
+		goto err;
+	}
+	/* Flawfinder: ignore */
+	memcpy(data, databuf->data, enclen - ctx->block_length);
+	/* Flawfinder: ignore */
+	memcpy(last_block, databuf->data + enclen - ctx->block_length,
+			ctx->block_length);
+	r = databuf->length;
+
+err:
+	BUF_MEM_clear_free(databuf);
+	if (encbuf)
+		BUF_MEM_free(encbuf);
+
+	return r;
+}
+
 static int
 eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *data, size_t datalen, u8 **macdata)
@@ -2372,6 +2466,8 @@ eac_sm_clear_free(const struct iso_sm_ctx *ctx)
 			BUF_MEM_free(eacsmctx->eph_pub_key);
 		if (eacsmctx->auxiliary_data)
 			BUF_MEM_free(eacsmctx->auxiliary_data);
+		if (eacsmctx->ef_cardaccess)
+			BUF_MEM_free(eacsmctx->ef_cardaccess);
 		free(eacsmctx);
 	}
 }
@@ -30,83 +30,111 @@
 
 #ifdef ENABLE_SM
 
-static const struct sc_asn1_entry c_sm_capdu[] = {
-	{ "Cryptogram",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x05, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Padding-content indicator followed by cryptogram",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x07, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Protected Le",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x17, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Cryptographic Checksum",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x0E, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ NULL , 0 , 0 , 0 , NULL , NULL }
+/* Buffer that is only ever enlarged, so that protecting a sequence of APDUs
+ * allocates memory only until the largest one has been seen. */
+struct iso_sm_buf {
+	u8 *data;
+	size_t size;
+	/* holds plaintext, allocated with sc_mem_secure_alloc() */
+	int secure;
 };
 
-static const struct sc_asn1_entry c_sm_rapdu[] = {
-	{ "Cryptogram",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x05, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Padding-content indicator followed by cryptogram" ,
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x07, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Processing Status",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x19, 0               , NULL, NULL },
-	{ "Cryptographic Checksum",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x0E, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ NULL, 0, 0, 0, NULL, NULL }
+struct iso_sm_buffers {
+	/* must be the first member, iso_free_sm_apdu() gets back to the
+	 * buffers from the SM APDU handed out by iso_get_sm_apdu() */
+	sc_apdu_t sm_apdu;
+	/* set while sm_apdu is handed out */
+	int in_use;
+	/* padded data to encrypt */
+	struct iso_sm_buf pad;
+	/* data to authenticate */
+	struct iso_sm_buf mac_data;
+	/* data field of sm_apdu */
+	struct iso_sm_buf cdata;
+	/* response buffer of sm_apdu */
+	struct iso_sm_buf resp;
+	/* output of the encrypt, authenticate and decrypt call backs, which
+	 * realloc() these in place */
+	u8 *enc, *mac, *dec;
 };
 
 static int
-add_iso_pad(const u8 *data, size_t datalen, int block_size, u8 **padded)
+sm_buf_reserve(struct iso_sm_buf *buf, size_t size)
 {
 	u8 *p;
-	size_t p_len;
 
-	if (!padded)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	/* calculate length of padded message */
-	p_len = (datalen / block_size) * block_size + block_size;
-
-	p = realloc(*padded, p_len);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
-
-	if (*padded != data)
-		/* Flawfinder: ignore */
-		memcpy(p, data, datalen);
-
-	*padded = p;
+	if (buf->size < size) {
+		if (buf->secure) {
+			p = sc_mem_secure_alloc(size);
+			if (p && buf->data)
+				memcpy(p, buf->data, buf->size);
+		} else {
+			p = realloc(buf->data, size);
+		}
+		if (!p)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (buf->secure)
+			sc_mem_secure_free(buf->data, buf->size);
+		buf->data = p;
+		buf->size = size;
+	}
 
-	/* now add iso padding */
-	memset(p + datalen, 0x80, 1);
-	memset(p + datalen + 1, 0, p_len - datalen - 1);
+	return SC_SUCCESS;
+}
 
-	return p_len;
+static void
+sm_buffers_free(struct iso_sm_buffers *b)
+{
+	if (b) {
+		sc_mem_secure_free(b->pad.data, b->pad.size);
+		free(b->mac_data.data);
+		free(b->cdata.data);
+		free(b->resp.data);
+		free(b->enc);
+		free(b->mac);
+		free(b->dec);
+		free(b);
+	}
 }
 
 static int
-add_padding(const struct iso_sm_ctx *ctx, const u8 *data, size_t datalen,
-		u8 **padded)
+padded_length(const struct iso_sm_ctx *ctx, size_t datalen)
 {
-	u8 *p;
-
 	switch (ctx->padding_indicator) {
 		case SM_NO_PADDING:
-			if (*padded != data) {
-				p = realloc(*padded, datalen);
-				if (!p)
-					return SC_ERROR_OUT_OF_MEMORY;
-				*padded = p;
-				/* Flawfinder: ignore */
-				memcpy(*padded, data, datalen);
-			}
 			return datalen;
 		case SM_ISO_PADDING:
-			return add_iso_pad(data, datalen, ctx->block_length, padded);
+			if (!ctx->block_length)
+				return SC_ERROR_INVALID_ARGUMENTS;
+			return (datalen / ctx->block_length) * ctx->block_length
+				+ ctx->block_length;
 		default:
 			return SC_ERROR_INVALID_ARGUMENTS;
 	}
 }
 
+/* pads the first datalen bytes of buf in place */
+static int
+add_padding(const struct iso_sm_ctx *ctx, struct iso_sm_buf *buf,
+		size_t datalen)
+{
+	int r;
+
+	r = padded_length(ctx, datalen);
+	if (r < 0)
+		return r;
+	if (sm_buf_reserve(buf, r) < 0)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	if ((size_t) r > datalen) {
+		/* iso padding */
+		buf->data[datalen] = 0x80;
+		memset(buf->data + datalen + 1, 0, r - datalen - 1);
+	}
+
+	return r;
+}
+
 static int
 rm_padding(u8 padding_indicator, const u8 *data, size_t datalen)
 {
@@ -141,148 +169,81 @@ rm_padding(u8 padding_indicator, const u8 *data, size_t datalen)
 	return len;
 }
 
-static int format_le(size_t le, struct sc_asn1_entry *le_entry,
-		u8 **lebuf, size_t *le_len)
-{
-	u8 *p;
-
-	if (!lebuf || !le_len)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	p = realloc(*lebuf, *le_len);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
-	*lebuf = p;
-
-	switch (*le_len) {
-		case 1:
-			p[0] = le & 0xff;
-			break;
-		case 2:
-			p[0] = (le >> 8) & 0xff;
-			p[1] = le & 0xff;
-			break;
-		case 3:
-			p[0] = 0x00;
-			p[1] = (le >> 8) & 0xff;
-			p[2] = le & 0xff;
-			break;
-		default:
-			return SC_ERROR_INVALID_ARGUMENTS;
-	}
-
-	sc_format_asn1_entry(le_entry, *lebuf, le_len, SC_ASN1_PRESENT);
-
-	return SC_SUCCESS;
-}
-
-static int prefix_buf(u8 prefix, u8 *buf, size_t buflen, u8 **cat)
-{
-	u8 *p;
-
-	p = realloc(*cat, buflen + 1);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
-
-	if (*cat == buf) {
-		memmove(p + 1, p, buflen);
-	} else {
-		/* Flawfinder: ignore */
-		memcpy(p + 1, buf, buflen);
-	}
-	p[0] = prefix;
-
-	*cat = p;
-
-	return buflen + 1;
-}
-
+/* pads and encrypts the data into b->enc */
 static int format_data(sc_card_t *card, const struct iso_sm_ctx *ctx,
-		int prepend_padding_indicator, const u8 *data, size_t datalen,
-		struct sc_asn1_entry *formatted_encrypted_data_entry,
-		u8 **formatted_data, size_t *formatted_data_len)
+		struct iso_sm_buffers *b, const u8 *data, size_t datalen)
 {
 	int r;
-	u8 *pad_data = NULL;
-	size_t pad_data_len = 0;
-
-	if (!ctx || !formatted_data || !formatted_data_len) {
-		r = SC_ERROR_INVALID_ARGUMENTS;
-		goto err;
-	}
+	size_t pad_data_len;
 
-	r = add_padding(ctx, data, datalen, &pad_data);
-	if (r < 0) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not add padding to data: %s",
-				sc_strerror(r));
-		goto err;
+	b->pad.secure = 1;
+	r = padded_length(ctx, datalen);
+	if (r < 0 || sm_buf_reserve(&b->pad, r) < 0) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not add padding to data");
+		return r < 0 ? r : SC_ERROR_OUT_OF_MEMORY;
 	}
+	if (datalen)
+		/* Flawfinder: ignore */
+		memcpy(b->pad.data, data, datalen);
+	r = add_padding(ctx, &b->pad, datalen);
+	if (r < 0)
+		return r;
 	pad_data_len = r;
 
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to encrypt", pad_data, pad_data_len);
-	r = ctx->encrypt(card, ctx, pad_data, pad_data_len, formatted_data);
+	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to encrypt", b->pad.data, pad_data_len);
+	r = ctx->encrypt(card, ctx, b->pad.data, pad_data_len, &b->enc);
+	sc_mem_clear(b->pad.data, pad_data_len);
 	if (r < 0) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not encrypt the data");
-		goto err;
-	}
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Cryptogram", *formatted_data, r);
-
-	if (prepend_padding_indicator) {
-		r = prefix_buf(ctx->padding_indicator, *formatted_data, r, formatted_data);
-		if (r < 0) {
-			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not prepend padding indicator to formatted "
-					"data: %s", sc_strerror(r));
-			goto err;
-		}
-	}
-
-	*formatted_data_len = r;
-	sc_format_asn1_entry(formatted_encrypted_data_entry,
-			*formatted_data, formatted_data_len, SC_ASN1_PRESENT);
-
-	r = SC_SUCCESS;
-
-err:
-	if (pad_data) {
-		sc_mem_clear(pad_data, pad_data_len);
-		free(pad_data);
+		return r;
 	}
+	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Cryptogram", b->enc, r);
 
 	return r;
 }
 
-static int format_head(const struct iso_sm_ctx *ctx, const sc_apdu_t *apdu,
-		u8 **formatted_head)
+/* appends a data object to b->cdata, prefix is written before the value
+ * if prefixlen is not 0 */
+static int put_do(struct iso_sm_buffers *b, size_t *cdata_len, u8 tag,
+		const u8 *prefix, size_t prefixlen, const u8 *value, size_t valuelen)
 {
 	u8 *p;
+	int r;
 
-	if (!apdu || !formatted_head)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	p = realloc(*formatted_head, 4);
-	if (!p)
+	r = sc_asn1_put_tag(tag, NULL, prefixlen + valuelen, NULL, 0, NULL);
+	if (r < 0)
+		return r;
+	if (sm_buf_reserve(&b->cdata, *cdata_len + r) < 0)
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	p[0] = apdu->cla;
-	p[1] = apdu->ins;
-	p[2] = apdu->p1;
-	p[3] = apdu->p2;
-	*formatted_head = p;
+	r = sc_asn1_put_tag(tag, NULL, prefixlen + valuelen,
+			b->cdata.data + *cdata_len, b->cdata.size - *cdata_len, &p);
+	if (r < 0)
+		return r;
+	if (prefixlen) {
+		/* Flawfinder: ignore */
+		memcpy(p, prefix, prefixlen);
+		p += prefixlen;
+	}
+	if (valuelen) {
+		/* Flawfinder: ignore */
+		memcpy(p, value, valuelen);
+		p += valuelen;
+	}
+	*cdata_len = p - b->cdata.data;
 
-	return add_padding(ctx, *formatted_head, 4, formatted_head);
+	return SC_SUCCESS;
 }
 
 static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
-		const sc_apdu_t *apdu, sc_apdu_t **psm_apdu)
+		const sc_apdu_t *apdu, struct iso_sm_buffers *b)
 {
-	struct sc_asn1_entry sm_capdu[5];
-	u8 *p, *le = NULL, *sm_data = NULL, *fdata = NULL, *mac_data = NULL,
-	   *asn1 = NULL, *mac = NULL, *resp_data = NULL;
-	size_t sm_data_len, fdata_len, mac_data_len, asn1_len, mac_len, le_len;
-	int r, cse;
-	sc_apdu_t *sm_apdu = NULL;
-
-	if (!apdu || !ctx || !card || !card->reader || !psm_apdu) {
+	u8 le[2];
+	size_t cdata_len = 0, mac_data_len, mac_len, le_len = 0;
+	int r, cse, with_data = 0;
+	sc_apdu_t *sm_apdu = &b->sm_apdu;
+
+	if (!apdu || !ctx || !card || !card->reader) {
 		r = SC_ERROR_INVALID_ARGUMENTS;
 		goto err;
 	}
@@ -293,20 +254,21 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 		goto err;
 	}
 
-	sc_copy_asn1_entry(c_sm_capdu, sm_capdu);
-
-	sm_apdu = malloc(sizeof(sc_apdu_t));
-	if (!sm_apdu) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto err;
-	}
+	memset(sm_apdu, 0, sizeof *sm_apdu);
 	sm_apdu->control = apdu->control;
 	sm_apdu->flags = apdu->flags;
 	sm_apdu->cla = apdu->cla|0x0C;
 	sm_apdu->ins = apdu->ins;
 	sm_apdu->p1 = apdu->p1;
 	sm_apdu->p2 = apdu->p2;
-	r = format_head(ctx, sm_apdu, &mac_data);
+	r = sm_buf_reserve(&b->mac_data, 4);
+	if (r < 0)
+		goto err;
+	b->mac_data.data[0] = sm_apdu->cla;
+	b->mac_data.data[1] = sm_apdu->ins;
+	b->mac_data.data[2] = sm_apdu->p1;
+	b->mac_data.data[3] = sm_apdu->p2;
+	r = add_padding(ctx, &b->mac_data, 4);
 	if (r < 0) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format header of SM apdu");
 		goto err;
@@ -326,76 +288,27 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	switch (cse) {
 		case SC_APDU_CASE_1:
 			break;
-	case SC_APDU_CASE_2_SHORT:
+		case SC_APDU_CASE_2_SHORT:
 			le_len = 1;
-			r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
 			break;
-	case SC_APDU_CASE_2_EXT:
+		case SC_APDU_CASE_2_EXT:
 			if (card->reader->active_protocol == SC_PROTO_T0) {
 				/* T0 extended APDUs look just like short APDUs */
 				le_len = 1;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
 			} else {
 				/* in case of T1 always use 2 bytes for length */
 				le_len = 2;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
 			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
 			break;
 		case SC_APDU_CASE_3_SHORT:
 		case SC_APDU_CASE_3_EXT:
-			if (apdu->ins & 1) {
-				r = format_data(card, ctx, 0, apdu->data, apdu->datalen,
-						sm_capdu + 0, &fdata, &fdata_len);
-			} else {
-				r = format_data(card, ctx, 1, apdu->data, apdu->datalen,
-						sm_capdu + 1, &fdata, &fdata_len);
-			}
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
-					fdata, fdata_len);
+			with_data = 1;
 			break;
 		case SC_APDU_CASE_4_SHORT:
 			/* in case of T0 no Le byte is added */
-			if (card->reader->active_protocol != SC_PROTO_T0) {
+			if (card->reader->active_protocol != SC_PROTO_T0)
 				le_len = 1;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
-				sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
-			}
-
-			if (apdu->ins & 1) {
-				r = format_data(card, ctx, 0, apdu->data, apdu->datalen,
-						sm_capdu + 0, &fdata, &fdata_len);
-			} else {
-				r = format_data(card, ctx, 1, apdu->data, apdu->datalen,
-						sm_capdu + 1, &fdata, &fdata_len);
-			}
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
-					fdata, fdata_len);
+			with_data = 1;
 			break;
 		case SC_APDU_CASE_4_EXT:
 			if (card->reader->active_protocol == SC_PROTO_T0) {
@@ -406,27 +319,8 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 				/* only 2 bytes are use to specify the length of the
 				 * expected data */
 				le_len = 2;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
-				sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
-			}
-
-			if (apdu->ins & 1) {
-				r = format_data(card, ctx, 0, apdu->data, apdu->datalen,
-						sm_capdu + 0, &fdata, &fdata_len);
-			} else {
-				r = format_data(card, ctx, 1, apdu->data, apdu->datalen,
-						sm_capdu + 1, &fdata, &fdata_len);
-			}
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
-				goto err;
 			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
-					fdata, fdata_len);
+			with_data = 1;
 			break;
 		default:
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Unhandled apdu case");
@@ -434,47 +328,72 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 			goto err;
 	}
 
-
-	r = sc_asn1_encode(card->ctx, sm_capdu, (u8 **) &asn1, &asn1_len);
-	if (r < 0) {
-		goto err;
-	}
-	if (asn1_len) {
-		p = realloc(mac_data, mac_data_len + asn1_len);
-		if (!p) {
-			r = SC_ERROR_OUT_OF_MEMORY;
+	if (with_data) {
+		r = format_data(card, ctx, b, apdu->data, apdu->datalen);
+		if (r < 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
 			goto err;
 		}
-		mac_data = p;
-		/* Flawfinder: ignore */
-		memcpy(mac_data + mac_data_len, asn1, asn1_len);
-		mac_data_len += asn1_len;
-		r = add_padding(ctx, mac_data, mac_data_len, &mac_data);
+		if (apdu->ins & 1) {
+			/* Cryptogram */
+			r = put_do(b, &cdata_len, SC_ASN1_TAG_CONTEXT|0x05, NULL, 0, b->enc, r);
+		} else {
+			/* Padding-content indicator followed by cryptogram */
+			r = put_do(b, &cdata_len, SC_ASN1_TAG_CONTEXT|0x07,
+					&ctx->padding_indicator, 1, b->enc, r);
+		}
 		if (r < 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
 			goto err;
 		}
+		sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
+				b->cdata.data, cdata_len);
+	}
+	if (le_len) {
+		if (le_len == 1) {
+			le[0] = apdu->le & 0xff;
+		} else {
+			le[0] = (apdu->le >> 8) & 0xff;
+			le[1] = apdu->le & 0xff;
+		}
+		sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
+		r = put_do(b, &cdata_len, SC_ASN1_TAG_CONTEXT|0x17, NULL, 0, le, le_len);
+		if (r < 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
+			goto err;
+		}
+	}
+
+	if (cdata_len) {
+		r = sm_buf_reserve(&b->mac_data, mac_data_len + cdata_len);
+		if (r < 0)
+			goto err;
+		/* Flawfinder: ignore */
+		memcpy(b->mac_data.data + mac_data_len, b->cdata.data, cdata_len);
+		r = add_padding(ctx, &b->mac_data, mac_data_len + cdata_len);
+		if (r < 0)
+			goto err;
 		mac_data_len = r;
 	}
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to authenticate", mac_data, mac_data_len);
+	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to authenticate", b->mac_data.data, mac_data_len);
 
-	r = ctx->authenticate(card, ctx, mac_data, mac_data_len,
-			&mac);
+	r = ctx->authenticate(card, ctx, b->mac_data.data, mac_data_len,
+			&b->mac);
 	if (r < 0) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not get authentication code");
 		goto err;
 	}
 	mac_len = r;
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Cryptographic Checksum (plain)", mac, mac_len);
+	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Cryptographic Checksum (plain)", b->mac, mac_len);
 
 
 	/* format SM apdu */
-	sc_format_asn1_entry(sm_capdu + 3, mac, &mac_len, SC_ASN1_PRESENT);
-	r = sc_asn1_encode(card->ctx, sm_capdu, (u8 **) &sm_data, &sm_data_len);
+	r = put_do(b, &cdata_len, SC_ASN1_TAG_CONTEXT|0x0E, NULL, 0, b->mac, mac_len);
 	if (r < 0)
 		goto err;
-	sm_apdu->data = sm_data;
-	sm_apdu->datalen = sm_data_len;
-	sm_apdu->lc = sm_data_len;
+	sm_apdu->data = b->cdata.data;
+	sm_apdu->datalen = cdata_len;
+	sm_apdu->lc = cdata_len;
 	sm_apdu->le = 0;
 	if (cse & SC_APDU_EXT) {
 		sm_apdu->cse = SC_APDU_CASE_4_EXT;
@@ -491,74 +410,97 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 		sm_apdu->resplen = SC_MAX_APDU_BUFFER_SIZE;
 #endif
 	}
-	resp_data = malloc(sm_apdu->resplen);
-	if (!resp_data) {
-		r = SC_ERROR_OUT_OF_MEMORY;
+	r = sm_buf_reserve(&b->resp, sm_apdu->resplen);
+	if (r < 0)
 		goto err;
-	}
-	sm_apdu->resp = resp_data;
+	sm_apdu->resp = b->resp.data;
 	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "ASN.1 encoded encrypted APDU data", sm_apdu->data, sm_apdu->datalen);
 
-	*psm_apdu = sm_apdu;
+	r = SC_SUCCESS;
 
 err:
-	free(fdata);
-	free(asn1);
-	free(mac_data);
-	free(mac);
-	free(le);
-	if (r < 0) {
-		free(resp_data);
-		free(sm_apdu);
-		free(sm_data);
-	}
-
 	return r;
 }
 
 static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
-		const sc_apdu_t *sm_apdu, sc_apdu_t *apdu)
+		struct iso_sm_buffers *b, sc_apdu_t *apdu)
 {
 	int r;
-	struct sc_asn1_entry sm_rapdu[5];
-	struct sc_asn1_entry my_sm_rapdu[5];
-	u8 sw[2], mac[8], fdata[SC_MAX_EXT_APDU_BUFFER_SIZE];
-	size_t sw_len = sizeof sw, mac_len = sizeof mac, fdata_len = sizeof fdata,
-		   buf_len, asn1_len, fdata_offset = 0;
-	const u8 *buf;
-	u8 *data = NULL, *mac_data = NULL, *asn1 = NULL;
-
-	sc_copy_asn1_entry(c_sm_rapdu, sm_rapdu);
-	sc_format_asn1_entry(sm_rapdu + 0, fdata, &fdata_len, 0);
-	sc_format_asn1_entry(sm_rapdu + 1, fdata, &fdata_len, 0);
-	sc_format_asn1_entry(sm_rapdu + 2, sw, &sw_len, 0);
-	sc_format_asn1_entry(sm_rapdu + 3, mac, &mac_len, 0);
-
-	r = sc_asn1_decode(card->ctx, sm_rapdu, sm_apdu->resp, sm_apdu->resplen,
-			&buf, &buf_len);
-	if (r < 0)
-		goto err;
-	if (buf_len > 0) {
-		r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
-		goto err;
-	}
+	const sc_apdu_t *sm_apdu = &b->sm_apdu;
+	const u8 *p, *value, *fdata = NULL, *sw = NULL, *mac = NULL;
+	size_t left, taglen, fdata_len = 0, sw_len = 0, mac_len = 0,
+		   mac_data_len = 0, data_len = 0, head_len;
+	unsigned int cla, tag;
+	u8 last_block[32];
+	int fdata_has_indicator = 0;
+
+	/* The data objects are parsed in place.  The checksum covers all data
+	 * objects before it, so these are authenticated as received. */
+	p = sm_apdu->resp;
+	left = sm_apdu->resplen;
+	while (left > 0) {
+		if (mac) {
+			/* data after the checksum is not authenticated */
+			r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+			goto err;
+		}
+		value = p;
+		r = sc_asn1_read_tag(&value, left, &cla, &tag, &taglen);
+		if (r < 0)
+			goto err;
+		if (!value) {
+			r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+			goto err;
+		}
+
+		switch (cla | tag) {
+			case SC_ASN1_TAG_CONTEXT|0x05:
+			case SC_ASN1_TAG_CONTEXT|0x07:
+				/* Cryptogram, Padding-content indicator
+				 * followed by cryptogram */
+				if (fdata) {
+					r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+					goto err;
+				}
+				fdata = value;
+				fdata_len = taglen;
+				fdata_has_indicator = tag == 0x07;
+				break;
+			case SC_ASN1_TAG_CONTEXT|0x19:
+				/* Processing Status */
+				sw = value;
+				sw_len = taglen;
+				break;
+			case SC_ASN1_TAG_CONTEXT|0x0E:
+				/* Cryptographic Checksum */
+				mac = value;
+				mac_len = taglen;
+				mac_data_len = p - sm_apdu->resp;
+				break;
+			default:
+				r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+				goto err;
+		}
 
+		left -= value + taglen - p;
+		p = value + taglen;
+	}
 
-	if (sm_rapdu[3].flags & SC_ASN1_PRESENT) {
-		/* copy from sm_apdu to my_sm_apdu, but leave mac at default */
-		sc_copy_asn1_entry(sm_rapdu, my_sm_rapdu);
-		sc_copy_asn1_entry(&c_sm_rapdu[3], &my_sm_rapdu[3]);
 
-		r = sc_asn1_encode(card->ctx, my_sm_rapdu, &asn1, &asn1_len);
+	if (mac) {
+		r = sm_buf_reserve(&b->mac_data, mac_data_len);
 		if (r < 0)
 			goto err;
-		r = add_padding(ctx, asn1, asn1_len, &mac_data);
+		if (mac_data_len)
+			/* Flawfinder: ignore */
+			memcpy(b->mac_data.data, sm_apdu->resp, mac_data_len);
+		r = add_padding(ctx, &b->mac_data, mac_data_len);
 		if (r < 0) {
 			goto err;
 		}
-		
+
 		r = ctx->verify_authentication(card, ctx, mac, mac_len,
-				mac_data, r);
+				b->mac_data.data, r);
 		if (r < 0)
 			goto err;
 	} else {
@@ -568,22 +510,56 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	}
 
 
-	if (sm_rapdu[1].flags & SC_ASN1_PRESENT) {
-		if (ctx->padding_indicator != fdata[0]) {
+	if (fdata_has_indicator) {
+		if (!fdata_len || ctx->padding_indicator != fdata[0]) {
 			r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
 			goto err;
 		}
-		fdata_offset = 1;
+		fdata++;
+		fdata_len--;
 	}
-	if (sm_rapdu[0].flags & SC_ASN1_PRESENT
-			|| sm_rapdu[1].flags & SC_ASN1_PRESENT) {
-		r = ctx->decrypt(card, ctx, fdata + fdata_offset,
-				fdata_len - fdata_offset, &data);
+	if (fdata && ctx->decrypt_to
+			&& ctx->padding_indicator == SM_ISO_PADDING
+			&& ctx->block_length && ctx->block_length <= sizeof last_block
+			&& fdata_len >= ctx->block_length
+			&& fdata_len % ctx->block_length == 0
+			&& apdu->resp && apdu->resplen >= fdata_len - ctx->block_length) {
+		/* the padding is in the last block, everything before fits
+		 * into the caller's buffer and is decrypted directly to it */
+		head_len = fdata_len - ctx->block_length;
+		r = ctx->decrypt_to(card, ctx, fdata, fdata_len, apdu->resp,
+				last_block);
 		if (r < 0)
 			goto err;
-		buf_len = r;
+		if ((size_t) r != fdata_len) {
+			r = SC_ERROR_INTERNAL;
+			goto err;
+		}
 
-		r = rm_padding(ctx->padding_indicator, data, buf_len);
+		r = rm_padding(ctx->padding_indicator, last_block, ctx->block_length);
+		if (r < 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not remove padding");
+			goto err;
+		}
+
+		if (apdu->resplen < head_len + r) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE,
+					"Response of SM APDU %"SC_FORMAT_LEN_SIZE_T"u byte%s too long",
+					head_len + r - apdu->resplen,
+					head_len + r - apdu->resplen < 2 ? "" : "s");
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+		/* Flawfinder: ignore */
+		memcpy(apdu->resp + head_len, last_block, r);
+		apdu->resplen = head_len + r;
+	} else if (fdata) {
+		r = ctx->decrypt(card, ctx, fdata, fdata_len, &b->dec);
+		if (r < 0)
+			goto err;
+		data_len = r;
+
+		r = rm_padding(ctx->padding_indicator, b->dec, data_len);
 		if (r < 0) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not remove padding");
 			goto err;
@@ -598,13 +574,13 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 			goto err;
 		}
 		/* Flawfinder: ignore */
-		memcpy(apdu->resp, data, r);
+		memcpy(apdu->resp, b->dec, r);
 		apdu->resplen = r;
 	} else {
 		apdu->resplen = 0;
 	}
 
-	if (sm_rapdu[2].flags & SC_ASN1_PRESENT) {
+	if (sw) {
 		if (sw_len != 2) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Length of processing status bytes must be 2");
 			r = SC_ERROR_ASN1_END_OF_CONTENTS;
@@ -626,12 +602,9 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	r = SC_SUCCESS;
 
 err:
-	free(asn1);
-	free(mac_data);
-	if (data) {
-		sc_mem_clear(data, buf_len);
-		free(data);
-	}
+	if (b->dec && data_len)
+		sc_mem_clear(b->dec, data_len);
+	sc_mem_clear(last_block, sizeof last_block);
 
 	return r;
 }
@@ -639,7 +612,10 @@ err:
 static int iso_add_sm(struct iso_sm_ctx *sctx, sc_card_t *card,
 		sc_apdu_t *apdu, sc_apdu_t **sm_apdu)
 {
-	if (!card || !sctx)
+	struct iso_sm_buffers *b;
+	int r;
+
+	if (!card || !sctx || !sm_apdu)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	if ((apdu->cla & 0x0C) == 0x0C) {
@@ -652,19 +628,36 @@ static int iso_add_sm(struct iso_sm_ctx *sctx, sc_card_t *card,
 	if (sctx->pre_transmit)
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sctx->pre_transmit(card, sctx, apdu),
 				"Could not complete SM specific pre transmit routine");
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sm_encrypt(sctx, card, apdu, sm_apdu),
-			"Could not encrypt APDU");
+
+	if (!sctx->buffers)
+		sctx->buffers = calloc(1, sizeof *sctx->buffers);
+	b = sctx->buffers;
+	if (b && b->in_use)
+		/* an APDU sent while transmitting the protected one, e.g. GET
+		 * RESPONSE, gets buffers of its own */
+		b = calloc(1, sizeof *b);
+	if (!b)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = sm_encrypt(sctx, card, apdu, b);
+	if (r < 0) {
+		if (b != sctx->buffers)
+			sm_buffers_free(b);
+		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Could not encrypt APDU");
+	}
+	b->in_use = 1;
+	*sm_apdu = &b->sm_apdu;
 
 	return SC_SUCCESS;
 }
 
 static int iso_rm_sm(struct iso_sm_ctx *sctx, sc_card_t *card,
-		sc_apdu_t *sm_apdu, sc_apdu_t *apdu)
+		struct iso_sm_buffers *b, sc_apdu_t *apdu)
 {
 	if (sctx->post_transmit)
-		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sctx->post_transmit(card, sctx, sm_apdu),
+		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sctx->post_transmit(card, sctx, &b->sm_apdu),
 				"Could not complete SM specific post transmit routine");
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sm_decrypt(sctx, card, sm_apdu, apdu),
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sm_decrypt(sctx, card, b, apdu),
 			"Could not decrypt APDU");
 	if (sctx->finish)
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sctx->finish(card, sctx, apdu),
@@ -690,21 +683,21 @@ int iso_get_sm_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu *
 
 int iso_free_sm_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu **sm_apdu)
 {
-	struct sc_apdu *p;
+	struct iso_sm_ctx *sctx = card->sm_ctx.info.cmd_data;
+	struct iso_sm_buffers *b;
 	int r;
 
-	if (!sm_apdu)
+	if (!sm_apdu || !*sm_apdu)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	p = *sm_apdu;
+	b = (struct iso_sm_buffers *) *sm_apdu;
 
-	r = iso_rm_sm(card->sm_ctx.info.cmd_data, card, p, apdu);
+	r = iso_rm_sm(sctx, card, b, apdu);
 
-	if (p) {
-		free((unsigned char *) p->data);
-		free((unsigned char *) p->resp);
-	}
-	free(*sm_apdu);
+	if (sctx && b == sctx->buffers)
+		b->in_use = 0;
+	else
+		sm_buffers_free(b);
 	*sm_apdu = NULL;
 
 	return r;
@@ -723,10 +716,12 @@ struct iso_sm_ctx *iso_sm_ctx_create(void)
 	sctx->verify_authentication = NULL;
 	sctx->encrypt = NULL;
 	sctx->decrypt = NULL;
+	sctx->decrypt_to = NULL;
 	sctx->pre_transmit = NULL;
 	sctx->post_transmit = NULL;
 	sctx->finish = NULL;
 	sctx->clear_free = NULL;
+	sctx->buffers = NULL;
 
 	return sctx;
 }
@@ -735,6 +730,8 @@ void iso_sm_ctx_clear_free(struct iso_sm_ctx *sctx)
 {
 	if (sctx && sctx->clear_free)
 		sctx->clear_free(sctx);
+	if (sctx)
+		sm_buffers_free(sctx->buffers);
 	free(sctx);
 }
 
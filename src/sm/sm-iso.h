@@ -74,6 +74,13 @@ struct iso_sm_ctx {
 	/** @brief Call back function for decryption of data */
 	int (*decrypt)(sc_card_t *card, const struct iso_sm_ctx *ctx,
 			const u8 *enc, size_t enclen, u8 **data);
+	/** @brief Call back function for decryption of data in place (optional)
+	 *
+	 * Decrypts all but the last block of \a enc to \a data and the last block
+	 * to \a last_block, so that response data is decrypted straight into the
+	 * response buffer of the unprotected APDU. */
+	int (*decrypt_to)(sc_card_t *card, const struct iso_sm_ctx *ctx,
+			const u8 *enc, size_t enclen, u8 *data, u8 *last_block);
 
 	/** @brief Call back function for actions before encoding and encryption of \a apdu */
 	int (*pre_transmit)(sc_card_t *card, const struct iso_sm_ctx *ctx,
@@ -87,6 +94,9 @@ struct iso_sm_ctx {
 
 	/** @brief Clears and frees private data */
 	void (*clear_free)(const struct iso_sm_ctx *ctx);
+
+	/** @brief Scratch buffers reused for each protected APDU (internal) */
+	struct iso_sm_buffers *buffers;
 };
 
 /** 
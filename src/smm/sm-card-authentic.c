@@ -119,6 +119,31 @@ sm_authentic_encode_apdu(struct sc_context *ctx, struct sm_info *sm_info)
 }
 
 
+static int
+sm_authentic_encode_apdus(struct sc_context *ctx, struct sm_info *sm_info,
+		struct sc_remote_data *rdata)
+{
+	struct sc_remote_apdu *rapdu;
+	int rv = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!rdata)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+	sc_log(ctx, "SM encode %i APDUs", rdata->length);
+
+	/* The MAC of each APDU chains into the next one: keep the list order */
+	for (rapdu = rdata->data; rapdu; rapdu = rapdu->next)   {
+		if (rapdu->apdu.data != rapdu->sbuf)
+			LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "SM encode APDUs: data not in send buffer");
+
+		rv = sm_gp_securize_apdu(ctx, sm_info, NULL, &rapdu->apdu);
+		LOG_TEST_RET(ctx, rv, "SM encode APDUs: securize error");
+	}
+
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+
 int
 sm_authentic_get_apdus(struct sc_context *ctx, struct sm_info *sm_info,
 		unsigned char *init_data, size_t init_len, struct sc_remote_data *rdata,
@@ -144,6 +169,10 @@ sm_authentic_get_apdus(struct sc_context *ctx, struct sm_info *sm_info,
 		rv = sm_authentic_encode_apdu(ctx, sm_info);
 		LOG_TEST_RET(ctx, rv, "SM get APDUs: cannot encode APDU");
 		break;
+	case SM_CMD_APDU_TRANSMIT_BATCH:
+		rv = sm_authentic_encode_apdus(ctx, sm_info, rdata);
+		LOG_TEST_RET(ctx, rv, "SM get APDUs: cannot encode APDUs");
+		break;
 	case SM_CMD_INITIALIZE:
 		break;
 	default:
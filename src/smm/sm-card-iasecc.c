@@ -70,6 +70,9 @@ sm_iasecc_get_apdu_read_binary(struct sc_context *ctx, struct sm_info *sm_info,
 	sc_log(ctx,
 	       "SM get 'READ BINARY' APDUs: offset:%"SC_FORMAT_LEN_SIZE_T"u,size:%"SC_FORMAT_LEN_SIZE_T"u",
 	       cmd_data->offs, cmd_data->count);
+	rv = rdata->reserve(rdata, (cmd_data->count + SM_MAX_DATA_SIZE - 1) / SM_MAX_DATA_SIZE);
+	LOG_TEST_RET(ctx, rv, "SM get 'READ BINARY' APDUs: cannot allocate remote APDUs");
+
 	offs = cmd_data->offs;
 	while (cmd_data->count > data_offs)   {
 		int sz = (cmd_data->count - data_offs) > SM_MAX_DATA_SIZE ? SM_MAX_DATA_SIZE : (cmd_data->count - data_offs);
@@ -116,6 +119,9 @@ sm_iasecc_get_apdu_update_binary(struct sc_context *ctx, struct sm_info *sm_info
 	sc_log(ctx,
 	       "SM get 'UPDATE BINARY' APDUs: offset:%"SC_FORMAT_LEN_SIZE_T"u,size:%"SC_FORMAT_LEN_SIZE_T"u",
 	       cmd_data->offs, cmd_data->count);
+	rv = rdata->reserve(rdata, (cmd_data->count + SM_MAX_DATA_SIZE - 1) / SM_MAX_DATA_SIZE);
+	LOG_TEST_RET(ctx, rv, "SM get 'UPDATE BINARY' APDUs: cannot allocate remote APDUs");
+
 	offs = cmd_data->offs;
 	while (data_offs < cmd_data->count)   {
 		int sz = (cmd_data->count - data_offs) > SM_MAX_DATA_SIZE ? SM_MAX_DATA_SIZE : (cmd_data->count - data_offs);
@@ -516,11 +522,19 @@ sm_iasecc_get_apdus(struct sc_context *ctx, struct sm_info *sm_info,
 	sc_log(ctx, "SM IAS/ECC get APDUs: rdata:%p", rdata);
 	sc_log(ctx, "SM IAS/ECC get APDUs: serial %s", sc_dump_hex(sm_info->serialnr.value, sm_info->serialnr.len));
 
-	rv = sm_cwa_decode_authentication_data(ctx, cwa_keyset, cwa_session, init_data);
-	LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: decode authentication data error");
+	if (!cwa_session->established)   {
+		rv = sm_cwa_decode_authentication_data(ctx, cwa_keyset, cwa_session, init_data);
+		LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: decode authentication data error");
+
+		rv = sm_cwa_init_session_keys(ctx, cwa_session, cwa_session->params.crt_at.algo);
+		LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: cannot get session keys");
 
-	rv = sm_cwa_init_session_keys(ctx, cwa_session, cwa_session->params.crt_at.algo);
-	LOG_TEST_RET(ctx, rv, "SM IAS/ECC get APDUs: cannot get session keys");
+		cwa_session->established = 1;
+		cwa_session->ssc_count = 0;
+	}
+	else   {
+		sc_log(ctx, "SM IAS/ECC get APDUs: continue session, %u APDUs secured so far", cwa_session->ssc_count);
+	}
 
 	sc_log(ctx, "SKENC %s", sc_dump_hex(cwa_session->session_enc, sizeof(cwa_session->session_enc)));
 	sc_log(ctx, "SKMAC %s", sc_dump_hex(cwa_session->session_mac, sizeof(cwa_session->session_mac)));
@@ -408,6 +408,7 @@ sm_cwa_securize_apdu(struct sc_context *ctx, struct sm_info *sm_info, struct sc_
 	memcpy((unsigned char *)apdu->data, sbuf, offs);
 
 	sm_incr_ssc(session_data->ssc, sizeof(session_data->ssc));
+	session_data->ssc_count++;
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
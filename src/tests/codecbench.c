@@ -0,0 +1,122 @@
+/*
+ * Benchmark of the hex and base64 codecs of libopensc
+ *
+ * These run on every logged APDU and in the tools that dump files and
+ * certificates, so they are measured here on a few buffer sizes.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/log.h"
+
+static double now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart * 1000000.0 / (double) freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+#endif
+}
+
+static void report(const char *what, size_t size, int iterations, double start)
+{
+	double elapsed = now_us() - start;
+
+	printf("%-14s %6lu %10.3f %10.1f\n", what, (unsigned long) size,
+		elapsed / iterations, size * iterations / elapsed);
+}
+
+static int bench(size_t size, int iterations)
+{
+	u8 *bin = malloc(size), *bin2 = malloc(size), *b64 = malloc(2 * size + 64);
+	char *hex = malloc(3 * size + 1), *dump = malloc(5 * size + 80);
+	size_t i, len;
+	double start;
+	int n, r = 0;
+
+	if (!bin || !bin2 || !b64 || !hex || !dump) {
+		r = 1;
+		goto out;
+	}
+	for (i = 0; i < size; i++)
+		bin[i] = (u8) rand();
+
+	start = now_us();
+	for (n = 0; n < iterations; n++)
+		sc_bin_to_hex(bin, size, hex, 3 * size + 1, ':');
+	report("bin_to_hex", size, iterations, start);
+
+	start = now_us();
+	for (n = 0; n < iterations; n++) {
+		len = size;
+		sc_hex_to_bin(hex, bin2, &len);
+	}
+	report("hex_to_bin", size, iterations, start);
+	if (len != size || memcmp(bin, bin2, size))
+		r = 1;
+
+	start = now_us();
+	for (n = 0; n < iterations; n++)
+		sc_hex_dump(bin, size, dump, 5 * size + 80);
+	report("hex_dump", size, iterations, start);
+
+	start = now_us();
+	for (n = 0; n < iterations; n++)
+		sc_dump_hex(bin, size);
+	report("dump_hex", size, iterations, start);
+
+	start = now_us();
+	for (n = 0; n < iterations; n++)
+		sc_base64_encode(bin, size, b64, 2 * size + 64, 64);
+	report("base64_encode", size, iterations, start);
+
+	start = now_us();
+	for (n = 0; n < iterations; n++)
+		sc_base64_decode((const char *) b64, bin2, size);
+	report("base64_decode", size, iterations, start);
+	if (memcmp(bin, bin2, size))
+		r = 1;
+
+out:
+	free(bin);
+	free(bin2);
+	free(b64);
+	free(hex);
+	free(dump);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 16, 256, 1024 };
+	int i, iterations = argc > 1 ? atoi(argv[1]) : 10000;
+
+	if (iterations <= 0)
+		iterations = 1;
+
+	printf("%-14s %6s %10s %10s\n", "operation", "bytes", "us/op", "MB/s");
+	for (i = 0; i < (int) (sizeof sizes / sizeof *sizes); i++) {
+		if (bench(sizes[i], iterations)) {
+			fprintf(stderr, "Codec round trip failed\n");
+			return 1;
+		}
+	}
+	return 0;
+}
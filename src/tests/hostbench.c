@@ -0,0 +1,837 @@
+/*
+ * Host side micro-benchmarks of libopensc and the PKCS#11 module
+ *
+ * Usage: hostbench [-n iterations] [-m module] [-s dir] [image ...]
+ *
+ * Each image is a card directory of the virtual reader. The PrKDF, CDF
+ * and DODF of every image are decoded entry by entry, as a whole and
+ * through sc_pkcs15_parse_df(). A synthetic token of 1000 objects is
+ * written to the directory given with -s, or to a temporary one, and
+ * serves for the secure messaging wrapping and the PKCS#11 object search.
+ * It comes with an opensc.conf that enables the default card driver.
+ *
+ * Every result is one line of tab separated fields: benchmark, subject,
+ * bytes, iterations and nanoseconds per operation. Other lines start
+ * with '#', so that the output of two releases can be compared directly.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/internal.h"
+#include "libopensc/pkcs15.h"
+#include "libopensc/log.h"
+#include "common/compat_getopt.h"
+#include "pkcs11/pkcs11.h"
+#include "common/libpkcs11.h"
+#ifdef ENABLE_SM
+#include "sm/sm-iso.h"
+#endif
+
+#define TOKEN_DFS		4
+#define TOKEN_DF_OBJECTS	250
+
+#ifndef DEFAULT_PKCS11_PROVIDER
+#define DEFAULT_PKCS11_PROVIDER "opensc-pkcs11.so"
+#endif
+
+static int iterations = 1000;
+
+static double now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart * 1000000000.0 / (double) freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000.0 + ts.tv_nsec;
+#endif
+}
+
+static void report(const char *what, const char *subject, size_t bytes, int count, double elapsed)
+{
+	printf("%s\t%s\t%lu\t%d\t%.1f\n", what, subject, (unsigned long) bytes,
+		count, count ? elapsed / count : 0.0);
+	fflush(stdout);
+}
+
+static int set_env(const char *name, const char *value)
+{
+#ifdef _WIN32
+	return _putenv_s(name, value) ? -1 : 0;
+#else
+	return setenv(name, value, 1);
+#endif
+}
+
+static void bench_codecs(void)
+{
+	static const size_t sizes[] = { 32, 1024 };
+	u8 bin[1024], bin2[1024], b64[2 * 1024 + 64];
+	char hex[3 * 1024 + 1], subject[16];
+	size_t i, s, len;
+	double start;
+	int n;
+
+	for (i = 0; i < sizeof bin; i++)
+		bin[i] = (u8) rand();
+	for (s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+		size_t size = sizes[s];
+
+		snprintf(subject, sizeof subject, "%lu", (unsigned long) size);
+		start = now_ns();
+		for (n = 0; n < iterations; n++)
+			sc_bin_to_hex(bin, size, hex, sizeof hex, 0);
+		report("hex_encode", subject, size, iterations, now_ns() - start);
+
+		start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			len = size;
+			sc_hex_to_bin(hex, bin2, &len);
+		}
+		report("hex_decode", subject, size, iterations, now_ns() - start);
+
+		start = now_ns();
+		for (n = 0; n < iterations; n++)
+			sc_base64_encode(bin, size, b64, sizeof b64, 64);
+		report("base64_encode", subject, size, iterations, now_ns() - start);
+
+		start = now_ns();
+		for (n = 0; n < iterations; n++)
+			sc_base64_decode((const char *) b64, bin2, size);
+		report("base64_decode", subject, size, iterations, now_ns() - start);
+	}
+}
+
+static void bench_pkcs1(struct sc_context *ctx)
+{
+	static const size_t modlens[] = { 256, 512 };
+	u8 hash[32], out[512];
+	char subject[16];
+	size_t i, len;
+	double start;
+	int n, errors = 0;
+
+	memset(hash, 0x5A, sizeof hash);
+	for (i = 0; i < sizeof modlens / sizeof *modlens; i++) {
+		snprintf(subject, sizeof subject, "sha256/%lu", (unsigned long) modlens[i] * 8);
+		start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			len = sizeof out;
+			if (sc_pkcs1_encode(ctx, SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256,
+					hash, sizeof hash, out, &len, modlens[i]) != SC_SUCCESS)
+				errors++;
+		}
+		report("pkcs1_encode", subject, modlens[i], iterations - errors, now_ns() - start);
+	}
+}
+
+static const char *df_name(const struct sc_pkcs15_df *df)
+{
+	switch (df->type) {
+	case SC_PKCS15_PRKDF:
+		return "PrKDF";
+	case SC_PKCS15_CDF:
+	case SC_PKCS15_CDF_TRUSTED:
+	case SC_PKCS15_CDF_USEFUL:
+		return "CDF";
+	case SC_PKCS15_DODF:
+		return "DODF";
+	}
+	return NULL;
+}
+
+/* One pass over the entries of a DF with the decoder sc_pkcs15_parse_df()
+ * uses, but without adding the objects to a card */
+static int decode_entries(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_df *df,
+		const u8 *content, size_t len)
+{
+	int (*func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *, const u8 **, size_t *);
+	struct sc_pkcs15_object *obj;
+	const u8 *p = content;
+	int r, count = 0;
+
+	if (df->type == SC_PKCS15_PRKDF)
+		func = sc_pkcs15_decode_prkdf_entry;
+	else if (df->type == SC_PKCS15_DODF)
+		func = sc_pkcs15_decode_dodf_entry;
+	else
+		func = sc_pkcs15_decode_cdf_entry;
+
+	while (len && *p != 0x00) {
+		obj = calloc(1, sizeof *obj);
+		if (obj == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = func(p15card, obj, &p, &len);
+		if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
+			free(obj);
+			break;
+		}
+		if (r < 0) {
+			free(obj);
+			return r;
+		}
+		sc_pkcs15_free_object(obj);
+		count++;
+	}
+	return count;
+}
+
+/* A card without objects to decode into, with the application of p15card */
+static struct sc_pkcs15_card *scratch_card(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_card *scratch = sc_pkcs15_card_new();
+
+	if (scratch != NULL) {
+		scratch->card = p15card->card;
+		sc_file_dup(&scratch->file_app, p15card->file_app);
+	}
+	return scratch;
+}
+
+static void bench_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df, const char *image)
+{
+	struct sc_pkcs15_card *scratch;
+	char subject[SC_MAX_PATH_STRING_SIZE + 64];
+	u8 *content;
+	size_t len;
+	double start;
+	int n, r, errors = 0;
+
+	if (sc_pkcs15_read_file(p15card, &df->path, &content, &len) != SC_SUCCESS)
+		return;
+	snprintf(subject, sizeof subject, "%s:%s:%s", image, df_name(df), sc_print_path(&df->path));
+
+	r = decode_entries(p15card, df, content, len);
+	if (r <= 0) {
+		printf("# %s: no entries decoded\n", subject);
+		free(content);
+		return;
+	}
+	start = now_ns();
+	for (n = 0; n < iterations; n++)
+		decode_entries(p15card, df, content, len);
+	report("asn1_decode_entries", subject, len, iterations, now_ns() - start);
+
+	/* decoding into the objects of a card, without reading the DF */
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		scratch = scratch_card(p15card);
+		if (scratch == NULL)
+			break;
+		if (sc_pkcs15_decode_df(scratch, df, content, len) != SC_SUCCESS)
+			errors++;
+		sc_pkcs15_card_free(scratch);
+	}
+	report("decode_df", subject, len, n - errors, now_ns() - start);
+
+	/* sc_pkcs15_parse_df() reads the DF from the virtual card as well */
+	errors = 0;
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		scratch = scratch_card(p15card);
+		if (scratch == NULL)
+			break;
+		if (sc_pkcs15_add_df(scratch, df->type, &df->path) != SC_SUCCESS
+				|| sc_pkcs15_parse_df(scratch, scratch->df_list) != SC_SUCCESS)
+			errors++;
+		sc_pkcs15_card_free(scratch);
+	}
+	report("parse_df", subject, len, n - errors, now_ns() - start);
+
+	free(content);
+}
+
+#ifdef ENABLE_SM
+/*
+ * Stand-ins for the cipher and the checksum of a secure messaging
+ * session, cheap enough that the cost of the ISO SM framing shows.
+ */
+#define BENCH_SM_BLOCK	16
+#define BENCH_SM_MAC	8
+
+static int sm_xor(const u8 *in, size_t len, u8 **out)
+{
+	u8 *p = realloc(*out, len);
+	size_t i;
+
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < len; i++)
+		p[i] = in[i] ^ 0x5A;
+	*out = p;
+	return (int) len;
+}
+
+static void sm_fold(const u8 *data, size_t len, u8 *mac)
+{
+	size_t i;
+
+	memset(mac, 0, BENCH_SM_MAC);
+	for (i = 0; i < len; i++)
+		mac[i % BENCH_SM_MAC] ^= data[i];
+}
+
+static int sm_encrypt_cb(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *data, size_t datalen, u8 **enc)
+{
+	return sm_xor(data, datalen, enc);
+}
+
+static int sm_decrypt_cb(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *enc, size_t enclen, u8 **data)
+{
+	return sm_xor(enc, enclen, data);
+}
+
+static int sm_decrypt_to_cb(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *enc, size_t enclen, u8 *data, u8 *last_block)
+{
+	size_t i;
+
+	for (i = 0; i < enclen; i++) {
+		if (i < enclen - BENCH_SM_BLOCK)
+			data[i] = enc[i] ^ 0x5A;
+		else
+			last_block[i - (enclen - BENCH_SM_BLOCK)] = enc[i] ^ 0x5A;
+	}
+	return (int) enclen;
+}
+
+static int sm_authenticate_cb(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *data, size_t datalen, u8 **outdata)
+{
+	u8 *p = realloc(*outdata, BENCH_SM_MAC);
+
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	sm_fold(data, datalen, p);
+	*outdata = p;
+	return BENCH_SM_MAC;
+}
+
+static int sm_verify_cb(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *mac, size_t maclen, const u8 *macdata, size_t macdatalen)
+{
+	u8 expected[BENCH_SM_MAC];
+
+	sm_fold(macdata, macdatalen, expected);
+	if (maclen != BENCH_SM_MAC || memcmp(mac, expected, BENCH_SM_MAC))
+		return SC_ERROR_SM_INVALID_CHECKSUM;
+	return SC_SUCCESS;
+}
+
+/* The protected response carrying 'len' bytes of data and 90 00 */
+static size_t sm_response(const u8 *data, size_t len, u8 *resp)
+{
+	u8 macdata[320], *p = resp;
+	size_t i, padded_len = (len / BENCH_SM_BLOCK + 1) * BENCH_SM_BLOCK;
+
+	*p++ = 0x87;
+	if (padded_len + 1 > 0x7F)
+		*p++ = 0x81;
+	*p++ = (u8) (padded_len + 1);
+	*p++ = SM_ISO_PADDING;
+	for (i = 0; i < padded_len; i++)
+		*p++ = (i < len ? data[i] : i == len ? 0x80 : 0x00) ^ 0x5A;
+	*p++ = 0x99;
+	*p++ = 0x02;
+	*p++ = 0x90;
+	*p++ = 0x00;
+
+	/* the checksum covers the padded data objects before it */
+	len = p - resp;
+	padded_len = (len / BENCH_SM_BLOCK + 1) * BENCH_SM_BLOCK;
+	memcpy(macdata, resp, len);
+	macdata[len] = 0x80;
+	memset(macdata + len + 1, 0, padded_len - len - 1);
+	*p++ = 0x8E;
+	*p++ = BENCH_SM_MAC;
+	sm_fold(macdata, padded_len, p);
+	p += BENCH_SM_MAC;
+	return p - resp;
+}
+
+static void bench_sm(struct sc_card *card)
+{
+	static const size_t sizes[] = { 16, 200 };
+	struct iso_sm_ctx *sctx;
+	struct sc_apdu apdu, *sm_apdu;
+	u8 data[200], resp[256], sm_resp[320];
+	char subject[16];
+	size_t s, sm_resp_len;
+	double start, enc, dec;
+	int n, errors;
+
+	sctx = iso_sm_ctx_create();
+	if (sctx == NULL)
+		return;
+	sctx->block_length = BENCH_SM_BLOCK;
+	sctx->encrypt = sm_encrypt_cb;
+	sctx->decrypt = sm_decrypt_cb;
+	sctx->decrypt_to = sm_decrypt_to_cb;
+	sctx->authenticate = sm_authenticate_cb;
+	sctx->verify_authentication = sm_verify_cb;
+	if (iso_sm_start(card, sctx) != SC_SUCCESS) {
+		iso_sm_ctx_clear_free(sctx);
+		return;
+	}
+
+	memset(data, 0xA5, sizeof data);
+	for (s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+		snprintf(subject, sizeof subject, "%lu", (unsigned long) sizes[s]);
+		sm_resp_len = sm_response(data, sizes[s], sm_resp);
+		enc = dec = 0;
+		errors = 0;
+		for (n = 0; n < iterations; n++) {
+			sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0x88, 0x00, 0x00);
+			apdu.data = data;
+			apdu.datalen = apdu.lc = sizes[s];
+			apdu.resp = resp;
+			apdu.resplen = sizeof resp;
+			apdu.le = sizes[s];
+
+			start = now_ns();
+			if (card->sm_ctx.ops.get_sm_apdu(card, &apdu, &sm_apdu) != SC_SUCCESS) {
+				errors++;
+				continue;
+			}
+			enc += now_ns() - start;
+
+			memcpy(sm_apdu->resp, sm_resp, sm_resp_len);
+			sm_apdu->resplen = sm_resp_len;
+			start = now_ns();
+			if (card->sm_ctx.ops.free_sm_apdu(card, &apdu, &sm_apdu) != SC_SUCCESS
+					|| apdu.resplen != sizes[s])
+				errors++;
+			dec += now_ns() - start;
+		}
+		report("sm_encrypt", subject, sizes[s], iterations - errors, enc);
+		report("sm_decrypt", subject, sizes[s], iterations - errors, dec);
+	}
+	/* frees sctx */
+	sc_sm_stop(card);
+}
+#endif
+
+static int open_card(struct sc_context **ctx, struct sc_card **card, const char *image)
+{
+	struct sc_reader *reader = NULL;
+	unsigned int i;
+	int r;
+
+	if (set_env("OPENSC_VIRTUAL_READER", image) != 0)
+		return SC_ERROR_INTERNAL;
+	r = sc_establish_context(ctx, "hostbench");
+	if (r != SC_SUCCESS)
+		return r;
+	for (i = 0; i < sc_ctx_get_reader_count(*ctx); i++) {
+		reader = sc_ctx_get_reader(*ctx, i);
+		if (reader != NULL && strncmp(reader->name, "Virtual card", 12) == 0)
+			break;
+		reader = NULL;
+	}
+	r = reader ? sc_connect_card(reader, card) : SC_ERROR_NO_READERS_FOUND;
+	if (r != SC_SUCCESS) {
+		sc_release_context(*ctx);
+		*ctx = NULL;
+	}
+	return r;
+}
+
+static int bench_image(const char *image, int with_sm)
+{
+	struct sc_context *ctx;
+	struct sc_card *card;
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_df *df;
+	const char *name;
+	int r;
+
+	r = open_card(&ctx, &card, image);
+	if (r != SC_SUCCESS) {
+		printf("# %s: %s\n", image, sc_strerror(r));
+		return r;
+	}
+	name = strrchr(image, '/');
+	name = name && name[1] ? name + 1 : image;
+
+	r = sc_lock(card);
+	if (r == SC_SUCCESS) {
+		r = sc_pkcs15_bind(card, NULL, &p15card);
+		if (r == SC_SUCCESS) {
+			for (df = p15card->df_list; df != NULL; df = df->next)
+				if (df_name(df) != NULL)
+					bench_df(p15card, df, name);
+			sc_pkcs15_unbind(p15card);
+		} else {
+			printf("# %s: %s\n", image, sc_strerror(r));
+		}
+#ifdef ENABLE_SM
+		if (with_sm)
+			bench_sm(card);
+#endif
+		sc_unlock(card);
+	}
+	sc_disconnect_card(card);
+	sc_release_context(ctx);
+	return r;
+}
+
+static int write_file(const char *dir, const char *name, const u8 *data, size_t len)
+{
+	char path[1024];
+	FILE *f;
+	int r;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	f = fopen(path, "wb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	r = fwrite(data, 1, len, f) == len ? SC_SUCCESS : SC_ERROR_INTERNAL;
+	if (fclose(f) != 0)
+		r = SC_ERROR_INTERNAL;
+	return r;
+}
+
+static int make_dir(const char *path)
+{
+#ifdef _WIN32
+	return _mkdir(path) == 0 || errno == EEXIST ? 0 : -1;
+#else
+	struct stat st;
+
+	return mkdir(path, 0700) == 0 || (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) ? 0 : -1;
+#endif
+}
+
+/* The entries of one DF of the synthetic token, 'first' numbers the objects */
+static int make_df(struct sc_context *ctx, unsigned int type, int first, u8 **buf, size_t *len)
+{
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_data_info data;
+	u8 *entry, *p;
+	size_t entry_len;
+	int i, r;
+
+	*buf = NULL;
+	*len = 0;
+	for (i = first; i < first + TOKEN_DF_OBJECTS; i++) {
+		memset(&obj, 0, sizeof obj);
+		if (type == SC_PKCS15_PRKDF) {
+			memset(&prkey, 0, sizeof prkey);
+			prkey.id.value[0] = (u8) (i >> 8);
+			prkey.id.value[1] = (u8) i;
+			prkey.id.len = 2;
+			prkey.usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_DECRYPT;
+			prkey.native = 1;
+			prkey.key_reference = i & 0x7F;
+			prkey.modulus_length = 2048;
+			sc_format_path("3F0050154B00", &prkey.path);
+			prkey.path.value[4] += (u8) (i >> 8);
+			prkey.path.value[5] = (u8) i;
+			snprintf(obj.label, sizeof obj.label, "Key %d", i);
+			obj.type = SC_PKCS15_TYPE_PRKEY_RSA;
+			obj.data = &prkey;
+			r = sc_pkcs15_encode_prkdf_entry(ctx, &obj, &entry, &entry_len);
+		} else {
+			memset(&data, 0, sizeof data);
+			sc_init_oid(&data.app_oid);
+			snprintf(data.app_label, sizeof data.app_label, "hostbench");
+			sc_format_path("3F0050155000", &data.path);
+			data.path.value[4] += (u8) (i >> 8);
+			data.path.value[5] = (u8) i;
+			snprintf(obj.label, sizeof obj.label, "Data %d", i);
+			obj.type = SC_PKCS15_TYPE_DATA_OBJECT;
+			obj.data = &data;
+			r = sc_pkcs15_encode_dodf_entry(ctx, &obj, &entry, &entry_len);
+		}
+		if (r != SC_SUCCESS)
+			goto err;
+		p = realloc(*buf, *len + entry_len);
+		if (p == NULL) {
+			free(entry);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+		memcpy(p + *len, entry, entry_len);
+		free(entry);
+		*buf = p;
+		*len += entry_len;
+	}
+	return SC_SUCCESS;
+
+err:
+	free(*buf);
+	*buf = NULL;
+	return r;
+}
+
+/*
+ * Writes a card directory of the virtual reader with a PKCS#15
+ * application of 500 RSA keys and 500 data objects, in two PrKDFs and
+ * two DODFs. The objects have no content, they are only listed.
+ */
+static int make_token(const char *dir)
+{
+	static const char *fids[TOKEN_DFS] = { "4401", "4402", "4601", "4602" };
+	static const char atr[] = "3B:80:80:01:01\n";
+	/* no card driver knows the ATR */
+	static const char conf[] = "app default {\n\tenable_default_driver = true;\n}\n";
+	struct sc_context *ctx = NULL;
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_pkcs15_tokeninfo ti;
+	char app[1024], path[SC_MAX_PATH_STRING_SIZE];
+	struct sc_path df_path;
+	u8 *buf = NULL;
+	size_t len;
+	int i, r;
+
+	snprintf(app, sizeof app, "%s/5015", dir);
+	if (make_dir(dir) != 0 || make_dir(app) != 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	r = write_file(dir, "atr", (const u8 *) atr, strlen(atr));
+	if (r == SC_SUCCESS)
+		r = write_file(dir, "opensc.conf", (const u8 *) conf, strlen(conf));
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_establish_context(&ctx, "hostbench");
+	if (r != SC_SUCCESS)
+		return r;
+	p15card = sc_pkcs15_card_new();
+	if (p15card == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	for (i = 0; i < TOKEN_DFS; i++) {
+		unsigned int type = i < TOKEN_DFS / 2 ? SC_PKCS15_PRKDF : SC_PKCS15_DODF;
+
+		snprintf(path, sizeof path, "3F005015%s", fids[i]);
+		sc_format_path(path, &df_path);
+		r = sc_pkcs15_add_df(p15card, type, &df_path);
+		if (r == SC_SUCCESS)
+			r = make_df(ctx, type, i * TOKEN_DF_OBJECTS, &buf, &len);
+		if (r == SC_SUCCESS)
+			r = write_file(app, fids[i], buf, len);
+		free(buf);
+		buf = NULL;
+		if (r != SC_SUCCESS)
+			goto out;
+	}
+
+	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &len);
+	if (r == SC_SUCCESS)
+		r = write_file(app, "5031", buf, len);
+	free(buf);
+	buf = NULL;
+	if (r != SC_SUCCESS)
+		goto out;
+
+	memset(&ti, 0, sizeof ti);
+	sc_init_oid(&ti.profile_indication.oid);
+	ti.serial_number = "0123456789";
+	ti.manufacturer_id = "OpenSC Project";
+	ti.label = "hostbench";
+	ti.flags = SC_PKCS15_TOKEN_READONLY;
+	r = sc_pkcs15_encode_tokeninfo(ctx, &ti, &buf, &len);
+	if (r == SC_SUCCESS)
+		r = write_file(app, "5032", buf, len);
+	free(buf);
+
+out:
+	sc_pkcs15_card_free(p15card);
+	sc_release_context(ctx);
+	return r;
+}
+
+static void remove_token(const char *dir)
+{
+	static const char *files[] = { "4401", "4402", "4601", "4602", "5031", "5032" };
+	char path[1024];
+	size_t i;
+
+	for (i = 0; i < sizeof files / sizeof *files; i++) {
+		snprintf(path, sizeof path, "%s/5015/%s", dir, files[i]);
+		remove(path);
+	}
+	snprintf(path, sizeof path, "%s/5015", dir);
+	rmdir(path);
+	snprintf(path, sizeof path, "%s/atr", dir);
+	remove(path);
+	snprintf(path, sizeof path, "%s/opensc.conf", dir);
+	remove(path);
+	rmdir(dir);
+}
+
+static void bench_find_init(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+		const char *subject, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
+{
+	CK_OBJECT_HANDLE handles[64];
+	CK_ULONG found, total = 0;
+	double start, elapsed = 0;
+	int n, errors = 0;
+
+	for (n = 0; n < iterations; n++) {
+		start = now_ns();
+		if (p11->C_FindObjectsInit(session, templ, count) != CKR_OK) {
+			errors++;
+			continue;
+		}
+		elapsed += now_ns() - start;
+		if (n == 0)
+			while (p11->C_FindObjects(session, handles, 64, &found) == CKR_OK && found)
+				total += found;
+		p11->C_FindObjectsFinal(session);
+	}
+	printf("# %s: %lu objects\n", subject, (unsigned long) total);
+	report("find_objects_init", subject, 0, iterations - errors, elapsed);
+}
+
+static int bench_pkcs11(const char *module, const char *token)
+{
+	CK_FUNCTION_LIST_PTR p11 = NULL;
+	CK_SLOT_ID slots[16];
+	CK_ULONG nslots = 16;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY, data_class = CKO_DATA;
+	CK_BYTE id[] = { 0x00, 0x2A };
+	CK_ATTRIBUTE by_class[] = {
+		{ CKA_CLASS, &key_class, sizeof key_class },
+	};
+	CK_ATTRIBUTE by_id[] = {
+		{ CKA_CLASS, &key_class, sizeof key_class },
+		{ CKA_ID, id, sizeof id },
+	};
+	CK_ATTRIBUTE data[] = {
+		{ CKA_CLASS, &data_class, sizeof data_class },
+	};
+	void *handle;
+	CK_RV rv;
+
+	if (set_env("OPENSC_VIRTUAL_READER", token) != 0)
+		return -1;
+	handle = C_LoadModule(module, &p11);
+	if (handle == NULL) {
+		printf("# %s: cannot load the module\n", module);
+		return -1;
+	}
+	rv = p11->C_Initialize(NULL);
+	if (rv != CKR_OK)
+		goto unload;
+	rv = p11->C_GetSlotList(CK_TRUE, slots, &nslots);
+	if (rv == CKR_OK && nslots == 0)
+		rv = CKR_TOKEN_NOT_PRESENT;
+	if (rv == CKR_OK)
+		rv = p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rv == CKR_OK) {
+		bench_find_init(p11, session, "all", NULL, 0);
+		bench_find_init(p11, session, "class=private_key", by_class, 1);
+		bench_find_init(p11, session, "class=private_key,id", by_id, 2);
+		bench_find_init(p11, session, "class=data", data, 1);
+		p11->C_CloseSession(session);
+	}
+	p11->C_Finalize(NULL);
+
+unload:
+	if (rv != CKR_OK)
+		printf("# %s: CK_RV 0x%lx\n", module, (unsigned long) rv);
+	C_UnloadModule(handle);
+	return rv == CKR_OK ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n iterations] [-m module] [-s dir] [image ...]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *module = DEFAULT_PKCS11_PROVIDER, *token = NULL;
+	char tmp[] = "/tmp/hostbench-XXXXXX", conf[1024];
+	struct sc_context *ctx;
+	int c, i, r = 0, temporary = 0;
+
+	while ((c = getopt(argc, argv, "n:m:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'm':
+			module = optarg;
+			break;
+		case 's':
+			token = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+	if (token == NULL) {
+#ifdef _WIN32
+		usage(argv[0]);
+		return 1;
+#else
+		token = mkdtemp(tmp);
+		if (token == NULL) {
+			perror("mkdtemp");
+			return 1;
+		}
+		temporary = 1;
+#endif
+	}
+
+	/* no reader driver but the virtual one is needed */
+	set_env("OPENSC_VIRTUAL_READER", token);
+
+	printf("# hostbench %s, %d iterations\n", PACKAGE_VERSION, iterations);
+	printf("# benchmark\tsubject\tbytes\titerations\tns/op\n");
+
+	bench_codecs();
+	if (sc_establish_context(&ctx, "hostbench") == SC_SUCCESS) {
+		bench_pkcs1(ctx);
+		sc_release_context(ctx);
+	}
+
+	for (i = optind; i < argc; i++)
+		bench_image(argv[i], 0);
+
+	r = make_token(token);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Cannot write the synthetic token to %s: %s\n", token, sc_strerror(r));
+		r = 1;
+		goto out;
+	}
+	/* the synthetic token comes with its configuration */
+	snprintf(conf, sizeof conf, "%s/opensc.conf", token);
+	set_env("OPENSC_CONF", conf);
+	if (bench_image(token, 1) != SC_SUCCESS || bench_pkcs11(module, token) != 0)
+		r = 1;
+
+out:
+	if (temporary)
+		remove_token(token);
+	return r;
+}
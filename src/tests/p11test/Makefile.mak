@@ -11,6 +11,8 @@ OBJECTS = p11test_loader.obj \
 	p11test_case_usage.obj \
 	p11test_case_wait.obj \
 	p11test_case_pss_oaep.obj \
+	p11test_case_threads.obj \
+	p11test_case_perf.obj \
 	p11test_helpers.obj \
 	$(TOPDIR)\win32\versioninfo.res
 
@@ -30,19 +30,23 @@
 #include "p11test_case_mechs.h"
 #include "p11test_case_wait.h"
 #include "p11test_case_pss_oaep.h"
+#include "p11test_case_threads.h"
+#include "p11test_case_perf.h"
 
 #define DEFAULT_P11LIB	"../../pkcs11/.libs/opensc-pkcs11.so"
 
 void display_usage() {
 	fprintf(stdout,
 		" Usage:\n"
-		"	./p11test [-m module_path] [-s slot_id] [-p pin]\n"
+		"	./p11test [-m module_path] [-s slot_id] [-p pin] [-b seconds]\n"
 		"		-m module_path	Path to tested module (e.g. /usr/lib64/opensc-pkcs11.so)\n"
 		"						Default is "DEFAULT_P11LIB"\n"
 		"		-p pin			Application PIN\n"
 		"		-s slot_id		Slot ID with the card\n"
 		"		-i				Wait for the card before running the test (interactive)\n"
 		"		-o				File to write a log in JSON\n"
+		"		-b seconds		Measure the performance of every mechanism\n"
+		"						of every key for this long, instead of the tests\n"
 		"		-h				This help\n"
 		"\n");
 }
@@ -77,6 +81,19 @@ int main(int argc, char** argv) {
 		/* Verify that RSA-PSS and RSA-OAEP functions if supported */
 		cmocka_unit_test_setup_teardown(pss_oaep_test,
 			user_login_setup, after_test_cleanup),
+
+		/* Sign from several threads and sessions at once */
+		cmocka_unit_test_setup_teardown(threads_test,
+			user_login_threads_setup, after_test_cleanup),
+	};
+	const struct CMUnitTest perf_tests[] = {
+		/* The mechanisms of the token, for the keys */
+		cmocka_unit_test_setup_teardown(supported_mechanisms_test,
+			token_setup, token_cleanup),
+
+		/* Operations per second and latency of every mechanism and key */
+		cmocka_unit_test_setup_teardown(perf_test,
+			user_login_setup, after_test_cleanup),
 	};
 
 	token.library_path = NULL;
@@ -85,9 +102,13 @@ int main(int argc, char** argv) {
 	token.interactive = 0;
 	token.slot_id = (unsigned long) -1;
 	token.log.outfile = NULL;
+	token.bench_time = 0;
 
-	while ((command = getopt(argc, argv, "?hm:s:p:io:")) != -1) {
+	while ((command = getopt(argc, argv, "?hm:s:p:io:b:")) != -1) {
 		switch (command) {
+			case 'b':
+				token.bench_time = atoi(optarg);
+				break;
 			case 'o':
 				token.log.outfile = strdup(optarg);
 				break;
@@ -126,6 +147,10 @@ int main(int argc, char** argv) {
 	debug_print("Card info:\n\tPIN %s\n\tPIN LENGTH %lu\n\t",
 		token.pin, token.pin_length);
 
+	if (token.bench_time > 0)
+		return cmocka_run_group_tests(perf_tests,
+			group_setup, group_teardown);
+
 	return cmocka_run_group_tests(readonly_tests_without_initialization,
 		group_setup, group_teardown);
 }
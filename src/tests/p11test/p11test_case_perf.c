@@ -0,0 +1,446 @@
+/*
+ * p11test_case_perf.c: Performance of the mechanisms of the keys
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "p11test_case_perf.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define PERF_INPUT_SIZE		1024
+
+typedef struct {
+	token_info_t *info;
+	test_cert_t *o;
+	CK_MECHANISM mechanism;
+	union {
+		CK_RSA_PKCS_PSS_PARAMS pss;
+		CK_RSA_PKCS_OAEP_PARAMS oaep;
+		CK_ECDH1_DERIVE_PARAMS ecdh;
+	} params;
+	CK_BYTE input[PERF_INPUT_SIZE];
+	CK_ULONG input_length;
+	CK_BYTE output[PERF_INPUT_SIZE];
+	CK_ULONG output_length;
+	CK_OBJECT_HANDLE derived;
+} perf_ctx_t;
+
+typedef struct {
+	unsigned long *samples;		/* us, latency of every operation */
+	size_t count;
+	size_t size;
+	unsigned long elapsed;		/* us */
+	CK_RV error;			/* of the operation which failed */
+} perf_run_t;
+
+typedef CK_RV (*perf_op_t)(perf_ctx_t *ctx);
+
+static unsigned long now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (unsigned long) (count.QuadPart * 1000000 / frequency.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#endif
+}
+
+static CK_RV perf_sign(perf_ctx_t *ctx)
+{
+	CK_FUNCTION_LIST_PTR fp = ctx->info->function_pointer;
+	CK_RV rv;
+
+	rv = fp->C_SignInit(ctx->info->session_handle, &ctx->mechanism,
+		ctx->o->private_handle);
+	if (rv != CKR_OK)
+		return rv;
+	/* part of the cost of the key, as with every application */
+	always_authenticate(ctx->o, ctx->info);
+	ctx->output_length = sizeof(ctx->output);
+	return fp->C_Sign(ctx->info->session_handle, ctx->input,
+		ctx->input_length, ctx->output, &ctx->output_length);
+}
+
+static CK_RV perf_verify(perf_ctx_t *ctx)
+{
+	CK_FUNCTION_LIST_PTR fp = ctx->info->function_pointer;
+	CK_RV rv;
+
+	rv = fp->C_VerifyInit(ctx->info->session_handle, &ctx->mechanism,
+		ctx->o->public_handle);
+	if (rv != CKR_OK)
+		return rv;
+	return fp->C_Verify(ctx->info->session_handle, ctx->input,
+		ctx->input_length, ctx->output, ctx->output_length);
+}
+
+static CK_RV perf_decrypt(perf_ctx_t *ctx)
+{
+	CK_FUNCTION_LIST_PTR fp = ctx->info->function_pointer;
+	CK_BYTE plain[PERF_INPUT_SIZE];
+	CK_ULONG plain_length = sizeof(plain);
+	CK_RV rv;
+
+	rv = fp->C_DecryptInit(ctx->info->session_handle, &ctx->mechanism,
+		ctx->o->private_handle);
+	if (rv != CKR_OK)
+		return rv;
+	always_authenticate(ctx->o, ctx->info);
+	return fp->C_Decrypt(ctx->info->session_handle, ctx->output,
+		ctx->output_length, plain, &plain_length);
+}
+
+static CK_RV perf_derive(perf_ctx_t *ctx)
+{
+	CK_FUNCTION_LIST_PTR fp = ctx->info->function_pointer;
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_KEY_TYPE key_type = CKK_GENERIC_SECRET;
+	CK_BBOOL _true = TRUE, _false = FALSE;
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+		{ CKA_TOKEN, &_false, sizeof(_false) },
+		{ CKA_SENSITIVE, &_false, sizeof(_false) },
+		{ CKA_EXTRACTABLE, &_true, sizeof(_true) },
+	};
+
+	always_authenticate(ctx->o, ctx->info);
+	return fp->C_DeriveKey(ctx->info->session_handle, &ctx->mechanism,
+		ctx->o->private_handle, template, 5, &ctx->derived);
+}
+
+/*
+ * Runs 'op' again and again for 'seconds', or until it fails. The first
+ * operation is not counted, it fills the caches of the module and of
+ * the card.
+ */
+static void perf_loop(perf_ctx_t *ctx, perf_op_t op, unsigned int seconds,
+	perf_run_t *run)
+{
+	CK_FUNCTION_LIST_PTR fp = ctx->info->function_pointer;
+	unsigned long start, begin, end;
+	int warm = 0;
+
+	memset(run, 0, sizeof(perf_run_t));
+	start = now_us();
+	do {
+		ctx->derived = CK_INVALID_HANDLE;
+		begin = now_us();
+		run->error = op(ctx);
+		end = now_us();
+		if (ctx->derived != CK_INVALID_HANDLE)
+			fp->C_DestroyObject(ctx->info->session_handle, ctx->derived);
+		if (run->error != CKR_OK)
+			break;
+		if (!warm) {
+			warm = 1;
+			start = end;
+			continue;
+		}
+		if (run->count == run->size) {
+			unsigned long *samples;
+
+			run->size = run->size ? 2 * run->size : 256;
+			samples = realloc(run->samples, run->size * sizeof(unsigned long));
+			if (samples == NULL) {
+				run->error = CKR_HOST_MEMORY;
+				break;
+			}
+			run->samples = samples;
+		}
+		run->samples[run->count++] = end - begin;
+	} while (end - start < seconds * 1000000UL);
+	run->elapsed = end - start;
+}
+
+static int cmp_samples(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile 'p' of the sorted samples */
+static unsigned long percentile(perf_run_t *run, unsigned int p)
+{
+	size_t rank = (run->count * p + 99) / 100;
+
+	return rank ? run->samples[rank - 1] : 0;
+}
+
+/* Prints and logs the results, returns 1 if the operation failed */
+static int perf_report(token_info_t *info, test_cert_t *o,
+	CK_MECHANISM_TYPE mech, const char *operation, perf_run_t *run)
+{
+	char rate[32];
+
+	if (run->count > 0)
+		qsort(run->samples, run->count, sizeof(unsigned long), cmp_samples);
+	snprintf(rate, sizeof(rate), "%.2f", run->elapsed
+		? run->count * 1000000.0 / run->elapsed : 0.0);
+	if (run->error != CKR_OK)
+		printf("[%-6s] [%-21s] [%-7s] failed: rv = 0x%.8lX\n",
+			o->id_str, get_mechanism_name(mech), operation, run->error);
+	else
+		printf("[%-6s] [%-21s] [%-7s] %10s/s  p50 %8lu  p90 %8lu  p99 %8lu  max %8lu us\n",
+			o->id_str, get_mechanism_name(mech), operation, rate,
+			percentile(run, 50), percentile(run, 90),
+			percentile(run, 99), percentile(run, 100));
+	P11TEST_DATA_ROW(info, 10,
+		's', o->id_str,
+		's', get_mechanism_name(mech),
+		's', operation,
+		's', rate,
+		'd', (int) run->count,
+		'd', (int) percentile(run, 50),
+		'd', (int) percentile(run, 90),
+		'd', (int) percentile(run, 99),
+		'd', (int) percentile(run, 100),
+		's', run->error == CKR_OK ? "" : "failed");
+	free(run->samples);
+	run->samples = NULL;
+	return run->error != CKR_OK;
+}
+
+/*
+ * Sets up the mechanism and an input for it. The mechanisms with a hash
+ * get the same PSS or OAEP parameters that the applications use most.
+ */
+static void perf_setup(perf_ctx_t *ctx, CK_MECHANISM_TYPE mech)
+{
+	CK_MECHANISM_TYPE hash = CKM_SHA256;
+	CK_RSA_PKCS_MGF_TYPE mgf = CKG_MGF1_SHA256;
+
+	memset(ctx->input, 0xA5, sizeof(ctx->input));
+	ctx->input_length = 32;
+	ctx->mechanism.mechanism = mech;
+	ctx->mechanism.pParameter = NULL_PTR;
+	ctx->mechanism.ulParameterLen = 0;
+
+	switch (mech) {
+	case CKM_RSA_X_509:
+		/* smaller than the modulus */
+		ctx->input_length = (ctx->o->bits + 7) / 8;
+		ctx->input[0] = 0x00;
+		break;
+	case CKM_SHA1_RSA_PKCS_PSS:
+		hash = CKM_SHA_1;
+		mgf = CKG_MGF1_SHA1;
+		break;
+	case CKM_SHA224_RSA_PKCS_PSS:
+		hash = CKM_SHA224;
+		mgf = CKG_MGF1_SHA224;
+		break;
+	case CKM_SHA384_RSA_PKCS_PSS:
+		hash = CKM_SHA384;
+		mgf = CKG_MGF1_SHA384;
+		break;
+	case CKM_SHA512_RSA_PKCS_PSS:
+		hash = CKM_SHA512;
+		mgf = CKG_MGF1_SHA512;
+		break;
+	case CKM_RSA_PKCS_OAEP:
+		/* what OpenSSL encrypts with by default */
+		ctx->params.oaep.hashAlg = CKM_SHA_1;
+		ctx->params.oaep.mgf = CKG_MGF1_SHA1;
+		ctx->params.oaep.source = CKZ_DATA_SPECIFIED;
+		ctx->params.oaep.pSourceData = NULL;
+		ctx->params.oaep.ulSourceDataLen = 0;
+		ctx->mechanism.pParameter = &ctx->params.oaep;
+		ctx->mechanism.ulParameterLen = sizeof(ctx->params.oaep);
+		break;
+	default:
+		break;
+	}
+
+	/* CKM_RSA_PKCS_PSS signs the 32 bytes as a SHA-256 hash */
+	if (is_pss_mechanism(mech)) {
+		ctx->params.pss.hashAlg = hash;
+		ctx->params.pss.mgf = mgf;
+		ctx->params.pss.sLen = 0;
+		ctx->mechanism.pParameter = &ctx->params.pss;
+		ctx->mechanism.ulParameterLen = sizeof(ctx->params.pss);
+	}
+}
+
+/* Encrypts the input with the public key into the output */
+static int perf_encrypt(perf_ctx_t *ctx)
+{
+	int padding, rv;
+
+	if (ctx->o->key.rsa == NULL
+			|| (size_t) RSA_size(ctx->o->key.rsa) > sizeof(ctx->output))
+		return -1;
+	switch (ctx->mechanism.mechanism) {
+	case CKM_RSA_X_509:
+		padding = RSA_NO_PADDING;
+		break;
+	case CKM_RSA_PKCS_OAEP:
+		padding = RSA_PKCS1_OAEP_PADDING;
+		break;
+	default:
+		padding = RSA_PKCS1_PADDING;
+		break;
+	}
+	rv = RSA_public_encrypt(ctx->input_length, ctx->input, ctx->output,
+		ctx->o->key.rsa, padding);
+	if (rv < 0)
+		return -1;
+	ctx->output_length = rv;
+	return 0;
+}
+
+/* ECDH with the public key of the key pair itself */
+static int perf_setup_derive(perf_ctx_t *ctx)
+{
+	const EC_GROUP *group;
+	const EC_POINT *point;
+	size_t length;
+
+	if (ctx->o->key.ec == NULL
+			|| (group = EC_KEY_get0_group(ctx->o->key.ec)) == NULL
+			|| (point = EC_KEY_get0_public_key(ctx->o->key.ec)) == NULL)
+		return -1;
+	length = EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+		ctx->output, sizeof(ctx->output), NULL);
+	if (length == 0)
+		return -1;
+	ctx->output_length = length;
+	ctx->params.ecdh.kdf = CKD_NULL;
+	ctx->params.ecdh.ulSharedDataLen = 0;
+	ctx->params.ecdh.pSharedData = NULL;
+	ctx->params.ecdh.ulPublicDataLen = ctx->output_length;
+	ctx->params.ecdh.pPublicData = ctx->output;
+	ctx->mechanism.mechanism = CKM_ECDH1_DERIVE;
+	ctx->mechanism.pParameter = &ctx->params.ecdh;
+	ctx->mechanism.ulParameterLen = sizeof(ctx->params.ecdh);
+	return 0;
+}
+
+/*
+ * Runs every sign, verify, decrypt and derive mechanism of the token on
+ * every key that allows it for the time given with -b, and reports the
+ * operations per second and the percentiles of their latency. With -o
+ * they are written to the JSON log, one data row per key, mechanism and
+ * operation, to compare tokens and versions of the module.
+ */
+void perf_test(void **state) {
+	token_info_t *info = (token_info_t *) *state;
+	CK_FUNCTION_LIST_PTR fp = info->function_pointer;
+	CK_MECHANISM_INFO mech_info;
+	perf_ctx_t *ctx;
+	perf_run_t run;
+	unsigned int i;
+	int j, errors = 0, derive;
+
+	P11TEST_START(info);
+	if (info->bench_time == 0) {
+		fprintf(stderr, "No time given for the performance tests. Skipping.\n");
+		P11TEST_SKIP(info);
+	}
+
+	ctx = calloc(1, sizeof(perf_ctx_t));
+	if (ctx == NULL)
+		P11TEST_FAIL(info, "Couldn't malloc()");
+	ctx->info = info;
+
+	test_certs_t objects;
+	objects.count = 0;
+	objects.data = NULL;
+
+	search_for_all_objects(&objects, info);
+
+	derive = fp->C_GetMechanismInfo(info->slot_id, CKM_ECDH1_DERIVE,
+		&mech_info) == CKR_OK && (mech_info.flags & CKF_DERIVE);
+
+	printf("[  KEY  ] [      MECHANISM      ] [OPERATION]\n");
+	P11TEST_DATA_ROW(info, 10,
+		's', "KEY ID",
+		's', "MECHANISM",
+		's', "OPERATION",
+		's', "OPS PER SECOND",
+		's', "OPERATIONS",
+		's', "P50 US",
+		's', "P90 US",
+		's', "P99 US",
+		's', "MAX US",
+		's', "ERROR");
+	for (i = 0; i < objects.count; i++) {
+		test_cert_t *o = &objects.data[i];
+
+		ctx->o = o;
+		if (o->private_handle == CK_INVALID_HANDLE)
+			continue;
+
+		for (j = 0; j < o->num_mechs; j++) {
+			test_mech_t *mech = &o->mechs[j];
+
+			if (o->sign && (mech->usage_flags & CKF_SIGN)) {
+				perf_setup(ctx, mech->mech);
+				perf_loop(ctx, perf_sign, info->bench_time, &run);
+				errors += perf_report(info, o, mech->mech, "sign", &run);
+
+				/* the signature of the last round is verified */
+				if (run.error == CKR_OK && o->verify
+						&& o->public_handle != CK_INVALID_HANDLE
+						&& (mech->usage_flags & CKF_VERIFY)) {
+					perf_loop(ctx, perf_verify, info->bench_time, &run);
+					errors += perf_report(info, o, mech->mech, "verify", &run);
+				}
+			}
+
+			if (o->decrypt && o->type == EVP_PK_RSA
+					&& (mech->usage_flags & CKF_DECRYPT)
+					&& (mech->mech == CKM_RSA_PKCS
+					|| mech->mech == CKM_RSA_X_509
+					|| mech->mech == CKM_RSA_PKCS_OAEP)) {
+				perf_setup(ctx, mech->mech);
+				if (perf_encrypt(ctx) != 0) {
+					fprintf(stderr, " [ %s ] Can not encrypt for CKM_%s. Skipping.\n",
+						o->id_str, get_mechanism_name(mech->mech));
+					continue;
+				}
+				perf_loop(ctx, perf_decrypt, info->bench_time, &run);
+				errors += perf_report(info, o, mech->mech, "decrypt", &run);
+			}
+		}
+
+		if (derive && o->derive_priv && o->type == EVP_PK_EC) {
+			if (perf_setup_derive(ctx) != 0) {
+				fprintf(stderr, " [ %s ] No public key to derive with. Skipping.\n",
+					o->id_str);
+				continue;
+			}
+			perf_loop(ctx, perf_derive, info->bench_time, &run);
+			errors += perf_report(info, o, CKM_ECDH1_DERIVE, "derive", &run);
+		}
+	}
+	clean_all_objects(&objects);
+	free(ctx);
+
+	if (errors > 0)
+		P11TEST_FAIL(info, "Some operations failed. Please review the log");
+	P11TEST_PASS(info);
+}
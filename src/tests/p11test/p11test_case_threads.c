@@ -0,0 +1,233 @@
+/*
+ * p11test_case_threads.c: Concurrent use of the module from several threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "p11test_case_threads.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <time.h>
+
+#define THREADS_MAX	8
+#define THREADS_ROUNDS	10
+
+typedef struct {
+	token_info_t *info;
+	test_cert_t *key;
+	test_mech_t *mech;
+	unsigned long ops;
+	unsigned long errors;
+	unsigned long lookup_max;	/* us, longest C_FindObjects & C_GetAttributeValue */
+} thread_ctx_t;
+
+static unsigned long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * One thread: its own session, looking up the key by its ID, reading
+ * an attribute and signing with it. The lookups do not need the card,
+ * so their latency shows how long they wait for the locks held by the
+ * signatures of the other threads.
+ */
+static void *threads_worker(void *arg)
+{
+	thread_ctx_t *ctx = arg;
+	CK_FUNCTION_LIST_PTR fp = ctx->info->function_pointer;
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE filter[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_ID, ctx->key->key_id, ctx->key->key_id_size },
+	};
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	CK_MECHANISM mechanism = { ctx->mech->mech, NULL_PTR, 0 };
+	CK_BYTE message[32], sign[1024];
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE handle;
+	CK_ULONG count, sign_length;
+	unsigned long start, lookup;
+	int i;
+	CK_RV rv;
+
+	memset(message, 0xA5, sizeof(message));
+	rv = fp->C_OpenSession(ctx->info->slot_id, CKF_SERIAL_SESSION,
+		NULL_PTR, NULL_PTR, &session);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "  C_OpenSession: rv = 0x%.8lX\n", rv);
+		ctx->errors = THREADS_ROUNDS;
+		return NULL;
+	}
+
+	for (i = 0; i < THREADS_ROUNDS; i++) {
+		start = now_us();
+		rv = fp->C_FindObjectsInit(session, filter, 2);
+		if (rv == CKR_OK) {
+			rv = fp->C_FindObjects(session, &handle, 1, &count);
+			fp->C_FindObjectsFinal(session);
+		}
+		if (rv == CKR_OK && count != 1)
+			rv = CKR_OBJECT_HANDLE_INVALID;
+		if (rv == CKR_OK)
+			rv = fp->C_GetAttributeValue(session, handle, &attr, 1);
+		lookup = now_us() - start;
+		if (lookup > ctx->lookup_max)
+			ctx->lookup_max = lookup;
+		if (rv != CKR_OK) {
+			fprintf(stderr, "  Key lookup: rv = 0x%.8lX\n", rv);
+			ctx->errors++;
+			continue;
+		}
+
+		rv = fp->C_SignInit(session, &mechanism, handle);
+		if (rv == CKR_OK) {
+			sign_length = sizeof(sign);
+			rv = fp->C_Sign(session, message, sizeof(message),
+				sign, &sign_length);
+		}
+		if (rv != CKR_OK) {
+			fprintf(stderr, "  C_Sign: rv = 0x%.8lX\n", rv);
+			ctx->errors++;
+			continue;
+		}
+		ctx->ops++;
+	}
+
+	fp->C_CloseSession(session);
+	return NULL;
+}
+
+/* Run 'n' threads, returns the number of errors */
+static int threads_run(token_info_t *info, test_cert_t *key, test_mech_t *mech,
+	int n, unsigned long *elapsed, unsigned long *ops, unsigned long *lookup_max)
+{
+	pthread_t threads[THREADS_MAX];
+	thread_ctx_t ctx[THREADS_MAX];
+	unsigned long start;
+	int i, errors = 0;
+
+	memset(ctx, 0, sizeof(ctx));
+	*ops = 0;
+	*lookup_max = 0;
+	start = now_us();
+	for (i = 0; i < n; i++) {
+		ctx[i].info = info;
+		ctx[i].key = key;
+		ctx[i].mech = mech;
+		if (pthread_create(&threads[i], NULL, threads_worker, &ctx[i]) != 0) {
+			fprintf(stderr, "  Can not create thread %d\n", i);
+			n = i;
+			errors++;
+			break;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		errors += ctx[i].errors;
+		*ops += ctx[i].ops;
+		if (ctx[i].lookup_max > *lookup_max)
+			*lookup_max = ctx[i].lookup_max;
+	}
+	*elapsed = now_us() - start;
+	return errors;
+}
+
+void threads_test(void **state) {
+	token_info_t *info = (token_info_t *) *state;
+	unsigned int i;
+	int j, n, errors = 0, slower = 0;
+	unsigned long elapsed, ops, lookup_max, rate, base_rate = 0;
+	test_cert_t *key = NULL;
+	test_mech_t *mech = NULL;
+
+	P11TEST_START(info);
+
+	test_certs_t objects;
+	objects.count = 0;
+	objects.data = NULL;
+
+	search_for_all_objects(&objects, info);
+
+	/* The first key usable for signatures without parameters and
+	 * without a login for every operation */
+	for (i = 0; i < objects.count && key == NULL; i++) {
+		test_cert_t *o = &objects.data[i];
+
+		if (!o->sign || o->always_auth || o->private_handle == CK_INVALID_HANDLE)
+			continue;
+		for (j = 0; j < o->num_mechs; j++) {
+			if ((o->mechs[j].usage_flags & CKF_SIGN) == 0
+					|| is_pss_mechanism(o->mechs[j].mech)
+					|| o->mechs[j].mech == CKM_RSA_X_509)
+				continue;
+			key = o;
+			mech = &o->mechs[j];
+			break;
+		}
+	}
+	if (key == NULL) {
+		clean_all_objects(&objects);
+		fprintf(stderr, "No key usable for signatures in threads. Skipping.\n");
+		P11TEST_SKIP(info);
+	}
+
+	debug_print("\nSign with key %s and CKM_%s from several threads",
+		key->id_str, get_mechanism_name(mech->mech));
+	P11TEST_DATA_ROW(info, 4,
+		's', "THREADS",
+		's', "SIGNATURES PER SECOND",
+		's', "ELAPSED MS",
+		's', "LONGEST LOOKUP US");
+	for (n = 1; n <= THREADS_MAX; n *= 2) {
+		errors += threads_run(info, key, mech, n, &elapsed, &ops, &lookup_max);
+		rate = elapsed ? ops * 1000000UL / elapsed : 0;
+		printf("  [ %d thread(s) ] %lu signatures/s, longest lookup %lu us\n",
+			n, rate, lookup_max);
+		P11TEST_DATA_ROW(info, 4,
+			'd', n,
+			'd', (int) rate,
+			'd', (int) (elapsed / 1000),
+			'd', (int) lookup_max);
+		/* One card signs one thing at a time, so more threads can not
+		 * be much faster, but they must not be much slower either */
+		if (n == 1)
+			base_rate = rate;
+		else if (rate < base_rate / 2)
+			slower++;
+	}
+	clean_all_objects(&objects);
+
+	if (errors > 0)
+		P11TEST_FAIL(info, "Some operations failed in threads. Please review the log");
+	if (slower > 0)
+		P11TEST_FAIL(info, "Throughput drops with several threads. Please review the log");
+	P11TEST_PASS(info);
+}
+
+#else
+
+void threads_test(void **state) {
+	token_info_t *info = (token_info_t *) *state;
+
+	P11TEST_START(info);
+	fprintf(stderr, "Threads are not supported on this platform. Skipping.\n");
+	P11TEST_SKIP(info);
+}
+
+#endif
@@ -73,6 +73,8 @@ typedef struct {
 	size_t pin_length;
 	char *library_path;
 	unsigned int interactive;
+	unsigned int os_locking;
+	unsigned int bench_time;	/* seconds per operation of perf_test */
 	log_context_t log;
 
 	test_mech_t rsa_mechs[MAX_MECHS];
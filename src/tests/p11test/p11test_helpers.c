@@ -41,9 +41,11 @@ int open_session(token_info_t *info) {
 int initialize_cryptoki(token_info_t *info) {
 
 	CK_FUNCTION_LIST_PTR function_pointer = info->function_pointer;
+	CK_C_INITIALIZE_ARGS init_args = { NULL_PTR, NULL_PTR, NULL_PTR, NULL_PTR,
+		CKF_OS_LOCKING_OK, NULL_PTR };
 	CK_RV rv;
 
-	rv = function_pointer->C_Initialize(NULL_PTR);
+	rv = function_pointer->C_Initialize(info->os_locking ? &init_args : NULL_PTR);
 	if(rv != CKR_OK){
 		fprintf(stderr,"Could not initialize CRYPTOKI!\n");
 		return 1;
@@ -103,6 +105,7 @@ int group_setup(void **state)
 	info->pin_length = token.pin_length;
 	info->interactive = token.interactive;
 	info->slot_id = token.slot_id;
+	info->bench_time = token.bench_time;
 
 	if (load_pkcs11_module(info, token.library_path)) {
 		free(info);
@@ -156,6 +159,7 @@ int finalize_token(token_info_t *info) {
 	function_pointer->C_CloseAllSessions(info->slot_id);
 	debug_print("Finalize CRYPTOKI");
 	function_pointer->C_Finalize(NULL_PTR);
+	info->os_locking = 0;
 	return 0;
 }
 
@@ -177,6 +181,14 @@ int user_login_setup(void **state) {
 	return 0;
 }
 
+int user_login_threads_setup(void **state) {
+	token_info_t *info = (token_info_t *) *state;
+
+	/* The module has to expect calls from several threads */
+	info->os_locking = 1;
+	return user_login_setup(state);
+}
+
 int after_test_cleanup(void **state) {
 
 	token_info_t *info = (token_info_t *) *state;
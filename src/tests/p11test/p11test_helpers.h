@@ -28,6 +28,7 @@ int group_setup(void **state);
 int group_teardown(void **state);
 
 int user_login_setup(void **state);
+int user_login_threads_setup(void **state);
 int after_test_cleanup(void **state);
 
 int token_setup(void **state);
@@ -0,0 +1,166 @@
+/*
+ * PKCS#15 benchmark: bind, object lookup and signature
+ *
+ * Run it on a virtual card (OPENSC_VIRTUAL_READER) to measure the host
+ * side cost of these operations without the noise of a reader.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "sc-test.h"
+
+static struct sc_pkcs15_card *p15card;
+
+static double now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart * 1000000.0 / (double) freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+#endif
+}
+
+static unsigned long apdu_count(void)
+{
+	unsigned long count = 0;
+	unsigned int ins;
+
+	for (ins = 0; ins < 256; ins++) {
+		const struct sc_apdu_stats *stats = sc_get_apdu_stats(card->reader, ins);
+
+		if (stats != NULL)
+			count += stats->count;
+	}
+	return count;
+}
+
+static void report(const char *what, int iterations, int errors, double start)
+{
+	double elapsed = now_us() - start;
+
+	printf("%-12s %6d %10.1f %10.1f %10.1f", what, iterations,
+		elapsed / 1000.0, elapsed / iterations,
+		(double) apdu_count() / iterations);
+	if (errors)
+		printf("  (%d failed)", errors);
+	printf("\n");
+}
+
+static int bench_bind(int iterations)
+{
+	double start;
+	int i, r, errors = 0;
+
+	sc_reset_apdu_stats(card->reader);
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		struct sc_pkcs15_card *p15;
+
+		r = sc_pkcs15_bind(card, NULL, &p15);
+		if (r != SC_SUCCESS) {
+			errors++;
+			continue;
+		}
+		sc_pkcs15_unbind(p15);
+	}
+	report("bind", iterations, errors, start);
+	return errors == iterations;
+}
+
+static void bench_find(int iterations)
+{
+	struct sc_pkcs15_object *objs[32];
+	double start;
+	int i, errors = 0;
+
+	sc_reset_apdu_stats(card->reader);
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		if (sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_AUTH_PIN, objs, 32) < 0
+				|| sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_PRKEY, objs, 32) < 0
+				|| sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_CERT_X509, objs, 32) < 0)
+			errors++;
+	}
+	report("find", iterations, errors, start);
+}
+
+static void bench_sign(int iterations)
+{
+	struct sc_pkcs15_object *key;
+	unsigned long flags;
+	u8 in[32], out[1024];
+	double start;
+	int i, r, errors = 0;
+
+	if (sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_PRKEY, &key, 1) != 1) {
+		printf("%-12s no private key\n", "sign");
+		return;
+	}
+	if (key->type == SC_PKCS15_TYPE_PRKEY_RSA)
+		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+	else if (key->type == SC_PKCS15_TYPE_PRKEY_EC)
+		flags = SC_ALGORITHM_ECDSA_RAW;
+	else {
+		printf("%-12s unsupported key type\n", "sign");
+		return;
+	}
+	memset(in, 0x5A, sizeof(in));
+
+	sc_reset_apdu_stats(card->reader);
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		r = sc_pkcs15_compute_signature(p15card, key, flags, in, sizeof(in), out, sizeof(out));
+		if (r < 0)
+			errors++;
+	}
+	report("sign", iterations, errors, start);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, iterations = 100, nargs = argc;
+
+	i = sc_test_init(&argc, argv);
+	if (i < 0)
+		return 1;
+	if (argc < nargs)
+		iterations = atoi(argv[argc]);
+	if (iterations <= 0)
+		iterations = 1;
+	ctx->flags |= SC_CTX_FLAG_APDU_STATS;
+
+	if (SC_SUCCESS != sc_lock(card))
+		return 1;
+	printf("%-12s %6s %10s %10s %10s\n", "operation", "count", "total ms", "us/op", "APDUs/op");
+	if (bench_bind(iterations)) {
+		fprintf(stderr, "No PKCS#15 compatible card found\n");
+		return 1;
+	}
+	i = sc_pkcs15_bind(card, NULL, &p15card);
+	if (i == SC_SUCCESS) {
+		bench_find(iterations);
+		bench_sign(iterations);
+		sc_pkcs15_unbind(p15card);
+	}
+	sc_unlock(card);
+	sc_test_cleanup();
+	return 0;
+}
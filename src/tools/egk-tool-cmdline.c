@@ -42,6 +42,7 @@ const char *gengetopt_args_info_help[] = {
   "      --vd          Show 'Allgemeine Versicherungsdaten' (XML)  (default=off)",
   "      --gvd         Show 'Geschützte Versicherungsdaten' (XML)  (default=off)",
   "      --vsd-status  Show 'Versichertenstammdaten-Status'  (default=off)",
+  "      --json        Print the requested data as one JSON object  (default=off)",
   "\nReport bugs to https://github.com/OpenSC/OpenSC/issues\n\nWritten by Frank Morgner <frankmorgner@gmail.com>",
     0
 };
@@ -77,6 +78,7 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->vd_given = 0 ;
   args_info->gvd_given = 0 ;
   args_info->vsd_status_given = 0 ;
+  args_info->json_given = 0 ;
 }
 
 static
@@ -89,6 +91,7 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->vd_flag = 0;
   args_info->gvd_flag = 0;
   args_info->vsd_status_flag = 0;
+  args_info->json_flag = 0;
   
 }
 
@@ -107,6 +110,7 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->vd_help = gengetopt_args_info_help[6] ;
   args_info->gvd_help = gengetopt_args_info_help[7] ;
   args_info->vsd_status_help = gengetopt_args_info_help[8] ;
+  args_info->json_help = gengetopt_args_info_help[9] ;
   
 }
 
@@ -244,6 +248,8 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "gvd", 0, 0 );
   if (args_info->vsd_status_given)
     write_into_file(outfile, "vsd-status", 0, 0 );
+  if (args_info->json_given)
+    write_into_file(outfile, "json", 0, 0 );
   
 
   i = EXIT_SUCCESS;
@@ -1174,6 +1180,7 @@ cmdline_parser_internal (
         { "vd",	0, NULL, 0 },
         { "gvd",	0, NULL, 0 },
         { "vsd-status",	0, NULL, 0 },
+        { "json",	0, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -1269,6 +1276,18 @@ cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Print the requested data as one JSON object.  */
+          else if (strcmp (long_options[option_index].name, "json") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->json_flag), 0, &(args_info->json_given),
+                &(local_args_info.json_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "json", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
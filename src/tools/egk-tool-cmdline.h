@@ -53,6 +53,8 @@ struct gengetopt_args_info
   const char *gvd_help; /**< @brief Show 'Geschützte Versicherungsdaten' (XML) help description.  */
   int vsd_status_flag;	/**< @brief Show 'Versichertenstammdaten-Status' (default=off).  */
   const char *vsd_status_help; /**< @brief Show 'Versichertenstammdaten-Status' help description.  */
+  int json_flag;	/**< @brief Print the requested data as one JSON object (default=off).  */
+  const char *json_help; /**< @brief Print the requested data as one JSON object help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -62,6 +64,7 @@ struct gengetopt_args_info
   unsigned int vd_given ;	/**< @brief Whether vd was given.  */
   unsigned int gvd_given ;	/**< @brief Whether gvd was given.  */
   unsigned int vsd_status_given ;	/**< @brief Whether vsd-status was given.  */
+  unsigned int json_given ;	/**< @brief Whether json was given.  */
 
 } ;
 
@@ -35,40 +35,18 @@
 
 #ifdef ENABLE_ZLIB
 #include <zlib.h>
-
-int uncompress_gzip(void* uncompressed, size_t *uncompressed_len,
-		const void* compressed, size_t compressed_len)
-{
-	z_stream stream;
-	memset(&stream, 0, sizeof stream);
-	stream.total_in = compressed_len;
-	stream.avail_in = compressed_len;
-	stream.total_out = *uncompressed_len;
-	stream.avail_out = *uncompressed_len;
-	stream.next_in = (Bytef *) compressed;
-	stream.next_out = (Bytef *) uncompressed;
-
-	/* 15 window bits, and the +32 tells zlib to to detect if using gzip or zlib */
-	if (Z_OK == inflateInit2(&stream, (15 + 32))
-			&& Z_STREAM_END == inflate(&stream, Z_FINISH)) {
-		*uncompressed_len = stream.total_out;
-	} else {
-		return SC_ERROR_INVALID_DATA;
-	}
-	inflateEnd(&stream);
-
-	return SC_SUCCESS;
-}
-#else
-int uncompress_gzip(void* uncompressed, size_t *uncompressed_len,
-		const void* compressed, size_t compressed_len)
-{
-	return SC_ERROR_NOT_SUPPORTED;
-}
 #endif
 
 #define PRINT(c) (isprint(c) ? c : '?')
 
+/* EFs of the HCA by their short file identifiers */
+#define SFID_EF_PD		0x01
+#define SFID_EF_VD		0x02
+#define SFID_EF_STATUSVD	0x0C
+
+static int json = 0;
+static int json_members = 0;
+
 void dump_binary(void *buf, size_t buf_len)
 {
 #ifdef _WIN32
@@ -80,6 +58,107 @@ void dump_binary(void *buf, size_t buf_len)
 #endif
 }
 
+/* Prints data of the card, which is encoded in ISO-8859-15, as part of a
+ * JSON string in UTF-8 */
+static void dump_json_chars(const unsigned char *buf, size_t buf_len)
+{
+	static const struct {
+		unsigned char c;
+		unsigned short u;
+	} iso8859_15[] = {
+		{0xA4, 0x20AC}, {0xA6, 0x0160}, {0xA8, 0x0161}, {0xB4, 0x017D},
+		{0xB8, 0x017E}, {0xBC, 0x0152}, {0xBD, 0x0153}, {0xBE, 0x0178},
+	};
+	size_t i, j;
+
+	for (i = 0; i < buf_len; i++) {
+		unsigned int u = buf[i];
+
+		if (u == '"' || u == '\\') {
+			printf("\\%c", u);
+		} else if (u < 0x20) {
+			printf("\\u%04x", u);
+		} else if (u < 0x80) {
+			putchar(u);
+		} else {
+			for (j = 0; j < sizeof iso8859_15 / sizeof *iso8859_15; j++) {
+				if (iso8859_15[j].c == u) {
+					u = iso8859_15[j].u;
+					break;
+				}
+			}
+			if (u < 0x800) {
+				putchar(0xC0 | (u >> 6));
+			} else {
+				putchar(0xE0 | (u >> 12));
+				putchar(0x80 | ((u >> 6) & 0x3F));
+			}
+			putchar(0x80 | (u & 0x3F));
+		}
+	}
+}
+
+static void print_data(const unsigned char *buf, size_t buf_len)
+{
+	if (json)
+		dump_json_chars(buf, buf_len);
+	else
+		dump_binary((void *) buf, buf_len);
+}
+
+static void print_begin(const char *name)
+{
+	if (json)
+		printf("%s\"%s\":\"", json_members++ ? "," : "", name);
+}
+
+static void print_end(void)
+{
+	if (json)
+		printf("\"");
+}
+
+/* Prints gzip or zlib compressed data while it is being decompressed; data
+ * that is not compressed is printed as it is */
+static void print_compressed(const unsigned char *data, size_t data_len)
+{
+#ifdef ENABLE_ZLIB
+	z_stream stream;
+	unsigned char chunk[4096];
+	size_t printed = 0;
+	int r;
+
+	memset(&stream, 0, sizeof stream);
+	stream.next_in = (Bytef *) data;
+	stream.avail_in = data_len;
+
+	/* 15 window bits, and the +32 tells zlib to to detect if using gzip or zlib */
+	if (Z_OK != inflateInit2(&stream, (15 + 32))) {
+		print_data(data, data_len);
+		return;
+	}
+	do {
+		stream.next_out = chunk;
+		stream.avail_out = sizeof chunk;
+		r = inflate(&stream, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END)
+			break;
+		print_data(chunk, sizeof chunk - stream.avail_out);
+		printed += sizeof chunk - stream.avail_out;
+	} while (r != Z_STREAM_END);
+	inflateEnd(&stream);
+
+	if (r != Z_STREAM_END) {
+		if (printed == 0)
+			print_data(data, data_len);
+		else
+			fprintf(stderr, "Compressed data is truncated or corrupt\n");
+	}
+#else
+	print_data(data, data_len);
+#endif
+}
+
 const unsigned char aid_hca[] = {0xD2, 0x76, 0x00, 0x00, 0x01, 0x02};
 
 static int initialize(int reader_id, int verbose,
@@ -170,6 +249,21 @@ err:
 	return ok;
 }
 
+/* Reads an EF of the HCA with its short file identifier, which needs no
+ * SELECT; falls back to selecting the EF if the card does not allow that */
+static int read_ef(struct sc_card *card, unsigned char sfid,
+		unsigned char **data, size_t *data_len)
+{
+	char str_path[5];
+
+	if (iso7816_read_binary_sfid(card, sfid, data, data_len) == SC_SUCCESS
+			&& *data_len > 0)
+		return 1;
+
+	snprintf(str_path, sizeof str_path, "D0%02X", sfid);
+	return read_file(card, str_path, data, data_len);
+}
+
 void decode_version(unsigned char *bcd, unsigned int *major, unsigned int *minor, unsigned int *fix)
 {
 	*major = 0;
@@ -221,26 +315,24 @@ main (int argc, char **argv)
 	if (SC_SUCCESS != sc_select_file(card, &path, NULL))
 		goto err;
 
+	json = cmdline.json_flag;
+	if (json)
+		printf("{");
+
 	if (cmdline.pd_flag
-			&& read_file(card, "D001", &data, &data_len)
+			&& read_ef(card, SFID_EF_PD, &data, &data_len)
 			&& data_len >= 2) {
 		size_t len_pd = (data[0] << 8) | data[1];
 
 		if (len_pd + 2 <= data_len) {
-			unsigned char uncompressed[1024];
-			size_t uncompressed_len = sizeof uncompressed;
-
-			if (uncompress_gzip(uncompressed, &uncompressed_len,
-						data + 2, len_pd) == SC_SUCCESS) {
-				dump_binary(uncompressed, uncompressed_len);
-			} else {
-				dump_binary(data + 2, len_pd);
-			}
+			print_begin("pd");
+			print_compressed(data + 2, len_pd);
+			print_end();
 		}
 	}
 
 	if ((cmdline.vd_flag || cmdline.gvd_flag)
-			&& read_file(card, "D001", &data, &data_len)
+			&& read_ef(card, SFID_EF_VD, &data, &data_len)
 			&& data_len >= 8) {
 		size_t off_vd  = (data[0] << 8) | data[1];
 		size_t end_vd  = (data[2] << 8) | data[3];
@@ -251,31 +343,22 @@ main (int argc, char **argv)
 
 		if (off_vd <= end_vd && end_vd < data_len
 				&& off_gvd <= end_gvd && end_gvd < data_len) {
-			unsigned char uncompressed[1024];
-			size_t uncompressed_len = sizeof uncompressed;
-
 			if (cmdline.vd_flag) {
-				if (uncompress_gzip(uncompressed, &uncompressed_len,
-							data + off_vd, len_vd) == SC_SUCCESS) {
-					dump_binary(uncompressed, uncompressed_len);
-				} else {
-					dump_binary(data + off_vd, len_vd);
-				}
+				print_begin("vd");
+				print_compressed(data + off_vd, len_vd);
+				print_end();
 			}
 
 			if (cmdline.gvd_flag) {
-				if (uncompress_gzip(uncompressed, &uncompressed_len,
-							data + off_gvd, len_gvd) == SC_SUCCESS) {
-					dump_binary(uncompressed, uncompressed_len);
-				} else {
-					dump_binary(data + off_gvd, len_gvd);
-				}
+				print_begin("gvd");
+				print_compressed(data + off_gvd, len_gvd);
+				print_end();
 			}
 		}
 	}
 
 	if (cmdline.vsd_status_flag
-			&& read_file(card, "D00C", &data, &data_len)
+			&& read_ef(card, SFID_EF_STATUSVD, &data, &data_len)
 			&& data_len >= 25) {
 		char *status;
 		unsigned int major, minor, fix;
@@ -294,20 +377,42 @@ main (int argc, char **argv)
 
 		decode_version(data+15, &major, &minor, &fix);
 
-		printf(
-				"Status      %s\n"
-				"Timestamp   %c%c.%c%c.%c%c%c%c at %c%c:%c%c:%c%c\n"
-				"Version     %u.%u.%u\n",
-				status,
-				PRINT(data[7]), PRINT(data[8]),
-				PRINT(data[5]), PRINT(data[6]),
-				PRINT(data[1]), PRINT(data[2]), PRINT(data[3]), PRINT(data[4]),
-				PRINT(data[9]), PRINT(data[10]),
-				PRINT(data[11]), PRINT(data[12]),
-				PRINT(data[13]), PRINT(data[14]),
-				major, minor, fix);
+		if (json) {
+			char timestamp[20];
+
+			snprintf(timestamp, sizeof timestamp, "%c%c%c%c-%c%c-%c%cT%c%c:%c%c:%c%c",
+					PRINT(data[1]), PRINT(data[2]), PRINT(data[3]), PRINT(data[4]),
+					PRINT(data[5]), PRINT(data[6]),
+					PRINT(data[7]), PRINT(data[8]),
+					PRINT(data[9]), PRINT(data[10]),
+					PRINT(data[11]), PRINT(data[12]),
+					PRINT(data[13]), PRINT(data[14]));
+			print_begin("vsd-status");
+			print_data((unsigned char *) status, strlen(status));
+			print_end();
+			print_begin("vsd-timestamp");
+			print_data((unsigned char *) timestamp, strlen(timestamp));
+			print_end();
+			printf(",\"vsd-version\":\"%u.%u.%u\"", major, minor, fix);
+		} else {
+			printf(
+					"Status      %s\n"
+					"Timestamp   %c%c.%c%c.%c%c%c%c at %c%c:%c%c:%c%c\n"
+					"Version     %u.%u.%u\n",
+					status,
+					PRINT(data[7]), PRINT(data[8]),
+					PRINT(data[5]), PRINT(data[6]),
+					PRINT(data[1]), PRINT(data[2]), PRINT(data[3]), PRINT(data[4]),
+					PRINT(data[9]), PRINT(data[10]),
+					PRINT(data[11]), PRINT(data[12]),
+					PRINT(data[13]), PRINT(data[14]),
+					major, minor, fix);
+		}
 	}
 
+	if (json)
+		printf("}\n");
+
 err:
 	sc_disconnect_card(card);
 	sc_release_context(ctx);
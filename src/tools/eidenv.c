@@ -28,6 +28,9 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "common/compat_getopt.h"
 #include "libopensc/opensc.h"
@@ -39,9 +42,19 @@
 static char *opt_reader = NULL;
 static int stats = 0;
 static int opt_wait = 0;
+static int opt_cached = 0;
 static char *exec_program = NULL;
 static int exit_status = EXIT_FAILURE;
 
+/* The data read from the card, or from the cache */
+#define MAX_ATTRS	32
+static struct {
+	char *name;
+	char *env_name;
+	char *value;
+} attrs[MAX_ATTRS];
+static int attr_count = 0;
+
 static const struct option options[] = {
 	{"reader", required_argument, NULL, 'r'},
 	{"print", no_argument, NULL, 'p'},
@@ -49,6 +62,7 @@ static const struct option options[] = {
 	{"stats", no_argument, NULL, 't'},
 	{"help", no_argument, NULL, 'h'},
 	{"wait", no_argument, NULL, 'w'},
+	{"cached", no_argument, NULL, 'c'},
 	{"version", no_argument, NULL, 'V'},
 	{NULL, 0, NULL, 0}
 };
@@ -97,6 +111,7 @@ static void show_help(void)
 		"-v --version   -  show version and exit\n"
 		"-r --reader    -  the reader to use\n"
 		"-w --wait      -  wait for a card to be inserted\n"
+		"-c --cached    -  only use the data cached for the card\n"
 		"-p --print     -  print the datafile\n"
 		"-t --stats     -  show usage counts of keys\n"
 		"-x --exec      -  execute a program with data in env vars.\n");
@@ -106,7 +121,7 @@ static void decode_options(int argc, char **argv)
 {
 	int c;
 
-	while ((c = getopt_long(argc, argv,"pwtr:x:hV", options, (int *) 0)) != EOF) {
+	while ((c = getopt_long(argc, argv,"pwctr:x:hV", options, (int *) 0)) != EOF) {
 
 		switch (c) {
 		case 'r':
@@ -129,6 +144,9 @@ static void decode_options(int argc, char **argv)
 		case 'w':
 			opt_wait = 1;
 			break;
+		case 'c':
+			opt_cached = 1;
+			break;
 		case 'V':
 			show_version();
 			exit(EXIT_SUCCESS);
@@ -140,6 +158,158 @@ static void decode_options(int argc, char **argv)
 	}
 }
 
+static void add_attr(const char *name, const char *env_name, const char *value)
+{
+	if (attr_count == MAX_ATTRS)
+		return;
+	attrs[attr_count].name = strdup(name);
+	attrs[attr_count].env_name = strdup(env_name);
+	attrs[attr_count].value = strdup(value);
+	if (attrs[attr_count].name && attrs[attr_count].env_name && attrs[attr_count].value)
+		attr_count++;
+}
+
+static void export_attrs(void)
+{
+	int i;
+
+	for (i = 0; i < attr_count; i++) {
+		if (exec_program) {
+			char * cp;
+			cp = malloc(strlen(attrs[i].env_name) + strlen(attrs[i].value) + 2);
+			if (cp) {
+				strcpy(cp, attrs[i].env_name);
+				strcat(cp, "=");
+				strcat(cp, attrs[i].value);
+				putenv(cp);
+			}
+		} else
+			printf("%s: %s\n", attrs[i].name, attrs[i].value);
+	}
+}
+
+/*
+ * The cache holds the attributes of a card in a file of the OpenSC cache
+ * directory, named after the identity of the card. It is written if file
+ * caching is enabled for the PKCS#15 framework, and read instead of the
+ * data files when the card is found there.
+ */
+static int cache_enabled(sc_context_t *ctx)
+{
+	scconf_block *conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+
+	return conf_block && scconf_get_bool(conf_block, "use_file_caching", 0);
+}
+
+static int cache_filename(sc_context_t *ctx, const char *id, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+
+	if (sc_get_cache_dir(ctx, dir, sizeof dir) != SC_SUCCESS)
+		return -1;
+	if ((size_t) snprintf(buf, bufsize, "%s/eidenv_%s", dir, id) >= bufsize)
+		return -1;
+	return 0;
+}
+
+static int load_cache(sc_context_t *ctx, const char *id)
+{
+	char fname[PATH_MAX], line[512];
+	FILE *f;
+
+	if (cache_filename(ctx, id, fname, sizeof fname) < 0
+			|| (f = fopen(fname, "r")) == NULL)
+		return -1;
+	/* name, variable and value, separated by tabs */
+	while (fgets(line, sizeof line, f) != NULL) {
+		char *env_name, *value;
+
+		line[strcspn(line, "\n")] = '\0';
+		env_name = strchr(line, '\t');
+		if (env_name == NULL || (value = strchr(env_name + 1, '\t')) == NULL)
+			continue;
+		*env_name++ = '\0';
+		*value++ = '\0';
+		add_attr(line, env_name, value);
+	}
+	fclose(f);
+	return attr_count > 0 ? 0 : -1;
+}
+
+static void save_cache(sc_context_t *ctx, const char *id)
+{
+	char fname[PATH_MAX];
+	FILE *f;
+	int i;
+
+	for (i = 0; i < attr_count; i++)
+		if (strpbrk(attrs[i].value, "\t\n") != NULL)
+			return;
+	if (cache_filename(ctx, id, fname, sizeof fname) < 0)
+		return;
+	f = fopen(fname, "w");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(fname, "w");
+	if (f == NULL)
+		return;
+	for (i = 0; i < attr_count; i++)
+		fprintf(f, "%s\t%s\t%s\n", attrs[i].name, attrs[i].env_name, attrs[i].value);
+	if (fclose(f) != 0)
+		remove(fname);
+}
+
+/*
+ * Identify the card with as little card access as possible: by its UID
+ * if the reader knows it, otherwise by the document or card number.
+ */
+static int card_identity(sc_card_t *card, char *id, size_t idlen)
+{
+	sc_path_t path;
+	unsigned char buff[64];
+	const u8 *p;
+	size_t len;
+	int r;
+
+	/* a random UID is no identity */
+	if (card->uid.len && card->uid.value[0] != 0x08) {
+		snprintf(id, idlen, "uid-");
+		return sc_bin_to_hex(card->uid.value, card->uid.len, id + 4, idlen - 4, 0);
+	}
+
+	if (card->type == SC_CARD_TYPE_BELPIC_EID) {
+		/* the card number is the first element of the ID file */
+		sc_format_path("3f00df014031", &path);
+		r = sc_select_file(card, &path, NULL);
+		if (r == SC_SUCCESS)
+			r = sc_read_binary(card, 0, buff, 14, 0);
+		if (r < 0)
+			return -1;
+		p = sc_asn1_find_tag(card->ctx, buff, r, 0x01, &len);
+		snprintf(id, idlen, "belpic-");
+	} else {
+		/* the document number record of the personal data file */
+		sc_format_path("3f00eeee5044", &path);
+		r = sc_select_file(card, &path, NULL);
+		if (r == SC_SUCCESS)
+			r = sc_read_record(card, 8, buff, 50, SC_RECORD_BY_REC_NR);
+		if (r < 0)
+			return -1;
+		p = buff;
+		len = r;
+		snprintf(id, idlen, "esteid-");
+	}
+	if (p == NULL || len == 0 || strlen(id) + len >= idlen)
+		return -1;
+	while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\0'))
+		len--;
+	for (r = 0; r < (int) len; r++) {
+		if (!isalnum(p[r]))
+			return -1;
+	}
+	strncat(id, (const char *) p, len);
+	return 0;
+}
+
 static void do_esteid(sc_card_t *card)
 {
 	sc_path_t path;
@@ -188,19 +358,7 @@ static void do_esteid(sc_card_t *card)
 			goto out;
 		}
 		buff[r] = '\0';
-		if (exec_program) {
-			unsigned char * cp;
-			cp = malloc(strlen(esteid_data[i].env_name) +
-				strlen((char *) buff) + 2);
-			if (cp) {
-				strcpy((char *) cp,esteid_data[i].env_name);
-				strcat((char *) cp,"=");
-				strcat((char *) cp,(char *) buff);
-				putenv((char *) cp);
-			}
-		} else {
-			printf("%s: %s\n", esteid_data[i].name, buff);
-		}
+		add_attr(esteid_data[i].name, esteid_data[i].env_name, (char *) buff);
 	}
 
 	exit_status = EXIT_SUCCESS;
@@ -239,21 +397,6 @@ static void bintohex(char *buf, int len)
 	}
 }
 
-static void exportprint(const char *key, const char *val)
-{
-	if (exec_program) {
-		char * cp;
-		cp = malloc(strlen(key) + strlen(val) + 2);
-		if (cp) {
-			strcpy(cp, key);
-			strcat(cp, "=");
-			strcat(cp, val);
-			putenv(cp);
-		}
-	} else
-		printf("%s: %s\n", key, val);
-}
-
 static void do_belpic(sc_card_t *card)
 {
 	/* Contents of the ID file (3F00\DF01\4031) */
@@ -342,23 +485,23 @@ static void do_belpic(sc_card_t *card)
 		goto out;
 	}
 
-	exportprint("BELPIC_CARDNUMBER", id_data.cardnumber);
+	add_attr("BELPIC_CARDNUMBER", "BELPIC_CARDNUMBER", id_data.cardnumber);
 	bintohex(id_data.chipnumber, chipnumberlen);
-	exportprint("BELPIC_CHIPNUMBER", id_data.chipnumber);
-	exportprint("BELPIC_VALIDFROM", id_data.validfrom);
-	exportprint("BELPIC_VALIDTILL", id_data.validtill);
-	exportprint("BELPIC_DELIVERINGMUNICIPALITY", id_data.deliveringmunicipality);
-	exportprint("BELPIC_NATIONALNUMBER", id_data.nationalnumber);
-	exportprint("BELPIC_NAME", id_data.name);
-	exportprint("BELPIC_FIRSTNAMES", id_data.firstnames);
-	exportprint("BELPIC_INITIAL", id_data.initial);
-	exportprint("BELPIC_NATIONALITY", id_data.nationality);
-	exportprint("BELPIC_BIRTHLOCATION", id_data.birthlocation);
-	exportprint("BELPIC_BIRTHDATE", id_data.birthdate);
-	exportprint("BELPIC_SEX", id_data.sex);
-	exportprint("BELPIC_NOBLECONDITION", id_data.noblecondition);
-	exportprint("BELPIC_DOCUMENTTYPE", id_data.documenttype);
-	exportprint("BELPIC_SPECIALSTATUS", id_data.specialstatus);
+	add_attr("BELPIC_CHIPNUMBER", "BELPIC_CHIPNUMBER", id_data.chipnumber);
+	add_attr("BELPIC_VALIDFROM", "BELPIC_VALIDFROM", id_data.validfrom);
+	add_attr("BELPIC_VALIDTILL", "BELPIC_VALIDTILL", id_data.validtill);
+	add_attr("BELPIC_DELIVERINGMUNICIPALITY", "BELPIC_DELIVERINGMUNICIPALITY", id_data.deliveringmunicipality);
+	add_attr("BELPIC_NATIONALNUMBER", "BELPIC_NATIONALNUMBER", id_data.nationalnumber);
+	add_attr("BELPIC_NAME", "BELPIC_NAME", id_data.name);
+	add_attr("BELPIC_FIRSTNAMES", "BELPIC_FIRSTNAMES", id_data.firstnames);
+	add_attr("BELPIC_INITIAL", "BELPIC_INITIAL", id_data.initial);
+	add_attr("BELPIC_NATIONALITY", "BELPIC_NATIONALITY", id_data.nationality);
+	add_attr("BELPIC_BIRTHLOCATION", "BELPIC_BIRTHLOCATION", id_data.birthlocation);
+	add_attr("BELPIC_BIRTHDATE", "BELPIC_BIRTHDATE", id_data.birthdate);
+	add_attr("BELPIC_SEX", "BELPIC_SEX", id_data.sex);
+	add_attr("BELPIC_NOBLECONDITION", "BELPIC_NOBLECONDITION", id_data.noblecondition);
+	add_attr("BELPIC_DOCUMENTTYPE", "BELPIC_DOCUMENTTYPE", id_data.documenttype);
+	add_attr("BELPIC_SPECIALSTATUS", "BELPIC_SPECIALSTATUS", id_data.specialstatus);
 
 	r = read_transp(card, "3f00df014033", buff, sizeof(buff));
 	if (r < 0)
@@ -372,9 +515,11 @@ static void do_belpic(sc_card_t *card)
 		goto out;
 	}
 
-	exportprint("BELPIC_STREETANDNUMBER", address_data.streetandnumber);
-	exportprint("BELPIC_ZIPCODE", address_data.zipcode);
-	exportprint("BELPIC_MUNICIPALITY", address_data.municipality);
+	add_attr("BELPIC_STREETANDNUMBER", "BELPIC_STREETANDNUMBER", address_data.streetandnumber);
+	add_attr("BELPIC_ZIPCODE", "BELPIC_ZIPCODE", address_data.zipcode);
+	add_attr("BELPIC_MUNICIPALITY", "BELPIC_MUNICIPALITY", address_data.municipality);
+
+	exit_status = EXIT_SUCCESS;
 
 out:
 	return;
@@ -385,6 +530,7 @@ int main(int argc, char **argv)
 	sc_context_t *ctx = NULL;
 	sc_context_param_t ctx_param;
 	sc_card_t *card = NULL;
+	char id[80] = "";
 	int r;
 
 	/* get options */
@@ -408,15 +554,36 @@ int main(int argc, char **argv)
 	}
 
 	/* Check card type */
-	if (card->type == SC_CARD_TYPE_MCRD_ESTEID_V10 || card->type == SC_CARD_TYPE_MCRD_ESTEID_V11 || card->type == SC_CARD_TYPE_MCRD_ESTEID_V30)
-		do_esteid(card);
-	else if (card->type == SC_CARD_TYPE_BELPIC_EID)
-		do_belpic(card);
-	else {
+	if (card->type != SC_CARD_TYPE_MCRD_ESTEID_V10 && card->type != SC_CARD_TYPE_MCRD_ESTEID_V11
+			&& card->type != SC_CARD_TYPE_MCRD_ESTEID_V30 && card->type != SC_CARD_TYPE_BELPIC_EID) {
 		fprintf(stderr, "Not an EstEID or Belpic card!\n");
 		goto out;
 	}
 
+	if (!stats && (opt_cached || cache_enabled(ctx))) {
+		if (card_identity(card, id, sizeof id) < 0) {
+			fprintf(stderr, "Failed to identify the card\n");
+			if (opt_cached)
+				goto out;
+			id[0] = '\0';
+		} else if (load_cache(ctx, id) == 0) {
+			exit_status = EXIT_SUCCESS;
+		} else if (opt_cached) {
+			fprintf(stderr, "No cached data for the card\n");
+			goto out;
+		}
+	}
+
+	if (exit_status != EXIT_SUCCESS) {
+		if (card->type == SC_CARD_TYPE_BELPIC_EID)
+			do_belpic(card);
+		else
+			do_esteid(card);
+		if (!stats && exit_status == EXIT_SUCCESS && id[0] && cache_enabled(ctx))
+			save_cache(ctx, id);
+	}
+	export_attrs();
+
 	if (exec_program) {
 		char *const largv[] = {exec_program, NULL};
 		sc_unlock(card);
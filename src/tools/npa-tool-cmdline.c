@@ -93,6 +93,7 @@ const char *gengetopt_args_info_help[] = {
   "  -t, --translate=FILENAME      File with APDUs of HEX_STRINGs to send through\n                                  the secure channel  (default=`stdin')",
   "      --tr-03110v201            Force compliance to BSI TR-03110 version 2.01\n                                  (default=off)",
   "      --disable-all-checks      Disable all checking of fly-by-data\n                                  (default=off)",
+  "      --service                 Keep running and process each card that is\n                                  inserted into the reader  (default=off)",
   "\nReport bugs to https://github.com/OpenSC/OpenSC/issues\n\nWritten by Frank Morgner <frankmorgner@gmail.com>",
     0
 };
@@ -175,6 +176,7 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->translate_given = 0 ;
   args_info->tr_03110v201_given = 0 ;
   args_info->disable_all_checks_given = 0 ;
+  args_info->service_given = 0 ;
 }
 
 static
@@ -254,6 +256,7 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->translate_orig = NULL;
   args_info->tr_03110v201_flag = 0;
   args_info->disable_all_checks_flag = 0;
+  args_info->service_flag = 0;
   
 }
 
@@ -320,6 +323,7 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->translate_help = gengetopt_args_info_help[57] ;
   args_info->tr_03110v201_help = gengetopt_args_info_help[58] ;
   args_info->disable_all_checks_help = gengetopt_args_info_help[59] ;
+  args_info->service_help = gengetopt_args_info_help[60] ;
   
 }
 
@@ -634,6 +638,8 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "tr-03110v201", 0, 0 );
   if (args_info->disable_all_checks_given)
     write_into_file(outfile, "disable-all-checks", 0, 0 );
+  if (args_info->service_given)
+    write_into_file(outfile, "service", 0, 0 );
   
 
   i = EXIT_SUCCESS;
@@ -1834,6 +1840,7 @@ cmdline_parser_internal (
         { "translate",	1, NULL, 't' },
         { "tr-03110v201",	0, NULL, 0 },
         { "disable-all-checks",	0, NULL, 0 },
+        { "service",	0, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -2496,6 +2503,18 @@ cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Keep running and process each card that is inserted into the reader.  */
+          else if (strcmp (long_options[option_index].name, "service") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->service_flag), 0, &(args_info->service_given),
+                &(local_args_info.service_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "service", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
@@ -168,6 +168,8 @@ struct gengetopt_args_info
   const char *tr_03110v201_help; /**< @brief Force compliance to BSI TR-03110 version 2.01 help description.  */
   int disable_all_checks_flag;	/**< @brief Disable all checking of fly-by-data (default=off).  */
   const char *disable_all_checks_help; /**< @brief Disable all checking of fly-by-data help description.  */
+  int service_flag;	/**< @brief Keep running and process each card that is inserted into the reader (default=off).  */
+  const char *service_help; /**< @brief Keep running and process each card that is inserted into the reader help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -223,6 +225,7 @@ struct gengetopt_args_info
   unsigned int translate_given ;	/**< @brief Whether translate was given.  */
   unsigned int tr_03110v201_given ;	/**< @brief Whether tr-03110v201 was given.  */
   unsigned int disable_all_checks_given ;	/**< @brief Whether disable-all-checks was given.  */
+  unsigned int service_given ;	/**< @brief Whether service was given.  */
 
 } ;
 
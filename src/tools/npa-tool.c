@@ -164,6 +164,45 @@ static int initialize(int reader_id, int verbose,
 }
 
 
+/**
+ * @brief Hand back the card and wait for the next one in the reader
+ *
+ * @param[in]     ctx    Context
+ * @param[in]     reader Reader to wait on
+ * @param[in,out] card   The card to release, on success the next card
+ *
+ * @return \c SC_SUCCESS or an error code
+ */
+static int wait_for_next_card(sc_context_t *ctx, sc_reader_t *reader,
+		sc_card_t **card)
+{
+	sc_reader_t *event_reader;
+	unsigned int event;
+	void *reader_states = NULL;
+	int r = SC_SUCCESS;
+
+	sc_sm_stop(*card);
+	sc_reset(*card, 1);
+	sc_disconnect_card(*card);
+	*card = NULL;
+
+	printf("Waiting for the next card.\n");
+	while (r == SC_SUCCESS
+			&& (sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+		r = sc_wait_for_event(ctx, SC_EVENT_CARD_REMOVED,
+				&event_reader, &event, -1, &reader_states);
+	while (r == SC_SUCCESS
+			&& !(sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+		r = sc_wait_for_event(ctx, SC_EVENT_CARD_INSERTED,
+				&event_reader, &event, -1, &reader_states);
+	sc_wait_for_event(ctx, 0, NULL, NULL, 0, &reader_states);
+
+	if (r == SC_SUCCESS)
+		r = sc_connect_card(reader, card);
+
+	return r;
+}
+
 static void read_dg(sc_card_t *card, unsigned char sfid, const char *dg_str,
 		unsigned char **dg, size_t *dg_len)
 {
@@ -425,6 +464,12 @@ main (int argc, char **argv)
 		eac_default_flags |= EAC_FLAG_DISABLE_CHECK_TA;
 	if (cmdline.disable_ca_checks_flag)
 		eac_default_flags |= EAC_FLAG_DISABLE_CHECK_CA;
+	if (cmdline.service_flag && (cmdline.break_flag || cmdline.resume_flag
+				|| cmdline.unblock_flag || cmdline.new_pin_given
+				|| cmdline.translate_given)) {
+		fprintf(stderr, "--service can only be used for reading data groups and verifications.\n");
+		exit(2);
+	}
 
 
 	r = initialize(cmdline.reader_arg, cmdline.verbose_given, &ctx, &reader);
@@ -716,6 +761,9 @@ main (int argc, char **argv)
 			}
 		}
 
+		/* in service mode, everything from here on is done for each card;
+		 * the certificates, key and auxiliary data above are loaded once */
+next_card:
 		pace_input.pin = NULL;
 		pace_input.pin_length = 0;
 		if (cmdline.pin_given) {
@@ -749,7 +797,7 @@ main (int argc, char **argv)
 
 		r = perform_pace(card, pace_input, &pace_output, tr_version);
 		if (r < 0)
-			goto err;
+			goto card_done;
 		printf("Established PACE channel with %s.\n",
 				eac_secret_name(pace_input.pin_id));
 
@@ -762,18 +810,18 @@ nopace:
 					(const unsigned char **) certs, certs_lens,
 					privkey, privkey_len, auxiliary_data, auxiliary_data_len);
 			if (r < 0)
-				goto err;
+				goto card_done;
 			printf("Performed Terminal Authentication.\n");
 
 			r = perform_chip_authentication(card, &ef_cardsecurity, &ef_cardsecurity_len);
 			if (r < 0)
-				goto err;
+				goto card_done;
 			printf("Performed Chip Authentication.\n");
 
 			sc_path_set(&path, SC_PATH_TYPE_DF_NAME, eid_aid, sizeof eid_aid, 0, 0);
 			r = sc_select_file(card, &path, NULL);
 			if (r < 0)
-				goto err;
+				goto card_done;
 			printf("Selected eID application.\n");
 		}
 
@@ -862,6 +910,29 @@ nopace:
 			fclose(input);
 			input = NULL;
 		}
+
+card_done:
+		if (cmdline.service_flag) {
+			if (r < 0)
+				fprintf(stderr, "Error: %s\n", sc_strerror(r));
+			free(pace_output.ef_cardaccess);
+			free(pace_output.recent_car);
+			free(pace_output.previous_car);
+			free(pace_output.id_icc);
+			free(pace_output.id_pcd);
+			memset(&pace_output, 0, sizeof pace_output);
+			if (ef_cardsecurity) {
+				OPENSSL_cleanse(ef_cardsecurity, ef_cardsecurity_len);
+				free(ef_cardsecurity);
+				ef_cardsecurity = NULL;
+				ef_cardsecurity_len = 0;
+			}
+
+			r = wait_for_next_card(ctx, reader, &card);
+			if (r < 0)
+				goto err;
+			goto next_card;
+		}
 	}
 
 err:
@@ -21,31 +21,52 @@
 #include "config.h"
 #endif
 
-#include "fread_to_eof.h"
 #include "libopensc/asn1.h"
 #include "opensc-asn1-cmdline.h"
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+static int read_file(void *arg, unsigned char *buf, size_t len)
+{
+	FILE *input = arg;
+	size_t r = fread(buf, 1, len, input);
+
+	if (r == 0 && ferror(input))
+		return -1;
+	return (int) r;
+}
+
 int
 main (int argc, char **argv)
 {
 	struct gengetopt_args_info cmdline;
-	unsigned char *buf = NULL;
-	size_t buflen = 0, i;
+	FILE *input;
+	long size;
+	size_t i;
 
 	if (cmdline_parser(argc, argv, &cmdline) != 0)
 		return 1;
 
 	for (i = 0; i < cmdline.inputs_num; i++) {
-		if (!fread_to_eof(cmdline.inputs[i], &buf, &buflen))
+		input = fopen(cmdline.inputs[i], "rb");
+		if (!input)
 			continue;
 
-		printf("Parsing '%s' (%"SC_FORMAT_LEN_SIZE_T"u byte%s)\n",
-				cmdline.inputs[i], buflen, buflen == 1 ? "" : "s");
-		sc_asn1_print_tags(buf, buflen);
+		/* the file is printed while it is read, so large inputs need
+		 * no more memory than their largest primitive element */
+		if (fseek(input, 0, SEEK_END) == 0 && (size = ftell(input)) >= 0) {
+			rewind(input);
+			printf("Parsing '%s' (%ld byte%s)\n",
+					cmdline.inputs[i], size, size == 1 ? "" : "s");
+			sc_asn1_print_tags_stream(read_file, input, size);
+		} else {
+			printf("Parsing '%s'\n", cmdline.inputs[i]);
+			sc_asn1_print_tags_stream(read_file, input, SIZE_MAX);
+		}
+		fclose(input);
 	}
 
-	free(buf);
 	cmdline_parser_free (&cmdline);
 
 	return 0;
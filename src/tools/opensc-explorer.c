@@ -30,6 +30,9 @@
 #endif
 #if !defined(_WIN32)
 #include <arpa/inet.h>  /* for htons() */
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 
 #ifdef HAVE_IO_H
@@ -64,6 +67,28 @@ static sc_path_t current_path;
 static sc_context_t *ctx = NULL;
 static sc_card_t *card = NULL;
 static int interactive = 1;
+static int show_progress = 1;
+
+/* Attributes of the files of the current DF seen by ls and find, so that they
+ * are not selected again. Dropped when the current DF changes and after the
+ * commands that may modify the card. */
+#define FILE_CACHE_SIZE 256
+static sc_path_t file_cache_df;
+static size_t file_cache_count = 0;
+static sc_file_t *file_cache[FILE_CACHE_SIZE];
+/* cleared if the driver does not select a file of the current DF by its FID */
+static int select_by_fid = 1;
+
+#if !defined(_WIN32)
+/* With several --reader options the script is run on each reader by its own
+ * worker process, as every reader needs its own context, card and current
+ * DF. The parent prefixes the output lines of each worker with its reader. */
+#define MAX_READERS 64
+static const char *opt_readers[MAX_READERS];
+static int opt_reader_count = 0;
+static char *script_text = NULL;	/* script of a worker, read from memory */
+static char *script_pos = NULL;
+#endif
 
 static const struct option options[] = {
 	{ "reader",		1, NULL, 'r' },
@@ -74,7 +99,7 @@ static const struct option options[] = {
 	{ NULL, 0, NULL, 0 }
 };
 static const char *option_help[] = {
-	"Uses reader number <arg> [0]",
+	"Uses reader number <arg> [0], can be given several times to run SCRIPT on each reader",
 	"Forces the use of driver <arg> [auto-detect]",
 	"Selects path <arg> on start-up, or none if empty [3F00]",
 	"Wait for card insertion",
@@ -263,8 +288,41 @@ static int usage(int (*func)(int, char **))
 	return -1;
 }
 
+static void file_cache_clear(void)
+{
+	while (file_cache_count > 0)
+		sc_file_free(file_cache[--file_cache_count]);
+}
+
+static sc_file_t *file_cache_get(const u8 *fid)
+{
+	size_t i;
+
+	if (!sc_compare_path(&file_cache_df, &current_path)) {
+		file_cache_clear();
+		file_cache_df = current_path;
+		return NULL;
+	}
+	for (i = 0; i < file_cache_count; i++)
+		if (file_cache[i]->id == ((fid[0] << 8) | fid[1]))
+			return file_cache[i];
+	return NULL;
+}
+
+static void file_cache_add(const sc_file_t *file)
+{
+	sc_file_t *copy = NULL;
+
+	if (file_cache_count >= FILE_CACHE_SIZE)
+		return;
+	sc_file_dup(&copy, file);
+	if (copy != NULL)
+		file_cache[file_cache_count++] = copy;
+}
+
 static void die(int ret)
 {
+	file_cache_clear();
 	sc_file_free(current_file);
 	if (card) {
 		sc_disconnect_card(card);
@@ -288,6 +346,15 @@ static void select_current_path_or_die(void)
 	}
 }
 
+static int command_modifies_card(const struct command *cmd)
+{
+	return cmd->func == do_create || cmd->func == do_mkdir
+		|| cmd->func == do_delete || cmd->func == do_put
+		|| cmd->func == do_update_binary || cmd->func == do_update_record
+		|| cmd->func == do_erase || cmd->func == do_put_data
+		|| cmd->func == do_apdu || cmd->func == do_sm;
+}
+
 static struct command *
 ambiguous_match(struct command *table, const char *cmd, int *ambiguous)
 {
@@ -398,6 +465,38 @@ arg_to_path(const char *arg, sc_path_t *path, int is_id)
 	return 0;
 }
 
+/* Selects a file of the current DF and leaves the current DF selected. A
+ * file selected by its FID takes a single SELECT unless it is a DF, while a
+ * file selected by its path is always followed by a SELECT of the current
+ * DF. */
+static int select_child(const u8 *fid, sc_file_t **file)
+{
+	sc_path_t path;
+	int r;
+
+	if (select_by_fid || current_path.type == SC_PATH_TYPE_DF_NAME) {
+		if (sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, 2, 0, 0) != SC_SUCCESS) {
+			fprintf(stderr, "unable to set path.\n");
+			die(1);
+		}
+		r = sc_select_file(card, &path, file);
+		if (current_path.type == SC_PATH_TYPE_DF_NAME
+				|| (r != SC_ERROR_INVALID_ARGUMENTS && r != SC_ERROR_NOT_SUPPORTED)) {
+			/* a SELECT that failed leaves the current DF selected */
+			if (r == SC_SUCCESS && (*file)->type == SC_FILE_TYPE_DF)
+				select_current_path_or_die();
+			return r;
+		}
+		select_by_fid = 0;
+	}
+
+	path = current_path;
+	sc_append_path_id(&path, fid, 2);
+	r = sc_select_file(card, &path, file);
+	select_current_path_or_die();
+	return r;
+}
+
 static void print_file(const sc_file_t *file)
 {
 	const char *format = " %02X%02X ";
@@ -492,15 +591,14 @@ static int do_ls(int argc, char **argv)
 	r = sc_lock(card);
 	if (r == SC_SUCCESS)
 		r = sc_list_files(card, buf, sizeof(buf));
-	sc_unlock(card);
 	if (r < 0) {
+		sc_unlock(card);
 		check_ret(r, SC_AC_OP_LIST_FILES, "unable to receive file listing", current_file);
 		return -1;
 	}
 	count = r;
 	printf("FileID\tType  Size\n");
 	while (count >= 2) {
-		sc_path_t path;
 		sc_file_t *file = NULL;
 		char filename[10];
 		int i = 0;
@@ -519,40 +617,30 @@ static int do_ls(int argc, char **argv)
 
 		/* if any filename pattern were given, filter only matching file names */
 		if (argc == 0 || matches) {
-			if (current_path.type != SC_PATH_TYPE_DF_NAME) {
-				path = current_path;
-				sc_append_path_id(&path, cur, 2);
-			} else {
-				if (sc_path_set(&path, SC_PATH_TYPE_FILE_ID, cur, 2, 0, 0) != SC_SUCCESS) {
-					fprintf(stderr, "unable to set path.\n");
-					die(1);
-				}
-			}
+			const sc_file_t *cached = file_cache_get(cur);
 
-			r = sc_lock(card);
-			if (r == SC_SUCCESS)
-				r = sc_select_file(card, &path, &file);
-			sc_unlock(card);
-			if (r) {
+			if (cached != NULL) {
+				print_file(cached);
+			} else if ((r = select_child(cur, &file)) != SC_SUCCESS) {
 				fprintf(stderr, " %02X%02X unable to select file, %s\n", cur[0], cur[1], sc_strerror(r));
 			} else {
 				file->id = (cur[0] << 8) | cur[1];
-					print_file(file);
+				print_file(file);
+				file_cache_add(file);
 				sc_file_free(file);
 			}
 		}
 		cur += 2;
 		count -= 2;
-		select_current_path_or_die();
 	}
+	sc_unlock(card);
 	return 0;
 }
 
 static int do_find(int argc, char **argv)
 {
 	u8 fid[2], end[2];
-	sc_path_t path;
-	int r;
+	int r, locked = 0;
 
 	fid[0] = 0;
 	fid[1] = 0;
@@ -575,31 +663,31 @@ static int do_find(int argc, char **argv)
 
 	printf("FileID\tType  Size\n");
 	while (1) {
+		const sc_file_t *cached;
 		sc_file_t *file = NULL;
 
-		printf("(%02X%02X)\r", fid[0], fid[1]);
-		fflush(stdout);
+		if (show_progress) {
+			printf("(%02X%02X)\r", fid[0], fid[1]);
+			fflush(stdout);
+		}
 
-		if (current_path.type != SC_PATH_TYPE_DF_NAME) {
-			path = current_path;
-			sc_append_path_id(&path, fid, sizeof fid);
-		} else {
-			if (sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, 2, 0, 0) != SC_SUCCESS) {
-				fprintf(stderr, "unable to set path.\n");
-				die(1);
-			}
+		/* keep the card for a block of IDs rather than for each one */
+		if (fid[1] == 0 || !locked) {
+			if (locked)
+				sc_unlock(card);
+			locked = sc_lock(card) == SC_SUCCESS;
 		}
 
-		r = sc_lock(card);
-		if (r == SC_SUCCESS)
-			r = sc_select_file(card, &path, &file);
-		sc_unlock(card);
+		cached = file_cache_get(fid);
+		r = cached != NULL ? SC_SUCCESS : select_child(fid, &file);
 		switch (r) {
 		case SC_SUCCESS:
-			file->id = (fid[0] << 8) | fid[1];
-			print_file(file);
+			if (cached == NULL) {
+				file->id = (fid[0] << 8) | fid[1];
+				file_cache_add(file);
+			}
+			print_file(cached != NULL ? cached : file);
 			sc_file_free(file);
-			select_current_path_or_die();
 			break;
 		case SC_ERROR_NOT_ALLOWED:
 		case SC_ERROR_SECURITY_STATUS_NOT_SATISFIED:
@@ -613,6 +701,8 @@ static int do_find(int argc, char **argv)
 		if (fid[1] == 0)
 			fid[0] = fid[0] + 1;
 	}
+	if (locked)
+		sc_unlock(card);
 	return 0;
 }
 
@@ -2052,6 +2142,23 @@ static char *read_cmdline(FILE *script, char *prompt)
 {
 	static char buf[SC_MAX_EXT_APDU_BUFFER_SIZE];
 
+#if !defined(_WIN32)
+	if (script_text != NULL) {
+		char *line = script_pos, *end;
+
+		if (*line == '\0')
+			return NULL;
+		end = strchr(line, '\n');
+		if (end != NULL) {
+			*end = '\0';
+			script_pos = end + 1;
+		} else {
+			script_pos = line + strlen(line);
+		}
+		return line;
+	}
+#endif
+
 	if (interactive) {
 #ifdef ENABLE_READLINE
 		static int initialized;
@@ -2085,6 +2192,158 @@ static char *read_cmdline(FILE *script, char *prompt)
 	return buf;
 }
 
+#if !defined(_WIN32)
+static char *read_script(const char *name)
+{
+	FILE *script = stdin;
+	char *text = NULL, *p;
+	size_t len = 0, size = 0, n;
+
+	if (strcmp(name, "-") != 0 && (script = fopen(name, "r")) == NULL)
+		return NULL;
+	do {
+		if (size - len < 4096) {
+			size += 4096;
+			p = realloc(text, size + 1);
+			if (p == NULL) {
+				free(text);
+				text = NULL;
+				break;
+			}
+			text = p;
+		}
+		n = fread(text + len, 1, size - len, script);
+		len += n;
+	} while (n > 0);
+	if (text != NULL)
+		text[len] = '\0';
+	if (script != stdin)
+		fclose(script);
+	return text;
+}
+
+/* Forks one worker per reader. Returns -1 in a worker, which then runs the
+ * script on its reader, or the exit status of the run in the parent. */
+static int run_workers(const char *script_name)
+{
+	struct worker {
+		pid_t pid;
+		int fd;
+		size_t len;
+		char buf[1024];
+	} *workers;
+	struct pollfd *pfd;
+	int i, j, count = 0, running, status, err = 0;
+
+	script_text = read_script(script_name);
+	if (script_text == NULL) {
+		fprintf(stderr, "unable to read script %s\n", script_name);
+		return 1;
+	}
+	workers = calloc(opt_reader_count, sizeof *workers);
+	pfd = calloc(opt_reader_count, sizeof *pfd);
+	if (workers == NULL || pfd == NULL) {
+		fprintf(stderr, "out of memory\n");
+		free(workers);
+		free(pfd);
+		return 1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < opt_reader_count; i++) {
+		int fds[2];
+
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			err = 1;
+			break;
+		}
+		workers[i].pid = fork();
+		if (workers[i].pid == 0) {
+			for (j = 0; j < count; j++)
+				close(workers[j].fd);
+			free(workers);
+			free(pfd);
+			close(fds[0]);
+			dup2(fds[1], STDOUT_FILENO);
+			dup2(fds[1], STDERR_FILENO);
+			close(fds[1]);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			script_pos = script_text;
+			opt_reader = opt_readers[i];
+			show_progress = 0;
+			return -1;
+		}
+		close(fds[1]);
+		if (workers[i].pid < 0) {
+			perror("fork");
+			close(fds[0]);
+			err = 1;
+			break;
+		}
+		workers[i].fd = fds[0];
+		count++;
+	}
+	free(script_text);
+	script_text = NULL;
+
+	/* pass on the output of the workers a line at a time */
+	for (running = count; running > 0; ) {
+		for (i = 0; i < count; i++) {
+			pfd[i].fd = workers[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, count, -1) < 0)
+			continue;
+		for (i = 0; i < count; i++) {
+			struct worker *w = &workers[i];
+			char *start, *end;
+			ssize_t n;
+
+			if (w->fd < 0 || pfd[i].revents == 0)
+				continue;
+			n = read(w->fd, w->buf + w->len, sizeof w->buf - w->len);
+			if (n > 0)
+				w->len += n;
+			start = w->buf;
+			while ((end = memchr(start, '\n', w->buf + w->len - start)) != NULL) {
+				printf("[%s] %.*s\n", opt_readers[i], (int) (end - start), start);
+				start = end + 1;
+			}
+			/* a last line without newline, or one too long for the buffer */
+			if (start < w->buf + w->len
+					&& (n <= 0 || (start == w->buf && w->len == sizeof w->buf))) {
+				printf("[%s] %.*s\n", opt_readers[i],
+					(int) (w->buf + w->len - start), start);
+				start = w->buf + w->len;
+			}
+			w->len -= start - w->buf;
+			memmove(w->buf, start, w->len);
+			if (n <= 0) {
+				close(w->fd);
+				w->fd = -1;
+				pfd[i].fd = -1;
+				running--;
+			}
+		}
+		fflush(stdout);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (waitpid(workers[i].pid, &status, 0) < 0
+				|| !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "[%s] failed\n", opt_readers[i]);
+			err = 1;
+		}
+	}
+	free(workers);
+	free(pfd);
+	return err;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	int r, c, long_optind = 0, err = 0;
@@ -2103,6 +2362,13 @@ int main(int argc, char *argv[])
 		switch (c) {
 		case 'r':
 			opt_reader = optarg;
+#if !defined(_WIN32)
+			if (opt_reader_count == MAX_READERS) {
+				fprintf(stderr, "too many readers, at most %d\n", MAX_READERS);
+				return 1;
+			}
+			opt_readers[opt_reader_count++] = optarg;
+#endif
 			break;
 		case 'c':
 			opt_driver = optarg;
@@ -2119,6 +2385,17 @@ int main(int argc, char *argv[])
 		}
 	}
 
+#if !defined(_WIN32)
+	if (opt_reader_count > 1) {
+		if (argc - optind != 1)
+			util_print_usage_and_die(app_name, options, option_help, "[SCRIPT]");
+		r = run_workers(argv[optind]);
+		if (r >= 0)
+			return r;
+		/* in a worker: go on with its reader and the script read by the parent */
+	}
+#endif
+
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
 	ctx_param.app_name = app_name;
@@ -2195,6 +2472,10 @@ int main(int argc, char *argv[])
 		break;
 	case 1:
 		interactive = 0;
+#if !defined(_WIN32)
+		if (script_text != NULL)
+			break;
+#endif
 		if (strcmp(argv[optind], "-") == 0) {
 			script = stdin;
 		}
@@ -2204,7 +2485,7 @@ int main(int argc, char *argv[])
 		break;
 	}
 
-	while (!feof(script)) {
+	while (1) {
 		char *line;
 		int cargc;
 		char *cargv[260];
@@ -2230,6 +2511,8 @@ int main(int argc, char *argv[])
 			err = -1;
 		} else {
 			err = cmd->func(cargc-1, cargv+1);
+			if (command_modifies_card(cmd))
+				file_cache_clear();
 		}
 	}
 end:
@@ -49,27 +49,39 @@ void Sleep(unsigned int Milliseconds)
 }
 #endif
 
+/* Whether sc_cancel() wakes up the waiting daemon */
+#if defined(PCSCLITE_GOOD) || defined(_WIN32)
+#define NOTIFY_CANCEL
+#endif
+
 void stop_daemon()
 {
-#ifdef PCSCLITE_GOOD
-	sc_cancel(ctx);
-#endif
 	run_daemon = 0;
+#ifdef NOTIFY_CANCEL
+	if (ctx)
+		sc_cancel(ctx);
+#endif
 }
 
 void notify_daemon()
 {
 	int r;
 	const unsigned int event_mask = SC_EVENT_CARD_EVENTS;
-	unsigned int event;
-	struct sc_reader *event_reader = NULL;
+	struct sc_reader_event event;
 	size_t error_count = 0;
+#ifdef NOTIFY_CANCEL
+	/* stop_daemon() cancels the wait, nothing runs until an event */
+	const int timeout = -1;
+#else
 	/* timeout adjusted to the maximum response time for WM_CLOSE in case
 	 * canceling doesn't work */
 	const int timeout = 20000;
+#endif
 	struct sc_atr old_atr;
 	void *reader_states = NULL;
 
+	old_atr.len = 0;
+
 	r = sc_establish_context(&ctx, "opensc-notify");
 	if (r < 0 || !ctx) {
 		fprintf(stderr, "Failed to create initial context: %s", sc_strerror(r));
@@ -77,13 +89,13 @@ void notify_daemon()
 	}
 
 	while (run_daemon && error_count < 1000) {
-		r = sc_wait_for_event(ctx, event_mask,
-				&event_reader, &event, timeout, &reader_states);
+		r = sc_wait_for_reader_event(ctx, event_mask, &event, timeout,
+				&reader_states);
 		if (r < 0) {
 			if (r == SC_ERROR_NO_READERS_FOUND) {
 				/* No readers available, PnP notification not supported */
 				Sleep(200);
-			} else {
+			} else if (r != SC_ERROR_EVENT_TIMEOUT) {
 				error_count++;
 			}
 			continue;
@@ -91,23 +103,13 @@ void notify_daemon()
 
 		error_count = 0;
 
-		if (event & SC_EVENT_CARD_REMOVED) {
-			sc_notify_id(ctx, &old_atr, NULL, NOTIFY_CARD_REMOVED);
+		if (event.event & SC_EVENT_CARD_REMOVED) {
+			sc_notify_id(ctx, old_atr.len ? &old_atr : NULL, NULL,
+					NOTIFY_CARD_REMOVED);
 		}
-		if (event & SC_EVENT_CARD_INSERTED) {
-			if (event_reader) {
-				/* FIXME `pcsc_wait_for_event` has all the information that's
-				 * requested again with `pcsc_detect_card_presence`, but it
-				 * doesn't use the ATR, for example, to refresh the reader's
-				 * attributes. To get the ATR we need to call
-				 * sc_detect_card_presence. Eventually this should be fixed. */
-				sc_detect_card_presence(event_reader);
-				memcpy(old_atr.value, event_reader->atr.value,
-						event_reader->atr.len);
-				old_atr.len = event_reader->atr.len;
-			} else {
-				old_atr.len = 0;
-			}
+		if (event.event & SC_EVENT_CARD_INSERTED) {
+			/* the ATR came with the event */
+			old_atr = event.atr;
 			sc_notify_id(ctx, old_atr.len ? &old_atr : NULL, NULL,
 					NOTIFY_CARD_INSERTED);
 		}
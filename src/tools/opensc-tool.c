@@ -29,6 +29,12 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef HAVE_GETTIMEOFDAY
+#include <sys/timeb.h>
+#endif
 
 #include "libopensc/opensc.h"
 #include "libopensc/cardctl.h"
@@ -46,13 +52,18 @@ static int	opt_wait = 0;
 static char **	opt_apdus;
 static char	*opt_reader;
 static int	opt_apdu_count = 0;
+static int	opt_apdu_stats = 0;
+static int	opt_batch = 0;
 static int	verbose = 0;
 
 enum {
 	OPT_SERIAL = 0x100,
 	OPT_LIST_ALG,
 	OPT_VERSION,
-	OPT_RESET
+	OPT_RESET,
+	OPT_APDU_STATS,
+	OPT_SCRIPT,
+	OPT_BATCH
 };
 
 static const struct option options[] = {
@@ -72,6 +83,9 @@ static const struct option options[] = {
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
 	{ "wait",		0, NULL,		'w' },
+	{ "apdu-stats",		0, NULL,	OPT_APDU_STATS },
+	{ "script",		1, NULL,	OPT_SCRIPT },
+	{ "batch",		0, NULL,	OPT_BATCH },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
 };
@@ -93,6 +107,9 @@ static const char *option_help[] = {
 	"Forces the use of driver <arg> [auto-detect]",
 	"Lists algorithms supported by card",
 	"Wait for a card to be inserted",
+	"Print statistics of the sent APDUs at the end",
+	"Sends the APDUs of file <arg> under one card lock and prints their timing",
+	"Sends the APDUs of a script that must return 9000 together",
 	"Verbose operation. Use several times to enable debug output.",
 };
 
@@ -549,6 +566,260 @@ static int send_apdu(void)
 	return 0;
 }
 
+/*
+ * APDU script: one APDU per line, in the format of --send-apdu, optionally
+ * followed by the expected status word, where X matches any nibble
+ * (default 9000). Empty lines and lines starting with '#' are skipped.
+ */
+struct script_apdu {
+	u8 *cmd;
+	size_t cmd_len;
+	unsigned int sw, sw_mask;
+	unsigned long line;
+	unsigned long long time_us;
+	size_t batch;		/* number of APDUs sent with this one, 1 if alone */
+};
+
+static unsigned long long script_time(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) != 0)
+		return 0;
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	struct _timeb time_buf;
+
+	_ftime(&time_buf);
+	return (unsigned long long) time_buf.time * 1000000 + time_buf.millitm * 1000;
+#endif
+}
+
+static int parse_sw_pattern(const char *in, unsigned int *sw, unsigned int *mask)
+{
+	int i;
+
+	*sw = *mask = 0;
+	for (i = 0; i < 4; i++) {
+		unsigned char c = (unsigned char) in[i];
+
+		*sw <<= 4;
+		*mask <<= 4;
+		if (c == 'X' || c == 'x')
+			continue;
+		if (!isxdigit(c))
+			return -1;
+		*sw |= isdigit(c) ? c - '0' : (toupper(c) - 'A' + 10);
+		*mask |= 0xF;
+	}
+	return in[4] == '\0' ? 0 : -1;
+}
+
+static void free_script(struct script_apdu *lines, sc_apdu_t *apdus, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		free(lines[i].cmd);
+		free(apdus[i].resp);
+	}
+	free(lines);
+	free(apdus);
+}
+
+static int load_script(const char *filename, struct script_apdu **lines_out,
+		sc_apdu_t **apdus_out, size_t *count_out)
+{
+	static char line[3 * SC_MAX_EXT_APDU_BUFFER_SIZE + 16];
+	u8 buf[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	struct script_apdu *lines = NULL, *l;
+	sc_apdu_t *apdus = NULL, *apdu;
+	size_t count = 0, alloc = 0, len;
+	unsigned long lineno = 0;
+	char *cmd, *sw, *p;
+	FILE *fp;
+	int r = 0;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open script '%s': %s\n", filename, strerror(errno));
+		return 2;
+	}
+
+	while (fgets(line, sizeof line, fp) != NULL) {
+		lineno++;
+		len = strlen(line);
+		if (len == sizeof line - 1 && line[len - 1] != '\n') {
+			fprintf(stderr, "%s:%lu: line too long\n", filename, lineno);
+			r = 2;
+			break;
+		}
+		cmd = strtok(line, " \t\r\n");
+		if (cmd == NULL || cmd[0] == '#')
+			continue;
+		sw = strtok(NULL, " \t\r\n");
+		p = strtok(NULL, " \t\r\n");
+		if (p != NULL && p[0] != '#') {
+			fprintf(stderr, "%s:%lu: unexpected '%s'\n", filename, lineno, p);
+			r = 2;
+			break;
+		}
+
+		if (count == alloc) {
+			struct script_apdu *nl;
+			sc_apdu_t *na;
+
+			alloc = alloc ? 2 * alloc : 32;
+			nl = realloc(lines, alloc * sizeof *lines);
+			if (nl != NULL)
+				lines = nl;
+			na = realloc(apdus, alloc * sizeof *apdus);
+			if (na != NULL)
+				apdus = na;
+			if (nl == NULL || na == NULL) {
+				fprintf(stderr, "Not enough memory\n");
+				r = 1;
+				break;
+			}
+		}
+		l = &lines[count];
+		apdu = &apdus[count];
+		memset(l, 0, sizeof *l);
+		memset(apdu, 0, sizeof *apdu);
+		l->line = lineno;
+		l->batch = 1;
+
+		if (sw == NULL || sw[0] == '#') {
+			l->sw = 0x9000;
+			l->sw_mask = 0xFFFF;
+		}
+		else if (parse_sw_pattern(sw, &l->sw, &l->sw_mask)) {
+			fprintf(stderr, "%s:%lu: invalid status word '%s'\n", filename, lineno, sw);
+			r = 2;
+			break;
+		}
+
+		len = sizeof buf;
+		if (sc_hex_to_bin(cmd, buf, &len) != SC_SUCCESS
+				|| sc_bytes2apdu(ctx, buf, len, apdu) != SC_SUCCESS) {
+			fprintf(stderr, "%s:%lu: invalid APDU '%s'\n", filename, lineno, cmd);
+			r = 2;
+			break;
+		}
+		/* the APDU points into the command, which has to stay */
+		l->cmd = malloc(len);
+		apdu->resplen = apdu->le > 256 ? apdu->le : 256;
+		apdu->resp = malloc(apdu->resplen);
+		count++;
+		if (l->cmd == NULL || apdu->resp == NULL) {
+			fprintf(stderr, "Not enough memory\n");
+			r = 1;
+			break;
+		}
+		memcpy(l->cmd, buf, len);
+		l->cmd_len = len;
+		if (apdu->data != NULL)
+			apdu->data = l->cmd + (apdu->data - buf);
+	}
+	fclose(fp);
+
+	if (r == 0 && count == 0) {
+		fprintf(stderr, "No APDUs in script '%s'\n", filename);
+		r = 2;
+	}
+	if (r) {
+		free_script(lines, apdus, count);
+		return r;
+	}
+	*lines_out = lines;
+	*apdus_out = apdus;
+	*count_out = count;
+	return 0;
+}
+
+/* APDUs that have to return 90 00 can go to the reader together */
+static int script_batchable(const struct script_apdu *l)
+{
+	return l->sw == 0x9000 && l->sw_mask == 0xFFFF;
+}
+
+static int run_script(const char *filename)
+{
+	struct script_apdu *lines, *l;
+	sc_apdu_t *apdus, *apdu;
+	size_t count, done = 0, i, j, n;
+	unsigned long long start, total;
+	unsigned int sw;
+	int r, err;
+
+	err = load_script(filename, &lines, &apdus, &count);
+	if (err)
+		return err;
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Cannot lock the card: %s\n", sc_strerror(r));
+		free_script(lines, apdus, count);
+		return 1;
+	}
+
+	total = script_time();
+	for (i = 0; i < count && !err; i += n) {
+		n = 1;
+		if (opt_batch && script_batchable(&lines[i]))
+			while (i + n < count && script_batchable(&lines[i + n]))
+				n++;
+
+		start = script_time();
+		if (n > 1)
+			r = sc_transmit_apdus(card, &apdus[i], n);
+		else
+			r = sc_transmit_apdu(card, &apdus[i]);
+		lines[i].time_us = script_time() - start;
+		lines[i].batch = n;
+
+		for (j = i; j < i + n; j++) {
+			l = &lines[j];
+			apdu = &apdus[j];
+			sw = apdu->sw1 << 8 | apdu->sw2;
+			if (sw == 0 && r != SC_SUCCESS)
+				/* not sent, or the transmission failed */
+				break;
+			done++;
+			printf("%4lu: %02X %02X %02X %02X -> %04X", l->line,
+					apdu->cla, apdu->ins, apdu->p1, apdu->p2, sw);
+			if (j == i && n == 1)
+				printf(" %10.3f ms", l->time_us / 1000.0);
+			else if (j == i)
+				printf(" %10.3f ms for %lu APDUs", l->time_us / 1000.0,
+						(unsigned long) n);
+			if ((sw & l->sw_mask) != l->sw) {
+				printf(" FAILED, expected %04X/%04X\n", l->sw, l->sw_mask);
+				err = 1;
+				break;
+			}
+			printf("\n");
+			if (verbose && apdu->resplen)
+				util_hex_dump_asc(stdout, apdu->resp, apdu->resplen, -1);
+		}
+		/* a wrong status word is reported above, this is the transmission */
+		if (r != SC_SUCCESS && !err) {
+			fprintf(stderr, "%s:%lu: APDU transmit failed: %s\n", filename,
+					lines[i].line, sc_strerror(r));
+			err = 1;
+		}
+	}
+	total = script_time() - total;
+	sc_unlock(card);
+
+	printf("%lu of %lu APDUs sent in %.3f ms, %.3f ms average\n",
+			(unsigned long) done, (unsigned long) count, total / 1000.0,
+			done ? total / 1000.0 / done : 0.0);
+	free_script(lines, apdus, count);
+	return err;
+}
+
 static void print_serial(sc_card_t *in_card)
 {
 	int r;
@@ -691,6 +962,46 @@ static int card_reset(const char *reset_type)
 	return 0;
 }
 
+static void print_apdu_stats(void)
+{
+	unsigned int i, ins, b;
+
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+		int header = 0;
+
+		for (ins = 0; ins <= 0xFF; ins++) {
+			const struct sc_apdu_stats *stats = sc_get_apdu_stats(reader, ins);
+
+			if (stats == NULL)
+				break;
+			if (stats->count == 0)
+				continue;
+			if (!header) {
+				printf("APDU statistics of reader '%s':\n", reader->name);
+				header = 1;
+			}
+			printf("  INS %02X: %lu APDUs, %lu errors, %llu bytes out, %llu bytes in, "
+					"%lu GET RESPONSE, %lu re-transmitted, %.3f ms average\n",
+					ins, stats->count, stats->errors, stats->bytes_out,
+					stats->bytes_in, stats->get_response, stats->retransmit,
+					stats->time_us / 1000.0 / stats->count);
+			printf("    latency:");
+			for (b = 0; b < SC_APDU_STATS_BUCKETS; b++) {
+				if (stats->latency[b] == 0)
+					continue;
+				if (b == 0)
+					printf(" <1ms:%lu", stats->latency[b]);
+				else if (b == SC_APDU_STATS_BUCKETS - 1)
+					printf(" >=%ums:%lu", 1U << (b - 1), stats->latency[b]);
+				else
+					printf(" <%ums:%lu", 1U << b, stats->latency[b]);
+			}
+			printf("\n");
+		}
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -707,10 +1018,12 @@ int main(int argc, char *argv[])
 	int do_print_name = 0;
 	int do_list_algorithms = 0;
 	int do_reset = 0;
+	int do_script = 0;
 	int action_count = 0;
 	const char *opt_driver = NULL;
 	const char *opt_conf_entry = NULL;
 	const char *opt_reset_type = NULL;
+	const char *opt_script = NULL;
 	char **p;
 	sc_context_param_t ctx_param;
 
@@ -802,6 +1115,17 @@ int main(int argc, char *argv[])
 			opt_reset_type = optarg;
 			action_count++;
 			break;
+		case OPT_APDU_STATS:
+			opt_apdu_stats = 1;
+			break;
+		case OPT_SCRIPT:
+			do_script = 1;
+			opt_script = optarg;
+			action_count++;
+			break;
+		case OPT_BATCH:
+			opt_batch = 1;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -828,6 +1152,8 @@ int main(int argc, char *argv[])
 	}
 
 	ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
+	if (opt_apdu_stats)
+		ctx->flags |= SC_CTX_FLAG_APDU_STATS;
 
 	if (verbose > 1) {
 		ctx->debug = verbose;
@@ -898,6 +1224,11 @@ int main(int argc, char *argv[])
 			goto end;
 		action_count--;
 	}
+	if (do_script) {
+		if ((err = run_script(opt_script)))
+			goto end;
+		action_count--;
+	}
 
 	if (do_list_files) {
 		if ((err = list_files()))
@@ -920,6 +1251,8 @@ end:
 	if (card) {
 		sc_disconnect_card(card);
 	}
+	if (ctx && opt_apdu_stats)
+		print_apdu_stats();
 	if (ctx)
 		sc_release_context(ctx);
 	return err;
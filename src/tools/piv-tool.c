@@ -30,6 +30,10 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/wait.h>
+#endif
 
 /* Module only built if OPENSSL is enabled */
 #include <openssl/opensslv.h>
@@ -64,14 +68,17 @@ static int	opt_wait = 0;
 static char **	opt_apdus;
 static char *	opt_reader;
 static int	opt_apdu_count = 0;
+static const char *opt_driver = NULL;
 static int	verbose = 0;
 
 enum {
 	OPT_SERIAL = 0x100,
+	OPT_MANIFEST,
 };
 
 static const struct option options[] = {
 	{ "serial",		0, NULL,	OPT_SERIAL  },
+	{ "manifest",		1, NULL,	OPT_MANIFEST },
 	{ "name",		0, NULL,		'n' },
 	{ "admin",		1, NULL, 		'A' },
 	{ "genkey",		1, NULL,		'G' },
@@ -90,6 +97,7 @@ static const struct option options[] = {
 
 static const char *option_help[] = {
 	"Print the card serial number",
+	"Run the lines of <arg> (reader and options) on all cards in parallel",
 	"Identify the card and print its name",
 	"Authenticate using default 3DES key",
 	"Generate key <ref>:<alg> 9A:06 on card, and output pubkey",
@@ -457,7 +465,194 @@ static void print_serial(sc_card_t *in_card)
 		util_hex_dump_asc(stdout, serial.value, serial.len, -1);
 }
 
-int main(int argc, char *argv[])
+#if !defined(_WIN32)
+#define MAX_CARDS	64
+#define MAX_ARGS	64
+
+static int in_worker = 0;
+
+static int piv_tool(int argc, char *argv[]);
+
+/* split a manifest line into words, a word may be enclosed in "" */
+static int split_args(char *line, char **args, int max)
+{
+	int n = 0;
+	char *p = line;
+
+	while (1) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+		if (n == max)
+			return -1;
+		if (*p == '"') {
+			args[n++] = ++p;
+			p = strchr(p, '"');
+			if (p == NULL)
+				return -1;
+		} else {
+			args[n++] = p;
+			p += strcspn(p, " \t\r\n");
+			if (*p == '\0')
+				break;
+		}
+		*p++ = '\0';
+	}
+	return n;
+}
+
+/*
+ * Every line of the manifest names a reader, followed by the options for
+ * the card in that reader, e.g. "0 -A A:9B:03 -G 9A:07 -o card0.pub".
+ * A worker is forked for each line, so the key generation, which is
+ * bound by the card, runs on all cards at once. The output of the workers
+ * is passed on a line at a time and prefixed with the reader.
+ */
+static int run_manifest(const char *name)
+{
+	struct worker {
+		pid_t pid;
+		int fd;
+		char *line;
+		int argc;
+		char *argv[MAX_ARGS + 3];
+		size_t len;
+		char buf[1024];
+	} *workers;
+	struct pollfd pfd[MAX_CARDS];
+	FILE *fp;
+	char line[4096];
+	int i, j, count = 0, lines = 0, running, status, err = 0;
+
+	fp = fopen(name, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open manifest %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	workers = calloc(MAX_CARDS, sizeof *workers);
+	if (workers == NULL) {
+		fclose(fp);
+		return 1;
+	}
+	while (fgets(line, sizeof line, fp) != NULL) {
+		struct worker *w = &workers[lines];
+		char *p = line + strspn(line, " \t\r\n");
+		int n;
+
+		if (*p == '\0' || *p == '#')
+			continue;
+		if (lines == MAX_CARDS) {
+			fprintf(stderr, "%s: too many cards, at most %d\n", name, MAX_CARDS);
+			err = 1;
+			break;
+		}
+		w->line = strdup(line);
+		n = w->line ? split_args(w->line, w->argv + 2, MAX_ARGS + 1) : -1;
+		if (n < 0) {
+			fprintf(stderr, "%s: invalid line %s", name, line);
+			free(w->line);
+			err = 1;
+			break;
+		}
+		/* <reader> <options> becomes piv-tool --reader <reader> <options> */
+		w->argv[0] = (char *) app_name;
+		w->argv[1] = "--reader";
+		w->argc = n + 2;
+		w->argv[w->argc] = NULL;
+		lines++;
+	}
+	fclose(fp);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < lines && !err; i++) {
+		int fds[2];
+
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			err = 1;
+			break;
+		}
+		workers[i].pid = fork();
+		if (workers[i].pid == 0) {
+			for (j = 0; j < count; j++)
+				close(workers[j].fd);
+			close(fds[0]);
+			dup2(fds[1], STDOUT_FILENO);
+			dup2(fds[1], STDERR_FILENO);
+			close(fds[1]);
+			in_worker = 1;
+			optind = 1;
+			exit(piv_tool(workers[i].argc, workers[i].argv));
+		}
+		close(fds[1]);
+		if (workers[i].pid < 0) {
+			perror("fork");
+			close(fds[0]);
+			err = 1;
+			break;
+		}
+		workers[i].fd = fds[0];
+		count++;
+	}
+
+	/* pass on the output of the workers a line at a time */
+	for (running = count; running > 0; ) {
+		for (i = 0; i < count; i++) {
+			pfd[i].fd = workers[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, count, -1) < 0)
+			continue;
+		for (i = 0; i < count; i++) {
+			struct worker *w = &workers[i];
+			char *start, *end;
+			ssize_t n;
+
+			if (w->fd < 0 || pfd[i].revents == 0)
+				continue;
+			n = read(w->fd, w->buf + w->len, sizeof w->buf - w->len);
+			if (n > 0)
+				w->len += n;
+			start = w->buf;
+			while ((end = memchr(start, '\n', w->buf + w->len - start)) != NULL) {
+				printf("[%s] %.*s\n", w->argv[2], (int) (end - start), start);
+				start = end + 1;
+			}
+			/* a last line without newline, or one too long for the buffer */
+			if (start < w->buf + w->len
+					&& (n <= 0 || (start == w->buf && w->len == sizeof w->buf))) {
+				printf("[%s] %.*s\n", w->argv[2],
+					(int) (w->buf + w->len - start), start);
+				start = w->buf + w->len;
+			}
+			w->len -= start - w->buf;
+			memmove(w->buf, start, w->len);
+			if (n <= 0) {
+				close(w->fd);
+				w->fd = -1;
+				running--;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (waitpid(workers[i].pid, &status, 0) < 0
+				|| !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "[%s] failed\n", workers[i].argv[2]);
+			err = 1;
+		}
+	}
+	for (i = 0; i < lines; i++)
+		free(workers[i].line);
+	free(workers);
+	return err;
+}
+#endif
+
+static int piv_tool(int argc, char *argv[])
 {
 	int err = 0, r, c, long_optind = 0;
 	int do_send_apdu = 0;
@@ -469,7 +664,7 @@ int main(int argc, char *argv[])
 	int do_print_serial = 0;
 	int do_print_name = 0;
 	int action_count = 0;
-	const char *opt_driver = NULL;
+	const char *opt_manifest = NULL;
 	const char *out_file = NULL;
 	const char *in_file = NULL;
 	const char *cert_id = NULL;
@@ -482,7 +677,7 @@ int main(int argc, char *argv[])
 	setbuf(stdout, NULL);
 
 	while (1) {
-		c = getopt_long(argc, argv, "nA:G:O:Z:C:i:o:fvs:c:w", options, &long_optind);
+		c = getopt_long(argc, argv, "nA:G:O:Z:C:i:o:fvs:r:c:w", options, &long_optind);
 		if (c == -1)
 			break;
 		if (c == '?')
@@ -492,6 +687,10 @@ int main(int argc, char *argv[])
 			do_print_serial = 1;
 			action_count++;
 			break;
+		case OPT_MANIFEST:
+			opt_manifest = optarg;
+			action_count++;
+			break;
 		case 's':
 			opt_apdus = (char **) realloc(opt_apdus,
 					(opt_apdu_count + 1) * sizeof(char *));
@@ -555,6 +754,25 @@ int main(int argc, char *argv[])
 	if (action_count == 0)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 
+	if (opt_manifest) {
+#if !defined(_WIN32)
+		if (in_worker || action_count > 1) {
+			fprintf(stderr, "--manifest can not be combined with other actions\n");
+			return 1;
+		}
+		return run_manifest(opt_manifest);
+#else
+		fprintf(stderr, "--manifest is not supported on this platform\n");
+		return 1;
+#endif
+	}
+#if !defined(_WIN32)
+	/* the output of a worker is passed on as text */
+	if (in_worker && do_gen_key && !out_file) {
+		fprintf(stderr, "--genkey needs --out in a manifest\n");
+		return 1;
+	}
+#endif
 
 //#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 //	OPENSSL_config(NULL);
@@ -662,3 +880,8 @@ end:
 	ERR_print_errors_fp(stderr);
 	return err;
 }
+
+int main(int argc, char *argv[])
+{
+	return piv_tool(argc, argv);
+}
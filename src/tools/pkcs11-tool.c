@@ -29,6 +29,10 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #else
 #include <windows.h>
 #include <io.h>
@@ -150,6 +154,9 @@ enum {
 	OPT_HASH_ALGORITHM,
 	OPT_MGF,
 	OPT_SALT,
+	OPT_BENCHMARK,
+	OPT_ITERATIONS,
+	OPT_THREADS,
 };
 
 static const struct option options[] = {
@@ -217,6 +224,9 @@ static const struct option options[] = {
 	{ "test-fork",		0, NULL,		OPT_TEST_FORK },
 #endif
 	{ "generate-random",	1, NULL,		OPT_GENERATE_RANDOM },
+	{ "benchmark",		1, NULL,		OPT_BENCHMARK },
+	{ "iterations",		1, NULL,		OPT_ITERATIONS },
+	{ "threads",		1, NULL,		OPT_THREADS },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -286,6 +296,9 @@ static const char *option_help[] = {
 	"Test forking and calling C_Initialize() in the child",
 #endif
 	"Generate given amount of random data",
+	"Measure the throughput of <arg> ('sign', 'decrypt' or 'verify') with the key given by --id",
+	"Number of operations per thread for --benchmark (default: 100)",
+	"Number of threads, each with its own session, for --benchmark (default: 1)",
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -331,6 +344,9 @@ static int		opt_derive_pass_der = 0;
 static unsigned long	opt_random_bytes = 0;
 static CK_MECHANISM_TYPE opt_hash_alg = 0;
 static unsigned long	opt_mgf = 0;
+static const char *	opt_benchmark = NULL;
+static unsigned long	opt_iterations = 100;
+static unsigned long	opt_threads = 1;
 static long	        salt_len = 0;
 static int		salt_len_given = 0; /* 0 - not given, 1 - given with input parameters */
 
@@ -397,6 +413,7 @@ static void		show_cert(CK_SESSION_HANDLE, CK_OBJECT_HANDLE);
 static void		show_dobj(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE obj);
 static void		sign_data(CK_SLOT_ID, CK_SESSION_HANDLE, CK_OBJECT_HANDLE);
 static void		decrypt_data(CK_SLOT_ID, CK_SESSION_HANDLE, CK_OBJECT_HANDLE);
+static void		benchmark(CK_SLOT_ID, CK_SESSION_HANDLE);
 static void		hash_data(CK_SLOT_ID, CK_SESSION_HANDLE);
 static void		derive_key(CK_SLOT_ID, CK_SESSION_HANDLE, CK_OBJECT_HANDLE);
 static int		gen_keypair(CK_SLOT_ID slot, CK_SESSION_HANDLE,
@@ -555,6 +572,8 @@ int main(int argc, char * argv[])
 	int do_unlock_pin = 0;
 	int action_count = 0;
 	int do_generate_random = 0;
+	int do_benchmark = 0;
+	CK_C_INITIALIZE_ARGS init_args;
 	CK_RV rv;
 
 #ifdef _WIN32
@@ -869,6 +888,18 @@ int main(int argc, char * argv[])
 			do_generate_random = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			need_session |= NEED_SESSION_RO;
+			opt_benchmark = optarg;
+			do_benchmark = 1;
+			action_count++;
+			break;
+		case OPT_ITERATIONS:
+			opt_iterations = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_THREADS:
+			opt_threads = strtoul(optarg, NULL, 0);
+			break;
 
 		default:
 			util_print_usage_and_die(app_name, options, option_help, NULL);
@@ -892,7 +923,10 @@ int main(int argc, char * argv[])
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
-	rv = p11->C_Initialize(NULL);
+	/* the benchmark threads call the module concurrently */
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+	rv = p11->C_Initialize(do_benchmark && opt_threads > 1 ? &init_args : NULL);
 	if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED)
 		fprintf(stderr, "\n*** Cryptoki library has already been initialized ***\n");
 	else if (rv != CKR_OK)
@@ -973,7 +1007,7 @@ int main(int argc, char * argv[])
 	if (do_list_mechs)
 		list_mechs(opt_slot);
 
-	if (do_sign || do_decrypt) {
+	if (do_sign || do_decrypt || do_benchmark) {
 		CK_TOKEN_INFO	info;
 
 		get_token_info(opt_slot, &info);
@@ -1050,6 +1084,9 @@ int main(int argc, char * argv[])
 	if (do_decrypt)
 		decrypt_data(opt_slot, session, object);
 
+	if (do_benchmark)
+		benchmark(opt_slot, session);
+
 	if (do_hash)
 		hash_data(opt_slot, session);
 
@@ -1977,6 +2014,284 @@ static void decrypt_data(CK_SLOT_ID slot, CK_SESSION_HANDLE session,
 }
 
 
+/* Operation measured by --benchmark */
+enum bench_op { BENCH_SIGN, BENCH_DECRYPT, BENCH_VERIFY };
+
+struct bench_ctx {
+	enum bench_op	op;
+	CK_SLOT_ID	slot;
+	CK_MECHANISM	mech;
+	CK_OBJECT_HANDLE key;
+	CK_BBOOL	always_auth;
+	unsigned char	*data, *sig;
+	CK_ULONG	data_len, sig_len;
+};
+
+struct bench_thread {
+	struct bench_ctx *ctx;
+	double		*latency;	/* milliseconds, one per successful operation */
+	unsigned long	done, failed;
+	CK_RV		first_error;
+};
+
+static double bench_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart * 1000.0 / (double) freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static CK_RV bench_once(struct bench_ctx *ctx, CK_SESSION_HANDLE session)
+{
+	unsigned char	out[1024];
+	CK_ULONG	out_len = sizeof(out);
+	CK_RV		rv;
+
+	switch (ctx->op) {
+	case BENCH_SIGN:
+		rv = p11->C_SignInit(session, &ctx->mech, ctx->key);
+		break;
+	case BENCH_DECRYPT:
+		rv = p11->C_DecryptInit(session, &ctx->mech, ctx->key);
+		break;
+	default:
+		rv = p11->C_VerifyInit(session, &ctx->mech, ctx->key);
+		break;
+	}
+	if (rv != CKR_OK)
+		return rv;
+
+	if (ctx->always_auth) {
+		rv = p11->C_Login(session, CKU_CONTEXT_SPECIFIC,
+				(CK_UTF8CHAR *) opt_pin, strlen(opt_pin));
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	switch (ctx->op) {
+	case BENCH_SIGN:
+		return p11->C_Sign(session, ctx->data, ctx->data_len, out, &out_len);
+	case BENCH_DECRYPT:
+		return p11->C_Decrypt(session, ctx->data, ctx->data_len, out, &out_len);
+	default:
+		return p11->C_Verify(session, ctx->data, ctx->data_len, ctx->sig, ctx->sig_len);
+	}
+}
+
+static void bench_run(struct bench_thread *t)
+{
+	CK_SESSION_HANDLE session;
+	unsigned long	i;
+	double		start;
+	CK_RV		rv;
+
+	rv = p11->C_OpenSession(t->ctx->slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rv != CKR_OK) {
+		t->failed = opt_iterations;
+		t->first_error = rv;
+		return;
+	}
+
+	for (i = 0; i < opt_iterations; i++) {
+		start = bench_time();
+		rv = bench_once(t->ctx, session);
+		if (rv == CKR_OK) {
+			t->latency[t->done++] = bench_time() - start;
+		} else {
+			if (t->failed++ == 0)
+				t->first_error = rv;
+			if (verbose)
+				fprintf(stderr, "Operation %lu failed: %s\n", i, CKR2Str(rv));
+		}
+	}
+
+	p11->C_CloseSession(session);
+}
+
+#ifdef HAVE_PTHREAD
+static void *bench_thread_main(void *arg)
+{
+	bench_run(arg);
+	return NULL;
+}
+#endif
+
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const double *sorted, unsigned long n, unsigned int pct)
+{
+	unsigned long rank = (n * pct + 99) / 100;
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+/*
+ * Repeat an operation with the key of --id across --threads sessions and
+ * report the throughput and the latency of the module. PKCS#11 does not tell
+ * how many APDUs an operation takes: use OPENSC_DEBUG or pkcs11-spy for that.
+ */
+static void benchmark(CK_SLOT_ID slot, CK_SESSION_HANDLE session)
+{
+	struct bench_ctx ctx;
+	struct bench_thread *threads;
+	unsigned char	in_buffer[1024], sig_buffer[1024];
+	const char	*op_name;
+	double		*latency, start, elapsed, sum = 0;
+	unsigned long	i, n = 0, failed = 0;
+	CK_OBJECT_HANDLE privkey;
+	CK_RV		rv;
+	int		fd, r;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.slot = slot;
+	if (!strcmp(opt_benchmark, "sign"))
+		ctx.op = BENCH_SIGN;
+	else if (!strcmp(opt_benchmark, "decrypt"))
+		ctx.op = BENCH_DECRYPT;
+	else if (!strcmp(opt_benchmark, "verify"))
+		ctx.op = BENCH_VERIFY;
+	else
+		util_fatal("Unsupported benchmark \"%s\" (use 'sign', 'decrypt' or 'verify')", opt_benchmark);
+	op_name = opt_benchmark;
+
+	if (opt_iterations == 0 || opt_threads == 0)
+		util_fatal("The number of iterations and threads must be positive");
+#ifndef HAVE_PTHREAD
+	if (opt_threads > 1)
+		util_fatal("Benchmark with several threads is not supported on this platform");
+#endif
+
+	if (!find_object(session, CKO_PRIVATE_KEY, &privkey,
+				opt_object_id_len ? opt_object_id : NULL, opt_object_id_len, 0))
+		util_fatal("Private key not found");
+
+	if (!opt_mechanism_used)
+		if (!find_mechanism(slot, (ctx.op == BENCH_DECRYPT ? CKF_DECRYPT : CKF_SIGN) | CKF_HW,
+					NULL, 0, &opt_mechanism))
+			util_fatal("No mechanism found for the benchmark, use --mechanism");
+	/* mechanisms with parameters (PSS, OAEP) would need the setup of sign_data() */
+	ctx.mech.mechanism = opt_mechanism;
+
+	/* the input defaults to a block fitting a hash for the raw signatures */
+	if (opt_input != NULL) {
+		if ((fd = open(opt_input, O_RDONLY|O_BINARY)) < 0)
+			util_fatal("Cannot open %s: %m", opt_input);
+		r = read(fd, in_buffer, sizeof(in_buffer));
+		if (r < 0)
+			util_fatal("Cannot read from %s: %m", opt_input);
+		close(fd);
+		ctx.data_len = r;
+	} else if (ctx.op == BENCH_DECRYPT) {
+		util_fatal("The decrypt benchmark needs a ciphertext in --input-file");
+	} else {
+		memset(in_buffer, 0x5A, 32);
+		ctx.data_len = 32;
+	}
+	ctx.data = in_buffer;
+
+	ctx.key = privkey;
+	if (ctx.op == BENCH_VERIFY) {
+		/* make the signature to verify with the private key */
+		rv = p11->C_SignInit(session, &ctx.mech, privkey);
+		if (rv != CKR_OK)
+			p11_fatal("C_SignInit", rv);
+		if (getALWAYS_AUTHENTICATE(session, privkey))
+			login(session, CKU_CONTEXT_SPECIFIC);
+		ctx.sig_len = sizeof(sig_buffer);
+		rv = p11->C_Sign(session, ctx.data, ctx.data_len, sig_buffer, &ctx.sig_len);
+		if (rv != CKR_OK)
+			p11_fatal("C_Sign", rv);
+		ctx.sig = sig_buffer;
+
+		if (!find_object(session, CKO_PUBLIC_KEY, &ctx.key,
+					opt_object_id_len ? opt_object_id : NULL, opt_object_id_len, 0))
+			util_fatal("Public key not found");
+	} else if (getALWAYS_AUTHENTICATE(session, privkey)) {
+		if (opt_pin == NULL)
+			util_fatal("The key needs a login for every operation, use --pin");
+		ctx.always_auth = 1;
+	}
+
+	fprintf(stderr, "Benchmark of %s with %s: %lu thread(s) x %lu iteration(s), %lu bytes of data\n",
+			op_name, p11_mechanism_to_name(opt_mechanism),
+			opt_threads, opt_iterations, ctx.data_len);
+
+	threads = calloc(opt_threads, sizeof(*threads));
+	latency = calloc(opt_threads * opt_iterations, sizeof(*latency));
+	if (threads == NULL || latency == NULL)
+		util_fatal("out of memory");
+	for (i = 0; i < opt_threads; i++) {
+		threads[i].ctx = &ctx;
+		threads[i].latency = latency + i * opt_iterations;
+	}
+
+	start = bench_time();
+#ifdef HAVE_PTHREAD
+	if (opt_threads > 1) {
+		pthread_t *tids = calloc(opt_threads, sizeof(*tids));
+
+		if (tids == NULL)
+			util_fatal("out of memory");
+		for (i = 0; i < opt_threads; i++)
+			if (pthread_create(&tids[i], NULL, bench_thread_main, &threads[i]) != 0)
+				util_fatal("Cannot create the benchmark threads");
+		for (i = 0; i < opt_threads; i++)
+			pthread_join(tids[i], NULL);
+		free(tids);
+	} else
+#endif
+		bench_run(&threads[0]);
+	elapsed = bench_time() - start;
+
+	/* gather the latencies of all threads at the start of the array */
+	for (i = 0; i < opt_threads; i++) {
+		memmove(latency + n, threads[i].latency, threads[i].done * sizeof(*latency));
+		n += threads[i].done;
+		failed += threads[i].failed;
+		if (threads[i].failed && verbose)
+			fprintf(stderr, "Thread %lu: %lu operation(s) failed, first error %s\n",
+					i, threads[i].failed, CKR2Str(threads[i].first_error));
+	}
+
+	printf("Operations:    %lu succeeded, %lu failed\n", n, failed);
+	printf("Elapsed time:  %.3f s\n", elapsed / 1000.0);
+	printf("Throughput:    %.2f ops/s\n", elapsed > 0 ? n * 1000.0 / elapsed : 0.0);
+	if (n > 0) {
+		qsort(latency, n, sizeof(*latency), bench_compare);
+		for (i = 0; i < n; i++)
+			sum += latency[i];
+		printf("Latency (ms):  min %.2f, mean %.2f, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+				latency[0], sum / n,
+				bench_percentile(latency, n, 50),
+				bench_percentile(latency, n, 90),
+				bench_percentile(latency, n, 99),
+				latency[n - 1]);
+	}
+	for (i = 0; i < opt_threads && failed; i++)
+		if (threads[i].failed) {
+			fprintf(stderr, "First error: %s\n", CKR2Str(threads[i].first_error));
+			break;
+		}
+
+	free(latency);
+	free(threads);
+}
+
+
 static void hash_data(CK_SLOT_ID slot, CK_SESSION_HANDLE session)
 {
 	unsigned char	buffer[64];
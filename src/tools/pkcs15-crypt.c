@@ -49,6 +49,7 @@ static char * opt_input = NULL, * opt_output = NULL;
 static char * opt_bind_to_aid = NULL;
 static char * opt_sig_format = NULL;
 static int opt_crypt_flags = 0;
+static int opt_stream = 0;
 
 enum {
 	OPT_SHA1 =	0x100,
@@ -60,6 +61,7 @@ enum {
 	OPT_PKCS1,
 	OPT_BIND_TO_AID,
 	OPT_VERSION,
+	OPT_STREAM,
 };
 
 static const struct option options[] = {
@@ -72,6 +74,7 @@ static const struct option options[] = {
 	{ "output",		1, NULL,		'o' },
 	{ "signature-format",	1, NULL,		'f' },
 	{ "raw",		0, NULL,		'R' },
+	{ "stream",		0, NULL,		OPT_STREAM },
 	{ "sha-1",		0, NULL,		OPT_SHA1 },
 	{ "sha-256",		0, NULL,		OPT_SHA256 },
 	{ "sha-384",		0, NULL,		OPT_SHA384 },
@@ -96,6 +99,7 @@ static const char *option_help[] = {
 	"Outputs to file <arg> (defaults to stdout)",
 	"Format for ECDSA signature <arg>: 'rs' (default), 'sequence', 'openssl'",
 	"Outputs raw 8 bit data",
+	"Process length prefixed records until end of input",
 	"Input file is a SHA-1 hash",
 	"Input file is a SHA-256 hash",
 	"Input file is a SHA-384 hash",
@@ -207,23 +211,16 @@ static int write_output(const u8 *buf, int len)
 	return 0;
 }
 
-static int sign(struct sc_pkcs15_object *obj)
+/* sign inlen bytes of in, the signature is returned in out and outlen */
+static int sign_data(struct sc_pkcs15_object *obj, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen)
 {
-	u8 buf[1024], out[1024];
 	struct sc_pkcs15_prkey_info *key = (struct sc_pkcs15_prkey_info *) obj->data;
-	int r, c, len;
-
-	if (opt_input == NULL) {
-		fprintf(stderr, "No input file specified. Reading from stdin\n");
-	}
+	int r, len;
 
-	c = read_input(buf, sizeof(buf));
-	if (c < 0)
-		return 2;
-	len = sizeof(out);
 	if (obj->type == SC_PKCS15_TYPE_PRKEY_RSA
 			&& !(opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1)
-			&& (size_t)c != key->modulus_length/8) {
+			&& inlen != key->modulus_length/8) {
 		fprintf(stderr, "Input has to be exactly %lu bytes, when using no padding.\n",
 			(unsigned long) key->modulus_length/8);
 		return 2;
@@ -233,7 +230,7 @@ static int sign(struct sc_pkcs15_object *obj)
 		return SC_ERROR_NOT_SUPPORTED;
 	}
 
-	r = sc_pkcs15_compute_signature(p15card, obj, opt_crypt_flags, buf, c, out, len);
+	r = sc_pkcs15_compute_signature(p15card, obj, opt_crypt_flags, in, inlen, out, *outlen);
 	if (r < 0) {
 		fprintf(stderr, "Compute signature failed: %s\n", sc_strerror(r));
 		return 1;
@@ -249,6 +246,10 @@ static int sign(struct sc_pkcs15_object *obj)
 				fprintf(stderr, "Failed to convert signature to ASN1 sequence format.\n");
 				return 2;
 			}
+			if (seqlen > *outlen) {
+				free(seq);
+				return 2;
+			}
 
 			memcpy(out, seq, seqlen);
 			len = seqlen;
@@ -257,39 +258,150 @@ static int sign(struct sc_pkcs15_object *obj)
 		}
 	}
 
-	r = write_output(out, len);
-
-	return r;
+	*outlen = len;
+	return 0;
 }
 
-static int decipher(struct sc_pkcs15_object *obj)
+static int sign(struct sc_pkcs15_object *obj)
 {
 	u8 buf[1024], out[1024];
-	int r, c, len;
+	size_t len = sizeof(out);
+	int r, c;
 
 	if (opt_input == NULL) {
 		fprintf(stderr, "No input file specified. Reading from stdin\n");
 	}
+
 	c = read_input(buf, sizeof(buf));
 	if (c < 0)
 		return 2;
 
-	len = sizeof(out);
+	r = sign_data(obj, buf, c, out, &len);
+	if (r)
+		return r;
+
+	r = write_output(out, len);
+
+	return r;
+}
+
+static int decipher_data(struct sc_pkcs15_object *obj, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen)
+{
+	int r;
+
 	if (!((struct sc_pkcs15_prkey_info *) obj->data)->native) {
-                fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
+		fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
 		return SC_ERROR_NOT_SUPPORTED;
 	}
 
-	r = sc_pkcs15_decipher(p15card, obj, opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1, buf, c, out, len);
+	r = sc_pkcs15_decipher(p15card, obj, opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1, in, inlen, out, *outlen);
 	if (r < 0) {
 		fprintf(stderr, "Decrypt failed: %s\n", sc_strerror(r));
 		return 1;
 	}
-	r = write_output(out, r);
+	*outlen = r;
+	return 0;
+}
+
+static int decipher(struct sc_pkcs15_object *obj)
+{
+	u8 buf[1024], out[1024];
+	size_t len = sizeof(out);
+	int r, c;
+
+	if (opt_input == NULL) {
+		fprintf(stderr, "No input file specified. Reading from stdin\n");
+	}
+	c = read_input(buf, sizeof(buf));
+	if (c < 0)
+		return 2;
+
+	r = decipher_data(obj, buf, c, out, &len);
+	if (r)
+		return r;
+
+	r = write_output(out, len);
 
 	return r;
 }
 
+/*
+ * Sign or decipher a stream of records. Each input record is a 4 byte
+ * big endian length followed by the data, each result is written the
+ * same way. The card stays locked, so the PIN is verified only once.
+ */
+static int stream(struct sc_pkcs15_object *obj, int do_sign)
+{
+	FILE *inf = stdin, *outf = stdout;
+	u8 hdr[4], buf[1024], out[1024];
+	size_t n, inlen, outlen;
+	unsigned long count = 0;
+	int r, err = 0;
+
+	if (opt_input != NULL && (inf = fopen(opt_input, "rb")) == NULL) {
+		fprintf(stderr, "Unable to open '%s' for reading.\n", opt_input);
+		return 2;
+	}
+	if (opt_output != NULL && (outf = fopen(opt_output, "wb")) == NULL) {
+		fprintf(stderr, "Unable to open '%s' for writing.\n", opt_output);
+		if (inf != stdin)
+			fclose(inf);
+		return 2;
+	}
+
+	r = sc_lock(card);
+	if (r < 0) {
+		fprintf(stderr, "Unable to lock card: %s\n", sc_strerror(r));
+		err = 1;
+		goto out;
+	}
+	while ((n = fread(hdr, 1, sizeof hdr, inf)) == sizeof hdr) {
+		inlen = (size_t) hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+		if (inlen > sizeof buf || fread(buf, 1, inlen, inf) != inlen) {
+			fprintf(stderr, "Record %lu: invalid length %lu\n", count,
+				(unsigned long) inlen);
+			err = 2;
+			break;
+		}
+		outlen = sizeof out;
+		if (do_sign)
+			err = sign_data(obj, buf, inlen, out, &outlen);
+		else
+			err = decipher_data(obj, buf, inlen, out, &outlen);
+		if (err) {
+			fprintf(stderr, "Record %lu failed\n", count);
+			break;
+		}
+		hdr[0] = (u8) (outlen >> 24);
+		hdr[1] = (u8) (outlen >> 16);
+		hdr[2] = (u8) (outlen >> 8);
+		hdr[3] = (u8) outlen;
+		if (fwrite(hdr, sizeof hdr, 1, outf) != 1
+				|| (outlen && fwrite(out, outlen, 1, outf) != 1)
+				|| fflush(outf) != 0) {
+			perror("write");
+			err = 2;
+			break;
+		}
+		count++;
+	}
+	if (!err && n != 0) {
+		fprintf(stderr, "Record %lu: truncated length\n", count);
+		err = 2;
+	}
+	sc_unlock(card);
+	if (verbose)
+		fprintf(stderr, "%lu records processed.\n", count);
+
+out:
+	if (inf != stdin)
+		fclose(inf);
+	if (outf != stdout)
+		fclose(outf);
+	return err;
+}
+
 static int get_key(unsigned int usage, sc_pkcs15_object_t **result)
 {
 	sc_pkcs15_object_t *key, *pin;
@@ -402,6 +514,9 @@ int main(int argc, char *argv[])
 		case 'R':
 			opt_raw = 1;
 			break;
+		case OPT_STREAM:
+			opt_stream = 1;
+			break;
 		case OPT_SHA1:
 			opt_crypt_flags |= SC_ALGORITHM_RSA_HASH_SHA1;
 			break;
@@ -445,6 +560,17 @@ int main(int argc, char *argv[])
 		action_count--;
 	}
 
+	if (opt_stream) {
+		if (do_sign + do_decipher != 1) {
+			fprintf(stderr, "--stream needs exactly one of --sign and --decipher\n");
+			return 1;
+		}
+		if (opt_input == NULL && opt_pincode && strcmp(opt_pincode, "-") == 0) {
+			fprintf(stderr, "--stream reads records from stdin, the PIN can not be read from there\n");
+			return 1;
+		}
+	}
+
 	if (!(opt_crypt_flags & SC_ALGORITHM_RSA_HASHES))
 		opt_crypt_flags |= SC_ALGORITHM_RSA_HASH_NONE;
 
@@ -493,7 +619,7 @@ int main(int argc, char *argv[])
 
 	if (do_decipher) {
 		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_DECRYPT|SC_PKCS15_PRKEY_USAGE_UNWRAP, &key))
-		 || (err = decipher(key)))
+		 || (err = opt_stream ? stream(key, 0) : decipher(key)))
 			goto end;
 		action_count--;
 	}
@@ -502,7 +628,7 @@ int main(int argc, char *argv[])
 		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_SIGN|
 				   SC_PKCS15_PRKEY_USAGE_SIGNRECOVER|
 				   SC_PKCS15_PRKEY_USAGE_NONREPUDIATION, &key))
-		 || (err = sign(key)))
+		 || (err = opt_stream ? stream(key, 1) : sign(key)))
 			goto end;
 		action_count--;
 	}
@@ -69,6 +69,11 @@
 #include "pkcs15init/profile.h"
 #include "util.h"
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
 #undef GET_KEY_ECHO_OFF
 
 static const char *app_name = "pkcs15-init";
@@ -118,6 +123,10 @@ static int	do_read_certificate(const char *, const char *, X509 **);
 static char *	cert_common_name(X509 *x509);
 static void	parse_commandline(int argc, char **argv);
 static void	read_options_file(const char *);
+static void	parse_option_line(char *);
+static void	handle_option(const struct option *);
+static int	personalize_card(void);
+static int	do_batch(void);
 static void	ossl_print_errors(void);
 static int	verify_pin(struct sc_pkcs15_card *, char *);
 
@@ -146,6 +155,7 @@ enum {
 	OPT_IGNORE_CA_CERTIFICATES,
 	OPT_UPDATE_EXISTING,
 	OPT_MD_CONTAINER_GUID,
+	OPT_BATCH,
 	OPT_VERSION,
 
 	OPT_PIN1      = 0x10000,	/* don't touch these values */
@@ -214,6 +224,7 @@ const struct option	options[] = {
 	{ "profile",		required_argument, NULL,	'p' },
 	{ "card-profile",	required_argument, NULL,	'c' },
 	{ "options-file",	required_argument, NULL,	OPT_OPTIONS },
+	{ "batch",		required_argument, NULL,	OPT_BATCH },
 	{ "md-container-guid",	required_argument, NULL,	OPT_MD_CONTAINER_GUID},
 	{ "wait",		no_argument, NULL,		'w' },
 	{ "help",		no_argument, NULL,		'h' },
@@ -279,6 +290,7 @@ static const char *		option_help[] = {
 	"Specify the general profile to use",
 	"Specify the card profile to use",
 	"Read additional command line options from file",
+	"Personalize one card per job of the manifest file, with all readers in parallel",
 	"For a new key specify GUID for a MD container",
 	"Wait for card insertion",
 	"Display this message",
@@ -385,6 +397,12 @@ static char *			opt_application_name = NULL;
 static char *			opt_bind_to_aid = NULL;
 static char *			opt_puk_authid = NULL;
 static char *			opt_md_container_guid = NULL;
+static char *			opt_batch = NULL;
+static struct {
+	const struct option *	opt;
+	char *			arg;
+} *				cmdline_options;
+static int			cmdline_option_count;
 static unsigned int		opt_x509_usage = 0;
 static unsigned int		opt_delete_flags = 0;
 static unsigned int		opt_type = 0;
@@ -447,8 +465,6 @@ static int	get_new_pin(sc_ui_hints_t *, const char *, const char *,
 int
 main(int argc, char **argv)
 {
-	struct sc_profile	*profile = NULL;
-	unsigned int		n;
 	int			r = 0;
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -476,7 +492,7 @@ main(int argc, char **argv)
 
 	if (optind != argc)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
-	if (opt_actions == 0) {
+	if (opt_actions == 0 && !opt_batch) {
 		fprintf(stderr, "No action specified.\n");
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 	}
@@ -485,17 +501,39 @@ main(int argc, char **argv)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 	}
 
+	sc_pkcs15init_set_callbacks(&callbacks);
+
+	if (opt_batch)
+		return do_batch();
+
 	/* Connect to the card */
 	if (!open_reader_and_card(opt_reader))
 		return 1;
 
-	sc_pkcs15init_set_callbacks(&callbacks);
+	r = personalize_card();
+
+	if (card) {
+		sc_disconnect_card(card);
+	}
+	sc_release_context(ctx);
+	return r < 0? 1 : 0;
+}
+
+/*
+ * Run the requested actions on the connected card
+ */
+static int
+personalize_card(void)
+{
+	struct sc_profile	*profile = NULL;
+	unsigned int		n;
+	int			r = 0;
 
 	/* Bind the card-specific operations and load the profile */
 	r = sc_pkcs15init_bind(card, opt_profile, opt_card_profile, NULL, &profile);
 	if (r < 0) {
 		printf("Couldn't bind to the card: %s\n", sc_strerror(r));
-		return 1;
+		return r;
 	}
 
 	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
@@ -519,7 +557,8 @@ main(int argc, char **argv)
 				aid.len = sizeof(aid.value);
 				if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len))   {
 					fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
-					return 1;
+					r = SC_ERROR_INVALID_ARGUMENTS;
+					break;
 				}
 
 				r = sc_pkcs15init_finalize_profile(card, profile, &aid);
@@ -639,16 +678,13 @@ out:
 	}
 	if (p15card) {
 		sc_pkcs15_unbind(p15card);
+		p15card = NULL;
 	}
-	if (card) {
-		sc_disconnect_card(card);
-	}
-	sc_release_context(ctx);
-	return r < 0? 1 : 0;
+	return r;
 }
 
 static int
-open_reader_and_card(char *reader)
+create_context(void)
 {
 	int	r;
 	sc_context_param_t ctx_param;
@@ -668,12 +704,236 @@ open_reader_and_card(char *reader)
 		sc_ctx_log_to_file(ctx, "stderr");
 	}
 
+	return 1;
+}
+
+static int
+open_reader_and_card(char *reader)
+{
+	if (!create_context())
+		return 0;
+
 	if (util_connect_card_ex(ctx, &card, reader, opt_wait, 0, verbose))
 		return 0;
 
 	return 1;
 }
 
+/*
+ * Batch personalization
+ *
+ * The manifest describes one card per job: lines in the format of an
+ * options file, the jobs being separated by empty lines. The options of
+ * the command line apply to every job. Every reader is driven by its own
+ * worker, which keeps its context and takes the next job whenever a card
+ * is inserted.
+ */
+struct batch_job {
+	unsigned int	line;
+	char **		options;
+	size_t		count;
+};
+
+static struct batch_job *	batch_jobs;
+static unsigned int		batch_job_count;
+
+static void
+read_batch_manifest(const char *filename)
+{
+	struct batch_job *job = NULL;
+	char		buffer[1024], *line;
+	unsigned int	lineno = 0;
+	FILE		*fp;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		util_fatal("Unable to open %s: %m", filename);
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		lineno++;
+		buffer[strcspn(buffer, "\r\n")] = '\0';
+		for (line = buffer; isspace((int) *line); line++)
+			;
+		if (*line == '\0') {
+			job = NULL;
+			continue;
+		}
+		if (*line == '#')
+			continue;
+
+		if (job == NULL) {
+			batch_jobs = realloc(batch_jobs, (batch_job_count + 1) * sizeof(*batch_jobs));
+			if (!batch_jobs)
+				util_fatal("Out of memory");
+			job = &batch_jobs[batch_job_count++];
+			memset(job, 0, sizeof(*job));
+			job->line = lineno;
+		}
+		job->options = realloc(job->options, (job->count + 1) * sizeof(char *));
+		if (!job->options || !(job->options[job->count] = strdup(line)))
+			util_fatal("Out of memory");
+		job->count++;
+	}
+	fclose(fp);
+}
+
+/*
+ * Go back to the options of the command line, then add those of the job
+ */
+static void
+load_batch_job(struct batch_job *job)
+{
+	char	buffer[1024];
+	size_t	i;
+	int	n;
+
+	opt_actions = 0;
+	opt_extractable = opt_insecure = opt_authority = 0;
+	opt_use_pinpad = opt_no_sopin = opt_use_defkeys = 0;
+	opt_wait = opt_verify_pin = 0;
+	opt_profile = "pkcs15";
+	opt_card_profile = opt_infile = opt_format = NULL;
+	opt_authid = opt_objectid = opt_label = NULL;
+	opt_puk_label = opt_pubkey_label = opt_secrkey_algo = NULL;
+	opt_cert_label = opt_serial = NULL;
+	opt_passphrase = NULL;
+	opt_newkey = opt_outkey = NULL;
+	opt_application_id = opt_application_name = NULL;
+	opt_bind_to_aid = opt_puk_authid = opt_md_container_guid = NULL;
+	memset(opt_pins, 0, sizeof(opt_pins));
+	opt_x509_usage = opt_delete_flags = opt_type = 0;
+	ignore_cmdline_pins = 0;
+	opt_secret_count = 0;
+	opt_ignore_ca_certs = opt_update_existing = 0;
+	verbose = 0;
+
+	for (n = 0; n < cmdline_option_count; n++) {
+		optarg = cmdline_options[n].arg;
+		handle_option(cmdline_options[n].opt);
+	}
+	for (i = 0; i < job->count; i++) {
+		strlcpy(buffer, job->options[i], sizeof(buffer));
+		parse_option_line(buffer);
+	}
+}
+
+static int
+batch_next_job(int fd, unsigned int *job)
+{
+#ifndef _WIN32
+	if (fd >= 0)
+		return read(fd, job, sizeof(*job)) == sizeof(*job);
+#endif
+	if (*job + 1 >= batch_job_count)
+		return 0;
+	(*job)++;
+	return 1;
+}
+
+static void
+batch_wait_for_card(sc_reader_t *reader, int present)
+{
+	sc_reader_t	*found;
+	unsigned int	event;
+
+	while (((sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT) != 0) != present)
+		sc_wait_for_event(ctx, present ? SC_EVENT_CARD_INSERTED : SC_EVENT_CARD_REMOVED,
+				&found, &event, 1000, NULL);
+}
+
+/*
+ * Run the jobs read from fd (all of them if fd < 0) with the given reader
+ * and return the number of failed jobs.
+ */
+static int
+batch_worker(unsigned int reader_index, int fd)
+{
+	sc_reader_t	*reader;
+	unsigned int	job = (unsigned int) -1;
+	int		r, failed = 0;
+
+	if (!create_context())
+		return 1;
+	reader = sc_ctx_get_reader(ctx, reader_index);
+	if (reader == NULL) {
+		sc_release_context(ctx);
+		return 1;
+	}
+
+	for (;;) {
+		batch_wait_for_card(reader, 1);
+		if (!batch_next_job(fd, &job))
+			break;
+
+		load_batch_job(&batch_jobs[job]);
+		r = sc_connect_card(reader, &card);
+		if (r == SC_SUCCESS) {
+			r = personalize_card();
+			sc_disconnect_card(card);
+			card = NULL;
+		}
+		if (r < 0)
+			failed++;
+		printf("%s: job %u (line %u): %s\n", reader->name, job + 1,
+				batch_jobs[job].line, r < 0 ? sc_strerror(r) : "done");
+		fflush(stdout);
+
+		batch_wait_for_card(reader, 0);
+	}
+
+	sc_release_context(ctx);
+	return failed;
+}
+
+static int
+do_batch(void)
+{
+	unsigned int	readers;
+
+	read_batch_manifest(opt_batch);
+	if (batch_job_count == 0)
+		util_fatal("No job in %s", opt_batch);
+
+	/* only used to count the readers */
+	if (!create_context())
+		return 1;
+	readers = sc_ctx_get_reader_count(ctx);
+	sc_release_context(ctx);
+	ctx = NULL;
+	if (readers == 0)
+		util_fatal("No smart card readers found");
+
+#ifndef _WIN32
+	if (readers > 1) {
+		unsigned int	job, i;
+		int		fds[2], status, failed = 0;
+
+		if (pipe(fds) < 0)
+			util_fatal("Unable to create a pipe: %m");
+		for (i = 0; i < readers; i++) {
+			pid_t pid = fork();
+
+			if (pid < 0)
+				util_fatal("Unable to start a worker: %m");
+			if (pid == 0) {
+				close(fds[1]);
+				exit(batch_worker(i, fds[0]) ? 1 : 0);
+			}
+		}
+		close(fds[0]);
+		/* each worker reads the next job number when it gets a card */
+		for (job = 0; job < batch_job_count; job++)
+			if (write(fds[1], &job, sizeof(job)) != sizeof(job))
+				util_fatal("Unable to dispatch the jobs: %m");
+		close(fds[1]);
+
+		while (wait(&status) > 0)
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				failed = 1;
+		return failed;
+	}
+#endif
+	return batch_worker(0, -1) ? 1 : 0;
+}
+
 /*
  * Make sure there's no pkcs15 structure on the card
  */
@@ -1069,8 +1329,15 @@ do_store_private_key(struct sc_profile *profile)
 	r = sc_lock(p15card->card);
 	if (r < 0)
 		return r;
+	/* write the DFs once for the key, the certificates and the public key */
+	r = sc_pkcs15init_begin_transaction(p15card, profile);
+	if (r < 0) {
+		sc_unlock(p15card->card);
+		return r;
+	}
 	r = sc_pkcs15init_store_private_key(p15card, profile, &args, NULL);
 	if (r < 0) {
+		sc_pkcs15init_commit_transaction(p15card, profile);
 		sc_unlock(p15card->card);
 		return r;
 	}
@@ -1122,6 +1389,9 @@ next_cert:
 	if (ncerts == 0)
 		r = do_store_public_key(profile, pkey);
 
+	i = sc_pkcs15init_commit_transaction(p15card, profile);
+	if (r >= 0)
+		r = i;
 	sc_unlock(p15card->card);
 	return r;
 }
@@ -2742,6 +3012,9 @@ handle_option(const struct option *opt)
 	case OPT_OPTIONS:
 		read_options_file(optarg);
 		break;
+	case OPT_BATCH:
+		opt_batch = optarg;
+		break;
 	case OPT_PIN1: case OPT_PUK1:
 	case OPT_PIN2: case OPT_PUK2:
 		util_get_pin(optarg, &(opt_pins[opt->val & 3]));
@@ -2900,11 +3173,18 @@ parse_commandline(int argc, char **argv)
 	}
 	sp[0] = 0;
 
+	/* kept to apply them again to every job of a batch */
+	cmdline_options = calloc(argc, sizeof(*cmdline_options));
+	if (!cmdline_options)
+		util_fatal("Out of memory");
+
 	while ((c = getopt_long(argc, argv, shortopts, options, &i)) != -1) {
 		/* The optindex seems to be off with some glibc
 		 * getopt implementations */
 		for (o = options; o->name; o++) {
 			if (o->val == c) {
+				cmdline_options[cmdline_option_count].opt = o;
+				cmdline_options[cmdline_option_count++].arg = optarg;
 				handle_option(o);
 				goto next;
 			}
@@ -2923,44 +3203,55 @@ next: ;
 static void
 read_options_file(const char *filename)
 {
-	const struct option	*o;
-	char		buffer[1024], *name;
+	char		buffer[1024];
 	FILE		*fp;
 
 	if ((fp = fopen(filename, "r")) == NULL)
 		util_fatal("Unable to open %s: %m", filename);
 	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
 		buffer[strcspn(buffer, "\n")] = '\0';
+		parse_option_line(buffer);
+	}
+	fclose(fp);
+}
+
+/*
+ * Handle a line of an options file: option names without the leading
+ * dashes, the argument of an option is the rest of the line.
+ */
+static void
+parse_option_line(char *line)
+{
+	const struct option	*o;
+	char		*name;
 
-		name = strtok(buffer, " \t");
-		while (name) {
-			if (*name == '#')
+	name = strtok(line, " \t");
+	while (name) {
+		if (*name == '#')
+			break;
+		for (o = options; o->name; o++)
+			if (!strcmp(o->name, name))
 				break;
-			for (o = options; o->name; o++)
-				if (!strcmp(o->name, name))
-					break;
-			if (!o->name) {
-				util_error("Unknown option \"%s\"\n", name);
-				util_print_usage_and_die(app_name, options, option_help, NULL);
-			}
-			if (o->has_arg != no_argument) {
-				optarg = strtok(NULL, "");
-				if (optarg) {
-					while (isspace((int) *optarg))
-						optarg++;
-					optarg = strdup(optarg);
-				}
-			}
-			if (o->has_arg == required_argument
-			 && (!optarg || !*optarg)) {
-				util_error("Option %s: missing argument\n", name);
-				util_print_usage_and_die(app_name, options, option_help, NULL);
+		if (!o->name) {
+			util_error("Unknown option \"%s\"\n", name);
+			util_print_usage_and_die(app_name, options, option_help, NULL);
+		}
+		if (o->has_arg != no_argument) {
+			optarg = strtok(NULL, "");
+			if (optarg) {
+				while (isspace((int) *optarg))
+					optarg++;
+				optarg = strdup(optarg);
 			}
-			handle_option(o);
-			name = strtok(NULL, " \t");
 		}
+		if (o->has_arg == required_argument
+		 && (!optarg || !*optarg)) {
+			util_error("Option %s: missing argument\n", name);
+			util_print_usage_and_die(app_name, options, option_help, NULL);
+		}
+		handle_option(o);
+		name = strtok(NULL, " \t");
 	}
-	fclose(fp);
 }
 
 
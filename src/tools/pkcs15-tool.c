@@ -89,6 +89,7 @@ enum {
 	OPT_PIN_ID,
 	OPT_NO_CACHE,
 	OPT_CLEAR_CACHE,
+	OPT_PREFETCH_CACHE,
 	OPT_LIST_PUB,
 	OPT_READ_PUB,
 #if defined(ENABLE_OPENSSL) && (defined(_WIN32) || defined(HAVE_INTTYPES_H))
@@ -146,6 +147,7 @@ static const struct option options[] = {
 	{ "output",		required_argument, NULL,	'o' },
 	{ "no-cache",		no_argument, NULL,		OPT_NO_CACHE },
 	{ "clear-cache",	no_argument, NULL,		OPT_CLEAR_CACHE },
+	{ "prefetch-cache",	no_argument, NULL,		OPT_PREFETCH_CACHE },
 	{ "auth-id",		required_argument, NULL,	'a' },
 	{ "aid",		required_argument, NULL,	OPT_BIND_TO_AID },
 	{ "wait",		no_argument, NULL,		'w' },
@@ -188,6 +190,7 @@ static const char *option_help[] = {
 	"Outputs to file <arg>",
 	"Disable card caching",
 	"Clear card caching",
+	"Read all public card objects into the cache",
 	"The auth ID of the PIN to use",
 	"Specify AID of the on-card PKCS#15 application to bind to (in hexadecimal form)",
 	"Wait for card insertion",
@@ -201,6 +204,10 @@ static sc_context_t *ctx = NULL;
 static sc_card_t *card = NULL;
 static struct sc_pkcs15_card *p15card = NULL;
 
+/* objects of all classes, enumerated once by dump() for all of its lists */
+static struct sc_pkcs15_object **dump_objs = NULL;
+static int dump_count = 0;
+
 struct _access_rule_text {
 	unsigned flag;
 	const char *label;
@@ -249,6 +256,33 @@ print_access_rules(const struct sc_pkcs15_accessrule *rules, int num)
 	printf("\n");
 }
 
+/* Gets all the objects of a type, without the limit of a fixed array.
+ * The array is to be freed by the caller. */
+static int get_objects(unsigned int type, struct sc_pkcs15_object ***objs)
+{
+	int r, i, count = 0;
+
+	*objs = NULL;
+	if (dump_objs != NULL) {
+		*objs = calloc(dump_count + 1, sizeof **objs);
+		if (*objs == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		for (i = 0; i < dump_count; i++)
+			if (dump_objs[i]->type == type
+					|| (dump_objs[i]->type & SC_PKCS15_TYPE_CLASS_MASK) == type)
+				(*objs)[count++] = dump_objs[i];
+		return count;
+	}
+
+	r = sc_pkcs15_get_objects(p15card, type, NULL, 0);
+	if (r <= 0)
+		return r;
+	*objs = calloc(r, sizeof **objs);
+	if (*objs == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	return sc_pkcs15_get_objects(p15card, type, *objs, r);
+}
+
 static void print_common_flags(const struct sc_pkcs15_object *obj)
 {
 	const char *common_flags[] = {"private", "modifiable"};
@@ -296,9 +330,9 @@ static void print_cert_info(const struct sc_pkcs15_object *obj)
 static int list_certificates(void)
 {
 	int r, i;
-	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_object **objs = NULL;
 
-	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_CERT_X509, objs, 32);
+	r = get_objects(SC_PKCS15_TYPE_CERT_X509, &objs);
 	if (r < 0) {
 		fprintf(stderr, "Certificate enumeration failed: %s\n", sc_strerror(r));
 		return 1;
@@ -310,8 +344,10 @@ static int list_certificates(void)
 	for (i = 0; i < r; i++) {
 		print_cert_info(objs[i]);
 		printf("\n");
+		fflush(stdout);
 	}
 
+	free(objs);
 	return 0;
 }
 
@@ -500,9 +536,9 @@ static int read_data_object(void)
 static int list_data_objects(void)
 {
 	int r, i, count;
-	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_object **objs = NULL;
 
-	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_DATA_OBJECT, objs, 32);
+	r = get_objects(SC_PKCS15_TYPE_DATA_OBJECT, &objs);
 	if (r < 0) {
 		fprintf(stderr, "Data object enumeration failed: %s\n", sc_strerror(r));
 		return 1;
@@ -530,6 +566,7 @@ static int list_data_objects(void)
 					fprintf(stderr, "Data object read failed: %s\n", sc_strerror(r));
 					if (r == SC_ERROR_FILE_NOT_FOUND)
 						continue; /* DEE emulation may say there is a file */
+					free(objs);
 					return 1;
 				}
 				sc_pkcs15_free_data_object(data_object);
@@ -562,6 +599,7 @@ static int list_data_objects(void)
 				fprintf(stderr, "Data object read failed: %s\n", sc_strerror(r));
 				if (r == SC_ERROR_FILE_NOT_FOUND)
 					 continue; /* DEE emulation may say there is a file */
+				free(objs);
 				return 1;
 			}
 			list_data_object("\tData", data_object->data, data_object->data_len);
@@ -572,7 +610,9 @@ static int list_data_objects(void)
 		}
 
 		printf("\n");
+		fflush(stdout);
 	}
+	free(objs);
 	return 0;
 }
 
@@ -667,9 +707,9 @@ static void print_prkey_info(const struct sc_pkcs15_object *obj)
 static int list_private_keys(void)
 {
 	int r, i;
-	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_object **objs = NULL;
 
-	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_PRKEY, objs, 32);
+	r = get_objects(SC_PKCS15_TYPE_PRKEY, &objs);
 	if (r < 0) {
 		fprintf(stderr, "Private key enumeration failed: %s\n", sc_strerror(r));
 		return 1;
@@ -681,7 +721,9 @@ static int list_private_keys(void)
 	for (i = 0; i < r; i++) {
 		print_prkey_info(objs[i]);
 		printf("\n");
+		fflush(stdout);
 	}
+	free(objs);
 	return 0;
 }
 
@@ -747,9 +789,9 @@ static void print_pubkey_info(const struct sc_pkcs15_object *obj)
 static int list_public_keys(void)
 {
 	int r, i;
-	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_object **objs = NULL;
 
-	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_PUBKEY, objs, 32);
+	r = get_objects(SC_PKCS15_TYPE_PUBKEY, &objs);
 	if (r < 0) {
 		fprintf(stderr, "Public key enumeration failed: %s\n", sc_strerror(r));
 		return 1;
@@ -761,7 +803,9 @@ static int list_public_keys(void)
 	for (i = 0; i < r; i++) {
 		print_pubkey_info(objs[i]);
 		printf("\n");
+		fflush(stdout);
 	}
+	free(objs);
 	return 0;
 }
 
@@ -868,9 +912,9 @@ static void print_skey_info(const struct sc_pkcs15_object *obj)
 static int list_skeys(void)
 {
 	int r, i;
-	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_object **objs = NULL;
 
-	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_SKEY, objs, 32);
+	r = get_objects(SC_PKCS15_TYPE_SKEY, &objs);
 	if (r < 0) {
 		fprintf(stderr, "Secret key enumeration failed: %s\n", sc_strerror(r));
 		return 1;
@@ -880,8 +924,10 @@ static int list_skeys(void)
 	for (i = 0; i < r; i++) {
 		print_skey_info(objs[i]);
 		printf("\n");
+		fflush(stdout);
 	}
 
+	free(objs);
 	return 0;
 }
 
@@ -1350,6 +1396,22 @@ static int clear_cache(void)
 }
 #endif
 
+static int prefetch_cache(void)
+{
+	int r;
+
+	r = sc_pkcs15_prefetch_cache(p15card);
+	if (r < 0) {
+		fprintf(stderr, "Failed to fill the cache: %s\n", sc_strerror(r));
+		if (r == SC_ERROR_NOT_SUPPORTED)
+			fprintf(stderr, "Enable 'use_file_caching' in the pkcs15 framework configuration.\n");
+		return 1;
+	}
+	if (verbose)
+		printf("%d objects read into the cache\n", r);
+	return 0;
+}
+
 
 static int verify_pin(void)
 {
@@ -1599,9 +1661,9 @@ static void print_pin_info(const struct sc_pkcs15_object *obj)
 static int list_pins(void)
 {
 	int r, i;
-	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_object **objs = NULL;
 
-	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_AUTH, objs, 32);
+	r = get_objects(SC_PKCS15_TYPE_AUTH, &objs);
 	if (r < 0) {
 		fprintf(stderr, "AUTH objects enumeration failed: %s\n", sc_strerror(r));
 		return 1;
@@ -1614,7 +1676,9 @@ static int list_pins(void)
 	for (i = 0; i < r; i++) {
 		print_pin_info(objs[i]);
 		printf("\n");
+		fflush(stdout);
 	}
+	free(objs);
 	return 0;
 }
 
@@ -1679,6 +1743,24 @@ static void list_info(void)
 
 static int dump(void)
 {
+	struct sc_pkcs15_search_key sk;
+	int r;
+
+	/* enumerate the objects of all classes once, for all the lists below */
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY
+		| SC_PKCS15_SEARCH_CLASS_SKEY | SC_PKCS15_SEARCH_CLASS_CERT
+		| SC_PKCS15_SEARCH_CLASS_DATA | SC_PKCS15_SEARCH_CLASS_AUTH;
+	r = sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+	if (r > 0 && (dump_objs = calloc(r, sizeof *dump_objs)) != NULL)
+		dump_count = sc_pkcs15_search_objects(p15card, &sk, dump_objs, r);
+	if (dump_count <= 0) {
+		/* let each list enumerate its objects */
+		free(dump_objs);
+		dump_objs = NULL;
+		dump_count = 0;
+	}
+
 	list_info();
 	list_pins();
 	list_private_keys();
@@ -1687,6 +1769,9 @@ static int dump(void)
 	list_certificates();
 	list_data_objects();
 
+	free(dump_objs);
+	dump_objs = NULL;
+	dump_count = 0;
 	return 0;
 }
 
@@ -2122,6 +2207,7 @@ int main(int argc, char *argv[])
 	int do_update = 0;
 	int do_print_version = 0;
 	int do_list_info = 0;
+	int do_prefetch_cache = 0;
 	int action_count = 0;
 	sc_context_param_t ctx_param;
 
@@ -2260,6 +2346,10 @@ int main(int argc, char *argv[])
 			opt_clear_cache = 1;
 			action_count++;
 			break;
+		case OPT_PREFETCH_CACHE:
+			do_prefetch_cache = 1;
+			action_count++;
+			break;
 		case 'w':
 			opt_wait = 1;
 			break;
@@ -2342,6 +2432,12 @@ int main(int argc, char *argv[])
 		if ((err = verify_pin()))
 			goto end;
 
+	if (do_prefetch_cache) {
+		if ((err = prefetch_cache()))
+			goto end;
+		action_count--;
+	}
+
 	if (do_list_certs) {
 		if ((err = list_certificates()))
 			goto end;
@@ -74,7 +74,9 @@ enum {
 	OPT_RETRY,
 	OPT_PASSWORD,
 	OPT_PASSWORD_SHARES_THRESHOLD,
-	OPT_PASSWORD_SHARES_TOTAL
+	OPT_PASSWORD_SHARES_TOTAL,
+	OPT_WRAP_KEYS,
+	OPT_UNWRAP_KEYS
 };
 
 static const struct option options[] = {
@@ -86,6 +88,8 @@ static const struct option options[] = {
 #endif
 	{ "wrap-key",				1, NULL,		'W' },
 	{ "unwrap-key",				1, NULL,		'U' },
+	{ "wrap-keys",				1, NULL,		OPT_WRAP_KEYS },
+	{ "unwrap-keys",			1, NULL,		OPT_UNWRAP_KEYS },
 	{ "dkek-shares",			1, NULL,		's' },
 	{ "so-pin",					1, NULL,		OPT_SO_PIN },
 	{ "pin",					1, NULL,		OPT_PIN },
@@ -111,6 +115,8 @@ static const char *option_help[] = {
 #endif
 	"Wrap key and save to <filename>",
 	"Unwrap key read from <filename>",
+	"Wrap all keys and save to archive <filename>",
+	"Unwrap all keys read from archive <filename>",
 	"Number of DKEK shares [No DKEK]",
 	"Define security officer PIN (SO-PIN)",
 	"Define user PIN",
@@ -1272,32 +1278,11 @@ static int wrap_with_tag(u8 tag, u8 *indata, size_t inlen, u8 **outdata, size_t
 
 
 
-static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pin)
+static int verify_user_pin(sc_card_t *card, const char *pin)
 {
-	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
 	struct sc_pin_cmd_data data;
-	sc_path_t path;
-	FILE *out = NULL;
-	u8 fid[2];
-	u8 ef_prkd[MAX_PRKD];
-	u8 ef_cert[MAX_CERT];
-	u8 wrapped_key_buff[MAX_KEY];
-	u8 keyblob[MAX_WRAPPED_KEY];
-	u8 *key;
-	u8 *ptr;
 	char *lpin = NULL;
-	size_t key_len;
-	int r, ef_prkd_len, ef_cert_len;
-
-	if ((keyid < 1) || (keyid > 255)) {
-		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
-		return -1;
-	}
-
-	if (outf == NULL) {
-		fprintf(stderr, "No file name specified for wrapped key\n");
-		return -1;
-	}
+	int r;
 
 	if (pin == NULL) {
 		printf("Enter User PIN : ");
@@ -1316,14 +1301,40 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 
 	r = sc_pin_cmd(card, &data, NULL);
 
+	if (pin == NULL) {
+		free(lpin);
+	}
+
 	if (r < 0) {
 		fprintf(stderr, "PIN verification failed with %s\n", sc_strerror(r));
 		return -1;
 	}
+	return 0;
+}
+
 
-	if (pin == NULL) {
-		free(lpin);
-	}
+
+/**
+ * Export a key wrapped with the DKEK together with its key description and certificate
+ *
+ * @param card the card, with the user PIN verified
+ * @param keyid the key reference
+ * @param blob pointer to the allocated wrapped key object
+ * @param bloblen the size of the wrapped key object
+ */
+static int wrap_key_blob(sc_card_t *card, int keyid, u8 **blob, size_t *bloblen)
+{
+	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+	sc_path_t path;
+	u8 fid[2];
+	u8 ef_prkd[MAX_PRKD];
+	u8 ef_cert[MAX_CERT];
+	u8 wrapped_key_buff[MAX_KEY];
+	u8 keyblob[MAX_WRAPPED_KEY];
+	u8 *key;
+	u8 *ptr;
+	size_t key_len;
+	int r, ef_prkd_len, ef_cert_len;
 
 	wrapped_key.key_id = keyid;
 	wrapped_key.wrapped_key = wrapped_key_buff;
@@ -1408,8 +1419,34 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 	}
 
 	// Encode key, key decription and certificate object in sequence
-	r = wrap_with_tag(0x30, keyblob, ptr - keyblob, &key, &key_len);
+	r = wrap_with_tag(0x30, keyblob, ptr - keyblob, blob, bloblen);
 	LOG_TEST_RET(ctx, r, "Out of memory");
+	return 0;
+}
+
+
+
+static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pin)
+{
+	FILE *out = NULL;
+	u8 *key;
+	size_t key_len;
+
+	if ((keyid < 1) || (keyid > 255)) {
+		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
+		return -1;
+	}
+
+	if (outf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped key\n");
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin))
+		return -1;
+
+	if (wrap_key_blob(card, keyid, &key, &key_len))
+		return -1;
 
 	out = fopen(outf, "wb");
 
@@ -1433,6 +1470,103 @@ static int wrap_key(sc_card_t *card, int keyid, const char *outf, const char *pi
 
 
 
+/**
+ * Wrap all keys of the device into an archive
+ *
+ * The archive is a sequence of entries SEQUENCE { INTEGER keyReference, wrappedKey },
+ * where wrappedKey is the object written by --wrap-key. The PIN is verified once
+ * and the card is locked for the whole run.
+ *
+ * @param card the card
+ * @param outf the name of the archive
+ * @param pin the user PIN or NULL to prompt for it
+ */
+static int wrap_keys(sc_card_t *card, const char *outf, const char *pin)
+{
+	FILE *out = NULL;
+	u8 fids[MAX_EXT_APDU_LENGTH];
+	u8 *key, *entry, *ptr;
+	size_t key_len, entry_len;
+	int r, i, nfids, count = 0, failed = 0;
+
+	if (outf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped keys\n");
+		return -1;
+	}
+
+	nfids = sc_list_files(card, fids, sizeof(fids));
+	if (nfids < 0) {
+		fprintf(stderr, "Enumerating keys failed with %s\n", sc_strerror(nfids));
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin))
+		return -1;
+
+	out = fopen(outf, "wb");
+
+	if (out == NULL) {
+		perror(outf);
+		return -1;
+	}
+
+	sc_lock(card);
+	for (i = 0; i + 1 < nfids; i += 2) {
+		/* key reference 0 is the device key, which can not be wrapped */
+		if ((fids[i] != KEY_PREFIX) || (fids[i + 1] == 0)) {
+			continue;
+		}
+
+		if (wrap_key_blob(card, fids[i + 1], &key, &key_len)) {
+			fprintf(stderr, "Wrapping key %d failed\n", fids[i + 1]);
+			failed++;
+			continue;
+		}
+
+		// Prefix the wrapped key with its key reference
+		entry = malloc(key_len + 3);
+		if (entry == NULL) {
+			free(key);
+			failed++;
+			break;
+		}
+		entry[0] = 0x02;
+		entry[1] = 0x01;
+		entry[2] = fids[i + 1];
+		memcpy(entry + 3, key, key_len);
+		free(key);
+
+		r = wrap_with_tag(0x30, entry, key_len + 3, &ptr, &entry_len);
+		free(entry);
+		if (r < 0) {
+			failed++;
+			break;
+		}
+
+		if (fwrite(ptr, 1, entry_len, out) != entry_len) {
+			perror(outf);
+			free(ptr);
+			failed++;
+			break;
+		}
+		free(ptr);
+
+		printf("Key %d wrapped\n", fids[i + 1]);
+		count++;
+	}
+	sc_unlock(card);
+
+	if (fclose(out) != 0) {
+		perror(outf);
+		failed++;
+	}
+
+	printf("%d key(s) written to %s\n", count, outf);
+	return failed ? -1 : 0;
+}
+
+
+
 static int update_ef(sc_card_t *card, u8 prefix, u8 id, int erase, const u8 *buf, size_t buflen)
 {
 	sc_file_t *file = NULL;
@@ -1472,43 +1606,16 @@ static int update_ef(sc_card_t *card, u8 prefix, u8 id, int erase, const u8 *buf
 
 
 
-static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *pin, int force)
+/**
+ * Split a wrapped key object into the key blob, key description and certificate
+ */
+static int parse_wrapped_key(const u8 *keyblob, size_t keybloblen,
+		sc_cardctl_sc_hsm_wrapped_key_t *wrapped_key,
+		const u8 **prkd, size_t *prkd_len, const u8 **cert, size_t *cert_len)
 {
-	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
-	struct sc_pin_cmd_data data;
-	u8 keyblob[MAX_WRAPPED_KEY];
-	const u8 *ptr,*prkd,*cert;
-	FILE *in = NULL;
-	sc_path_t path;
-	u8 fid[2];
-	char *lpin = NULL;
+	const u8 *ptr;
 	unsigned int cla, tag;
-	int r, keybloblen;
-	size_t len, olen, prkd_len, cert_len;
-
-	if ((keyid < 1) || (keyid > 255)) {
-		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
-		return -1;
-	}
-
-	if (inf == NULL) {
-		fprintf(stderr, "No file name specified for wrapped key\n");
-		return -1;
-	}
-
-	in = fopen(inf, "rb");
-
-	if (in == NULL) {
-		perror(inf);
-		return -1;
-	}
-
-	if ((keybloblen = fread(keyblob, 1, sizeof(keyblob), in)) < 0) {
-		perror(inf);
-		return -1;
-	}
-
-	fclose(in);
+	size_t len, olen;
 
 	ptr = keyblob;
 	if ((sc_asn1_read_tag(&ptr, keybloblen, &cla, &tag, &len) != SC_SUCCESS)
@@ -1525,27 +1632,31 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		return -1;
 	}
 
-	wrapped_key.wrapped_key = (u8 *)ptr;
-	wrapped_key.wrapped_key_length = olen;
+	wrapped_key->wrapped_key = (u8 *)ptr;
+	wrapped_key->wrapped_key_length = olen;
 
 	ptr += olen;
-	prkd = ptr;
-	prkd_len = determineLength(ptr, keybloblen - (ptr - keyblob));
+	*prkd = ptr;
+	*prkd_len = determineLength(ptr, keybloblen - (ptr - keyblob));
 
-	ptr += prkd_len;
-	cert = ptr;
-	cert_len = determineLength(ptr, keybloblen - (ptr - keyblob));
+	ptr += *prkd_len;
+	*cert = ptr;
+	*cert_len = determineLength(ptr, keybloblen - (ptr - keyblob));
+	return 0;
+}
 
-	printf("Wrapped key contains:\n");
-	printf("  Key blob\n");
-	if (prkd_len > 0) {
-		printf("  Private Key Description (PRKD)\n");
-	}
-	if (cert_len > 0) {
-		printf("  Certificate\n");
-	}
 
-	if ((prkd_len > 0) && !force) {
+
+/**
+ * Check that no key description or certificate is in the way of an unwrapped key
+ */
+static int check_key_reference_unused(sc_card_t *card, int keyid, size_t prkd_len, size_t cert_len)
+{
+	sc_path_t path;
+	u8 fid[2];
+	int r;
+
+	if (prkd_len > 0) {
 		fid[0] = PRKD_PREFIX;
 		fid[1] = (unsigned char)keyid;
 
@@ -1559,7 +1670,7 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		}
 	}
 
-	if ((cert_len > 0) && !force) {
+	if (cert_len > 0) {
 		fid[0] = EE_CERTIFICATE_PREFIX;
 		fid[1] = (unsigned char)keyid;
 
@@ -1572,32 +1683,20 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 			return -1;
 		}
 	}
+	return 0;
+}
 
-	if (pin == NULL) {
-		printf("Enter User PIN : ");
-		util_getpass(&lpin, NULL, stdin);
-		printf("\n");
-	} else {
-		lpin = (char *)pin;
-	}
-
-	memset(&data, 0, sizeof(data));
-	data.cmd = SC_PIN_CMD_VERIFY;
-	data.pin_type = SC_AC_CHV;
-	data.pin_reference = ID_USER_PIN;
-	data.pin1.data = (u8 *)lpin;
-	data.pin1.len = strlen(lpin);
-
-	r = sc_pin_cmd(card, &data, NULL);
 
-	if (r < 0) {
-		fprintf(stderr, "PIN verification failed with %s\n", sc_strerror(r));
-		return -1;
-	}
 
-	if (pin == NULL) {
-		free(lpin);
-	}
+/**
+ * Import a key wrapped with the DKEK and write its key description and certificate
+ */
+static int import_wrapped_key(sc_card_t *card, int keyid, sc_cardctl_sc_hsm_wrapped_key_t *wrapped_key,
+		const u8 *prkd, size_t prkd_len, const u8 *cert, size_t cert_len, int force)
+{
+	sc_path_t path;
+	u8 fid[2];
+	int r;
 
 	if (force) {
 		fid[0] = KEY_PREFIX;
@@ -1607,9 +1706,9 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		sc_delete_file(card, &path);
 	}
 
-	wrapped_key.key_id = keyid;
+	wrapped_key->key_id = keyid;
 
-	r = sc_card_ctl(card, SC_CARDCTL_SC_HSM_UNWRAP_KEY, (void *)&wrapped_key);
+	r = sc_card_ctl(card, SC_CARDCTL_SC_HSM_UNWRAP_KEY, (void *)wrapped_key);
 
 	if (r == SC_ERROR_INS_NOT_SUPPORTED) {			// Not supported or not initialized for key shares
 		fprintf(stderr, "Card not initialized for key wrap\n");
@@ -1643,6 +1742,64 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 			return -1;
 		}
 	}
+	return 0;
+}
+
+
+
+static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *pin, int force)
+{
+	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+	u8 keyblob[MAX_WRAPPED_KEY];
+	const u8 *prkd,*cert;
+	FILE *in = NULL;
+	int keybloblen;
+	size_t prkd_len, cert_len;
+
+	if ((keyid < 1) || (keyid > 255)) {
+		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
+		return -1;
+	}
+
+	if (inf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped key\n");
+		return -1;
+	}
+
+	in = fopen(inf, "rb");
+
+	if (in == NULL) {
+		perror(inf);
+		return -1;
+	}
+
+	if ((keybloblen = fread(keyblob, 1, sizeof(keyblob), in)) < 0) {
+		perror(inf);
+		return -1;
+	}
+
+	fclose(in);
+
+	if (parse_wrapped_key(keyblob, keybloblen, &wrapped_key, &prkd, &prkd_len, &cert, &cert_len))
+		return -1;
+
+	printf("Wrapped key contains:\n");
+	printf("  Key blob\n");
+	if (prkd_len > 0) {
+		printf("  Private Key Description (PRKD)\n");
+	}
+	if (cert_len > 0) {
+		printf("  Certificate\n");
+	}
+
+	if (!force && check_key_reference_unused(card, keyid, prkd_len, cert_len))
+		return -1;
+
+	if (verify_user_pin(card, pin))
+		return -1;
+
+	if (import_wrapped_key(card, keyid, &wrapped_key, prkd, prkd_len, cert, cert_len, force))
+		return -1;
 
 	printf("Key successfully imported\n");
 	return 0;
@@ -1650,6 +1807,132 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 
 
 
+/**
+ * Import all keys of an archive written by --wrap-keys under their key references
+ *
+ * All entries are parsed, and unless forced checked for existing objects, before
+ * the PIN is verified and the first key is imported. The card is locked for the
+ * whole run.
+ *
+ * @param card the card
+ * @param inf the name of the archive
+ * @param pin the user PIN or NULL to prompt for it
+ * @param force remove existing keys, key descriptions and certificates
+ */
+static int unwrap_keys(sc_card_t *card, const char *inf, const char *pin, int force)
+{
+	FILE *in = NULL;
+	u8 *archive = NULL, *p;
+	const u8 *ptr, *end;
+	size_t archive_len = 0, archive_size = 0, n;
+	unsigned int cla, tag;
+	size_t len;
+	int pass, count = 0, failed = 0;
+
+	if (inf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped keys\n");
+		return -1;
+	}
+
+	in = fopen(inf, "rb");
+
+	if (in == NULL) {
+		perror(inf);
+		return -1;
+	}
+
+	do {
+		if (archive_size - archive_len < MAX_WRAPPED_KEY) {
+			archive_size += 16 * MAX_WRAPPED_KEY;
+			p = realloc(archive, archive_size);
+			if (p == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				free(archive);
+				fclose(in);
+				return -1;
+			}
+			archive = p;
+		}
+		n = fread(archive + archive_len, 1, archive_size - archive_len, in);
+		archive_len += n;
+	} while (n > 0);
+
+	if (ferror(in)) {
+		perror(inf);
+		free(archive);
+		fclose(in);
+		return -1;
+	}
+	fclose(in);
+
+	/* first check all entries, then import them */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			if (verify_user_pin(card, pin)) {
+				free(archive);
+				return -1;
+			}
+			sc_lock(card);
+		}
+
+		ptr = archive;
+		end = archive + archive_len;
+		while (ptr < end) {
+			sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+			const u8 *prkd, *cert, *entry;
+			size_t prkd_len, cert_len;
+			int keyid;
+
+			if ((sc_asn1_read_tag(&ptr, end - ptr, &cla, &tag, &len) != SC_SUCCESS)
+					|| (ptr == NULL)
+					|| ((cla & SC_ASN1_TAG_CONSTRUCTED) != SC_ASN1_TAG_CONSTRUCTED)
+					|| (tag != SC_ASN1_TAG_SEQUENCE)
+					|| (len < 3) || (ptr[0] != 0x02) || (ptr[1] != 0x01)) {
+				fprintf(stderr, "Invalid wrapped key archive format at offset %lu.\n",
+						(unsigned long)(ptr ? ptr - archive : archive_len));
+				failed++;
+				break;
+			}
+			entry = ptr;
+			ptr += len;
+			keyid = entry[2];
+
+			if ((keyid < 1)
+					|| parse_wrapped_key(entry + 3, len - 3, &wrapped_key, &prkd, &prkd_len, &cert, &cert_len)) {
+				fprintf(stderr, "Invalid entry for key %d\n", keyid);
+				failed++;
+				break;
+			}
+
+			if (pass == 0) {
+				if (!force && check_key_reference_unused(card, keyid, prkd_len, cert_len))
+					failed++;
+				continue;
+			}
+
+			if (import_wrapped_key(card, keyid, &wrapped_key, prkd, prkd_len, cert, cert_len, force)) {
+				fprintf(stderr, "Importing key %d failed\n", keyid);
+				failed++;
+				continue;
+			}
+			printf("Key %d imported\n", keyid);
+			count++;
+		}
+
+		if (pass == 0 && failed) {
+			free(archive);
+			return -1;
+		}
+	}
+	sc_unlock(card);
+
+	free(archive);
+	printf("%d key(s) imported from %s\n", count, inf);
+	return failed ? -1 : 0;
+}
+
+
+
 int main(int argc, char *argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -1660,6 +1943,8 @@ int main(int argc, char *argv[])
 	int do_create_dkek_share = 0;
 	int do_wrap_key = 0;
 	int do_unwrap_key = 0;
+	int do_wrap_keys = 0;
+	int do_unwrap_keys = 0;
 	sc_path_t path;
 	sc_file_t *file = NULL;
 	const char *opt_so_pin = NULL;
@@ -1714,6 +1999,16 @@ int main(int argc, char *argv[])
 			opt_filename = optarg;
 			action_count++;
 			break;
+		case OPT_WRAP_KEYS:
+			do_wrap_keys = 1;
+			opt_filename = optarg;
+			action_count++;
+			break;
+		case OPT_UNWRAP_KEYS:
+			do_unwrap_keys = 1;
+			opt_filename = optarg;
+			action_count++;
+			break;
 		case OPT_PASSWORD:
 			util_get_pin(optarg, &opt_password);
 			break;
@@ -1816,6 +2111,12 @@ int main(int argc, char *argv[])
 	if (do_unwrap_key && unwrap_key(card, opt_key_reference, opt_filename, opt_pin, opt_force))
 		goto fail;
 
+	if (do_wrap_keys && wrap_keys(card, opt_filename, opt_pin))
+		goto fail;
+
+	if (do_unwrap_keys && unwrap_keys(card, opt_filename, opt_pin, opt_force))
+		goto fail;
+
 	if (action_count == 0) {
 		print_info(card, file);
 	}
@@ -24,6 +24,14 @@
 
 #include "notify.h"
 
+#if defined(ENABLE_NOTIFY) && !defined(_WIN32) && (defined(__APPLE__) || defined(ENABLE_GIO2))
+/* The notifications are handed to the backend by notify_send(), which
+ * delivers them in a worker thread where available */
+#define NOTIFY_BACKEND
+static void notify_send(const char *title, const char *text, const char *icon,
+		const char *group);
+#endif
+
 #if defined(ENABLE_NOTIFY) && (defined(__APPLE__))
 
 #include "libopensc/internal.h"
@@ -36,11 +44,11 @@
 
 static pid_t child = -1;
 
-void sc_notify_init(void)
+static void notify_backend_init(void)
 {
 }
 
-void sc_notify_close(void)
+static void notify_backend_close(void)
 {
 	if (child > 0) {
 		int i, status;
@@ -330,17 +338,6 @@ static void notify_proxy(struct sc_context *ctx,
 	 * we're including NotificationProxy which has similar features */
 	const char notificationproxy[] = "/Library/Security/tokend/OpenSC.tokend/Contents/Resources/Applications/NotificationProxy.app/Contents/MacOS/NotificationProxy";
 
-	if (ctx && ctx->app_name
-			&& (0 == strcmp(ctx->app_name, "opensc-pkcs11")
-				|| 0 == strcmp(ctx->app_name, "onepin-opensc-pkcs11"))) {
-		/* some programs don't like forking when loading our PKCS#11 module,
-		 * see https://github.com/OpenSC/OpenSC/issues/1174.
-		 * TODO implementing an XPC service which sends the notification should
-		 * work, though. See
-		 * https://github.com/OpenSC/OpenSC/issues/1304#issuecomment-376656003 */
-		return;
-	}
-
 	if (child > 0) {
 		int status;
 		if (0 == waitpid(child, &status, WNOHANG)) {
@@ -395,15 +392,33 @@ static void notify_proxy(struct sc_context *ctx,
 	}
 }
 
+static void notify_backend_send(const char *title, const char *text,
+		const char *icon, const char *group)
+{
+	notify_proxy(NULL, title, NULL, text, icon, NULL, group);
+}
+
 void sc_notify(const char *title, const char *text)
 {
-	notify_proxy(NULL, title, NULL, text, NULL, NULL, NULL);
+	notify_send(title, text, NULL, NULL);
 }
 
 void sc_notify_id(struct sc_context *ctx, struct sc_atr *atr,
 		struct sc_pkcs15_card *p15card, enum ui_str id)
 {
 	const char *title, *text, *icon, *group;
+
+	if (ctx && ctx->app_name
+			&& (0 == strcmp(ctx->app_name, "opensc-pkcs11")
+				|| 0 == strcmp(ctx->app_name, "onepin-opensc-pkcs11"))) {
+		/* some programs don't like forking when loading our PKCS#11 module,
+		 * see https://github.com/OpenSC/OpenSC/issues/1174.
+		 * TODO implementing an XPC service which sends the notification should
+		 * work, though. See
+		 * https://github.com/OpenSC/OpenSC/issues/1304#issuecomment-376656003 */
+		return;
+	}
+
 	title = ui_get_str(ctx, atr, p15card, id);
 	text = ui_get_str(ctx, atr, p15card, id+1);
 
@@ -431,7 +446,7 @@ void sc_notify_id(struct sc_context *ctx, struct sc_atr *atr,
 			break;
 	}
 
-	notify_proxy(ctx, title, NULL, text, icon, NULL, group);
+	notify_send(title, text, icon, group);
 }
 
 #elif defined(ENABLE_NOTIFY) && defined(ENABLE_GIO2)
@@ -440,26 +455,25 @@ void sc_notify_id(struct sc_context *ctx, struct sc_atr *atr,
 
 static GApplication *application = NULL;
 
-void sc_notify_init(void)
+static void notify_backend_close(void)
 {
-	sc_notify_close();
-	application = g_application_new("org.opensc.notify", G_APPLICATION_NON_UNIQUE);
 	if (application) {
-		g_application_register(application, NULL, NULL);
+		g_object_unref(application);
+		application = NULL;
 	}
 }
 
-void sc_notify_close(void)
+static void notify_backend_init(void)
 {
+	notify_backend_close();
+	application = g_application_new("org.opensc.notify", G_APPLICATION_NON_UNIQUE);
 	if (application) {
-		g_object_unref(application);
-		application = NULL;
+		g_application_register(application, NULL, NULL);
 	}
 }
 
-static void notify_gio(struct sc_context *ctx,
-		const char *title, const char *text, const char *icon,
-		const char *group)
+static void notify_backend_send(const char *title, const char *text,
+		const char *icon, const char *group)
 {
 	if (application
 			&& g_application_get_is_registered(application)
@@ -502,7 +516,7 @@ void sc_notify_id(struct sc_context *ctx, struct sc_atr *atr,
 #if defined(ENABLE_NOTIFY) && defined(ENABLE_GIO2)
 void sc_notify(const char *title, const char *text)
 {
-	notify_gio(NULL, title, text, NULL, NULL);
+	notify_send(title, text, NULL, NULL);
 }
 
 void sc_notify_id(struct sc_context *ctx, struct sc_atr *atr,
@@ -536,7 +550,180 @@ void sc_notify_id(struct sc_context *ctx, struct sc_atr *atr,
 			break;
 	}
 
-	notify_gio(ctx, title, text, icon, group);
+	notify_send(title, text, icon, group);
 }
 
 #endif
+
+#ifdef NOTIFY_BACKEND
+#ifdef HAVE_PTHREAD
+/*
+ * The desktop backends may fork a helper or talk to D-Bus, which must not
+ * hold up the caller, e.g. the PKCS#11 module binding a card. The messages
+ * are queued and delivered by a worker thread, which also registers with the
+ * backend. A message is dropped if the queue is full.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NOTIFY_QUEUE_SIZE 8
+
+struct notify_message {
+	char *title, *text, *icon, *group;
+};
+
+static pthread_mutex_t notify_mutex;
+static pthread_cond_t notify_cond;
+static pthread_t notify_thread;
+static pid_t notify_pid;
+static int notify_running = 0;
+static int notify_stop = 0;
+static struct notify_message notify_queue[NOTIFY_QUEUE_SIZE];
+static unsigned int notify_head = 0, notify_count = 0;
+
+static void notify_message_free(struct notify_message *msg)
+{
+	free(msg->title);
+	free(msg->text);
+	free(msg->icon);
+	free(msg->group);
+	memset(msg, 0, sizeof *msg);
+}
+
+static void notify_queue_clear(void)
+{
+	while (notify_count) {
+		notify_message_free(&notify_queue[notify_head]);
+		notify_head = (notify_head + 1) % NOTIFY_QUEUE_SIZE;
+		notify_count--;
+	}
+	notify_head = 0;
+}
+
+static void *notify_worker(void *arg)
+{
+	struct notify_message msg;
+
+	notify_backend_init();
+
+	pthread_mutex_lock(&notify_mutex);
+	for (;;) {
+		while (notify_count == 0 && !notify_stop)
+			pthread_cond_wait(&notify_cond, &notify_mutex);
+		/* the queued messages are delivered before stopping */
+		if (notify_count == 0)
+			break;
+		msg = notify_queue[notify_head];
+		memset(&notify_queue[notify_head], 0, sizeof msg);
+		notify_head = (notify_head + 1) % NOTIFY_QUEUE_SIZE;
+		notify_count--;
+		pthread_mutex_unlock(&notify_mutex);
+
+		notify_backend_send(msg.title, msg.text, msg.icon, msg.group);
+		notify_message_free(&msg);
+
+		pthread_mutex_lock(&notify_mutex);
+	}
+	pthread_mutex_unlock(&notify_mutex);
+
+	notify_backend_close();
+	return NULL;
+}
+
+void sc_notify_init(void)
+{
+	sc_notify_close();
+
+	notify_stop = 0;
+	pthread_mutex_init(&notify_mutex, NULL);
+	pthread_cond_init(&notify_cond, NULL);
+	if (0 == pthread_create(&notify_thread, NULL, notify_worker, NULL)) {
+		notify_pid = getpid();
+		notify_running = 1;
+	} else {
+		pthread_cond_destroy(&notify_cond);
+		pthread_mutex_destroy(&notify_mutex);
+		notify_backend_init();
+	}
+}
+
+void sc_notify_close(void)
+{
+	if (!notify_running) {
+		notify_backend_close();
+		return;
+	}
+	notify_running = 0;
+
+	if (notify_pid != getpid()) {
+		/* after fork() the worker and the backend belong to the parent */
+		notify_queue_clear();
+		return;
+	}
+
+	pthread_mutex_lock(&notify_mutex);
+	notify_stop = 1;
+	pthread_cond_signal(&notify_cond);
+	pthread_mutex_unlock(&notify_mutex);
+	pthread_join(notify_thread, NULL);
+	pthread_cond_destroy(&notify_cond);
+	pthread_mutex_destroy(&notify_mutex);
+	notify_queue_clear();
+}
+
+static char *notify_strdup(const char *str, int *failed)
+{
+	char *copy = NULL;
+
+	if (str && !(copy = strdup(str)))
+		*failed = 1;
+	return copy;
+}
+
+static void notify_send(const char *title, const char *text, const char *icon,
+		const char *group)
+{
+	struct notify_message *msg;
+	int failed = 0;
+
+	if (!notify_running || notify_pid != getpid()) {
+		notify_backend_send(title, text, icon, group);
+		return;
+	}
+
+	pthread_mutex_lock(&notify_mutex);
+	if (notify_count < NOTIFY_QUEUE_SIZE) {
+		msg = &notify_queue[(notify_head + notify_count) % NOTIFY_QUEUE_SIZE];
+		msg->title = notify_strdup(title, &failed);
+		msg->text = notify_strdup(text, &failed);
+		msg->icon = notify_strdup(icon, &failed);
+		msg->group = notify_strdup(group, &failed);
+		if (failed) {
+			notify_message_free(msg);
+		} else {
+			notify_count++;
+			pthread_cond_signal(&notify_cond);
+		}
+	}
+	pthread_mutex_unlock(&notify_mutex);
+}
+#else
+void sc_notify_init(void)
+{
+	notify_backend_init();
+}
+
+void sc_notify_close(void)
+{
+	notify_backend_close();
+}
+
+static void notify_send(const char *title, const char *text, const char *icon,
+		const char *group)
+{
+	notify_backend_send(title, text, icon, group);
+}
+#endif
+#endif